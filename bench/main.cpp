@@ -0,0 +1,532 @@
+/* firebird-bench runs a fixed set of small guest programs through the
+   interpreter and the JIT and tells how fast they ran, so that changes to
+   the core can be compared on the same host. The programs (kernels) run from
+   SDRAM on a blank flash, without an OS, until they get to their end. */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <errno.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "core/cpu.h"
+#include "core/debug.h"
+#include "core/emu.h"
+#include "core/flash.h"
+#include "core/mem.h"
+#include "core/mmu.h"
+#include "core/schedule.h"
+#include "core/translate.h"
+
+void gui_do_stuff(bool wait) {}
+void do_stuff(int i) {}
+
+void gui_debug_printf(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+
+	gui_debug_vprintf(fmt, ap);
+
+	va_end(ap);
+}
+
+// Only the errors, the results are on stdout
+void gui_debug_vprintf(const char *fmt, va_list ap)
+{
+	vfprintf(stderr, fmt, ap);
+}
+
+void gui_status_printf(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+
+	gui_debug_vprintf(fmt, ap);
+
+	va_end(ap);
+}
+
+void gui_perror(const char *msg)
+{
+	gui_debug_printf("%s: %s\n", msg, strerror(errno));
+}
+
+void gui_debugger_entered_or_left(bool entered) {}
+void gui_debugger_request_input(debug_input_cb callback) {}
+void gui_serial_write(const char *data, size_t size) {}
+int gui_getchar() { return -1; }
+void gui_set_busy(bool busy) {}
+void gui_show_speed(double d) {}
+void gui_usblink_changed(bool state) {}
+void gui_lcd_changed() {}
+void throttle_timer_off() {}
+void throttle_timer_on() {}
+void throttle_timer_wait(unsigned int usec)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(usec));
+}
+
+/* The kernels get the number of iterations in r0, with the other registers
+   zeroed, and end with a branch to itself at done, which has to be the first
+   instruction in its word. check then compares their results with the ones
+   computed here, so that a miscompiled kernel doesn't just look fast. */
+struct kernel {
+	const char *name;
+	bool thumb;
+	const void *code;
+	size_t size;
+	uint32_t done;
+	uint32_t iterations;
+	bool (*check)(uint32_t iterations);
+};
+
+static bool check_reg(int reg, uint32_t expected)
+{
+	if(arm.reg[reg] == expected)
+		return true;
+
+	fprintf(stderr, "r%d is %08x instead of %08x.\n", reg, arm.reg[reg], expected);
+	return false;
+}
+
+static uint32_t ror(uint32_t value, int shift)
+{
+	return value >> shift | value << (32 - shift);
+}
+
+static const uint32_t kernel_alu[] = {
+	0xe3a01001, // mov r1, #1
+	0xe3a02003, // mov r2, #3
+	0xe3a03000, // mov r3, #0
+	0xe0811002, // 1: add r1, r1, r2
+	0xe0222181, // eor r2, r2, r1, lsl #3
+	0xe0433001, // sub r3, r3, r1
+	0xe18222a3, // orr r2, r2, r3, lsr #5
+	0xe0040291, // mul r4, r1, r2
+	0xe09333e4, // adds r3, r3, r4, ror #7
+	0xe2a11011, // adc r1, r1, #0x11
+	0xe3c22a0f, // bic r2, r2, #0xF000
+	0xe2500001, // subs r0, r0, #1
+	0x1afffff5, // bne 1b
+	0xeafffffe, // done: b done
+};
+
+static bool check_alu(uint32_t iterations)
+{
+	uint32_t r1 = 1, r2 = 3, r3 = 0, r4 = 0;
+	for(uint32_t i = 0; i < iterations; i++)
+	{
+		r1 += r2;
+		r2 ^= r1 << 3;
+		r3 -= r1;
+		r2 |= r3 >> 5;
+		r4 = r1 * r2;
+		uint64_t sum = (uint64_t) r3 + ror(r4, 7);
+		r3 = sum;
+		r1 += 0x11 + (uint32_t)(sum >> 32);
+		r2 &= ~0xF000u;
+	}
+	return check_reg(1, r1) & check_reg(2, r2) & check_reg(3, r3) & check_reg(4, r4);
+}
+
+// 4 KiB with ldm/stm and 256 bytes with ldrb/strb per iteration, from the same source
+static const uint32_t kernel_memcpy[] = {
+	0xe3a05201, // mov r5, #0x10000000
+	0xe3855601, // orr r5, r5, #0x100000
+	0xe3a06201, // mov r6, #0x10000000
+	0xe3866602, // orr r6, r6, #0x200000
+	0xe1a07005, // 1: mov r7, r5
+	0xe1a08006, // mov r8, r6
+	0xe3a09080, // mov r9, #128
+	0xe8b75c1e, // 2: ldmia r7!, {r1-r4, r10-r12, lr}
+	0xe8a85c1e, // stmia r8!, {r1-r4, r10-r12, lr}
+	0xe2599001, // subs r9, r9, #1
+	0x1afffffb, // bne 2b
+	0xe3a09c01, // mov r9, #256
+	0xe4d71001, // 3: ldrb r1, [r7], #1
+	0xe4c81001, // strb r1, [r8], #1
+	0xe2599001, // subs r9, r9, #1
+	0x1afffffb, // bne 3b
+	0xe2500001, // subs r0, r0, #1
+	0x1afffff1, // bne 1b
+	0xeafffffe, // done: b done
+};
+
+static const uint32_t memcpy_src = 0x10100000, memcpy_dst = 0x10200000, memcpy_size = 128 * 32 + 256;
+
+static bool check_memcpy(uint32_t iterations)
+{
+	(void) iterations;
+	bool success = check_reg(7, memcpy_src + memcpy_size) & check_reg(8, memcpy_dst + memcpy_size) & check_reg(9, 0);
+	if(memcmp(phys_mem_ptr(memcpy_dst, memcpy_size), phys_mem_ptr(memcpy_src, memcpy_size), memcpy_size) != 0)
+	{
+		fprintf(stderr, "The copy differs from the source.\n");
+		success = false;
+	}
+	return success;
+}
+
+// Data dependent branches and calls, on a linear congruential generator
+static const uint32_t kernel_branch[] = {
+	0xe59f2044, // ldr r2, =1103515245
+	0xe59f3044, // ldr r3, =12345
+	0xe3a01001, // mov r1, #1
+	0xe3a04000, // mov r4, #0
+	0xe3a05000, // mov r5, #0
+	0xe0213291, // 1: mla r1, r1, r2, r3
+	0xe3110801, // tst r1, #0x10000
+	0x0a000001, // beq 2f
+	0xe2844001, // add r4, r4, #1
+	0xea000000, // b 3f
+	0xeb000009, // 2: bl func
+	0xe3110802, // 3: tst r1, #0x20000
+	0x12855001, // addne r5, r5, #1
+	0xe3510102, // cmp r1, #0x80000000
+	0x3a000000, // blo 4f
+	0xe0455004, // sub r5, r5, r4
+	0xe2500001, // 4: subs r0, r0, #1
+	0x1afffff2, // bne 1b
+	0xeafffffe, // done: b done
+	1103515245,
+	12345,
+	0xe0866001, // func: add r6, r6, r1
+	0xe12fff1e, // bx lr
+};
+
+static bool check_branch(uint32_t iterations)
+{
+	uint32_t r1 = 1, r4 = 0, r5 = 0, r6 = 0;
+	for(uint32_t i = 0; i < iterations; i++)
+	{
+		r1 = r1 * 1103515245 + 12345;
+		if(r1 & 0x10000)
+			r4++;
+		else
+			r6 += r1;
+		if(r1 & 0x20000)
+			r5++;
+		if(r1 >= 0x80000000)
+			r5 -= r4;
+	}
+	return check_reg(1, r1) & check_reg(4, r4) & check_reg(5, r5) & check_reg(6, r6);
+}
+
+/* Reads the inputs of the first GPIO port. Unlike the timers, this doesn't
+   skip the cycles to the next event, which polling loops usually wait for. */
+static const uint32_t kernel_mmio[] = {
+	0xe59f1014, // ldr r1, =0x90000018
+	0xe3a03000, // mov r3, #0
+	0xe5912000, // 1: ldr r2, [r1]
+	0xe0833002, // add r3, r3, r2
+	0xe2500001, // subs r0, r0, #1
+	0x1afffffb, // bne 1b
+	0xeafffffe, // done: b done
+	0x90000018,
+};
+
+// Nothing changes the inputs meanwhile, so the last read is like the others
+static bool check_mmio(uint32_t iterations)
+{
+	return check_reg(3, arm.reg[2] * iterations);
+}
+
+// Changes the immediate of the instruction at func before each call
+static const uint32_t kernel_smc[] = {
+	0xe28f1024, // adr r1, func
+	0xe5912000, // ldr r2, [r1]
+	0xe3a04000, // mov r4, #0
+	0xe20030ff, // 1: and r3, r0, #0xFF
+	0xe3c250ff, // bic r5, r2, #0xFF
+	0xe1855003, // orr r5, r5, r3
+	0xe5815000, // str r5, [r1]
+	0xeb000002, // bl func
+	0xe2500001, // subs r0, r0, #1
+	0x1afffff8, // bne 1b
+	0xeafffffe, // done: b done
+	0xe2844000, // func: add r4, r4, #0
+	0xe12fff1e, // bx lr
+};
+
+// Only right if the calls ran the changed instruction each time
+static bool check_smc(uint32_t iterations)
+{
+	uint32_t r4 = 0;
+	for(uint32_t i = iterations; i > 0; i--)
+		r4 += i & 0xFF;
+	return check_reg(4, r4);
+}
+
+static const uint16_t kernel_thumb[] = {
+	0x2101, // movs r1, #1
+	0x2203, // movs r2, #3
+	0x2300, // movs r3, #0
+	0x46c0, // nop, to align done
+	0x1889, // 1: adds r1, r1, r2
+	0x404a, // eors r2, r1
+	0x00cc, // lsls r4, r1, #3
+	0x1b1b, // subs r3, r3, r4
+	0x095c, // lsrs r4, r3, #5
+	0x4322, // orrs r2, r4
+	0x4354, // muls r4, r2
+	0x191b, // adds r3, r3, r4
+	0x1e40, // subs r0, r0, #1
+	0xd1f5, // bne 1b
+	0xe7fe, // done: b done
+};
+
+static bool check_thumb(uint32_t iterations)
+{
+	uint32_t r1 = 1, r2 = 3, r3 = 0, r4 = 0;
+	for(uint32_t i = 0; i < iterations; i++)
+	{
+		r1 += r2;
+		r2 ^= r1;
+		r4 = r1 << 3;
+		r3 -= r4;
+		r4 = r3 >> 5;
+		r2 |= r4;
+		r4 *= r2;
+		r3 += r4;
+	}
+	return check_reg(1, r1) & check_reg(2, r2) & check_reg(3, r3) & check_reg(4, r4);
+}
+
+static const kernel kernels[] = {
+	{ "alu", false, kernel_alu, sizeof(kernel_alu), 13 * 4, 2000000, check_alu },
+	{ "memcpy", false, kernel_memcpy, sizeof(kernel_memcpy), 18 * 4, 12000, check_memcpy },
+	{ "branch", false, kernel_branch, sizeof(kernel_branch), 18 * 4, 2000000, check_branch },
+	{ "mmio", false, kernel_mmio, sizeof(kernel_mmio), 6 * 4, 1000000, check_mmio },
+	{ "smc", false, kernel_smc, sizeof(kernel_smc), 10 * 4, 200000, check_smc },
+	{ "thumb", true, kernel_thumb, sizeof(kernel_thumb), 14 * 2, 2000000, check_thumb },
+};
+
+// Where the kernels run from, the start of the SDRAM
+static const uint32_t kernel_base = 0x10000000;
+
+// Way more than any of the kernels needs, in case one doesn't get to done
+static const uint64_t cycle_budget = 20000000000ull;
+
+struct bench_result {
+	uint64_t instructions;
+	double seconds;
+	uint64_t translations, translate_ns, addr_cache_misses;
+};
+
+static bool budget_reached;
+
+static void budget_event()
+{
+	budget_reached = exiting = true;
+}
+
+static bool run_kernel(const kernel &k, double scale, bool jit, bench_result *result)
+{
+	do_translate = jit;
+	if(!emu_start(0, 0, nullptr))
+		return false;
+
+	if(jit && !do_translate)
+	{
+		emu_cleanup();
+		return false;
+	}
+
+	memcpy(phys_mem_ptr(kernel_base, k.size), k.code, k.size);
+	// Something to copy for memcpy, which the other kernels don't touch
+	uint8_t *src = static_cast<uint8_t *>(phys_mem_ptr(memcpy_src, memcpy_size));
+	for(uint32_t i = 0; i < memcpy_size; i++)
+		src[i] = i * 7 + 1;
+
+	uint32_t iterations = std::max<uint32_t>(1, k.iterations * scale);
+	for(int i = 1; i < 15; i++)
+		arm.reg[i] = 0;
+	arm.reg[0] = iterations;
+	arm.reg[15] = kernel_base;
+	if(k.thumb)
+		arm.cpsr_low28 |= 0x20;
+
+	bool success = debug_set_stop_pc(kernel_base + k.done);
+	if(success)
+	{
+		budget_reached = false;
+		sched_set_host_event(SCHED_HOST_STOP, sched_cputick() + cycle_budget, budget_event);
+
+		translate_stats = {};
+		addr_cache_misses = 0;
+
+		auto start = std::chrono::steady_clock::now();
+		emu_loop(false);
+		result->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		result->instructions = translate_stats.jit_instructions + translate_stats.interpreted_instructions;
+		result->translations = translate_stats.translations;
+		result->translate_ns = translate_stats.translate_ns;
+		result->addr_cache_misses = addr_cache_misses;
+
+		success = !budget_reached && arm.reg[15] == kernel_base + k.done;
+		if(!success)
+			fprintf(stderr, "%s did not finish, stopped at %08x.\n", k.name, arm.reg[15]);
+		else if(!k.check(iterations))
+		{
+			fprintf(stderr, "%s got wrong results in the %s.\n", k.name, jit ? "JIT" : "interpreter");
+			success = false;
+		}
+	}
+
+	emu_cleanup();
+	return success;
+}
+
+// A blank flash of a classic model and a boot1 which isn't used, in dir
+static bool write_images(const std::string &dir, std::string *boot1, std::string *flash)
+{
+	*boot1 = dir + "/boot1.img";
+	*flash = dir + "/flash.img";
+
+	const uint32_t loop = 0xeafffffe; // b .
+	FILE *f = fopen(boot1->c_str(), "wb");
+	if(!f || fwrite(&loop, sizeof(loop), 1, f) != 1 || fclose(f) != 0)
+	{
+		perror(boot1->c_str());
+		return false;
+	}
+
+	const char *preload[4] = {};
+	uint8_t *nand_data;
+	size_t nand_size;
+	if(!flash_create_new(false, preload, 0x0E0, 0, false, &nand_data, &nand_size))
+	{
+		fprintf(stderr, "Could not create the flash.\n");
+		return false;
+	}
+
+	f = fopen(flash->c_str(), "wb");
+	bool success = f && fwrite(nand_data, nand_size, 1, f) == 1;
+	if(f && fclose(f) != 0)
+		success = false;
+	free(nand_data);
+
+	if(!success)
+		perror(flash->c_str());
+	return success;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [--kernel <name>] [--mode interpreter|jit] [--scale <factor>] [--json]\n"
+	                "Kernels:", name);
+	for(const kernel &k : kernels)
+		fprintf(stderr, " %s", k.name);
+	fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *only_kernel = nullptr, *only_mode = nullptr;
+	double scale = 1;
+	bool json = false;
+
+	for(int argi = 1; argi < argc; ++argi)
+	{
+		if(strcmp(argv[argi], "--kernel") == 0 && argi + 1 < argc)
+			only_kernel = argv[++argi];
+		else if(strcmp(argv[argi], "--mode") == 0 && argi + 1 < argc)
+			only_mode = argv[++argi];
+		else if(strcmp(argv[argi], "--scale") == 0 && argi + 1 < argc)
+			scale = strtod(argv[++argi], nullptr);
+		else if(strcmp(argv[argi], "--json") == 0)
+			json = true;
+		else
+		{
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	if(scale <= 0)
+	{
+		fprintf(stderr, "The scale has to be positive.\n");
+		return 2;
+	}
+
+	std::vector<const char *> modes = { "interpreter" };
+#ifndef NO_TRANSLATION
+	modes.push_back("jit");
+#endif
+
+	if(only_mode && std::find_if(modes.begin(), modes.end(), [&](const char *m) { return strcmp(m, only_mode) == 0; }) == modes.end())
+	{
+		fprintf(stderr, "Mode %s is not available.\n", only_mode);
+		return 2;
+	}
+
+	if(only_kernel && std::find_if(std::begin(kernels), std::end(kernels), [&](const kernel &k) { return strcmp(k.name, only_kernel) == 0; }) == std::end(kernels))
+	{
+		fprintf(stderr, "There is no kernel %s.\n", only_kernel);
+		usage(argv[0]);
+		return 2;
+	}
+
+	const char *tmpdir = getenv("TMPDIR");
+	std::string dir_pattern = std::string(tmpdir ? tmpdir : "/tmp") + "/firebird-bench-XXXXXX";
+	std::vector<char> dir_buf(dir_pattern.begin(), dir_pattern.end());
+	dir_buf.push_back(0);
+	if(!mkdtemp(dir_buf.data()))
+	{
+		perror("Could not create a temporary directory");
+		return 1;
+	}
+
+	std::string dir = dir_buf.data();
+	bool success = write_images(dir, &path_boot1, &path_flash);
+	turbo_mode = true;
+
+	if(success && !json)
+		printf("%-8s %-12s %10s %9s %8s %12s %10s\n", "kernel", "mode", "mips", "seconds", "blocks", "us/block", "misses/ki");
+
+	for(const kernel &k : kernels)
+	{
+		if(!success)
+			break;
+		if(only_kernel && strcmp(k.name, only_kernel) != 0)
+			continue;
+
+		for(const char *mode : modes)
+		{
+			if(only_mode && strcmp(mode, only_mode) != 0)
+				continue;
+
+			bench_result r;
+			if(!run_kernel(k, scale, strcmp(mode, "jit") == 0, &r))
+			{
+				success = false;
+				break;
+			}
+
+			double mips = r.instructions / r.seconds / 1e6,
+			       us_per_block = r.translations ? r.translate_ns / 1e3 / r.translations : 0,
+			       misses_per_ki = r.instructions ? r.addr_cache_misses * 1000.0 / r.instructions : 0;
+			if(json)
+				printf("{\"kernel\":\"%s\",\"mode\":\"%s\",\"instructions\":%llu,\"seconds\":%.6f,\"mips\":%.2f,"
+				       "\"translations\":%llu,\"translate_us_per_block\":%.3f,\"addr_cache_misses\":%llu,\"addr_cache_misses_per_ki\":%.4f}\n",
+				       k.name, mode, (unsigned long long) r.instructions, r.seconds, mips,
+				       (unsigned long long) r.translations, us_per_block, (unsigned long long) r.addr_cache_misses, misses_per_ki);
+			else
+				printf("%-8s %-12s %10.2f %9.3f %8llu %12.3f %10.4f\n", k.name, mode, mips, r.seconds,
+				       (unsigned long long) r.translations, us_per_block, misses_per_ki);
+			fflush(stdout);
+		}
+	}
+
+	unlink(path_boot1.c_str());
+	unlink(path_flash.c_str());
+	rmdir(dir.c_str());
+
+	return success ? 0 : 1;
+}
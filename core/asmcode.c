@@ -2,11 +2,26 @@
 #include "debug.h"
 #include "mmu.h"
 #include "mem.h"
+#include "translate.h"
 
 //TODO: Read breakpoints, alignment checks
 
+// The interpreter's part of the lockstep validation, see translation_run
+#ifdef TRANSLATE_VALIDATE
+    #define REPLAY_BAIL() do { if(unlikely(translation_replaying)) translation_replay_bail(); } while(0)
+    #define REPLAY_STORE(addr, entry, value, size) do { if(unlikely(translation_replaying)) translation_replay_store(addr, (void*) (entry), value, size); } while(0)
+#else
+    #define REPLAY_BAIL() do {} while(0)
+    #define REPLAY_STORE(addr, entry, value, size) do {} while(0)
+#endif
+
 #if defined(NO_TRANSLATION)
 void flush_translations() {}
+void flush_remapped_translations(uint32_t start, uint32_t last) { (void) start; (void) last; }
+void flush_translation_shortcuts() {}
+bool translate_write_fault(void *addr) { (void) addr; return false; }
+void invalidate_translation_at(void *ptr) { (void) ptr; }
+unsigned int translate_list(uint32_t *pcs, unsigned int max) { (void) pcs; (void) max; return 0; }
 #endif
 
 uint32_t FASTCALL read_word(uint32_t addr)
@@ -23,6 +38,7 @@ uint32_t FASTCALL read_word(uint32_t addr)
         }
         else //Physical address
         {
+            REPLAY_BAIL();
             entry &= ~AC_FLAGS;
             entry += addr;
             return mmio_read_word(entry);
@@ -48,6 +64,7 @@ uint32_t FASTCALL read_byte(uint32_t addr)
         }
         else //Physical address
         {
+            REPLAY_BAIL();
             entry &= ~AC_FLAGS;
             entry += addr;
             return mmio_read_byte(entry);
@@ -74,6 +91,7 @@ uint32_t FASTCALL read_half(uint32_t addr)
         }
         else //Physical address
         {
+            REPLAY_BAIL();
             entry &= ~AC_FLAGS;
             entry += addr;
             return mmio_read_half(entry);
@@ -99,6 +117,7 @@ void FASTCALL write_byte(uint32_t addr, uint32_t value)
         }
         else //Physical address
         {
+            REPLAY_BAIL();
             entry &= ~AC_FLAGS;
             entry += addr;
             return mmio_write_byte(entry, value);
@@ -107,6 +126,7 @@ void FASTCALL write_byte(uint32_t addr, uint32_t value)
 
     entry += addr;
 
+    REPLAY_STORE(addr, entry, value, 1);
     if(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION)
         write_action((void*) entry);
     *(uint8_t*)entry = value;
@@ -127,6 +147,7 @@ void FASTCALL write_half(uint32_t addr, uint32_t value)
         }
         else //Physical address
         {
+            REPLAY_BAIL();
             entry &= ~AC_FLAGS;
             entry += addr;
             return mmio_write_half(entry, value);
@@ -135,6 +156,7 @@ void FASTCALL write_half(uint32_t addr, uint32_t value)
 
     entry += addr;
 
+    REPLAY_STORE(addr, entry, value, 2);
     if(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION)
         write_action((void*) entry);
     *(uint16_t*)entry = value;
@@ -154,6 +176,7 @@ void FASTCALL write_word(uint32_t addr, uint32_t value)
         }
         else //Physical address
         {
+            REPLAY_BAIL();
             entry &= ~AC_FLAGS;
             entry += addr;
             return mmio_write_word(entry, value);
@@ -161,6 +184,7 @@ void FASTCALL write_word(uint32_t addr, uint32_t value)
     }
     entry += addr;
 
+    REPLAY_STORE(addr, entry, value, 4);
     if(RAM_FLAGS(entry & ~3) & DO_WRITE_ACTION)
         write_action((void*) entry);
     *(uint32_t*)entry = value;
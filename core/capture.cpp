@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "os/os.h"
+
+struct CaptureFrame {
+    std::array<uint16_t, 320 * 240> pixels; // From lcd_cx_draw_frame
+    uint64_t tick; // When it got shown
+};
+
+// Some slack for the writer, which has to be given all frames
+static const size_t max_queued_frames = 16;
+
+static std::mutex capture_mutex; // For everything up to the writer
+static std::condition_variable capture_cond; // Frames got queued or written
+static std::deque<std::unique_ptr<CaptureFrame>> queued_frames, spare_frames;
+static std::thread writer;
+static std::atomic<bool> active{false};
+static std::atomic<uint64_t> last_tick{0};
+static bool started = false, stopping = false, failed = false;
+static FILE *capture_file;
+static capture_format format;
+// Of the video, from the first frame
+static uint32_t clock_rate, frame_ticks;
+static uint64_t first_tick;
+
+// Only for the writer
+static std::unique_ptr<CaptureFrame> held; // The latest frame, repeated until the next one
+static std::vector<uint8_t> encoded; // held in the output format
+static uint64_t frames_written;
+
+static void capture_encode(const CaptureFrame &frame)
+{
+    if(format == CAPTURE_RAW)
+    {
+        encoded.resize(sizeof(frame.pixels));
+        memcpy(encoded.data(), frame.pixels.data(), sizeof(frame.pixels));
+        return;
+    }
+
+    // BT.601 in limited range, one plane each
+    const unsigned int pixels = 320 * 240;
+    encoded.resize(pixels * 3);
+    uint8_t *y = encoded.data(), *cb = y + pixels, *cr = cb + pixels;
+    for(unsigned int i = 0; i < pixels; ++i)
+    {
+        uint16_t pix = frame.pixels[i];
+        int r = (pix >> 11) << 3 | pix >> 13,
+            g = (pix >> 5 & 0x3F) << 2 | (pix >> 9 & 0x3),
+            b = (pix & 0x1F) << 3 | (pix >> 2 & 0x7);
+        y[i] = (66 * r + 129 * g + 25 * b + 128 + (16 << 8)) >> 8;
+        cb[i] = (-38 * r - 74 * g + 112 * b + 128 + (128 << 8)) >> 8;
+        cr[i] = (112 * r - 94 * g - 18 * b + 128 + (128 << 8)) >> 8;
+    }
+}
+
+// Writes held for each frame of the video which starts before tick
+static bool capture_write_until(uint64_t tick)
+{
+    for(uint64_t frame_tick; (frame_tick = first_tick + frames_written * frame_ticks) < tick; ++frames_written)
+    {
+        if(format == CAPTURE_Y4M
+           && fprintf(capture_file, "FRAME XTIME=%" PRIu64 "\n", frame_tick * 1000000 / clock_rate) < 0)
+            return false;
+
+        if(fwrite(encoded.data(), encoded.size(), 1, capture_file) != 1)
+            return false;
+    }
+
+    return true;
+}
+
+// Takes frame and hands the previous one back in it
+static bool capture_write_frame(std::unique_ptr<CaptureFrame> &frame)
+{
+    bool success;
+    if(held)
+        success = capture_write_until(frame->tick);
+    else
+        success = format != CAPTURE_Y4M
+                  || fprintf(capture_file, "YUV4MPEG2 W320 H240 F%u:%u Ip A1:1 C444 XCOLORRANGE=LIMITED\n",
+                             clock_rate, frame_ticks) >= 0;
+
+    std::swap(held, frame);
+    capture_encode(*held);
+    return success;
+}
+
+static void capture_failed()
+{
+    failed = true;
+    active = false;
+    queued_frames.clear();
+    capture_cond.notify_all();
+}
+
+static void capture_write_frames()
+{
+    std::unique_lock<std::mutex> lock(capture_mutex);
+    for(;;)
+    {
+        capture_cond.wait(lock, [] { return stopping || !queued_frames.empty(); });
+        // The remaining ones get written before stopping
+        if(queued_frames.empty())
+            return;
+
+        std::unique_ptr<CaptureFrame> frame = std::move(queued_frames.front());
+        queued_frames.pop_front();
+
+        lock.unlock();
+        bool success = capture_write_frame(frame);
+        lock.lock();
+
+        if(frame)
+            spare_frames.push_back(std::move(frame));
+
+        if(!success)
+        {
+            capture_failed();
+            return;
+        }
+
+        capture_cond.notify_all();
+    }
+}
+
+bool capture_start(const char *filename, capture_format new_format)
+{
+    std::lock_guard<std::mutex> lock(capture_mutex);
+
+    if(started)
+        return false;
+
+    // Waits for the reader of a named pipe
+    capture_file = fopen_utf8(filename, "wb");
+    if(!capture_file)
+        return false;
+
+    format = new_format;
+    frame_ticks = 0;
+    last_tick = 0;
+    frames_written = 0;
+    started = true;
+    stopping = failed = false;
+
+    try
+    {
+        writer = std::thread(capture_write_frames);
+    }
+    catch(const std::system_error &)
+    {
+        // Without threads, capture_frame writes them itself
+    }
+
+    active = true;
+    return true;
+}
+
+bool capture_active()
+{
+    return active;
+}
+
+void capture_frame(const uint16_t *frame, uint64_t tick, uint32_t rate, uint32_t ticks)
+{
+    if(!active)
+        return;
+
+    last_tick = tick;
+    if(!frame)
+        return;
+
+    std::unique_lock<std::mutex> lock(capture_mutex);
+
+    // Lossless, so the emulation has to wait if the writer is behind
+    bool threaded = writer.joinable();
+    if(threaded)
+        capture_cond.wait(lock, [] { return queued_frames.size() < max_queued_frames || !active; });
+
+    if(!active)
+        return;
+
+    if(!frame_ticks)
+    {
+        clock_rate = rate;
+        frame_ticks = ticks;
+        first_tick = tick;
+    }
+
+    std::unique_ptr<CaptureFrame> copy;
+    if(spare_frames.empty())
+        copy.reset(new CaptureFrame);
+    else
+    {
+        copy = std::move(spare_frames.back());
+        spare_frames.pop_back();
+    }
+
+    memcpy(copy->pixels.data(), frame, sizeof(copy->pixels));
+    copy->tick = tick;
+
+    if(threaded)
+    {
+        queued_frames.push_back(std::move(copy));
+        capture_cond.notify_all();
+    }
+    else
+    {
+        if(!capture_write_frame(copy))
+            capture_failed();
+
+        if(copy)
+            spare_frames.push_back(std::move(copy));
+    }
+}
+
+bool capture_stop()
+{
+    std::unique_lock<std::mutex> lock(capture_mutex);
+
+    if(!started)
+        return false;
+
+    active = false;
+    stopping = true;
+    capture_cond.notify_all();
+
+    lock.unlock();
+    if(writer.joinable())
+        writer.join();
+    lock.lock();
+
+    // The last frame is shown until the next one would have come
+    bool ret = held && !failed && capture_write_until(std::max<uint64_t>(last_tick, held->tick) + frame_ticks);
+    if(fclose(capture_file) != 0)
+        ret = false;
+
+    started = false;
+    held.reset();
+    encoded.clear();
+    spare_frames.clear();
+    return ret;
+}
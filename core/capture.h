@@ -0,0 +1,36 @@
+/* Declarations for capture.cpp */
+
+#ifndef _H_CAPTURE
+#define _H_CAPTURE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum capture_format {
+    CAPTURE_RAW, // Only the RGB565 pixels in host byte order, like ffmpeg's rawvideo
+    CAPTURE_Y4M, // YUV4MPEG2 with 4:4:4 BT.601 frames, each with its time in microseconds as XTIME
+};
+
+/* Streams the LCD losslessly into the file, which may as well be a named pipe
+   or /dev/fd/N, so that it can be encoded by another process. The video has
+   the frame rate of the LCD when capturing started and stays in sync with the
+   emulated time, frames which are shown longer get repeated. The emulation
+   only copies frames which changed, a background thread converts and writes
+   them. If that doesn't keep up, the emulation waits for it. */
+bool capture_start(const char *filename, enum capture_format format);
+// Returns false if nothing got captured or writing failed
+bool capture_stop(void);
+bool capture_active(void);
+/* Called by lcd_event for each frame which gets shown, at tick of the LCD clock
+   with frame_ticks until the next one. frame is NULL if it didn't change. */
+void capture_frame(const uint16_t *frame, uint64_t tick, uint32_t clock_rate, uint32_t frame_ticks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
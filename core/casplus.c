@@ -202,7 +202,8 @@ static void int_chk() {
     cpu_int_check();
 }
 
-static uint32_t omap_int_read_word(uint32_t addr) {
+static uint32_t omap_int_read_word(int which, uint32_t addr) {
+    (void) which;
     int offset = addr & 0xFF;
     if (offset >= 0x1C && offset < 0x9C) {
         return omap_int.priority[(offset - 0x1C) >> 2];
@@ -224,7 +225,8 @@ static uint32_t omap_int_read_word(uint32_t addr) {
     }
     return bad_read_word(addr);
 }
-static void omap_int_write_word(uint32_t addr, uint32_t value) {
+static void omap_int_write_word(int which, uint32_t addr, uint32_t value) {
+    (void) which;
     int offset = addr & 0xFF;
     if (offset >= 0x1C && offset < 0x9C) {
         omap_int.priority[(offset - 0x1C) >> 2] = value & 0x7F;
@@ -246,16 +248,10 @@ void casplus_int_set(uint32_t int_num, bool on) {
 
 uint32_t omap_32k_synch_timer;
 
-uint8_t omap_read_byte(uint32_t addr) {
-    if (addr >= 0xFFFB9800 && addr <= 0xFFFB983F)
-        return serial_read(addr);
-    return bad_read_byte(addr);
-}
-uint16_t omap_read_half(uint32_t addr) {
-    if (addr >= 0xFFFBB400 && addr <= 0xFFFBB4FF) return omap_gpio_read(2, addr);
-    if (addr >= 0xFFFBBC00 && addr <= 0xFFFBBCFF) return omap_gpio_read(3, addr);
-    if (addr >= 0xFFFBE400 && addr <= 0xFFFBE4FF) return omap_gpio_read(0, addr);
-    if (addr >= 0xFFFBEC00 && addr <= 0xFFFBECFF) return omap_gpio_read(1, addr);
+/* The registers outside of the devices above */
+
+static uint16_t omap_misc_read_half(int which, uint32_t addr) {
+    (void) which;
     switch (addr) {
         case 0xFFFB3808: return 4;
         case 0xFFFB5010: return ~(omap_read_keypad() & 0xFF);
@@ -267,16 +263,8 @@ uint16_t omap_read_half(uint32_t addr) {
     }
     return 0; //bad_read_half(addr);
 }
-uint32_t omap_read_word(uint32_t addr) {
-    if (addr >= 0xFFFBB400 && addr <= 0xFFFBB4FF) return omap_gpio_read(2, addr);
-    if (addr >= 0xFFFBBC00 && addr <= 0xFFFBBCFF) return omap_gpio_read(3, addr);
-    if (addr >= 0xFFFBE400 && addr <= 0xFFFBE4FF) return omap_gpio_read(0, addr);
-    if (addr >= 0xFFFBEC00 && addr <= 0xFFFBECFF) return omap_gpio_read(1, addr);
-    if (addr >= 0xFFFEC500 && addr <= 0xFFFEC7FF)
-        return omap_timer_read_word((addr >> 8 & 3) - 1, addr);
-    if (addr >= 0xFFFECB00 && addr <= 0xFFFECBFF)
-        return omap_int_read_word(addr);
-
+static uint32_t omap_misc_read_word(int which, uint32_t addr) {
+    (void) which;
     switch (addr) {
         case 0xFFFB0404: return 4;
         case 0xFFFB0C14: return 1; // SPI status
@@ -289,20 +277,8 @@ uint32_t omap_read_word(uint32_t addr) {
     }
     return 0; //bad_read_word(addr);
 }
-
-void omap_write_byte(uint32_t addr, uint8_t byte) {
-    if (addr >= 0xFFFB9800 && addr <= 0xFFFB983F)
-    {
-        serial_write(addr, byte);
-        return;
-    }
-    bad_write_byte(addr, byte);
-}
-void omap_write_half(uint32_t addr, uint16_t value) {
-    if (addr >= 0xFFFBB400 && addr <= 0xFFFBB4FF) return omap_gpio_write(2, addr, value);
-    if (addr >= 0xFFFBBC00 && addr <= 0xFFFBBCFF) return omap_gpio_write(3, addr, value);
-    if (addr >= 0xFFFBE400 && addr <= 0xFFFBE4FF) return omap_gpio_write(0, addr, value);
-    if (addr >= 0xFFFBEC00 && addr <= 0xFFFBECFF) return omap_gpio_write(1, addr, value);
+static void omap_misc_write_half(int which, uint32_t addr, uint16_t value) {
+    (void) which;
     switch (addr) {
         case 0xFFFB5014: omap_keypad_row_mask = 0xFF00 | value; return;
         case 0xFFFECE00: {
@@ -316,16 +292,8 @@ void omap_write_half(uint32_t addr, uint16_t value) {
     }
     //bad_write_half(addr, value);
 }
-void omap_write_word(uint32_t addr, uint32_t value) {
-    if (addr >= 0xFFFBB400 && addr <= 0xFFFBB4FF) return omap_gpio_write(2, addr, value);
-    if (addr >= 0xFFFBBC00 && addr <= 0xFFFBBCFF) return omap_gpio_write(3, addr, value);
-    if (addr >= 0xFFFBE400 && addr <= 0xFFFBE4FF) return omap_gpio_write(0, addr, value);
-    if (addr >= 0xFFFBEC00 && addr <= 0xFFFBECFF) return omap_gpio_write(1, addr, value);
-
-    if (addr >= 0xFFFEC500 && addr <= 0xFFFEC7FF)
-        return omap_timer_write_word((addr >> 8 & 3) - 1, addr, value);
-    if (addr >= 0xFFFECB00 && addr <= 0xFFFECBFF)
-        return omap_int_write_word(addr, value);
+static void omap_misc_write_word(int which, uint32_t addr, uint32_t value) {
+    (void) which;
     switch (addr) {
         case 0xFFFEC000: lcd_control = value; return;
         case 0xFFFECC0C: nand.nand_writable = value & 1; return; // EMIFS_CONFIG
@@ -334,7 +302,91 @@ void omap_write_word(uint32_t addr, uint32_t value) {
     //bad_write_word(addr, value);
 }
 
+static uint32_t omap_gpio_read_word(int which, uint32_t addr) {
+    return omap_gpio_read(which, addr);
+}
+static void omap_gpio_write_word(int which, uint32_t addr, uint32_t value) {
+    omap_gpio_write(which, addr, value);
+}
+
+/* FFFB0000-FFFFFFFF: half and word accesses go through a table with the
+ * handlers of each 256 byte page, instead of comparing the address with the
+ * range of every device. Byte accesses only reach the serial port. */
+struct omap_map_entry {
+    uint16_t (*read_half)(int which, uint32_t addr);
+    uint32_t (*read_word)(int which, uint32_t addr);
+    void (*write_half)(int which, uint32_t addr, uint16_t value);
+    void (*write_word)(int which, uint32_t addr, uint32_t value);
+    int which; // Of the devices with several instances
+};
+#define OMAP_MAP_BASE 0xFFFB0000
+static struct omap_map_entry omap_map[0x500];
+static const struct omap_map_entry omap_misc_entry = {
+    omap_misc_read_half, omap_misc_read_word, omap_misc_write_half, omap_misc_write_word, 0
+};
+
+static void omap_set_map(uint32_t base, uint32_t size, struct omap_map_entry entry) {
+    for (uint32_t page = (base - OMAP_MAP_BASE) >> 8; page < (base - OMAP_MAP_BASE + size) >> 8; page++)
+        omap_map[page] = entry;
+}
+
+static void omap_map_init() {
+    omap_set_map(OMAP_MAP_BASE, 0 - OMAP_MAP_BASE, omap_misc_entry);
+
+    static const uint32_t gpio_base[4] = { 0xFFFBE400, 0xFFFBEC00, 0xFFFBB400, 0xFFFBBC00 };
+    for (int i = 0; i < 4; i++)
+        omap_set_map(gpio_base[i], 0x100, (struct omap_map_entry) {
+            omap_gpio_read, omap_gpio_read_word, omap_gpio_write, omap_gpio_write_word, i
+        });
+
+    for (int i = 0; i < 3; i++)
+        omap_set_map(0xFFFEC500 + (i << 8), 0x100, (struct omap_map_entry) {
+            omap_misc_read_half, omap_timer_read_word, omap_misc_write_half, omap_timer_write_word, i
+        });
+
+    omap_set_map(0xFFFECB00, 0x100, (struct omap_map_entry) {
+        omap_misc_read_half, omap_int_read_word, omap_misc_write_half, omap_int_write_word, 0
+    });
+}
+
+static inline const struct omap_map_entry *omap_map_entry(uint32_t addr) {
+    return addr >= OMAP_MAP_BASE ? &omap_map[(addr - OMAP_MAP_BASE) >> 8] : &omap_misc_entry;
+}
+
+uint8_t omap_read_byte(uint32_t addr) {
+    if (addr >= 0xFFFB9800 && addr <= 0xFFFB983F)
+        return serial_read(addr);
+    return bad_read_byte(addr);
+}
+uint16_t omap_read_half(uint32_t addr) {
+    const struct omap_map_entry *e = omap_map_entry(addr);
+    return e->read_half(e->which, addr);
+}
+uint32_t omap_read_word(uint32_t addr) {
+    const struct omap_map_entry *e = omap_map_entry(addr);
+    return e->read_word(e->which, addr);
+}
+
+void omap_write_byte(uint32_t addr, uint8_t byte) {
+    if (addr >= 0xFFFB9800 && addr <= 0xFFFB983F)
+    {
+        serial_write(addr, byte);
+        return;
+    }
+    bad_write_byte(addr, byte);
+}
+void omap_write_half(uint32_t addr, uint16_t value) {
+    const struct omap_map_entry *e = omap_map_entry(addr);
+    e->write_half(e->which, addr, value);
+}
+void omap_write_word(uint32_t addr, uint32_t value) {
+    const struct omap_map_entry *e = omap_map_entry(addr);
+    e->write_word(e->which, addr, value);
+}
+
 void casplus_reset() {
+    omap_map_init();
+
     memset(lcd_framebuffer, 0, sizeof lcd_framebuffer);
     lcd_control = 0;
 
@@ -343,7 +395,7 @@ void casplus_reset() {
         omap_timer[i].control = 0;
         omap_timer[i].load = 0xffffffff; // hack for U-Boot
         sched.items[SCHED_CASPLUS_TIMER1+i].clock = CLOCK_AHB;
-        sched.items[SCHED_CASPLUS_TIMER1+i].second = -1;
+        sched.items[SCHED_CASPLUS_TIMER1+i].disabled = true;
         sched.items[SCHED_CASPLUS_TIMER1+i].proc = omap_timer_event;
     }
 
@@ -1,6 +1,7 @@
 #include "cpu.h"
 #include "cpudefs.h"
 #include "mmu.h"
+#include "translate.h"
 
 void do_cp15_mrc(uint32_t insn)
 {
@@ -79,7 +80,7 @@ void do_cp15_mcr(uint32_t insn)
             break;
         case 0x030000: /* MCR p15, 0, <Rd>, c3, c0, 0: Domain Access Control Register */
             arm.domain_access_control = value;
-            addr_cache_flush();
+            addr_cache_flush_permissions();
             break;
         case 0x050000: /* MCR p15, 0, <Rd>, c5, c0, 0: Data Fault Status Register */
             arm.data_fault_status = value;
@@ -91,20 +92,26 @@ void do_cp15_mcr(uint32_t insn)
             arm.fault_address = value;
             break;
         case 0x070080: /* MCR p15, 0, <Rd>, c7, c0, 4: Wait for interrupt */
-            cycle_count_delta = 0;
+            // With an interrupt pending it doesn't wait, so the time doesn't skip ahead either
             if (arm.interrupts == 0) {
+                cycle_count_delta = 0;
                 arm.reg[15] -= 4;
                 cpu_events |= EVENT_WAITING;
             }
             break;
         case 0x080005: /* MCR p15, 0, <Rd>, c8, c5, 0: Invalidate instruction TLB */
         case 0x080007: /* MCR p15, 0, <Rd>, c8, c7, 0: Invalidate TLB */
+            addr_cache_flush();
+            break;
         case 0x080025: /* MCR p15, 0, <Rd>, c8, c5, 1: Invalidate instruction TLB entry */
-        case 0x080027: /* MCR p15, 0, <Rd>, c8, c7, 1: Invalidate TLB (used by polydumper) */
+        case 0x080027: /* MCR p15, 0, <Rd>, c8, c7, 1: Invalidate TLB entry (used by polydumper) */
+            addr_cache_flush_entry(value);
+            break;
         case 0x070005: /* MCR p15, 0, <Rd>, c7, c5, 0: Invalidate ICache */
         case 0x070025: /* MCR p15, 0, <Rd>, c7, c5, 1: Invalidate ICache line */
         case 0x070007: /* MCR p15, 0, <Rd>, c7, c7, 0: Invalidate ICache and DCache */
             addr_cache_flush();
+            flush_translations();
             break;
 
         case 0x080006: /* MCR p15, 0, <Rd>, c8, c6, 0: Invalidate data TLB */
@@ -117,6 +124,7 @@ void do_cp15_mcr(uint32_t insn)
             #ifdef SUPPORT_LINUX
                 // Normally ignored, but somehow needed for linux to boot correctly
                 addr_cache_flush();
+                flush_translations();
             #endif
             break;
         default:
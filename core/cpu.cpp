@@ -1,25 +1,29 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstring>
 #include <mutex>
 
-// Uncomment the following line to measure the time until the OS is loaded
-// #define BENCHMARK
-#ifdef BENCHMARK
-    #include <ctime>
-#endif
-
 #include "armsnippets.h"
 #include "asmcode.h"
 #include "cpu.h"
 #include "cpudefs.h"
 #include "debug.h"
+#include "disasm.h"
 #include "emu.h"
 #include "mem.h"
 #include "mmu.h"
+#include "trace.h"
 #include "translate.h"
 
-// Global CPU state
-struct arm_state arm;
+// The CPU state, the scheduler and the memory layout of the calculator
+struct emu_instance emu_instance;
+
+struct translate_stats translate_stats;
+
+#ifndef NO_TRANSLATION
+uint16_t translate_counters[0x10000];
+#endif
 
 void cpu_arm_loop()
 {
@@ -30,20 +34,6 @@ void cpu_arm_loop()
         if(!p)
             error("Bad PC: 0x%08x\n", arm.reg[15]);
 
-        #ifdef BENCHMARK
-            static clock_t start = 0;
-            if(arm.reg[15] == 0)
-            {
-                start = clock();
-                turbo_mode = true;
-            }
-            else if(arm.reg[15] == 0x10000000 || arm.reg[15] == 0x11800000)
-            {
-                clock_t diff = clock() - start;
-                printf("%ld ms\n", diff / 1000);
-            }
-        #endif
-
         uint32_t *flags_ptr = &RAM_FLAGS(p);
 
         // Check for pending events
@@ -57,9 +47,12 @@ void cpu_arm_loop()
 
 #ifndef NO_TRANSLATION
         // If the instruction is translated, use the translation
-        if(*flags_ptr & RF_CODE_TRANSLATED)
+        if((*flags_ptr & (RF_CODE_TRANSLATED | RF_CODE_THUMB)) == RF_CODE_TRANSLATED && !translation_replaying)
         {
-            translation_enter();
+            translation_touch(*flags_ptr >> RFS_TRANSLATION_INDEX);
+            uint64_t cputick = sched_cputick();
+            translation_run();
+            translate_stats.jit_instructions += sched_cputick() - cputick;
             continue;
         }
 #endif
@@ -72,7 +65,7 @@ void cpu_arm_loop()
                 *flags_ptr &= ~RF_ARMLOADER_CB;
                 armloader_cb();
             }
-            else
+            else if((*flags_ptr & RF_EXEC_DEBUG_NEXT) || debug_exec_breakpoint(p))
             {
                 if(*flags_ptr & RF_EXEC_BREAKPOINT)
                     gui_debug_printf("Breakpoint at 0x%08x\n", arm.reg[15]);
@@ -82,22 +75,318 @@ void cpu_arm_loop()
                 if(arm.reg[15] != pc)
                     continue; // Debugger changed PC
             }
+            else if(exiting)
+                continue; // The breakpoint stops the emulation before the instruction
         }
 #ifndef NO_TRANSLATION
-        else if(do_translate && !(*flags_ptr & RF_CODE_NO_TRANSLATE))
+        else if(do_translate && !(*flags_ptr & (RF_CODE_NO_TRANSLATE | RF_CODE_TRANSLATED)) && translation_hot(p)
+                && !translation_queued(arm.reg[15], p, false))
         {
+            auto start = std::chrono::steady_clock::now();
             translate(arm.reg[15], &p->raw);
+            translate_stats.translate_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            if(*flags_ptr & RF_CODE_TRANSLATED)
+                ++translate_stats.translations;
+            else
+                ++translate_stats.fallbacks;
             continue;
         }
 #endif
 
+        if(unlikely(trace_enabled))
+            trace_record(p, false);
+
         arm.reg[15] += 4; // Increment now to account for the pipeline
         ++cycle_count_delta;
-        do_arm_instruction(*p);
+        ++translate_stats.interpreted_instructions;
+        do_arm_instruction_cached(p);
     }
 }
 
 // Makes arm.reg[15] point to the current instruction
+#ifndef NO_TRANSLATION
+bool translation_replaying = false;
+
+#ifndef TRANSLATE_VALIDATE
+void translation_replay_store(uint32_t, void *, uint32_t, unsigned int) {}
+void translation_replay_bail() { __builtin_unreachable(); }
+
+void translation_run()
+{
+    translation_enter();
+}
+#else
+// A block doesn't leave its 1 KiB page, so that's the most it can have
+static const unsigned int replay_steps_max = 0x400 / 2;
+static const unsigned int replay_stores_max = 1024; // Bytes
+
+static struct {
+    arm_state start;
+    uint32_t start_cpsr, start_events;
+    int32_t start_delta;
+    uint64_t start_interpreted;
+    void *restart[32]; // The restart_after_exception of the emulation
+    unsigned int steps_count, stores_count;
+    // The state after each instruction the interpreter ran
+    struct {
+        uint32_t pc, reg[16], cpsr;
+    } steps[replay_steps_max];
+    // Each byte stored, in order
+    struct {
+        uint8_t *ptr;
+        uint32_t addr;
+        uint8_t old_value, new_value;
+        uint16_t step;
+    } stores[replay_stores_max];
+} replay;
+
+static unsigned int validate_countdown;
+
+void translation_replay_store(uint32_t addr, void *ptr, uint32_t value, unsigned int size)
+{
+    // write_action would drop translations, maybe the one to validate
+    if((RAM_FLAGS((uintptr_t) ptr & ~3) & DO_WRITE_ACTION) || replay.stores_count + size > replay_stores_max)
+        translation_replay_bail();
+
+    for(unsigned int i = 0; i < size; ++i)
+    {
+        auto &store = replay.stores[replay.stores_count++];
+        store.ptr = static_cast<uint8_t*>(ptr) + i;
+        store.addr = addr + i;
+        store.old_value = *store.ptr;
+        store.new_value = value >> (i * 8);
+        store.step = replay.steps_count;
+    }
+}
+
+void translation_replay_bail()
+{
+    __builtin_longjmp(restart_after_exception, 1);
+}
+
+/* Interprets the instructions of the translation from arm.reg[15] on, one
+   at a time, until one branches or the translation ends */
+static void replay_block(const struct translation *t)
+{
+    bool thumb = arm.cpsr_low28 & 0x20;
+    uint32_t size = thumb ? 2 : 4;
+    uint8_t *insnp = static_cast<uint8_t*>(read_instruction(arm.reg[15]));
+
+    while(replay.steps_count < replay_steps_max && insnp < reinterpret_cast<uint8_t*>(t->end_ptr))
+    {
+        uint32_t pc = arm.reg[15];
+        // Coprocessor instructions can flush the caches and the translations
+        if(!thumb)
+        {
+            uint32_t insn = *reinterpret_cast<uint32_t*>(insnp);
+            if((insn & 0x0E000000) == 0x0C000000 || (insn & 0x0F000000) == 0x0E000000)
+                translation_replay_bail();
+        }
+
+        cycle_count_delta = -1;
+        if(thumb)
+            cpu_thumb_loop();
+        else
+            cpu_arm_loop();
+
+        if(cycle_count_delta < 0)
+            break; // Stopped for cpu_events before it
+
+        auto &step = replay.steps[replay.steps_count++];
+        step.pc = pc;
+        memcpy(step.reg, arm.reg, sizeof(step.reg));
+        step.cpsr = get_cpsr();
+
+        insnp += size;
+        if(bool(arm.cpsr_low28 & 0x20) != thumb || arm.reg[15] != pc + size)
+            break;
+    }
+}
+
+static void replay_disasm(uint32_t pc, uint32_t cpsr)
+{
+    if(cpsr & 0x20)
+        disasm_thumb_insn(pc);
+    else
+        disasm_arm_insn(pc);
+}
+
+/* Compares the state after the translation with the one after the step of
+   the replay which ended at the same PC. That's the last such step: a block
+   which branches back into itself ends at the PC after an earlier step. */
+static void replay_compare(uint32_t block_pc)
+{
+    uint32_t cpsr = get_cpsr();
+    unsigned int exit = replay.steps_count;
+    while(exit > 0 && replay.steps[exit - 1].reg[15] != arm.reg[15])
+        --exit;
+
+    bool reached = exit > 0, differs = false;
+    exit = reached ? exit - 1 : replay.steps_count - 1;
+
+    const auto &expected = replay.steps[exit];
+    // The first step which a differing result comes from
+    unsigned int first = exit + 1;
+
+    auto report = [&]() {
+        if(!differs)
+            gui_debug_printf("The translation of %08x, entered at %08x, differs from the interpreter:\n", block_pc, replay.steps[0].pc);
+        differs = true;
+    };
+    if(!reached)
+    {
+        report();
+        gui_debug_printf("  It exited to %08x, the interpreter got to %08x\n", arm.reg[15], expected.reg[15]);
+    }
+
+    for(unsigned int r = 0; r < 16; ++r)
+    {
+        uint32_t value = r < 15 ? arm.reg[r] : cpsr, want = r < 15 ? expected.reg[r] : expected.cpsr;
+        if(value == want)
+            continue;
+
+        // The last step which changed it
+        int step = exit;
+        for(; step >= 0; --step)
+        {
+            uint32_t after = r < 15 ? replay.steps[step].reg[r] : replay.steps[step].cpsr,
+                     before = step == 0 ? (r < 15 ? replay.start.reg[r] : replay.start_cpsr)
+                                        : (r < 15 ? replay.steps[step - 1].reg[r] : replay.steps[step - 1].cpsr);
+            if(after != before)
+                break;
+        }
+
+        report();
+        if(r < 15)
+            gui_debug_printf("  r%u: %08x, interpreter %08x", r, value, want);
+        else
+            gui_debug_printf("  cpsr: %08x, interpreter %08x", value, want);
+
+        if(step >= 0)
+        {
+            gui_debug_printf(" (from %08x)\n", replay.steps[step].pc);
+            first = std::min(first, unsigned(step));
+        }
+        else
+            gui_debug_printf(" (unchanged)\n");
+    }
+
+    for(unsigned int i = 0; i < replay.stores_count; ++i)
+    {
+        const auto &store = replay.stores[i];
+        bool seen = false;
+        for(unsigned int j = 0; j < i && !seen; ++j)
+            seen = replay.stores[j].ptr == store.ptr;
+        if(seen)
+            continue;
+
+        // The last value stored there up to the exit
+        uint8_t want = store.old_value;
+        int step = -1;
+        for(unsigned int j = i; j < replay.stores_count; ++j)
+        {
+            if(replay.stores[j].ptr == store.ptr && replay.stores[j].step <= exit)
+            {
+                want = replay.stores[j].new_value;
+                step = replay.stores[j].step;
+            }
+        }
+
+        if(*store.ptr == want)
+            continue;
+
+        report();
+        gui_debug_printf("  [%08x]: %02x, interpreter %02x", store.addr, *store.ptr, want);
+        if(step >= 0)
+        {
+            gui_debug_printf(" (from %08x)\n", replay.steps[step].pc);
+            first = std::min(first, unsigned(step));
+        }
+        else
+            gui_debug_printf(" (not stored to)\n");
+    }
+
+    if(!differs)
+        return;
+
+    ++translate_stats.mismatches;
+    if(first <= exit)
+    {
+        gui_debug_printf("First differing result from:\n");
+        replay_disasm(replay.steps[first].pc, first ? replay.steps[first - 1].cpsr : replay.start_cpsr);
+    }
+    gui_debug_printf("Interpreted instructions:\n");
+    for(unsigned int step = 0; step <= exit; ++step)
+        replay_disasm(replay.steps[step].pc, step ? replay.steps[step - 1].cpsr : replay.start_cpsr);
+
+    warn("Translation of %08x differs from the interpreter", block_pc);
+}
+
+static void translation_validate()
+{
+    void *insnp = read_instruction(arm.reg[15]);
+    const struct translation *t = &translation_table[RAM_FLAGS((uintptr_t) insnp & ~3) >> RFS_TRANSLATION_INDEX];
+    uint32_t block_pc = arm.reg[15] - (static_cast<uint8_t*>(insnp) - reinterpret_cast<uint8_t*>(t->start_ptr));
+
+    replay.start = arm;
+    replay.start_cpsr = get_cpsr();
+    replay.start_events = cpu_events;
+    replay.start_delta = cycle_count_delta;
+    replay.start_interpreted = translate_stats.interpreted_instructions;
+    replay.steps_count = replay.stores_count = 0;
+
+    // Exceptions and translation_replay_bail end up here
+    bool bailed = false;
+    memcpy(replay.restart, restart_after_exception, sizeof(replay.restart));
+    translation_replaying = true;
+    if(__builtin_setjmp(restart_after_exception))
+        bailed = true;
+    else
+        replay_block(t);
+    translation_replaying = false;
+    memcpy(restart_after_exception, replay.restart, sizeof(replay.restart));
+
+    for(unsigned int i = replay.stores_count; i-- > 0;)
+        *replay.stores[i].ptr = replay.stores[i].old_value;
+    arm = replay.start;
+    cpu_events = replay.start_events;
+    cycle_count_delta = replay.start_delta;
+    translate_stats.interpreted_instructions = replay.start_interpreted;
+
+    /* The translation returns at the end of the block if cycle_count_delta
+       isn't negative anymore then. The schedule gets shifted for that, so
+       that sched_cputick() is the same, also if it doesn't return. */
+    uint64_t next_cputick = sched.next_cputick, shifted = next_cputick + cycle_count_delta + 1;
+    sched.next_cputick = shifted;
+    cycle_count_delta = -1;
+    translation_enter();
+    if(sched.next_cputick == shifted)
+    {
+        cycle_count_delta += shifted - next_cputick;
+        sched.next_cputick = next_cputick;
+    }
+
+    if(bailed || replay.steps_count == 0)
+    {
+        ++translate_stats.validate_skipped;
+        return;
+    }
+
+    ++translate_stats.validated;
+    replay_compare(block_pc);
+}
+
+void translation_run()
+{
+    if(likely(!translate_validate_interval) || ++validate_countdown < translate_validate_interval)
+        return translation_enter();
+
+    validate_countdown = 0;
+    translation_validate();
+}
+#endif
+#endif
+
 void fix_pc_for_fault()
 {
 #ifndef NO_TRANSLATION
@@ -194,8 +483,14 @@ void * FASTCALL read_instruction(uint32_t addr)
             addr_cache_miss(addr, false, prefetch_abort);
             return read_instruction(addr);
         }
-        else // Executing MMIO stuff
+        else
         {
+            // Memory in a page with a read breakpoint, which doesn't apply to fetches
+            void *ptr = phys_mem_ptr((entry & ~AC_FLAGS) + addr, 4);
+            if(ptr)
+                return ptr;
+
+            // Executing MMIO stuff
             warn("PC in MMIO range: 0x%x\n", addr);
             return 0;
         }
@@ -356,7 +651,7 @@ void set_cpsr_full(uint32_t cpsr)
 
     // Access permissions are different
     if((old_mode == MODE_USR) ^ (new_mode == MODE_USR))
-        addr_cache_flush();
+        addr_cache_flush_permissions();
 
     same_mode:
     if(cpsr & 0x01000000)
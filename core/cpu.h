@@ -45,7 +45,17 @@ typedef struct arm_state {  // Remember to update asmcode.S if this gets rearran
 __attribute__((packed))
 #endif
 arm_state;
-extern struct arm_state arm __asm__("arm");
+
+#ifdef __cplusplus
+}
+#endif
+
+// arm is part of the emu_instance
+#include "instance.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define MODE_USR 0x10
 #define MODE_FIQ 0x11
@@ -149,6 +149,8 @@ enum DataOp {
 
 // Defined in arm_interpreter.cpp
 void do_arm_instruction(Instruction i);
+// Same, but looks the decoded instruction up in a cache
+void do_arm_instruction_cached(const Instruction *p);
 // Defined in coproc.cpp
 void do_cp15_instruction(Instruction i);
 
@@ -16,7 +16,10 @@
 #include <netinet/tcp.h>
 #endif
 
+#include <algorithm>
 #include <condition_variable>
+#include <unordered_map>
+#include <vector>
 
 #include "armsnippets.h"
 #include "debug.h"
@@ -26,9 +29,13 @@
 #include "mem.h"
 #include "disasm.h"
 #include "mmu.h"
+#include "profile.h"
+#include "rewind.h"
+#include "trace.h"
 #include "translate.h"
 #include "usblink_queue.h"
 #include "gdbstub.h"
+#include "hostio.h"
 #include "os/os.h"
 
 std::string ln_target_folder;
@@ -52,6 +59,72 @@ void *virt_mem_ptr(uint32_t addr, uint32_t size) {
     return (void *)(intptr_t)phys_mem_ptr(mmu_translate(addr, false, NULL, NULL), size);
 }
 
+// The first match of pattern in the size bytes at data, memchr finds the candidates
+static const uint8_t *find_pattern(const uint8_t *data, size_t size, const uint8_t *pattern, size_t pattern_len) {
+    if (size < pattern_len)
+        return nullptr;
+
+    const uint8_t *last = data + size - pattern_len;
+    for (const uint8_t *p = data; p <= last; p++) {
+        p = (const uint8_t *) memchr(p, pattern[0], last - p + 1);
+        if (!p)
+            return nullptr;
+        if (!memcmp(p + 1, pattern + 1, pattern_len - 1))
+            return p;
+    }
+    return nullptr;
+}
+
+bool debug_search_memory(uint32_t addr, uint32_t len, const void *pattern_ptr, uint32_t pattern_len, uint32_t *found) {
+    const uint8_t *pattern = (const uint8_t *) pattern_ptr;
+    if (!pattern_len || pattern_len > len)
+        return false;
+
+    uint64_t pos = addr, end = (uint64_t) addr + len;
+    // The last bytes before tail_end, for matches which continue in the next run
+    std::vector<uint8_t> tail;
+    uint64_t tail_end = 0;
+    while (pos < end) {
+        uint32_t phys = mmu_translate(pos, false, NULL, NULL);
+        uint8_t *start = (uint8_t *) phys_mem_ptr(phys, 1);
+        uint64_t run_end = std::min(end, (pos | 0x3FF) + 1);
+        if (!start) {
+            pos = run_end;
+            continue;
+        }
+
+        // As long as the next page follows in the same memory area
+        while (run_end < end && mmu_translate(run_end, false, NULL, NULL) == phys + (run_end - pos)
+               && phys_mem_ptr(phys, run_end - pos + 1))
+            run_end = std::min(end, run_end + 0x400);
+
+        size_t run_len = run_end - pos;
+        if (tail_end != pos)
+            tail.clear();
+
+        if (!tail.empty()) {
+            std::vector<uint8_t> seam(tail);
+            seam.insert(seam.end(), start, start + std::min<size_t>(run_len, pattern_len - 1));
+            if (const uint8_t *match = find_pattern(seam.data(), seam.size(), pattern, pattern_len)) {
+                *found = pos - tail.size() + (match - seam.data());
+                return true;
+            }
+        }
+
+        if (const uint8_t *match = find_pattern(start, run_len, pattern, pattern_len)) {
+            *found = pos + (match - start);
+            return true;
+        }
+
+        size_t keep = std::min<size_t>(run_len, pattern_len - 1);
+        tail.insert(tail.end(), start + run_len - keep, start + run_len);
+        if (tail.size() > pattern_len - 1)
+            tail.erase(tail.begin(), tail.end() - (pattern_len - 1));
+        tail_end = pos = run_end;
+    }
+    return false;
+}
+
 void backtrace(uint32_t fp) {
     uint32_t *frame;
     gui_debug_printf("Frame     PrvFrame Self     Return   Start\n");
@@ -69,6 +142,20 @@ void backtrace(uint32_t fp) {
     } while (frame[2] != 0);
 }
 
+unsigned int backtrace_returns(uint32_t fp, uint32_t *returns, unsigned int max) {
+    unsigned int count = 0;
+    while (count < max) {
+        uint32_t *frame = (uint32_t*) virt_mem_ptr(fp - 12, 16);
+        if (!frame || frame[2] == 0)
+            break;
+        returns[count++] = frame[2];
+        if (frame[0] <= fp)
+            break;
+        fp = frame[0];
+    }
+    return count;
+}
+
 static void dump(uint32_t addr) {
     uint32_t start = addr;
     uint32_t end = addr + 0x7F;
@@ -106,15 +193,18 @@ static void dump(uint32_t addr) {
     }
 }
 
-static uint32_t parse_expr(char *str) {
+/* Sums of hex numbers, registers, v<address> for the physical address of a
+   virtual one and [<expr>] for the word at a virtual address. Returns false
+   with a message in error if str isn't valid or reads unmapped memory. */
+static bool eval_expr(const char *str, uint32_t *value, const char **error) {
     uint32_t sum = 0;
     int sign = 1;
-    if (str == NULL)
-        return 0;
+    char *end;
     while (*str) {
         int reg;
         if (isxdigit(*str)) {
-            sum += sign * strtoul(str, &str, 16);
+            sum += sign * strtoul(str, &end, 16);
+            str = end;
             sign = 1;
         } else if (*str == '+') {
             str++;
@@ -122,17 +212,37 @@ static uint32_t parse_expr(char *str) {
             sign = -1;
             str++;
         } else if (*str == 'v') {
-            sum += sign * mmu_translate(strtoul(str + 1, &str, 16), false, NULL, NULL);
+            sum += sign * mmu_translate(strtoul(str + 1, &end, 16), false, NULL, NULL);
+            str = end;
             sign = 1;
         } else if (*str == 'r') {
-            reg = strtoul(str + 1, &str, 10);
+            reg = strtoul(str + 1, &end, 10);
+            str = end;
             if(reg > 15)
             {
-                gui_debug_printf("Reg number out of range!\n");
-                return 0;
+                *error = "Reg number out of range!";
+                return false;
             }
             sum += sign * arm.reg[reg];
             sign = 1;
+        } else if (*str == '[') {
+            const char *close = str + 1;
+            for (int depth = 1; *close && (depth += (*close == '[') - (*close == ']')); close++);
+            uint32_t addr;
+            if (!*close) {
+                *error = "syntax error";
+                return false;
+            }
+            if (!eval_expr(std::string(str + 1, close).c_str(), &addr, error))
+                return false;
+            uint32_t *ptr = (uint32_t *) virt_mem_ptr(addr, 4);
+            if (!ptr) {
+                *error = "Address not mapped!";
+                return false;
+            }
+            sum += sign * *ptr;
+            sign = 1;
+            str = close + 1;
         } else {
             for (reg = 13; reg < 16; reg++) {
                 if (!memcmp(str, reg_name[reg], 2)) {
@@ -142,12 +252,121 @@ static uint32_t parse_expr(char *str) {
                     goto ok;
                 }
             }
-            gui_debug_printf("syntax error\n");
-            return 0;
+            *error = "syntax error";
+            return false;
 ok:;
         }
     }
-    return sum;
+    *value = sum;
+    return true;
+}
+
+static uint32_t parse_expr(char *str) {
+    uint32_t value;
+    const char *error;
+    if (str == NULL)
+        return 0;
+    if (!eval_expr(str, &value, &error)) {
+        gui_debug_printf("%s\n", error);
+        return 0;
+    }
+    return value;
+}
+
+/* Exec breakpoints with a condition or an ignore count, by physical address.
+   Those without either aren't in here, they always stop. */
+struct breakpoint_cond {
+    std::string lhs, op, rhs; // The condition is lhs op rhs, or lhs != 0 without op
+    uint32_t ignore = 0; // Hits left which don't stop
+    uint32_t hits = 0; // Times the condition was met
+    bool stop = false; // Stops the emulation instead of entering the debugger
+};
+static std::unordered_map<uint32_t, breakpoint_cond> breakpoint_conds;
+
+static const char *const condition_ops[] = { "==", "!=", "<=", ">=", "<", ">" };
+
+// Splits cond into bp, returns false if it isn't valid right now
+static bool breakpoint_set_condition(breakpoint_cond &bp, const std::string &cond) {
+    size_t pos = std::string::npos;
+    const char *op = "";
+    for (const char *candidate : condition_ops) {
+        size_t found = cond.find(candidate);
+        // The longer ones come first, so that "<=" doesn't get split at '<'
+        if (found < pos) {
+            pos = found;
+            op = candidate;
+        }
+    }
+
+    uint32_t value;
+    const char *error;
+    std::string lhs = cond.substr(0, pos), rhs = pos == std::string::npos ? "" : cond.substr(pos + strlen(op));
+    if (!eval_expr(lhs.c_str(), &value, &error) || (*op && !eval_expr(rhs.c_str(), &value, &error))) {
+        gui_debug_printf("%s\n", error);
+        return false;
+    }
+
+    bp.lhs = lhs;
+    bp.op = op;
+    bp.rhs = rhs;
+    return true;
+}
+
+static bool breakpoint_condition_met(const breakpoint_cond &bp) {
+    if (bp.lhs.empty())
+        return true;
+
+    uint32_t lhs, rhs = 0;
+    const char *error;
+    if (!eval_expr(bp.lhs.c_str(), &lhs, &error) || (!bp.op.empty() && !eval_expr(bp.rhs.c_str(), &rhs, &error))) {
+        // Better stop than miss it
+        gui_debug_printf("Breakpoint condition: %s\n", error);
+        return true;
+    }
+
+    const std::string &op = bp.op;
+    if (op.empty() || op == "!=") return lhs != rhs;
+    if (op == "==") return lhs == rhs;
+    if (op == "<=") return lhs <= rhs;
+    if (op == ">=") return lhs >= rhs;
+    if (op == "<") return lhs < rhs;
+    return lhs > rhs;
+}
+
+bool debug_exec_breakpoint(const void *ptr) {
+    if (breakpoint_conds.empty())
+        return true;
+
+    auto it = breakpoint_conds.find(phys_mem_addr((void *) ptr) & ~3);
+    if (it == breakpoint_conds.end())
+        return true;
+
+    // Like GDB, only hits where the condition is met count for the ignore count
+    breakpoint_cond &bp = it->second;
+    if (!breakpoint_condition_met(bp))
+        return false;
+
+    bp.hits++;
+    if (bp.ignore) {
+        bp.ignore--;
+        return false;
+    }
+    if (bp.stop) {
+        exiting = true;
+        return false;
+    }
+    return true;
+}
+
+bool debug_set_stop_pc(uint32_t addr) {
+    void *ptr = virt_mem_ptr(addr & ~3, 4);
+    if (!ptr)
+        return false;
+
+    invalidate_translation_at(ptr);
+    RAM_FLAGS(ptr) |= RF_EXEC_BREAKPOINT;
+    breakpoint_conds[phys_mem_addr(ptr)].stop = true;
+    return true;
 }
 
 uint32_t disasm_insn(uint32_t pc) {
@@ -173,8 +392,7 @@ static void set_debug_next(uint32_t *next) {
     if (debug_next != NULL)
         RAM_FLAGS(debug_next) &= ~RF_EXEC_DEBUG_NEXT;
     if (next != NULL) {
-        if (RAM_FLAGS(next) & RF_CODE_TRANSLATED)
-            flush_translations();
+        invalidate_translation_at(next);
         RAM_FLAGS(next) |= RF_EXEC_DEBUG_NEXT;
     }
     debug_next = next;
@@ -183,6 +401,40 @@ static void set_debug_next(uint32_t *next) {
 bool gdb_connected = false;
 FILE *debugger_input = NULL;
 
+void debug_print_jit_stats() {
+    const struct translate_stats &s = translate_stats;
+    uint64_t total = s.jit_instructions + s.interpreted_instructions;
+    gui_debug_printf("Translations: %llu (%llu dropped, %llu failed)\n",
+                     (unsigned long long) s.translations, (unsigned long long) s.dropped, (unsigned long long) s.fallbacks);
+    gui_debug_printf("Code cache: %llu bytes\n", (unsigned long long) s.code_bytes);
+    gui_debug_printf("Untranslatable instructions: %llu\n", (unsigned long long) s.no_translate);
+    static const char *const unimpl_names[UNIMPL_CLASSES] = {
+        "Thumb", "condition", "multiply", "halfword/doubleword transfer", "BX/MRS/MSR/CLZ",
+        "data processing", "byte/word transfer", "LDM/STM", "coprocessor/SWI/undefined"
+    };
+    for (int i = 0; i < UNIMPL_CLASSES; i++) {
+        if (s.unimpl[i])
+            gui_debug_printf("  %s: %llu\n", unimpl_names[i], (unsigned long long) s.unimpl[i]);
+    }
+    gui_debug_printf("Exits through translate_fix_pc: %llu\n", (unsigned long long) s.fix_pc);
+    // The compiler thread's blocks don't take time of the emulation
+    uint64_t blocks = s.translations + s.fallbacks - s.background;
+    gui_debug_printf("Time spent translating: %.3f ms (%.2f us per block)\n", s.translate_ns / 1e6,
+                     blocks ? s.translate_ns / 1e3 / blocks : 0.0);
+    if (s.background || s.discarded)
+        gui_debug_printf("Translated in the background: %llu (%llu outdated before installing)\n",
+                         (unsigned long long) s.background, (unsigned long long) s.discarded);
+    gui_debug_printf("Address cache misses: %llu\n", (unsigned long long) addr_cache_misses);
+    if (addr_cache_pagefaults)
+        gui_debug_printf("Address cache page faults: %llu\n", (unsigned long long) addr_cache_pagefaults);
+    gui_debug_printf("Instructions: %llu translated, %llu interpreted (%.1f%% translated)\n",
+                     (unsigned long long) s.jit_instructions, (unsigned long long) s.interpreted_instructions,
+                     total ? s.jit_instructions * 100.0 / total : 0.0);
+    if (translate_validate_interval)
+        gui_debug_printf("Validated blocks: %llu (%llu mismatches, %llu skipped)\n",
+                         (unsigned long long) s.validated, (unsigned long long) s.mismatches, (unsigned long long) s.validate_skipped);
+}
+
 // return 1: break (should stop being feed with debugger commands), 0: continue (can be feed with other debugger commands)
 int process_debug_cmd(char *cmdline) {
     char *cmd = strtok(cmdline, " \n\r");
@@ -195,21 +447,31 @@ int process_debug_cmd(char *cmdline) {
                     "b - stack backtrace\n"
                     "c - continue\n"
                     "d <address> - dump memory\n"
-                    "k <address> <+r|+w|+x|-r|-w|-x> - add/remove breakpoint\n"
+                    "k <address> <+r|+w|+x|-r|-w|-x> [size] - add/remove breakpoint, r and w on size bytes\n"
+                    "kc <address> [condition] - only stop at an exec breakpoint if the condition\n"
+                    "                           (<expr> [==|!=|<|>|<=|>= <expr>]) is met, [<expr>] reads memory\n"
+                    "ki <address> <count> - don't stop at an exec breakpoint the next count times\n"
+                    "jit - show translation statistics\n"
                     "k - show breakpoints\n"
                     "ln c - connect\n"
                     "ln s <file> - send a file\n"
                     "ln st <dir> - set target directory\n"
                     "mmu - dump memory mappings\n"
                     "n - continue until next instruction\n"
+                    "pf [cycles] - profile: sample the stack every cycles cycles, 0 stops\n"
+                    "pfw <file> - write the profile as folded stacks for flamegraphs\n"
                     "pr <address> - port or memory read\n"
                     "pw <address> <value> - port or memory write\n"
                     "r - show registers\n"
                     "rs <regnum> <value> - change register value\n"
+                    "rw [index] - list checkpoints or rewind to one\n"
                     "ss <address> <length> <string> - search a string\n"
+                    "ssx <address> <length> <hex bytes> - search a byte pattern\n"
                     "s - step instruction\n"
                     "t+ - enable instruction translation\n"
                     "t- - disable instruction translation\n"
+                    "tt <count> - translate code after it ran count times\n"
+                    "tr <on|off|count> - record an instruction trace or show its last count entries\n"
                     "u[a|t] [address] - disassemble memory\n"
                     "wm <file> <start> <size> - write memory to file\n"
                     "wf <file> <start> [size] - write file to memory\n"
@@ -220,6 +482,8 @@ int process_debug_cmd(char *cmdline) {
         backtrace(fp ? parse_expr(fp) : arm.reg[11]);
     } else if (!strcasecmp(cmd, "mmu")) {
         mmu_dump_tables();
+    } else if (!strcasecmp(cmd, "jit")) {
+        debug_print_jit_stats();
     } else if (!strcasecmp(cmd, "r")) {
         int i, show_spsr;
         uint32_t cpsr = get_cpsr();
@@ -266,14 +530,38 @@ int process_debug_cmd(char *cmdline) {
                     gui_debug_printf("Invalid register.\n");
             }
         }
+    } else if (!strcasecmp(cmd, "rw")) {
+        char *index_str = strtok(NULL, " \n\r");
+        unsigned int count = rewind_count();
+        if (!index_str) {
+            if (!count)
+                gui_debug_printf("No checkpoints to rewind to.\n");
+            for (unsigned int i = 0; i < count; i++)
+                gui_debug_printf("%3u: %.2f s ago\n", i, rewind_age(i));
+            return 0;
+        }
+        unsigned long index = strtoul(index_str, NULL, 0);
+        if (index >= count) {
+            gui_debug_printf("There is no checkpoint %lu.\n", index);
+            return 0;
+        }
+        gui_debug_printf("Rewinding %.2f s.\n", rewind_age(index));
+        rewind_to(index);
+        // Back into the debugger right after
+        cpu_events |= EVENT_DEBUG_STEP;
+        return 1;
     } else if (!strcasecmp(cmd, "k")) {
         const char *addr_str = strtok(NULL, " \n\r");
         const char *flag_str = strtok(NULL, " \n\r");
+        char *size_str = strtok(NULL, " \n\r");
         if (!flag_str)
             flag_str = "+x";
         if (addr_str) {
             uint32_t addr = parse_expr((char*) addr_str);
             void *ptr = virt_mem_ptr(addr & ~3, 4);
+            // Without a size, read and write breakpoints are on the word
+            uint32_t watch_size = size_str ? parse_expr(size_str) : 4;
+            void *watch_ptr = size_str ? virt_mem_ptr(addr, watch_size) : ptr;
             if (ptr) {
                 uint32_t *flags = &RAM_FLAGS(ptr);
                 bool on = true;
@@ -282,19 +570,19 @@ int process_debug_cmd(char *cmdline) {
                         case '+': on = true; break;
                         case '-': on = false; break;
                         case 'r':
-                            if (on) *flags |= RF_READ_BREAKPOINT;
-                            else *flags &= ~RF_READ_BREAKPOINT;
-                            break;
                         case 'w':
-                            if (on) *flags |= RF_WRITE_BREAKPOINT;
-                            else *flags &= ~RF_WRITE_BREAKPOINT;
+                            if (!watch_ptr || !memory_set_watchpoint(watch_ptr, watch_size,
+                                                                     tolower(*flag_str) == 'r' ? RF_READ_BREAKPOINT : RF_WRITE_BREAKPOINT, on))
+                                gui_debug_printf("Could not change the breakpoint.\n");
                             break;
                         case 'x':
                             if (on) {
-                                if (*flags & RF_CODE_TRANSLATED) flush_translations();
+                                invalidate_translation_at(ptr);
                                 *flags |= RF_EXEC_BREAKPOINT;
-                            } else
+                            } else {
                                 *flags &= ~RF_EXEC_BREAKPOINT;
+                                breakpoint_conds.erase(phys_mem_addr(ptr));
+                            }
                             break;
                     }
                 }
@@ -309,16 +597,61 @@ int process_debug_cmd(char *cmdline) {
                 uint32_t *flags_end = &RAM_FLAGS(mem_areas[area].ptr + mem_areas[area].size);
                 for (flags = flags_start; flags != flags_end; flags++) {
                     uint32_t addr = mem_areas[area].base + ((uint8_t *)flags - (uint8_t *)flags_start);
-                    if (*flags & (RF_READ_BREAKPOINT | RF_WRITE_BREAKPOINT | RF_EXEC_BREAKPOINT)) {
-                        gui_debug_printf("%08x %c%c%c\n",
-                                         addr,
-                                         (*flags & RF_READ_BREAKPOINT)  ? 'r' : ' ',
-                                         (*flags & RF_WRITE_BREAKPOINT) ? 'w' : ' ',
-                                         (*flags & RF_EXEC_BREAKPOINT)  ? 'x' : ' ');
+                    if (*flags & RF_EXEC_BREAKPOINT) {
+                        gui_debug_printf("%08x   x", addr);
+                        auto it = breakpoint_conds.find(addr);
+                        if (it != breakpoint_conds.end()) {
+                            const breakpoint_cond &bp = it->second;
+                            if (!bp.lhs.empty())
+                                gui_debug_printf(" if %s%s%s", bp.lhs.c_str(), bp.op.c_str(), bp.rhs.c_str());
+                            if (bp.ignore)
+                                gui_debug_printf(" ignore %x", bp.ignore);
+                            if (bp.stop)
+                                gui_debug_printf(" stop");
+                            gui_debug_printf(" hits %u", bp.hits);
+                        }
+                        gui_debug_printf("\n");
                     }
                 }
             }
+
+            unsigned int count;
+            const mem_watchpoint *watchpoints = memory_watchpoints(&count);
+            for (unsigned int i = 0; i < count; i++)
+                gui_debug_printf("%08x %c%c  size %x\n", phys_mem_addr(watchpoints[i].ptr),
+                                 (watchpoints[i].type & RF_READ_BREAKPOINT)  ? 'r' : ' ',
+                                 (watchpoints[i].type & RF_WRITE_BREAKPOINT) ? 'w' : ' ',
+                                 watchpoints[i].size);
         }
+    } else if (!strcasecmp(cmd, "kc") || !strcasecmp(cmd, "ki")) {
+        bool ignore = !strcasecmp(cmd, "ki");
+        char *addr_str = strtok(NULL, " \n\r");
+        // The condition may have spaces, which aren't part of expressions
+        char *arg = strtok(NULL, "\n\r");
+        void *ptr = addr_str ? virt_mem_ptr(parse_expr(addr_str) & ~3, 4) : NULL;
+        if (!ptr || !(RAM_FLAGS(ptr) & RF_EXEC_BREAKPOINT)) {
+            gui_debug_printf("There is no exec breakpoint at that address.\n");
+            return 0;
+        }
+
+        std::string value;
+        for (; arg && *arg; arg++)
+            if (*arg != ' ')
+                value += *arg;
+
+        uint32_t phys = phys_mem_addr(ptr);
+        breakpoint_cond bp = breakpoint_conds.count(phys) ? breakpoint_conds[phys] : breakpoint_cond();
+        if (ignore)
+            bp.ignore = parse_expr(&value[0]);
+        else if (!value.empty() && !breakpoint_set_condition(bp, value))
+            return 0;
+        else if (value.empty())
+            bp.lhs = bp.op = bp.rhs = "";
+
+        if (bp.lhs.empty() && !bp.ignore && !bp.stop)
+            breakpoint_conds.erase(phys);
+        else
+            breakpoint_conds[phys] = bp;
     } else if (!strcasecmp(cmd, "c")) {
         return 1;
     } else if (!strcasecmp(cmd, "s")) {
@@ -432,6 +765,22 @@ int process_debug_cmd(char *cmdline) {
     } else if (!strcasecmp(cmd, "t-")) {
         flush_translations();
         do_translate = false;
+    } else if (!strcasecmp(cmd, "tt")) {
+        char *count_str = strtok(NULL, " \n\r");
+        if (!count_str) {
+            gui_debug_printf("Translation threshold: %u\n", translate_threshold);
+            return 0;
+        }
+        uint32_t threshold = parse_expr(count_str);
+        translate_threshold = threshold < TRANSLATE_THRESHOLD_MAX ? threshold : TRANSLATE_THRESHOLD_MAX;
+    } else if (!strcasecmp(cmd, "tr")) {
+        char *arg = strtok(NULL, " \n\r");
+        if (!arg)
+            gui_debug_printf("Tracing is %s\n", trace_enabled ? "on" : "off");
+        else if (!strcasecmp(arg, "on") || !strcasecmp(arg, "off"))
+            trace_enable(!strcasecmp(arg, "on"));
+        else
+            trace_dump(parse_expr(arg));
     } else if (!strcasecmp(cmd, "wm") || !strcasecmp(cmd, "wf")) {
         bool frommem = cmd[1] != 'f';
         char *filename = strtok(NULL, " \n\r");
@@ -472,38 +821,54 @@ int process_debug_cmd(char *cmdline) {
         }
         fclose(f);
         return 0;
-    } else if (!strcasecmp(cmd, "ss")) {
+    } else if (!strcasecmp(cmd, "ss") || !strcasecmp(cmd, "ssx")) {
+        bool hex = !strcasecmp(cmd, "ssx");
         char *addr_str = strtok(NULL, " \n\r");
         char *len_str = strtok(NULL, " \n\r");
-        char *string = strtok(NULL, " \n\r");
+        char *string = strtok(NULL, hex ? "\n\r" : " \n\r");
         if (!addr_str || !len_str || !string) {
             gui_debug_printf("Missing parameters.\n");
-        } else {
-            uint32_t addr = parse_expr(addr_str);
-            uint32_t len = parse_expr(len_str);
-            char *strptr = (char*) phys_mem_ptr(addr, len);
-            char *ptr = strptr;
-            char *endptr = strptr + len;
-            if (ptr) {
-                size_t slen = strlen(string);
-                while (1) {
-                    ptr = (char*) memchr(ptr, *string, endptr - ptr);
-                    if (!ptr) {
-                        gui_debug_printf("String not found.\n");
-                        return 0;
-                    }
-                    if (!memcmp(ptr, string, slen)) {
-                        uint32_t found_addr = ptr - strptr + addr;
-                        gui_debug_printf("Found at address %08x.\n", found_addr);
-                        return 0;
-                    }
-                    if (ptr < endptr)
-                        ptr++;
+            return 0;
+        }
+
+        std::vector<uint8_t> pattern;
+        if (hex) {
+            // Pairs of hex digits, spaces between bytes are allowed
+            for (char *c = string; *c;) {
+                if (*c == ' ') {
+                    c++;
+                    continue;
                 }
-            } else {
-                gui_debug_printf("Address range %08x-%08x is not in RAM.\n", addr, addr + len - 1);
+                if (!isxdigit(c[0]) || !isxdigit(c[1])) {
+                    gui_debug_printf("Invalid hex pattern.\n");
+                    return 0;
+                }
+                char byte[3] = { c[0], c[1], 0 };
+                pattern.push_back(strtoul(byte, NULL, 16));
+                c += 2;
             }
+        } else
+            pattern.assign(string, string + strlen(string));
+
+        uint32_t addr = parse_expr(addr_str);
+        uint32_t len = parse_expr(len_str);
+        uint64_t end = (uint64_t) addr + len;
+        unsigned int hits = 0;
+        const unsigned int max_hits = 100;
+        uint32_t found;
+        while (hits < max_hits && addr < end
+               && debug_search_memory(addr, end - addr, pattern.data(), pattern.size(), &found)) {
+            gui_debug_printf("Found at address %08x.\n", found);
+            hits++;
+            if (found + 1 == 0)
+                break;
+            addr = found + 1;
         }
+
+        if (!hits)
+            gui_debug_printf("Pattern not found.\n");
+        else if (hits == max_hits)
+            gui_debug_printf("Stopped after %u matches.\n", max_hits);
         return 0;
     } else if (!strcasecmp(cmd, "int")) {
         gui_debug_printf("active		= %08x\n", intr.active);
@@ -524,6 +889,21 @@ int process_debug_cmd(char *cmdline) {
         int_set(atoi(strtok(NULL, " \n\r")), 1);
     } else if (!strcasecmp(cmd, "int-")) {
         int_set(atoi(strtok(NULL, " \n\r")), 0);
+    } else if (!strcasecmp(cmd, "pf")) {
+        char *interval_str = strtok(NULL, " \n\r");
+        if (interval_str)
+            profile_start(parse_expr(interval_str));
+        else
+            gui_debug_printf("Profiling is %s, %llu samples\n", profile_active() ? "on" : "off",
+                             (unsigned long long) profile_sample_count());
+    } else if (!strcasecmp(cmd, "pfw")) {
+        char *filename = strtok(NULL, " \n\r");
+        if (!filename) {
+            gui_debug_printf("Missing filename parameter\n");
+            return 0;
+        }
+        if (!profile_write(filename))
+            gui_perror(filename);
     } else if (!strcasecmp(cmd, "pr")) {
         // TODO: need to avoid entering debugger recursively
         // also, where should error() go?
@@ -696,6 +1076,12 @@ bool rdebug_bind(unsigned int port) {
         return false;
     }
 
+    // Connections get accepted and read by the I/O thread
+    if (!hostio_listen(HOSTIO_RDEBUG, listen_socket_fd)) {
+        gui_debug_printf("Remote debug: failed to start the I/O thread\n");
+        return false;
+    }
+
     return true;
 }
 
@@ -708,7 +1094,7 @@ void rdebug_recv(void) {
 
     int ret, on;
     if (socket_fd == -1) {
-        ret = accept(listen_socket_fd, NULL, NULL);
+        ret = hostio_accepted(HOSTIO_RDEBUG);
         if (ret == -1)
             return;
         socket_fd = ret;
@@ -726,35 +1112,16 @@ void rdebug_recv(void) {
         return;
     }
 
-    while(true)
+    while(!hostio_wait(HOSTIO_RDEBUG, 100))
     {
-        fd_set rfds;
-        FD_ZERO(&rfds);
-        FD_SET((unsigned)socket_fd, &rfds);
-        struct timeval zero = {0, 100000};
-        ret = select(socket_fd + 1, &rfds, NULL, NULL, &zero);
-        if (ret == -1 && errno == EBADF) {
-            gui_debug_printf("Remote debug: connection closed.\n");
-            #ifdef __MINGW32__
-                closesocket(socket_fd);
-            #else
-                close(socket_fd);
-            #endif
-            socket_fd = 0;
-        }
-        else if (!ret) // No data available
+        if(exiting)
         {
-            if(exiting)
-            {
-                close(socket_fd);
-                socket_fd = -1;
-                return;
-            }
-
-            gui_do_stuff(false);
+            hostio_disconnect(HOSTIO_RDEBUG);
+            socket_fd = -1;
+            return;
         }
-        else // Data available
-            break;
+
+        gui_do_stuff(false);
     }
 
     size_t buf_remain = sizeof(rdebug_inbuf) - rdebug_inbuf_used;
@@ -763,29 +1130,13 @@ void rdebug_recv(void) {
         return;
     }
 
-#ifdef __MINGW32__
-    ssize_t rv = recv(socket_fd, &rdebug_inbuf[rdebug_inbuf_used], buf_remain, 0);
-#else
-    ssize_t rv = recv(socket_fd, (void*) &rdebug_inbuf[rdebug_inbuf_used], buf_remain, 0);
-#endif
-    if (!rv) {
+    int rv = hostio_read(HOSTIO_RDEBUG, &rdebug_inbuf[rdebug_inbuf_used], buf_remain);
+    if (rv < 0) {
         gui_debug_printf("Remote debug: connection closed.\n");
-#ifdef __MINGW32__
-        closesocket(socket_fd);
-#else
-        close(socket_fd);
-#endif
+        hostio_disconnect(HOSTIO_RDEBUG);
         socket_fd = -1;
         return;
     }
-    if (rv < 0 && errno == EAGAIN) {
-        /* no data for now, call back when the socket is readable */
-        return;
-    }
-    if (rv < 0) {
-        log_socket_error("Remote debug: connection error");
-        return;
-    }
     rdebug_inbuf_used += rv;
 
     char *line_start = rdebug_inbuf;
@@ -803,6 +1154,8 @@ void rdebug_recv(void) {
 volatile bool in_debugger = false;
 
 void debugger(enum DBG_REASON reason, uint32_t addr) {
+    // What the guest printed up to the stop
+    serial_flush();
     gui_debugger_entered_or_left(in_debugger = true);
     if (gdb_connected)
         gdbstub_debugger(reason, addr);
@@ -813,15 +1166,11 @@ void debugger(enum DBG_REASON reason, uint32_t addr) {
 
 void rdebug_quit()
 {
-    if(socket_fd != -1)
-    {
-        close(socket_fd);
-        socket_fd = -1;
-    }
-
     if(listen_socket_fd != -1)
     {
-        close(listen_socket_fd);
+        hostio_stop(HOSTIO_RDEBUG);
         listen_socket_fd = -1;
     }
+
+    socket_fd = -1;
 }
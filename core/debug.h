@@ -30,9 +30,24 @@ enum DBG_REASON {
 };
 
 void *virt_mem_ptr(uint32_t addr, uint32_t size);
+/* Finds the first of the pattern_len bytes at pattern in the len bytes at the
+   virtual address addr. Pages which aren't memory are skipped, pages which
+   follow in memory get searched in one piece. */
+bool debug_search_memory(uint32_t addr, uint32_t len, const void *pattern, uint32_t pattern_len, uint32_t *found);
 void backtrace(uint32_t fp);
+// Stores up to max return addresses of the frames which backtrace would show
+unsigned int backtrace_returns(uint32_t fp, uint32_t *returns, unsigned int max);
+void debug_print_jit_stats();
 int process_debug_cmd(char *cmdline);
 void debugger(enum DBG_REASON reason, uint32_t addr);
+/* Whether the exec breakpoint on the instruction at ptr stops, checked by
+   the CPU loops so that its condition and ignore count don't need the
+   debugger to be entered first */
+bool debug_exec_breakpoint(const void *ptr);
+/* Stops the emulation, setting exiting, before the code at the virtual
+   address addr runs. The address gets translated right away, like for
+   the exec breakpoints of the debugger. Returns false if it isn't memory. */
+bool debug_set_stop_pc(uint32_t addr);
 void rdebug_recv(void);
 bool rdebug_bind(unsigned int port);
 void rdebug_quit();
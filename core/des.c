@@ -179,8 +179,11 @@ void des_write_word(uint32_t addr, uint32_t value) {
         case 0x10008: case 0x1000C:
         case 0x10010: case 0x10014:
         case 0x10018: case 0x1001C:
-            des.key[(addr - 8) >> 2 & 7] = value;
-            des.key_schedule_valid = false;
+            // Rewriting the same key keeps the schedule
+            if (des.key[(addr - 8) >> 2 & 7] != value) {
+                des.key[(addr - 8) >> 2 & 7] = value;
+                des.key_schedule_valid = false;
+            }
             return;
     }
     bad_write_word(addr, value);
@@ -1,12 +1,21 @@
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cctype>
 #include <csetjmp>
-
-#include <fcntl.h>
-
-#include <zlib.h>
+#include <cstring>
+#include <iterator>
+#include <vector>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+    #define BACKGROUND_SNAPSHOTS
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
 
 #include "emu.h"
 #include "translate.h"
@@ -14,17 +23,33 @@
 #include "mmu.h"
 #include "gdbstub.h"
 #include "usblink_queue.h"
+#include "gzip_file.h"
+#include "rewind.h"
+#include "shmem.h"
+#include "snapshot_file.h"
+#include "trace.h"
 #include "os/os.h"
 
 /* cycle_count_delta is a (usually negative) number telling what the time is relative
  * to the next scheduled event. See sched.c */
 int cycle_count_delta = 0;
 
-int throttle_delay = 10; /* in milliseconds */
+double throttle_speed = 1.0;
 
 uint32_t cpu_events;
 
 bool do_translate = true;
+bool do_store_translations = false;
+bool write_perf_map = false;
+bool use_huge_pages = false;
+bool protect_translated_code = false;
+bool incremental_snapshots = false;
+bool map_snapshots = false;
+bool snapshot_translations = false;
+const char *shared_state_name = nullptr;
+unsigned int translate_threshold = 0;
+unsigned int translate_validate_interval = 0;
+bool translate_background = false;
 uint32_t product = 0x0E0, features = 0, asic_user_flags = 0;
 bool turbo_mode = false;
 
@@ -35,15 +60,14 @@ std::string path_boot1, path_flash;
 
 void *restart_after_exception[32];
 
-int log_enabled[MAX_LOG];
-FILE *log_file[MAX_LOG];
-void logprintf(int type, const char *str, ...) {
-    if (log_enabled[type]) {
-        va_list va;
-        va_start(va, str);
-        vfprintf(log_file[type], str, va);
-        va_end(va);
-    }
+uint64_t idle_cycles = 0;
+
+static volatile bool gui_requested = false;
+
+void emu_request_gui() {
+    gui_requested = true;
+    // Like EmuThread::stop, this ends the current time slice early
+    cycle_count_delta = 0;
 }
 
 void emuprintf(const char *format, ...) {
@@ -72,6 +96,8 @@ void error(const char *fmt, ...) {
     gui_debug_vprintf(fmt, va);
     gui_debug_printf("\n");
     va_end(va);
+    if (trace_enabled)
+        trace_dump(32);
     debugger(DBG_EXCEPTION, 0);
     cpu_events |= EVENT_RESET;
     #ifndef NO_SETJMP
@@ -92,6 +118,67 @@ int exec_hack() {
 
 extern "C" void usblink_timer();
 
+/* Keeps emulated time running at throttle_speed times the real time. The
+   real time at which each interval should end follows from the number of
+   intervals since the start, so only the lead accumulated so far gets slept
+   off and late intervals are made up for by the next ones. */
+static void throttle_interval_wait()
+{
+    using throttle_clock = std::chrono::steady_clock;
+    static throttle_clock::time_point start;
+    static uint64_t intervals = 0; // Since start
+    static double speed = 0;
+
+    auto now = throttle_clock::now(), due = start;
+    if(speed == throttle_speed)
+        due += std::chrono::microseconds((int64_t)(intervals * 10000 / speed));
+    // Start over with a different speed, after turbo mode or a pause or if the emulation can't keep up
+    if(speed != throttle_speed || now - due > std::chrono::milliseconds(100))
+    {
+        start = due = now;
+        intervals = 0;
+        speed = throttle_speed;
+    }
+    intervals++;
+
+    if(due > now)
+        throttle_timer_wait(std::chrono::duration_cast<std::chrono::microseconds>(due - now).count());
+}
+
+struct emu_metrics emu_metrics;
+
+// Over seconds, from the counters of the last call
+static void emu_metrics_update(double speed, double seconds)
+{
+    static uint64_t prev_jit, prev_interpreted, prev_translations, prev_flushes, prev_misses, prev_pagefaults, prev_mmio, prev_frames;
+    static double prev_cpu_time = -1;
+
+    uint64_t jit = translate_stats.jit_instructions - prev_jit,
+             interpreted = translate_stats.interpreted_instructions - prev_interpreted;
+    double cpu_time = os_thread_cpu_time();
+
+    emu_metrics.speed = speed;
+    emu_metrics.mips = (jit + interpreted) / seconds / 1e6;
+    emu_metrics.jit_percent = jit + interpreted ? jit * 100.0 / (jit + interpreted) : 0;
+    emu_metrics.translations = (translate_stats.translations - prev_translations) / seconds;
+    emu_metrics.flushes = (addr_cache_flushes - prev_flushes) / seconds;
+    emu_metrics.addr_cache_misses = (addr_cache_misses - prev_misses) / seconds;
+    emu_metrics.addr_cache_pagefaults = (addr_cache_pagefaults - prev_pagefaults) / seconds;
+    emu_metrics.mmio_accesses = (mmio_accesses - prev_mmio) / seconds;
+    emu_metrics.host_cpu_percent = cpu_time >= 0 && prev_cpu_time >= 0 ? (cpu_time - prev_cpu_time) * 100 / seconds : -1;
+    emu_metrics.fps = (lcd_frames - prev_frames) / seconds;
+
+    prev_jit = translate_stats.jit_instructions;
+    prev_interpreted = translate_stats.interpreted_instructions;
+    prev_translations = translate_stats.translations;
+    prev_flushes = addr_cache_flushes;
+    prev_misses = addr_cache_misses;
+    prev_pagefaults = addr_cache_pagefaults;
+    prev_mmio = mmio_accesses;
+    prev_frames = lcd_frames;
+    prev_cpu_time = cpu_time;
+}
+
 void throttle_interval_event(int index)
 {
     event_repeat(index, 27000000 / 100);
@@ -121,35 +208,20 @@ void throttle_interval_event(int index)
     auto time = std::chrono::duration_cast<std::chrono::microseconds>(interval_end - prev).count();
     if (time >= 500000) {
         speed = (double)10000 * (intervals - prev_intervals) / time;
+        emu_metrics_update(speed, time / 1e6);
         gui_show_speed(speed);
         prev_intervals = intervals;
         prev = interval_end;
     }
 
-    gui_do_stuff(true);
+    rewind_interval_event();
 
-    if (!turbo_mode)
-		throttle_timer_wait();
-}
+    serial_flush();
 
-size_t gzip_filesize(const char *path)
-{
-    #if __BYTE_ORDER == __LITTLE_ENDIAN
-        int fp = open(path, O_RDONLY);
-        if(fp == -1)
-            return false;
-
-        // The last four bytes of a gzip file are the uncompressed size (% 2^32)
-        lseek(fp, -4, SEEK_END);
-        size_t ret = 0;
-        if(read(fp, &ret, 4) != 4)
-            ret = 0;
+    gui_do_stuff(true);
 
-        close(fp);
-        return ret;
-    #else
-        #error "Not implemented"
-    #endif
+    if (!turbo_mode)
+        throttle_interval_wait();
 }
 
 struct gui_busy_raii {
@@ -173,35 +245,93 @@ static void emu_reset()
     memory_reset();
 }
 
+// What emu_start takes from a snapshot for after the memory got set up
+static struct {
+    std::vector<uint32_t> breakpoints;
+    std::vector<snapshot_watchpoint> watchpoints;
+    std::vector<uint32_t> translations; // For emu_prepare_loop
+} resumed;
+
+// The data of the section id, which are in whole elements of type T
+template <typename T> static void snapshot_section_read(const snapshot_image *image, uint32_t id, std::vector<T> &out)
+{
+    out.clear();
+
+    // Already checked by emu_snapshot_decode
+    auto data = static_cast<const uint8_t *>(image->data);
+    snapshot_header header;
+    memcpy(&header, data, sizeof(header));
+    size_t offset = sizeof(header);
+    for(uint32_t i = 0; i < header.section_count; i++)
+    {
+        snapshot_section_header section;
+        memcpy(&section, data + offset, sizeof(section));
+        offset += sizeof(section);
+        if(section.id == SECTION_MEM_PAGES)
+            return;
+
+        if(section.id == id)
+        {
+            out.resize(section.size / sizeof(T));
+            memcpy(out.data(), data + offset, out.size() * sizeof(T));
+            return;
+        }
+        offset += section.size;
+    }
+}
+
+// After memory_resume and the ROM flags, which both would drop them
+static void resume_breakpoints()
+{
+    for(uint32_t addr : resumed.breakpoints)
+        if(void *ptr = phys_mem_ptr(addr, 4))
+            RAM_FLAGS(ptr) |= RF_EXEC_BREAKPOINT;
+
+    for(auto &watchpoint : resumed.watchpoints)
+        if(void *ptr = phys_mem_ptr(watchpoint.addr, watchpoint.size))
+            memory_set_watchpoint(ptr, watchpoint.size, watchpoint.type & (RF_READ_BREAKPOINT | RF_WRITE_BREAKPOINT), true);
+
+    resumed.breakpoints.clear();
+    resumed.watchpoints.clear();
+}
+
+/* Reads the uncompressed snapshot into a malloc'd buffer, except for the
+   memory pages which can be mapped from the file */
+static bool snapshot_read(const char *file, snapshot_image *image)
+{
+    image->path = file;
+    image->snapshot = nullptr;
+    image->data = snapshot_file_read(file, &image->size, &image->mapping);
+    if(!image->data || !emu_snapshot_decode(image))
+    {
+        emu_snapshot_image_free(image);
+        return false;
+    }
+
+    return true;
+}
+
 bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapshot_file)
 {
     gui_busy_raii gui_busy;
 
     if(snapshot_file)
     {
-        // Open snapshot
-        size_t snapshot_size = gzip_filesize(snapshot_file);
-        if(snapshot_size < sizeof(emu_snapshot))
-            return false;
-
-        gzFile gzf = gzopen(snapshot_file, "r");
-        if(!gzf)
-            return false;
-
-        auto snapshot = (struct emu_snapshot *) malloc(snapshot_size);
-        if(!snapshot)
-        {
-            gzclose(gzf);
+        snapshot_image image;
+        if(!snapshot_read(snapshot_file, &image))
             return false;
-        }
+        auto snapshot = image.snapshot;
 
-        if((size_t) gzread(gzf, snapshot, snapshot_size) != snapshot_size)
+        // An incremental snapshot has the rest of the memory in its base
+        snapshot_image base = {};
+        if(snapshot->mem.base_mem_id
+           && (!memchr(snapshot->mem.base_path, 0, sizeof(snapshot->mem.base_path))
+               || !snapshot_read(snapshot->mem.base_path, &base)))
         {
-            gzclose(gzf);
-            free(snapshot);
+            gui_debug_printf("Could not read the base snapshot %.511s\n", snapshot->mem.base_path);
+            emu_snapshot_image_free(&image);
             return false;
         }
-        gzclose(gzf);
 
         //sched_reset();
         sched.items[SCHED_THROTTLE].clock = CLOCK_27M;
@@ -215,19 +345,23 @@ bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapsh
 
         // Resume components
         uint32_t sdram_size;
-        if(snapshot->sig != SNAPSHOT_SIG
-                || snapshot->version != SNAPSHOT_VER
-                || !flash_resume(snapshot)
+        if(!flash_resume(snapshot)
                 || !flash_read_settings(&sdram_size, &product, &features, &asic_user_flags)
                 || !cpu_resume(snapshot)
-                || !memory_resume(snapshot)
+                || !memory_resume(&image, base.snapshot ? &base : nullptr)
                 || !sched_resume(snapshot))
         {
             emu_cleanup();
-            free(snapshot);
+            emu_snapshot_image_free(&base);
+            emu_snapshot_image_free(&image);
             return false;
         }
-        free(snapshot);
+
+        snapshot_section_read(&image, SECTION_BREAKPOINTS, resumed.breakpoints);
+        snapshot_section_read(&image, SECTION_WATCHPOINTS, resumed.watchpoints);
+        snapshot_section_read(&image, SECTION_TRANSLATIONS, resumed.translations);
+        emu_snapshot_image_free(&base);
+        emu_snapshot_image_free(&image);
     }
     else
     {
@@ -261,15 +395,22 @@ bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapsh
         emu_cleanup();
         return false;
     }
-    fread(rom, 1, 0x80000, f);
+    if(gzip_detect(f))
+        gzip_read(f, rom, 0x80000, 0x80000, nullptr);
+    else
+        fread(rom, 1, 0x80000, f);
     fclose(f);
 
+    resume_breakpoints();
+
 #ifndef NO_TRANSLATION
     if(!translate_init())
     {
         gui_debug_printf("Could not init JIT, disabling translation.\n");
         do_translate = false;
     }
+    else if(do_store_translations && !translate_store_open((path_flash + ".tstore").c_str()))
+        gui_debug_printf("Could not open the translation store, not keeping translations.\n");
 #endif
 
     os_exception_frame_t frame;
@@ -291,21 +432,55 @@ bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapsh
     return true;
 }
 
-void emu_loop(bool reset)
+// After a reset or resume, nothing of the caches is valid anymore
+static void emu_prepare_loop()
 {
-    if(reset)
-    {
-        reset:
-        emu_reset();
-    }
-
     gdbstub_reset();
 
     addr_cache_flush();
     flush_translations();
 
-    sched_update_next_event(0);
+#ifndef NO_TRANSLATION
+    // What was translated when the snapshot got written, without waiting for it to get hot again
+    for(uint32_t pc : resumed.translations)
+    {
+        bool thumb = pc & 1;
+        pc &= ~1u;
+        void *ptr = do_translate ? virt_mem_ptr(pc, thumb ? 2 : 4) : nullptr;
+        if(!ptr || (RAM_FLAGS((uintptr_t) ptr & ~3) & (RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE
+                                                      | RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_ARMLOADER_CB)))
+            continue;
+
+        auto start = std::chrono::steady_clock::now();
+        bool translated;
+        if(thumb)
+            translated = translate_thumb(pc, static_cast<uint16_t *>(ptr));
+        else
+        {
+            translate(pc, static_cast<uint32_t *>(ptr));
+            translated = RAM_FLAGS(ptr) & RF_CODE_TRANSLATED;
+        }
+        translate_stats.translate_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        ++(translated ? translate_stats.translations : translate_stats.fallbacks);
+    }
+#endif
+    resumed.translations.clear();
+
+    // Set by sched_reset or sched_resume, or where the last loop stopped
+    sched_update_next_event(sched_cputick());
+}
+
+void emu_loop(bool reset)
+{
+    if(reset)
+        emu_reset();
+
+    emu_prepare_loop();
+    emu_continue_loop();
+}
 
+void emu_continue_loop()
+{
     exiting = false;
 
 // clang segfaults with that, for an iOS build :(
@@ -316,10 +491,26 @@ void emu_loop(bool reset)
 
     while (!exiting) {
         sched_process_pending_events();
+        sched_process_host_events();
+#ifdef TRANSLATE_BACKGROUND
+        translate_install();
+#endif
+        if (gui_requested) {
+            gui_requested = false;
+            gui_do_stuff(false);
+        }
         while (!exiting && cycle_count_delta < 0) {
             if (cpu_events & EVENT_RESET) {
                 gui_status_printf("Reset");
-                goto reset;
+                emu_reset();
+                emu_prepare_loop();
+                continue;
+            }
+
+            if (cpu_events & EVENT_REWIND) {
+                cpu_events &= ~EVENT_REWIND;
+                rewind_apply();
+                continue;
             }
 
             if (cpu_events & (EVENT_FIQ | EVENT_IRQ)) {
@@ -335,6 +526,14 @@ void emu_loop(bool reset)
                 arm.reg[15] += 4;
                 cpu_exception((cpu_events & EVENT_FIQ) ? EX_FIQ : EX_IRQ);
             }
+
+            if (cpu_events == EVENT_WAITING && arm.interrupts == 0) {
+                /* Running the wait instruction again would only end the
+                   timeslice, so skip right to the next event. */
+                idle_cycles -= cycle_count_delta;
+                cycle_count_delta = 0;
+                continue;
+            }
             cpu_events &= ~EVENT_WAITING;
 
             if (arm.cpsr_low28 & 0x20)
@@ -343,21 +542,17 @@ void emu_loop(bool reset)
                 cpu_arm_loop();
         }
     }
+
+    serial_flush();
 }
 
-bool emu_suspend(const char *file)
+emu_snapshot *emu_snapshot_begin(size_t *size)
 {
-    gui_busy_raii gui_busy;
-
-    gzFile gzf = gzopen(file, "wb");
-
-    size_t size = sizeof(emu_snapshot) + flash_suspend_flexsize();
-    auto snapshot = (struct emu_snapshot *) malloc(size);
+    *size = sizeof(emu_snapshot) + flash_suspend_flexsize();
+    // Zeroed, so that the paths are terminated
+    auto snapshot = (struct emu_snapshot *) calloc(1, *size);
     if(!snapshot)
-    {
-        gzclose(gzf);
-        return false;
-    }
+        return nullptr;
 
     snapshot->product = product;
     snapshot->asic_user_flags = asic_user_flags;
@@ -367,24 +562,363 @@ bool emu_suspend(const char *file)
 
     if(!flash_suspend(snapshot)
             || !cpu_suspend(snapshot)
-            || !sched_suspend(snapshot)
-            || !memory_suspend(snapshot))
+            || !sched_suspend(snapshot))
     {
         free(snapshot);
-        gzclose(gzf);
+        return nullptr;
+    }
+
+    return snapshot;
+}
+
+// Where the sections with a fixed size are in emu_snapshot
+struct snapshot_section_desc {
+    uint32_t id;
+    size_t offset, size;
+    bool string; // Up to size - 1 characters
+};
+
+#define SECTION(id, member) { id, offsetof(emu_snapshot, member), sizeof(((emu_snapshot *) nullptr)->member), false }
+#define SECTION_RANGE(id, first, end) { id, offsetof(emu_snapshot, first), offsetof(emu_snapshot, end) - offsetof(emu_snapshot, first), false }
+#define SECTION_STRING(id, member) { id, offsetof(emu_snapshot, member), sizeof(((emu_snapshot *) nullptr)->member), true }
+
+static const snapshot_section_desc snapshot_sections[] = {
+    SECTION_RANGE(SECTION_PRODUCT, product, path_boot1),
+    SECTION_STRING(SECTION_PATH_BOOT1, path_boot1),
+    SECTION_STRING(SECTION_PATH_FLASH, path_flash),
+    SECTION(SECTION_SCHED, schedule),
+    SECTION(SECTION_CPU, cpu_state),
+    SECTION(SECTION_FLASH, flash.state),
+    SECTION_RANGE(SECTION_MEM, mem.sdram_size, mem.base_path),
+    SECTION_STRING(SECTION_MEM_BASE_PATH, mem.base_path),
+    SECTION(SECTION_GPIO, mem.gpio),
+    SECTION(SECTION_UNKNOWN_CX, mem.unknown_cx),
+    SECTION(SECTION_WATCHDOG, mem.watchdog),
+    SECTION(SECTION_PMU, mem.pmu),
+    SECTION(SECTION_KEYPAD, mem.keypad),
+    SECTION(SECTION_HDQ1W, mem.hdq1w),
+    SECTION(SECTION_USB, mem.usb),
+    SECTION(SECTION_LCD, mem.lcd),
+    SECTION(SECTION_ADC, mem.adc),
+    SECTION(SECTION_DES, mem.des),
+    SECTION(SECTION_SHA256, mem.sha256),
+    SECTION(SECTION_TIMER, mem.timer),
+    SECTION(SECTION_TIMER_CX, mem.timer_cx),
+    SECTION(SECTION_SERIAL, mem.serial),
+    SECTION(SECTION_INTERRUPT, mem.intr),
+    SECTION(SECTION_MEMCTL_CX, mem.memctl_cx),
+    SECTION(SECTION_SERIAL_CX, mem.serial_cx),
+};
+
+#undef SECTION
+#undef SECTION_RANGE
+#undef SECTION_STRING
+
+static const size_t snapshot_page_record = sizeof(uint32_t) + sizeof(uint64_t) + MEM_SNAPSHOT_PAGE_SIZE;
+
+static void put_section(std::vector<uint8_t> &sections, uint32_t id, const void *data, size_t size)
+{
+    snapshot_section_header header = { id, uint32_t(size) };
+    size_t offset = sections.size();
+    sections.resize(offset + sizeof(header) + (data ? size : 0));
+    memcpy(sections.data() + offset, &header, sizeof(header));
+    if(data)
+        memcpy(sections.data() + offset + sizeof(header), data, size);
+}
+
+std::vector<snapshot_segment> emu_snapshot_segments(const emu_snapshot *snapshot, size_t size, bool mappable,
+                                                    bool extras, std::vector<uint8_t> &sections)
+{
+    snapshot_header header = { SNAPSHOT_SIG, SNAPSHOT_VER, SNAPSHOT_COMPAT_VER, 0 };
+    sections.assign(sizeof(header), 0);
+    for(auto &desc : snapshot_sections)
+    {
+        auto data = reinterpret_cast<const char *>(snapshot) + desc.offset;
+        put_section(sections, desc.id, data, desc.string ? strlen(data) : desc.size);
+    }
+    put_section(sections, SECTION_FLASH_BLOCKS, snapshot->flash.nand_modified_blocks, size - sizeof(emu_snapshot));
+    header.section_count = sizeof(snapshot_sections) / sizeof(*snapshot_sections) + 1;
+
+    if(extras)
+    {
+        std::vector<uint32_t> breakpoints;
+        for(auto &area : mem_areas)
+            for(uint32_t offset = 0; offset < area.size; offset += 4)
+                if(RAM_FLAGS(area.ptr + offset) & RF_EXEC_BREAKPOINT)
+                    breakpoints.push_back(area.base + offset);
+        put_section(sections, SECTION_BREAKPOINTS, breakpoints.data(), breakpoints.size() * sizeof(uint32_t));
+
+        unsigned int count;
+        const mem_watchpoint *watched = memory_watchpoints(&count);
+        std::vector<snapshot_watchpoint> watchpoints;
+        for(unsigned int i = 0; i < count; i++)
+            watchpoints.push_back({ phys_mem_addr(watched[i].ptr), watched[i].size, watched[i].type });
+        put_section(sections, SECTION_WATCHPOINTS, watchpoints.data(), watchpoints.size() * sizeof(snapshot_watchpoint));
+        header.section_count += 2;
+
+        if(snapshot_translations)
+        {
+            std::vector<uint32_t> pcs(translate_list(nullptr, 0));
+            pcs.resize(std::min<size_t>(pcs.size(), translate_list(pcs.data(), pcs.size())));
+            put_section(sections, SECTION_TRANSLATIONS, pcs.data(), pcs.size() * sizeof(uint32_t));
+            header.section_count++;
+        }
+    }
+
+    // The memory pages follow, straight from the emulated memory
+    uint32_t page_count = snapshot->mem.page_count;
+    put_section(sections, SECTION_MEM_PAGES, nullptr, page_count * snapshot_page_record);
+    header.section_count++;
+    memcpy(sections.data(), &header, sizeof(header));
+
+    const uint64_t *digests;
+    const uint32_t *pages = memory_suspend_pages(&digests);
+    std::vector<snapshot_segment> segments = {
+        { sections.data(), sections.size(), false },
+        { pages, page_count * sizeof(*pages), false },
+        { digests, page_count * sizeof(*digests), false },
+    };
+    for(uint32_t i = 0; i < page_count; i++)
+    {
+        const uint8_t *page = mem_and_flags + pages[i] * MEM_SNAPSHOT_PAGE_SIZE;
+        if(i && pages[i] == pages[i - 1] + 1)
+            segments.back().size += MEM_SNAPSHOT_PAGE_SIZE;
+        else
+            segments.push_back({ page, MEM_SNAPSHOT_PAGE_SIZE, mappable });
+    }
+
+    return segments;
+}
+
+bool emu_snapshot_decode(snapshot_image *image)
+{
+    image->snapshot = nullptr;
+
+    // Only the pages may have been left in the file
+    auto data = static_cast<const uint8_t *>(image->data);
+    size_t available = std::min(image->size, image->mapping.start);
+    snapshot_header header;
+    if(available < sizeof(header))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+    if(header.sig != SNAPSHOT_SIG || header.compat_version > SNAPSHOT_VER)
+    {
+        gui_debug_printf("Not a snapshot or written by a newer version\n");
+        return false;
+    }
+
+    // Find the sections first, the size of the flash blocks is needed for allocating
+    struct found_section {
+        snapshot_section_header header;
+        const uint8_t *data;
+    };
+    std::vector<found_section> found;
+    size_t offset = sizeof(header), blocks_size = 0;
+    bool have_pages = false;
+    for(uint32_t i = 0; i < header.section_count; i++)
+    {
+        snapshot_section_header section;
+        if(have_pages || available - offset < sizeof(section))
+            return false;
+
+        memcpy(&section, data + offset, sizeof(section));
+        offset += sizeof(section);
+        if(section.id == SECTION_MEM_PAGES)
+        {
+            // Up to the end, possibly in the file
+            if(image->size - offset != section.size)
+                return false;
+            have_pages = true;
+        }
+        else if(available - offset < section.size)
+            return false;
+        else if(section.id == SECTION_FLASH_BLOCKS)
+            blocks_size = section.size;
+
+        found.push_back({ section, data + offset });
+        offset += section.size;
+    }
+
+    auto snapshot = static_cast<emu_snapshot *>(calloc(1, sizeof(emu_snapshot) + blocks_size));
+    if(!snapshot)
         return false;
+
+    // Unknown sections are from newer versions and can be skipped
+    uint64_t seen = 0;
+    bool success = have_pages;
+    for(auto &section : found)
+    {
+        if(section.header.id == SECTION_FLASH_BLOCKS)
+            memcpy(snapshot->flash.nand_modified_blocks, section.data, blocks_size);
+        else if(section.header.id != SECTION_MEM_PAGES)
+        {
+            auto desc = std::find_if(std::begin(snapshot_sections), std::end(snapshot_sections),
+                                     [&] (const snapshot_section_desc &d) { return d.id == section.header.id; });
+            if(desc == std::end(snapshot_sections))
+                continue;
+
+            if(desc->string ? section.header.size >= desc->size : section.header.size != desc->size)
+                success = false;
+            else
+                memcpy(reinterpret_cast<char *>(snapshot) + desc->offset, section.data, section.header.size);
+        }
+
+        if(section.header.id < 64)
+            seen |= uint64_t(1) << section.header.id;
     }
 
-    snapshot->sig = SNAPSHOT_SIG;
-    snapshot->version = SNAPSHOT_VER;
+    // All of them are needed
+    uint64_t required = uint64_t(1) << SECTION_FLASH_BLOCKS | uint64_t(1) << SECTION_MEM_PAGES;
+    for(auto &desc : snapshot_sections)
+        required |= uint64_t(1) << desc.id;
 
-    bool success = (size_t) gzwrite(gzf, snapshot, size) == size;
+    if(!success || (seen & required) != required
+       || found.back().header.size != snapshot->mem.page_count * snapshot_page_record)
+    {
+        free(snapshot);
+        return false;
+    }
+
+    image->snapshot = snapshot;
+    return true;
+}
+
+void emu_snapshot_image_free(snapshot_image *image)
+{
+    free(const_cast<void *>(image->data));
+    free(const_cast<emu_snapshot *>(image->snapshot));
+    image->data = nullptr;
+    image->snapshot = nullptr;
+}
+
+// Everything but memory_suspend_done
+static bool snapshot_write(const char *file)
+{
+    size_t size;
+    auto snapshot = emu_snapshot_begin(&size);
+    if(!snapshot)
+        return false;
+
+    bool success = memory_suspend(snapshot, file);
+    if(success)
+    {
+        std::vector<uint8_t> sections;
+        auto segments = emu_snapshot_segments(snapshot, size, map_snapshots, true, sections);
+        success = snapshot_file_write(file, segments.data(), segments.size());
+    }
 
     free(snapshot);
-    gzclose(gzf);
     return success;
 }
 
+bool emu_suspend(const char *file)
+{
+    gui_busy_raii gui_busy;
+
+    bool success = snapshot_write(file);
+    memory_suspend_done(file, success);
+    return success;
+}
+
+bool emu_suspend_copy(const char *file)
+{
+    gui_busy_raii gui_busy;
+
+    return snapshot_write(file);
+}
+
+#ifdef BACKGROUND_SNAPSHOTS
+// A snapshot which is written by a forked copy of the process
+static struct {
+    pid_t pid = -1;
+    std::string path;
+    uint8_t *result; // Shared with the child: whether it succeeded, then the memory_suspend_state
+    size_t result_size;
+} background;
+#endif
+static bool background_success = true;
+
+bool emu_suspend_background_finished(bool wait, bool *success)
+{
+#ifdef BACKGROUND_SNAPSHOTS
+    if(background.pid != -1)
+    {
+        int status;
+        pid_t ret;
+        while((ret = waitpid(background.pid, &status, wait ? 0 : WNOHANG)) == -1 && errno == EINTR);
+        if(ret == 0)
+            return false;
+
+        background_success = ret == background.pid && WIFEXITED(status) && WEXITSTATUS(status) == 0 && background.result[0];
+        if(background_success)
+        {
+            size_t state_size;
+            void *state = memory_suspend_state(&state_size);
+            memcpy(state, background.result + 1, state_size);
+        }
+        memory_suspend_done(background.path.c_str(), background_success);
+
+        munmap(background.result, background.result_size);
+        background.pid = -1;
+    }
+#else
+    (void) wait;
+#endif
+
+    if(success)
+        *success = background_success;
+    return true;
+}
+
+bool emu_suspend_background(const char *file)
+{
+    if(!emu_suspend_background_finished(false, nullptr))
+        return false;
+
+#ifdef BACKGROUND_SNAPSHOTS
+    // The child doesn't get the thread which saves the flash
+    flash_save_wait();
+
+    size_t state_size;
+    memory_suspend_state(&state_size);
+    background.result_size = 1 + state_size;
+    // The child wouldn't get a copy of shared memory
+    void *result = shmem_active() ? MAP_FAILED
+            : mmap(nullptr, background.result_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    if(result != MAP_FAILED)
+    {
+        background.result = static_cast<uint8_t *>(result);
+        background.result[0] = false;
+
+        /* The child gets a copy of the memory as it is now and has only this
+           thread, which must not get back into the emulation or the GUI. */
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            bool success = snapshot_write(file);
+            const void *state = memory_suspend_state(&state_size);
+            memcpy(background.result + 1, state, state_size);
+            background.result[0] = success;
+            _exit(success ? 0 : 1);
+        }
+
+        if(pid != -1)
+        {
+            background.pid = pid;
+            background.path = file;
+            return true;
+        }
+
+        munmap(result, background.result_size);
+    }
+#endif
+
+    // Not possible here, so do it right away
+    background_success = emu_suspend(file);
+    return background_success;
+}
+
 void emu_cleanup()
 {
     exiting = true;
@@ -396,9 +930,11 @@ void emu_cleanup()
     //addr_cache_deinit();
 
     #ifndef NO_TRANSLATION
+        translate_store_close();
         translate_deinit();
     #endif
 
+    rewind_clear();
     memory_reset();
     memory_deinitialize();
     flash_close();
@@ -9,6 +9,7 @@
 #include "flash.h"
 #include "mem.h"
 #include "lcd.h"
+#include "log.h"
 #include "schedule.h"
 
 #ifdef __cplusplus
@@ -19,7 +20,7 @@ extern "C" {
 #endif
 
 // Can also be set manually
-#if !defined(__i386__) && !defined(__x86_64__) && !(defined(__arm__) && !defined(__thumb__)) && !(defined(__aarch64__))
+#if !defined(__i386__) && !defined(__x86_64__) && !(defined(__arm__) && !defined(__thumb__)) && !(defined(__aarch64__)) && !defined(__EMSCRIPTEN__)
 #define NO_TRANSLATION
 #endif
 
@@ -35,18 +36,38 @@ static inline uint16_t BSWAP16(uint16_t x) { return x << 8 | x >> 8; }
 #define BSWAP32(x) __builtin_bswap32(x)
 
 extern int cycle_count_delta __asm__("cycle_count_delta");
-extern int throttle_delay;
+// CPU cycles since the reset, see schedule.c
+static inline uint64_t sched_cputick() { return sched.next_cputick + cycle_count_delta; }
+// How fast emulated time runs compared to the real time if not in turbo mode
+extern double throttle_speed;
 extern uint32_t cpu_events __asm__("cpu_events");
 #define EVENT_IRQ 1
 #define EVENT_FIQ 2
 #define EVENT_RESET 4
 #define EVENT_DEBUG_STEP 8
 #define EVENT_WAITING 16
+#define EVENT_REWIND 32 // See rewind_to
 
 // Settings
 extern volatile bool exiting, debug_on_start, debug_on_warn;
 extern BootOrder boot_order;
 extern bool do_translate;
+// Keep translations in a file next to the flash image, see translation_store.h
+extern bool do_store_translations;
+// Describe translated code to perf in /tmp, see translation_perfmap.h
+extern bool write_perf_map;
+// Back guest memory and translated code with huge pages if possible
+extern bool use_huge_pages;
+// Catch writes to translated code by protecting its pages instead of checking each store
+extern bool protect_translated_code;
+// Only store the memory pages which changed since the last full snapshot
+extern bool incremental_snapshots;
+// Store which code is translated, so that resuming translates it right away
+extern bool snapshot_translations;
+// Store memory pages uncompressed, so that resuming maps them from the file
+extern bool map_snapshots;
+// Share the guest memory and the LCD under this name from emu_start on, or not if NULL, see shmem.h
+extern const char *shared_state_name;
 extern uint32_t product, features, asic_user_flags;
 
 #define FEATURE_CX 0x05
@@ -59,17 +80,36 @@ extern uint32_t product, features, asic_user_flags;
 #define emulate_cx (product >= 0x0F0)
 extern bool turbo_mode;
 
-enum { LOG_CPU, LOG_IO, LOG_FLASH, LOG_INTS, LOG_ICOUNT, LOG_USB, LOG_GDB, MAX_LOG };
-#define LOG_TYPE_TBL "CIFQ#UG"
-extern int log_enabled[MAX_LOG];
-void logprintf(int type, const char *str, ...);
+// Measured over about half a second each, in throttle_interval_event
+struct emu_metrics {
+    double speed; // Compared to the real calculator
+    double mips; // Guest instructions per second, in millions
+    double jit_percent; // Of those, how many ran in translated code
+    double translations; // Per second, like the rest
+    double flushes; // Of addr_cache
+    double addr_cache_misses;
+    double addr_cache_pagefaults; // Only with a sparse addr_cache (Windows)
+    double mmio_accesses;
+    double host_cpu_percent; // Of a host core used by the emulation thread, negative if unknown
+    double fps; // Frames which looked different
+};
+// Only written by the emulation thread, others may read slightly inconsistent values
+extern struct emu_metrics emu_metrics;
+// Cycles skipped while the CPU waited for an interrupt, see emu_continue_loop
+extern uint64_t idle_cycles;
+
 void emuprintf(const char *format, ...);
 
+/* For other threads: makes emu_loop call gui_do_stuff(false) between
+   instructions as soon as possible, not only on the next throttle interval */
+void emu_request_gui(void);
+
 void warn(const char *fmt, ...);
 __attribute__((noreturn)) void error(const char *fmt, ...);
 void throttle_timer_on();
 void throttle_timer_off();
-void throttle_timer_wait();
+// Sleeps for usec microseconds, the emulation is ahead of the real time
+void throttle_timer_wait(unsigned int usec);
 int exec_hack();
 void add_reset_proc(void (*proc)(void));
 
@@ -80,31 +120,88 @@ extern void *restart_after_exception[32];
 // GUI callbacks
 void gui_do_stuff(bool wait); // Called every once in a while...
 int gui_getchar(); // Serial input
-void gui_putchar(char c); // Serial output
+void gui_serial_write(const char *data, size_t size); // Serial output, in batches from serial_flush
 void gui_debug_printf(const char *fmt, ...); // Debug output #1
 void gui_debug_vprintf(const char *fmt, va_list ap); // Debug output #2
 void gui_perror(const char *msg); // Error output
 void gui_set_busy(bool busy); // To change the cursor, for instance
 void gui_status_printf(const char *fmt, ...); // Status output
-void gui_show_speed(double speed); // Speed display output
+void gui_show_speed(double speed); // Speed display output, emu_metrics got updated before
 void gui_usblink_changed(bool state); // Notification for usblink state changes
 void gui_debugger_entered_or_left(bool entered); // Notification for debug events
+void gui_lcd_changed(); // A frame which looks different got shown, see lcd_event
 
 /* callback == 0: Stop requesting input
  * callback != 0: Call callback with input, then stop requesting */
 typedef void (*debug_input_cb)(const char *input);
 void gui_debugger_request_input(debug_input_cb callback);
 
+/* The uncompressed data of a snapshot starts with a snapshot_header, followed
+   by sections of a snapshot_section_header and size bytes each, one per device
+   and setting. Readers skip the sections they don't know, so a new section only
+   needs a new SNAPSHOT_VER. SNAPSHOT_COMPAT_VER is the oldest version which can
+   still read the snapshot and only has to be raised if the meaning of an
+   existing section changes. The memory pages are always the last section. */
 #define SNAPSHOT_SIG 0xCAFEBEE0
-#define SNAPSHOT_VER 1
+#define SNAPSHOT_VER 6
+#define SNAPSHOT_COMPAT_VER 5
 
-typedef struct emu_snapshot {
+struct snapshot_header {
     uint32_t sig; // SNAPSHOT_SIG
-    uint32_t version; // SNAPSHOT_VER
+    uint16_t version; // SNAPSHOT_VER of the writer
+    uint16_t compat_version; // SNAPSHOT_COMPAT_VER of the writer
+    uint32_t section_count;
+};
+
+struct snapshot_section_header {
+    uint32_t id;
+    uint32_t size; // Of the data that follows
+};
+
+// Never reuse or renumber these
+enum {
+    SECTION_PRODUCT = 1, // product and asic_user_flags
+    SECTION_PATH_BOOT1 = 2, // Strings are stored without terminator
+    SECTION_PATH_FLASH = 3,
+    SECTION_SCHED = 4,
+    SECTION_CPU = 5,
+    SECTION_FLASH = 6,
+    SECTION_FLASH_BLOCKS = 7, // flash.nand_modified_blocks
+    SECTION_MEM = 8, // sdram_size up to base_mem_id
+    SECTION_MEM_BASE_PATH = 9,
+    SECTION_GPIO = 10,
+    SECTION_UNKNOWN_CX = 11,
+    SECTION_WATCHDOG = 12,
+    SECTION_PMU = 13,
+    SECTION_KEYPAD = 14,
+    SECTION_HDQ1W = 15,
+    SECTION_USB = 16,
+    SECTION_LCD = 17,
+    SECTION_ADC = 18,
+    SECTION_DES = 19,
+    SECTION_SHA256 = 20,
+    SECTION_TIMER = 21,
+    SECTION_TIMER_CX = 22,
+    SECTION_SERIAL = 23,
+    SECTION_INTERRUPT = 24,
+    SECTION_MEMCTL_CX = 25,
+    SECTION_SERIAL_CX = 26,
+    SECTION_MEM_PAGES = 27, // See mem_snapshot
+    SECTION_BREAKPOINTS = 28, // Physical addresses with RF_EXEC_BREAKPOINT
+    SECTION_WATCHPOINTS = 29, // snapshot_watchpoint each
+    SECTION_TRANSLATIONS = 30, // See translate_list, only with snapshot_translations
+};
+
+struct snapshot_watchpoint {
+    uint32_t addr, size, type; // Physical address, see memory_set_watchpoint
+};
+
+// What the sections get read into and written from
+typedef struct emu_snapshot {
     int product, asic_user_flags;
     char path_boot1[512];
     char path_flash[512];
-    sched_state sched;
+    sched_state schedule;
     arm_state cpu_state;
     mem_snapshot mem;
     flash_snapshot flash;
@@ -112,11 +209,37 @@ typedef struct emu_snapshot {
 
 bool emu_start(unsigned int port_gdb, unsigned int port_rdbg, const char *snapshot);
 void emu_loop(bool reset);
+// Runs again after emu_loop returned, keeping the translations and the address cache
+void emu_continue_loop();
 bool emu_suspend(const char *file);
+// Like emu_suspend, but later incremental snapshots don't refer to this one
+bool emu_suspend_copy(const char *file);
+/* Writes the snapshot from a forked copy of the process while the emulation
+   goes on, or right away if that's not possible. Returns false if it
+   can't be started, also while the previous one is still being written. */
+bool emu_suspend_background(const char *file);
+/* Returns whether the last one is done, wait blocks until then.
+   success tells whether it got written. */
+bool emu_suspend_background_finished(bool wait, bool *success);
 void emu_cleanup();
 
 #ifdef __cplusplus
 }
+
+#include <vector>
+
+// For snapshots which aren't written to a file, see rewind.cpp
+// Suspends everything but the memory into a malloc'd snapshot of size bytes
+emu_snapshot *emu_snapshot_begin(size_t *size);
+/* The sections of the snapshot, encoded into sections, followed by the memory
+   pages picked by memory_suspend or memory_checkpoint. With extras, also the
+   breakpoints and the translations, which rewinding leaves alone anyway. */
+std::vector<snapshot_segment> emu_snapshot_segments(const emu_snapshot *snapshot, size_t size, bool mappable,
+                                                    bool extras, std::vector<uint8_t> &sections);
+// Reads the sections of image->data into a malloc'd image->snapshot
+bool emu_snapshot_decode(snapshot_image *image);
+// Frees both buffers of the image
+void emu_snapshot_image_free(snapshot_image *image);
 #endif
 
 #endif
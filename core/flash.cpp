@@ -4,9 +4,15 @@
 #include <string.h>
 
 #include <algorithm>
+#include <future>
+#include <mutex>
+#include <system_error>
+#include <vector>
 
 #include "emu.h"
 #include "flash.h"
+#include "gzip_file.h"
+#include "parallel.h"
 #include "mem.h"
 #include "cpu.h"
 #include "os/os.h"
@@ -19,6 +25,16 @@ static const struct nand_metrics chips[] = {
     { 0xEC, 0xA1, 0x840, 6, 0x10000 }, // Samsung 1 GBit
 };
 
+/* Whether nand_data is a copy on write mapping of the file. Only the pages
+   which get read are loaded then and only modified ones take up memory of
+   their own, the others are shared with other instances using the image. */
+static bool nand_mapped = false;
+
+static size_t nand_size()
+{
+    return size_t(nand.metrics.page_size) * nand.metrics.num_pages;
+}
+
 bool nand_initialize(bool large, const char *filename) {
     if(nand_data)
         nand_deinitialize();
@@ -26,19 +42,39 @@ bool nand_initialize(bool large, const char *filename) {
     memcpy(&nand.metrics, &chips[large], sizeof(nand_metrics));
     nand.state = 0xFF;
 
-    nand_data = (uint8_t*) os_map_cow(filename, large ? 132*1024*1024 : 33*1024*1024);
+    FILE *file = fopen_utf8(filename, "rb");
+    bool compressed = file && gzip_detect(file);
+    if(!compressed)
+        nand_data = (uint8_t*) os_map_cow(filename, nand_size());
+
+    nand_mapped = nand_data != nullptr;
     if(!nand_data)
-        nand_deinitialize();
+    {
+        // Some file systems can't be mapped and compressed images have to be inflated, so read all of it
+        nand_data = (uint8_t*) malloc(nand_size());
+        if(!file || !nand_data
+           || (compressed ? gzip_read(file, nand_data, nand_size(), nand_size(), nullptr) != nand_size()
+                          : fread(nand_data, nand_size(), 1, file) != 1))
+        {
+            free(nand_data);
+            nand_data = nullptr;
+        }
+    }
+    if(file)
+        fclose(file);
 
     return nand_data != nullptr;
 }
 
 void nand_deinitialize()
 {
-    if(nand_data)
-        os_unmap_cow(nand_data, (nand.metrics.num_pages == 0x840) ? 132*1024*1024 : 33*1024*1024);
+    if(nand_data && nand_mapped)
+        os_unmap_cow(nand_data, nand_size());
+    else
+        free(nand_data);
 
     nand_data = nullptr;
+    nand_mapped = false;
 }
 
 void nand_write_command_byte(uint8_t command) {
@@ -137,6 +173,10 @@ void nand_write_address_byte(uint8_t byte) {
 
 uint8_t nand_read_data_byte() {
     //putchar('r');
+    // Reading a page is by far the most common
+    if (likely(nand.state == 0x00 && nand.nand_col < nand.metrics.page_size))
+        return nand_data[nand.nand_row * nand.metrics.page_size + nand.nand_col++];
+
     switch (nand.state) {
         case 0x00:
             if (nand.nand_col >= nand.metrics.page_size) {
@@ -157,6 +197,13 @@ uint8_t nand_read_data_byte() {
 }
 uint32_t nand_read_data_word() {
     //putchar('R');
+    if (likely(nand.state == 0x00 && nand.nand_col + 4 <= nand.metrics.page_size)) {
+        uint32_t value;
+        memcpy(&value, &nand_data[nand.nand_row * nand.metrics.page_size + nand.nand_col], sizeof(value));
+        nand.nand_col += 4;
+        return value;
+    }
+
     switch (nand.state) {
         case 0x00:
             if (nand.nand_col + 4 > nand.metrics.page_size) {
@@ -171,6 +218,21 @@ uint32_t nand_read_data_word() {
             return 0;
     }
 }
+// Same as size calls of nand_read_data_byte, but a page is copied at once
+void nand_read_data(uint8_t *data, uint32_t size) {
+    if (nand.state != 0x00) {
+        for (uint32_t i = 0; i < size; i++)
+            data[i] = nand_read_data_byte();
+        return;
+    }
+
+    // Past the end of the page it reads 0
+    uint32_t available = nand.nand_col < nand.metrics.page_size ? nand.metrics.page_size - nand.nand_col : 0,
+             count = std::min(size, available);
+    memcpy(data, &nand_data[nand.nand_row * nand.metrics.page_size + nand.nand_col], count);
+    memset(data + count, 0, size - count);
+    nand.nand_col += count;
+}
 void nand_write_data_byte(uint8_t value) {
     //putchar('w');
     switch (nand.state) {
@@ -185,6 +247,22 @@ void nand_write_data_byte(uint8_t value) {
             return;
     }
 }
+// Same as size calls of nand_write_data_byte
+void nand_write_data(const uint8_t *data, uint32_t size) {
+    if (nand.state != 0x80) {
+        for (uint32_t i = 0; i < size; i++)
+            nand_write_data_byte(data[i]);
+        return;
+    }
+
+    uint32_t used = nand.nand_buffer_pos + nand.nand_col,
+             available = used < nand.metrics.page_size ? nand.metrics.page_size - used : 0,
+             count = std::min(size, available);
+    memcpy(&nand.nand_buffer[nand.nand_buffer_pos], data, count);
+    nand.nand_buffer_pos += count;
+    if (count < size)
+        warn("NAND write past end of page");
+}
 void nand_write_data_word(uint32_t value) {
     //putchar('W');
     switch (nand.state) {
@@ -204,36 +282,36 @@ void nand_write_data_word(uint32_t value) {
 }
 
 
-static uint32_t parity(uint32_t word) {
-    word ^= word >> 16;
-    word ^= word >> 8;
-    word ^= word >> 4;
-    return 0x6996 >> (word & 15) & 1;
-}
-static uint32_t ecc_calculate(uint8_t page[512]) {
+/* The Hamming code of a 512 byte sector. From the top, each pair of bits
+   has the parities of the two halves of all bit positions which have a
+   certain bit of their index set or not, from bit 11 (which half of the
+   sector) down to bit 0 (odd or even bits). Folding the upper half of the
+   sector onto the lower one over and over gives all of those with a single
+   pass over the data, 64 bits at a time. The parity of the half with the
+   bit clear is enough, the other one follows from the parity of all bits. */
+static uint32_t ecc_calculate(const uint8_t page[512]) {
+    uint64_t in[64];
+    memcpy(in, page, sizeof(in));
+
     uint32_t ecc = 0;
-    uint32_t *in = (uint32_t *)page;
-    uint32_t temp[64];
-    int i, j;
-    uint32_t words;
-
-    for (j = 64; j != 0; j >>= 1) {
-        words = 0;
-        for (i = 0; i < j; i++) {
+    for (int j = 32; j != 0; j >>= 1) {
+        uint64_t words = 0;
+        for (int i = 0; i < j; i++) {
             words ^= in[i];
-            temp[i] = in[i] ^ in[i + j];
+            in[i] ^= in[i + j];
         }
-        ecc = ecc << 2 | parity(words);
-        in = temp;
+        ecc = ecc << 2 | __builtin_parityll(words);
     }
 
-    words = temp[0];
-    ecc = ecc << 2 | parity(words & 0x0000FFFF);
-    ecc = ecc << 2 | parity(words & 0x00FF00FF);
-    ecc = ecc << 2 | parity(words & 0x0F0F0F0F);
-    ecc = ecc << 2 | parity(words & 0x33333333);
-    ecc = ecc << 2 | parity(words & 0x55555555);
-    return (ecc | ecc << 1) ^ (parity(words) ? 0x555555 : 0xFFFFFF);
+    // Even and odd 32-bit words, then down to the bits of all words together
+    ecc = ecc << 2 | __builtin_parity(uint32_t(in[0]));
+    uint32_t words = uint32_t(in[0]) ^ uint32_t(in[0] >> 32);
+    ecc = ecc << 2 | __builtin_parity(words & 0x0000FFFF);
+    ecc = ecc << 2 | __builtin_parity(words & 0x00FF00FF);
+    ecc = ecc << 2 | __builtin_parity(words & 0x0F0F0F0F);
+    ecc = ecc << 2 | __builtin_parity(words & 0x33333333);
+    ecc = ecc << 2 | __builtin_parity(words & 0x55555555);
+    return (ecc | ecc << 1) ^ (__builtin_parity(words) ? 0x555555 : 0xFFFFFF);
 }
 
 void nand_phx_reset(void) {
@@ -270,15 +348,13 @@ void nand_phx_write_word(uint32_t addr, uint32_t value) {
             if (nand.phx.operation & 0x400800) {
                 uint8_t *ptr = (uint8_t*) phys_mem_ptr(nand.phx.ram_address, nand.phx.op_size);
                 if (!ptr)
-                    error("NAND controller: address %x is not in RAM\n", addr);
-
-                if (nand.phx.operation & 0x000800) {
-                    for (i = 0; i < nand.phx.op_size; i++)
-                        nand_write_data_byte(ptr[i]);
-                } else {
-                    for (i = 0; i < nand.phx.op_size; i++)
-                        ptr[i] = nand_read_data_byte();
-                }
+                    error("NAND controller: address %x is not in RAM\n", nand.phx.ram_address);
+
+                // DMA, so whole pages at once
+                if (nand.phx.operation & 0x000800)
+                    nand_write_data(ptr, nand.phx.op_size);
+                else
+                    nand_read_data(ptr, nand.phx.op_size);
 
                 if (nand.phx.op_size >= 0x200) { // XXX: what really triggers ECC?
                     // Set ECC register
@@ -379,6 +455,10 @@ void nand_cx_write_word(uint32_t addr, uint32_t value) {
 }
 
 FILE *flash_file = NULL;
+// The file couldn't be opened for writing, so changes can only be saved elsewhere
+static bool flash_read_only = false;
+// The file is gzip compressed, so it's read and written as a whole
+static bool flash_compressed = false;
 
 typedef enum Partition {
     PartitionManuf=0,
@@ -403,19 +483,97 @@ size_t flash_partition_offset(Partition p, struct nand_metrics *nand_metrics, ui
     return (*(uint32_t*)(nand_data + parttable_cx[p-1]))/0x800 * 0x840;
 }
 
+// A save by flash_save_changes which may still be written in the background
+struct flash_save {
+    struct run {
+        size_t offset; // In nand_data and the file
+        size_t size;
+        uint32_t first_block, block_count;
+    };
+    std::vector<run> runs;
+    std::vector<uint8_t> data; // Of the runs, one after another, or all of nand_data if compressed
+    bool compressed;
+    std::future<bool> result;
+};
+
+static std::mutex save_mutex;
+static flash_save pending_save;
+
+static bool flash_save_write(FILE *file, const flash_save *save)
+{
+    if(save->compressed)
+    {
+        // Rewritten in place, as the file can't be replaced while it's open on all platforms
+        size_t size;
+        void *compressed = gzip_buffer_write(save->data.data(), save->data.size(), &size);
+        bool success = compressed && os_write_at(file, compressed, size, 0) && os_truncate(file, size);
+        free(compressed);
+        return success;
+    }
+
+    size_t data_offset = 0;
+    for(auto &run : save->runs)
+    {
+        if(!os_write_at(file, save->data.data() + data_offset, run.size, run.offset))
+            return false;
+        data_offset += run.size;
+    }
+
+    return true;
+}
+
+/* Waits until the pending save is written. If that failed, its blocks
+   count as modified again. save_mutex has to be locked. */
+static bool flash_save_wait_locked()
+{
+    if(!pending_save.result.valid())
+        return true;
+
+    bool success = pending_save.result.get();
+    if(!success)
+    {
+        gui_status_printf("Flash: Could not save the modified blocks");
+        for(auto &run : pending_save.runs)
+            std::fill_n(nand.nand_block_modified + run.first_block, run.block_count, true);
+    }
+
+    pending_save.runs.clear();
+    pending_save.data.clear();
+    return success;
+}
+
+bool flash_save_wait()
+{
+    std::lock_guard<std::mutex> lock(save_mutex);
+    return flash_save_wait_locked();
+}
+
 bool flash_open(const char *filename) {
     bool large = false;
+    flash_save_wait();
     if(flash_file)
         fclose(flash_file);
 
     flash_file = fopen_utf8(filename, "r+b");
+    flash_read_only = !flash_file;
+    if (!flash_file)
+        flash_file = fopen_utf8(filename, "rb");
 
     if (!flash_file) {
         gui_perror(filename);
         return false;
     }
-    fseek(flash_file, 0, SEEK_END);
-    uint32_t size = ftell(flash_file);
+    if (flash_read_only)
+        emuprintf("%s is read-only, changes can't be saved to it\n", filename);
+
+    uint32_t size = 0;
+    flash_compressed = gzip_detect(flash_file);
+    if (flash_compressed)
+        gzip_filesize(flash_file, &size);
+    else {
+        fseek(flash_file, 0, SEEK_END);
+        size = ftell(flash_file);
+    }
 
     if (size == 33*1024*1024)
         large = false;
@@ -442,30 +600,89 @@ bool flash_save_changes() {
         gui_status_printf("No flash loaded!");
         return false;
     }
-    uint32_t block, count = 0;
-    uint32_t block_size = nand.metrics.page_size << nand.metrics.log2_pages_per_block;
-    for (block = 0; block < nand.metrics.num_pages; block += 1 << nand.metrics.log2_pages_per_block) {
-        if (nand.nand_block_modified[block >> nand.metrics.log2_pages_per_block]) {
-            fseek(flash_file, block * nand.metrics.page_size, SEEK_SET);
-            fwrite(&nand_data[block * nand.metrics.page_size], block_size, 1, flash_file);
-            nand.nand_block_modified[block >> nand.metrics.log2_pages_per_block] = false;
-            count++;
-        }
+    if (flash_read_only) {
+        gui_status_printf("Flash: The image is read-only");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(save_mutex);
+    flash_save_wait_locked();
+
+    // Copy the modified blocks, so that the emulation can go on while they get written
+    const uint32_t num_blocks = nand.metrics.num_pages >> nand.metrics.log2_pages_per_block,
+            block_size = nand.metrics.page_size << nand.metrics.log2_pages_per_block;
+    uint32_t count = 0;
+    for (uint32_t block = 0; block < num_blocks; block++) {
+        if (!nand.nand_block_modified[block])
+            continue;
+
+        // Consecutive blocks are written at once
+        uint32_t end = block + 1;
+        while (end < num_blocks && nand.nand_block_modified[end])
+            end++;
+
+        const size_t offset = size_t(block) * block_size, size = size_t(end - block) * block_size;
+        pending_save.runs.push_back({ offset, size, block, end - block });
+        if (!flash_compressed)
+            pending_save.data.insert(pending_save.data.end(), nand_data + offset, nand_data + offset + size);
+        std::fill(nand.nand_block_modified + block, nand.nand_block_modified + end, false);
+
+        count += end - block;
+        block = end;
+    }
+
+    if (!count) {
+        gui_status_printf("Flash: No modified blocks to save");
+        return true;
+    }
+
+    // A compressed image can only be written as a whole
+    pending_save.compressed = flash_compressed;
+    if (flash_compressed)
+        pending_save.data.assign(nand_data, nand_data + nand_size());
+
+    FILE *file = flash_file;
+    const flash_save *save = &pending_save;
+    try {
+        pending_save.result = std::async(std::launch::async, [file, save, count] {
+            bool success = flash_save_write(file, save);
+            if (success)
+                gui_status_printf("Flash: Saved %u modified blocks", count);
+            return success;
+        });
+    } catch (const std::system_error &) {
+        // Without threads it's written right away
+        std::promise<bool> written;
+        written.set_value(flash_save_write(file, save));
+        pending_save.result = written.get_future();
+        if (!flash_save_wait_locked())
+            return false;
+        gui_status_printf("Flash: Saved %u modified blocks", count);
     }
-    fflush(flash_file);
-    gui_status_printf("Flash: Saved %d modified blocks", count);
+
     return true;
 }
 
 int flash_save_as(const char *filename) {
-    FILE *f = fopen_utf8(filename, "wb");
+    // The whole image goes into the new file anyway
+    flash_save_wait();
+    // Blocks get read back from it by flash_rewind
+    FILE *f = fopen_utf8(filename, "w+b");
     if (!f) {
         emuprintf("NAND flash: could not open ");
         gui_perror(filename);
         return 1;
     }
     emuprintf("Saving flash image %s...", filename);
-    if (!fwrite(nand_data, nand.metrics.page_size * nand.metrics.num_pages, 1, f) || fflush(f)) {
+    // Compressed if the name asks for it
+    size_t name_len = strlen(filename);
+    bool compressed = name_len > 3 && strcmp(filename + name_len - 3, ".gz") == 0;
+    size_t size = nand_size();
+    void *data = compressed ? gzip_buffer_write(nand_data, size, &size) : nand_data;
+    bool written = data && fwrite(data, size, 1, f) && !fflush(f);
+    if (compressed)
+        free(data);
+    if (!written) {
         fclose(f);
         f = NULL;
         remove(filename);
@@ -478,6 +695,8 @@ int flash_save_as(const char *filename) {
         fclose(flash_file);
 
     flash_file = f;
+    flash_read_only = false;
+    flash_compressed = compressed;
     printf("done\n");
     return 0;
 }
@@ -500,32 +719,60 @@ static void ecc_fix(uint8_t *nand_data, struct nand_metrics nand_metrics, int pa
     }
 }
 
-static uint32_t load_file_part(uint8_t *nand_data, struct nand_metrics nand_metrics, uint32_t offset, FILE *f, uint32_t length) {
+// Pages from first to end which got loaded and still need their ECC
+struct ecc_range {
+    uint32_t first, end;
+};
+
+static void ecc_fix_ranges(uint8_t *nand_data, struct nand_metrics nand_metrics, const std::vector<ecc_range> &ranges) {
+    // Split into pieces of up to 1024 pages, so that all threads have something to do
+    std::vector<ecc_range> pieces;
+    for (auto &range : ranges)
+        for (uint32_t page = range.first; page < range.end; page += 1024)
+            pieces.push_back({ page, std::min(range.end, page + 1024) });
+
+    parallel_for(pieces.size(), [&](size_t i) {
+        for (uint32_t page = pieces[i].first; page < pieces[i].end; page++)
+            ecc_fix(nand_data, nand_metrics, page);
+    });
+}
+
+/* Reads the file in large chunks and spreads them over the data part of the pages.
+   The ECC of the pages isn't fixed, their range is added to ecc instead. */
+static uint32_t load_file_part(uint8_t *nand_data, struct nand_metrics nand_metrics, uint32_t offset, FILE *f, uint32_t length, std::vector<ecc_range> &ecc) {
     uint32_t start = offset;
     uint32_t page_data_size = (nand_metrics.page_size & ~0x7F);
-    while (length > 0) {
-        uint32_t page = offset / page_data_size;
-        uint32_t pageoff = offset % page_data_size;
-        if (page >= nand_metrics.num_pages) {
-            printf("Preload image(s) too large\n");
-            return 0;
-        }
+    std::vector<uint8_t> buffer(page_data_size * 256);
+    bool too_large = false;
+    while (length > 0 && !too_large) {
+        size_t size = fread(buffer.data(), 1, std::min<size_t>(length, buffer.size()), f);
+        if (size == 0)
+            break;
 
-        uint32_t readsize = page_data_size - pageoff;
-        if (readsize > length) readsize = length;
+        for (size_t pos = 0; pos < size;) {
+            uint32_t page = offset / page_data_size;
+            uint32_t pageoff = offset % page_data_size;
+            if (page >= nand_metrics.num_pages) {
+                printf("Preload image(s) too large\n");
+                too_large = true;
+                break;
+            }
 
-        int ret = fread(&nand_data[page * nand_metrics.page_size + pageoff], 1, readsize, f);
-        if (ret <= 0)
-            break;
-        readsize = ret;
-        ecc_fix(nand_data, nand_metrics, page);
-        offset += readsize;
-        length -= readsize;
+            uint32_t copysize = std::min<size_t>(page_data_size - pageoff, size - pos);
+            memcpy(&nand_data[page * nand_metrics.page_size + pageoff], &buffer[pos], copysize);
+            pos += copysize;
+            offset += copysize;
+        }
+        length -= size;
     }
-    return offset - start;
+
+    // What got loaded before running out of pages still needs its ECC
+    if (offset != start)
+        ecc.push_back({ start / page_data_size, (offset - 1) / page_data_size + 1 });
+    return too_large ? 0 : offset - start;
 }
 
-static uint32_t load_file(uint8_t *nand_data, struct nand_metrics nand_metrics, Partition p, const char *filename, size_t off) {
+static uint32_t load_file(uint8_t *nand_data, struct nand_metrics nand_metrics, Partition p, const char *filename, size_t off, std::vector<ecc_range> &ecc) {
     FILE *f = fopen_utf8(filename, "rb");
     if (!f) {
         gui_perror(filename);
@@ -535,7 +782,7 @@ static uint32_t load_file(uint8_t *nand_data, struct nand_metrics nand_metrics,
     offset /= nand_metrics.page_size;
     offset *= nand_metrics.page_size & ~0x7F; // Convert offset into offset without spare bytes
     offset += off;
-    uint32_t size = load_file_part(nand_data, nand_metrics, offset, f, -1);
+    uint32_t size = load_file_part(nand_data, nand_metrics, offset, f, -1, ecc);
     fclose(f);
     return size;
 }
@@ -574,7 +821,7 @@ static uint32_t load_file(uint8_t *nand_data, struct nand_metrics nand_metrics,
     return 0;
 }*/
 
-static void preload(uint8_t *nand_data, struct nand_metrics nand_metrics, Partition p, const char *name, const char *filename) {
+static void preload(uint8_t *nand_data, struct nand_metrics nand_metrics, Partition p, const char *name, const char *filename, std::vector<ecc_range> &ecc) {
     uint32_t page = flash_partition_offset(p, &nand_metrics, nand_data) / nand_metrics.page_size;
     uint32_t manifest_size, image_size;
 
@@ -594,7 +841,7 @@ static void preload(uint8_t *nand_data, struct nand_metrics nand_metrics, Partit
             return false;*/
     } else {
         manifest_size = 0;
-        image_size = load_file(nand_data, nand_metrics, p, filename, 32);
+        image_size = load_file(nand_data, nand_metrics, p, filename, 32, ecc);
         if(!image_size)
             return;
     }
@@ -604,7 +851,7 @@ static void preload(uint8_t *nand_data, struct nand_metrics nand_metrics, Partit
     *(uint32_t *)&pagep[20] = BSWAP32(0x55F00155);
     *(uint32_t *)&pagep[24] = BSWAP32(manifest_size);
     *(uint32_t *)&pagep[28] = BSWAP32(image_size);
-    ecc_fix(nand_data, nand_metrics, page);
+    // The first page of the image is in ecc already
 }
 
 struct manuf_data_804 {
@@ -669,10 +916,17 @@ bool flash_create_new(bool flag_large_nand, const char **preload_file, unsigned
     if(!nand_data)
         return false;
 
-    memset(nand_data, 0xFF, *size);
+    // Erased, in pieces of 1024 pages to fault in the memory from all threads
+    size_t piece_size = nand_metrics.page_size * 1024;
+    parallel_for((*size + piece_size - 1) / piece_size, [&](size_t i) {
+        memset(nand_data + i * piece_size, 0xFF, std::min(piece_size, *size - i * piece_size));
+    });
 
+    std::vector<ecc_range> ecc;
     if (preload_file[0]) {
-        load_file(nand_data, nand_metrics, PartitionManuf, preload_file[0], 0);
+        load_file(nand_data, nand_metrics, PartitionManuf, preload_file[0], 0, ecc);
+        ecc_fix_ranges(nand_data, nand_metrics, ecc);
+        ecc.clear();
 
         // Overwrite some values to match the configuration
         struct manuf_data_804 *manuf = (struct manuf_data_804 *)&nand_data[0x844];
@@ -719,13 +973,23 @@ bool flash_create_new(bool flag_large_nand, const char **preload_file, unsigned
         ecc_fix(nand_data, nand_metrics, nand_metrics.page_size < 0x800 ? 4 : 1);
     }
 
-    if (preload_file[1]) load_file(nand_data, nand_metrics, PartitionBoot2, preload_file[1], 0); // Boot2 area
     size_t bootdata_offset = flash_partition_offset(PartitionBootdata, &nand_metrics, nand_data); // Bootdata
     memset(nand_data + bootdata_offset, 0xFF, nand_metrics.page_size);
     memset(nand_data + bootdata_offset + 0x62, 0, 414);
     memcpy(nand_data + bootdata_offset, bootdata, sizeof(bootdata));
-    if (preload_file[2]) load_file(nand_data, nand_metrics, PartitionDiags, preload_file[2], 0); // Diags area
-    if (preload_file[3]) preload(nand_data, nand_metrics, PartitionFilesystem, "IMAGE", preload_file[3]); // Filesystem/OS
+
+    /* The partitions are known with the manuf data in place, so they get loaded
+       at the same time. The ECC of all their pages is fixed afterwards, also
+       spread over all threads. */
+    std::vector<ecc_range> ecc_parts[3];
+    parallel_for(3, [&](size_t i) {
+        if (i == 0 && preload_file[1]) load_file(nand_data, nand_metrics, PartitionBoot2, preload_file[1], 0, ecc_parts[i]); // Boot2 area
+        if (i == 1 && preload_file[2]) load_file(nand_data, nand_metrics, PartitionDiags, preload_file[2], 0, ecc_parts[i]); // Diags area
+        if (i == 2 && preload_file[3]) preload(nand_data, nand_metrics, PartitionFilesystem, "IMAGE", preload_file[3], ecc_parts[i]); // Filesystem/OS
+    });
+    for (auto &part : ecc_parts)
+        ecc.insert(ecc.end(), part.begin(), part.end());
+    ecc_fix_ranges(nand_data, nand_metrics, ecc);
 
     return true;
 }
@@ -766,17 +1030,19 @@ bool flash_read_settings(uint32_t *sdram_size, uint32_t *product, uint32_t *feat
 
 std::string flash_read_type(FILE *flash)
 {
-    uint32_t i;
-    struct manuf_data_804 manuf;
-    if(fread(&i, sizeof(i), 1, flash) != 1)
+    // Only the start is needed, the rest of a compressed image doesn't get inflated
+    uint8_t start[0x844 + sizeof(manuf_data_804)];
+    if(gzip_detect(flash) ? gzip_read(flash, start, sizeof(start), sizeof(start), nullptr) != sizeof(start)
+                          : fread(start, sizeof(start), 1, flash) != 1)
         return "";
 
+    uint32_t i;
+    struct manuf_data_804 manuf;
+    memcpy(&i, start, sizeof(i));
     if(i == 0xFFFFFFFF)
         return "CAS+";
 
-    if((fseek(flash, 0x844 - sizeof(i), SEEK_CUR) != 0)
-    || (fread(&manuf, sizeof(manuf), 1, flash) != 1))
-        return "";
+    memcpy(&manuf, start + 0x844, sizeof(manuf));
 
     std::string ret;
     switch(manuf.product)
@@ -836,6 +1102,9 @@ std::string flash_read_type(FILE *flash)
 
 size_t flash_suspend_flexsize()
 {
+    // Blocks of a failed save have to go into the snapshot
+    flash_save_wait();
+
     const size_t num_blocks = nand.metrics.num_pages >> nand.metrics.log2_pages_per_block,
             block_size = nand.metrics.page_size << nand.metrics.log2_pages_per_block;
 
@@ -893,8 +1162,53 @@ bool flash_resume(const emu_snapshot *snapshot)
     return true;
 }
 
+bool flash_rewind(const emu_snapshot *snapshot)
+{
+    // Blocks are read back from the file
+    flash_save_wait();
+
+    const flash_snapshot *flash = &snapshot->flash;
+    if(!nand_data || memcmp(&nand.metrics, &flash->state.metrics, sizeof(nand.metrics)) != 0)
+        return false;
+
+    const uint8_t *cur_modified_block = flash->nand_modified_blocks;
+    const size_t num_blocks = nand.metrics.num_pages >> nand.metrics.log2_pages_per_block,
+            block_size = nand.metrics.page_size << nand.metrics.log2_pages_per_block;
+
+    bool success = true;
+    // Blocks of a compressed image are all inflated at once afterwards
+    bool from_file[sizeof(nand.nand_block_modified)] = {}, any_from_file = false;
+    for(unsigned int cur_modified_block_nr = 0; cur_modified_block_nr < num_blocks; ++cur_modified_block_nr)
+    {
+        uint8_t *block = nand_data + block_size * cur_modified_block_nr;
+        if(flash->state.nand_block_modified[cur_modified_block_nr])
+        {
+            memcpy(block, cur_modified_block, block_size);
+            cur_modified_block += block_size;
+        }
+        else if(nand.nand_block_modified[cur_modified_block_nr] && flash_compressed)
+            any_from_file = from_file[cur_modified_block_nr] = true;
+        else if(nand.nand_block_modified[cur_modified_block_nr])
+        {
+            // Modified since then, so back to what's in the file
+            if(!nand_mapped || !os_map_cow_at(snapshot->path_flash, block_size * cur_modified_block_nr, block, block_size))
+                success = success && flash_file
+                        && fseek(flash_file, block_size * cur_modified_block_nr, SEEK_SET) == 0
+                        && fread(block, block_size, 1, flash_file) == 1;
+        }
+    }
+
+    if(any_from_file)
+        success = success && flash_file
+                && gzip_read(flash_file, nand_data, nand_size(), block_size, from_file) == nand_size();
+
+    nand = flash->state;
+    return success;
+}
+
 void flash_close()
 {
+    flash_save_wait();
     if(flash_file)
     {
         fclose(flash_file);
@@ -18,8 +18,11 @@ void nand_write_command_byte(uint8_t command);
 void nand_write_address_byte(uint8_t byte);
 uint8_t nand_read_data_byte(void);
 uint32_t nand_read_data_word(void);
+// Transfers of size bytes at once, for DMA
+void nand_read_data(uint8_t *data, uint32_t size);
 void nand_write_data_byte(uint8_t value);
 void nand_write_data_word(uint32_t value);
+void nand_write_data(const uint8_t *data, uint32_t size);
 
 void nand_phx_reset(void);
 uint32_t nand_phx_read_word(uint32_t addr);
@@ -76,7 +79,13 @@ size_t flash_suspend_flexsize();
 struct emu_snapshot;
 bool flash_suspend(struct emu_snapshot *snapshot);
 bool flash_resume(const struct emu_snapshot *snapshot);
+// Like flash_resume, but only the blocks which differ get replaced
+bool flash_rewind(const struct emu_snapshot *snapshot);
+/* Writes the modified blocks into the file in the background, their
+   content is copied right away. Returns false if no flash is loaded. */
 bool flash_save_changes();
+// Waits until the last flash_save_changes is done, returns whether it succeeded
+bool flash_save_wait();
 int flash_save_as(const char *filename);
 bool flash_create_new(bool flag_large_nand, const char **preload_file, unsigned int product, unsigned int features, bool large_sdram, uint8_t **nand_data_ptr, size_t *size);
 bool flash_read_settings(uint32_t *sdram_size, uint32_t *product, uint32_t *features, uint32_t *asic_user_flags);
@@ -19,7 +19,6 @@
 #ifdef __MINGW32__
 #include <winsock2.h>
 #else
-#include <poll.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <netinet/in.h>
@@ -34,6 +33,7 @@
 #include "cpu.h"
 #include "armsnippets.h"
 #include "gdbstub.h"
+#include "hostio.h"
 #include "translate.h"
 
 static void gdbstub_disconnect(void);
@@ -98,9 +98,8 @@ static bool flush_out_buffer(void) {
 }
 
 static bool put_debug_char(char c) {
-    if (log_enabled[LOG_GDB]) {
+    if (log_active(LOG_GDB)) {
         logprintf(LOG_GDB, "%c", c);
-        fflush(stdout);
         if (c == '+' || c == '-')
             logprintf(LOG_GDB, "\t");
     }
@@ -112,56 +111,41 @@ static bool put_debug_char(char c) {
     return true;
 }
 
-// returns 1 if at least one instruction translated in the range
-static int range_translated(uint32_t range_start, uint32_t range_end) {
-    uint32_t pc;
-    int translated = 0;
-    for (pc = range_start; pc < range_end;  pc += 4) {
-        void *pc_ram_ptr = virt_mem_ptr(pc, 4);
-        if (!pc_ram_ptr)
-            break;
-        translated |= RAM_FLAGS(pc_ram_ptr) & RF_CODE_TRANSLATED;
-    }
-    return translated;
+// Drops the translations of the code in the length bytes at ramaddr
+static void invalidate_range(void *ramaddr, uint32_t length) {
+    uintptr_t ptr = (uintptr_t)ramaddr & ~3, end = (uintptr_t)ramaddr + length;
+    for (; ptr < end; ptr += 4)
+        invalidate_translation_at((void *)ptr);
 }
 
+// What hostio_read returned and get_debug_char didn't take yet
+static char inbuf[4096];
+static int inbuf_pos = 0, inbuf_len = 0;
+
 /* Returns -1 on disconnection */
 static char get_debug_char(void) {
     char c;
 
-    #ifndef WIN32
-        while(true)
+    if (inbuf_pos == inbuf_len) {
+        while(!hostio_wait(HOSTIO_GDB, 100))
         {
-            struct pollfd pfd;
-            pfd.fd = socket_fd;
-            pfd.events = POLLIN;
-            int p = poll(&pfd, 1, 100);
-            if(p == -1) // Disconnected
+            if(exiting)
                 return -1;
 
-            if(p) // Data available
-                break;
-
-            else // No data available
-            {
-                if(exiting)
-                    return -1;
-
-                gui_do_stuff(false);
-            }
+            gui_do_stuff(false);
         }
-    #endif
 
-    int r = recv(socket_fd, &c, 1, 0);
-    if (r == -1) {
-        // only for debugging - log_socket_error("Failed to recv from GDB stub socket");
-        return -1;
+        inbuf_len = hostio_read(HOSTIO_GDB, inbuf, sizeof(inbuf));
+        inbuf_pos = 0;
+        if (inbuf_len <= 0) {
+            inbuf_len = 0;
+            return -1; // disconnected
+        }
     }
-    if (r == 0)
-        return -1; // disconnected
-    if (log_enabled[LOG_GDB]) {
+
+    c = inbuf[inbuf_pos++];
+    if (log_active(LOG_GDB)) {
         logprintf(LOG_GDB, "%c", c);
-        fflush(stdout);
         if (c == '+' || c == '-')
             logprintf(LOG_GDB, "\n");
     }
@@ -212,6 +196,12 @@ bool gdbstub_init(unsigned int port) {
         log_socket_error("Failed to listen on GDB stub socket");
     }
 
+    // Connections get accepted and read by the I/O thread
+    if (!hostio_listen(HOSTIO_GDB, listen_socket_fd)) {
+        gui_debug_printf("Failed to start the I/O thread for the GDB stub\n");
+        return false;
+    }
+
     return true;
 }
 
@@ -225,8 +215,9 @@ static void gdb_connect_ndls_cb(struct arm_state *state) {
 }
 
 /* BUFMAX defines the maximum number of characters in inbound/outbound buffers */
-/* at least NUMREGBYTES*2 are needed for register packets */
-#define BUFMAX 2048
+/* at least NUMREGBYTES*2 are needed for register packets. GDB gets told with
+ * PacketSize, so that memory is read and written in large blocks. */
+#define BUFMAX 0x10000
 
 static const char hexchars[]="0123456789abcdef";
 
@@ -255,8 +246,9 @@ static char remcomInBuffer[BUFMAX];
 static char remcomOutBuffer[BUFMAX];
 
 /* scan for the sequence $<data>#<checksum>. # will be replaced with \0.
+ * The size of the data is stored in size, as binary data may contain \0.
  * Returns NULL on disconnection. */
-char *getpacket(void) {
+static char *getpacket(int *size) {
     char *buffer = &remcomInBuffer[0];
     unsigned char checksum;
     unsigned char xmitcsum;
@@ -308,11 +300,13 @@ retry:
                        || !flush_out_buffer())
                         return NULL;
 
+                    *size = count - 3;
                     return &buffer[3];
                 }
                 if(!flush_out_buffer())
                     return NULL;
 
+                *size = count;
                 return &buffer[0];
             }
         }
@@ -419,9 +413,10 @@ static int hexToInt(char **ptr, int *intValue) {
 }
 
 /* See Appendix D - GDB Remote Serial Protocol - Overview.
- * A null character is appended. */
-__attribute__((unused)) static void binary_escape(char *in, int insize, char *out, int outsize) {
-    while (insize-- > 0 && outsize > 1) {
+ * A null character is appended. Returns the number of bytes of in used. */
+static int binary_escape(const char *in, int insize, char *out, int outsize) {
+    int used = 0;
+    while (used < insize && outsize > 1) {
         if (*in == '#' || *in == '$' || *in == '}' || *in == 0x2A) {
             if (outsize < 3)
                 break;
@@ -433,8 +428,56 @@ __attribute__((unused)) static void binary_escape(char *in, int insize, char *ou
             *out++ = *in++;
             outsize--;
         }
+        used++;
     }
     *out = '\0';
+    return used;
+}
+
+/* The reverse of binary_escape, for the data from *in to end. Stores up to
+ * count bytes in out and advances *in past them, returns how many. */
+static int binary_unescape(const char **in, const char *end, uint8_t *out, int count) {
+    const char *ptr = *in;
+    int done = 0;
+    while (ptr < end && done < count) {
+        if (*ptr == '}' && ptr + 1 < end) {
+            out[done++] = ptr[1] ^ 0x20;
+            ptr += 2;
+        }
+        else
+            out[done++] = *ptr++;
+    }
+    *in = ptr;
+    return done;
+}
+
+/* The host memory of addr up to length bytes or the end of its page, whichever
+ * is first, as the next page may be mapped somewhere else. Stores the size in
+ * piece, returns NULL if addr is not mapped to memory. */
+static void *virt_mem_piece(uint32_t addr, uint32_t length, uint32_t *piece) {
+    *piece = 0x400 - (addr & 0x3FF);
+    if (*piece > length)
+        *piece = length;
+    return virt_mem_ptr(addr, *piece);
+}
+
+/* For qXfer:memory-map:read, so that GDB knows which addresses it can access
+ * without trying. It's the physical memory, the OS maps that 1:1. */
+static int memory_map(char *buf, int size) {
+    int len = snprintf(buf, size, "<?xml version=\"1.0\"?>\n"
+                       "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" \"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+                       "<memory-map>\n");
+    for (unsigned int i = 0; i < sizeof(mem_areas)/sizeof(*mem_areas); i++) {
+        if (!mem_areas[i].size)
+            continue;
+
+        // The boot ROM and its mirror
+        const char *type = mem_areas[i].ptr == mem_areas[0].ptr ? "rom" : "ram";
+        len += snprintf(buf + len, size - len, "<memory type=\"%s\" start=\"0x%x\" length=\"0x%x\"/>\n",
+                        type, mem_areas[i].base, mem_areas[i].size);
+    }
+    len += snprintf(buf + len, size - len, "</memory-map>\n");
+    return len;
 }
 
 /* From emu to GDB. Returns regbuf. */
@@ -481,9 +524,34 @@ static bool send_stop_reply(int signal, const char *stop_reason, const char *r)
     return putpacket(remcomOutBuffer);
 }
 
+/* Writes the memory for M and X, with the data at ptr being size bytes
+ * of hex or binary. Returns false if any of it isn't mapped. */
+static bool write_memory(uint32_t addr, uint32_t length, const char *ptr, int size, bool binary) {
+    const char *end = ptr + size;
+    uint32_t piece;
+    void *ramaddr;
+    for (; length; addr += piece, length -= piece) {
+        if (!(ramaddr = virt_mem_piece(addr, length, &piece)))
+            return false;
+
+        invalidate_range(ramaddr, piece);
+        if (binary) {
+            if ((uint32_t)binary_unescape(&ptr, end, ramaddr, piece) < piece)
+                return false;
+        } else {
+            if (end - ptr < (int)piece * 2 || !hex2mem((char *)ptr, ramaddr, piece))
+                return false;
+            ptr += piece * 2;
+        }
+    }
+    return true;
+}
+
 void gdbstub_loop(void) {
     int addr;
     int length;
+    int size;
+    uint32_t piece;
     char *ptr, *ptr1;
     void *ramaddr;
     uint32_t regbuf[NUMREGS];
@@ -494,7 +562,7 @@ void gdbstub_loop(void) {
     while (1) {
         remcomOutBuffer[0] = 0;
 
-        ptr = getpacket();
+        ptr = getpacket(&size);
         if (!ptr) {
             gdbstub_disconnect();
             gui_debugger_entered_or_left(in_debugger = false);
@@ -557,29 +625,27 @@ void gdbstub_loop(void) {
                         && hexToInt(&ptr, &length)
                         && (size_t)length < (sizeof(remcomOutBuffer) - 1) / 2)
                 {
-                    ramaddr = virt_mem_ptr(addr, length);
-                    if (ramaddr && mem2hex(ramaddr, remcomOutBuffer, length))
-                        break;
-                    strcpy(remcomOutBuffer, "E03");
+                    /* Page by page, up to the first which isn't mapped.
+                     * GDB takes a shorter reply as a partial read. */
+                    ptr = remcomOutBuffer;
+                    for (; length && (ramaddr = virt_mem_piece(addr, length, &piece)); addr += piece, length -= piece)
+                        ptr = mem2hex(ramaddr, ptr, piece);
+                    if (ptr == remcomOutBuffer)
+                        strcpy(remcomOutBuffer, "E03");
                 } else
                     strcpy(remcomOutBuffer,"E01");
                 break;
 
             case 'M': /* MAA..AA,LLLL: Write LLLL bytes at address AA..AA  */
+            case 'X': /* XAA..AA,LLLL: Write LLLL binary bytes at address AA..AA  */
+                ptr1 = ptr - 1;
                 /* Try to read '%x,%x:' */
                 if (hexToInt(&ptr, &addr)
                         && *ptr++ == ','
                         && hexToInt(&ptr, &length)
                         && *ptr++ == ':')
                 {
-                    ramaddr = virt_mem_ptr(addr, length);
-                    if (!ramaddr) {
-                        strcpy(remcomOutBuffer, "E03");
-                        break;
-                    }
-                    if (range_translated((uintptr_t)ramaddr, (uintptr_t)((char *)ramaddr + length)))
-                        flush_translations();
-                    if (hex2mem(ptr, ramaddr, length))
+                    if (write_memory(addr, length, ptr, size - (ptr - ptr1), *ptr1 == 'X'))
                         strcpy(remcomOutBuffer, "OK");
                     else
                         strcpy(remcomOutBuffer, "E03");
@@ -635,10 +701,43 @@ parse_new_pc:
                     /* Host information */
                     strcpy(remcomOutBuffer, "cputype:12;cpusubtype:7;endian:little;ptrsize:4;");
                 }
-                else if(!strcmp("Supported", ptr))
+                else if(!strncmp("Supported", ptr, 9))
+                {
+                    /* Feature query, GDB lists its own features after a ':' */
+                    sprintf(remcomOutBuffer, "PacketSize=%x;qXfer:memory-map:read+", BUFMAX - 1);
+                }
+                else if(!strncmp("Xfer:memory-map:read::", ptr, 22))
                 {
-                    /* Feature query */
-                    strcpy(remcomOutBuffer, "vContSupported");
+                    /* Xfer:memory-map:read::offset,length Read part of the memory map */
+                    static char map[1024];
+                    int map_len = memory_map(map, sizeof(map));
+                    ptr += 22;
+                    if (hexToInt(&ptr, &addr) && *ptr++ == ',' && hexToInt(&ptr, &length)) {
+                        if (addr > map_len)
+                            addr = map_len;
+                        int used = binary_escape(map + addr, map_len - addr, remcomOutBuffer + 1,
+                                                 length + 1 < BUFMAX - 1 ? length + 1 : BUFMAX - 1);
+                        // 'l' if that's the end of it
+                        remcomOutBuffer[0] = addr + used < map_len ? 'm' : 'l';
+                    } else
+                        strcpy(remcomOutBuffer, "E01");
+                }
+                else if(!strncmp("Search:memory:", ptr, 14))
+                {
+                    /* Search:memory:address;length;pattern Find the binary pattern */
+                    static uint8_t pattern[BUFMAX];
+                    const char *end = ptr - 1 + size;
+                    uint32_t found;
+                    ptr += 14;
+                    if (hexToInt(&ptr, &addr) && *ptr++ == ';' && hexToInt(&ptr, &length) && *ptr++ == ';') {
+                        const char *pattern_ptr = ptr;
+                        int pattern_len = binary_unescape(&pattern_ptr, end, pattern, sizeof(pattern));
+                        if (debug_search_memory(addr, length, pattern, pattern_len, &found))
+                            sprintf(remcomOutBuffer, "1,%x", found);
+                        else
+                            strcpy(remcomOutBuffer, "0");
+                    } else
+                        strcpy(remcomOutBuffer, "E01");
                 }
                 else if(!strcmp("Symbol::", ptr))
                 {
@@ -651,7 +750,23 @@ parse_new_pc:
                 break;
             case 'v':
                 if(!strcmp("Cont?", ptr))
-                    strcpy(remcomOutBuffer, "");
+                    strcpy(remcomOutBuffer, "vCont;c;C;s;S");
+                else if(!strncmp("Cont;", ptr, 5))
+                {
+                    /* vCont;action[:thread-id]... There's only one thread,
+                     * which the first action is for. Signals are ignored. */
+                    ptr += 5;
+                    if (*ptr == 's' || *ptr == 'S')
+                        cpu_events |= EVENT_DEBUG_STEP;
+                    else if (*ptr != 'c' && *ptr != 'C')
+                    {
+                        strcpy(remcomOutBuffer, "E01");
+                        break;
+                    }
+
+                    gui_debugger_entered_or_left(in_debugger = false);
+                    return;
+                }
                 else
                     gui_debug_printf("Unsupported GDB cmd '%s'\n", ptr - 1);
 
@@ -659,35 +774,39 @@ parse_new_pc:
             case 'Z': /* 0|1|2|3|4,addr,kind  */
             case 'z': /* 0|1|2|3|4,addr,kind  */
                 set = *(ptr - 1) == 'Z';
-                // kinds other than 4 aren't supported
+                // For watchpoints, kind is the number of bytes
                 ptr1 = ptr++;
                 ptr = strtok(ptr, ",");
                 if (ptr && hexToInt(&ptr, &addr) && (ramaddr = virt_mem_ptr(addr & ~3, 4))) {
                     uint32_t *flags = &RAM_FLAGS(ramaddr);
+                    char *kind_str = strtok(NULL, ",;");
+                    int kind = 4;
+                    if (kind_str)
+                        hexToInt(&kind_str, &kind);
+                    void *watchaddr = virt_mem_ptr(addr, kind);
+                    bool ok = true;
                     switch (*ptr1) {
                         case '0': // mem breakpoint
                         case '1': // hw breakpoint
                             if (set) {
-                                if (*flags & RF_CODE_TRANSLATED) flush_translations();
+                                invalidate_translation_at(ramaddr);
                                 *flags |= RF_EXEC_BREAKPOINT;
                             } else
                                 *flags &= ~RF_EXEC_BREAKPOINT;
                             break;
                         case '2': // write watchpoint
+                            ok = watchaddr && memory_set_watchpoint(watchaddr, kind, RF_WRITE_BREAKPOINT, set);
+                            break;
+                        case '3': // read watchpoint
+                            ok = watchaddr && memory_set_watchpoint(watchaddr, kind, RF_READ_BREAKPOINT, set);
+                            break;
                         case '4': // access watchpoint
-                            if (set) *flags |= RF_WRITE_BREAKPOINT;
-                            else *flags &= ~RF_WRITE_BREAKPOINT;
-                            if (*ptr1 != '4')
-                                break;
-                            // fallthrough
-                        case '3': // read watchpoint, access watchpoint
-                            if (set) *flags |= RF_READ_BREAKPOINT;
-                            else *flags &= ~RF_READ_BREAKPOINT;
+                            ok = watchaddr && memory_set_watchpoint(watchaddr, kind, RF_READ_BREAKPOINT | RF_WRITE_BREAKPOINT, set);
                             break;
                         default:
                             goto reply;
                     }
-                    strcpy(remcomOutBuffer, "OK");
+                    strcpy(remcomOutBuffer, ok ? "OK" : "E01");
                 } else
                     strcpy(remcomOutBuffer, "E01");
                 break;
@@ -710,11 +829,8 @@ void gdbstub_reset(void) {
 
 static void gdbstub_disconnect(void) {
     gui_status_printf("GDB disconnected.");
-#ifdef __MINGW32__
-    closesocket(socket_fd);
-#else
-    close(socket_fd);
-#endif
+    hostio_disconnect(HOSTIO_GDB);
+    inbuf_pos = inbuf_len = 0;
     socket_fd = 0;
     gdb_connected = false;
     if (ndls_is_installed())
@@ -728,7 +844,7 @@ void gdbstub_recv(void) {
 
     int ret, on;
     if (!socket_fd) {
-        ret = accept(listen_socket_fd, NULL, NULL);
+        ret = hostio_accepted(HOSTIO_GDB);
         if (ret == -1)
             return;
         socket_fd = ret;
@@ -764,14 +880,8 @@ void gdbstub_recv(void) {
     if(!ndls_debug_received)
         return;
 
-    fd_set rfds;
-    FD_ZERO(&rfds);
-    FD_SET((unsigned)socket_fd, &rfds);
-    ret = select(socket_fd + 1, &rfds, NULL, NULL, &(struct timeval) {0, 0});
-    if (ret == -1 && errno == EBADF) {
-        gdbstub_disconnect();
-    }
-    else if (ret)
+    // Reading the end of the connection disconnects
+    if (inbuf_pos < inbuf_len || hostio_readable(HOSTIO_GDB))
     {
         if(!gdb_handshake_complete)
         {
@@ -805,13 +915,9 @@ void gdbstub_quit()
 {
     if(listen_socket_fd)
     {
-        close(listen_socket_fd);
+        hostio_stop(HOSTIO_GDB);
         listen_socket_fd = 0;
     }
 
-    if(socket_fd)
-    {
-        close(socket_fd);
-        socket_fd = 0;
-    }
+    socket_fd = 0;
 }
@@ -1,5 +1,11 @@
 #include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
 #include <mutex>
+#include <system_error>
+#include <thread>
 #include <vector>
 
 #include "emu.h"
@@ -14,27 +20,119 @@ struct RGB24 {
     uint8_t r, g, b, a;
 };
 
-static std::mutex gif_mutex;
-static bool recording = false;
+struct GifFrame {
+    std::array<uint16_t, 320 * 240> pixels; // From lcd_cx_draw_frame
+    unsigned int delay; // Longer if the ones before it got dropped
+    bool cx;
+};
+
+/* Quantisation and LZW take far longer than drawing a frame, so that's done
+   by the encoder thread. If it falls behind by more than this, frames get
+   dropped instead of slowing the emulation down. */
+static const size_t max_queued_frames = 4;
+
+static std::mutex gif_mutex; // For everything but the writer, which only the encoder uses
+static std::condition_variable gif_cond;
+static std::deque<std::unique_ptr<GifFrame>> queued_frames, spare_frames;
+static std::thread encoder;
+static bool started = false, stopping = false, failed = false;
+static std::atomic<bool> recording{false};
 static GifWriter writer;
 static std::vector<RGB24> buffer;
-static unsigned int framenr = 0, framenrskip = 0, framedelay = 0;
+static unsigned int framenr = 0, framenrskip = 0, framedelay = 0, dropped_delay = 0;
+
+static bool gif_write_frame(const GifFrame &frame)
+{
+    const uint16_t *ptr16 = frame.pixels.data();
+    RGB24 *ptr24 = buffer.data();
+
+    /* Convert RGB565 or RGB444 to RGBA8888 */
+    if(frame.cx)
+    {
+        for(unsigned int i = 0; i < 320*240; ++i)
+        {
+            ptr24->r = (*ptr16 & 0b1111100000000000) >> 8;
+            ptr24->g = (*ptr16 & 0b0000011111100000) >> 3;
+            ptr24->b = (*ptr16 & 0b0000000000011111) << 3;
+            ++ptr24;
+            ++ptr16;
+        }
+    }
+    else
+    {
+        for(unsigned int i = 0; i < 320*240; ++i)
+        {
+            uint8_t pix = ~(*ptr16 & 0xF);
+            ptr24->r = pix << 4;
+            ptr24->g = pix << 4;
+            ptr24->b = pix << 4;
+            ++ptr24;
+            ++ptr16;
+        }
+    }
+
+    return GifWriteFrame(&writer, reinterpret_cast<const uint8_t*>(buffer.data()), 320, 240, frame.delay);
+}
+
+static void gif_encode_frames()
+{
+    std::unique_lock<std::mutex> lock(gif_mutex);
+    for(;;)
+    {
+        gif_cond.wait(lock, [] { return stopping || !queued_frames.empty(); });
+        // The remaining ones get written before stopping
+        if(queued_frames.empty())
+            return;
+
+        std::unique_ptr<GifFrame> frame = std::move(queued_frames.front());
+        queued_frames.pop_front();
+
+        lock.unlock();
+        bool success = gif_write_frame(*frame);
+        lock.lock();
+
+        spare_frames.push_back(std::move(frame));
+        if(!success)
+        {
+            failed = true;
+            recording = false;
+            queued_frames.clear();
+            return;
+        }
+    }
+}
 
 bool gif_start_recording(const char *filename, unsigned int frameskip)
 {
     std::lock_guard<std::mutex> lock(gif_mutex);
 
+    if(started)
+        return false;
+
     framenr = framenrskip = frameskip;
     framedelay = 100 / (60/(frameskip+1));
+    dropped_delay = 0;
 
     FILE *gif_file = fopen_utf8(filename, "wb");
 
-    if(gif_file && GifBegin(&writer, gif_file, 320, 240, framedelay))
-        recording = true;
+    if(!gif_file || !GifBegin(&writer, gif_file, 320, 240, framedelay))
+        return false;
 
     buffer.resize(320*240);
+    started = true;
+    stopping = failed = false;
+
+    try
+    {
+        encoder = std::thread(gif_encode_frames);
+    }
+    catch(const std::system_error &)
+    {
+        // Without threads, gif_new_frame encodes them itself
+    }
 
-    return recording;
+    recording = true;
+    return true;
 }
 
 void gif_new_frame()
@@ -49,51 +147,67 @@ void gif_new_frame()
 
     framenr = framenrskip;
 
-    static std::array<uint16_t, 320 * 240> framebuffer;
+    bool threaded = encoder.joinable();
+    if(threaded && queued_frames.size() >= max_queued_frames)
+    {
+        // The GIF still has to take as long as the emulation did
+        dropped_delay += framedelay;
+        return;
+    }
 
-    lcd_cx_draw_frame(framebuffer.data());
+    std::unique_ptr<GifFrame> frame;
+    if(spare_frames.empty())
+        frame.reset(new GifFrame);
+    else
+    {
+        frame = std::move(spare_frames.back());
+        spare_frames.pop_back();
+    }
 
-    uint16_t *ptr16 = framebuffer.data();
-    RGB24 *ptr24 = buffer.data();
+    lcd_cx_draw_frame(frame->pixels.data());
+    frame->delay = framedelay + dropped_delay;
+    frame->cx = emulate_cx;
+    dropped_delay = 0;
 
-    /* Convert RGB565 or RGB444 to RGBA8888 */
-    if(emulate_cx)
+    if(threaded)
     {
-        for(unsigned int i = 0; i < 320*240; ++i)
-        {
-            ptr24->r = (*ptr16 & 0b1111100000000000) >> 8;
-            ptr24->g = (*ptr16 & 0b0000011111100000) >> 3;
-            ptr24->b = (*ptr16 & 0b0000000000011111) << 3;
-            ++ptr24;
-            ++ptr16;
-        }
+        queued_frames.push_back(std::move(frame));
+        gif_cond.notify_one();
     }
     else
     {
-        for(unsigned int i = 0; i < 320*240; ++i)
+        if(!gif_write_frame(*frame))
         {
-            uint8_t pix = ~(*ptr16 & 0xF);
-            ptr24->r = pix << 4;
-            ptr24->g = pix << 4;
-            ptr24->b = pix << 4;
-            ++ptr24;
-            ++ptr16;
+            failed = true;
+            recording = false;
         }
-    }
 
-    if(!GifWriteFrame(&writer, reinterpret_cast<const uint8_t*>(buffer.data()), 320, 240, framedelay))
-        recording = false;
+        spare_frames.push_back(std::move(frame));
+    }
 }
 
 bool gif_stop_recording()
 {
-    std::lock_guard<std::mutex> lock(gif_mutex);
+    std::unique_lock<std::mutex> lock(gif_mutex);
 
-    bool ret = recording;
+    if(!started)
+        return false;
 
     recording = false;
+    stopping = true;
+    gif_cond.notify_one();
+
+    // Let the encoder finish the queued frames
+    lock.unlock();
+    if(encoder.joinable())
+        encoder.join();
+    lock.lock();
+
+    bool ret = !failed;
 
+    started = false;
     buffer.clear();
+    spare_frames.clear();
     GifEnd(&writer);
     return ret;
 }
@@ -0,0 +1,129 @@
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <zlib.h>
+
+#include "gzip_file.h"
+
+bool gzip_detect(FILE *file)
+{
+    uint8_t magic[2];
+    bool ret = fseek(file, 0, SEEK_SET) == 0
+            && fread(magic, sizeof(magic), 1, file) == 1
+            && magic[0] == 0x1F && magic[1] == 0x8B;
+
+    fseek(file, 0, SEEK_SET);
+    return ret;
+}
+
+bool gzip_filesize(FILE *file, uint32_t *size)
+{
+    uint8_t trailer[4];
+    if(fseek(file, -4, SEEK_END) != 0 || fread(trailer, sizeof(trailer), 1, file) != 1)
+        return false;
+
+    // Little endian, whatever the host is
+    *size = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | uint32_t(trailer[3]) << 24;
+    return true;
+}
+
+size_t gzip_read(FILE *file, uint8_t *data, size_t size, size_t piece_size, const bool *wanted)
+{
+    if(fseek(file, 0, SEEK_SET) != 0)
+        return 0;
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // Only gzip, not zlib or raw deflate
+    if(inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+        return 0;
+
+    std::vector<uint8_t> in(0x40000), dropped;
+    if(wanted)
+        dropped.resize(std::min(piece_size, size));
+
+    size_t done = 0;
+    while(done < size)
+    {
+        if(stream.avail_in == 0)
+        {
+            stream.next_in = in.data();
+            stream.avail_in = fread(in.data(), 1, in.size(), file);
+            if(stream.avail_in == 0)
+                break; // Truncated
+        }
+
+        // Straight into data, unless this piece isn't wanted
+        size_t out_size = size - done;
+        uint8_t *out = data + done;
+        if(wanted)
+        {
+            size_t piece = done / piece_size, piece_offset = done % piece_size;
+            out_size = std::min(out_size, piece_size - piece_offset);
+            if(!wanted[piece])
+                out = dropped.data() + piece_offset;
+        }
+
+        stream.next_out = out;
+        stream.avail_out = std::min<size_t>(out_size, UINT_MAX);
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        done += stream.next_out - out;
+
+        if(ret == Z_STREAM_END)
+        {
+            // There may be another member after this one
+            if(inflateReset(&stream) != Z_OK)
+                break;
+        }
+        else if(ret != Z_OK && ret != Z_BUF_ERROR)
+            break;
+    }
+
+    inflateEnd(&stream);
+    return done;
+}
+
+void *gzip_buffer_write(const void *data, size_t size, size_t *compressed_size)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return nullptr;
+
+    size_t bound = deflateBound(&stream, size);
+    uint8_t *out = (uint8_t *) malloc(bound);
+    if(!out)
+    {
+        deflateEnd(&stream);
+        return nullptr;
+    }
+
+    // Fed in pieces, so that sizes beyond 4 GiB work as well
+    const uint8_t *in = (const uint8_t *) data;
+    size_t in_left = size;
+    stream.next_out = out;
+    int ret = Z_OK;
+    while(ret == Z_OK)
+    {
+        uInt in_size = std::min<size_t>(in_left, UINT_MAX);
+        stream.next_in = (Bytef *) in;
+        stream.avail_in = in_size;
+        stream.avail_out = std::min<size_t>(bound - (stream.next_out - out), UINT_MAX);
+        ret = deflate(&stream, in_size == in_left ? Z_FINISH : Z_NO_FLUSH);
+        in += in_size - stream.avail_in;
+        in_left -= in_size - stream.avail_in;
+    }
+
+    *compressed_size = stream.next_out - out;
+    deflateEnd(&stream);
+    if(ret != Z_STREAM_END)
+    {
+        free(out);
+        return nullptr;
+    }
+
+    return out;
+}
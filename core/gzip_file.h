@@ -0,0 +1,36 @@
+/* Declarations for gzip_file.cpp */
+
+#ifndef _H_GZIP_FILE
+#define _H_GZIP_FILE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Flash and boot1 images can also be stored gzip compressed. They get
+   inflated while being read, without an uncompressed copy on disk. */
+
+// Whether the file starts like gzip data, its position is at the start afterwards
+bool gzip_detect(FILE *file);
+/* The uncompressed size according to the trailer of the last member,
+   modulo 4 GiB. Returns false if it can't be read. */
+bool gzip_filesize(FILE *file, uint32_t *size);
+/* Inflates the file from the start into data, up to size bytes. If wanted is
+   given, data is split into pieces of piece_size bytes and piece i is only
+   written if wanted[i] is true, the others are inflated and dropped.
+   Returns the number of bytes inflated, like fread. */
+size_t gzip_read(FILE *file, uint8_t *data, size_t size, size_t piece_size, const bool *wanted);
+/* Returns the data gzip compressed in a malloc'd buffer or NULL,
+   its size in compressed_size. */
+void *gzip_buffer_write(const void *data, size_t size, size_t *compressed_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
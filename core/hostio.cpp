@@ -0,0 +1,261 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <system_error>
+#include <thread>
+
+#ifdef __MINGW32__
+#include <winsock2.h>
+#else
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "hostio.h"
+
+// Filled by the I/O thread, emptied by the emulation
+template <size_t size> class spsc_queue
+{
+public:
+    bool empty() const
+    {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+    }
+
+    size_t space() const
+    {
+        return size - (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_acquire));
+    }
+
+    size_t push(const char *data, size_t count)
+    {
+        size_t h = head.load(std::memory_order_relaxed), free = space();
+        if(count > free)
+            count = free;
+        for(size_t i = 0; i < count; ++i)
+            buffer[(h + i) % size] = data[i];
+        head.store(h + count, std::memory_order_release);
+        return count;
+    }
+
+    size_t pop(char *data, size_t count)
+    {
+        size_t t = tail.load(std::memory_order_relaxed), used = head.load(std::memory_order_acquire) - t;
+        if(count > used)
+            count = used;
+        for(size_t i = 0; i < count; ++i)
+            data[i] = buffer[(t + i) % size];
+        tail.store(t + count, std::memory_order_release);
+        return count;
+    }
+
+    // Only while the producer is known not to push
+    void clear()
+    {
+        tail.store(head.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+private:
+    char buffer[size];
+    std::atomic<size_t> head{0}, tail{0}; // Counting up, only the producer writes head
+};
+
+struct hostio_channel_state
+{
+    int listen_fd = -1, fd = -1; // Owned by the I/O thread
+    std::atomic<int> accepted{-1}; // Connection not taken by hostio_accepted yet
+    std::atomic<bool> eof{false};
+    bool close_request = false, stop_request = false;
+    spsc_queue<0x10000> in;
+};
+
+static hostio_channel_state channels[HOSTIO_CHANNELS];
+/* Held by the I/O thread while it changes the sockets or fills the queues,
+   the requests from the emulation are done under it as well. */
+static std::mutex hostio_mutex;
+static std::condition_variable hostio_done, hostio_data;
+static bool hostio_running = false;
+
+static void close_socket(int fd)
+{
+#ifdef __MINGW32__
+    closesocket(fd);
+#else
+    close(fd);
+#endif
+}
+
+static bool any_listening()
+{
+    for(auto &ch : channels)
+        if(ch.listen_fd != -1)
+            return true;
+    return false;
+}
+
+static void hostio_thread()
+{
+    std::unique_lock<std::mutex> lock(hostio_mutex);
+    while(any_listening())
+    {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        int max_fd = -1, listen_fds[HOSTIO_CHANNELS], fds[HOSTIO_CHANNELS];
+        for(int i = 0; i < HOSTIO_CHANNELS; ++i)
+        {
+            auto &ch = channels[i];
+            listen_fds[i] = ch.fd == -1 ? ch.listen_fd : -1;
+            // Stop reading if the emulation doesn't keep up
+            fds[i] = ch.fd != -1 && !ch.eof && ch.in.space() ? ch.fd : -1;
+            for(int fd : { listen_fds[i], fds[i] })
+            {
+                if(fd == -1)
+                    continue;
+                FD_SET((unsigned) fd, &rfds);
+                if(fd > max_fd)
+                    max_fd = fd;
+            }
+        }
+
+        // Short enough for requests and queues getting room again
+        lock.unlock();
+        int ready = 0;
+        if(max_fd == -1)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        else
+        {
+            struct timeval timeout = {0, 10000};
+            ready = select(max_fd + 1, &rfds, NULL, NULL, &timeout);
+        }
+        lock.lock();
+
+        for(int i = 0; i < HOSTIO_CHANNELS; ++i)
+        {
+            auto &ch = channels[i];
+            if(ch.close_request || ch.stop_request)
+            {
+                if(ch.fd != -1)
+                    close_socket(ch.fd);
+                ch.fd = -1;
+                ch.accepted = -1; // If it wasn't taken, it was ch.fd
+                ch.eof = false;
+                if(ch.stop_request && ch.listen_fd != -1)
+                {
+                    close_socket(ch.listen_fd);
+                    ch.listen_fd = -1;
+                }
+                ch.close_request = ch.stop_request = false;
+                hostio_done.notify_all();
+                continue;
+            }
+            if(ready <= 0)
+                continue;
+
+            if(listen_fds[i] != -1 && FD_ISSET(listen_fds[i], &rfds))
+            {
+                int fd = accept(listen_fds[i], NULL, NULL);
+                if(fd != -1)
+                {
+                    ch.fd = fd;
+                    ch.accepted = fd;
+                }
+            }
+            else if(fds[i] != -1 && FD_ISSET(fds[i], &rfds))
+            {
+                char buf[4096];
+                size_t count = ch.in.space() < sizeof(buf) ? ch.in.space() : sizeof(buf);
+                int r = recv(ch.fd, buf, count, 0);
+                if(r > 0)
+                    ch.in.push(buf, r);
+                else
+                    ch.eof = true; // Closed or broken
+                hostio_data.notify_all();
+            }
+        }
+    }
+
+    hostio_running = false;
+    hostio_done.notify_all();
+}
+
+bool hostio_listen(enum hostio_channel channel, int listen_fd)
+{
+    std::lock_guard<std::mutex> lock(hostio_mutex);
+    channels[channel].listen_fd = listen_fd;
+    if(hostio_running)
+        return true;
+
+    try
+    {
+        std::thread(hostio_thread).detach();
+    }
+    catch(const std::system_error &)
+    {
+        channels[channel].listen_fd = -1;
+        return false;
+    }
+    hostio_running = true;
+    return true;
+}
+
+// Lets the I/O thread carry out the request and waits for it
+static void hostio_request(enum hostio_channel channel, bool stop)
+{
+    std::unique_lock<std::mutex> lock(hostio_mutex);
+    auto &ch = channels[channel];
+    if(!hostio_running)
+        return;
+
+    if(stop)
+        ch.stop_request = true;
+    else
+        ch.close_request = true;
+    hostio_done.wait(lock, [&] { return !ch.close_request && !ch.stop_request; });
+    // Nothing can arrive anymore until a new connection gets accepted
+    ch.in.clear();
+    if(!any_listening())
+        hostio_done.wait(lock, [] { return !hostio_running; });
+}
+
+void hostio_stop(enum hostio_channel channel)
+{
+    hostio_request(channel, true);
+}
+
+void hostio_disconnect(enum hostio_channel channel)
+{
+    hostio_request(channel, false);
+}
+
+int hostio_accepted(enum hostio_channel channel)
+{
+    if(channels[channel].accepted.load(std::memory_order_relaxed) == -1)
+        return -1;
+
+    return channels[channel].accepted.exchange(-1);
+}
+
+bool hostio_readable(enum hostio_channel channel)
+{
+    return !channels[channel].in.empty() || channels[channel].eof;
+}
+
+bool hostio_wait(enum hostio_channel channel, int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(hostio_mutex);
+    return hostio_data.wait_for(lock, std::chrono::milliseconds(timeout_ms), [=] { return hostio_readable(channel); });
+}
+
+int hostio_read(enum hostio_channel channel, void *buf, size_t size)
+{
+    auto &ch = channels[channel];
+    // eof gets set after the last push
+    bool eof = ch.eof;
+    size_t count = ch.in.pop(static_cast<char *>(buf), size);
+    if(count)
+        return count;
+
+    return eof ? -1 : 0;
+}
@@ -0,0 +1,39 @@
+/* Declarations for hostio.cpp */
+
+#ifndef _H_HOSTIO
+#define _H_HOSTIO
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The sockets of the GDB stub and the remote debugger are watched by a
+   thread of their own. It accepts connections and reads whatever arrives
+   into a queue per channel, so that polling from the emulation only has to
+   look at the queue. Sending is still done by the stubs themselves. */
+enum hostio_channel { HOSTIO_GDB, HOSTIO_RDEBUG, HOSTIO_CHANNELS };
+
+// Takes over the listening socket listen_fd, returns false on failure
+bool hostio_listen(enum hostio_channel channel, int listen_fd);
+// Closes all sockets of channel
+void hostio_stop(enum hostio_channel channel);
+// Returns the socket of a new connection, -1 if there is none
+int hostio_accepted(enum hostio_channel channel);
+// Whether hostio_read would return something else than 0
+bool hostio_readable(enum hostio_channel channel);
+// Waits up to timeout_ms milliseconds for hostio_readable
+bool hostio_wait(enum hostio_channel channel, int timeout_ms);
+/* Returns the number of bytes copied into buf, 0 if nothing arrived yet or
+   -1 if the connection got closed by the other side */
+int hostio_read(enum hostio_channel channel, void *buf, size_t size);
+// Closes the connection and drops what's still queued
+void hostio_disconnect(enum hostio_channel channel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
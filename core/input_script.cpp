@@ -0,0 +1,253 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "emu.h"
+#include "input_script.h"
+#include "keypad.h"
+#include "schedule.h"
+#include "usblink.h"
+#include "usblink_queue.h"
+#include "os/os.h"
+
+enum InputEventType {
+    INPUT_KEY,
+    INPUT_TOUCHPAD,
+    INPUT_FILE,
+    INPUT_SNAPSHOT,
+    INPUT_EXIT
+};
+
+struct InputEvent {
+    uint64_t cycles; // After the start of the script
+    InputEventType type;
+    int row, col;
+    float x, y;
+    bool state, down; // state is the contact of the touchpad
+    std::string path;
+};
+
+static std::vector<InputEvent> script;
+static size_t script_pos;
+static uint64_t script_start;
+
+// Only the GUI thread and the emulation ever record, but they can at the same time
+static std::mutex record_mutex;
+static FILE *record_file;
+static uint64_t record_start;
+static bool record_failed;
+
+// Splits off the next word of line, NULL at the end
+static char *next_word(char **line)
+{
+    *line += strspn(*line, " \t\r\n");
+    if(!**line)
+        return nullptr;
+
+    char *word = *line;
+    *line += strcspn(*line, " \t\r\n");
+    if(**line)
+        *(*line)++ = 0;
+    return word;
+}
+
+static bool parse_event(char *line, InputEvent *event)
+{
+    char *cycles = next_word(&line), *type = next_word(&line), *end;
+    if(!cycles || !type)
+        return false;
+
+    event->cycles = strtoull(cycles, &end, 0);
+    if(*end)
+        return false;
+
+    char *args[4] = {};
+    for(char *&arg : args)
+        arg = next_word(&line);
+
+    bool extra = next_word(&line) != nullptr;
+    if(!strcmp(type, "key") && args[2] && !args[3])
+    {
+        event->type = INPUT_KEY;
+        event->row = atoi(args[0]);
+        event->col = atoi(args[1]);
+        event->state = atoi(args[2]) != 0;
+        return event->row >= 0 && event->row < KEYPAD_ROWS && event->col >= 0 && event->col < KEYPAD_COLS;
+    }
+    else if(!strcmp(type, "touchpad") && args[3] && !extra)
+    {
+        event->type = INPUT_TOUCHPAD;
+        event->x = strtof(args[0], nullptr);
+        event->y = strtof(args[1], nullptr);
+        event->state = atoi(args[2]) != 0;
+        event->down = atoi(args[3]) != 0;
+        return true;
+    }
+    else if((!strcmp(type, "file") || !strcmp(type, "snapshot")) && args[0] && !args[1])
+    {
+        event->type = !strcmp(type, "file") ? INPUT_FILE : INPUT_SNAPSHOT;
+        event->path = args[0];
+        return true;
+    }
+    else if(!strcmp(type, "exit") && !args[0])
+    {
+        event->type = INPUT_EXIT;
+        return true;
+    }
+
+    return false;
+}
+
+bool input_script_load(const char *filename)
+{
+    FILE *file = fopen_utf8(filename, "r");
+    if(!file)
+    {
+        gui_perror(filename);
+        return false;
+    }
+
+    std::vector<InputEvent> events;
+    char line[1024];
+    bool success = true;
+    for(unsigned int number = 1; fgets(line, sizeof(line), file); ++number)
+    {
+        char *start = line + strspn(line, " \t\r\n");
+        if(!*start || *start == '#')
+            continue;
+
+        InputEvent event;
+        if(!parse_event(start, &event))
+        {
+            gui_debug_printf("%s:%u: Invalid input event.\n", filename, number);
+            success = false;
+            break;
+        }
+        events.push_back(event);
+    }
+
+    if(ferror(file))
+    {
+        gui_perror(filename);
+        success = false;
+    }
+    fclose(file);
+
+    if(!success)
+        return false;
+
+    // In the order of the file where they're at the same cycle
+    std::stable_sort(events.begin(), events.end(), [](const InputEvent &a, const InputEvent &b) {
+        return a.cycles < b.cycles;
+    });
+    script = std::move(events);
+    script_pos = 0;
+    return true;
+}
+
+static void input_file_progress(int progress, void *user_data)
+{
+    std::string *path = static_cast<std::string *>(user_data);
+    if(progress == -1)
+        gui_debug_printf("Input script: could not send %s.\n", path->c_str());
+    if(progress == 100 || progress == -1)
+        delete path;
+}
+
+static void input_script_event()
+{
+    uint64_t now = sched_cputick() - script_start;
+    while(script_pos < script.size() && script[script_pos].cycles <= now)
+    {
+        const InputEvent &event = script[script_pos++];
+        switch(event.type)
+        {
+        case INPUT_KEY:
+            keypad_set_key(event.row, event.col, event.state);
+            break;
+        case INPUT_TOUCHPAD:
+            touchpad_set_state(event.x, event.y, event.state, event.down);
+            break;
+        case INPUT_FILE:
+            usblink_queue_put_file(event.path, "", input_file_progress, new std::string(event.path));
+            if(!usblink_connected)
+                usblink_connect();
+            break;
+        case INPUT_SNAPSHOT:
+            if(!emu_suspend(event.path.c_str()))
+                gui_debug_printf("Input script: could not write the snapshot %s.\n", event.path.c_str());
+            break;
+        case INPUT_EXIT:
+            exiting = true;
+            script_pos = script.size();
+            return;
+        }
+    }
+
+    if(script_pos < script.size())
+        sched_set_host_event(SCHED_HOST_INPUT_SCRIPT, script_start + script[script_pos].cycles, input_script_event);
+}
+
+void input_script_start()
+{
+    script_pos = 0;
+    script_start = sched_cputick();
+    if(!script.empty())
+        sched_set_host_event(SCHED_HOST_INPUT_SCRIPT, script_start + script[0].cycles, input_script_event);
+}
+
+bool input_record_start(const char *filename)
+{
+    std::lock_guard<std::mutex> lock(record_mutex);
+    if(record_file)
+        return false;
+
+    record_file = fopen_utf8(filename, "w");
+    if(!record_file)
+        return false;
+
+    record_start = sched_cputick();
+    record_failed = fprintf(record_file, "# Firebird input script, cycles after the start\n") < 0;
+    return true;
+}
+
+bool input_record_stop()
+{
+    std::lock_guard<std::mutex> lock(record_mutex);
+    if(!record_file)
+        return false;
+
+    bool success = !record_failed;
+    if(fclose(record_file) != 0)
+        success = false;
+
+    record_file = nullptr;
+    return success;
+}
+
+bool input_record_active()
+{
+    std::lock_guard<std::mutex> lock(record_mutex);
+    return record_file != nullptr;
+}
+
+void input_record_key(int row, int col, bool state)
+{
+    std::lock_guard<std::mutex> lock(record_mutex);
+    if(record_file && fprintf(record_file, "%" PRIu64 " key %d %d %d\n", sched_cputick() - record_start, row, col, state) < 0)
+        record_failed = true;
+}
+
+void input_record_touchpad(float x, float y, bool contact, bool down)
+{
+    std::lock_guard<std::mutex> lock(record_mutex);
+    // Enough digits for the same float when reading it back
+    if(record_file && fprintf(record_file, "%" PRIu64 " touchpad %.9g %.9g %d %d\n",
+                              sched_cputick() - record_start, x, y, contact, down) < 0)
+        record_failed = true;
+}
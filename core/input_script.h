@@ -0,0 +1,43 @@
+/* Declarations for input_script.cpp */
+
+#ifndef _H_INPUT_SCRIPT
+#define _H_INPUT_SCRIPT
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An input script has an event per line, at a number of CPU cycles after the
+   start of the script, so that replaying it doesn't depend on the speed of
+   the host:
+     <cycles> key <row> <col> <0|1>
+     <cycles> touchpad <x> <y> <contact 0|1> <down 0|1>
+     <cycles> file <path>
+     <cycles> snapshot <path>
+     <cycles> exit
+   The touchpad coordinates are from 0 to 1, like for touchpad_set_state.
+   Files get sent over usblink into the root folder. Empty lines and the
+   ones starting with # are ignored. */
+
+// Replaces the script, returns false if it couldn't be read or parsed
+bool input_script_load(const char *filename);
+// Runs the loaded script from the current cycle, through the scheduler
+void input_script_start();
+
+/* Writes the keys and touchpad changes from keypad_set_key and
+   touchpad_set_state as a script, until input_record_stop. */
+bool input_record_start(const char *filename);
+// Returns false if writing failed
+bool input_record_stop();
+bool input_record_active();
+void input_record_key(int row, int col, bool state);
+void input_record_touchpad(float x, float y, bool contact, bool down);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+/* The state of the emulated calculator */
+
+#ifndef _H_INSTANCE
+#define _H_INSTANCE
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "schedule.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct mem_area_desc {
+    uint32_t base, size;
+    uint8_t *ptr;
+};
+
+/* What makes up one calculator, as far as it got moved here yet: the CPU,
+   the scheduler and where its memory is. There's a single instance for now
+   and the rest of the state is still global, see TODO.md. The code refers
+   to the parts by the names below, so that they can become members of the
+   instance which runs on the current thread later on. */
+struct emu_instance {
+    // First, so that the asm code and the translators find it as "arm"
+    struct arm_state cpu;
+    sched_state sched;
+    struct {
+        // Must be allocated below 2GB (see comments for mmu.c)
+        uint8_t *and_flags;
+        struct mem_area_desc areas[4];
+    } mem;
+};
+
+extern struct emu_instance emu_instance __asm__("arm");
+
+#define arm (emu_instance.cpu)
+#define sched (emu_instance.sched)
+#define mem_and_flags (emu_instance.mem.and_flags)
+#define mem_areas (emu_instance.mem.areas)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,14 +7,27 @@
 /* DC000000: Interrupt controller */
 interrupt_state intr;
 
+// Which interrupts have each priority, derived from intr.priority
+static uint32_t priority_lines[8];
+
+static void update_priority_lines() {
+    memset(priority_lines, 0, sizeof priority_lines);
+    for (int i = 0; i < 32; i++)
+        priority_lines[intr.priority[i] & 7] |= 1u << i;
+}
+
+// The lowest numbered interrupt of the highest priority wins
 static void get_current_int(int is_fiq, int *current) {
     uint32_t masked_status = intr.status & intr.mask[is_fiq];
+    if (!masked_status)
+        return;
+
     int pri_limit = intr.priority_limit[is_fiq];
-    int i;
-    for (i = 0; i < 32; i++) {
-        if (masked_status & (1u << i) && intr.priority[i] < pri_limit) {
-            *current = i;
-            pri_limit = intr.priority[i];
+    for (int pri = 0; pri < pri_limit && pri < 8; pri++) {
+        uint32_t lines = masked_status & priority_lines[pri];
+        if (lines) {
+            *current = __builtin_ctz(lines);
+            return;
         }
     }
 }
@@ -101,6 +114,7 @@ void int_write_word(uint32_t addr, uint32_t value) {
     } else {
         if (!(addr & 0x80)) {
             intr.priority[addr >> 2 & 0x1F] = value & 7;
+            update_priority_lines();
             return;
         }
     }
@@ -171,6 +185,7 @@ void int_reset() {
     intr.noninverted = -1;
     intr.priority_limit[0] = 8;
     intr.priority_limit[1] = 8;
+    update_priority_lines();
 }
 
 bool interrupt_suspend(emu_snapshot *snapshot)
@@ -182,5 +197,6 @@ bool interrupt_suspend(emu_snapshot *snapshot)
 bool interrupt_resume(const emu_snapshot *snapshot)
 {
     intr = snapshot->mem.intr;
+    update_priority_lines();
     return true;
 }
@@ -4,6 +4,7 @@
 #include <mutex>
 
 #include "emu.h"
+#include "input_script.h"
 #include "misc.h"
 #include "keypad.h"
 #include "schedule.h"
@@ -13,8 +14,15 @@
 /* 900E0000: Keypad controller */
 keypad_state keypad;
 
+/* For the touchpad, which the GUI thread changes. key_map is only changed
+   with atomic operations instead, so that the scan doesn't need the lock. */
 static std::mutex keypad_mut;
 
+static void keypad_int_update() {
+    int_set(INT_KEYPAD, (keypad.kpc.int_enable & keypad.kpc.int_active)
+                      | (keypad.kpc.gpio_int_enable & __atomic_load_n(&keypad.kpc.gpio_int_active, __ATOMIC_RELAXED)));
+}
+
 void keypad_int_check() {
     if(keypad.touchpad_contact != keypad.touchpad_last_contact)
         keypad.touchpad_irq_state |= 0x4;
@@ -24,8 +32,7 @@ void keypad_int_check() {
     keypad.touchpad_last_contact = keypad.touchpad_contact;
     keypad.touchpad_last_down = keypad.touchpad_down;
 
-    int_set(INT_KEYPAD, (keypad.kpc.int_enable & keypad.kpc.int_active)
-                      | (keypad.kpc.gpio_int_enable & keypad.kpc.gpio_int_active));
+    keypad_int_update();
 }
 
 void keypad_on_pressed() {
@@ -77,49 +84,72 @@ void keypad_write(uint32_t addr, uint32_t value) {
         case 0x34: return;
         case 0x3C: return;
         case 0x40: keypad.kpc.gpio_int_enable = value; keypad_int_check(); return;
-        case 0x44: keypad.kpc.gpio_int_active &= ~value; keypad_int_check(); return;
+        case 0x44: __atomic_fetch_and(&keypad.kpc.gpio_int_active, ~value, __ATOMIC_RELAXED); keypad_int_check(); return;
         case 0x48: return;
     }
     bad_write_word(addr, value);
 }
-// Scan next row of keypad, if scanning is enabled
-static void keypad_scan_event(int index) {
-    std::lock_guard<std::mutex> lg(keypad_mut);
-    if (keypad.kpc.current_row >= 16)
-        error("too many keypad rows");
-
-    uint16_t row = ~keypad.key_map[keypad.kpc.current_row];
-    row &= ~(0x80000 >> keypad.kpc.current_row); // Emulate weird diagonal glitch
+// What the data register of a row should contain
+static uint16_t keypad_row_data(int row_index) {
+    uint16_t row = ~__atomic_load_n(&keypad.key_map[row_index], __ATOMIC_RELAXED);
+    row &= ~(0x80000 >> row_index); // Emulate weird diagonal glitch
     row |= ~0u << (keypad.kpc.size >> 8 & 0xFF);  // Unused columns read as 1
     if (emulate_cx)
         row = ~row;
+    return row;
+}
 
-    if (keypad.kpc.data[keypad.kpc.current_row] != row) {
-        keypad.kpc.data[keypad.kpc.current_row] = row;
+static void keypad_scan_row(int row_index) {
+    uint16_t row = keypad_row_data(row_index);
+    if (keypad.kpc.data[row_index] != row) {
+        keypad.kpc.data[row_index] = row;
         keypad.kpc.int_active |= 2;
     }
+}
+
+/* Scan next row of keypad, if scanning is enabled. After the first scan,
+   the rows get scanned together with the last one, so that an unchanged
+   keypad takes one event per scan. The end of the scan is still on time,
+   only the data of a row which changed may come a bit later. */
+static void keypad_scan_event(int index) {
+    if (keypad.kpc.current_row >= 16)
+        error("too many keypad rows");
+
+    uint32_t row_time = keypad.kpc.control >> 2 & 0x3FFF;
+    int rows = keypad.kpc.size & 0xFF;
+    if (keypad.kpc.current_row == rows - 1) {
+        for (int row_index = 0; row_index < rows; row_index++)
+            keypad_scan_row(row_index);
+    } else {
+        keypad_scan_row(keypad.kpc.current_row);
+    }
 
     keypad.kpc.current_row++;
-    if (keypad.kpc.current_row < (keypad.kpc.size & 0xFF)) {
-        event_repeat(index, keypad.kpc.control >> 2 & 0x3FFF);
+    if (keypad.kpc.current_row < rows) {
+        event_repeat(index, row_time);
     } else {
         keypad.kpc.current_row = 0;
         keypad.kpc.int_active |= 1;
         if (keypad.kpc.control & 1) {
-            event_repeat(index, (keypad.kpc.control >> 16) + (keypad.kpc.control >> 2 & 0x3FFF));
+            uint32_t skipped_time = 0;
+            if (rows > 1) {
+                keypad.kpc.current_row = rows - 1;
+                skipped_time = (rows - 1) * row_time;
+            }
+            event_repeat(index, (keypad.kpc.control >> 16) + row_time + skipped_time);
         } else {
             // If in single scan mode, go to idle mode
             keypad.kpc.control &= ~3;
         }
     }
-    keypad_int_check();
+    keypad_int_update();
 }
 void keypad_reset() {
     std::lock_guard<std::mutex> lg(keypad_mut);
     memset(&keypad.kpc, 0, sizeof keypad.kpc);
     keypad.touchpad_page = 0x04;
     sched.items[SCHED_KEYPAD].clock = CLOCK_APB;
-    sched.items[SCHED_KEYPAD].second = -1;
+    sched.items[SCHED_KEYPAD].disabled = true;
     sched.items[SCHED_KEYPAD].proc = keypad_scan_event;
 }
 
@@ -331,23 +361,25 @@ bool keypad_resume(const emu_snapshot *snapshot)
 
 void keypad_set_key(int row, int col, bool state)
 {
-    std::lock_guard<std::mutex> lg(keypad_mut);
-
     assert(row < KEYPAD_ROWS);
     assert(col < KEYPAD_COLS);
 
+    // The next scan picks it up
     if(state)
-        keypad.key_map[row] |= 1 << col;
+        __atomic_fetch_or(&keypad.key_map[row], 1 << col, __ATOMIC_RELAXED);
     else
-        keypad.key_map[row] &= ~(1 << col);
+        __atomic_fetch_and(&keypad.key_map[row], ~(1 << col), __ATOMIC_RELAXED);
 
     if(state && row == 0 && col == 9)
         keypad_on_pressed();
+
+    input_record_key(row, col, state);
 }
 
 void touchpad_set_state(float x, float y, bool contact, bool down)
 {
     std::lock_guard<std::mutex> lg(keypad_mut);
+    input_record_touchpad(x, y, contact, down);
     if(contact || down)
     {
         int new_x = x * TOUCHPAD_X_MAX,
@@ -389,6 +421,6 @@ void touchpad_set_state(float x, float y, bool contact, bool down)
     keypad.touchpad_down = down;
     keypad.touchpad_contact = contact;
 
-    keypad.kpc.gpio_int_active |= 0x800;
+    __atomic_fetch_or(&keypad.kpc.gpio_int_active, 0x800, __ATOMIC_RELAXED);
     keypad_int_check();
 }
@@ -1,13 +1,36 @@
 #include <string.h>
 #include <stdint.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "capture.h"
 #include "emu.h"
 #include "gif.h"
 #include "interrupt.h"
 #include "schedule.h"
 #include "mem.h"
+#include "misc.h"
+#include "shmem.h"
 
 static lcd_state lcd;
+// Of the last frame, see lcd_frame_hash
+static uint64_t last_frame_hash;
+// Whether capture_frame got the frames so far
+static bool capturing;
+
+bool lcd_draw_frames = false;
+
+/* The frames for lcd_frame_acquire. Each buffer is either the one being
+   drawn into, the latest complete one or the one the GUI shows, so neither
+   side waits for the other. frame_latest has FRAME_NEW set until the GUI
+   takes it, only the indices get exchanged. */
+static uint16_t frames[3][320 * 240];
+static int frame_drawn = 0, frame_shown = 1, frame_latest = 2;
+#define FRAME_NEW 4
 
 /* Draw the current screen into a 4bpp bitmap. (SetDIBitsToDevice
  * supports either orientation, but some programs can't paste right-side-up bitmaps) */
@@ -58,71 +81,173 @@ void lcd_draw_frame(uint8_t *buffer) {
     }
 }
 
-void lcd_cx_w_draw_frame(uint16_t *buffer)
-{
-    uint32_t mode = lcd.control >> 1 & 7;
-    uint32_t bpp;
-    if (mode <= 5)
-        bpp = 1 << mode;
-    else
-        bpp = 16;
+/* How lcd_cx_convert_line turns the pixels of the framebuffer into RGB565,
+   all conversions are done in the same pass. */
+typedef struct lcd_format {
+    uint32_t mode, bpp;
+    uint32_t bi; // XORed into the position of a pixel in its word, for the palette modes
+    bool swap_halfwords; // Of the 16 bpp modes
+    bool rgb555, rgb444, bgr; // Conversions of the 16 bpp modes, bgr for mode 5 as well
+    uint16_t lut[256]; // The palette converted into the final colors
+} lcd_format;
 
-    uint16_t *in = (uint16_t *)phys_mem_ptr(lcd.framebuffer, (320 * 240) / 8 * bpp);
-    if(!in || !lcd.framebuffer)
-    {
-        memset(buffer, 0, 320 * 240 * 2);
-        return;
-    }
+static void lcd_cx_format(lcd_format *f, uint32_t mode, uint32_t bpp, bool hww) {
+    f->mode = mode;
+    f->bpp = bpp;
+    f->bi = (lcd.control & (1 << 9)) ? 0 : 24;
+    if (!(lcd.control & (1 << 10)))
+        f->bi ^= (8 - bpp);
+    // The HW-W LCD doesn't swap them
+    f->swap_halfwords = !hww && (lcd.control & (1 << 9));
+    f->rgb555 = mode == 4;
+    f->rgb444 = emulate_cx && mode == 7;
+    f->bgr = emulate_cx && !(lcd.control & (1 << 8));
 
-    if(mode == 6)
-    {
-        for (int col = 0; col < 320; ++col)
-        {
-            uint16_t *out = buffer + col;
-            for(int row = 0; row < 240; ++row, out += 320)
-                *out = *in++;
+    if (bpp < 16) {
+        for (uint32_t i = 0; i < (1u << bpp); i++) {
+            uint16_t color = lcd.palette[i];
+            color = color + (color & 0xFFE0) + (color >> 10 & 0x20);
+            if (f->bgr)
+                color = color << 11 | (color & 0x07E0) | color >> 11;
+            f->lut[i] = color;
         }
     }
-    else if(mode == 4)
-    {
-        for (int col = 0; col < 320; ++col)
-        {
-            uint16_t *out = buffer + col;
-            for(int row = 0; row < 240; ++row, out += 320)
-            {
-                uint16_t color = *in++;
-                uint8_t b = color & 0x1F,
-                        g = (color >> 5) & 0x1F,
-                        r = (color >> 10) & 0x1F;
-
-                *out = (r << 11) | (g << 6) | b | (color >> 10 & 0x20);
-            }
+}
+
+static void lcd_cx_convert_palette(uint16_t *out, const uint32_t *in, unsigned int pixels, const lcd_format *f) {
+    uint32_t bpp = f->bpp, bi = f->bi, mask = (1 << bpp) - 1;
+    for (unsigned int words = pixels * bpp / 32; words; --words) {
+        uint32_t word = *in++;
+        int bitpos = 32;
+        do {
+            *out++ = f->lut[word >> ((bitpos -= bpp) ^ bi) & mask];
+        } while (bitpos != 0);
+    }
+}
+
+// Always inlined with constant flags by lcd_cx_convert_16, so that the loops don't branch
+static inline __attribute__((always_inline)) void lcd_cx_kernel_16(uint16_t *out, const uint16_t *in, unsigned int pixels,
+                                                                    bool swap_halfwords, bool rgb555, bool rgb444, bool bgr) {
+    unsigned int i = 0;
+#if defined(__SSE2__)
+    const __m128i m7fe0 = _mm_set1_epi16(0x7FE0), m001f = _mm_set1_epi16(0x001F), m0020 = _mm_set1_epi16(0x0020),
+            m0f00 = _mm_set1_epi16(0x0F00), m00f0 = _mm_set1_epi16(0x00F0), m000f = _mm_set1_epi16(0x000F),
+            m07e0 = _mm_set1_epi16(0x07E0);
+    for (; i + 8 <= pixels; i += 8) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(in + i));
+        if (swap_halfwords)
+            c = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, 0xB1), 0xB1);
+        if (rgb555)
+            c = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(_mm_and_si128(c, m7fe0), 1), _mm_and_si128(c, m001f)),
+                             _mm_and_si128(_mm_srli_epi16(c, 10), m0020));
+        else if (rgb444)
+            c = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(_mm_and_si128(c, m0f00), 4), _mm_slli_epi16(_mm_and_si128(c, m00f0), 3)),
+                             _mm_slli_epi16(_mm_and_si128(c, m000f), 1));
+        if (bgr)
+            c = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(c, 11), _mm_and_si128(c, m07e0)), _mm_srli_epi16(c, 11));
+        _mm_storeu_si128((__m128i *)(out + i), c);
+    }
+#elif defined(__ARM_NEON)
+    const uint16x8_t m7fe0 = vdupq_n_u16(0x7FE0), m001f = vdupq_n_u16(0x001F), m0020 = vdupq_n_u16(0x0020),
+            m0f00 = vdupq_n_u16(0x0F00), m00f0 = vdupq_n_u16(0x00F0), m000f = vdupq_n_u16(0x000F),
+            m07e0 = vdupq_n_u16(0x07E0);
+    for (; i + 8 <= pixels; i += 8) {
+        uint16x8_t c = vld1q_u16(in + i);
+        if (swap_halfwords)
+            c = vrev32q_u16(c);
+        if (rgb555)
+            c = vorrq_u16(vorrq_u16(vshlq_n_u16(vandq_u16(c, m7fe0), 1), vandq_u16(c, m001f)),
+                          vandq_u16(vshrq_n_u16(c, 10), m0020));
+        else if (rgb444)
+            c = vorrq_u16(vorrq_u16(vshlq_n_u16(vandq_u16(c, m0f00), 4), vshlq_n_u16(vandq_u16(c, m00f0), 3)),
+                          vshlq_n_u16(vandq_u16(c, m000f), 1));
+        if (bgr)
+            c = vorrq_u16(vorrq_u16(vshlq_n_u16(c, 11), vandq_u16(c, m07e0)), vshrq_n_u16(c, 11));
+        vst1q_u16(out + i, c);
+    }
+#endif
+    for (; i < pixels; i++) {
+        uint16_t color = in[i ^ swap_halfwords];
+        if (rgb555)
+            color = (color & 0x7FE0) << 1 | (color & 0x1F) | (color >> 10 & 0x20);
+        else if (rgb444)
+            color = (color & 0xF00) << 4 | (color & 0x0F0) << 3 | (color & 0x00F) << 1;
+        if (bgr)
+            color = color << 11 | (color & 0x07E0) | color >> 11;
+        out[i] = color;
+    }
+}
+
+#define LCD_CX_KERNEL_16(swap_halfwords, rgb555, rgb444) \
+    (f->bgr ? lcd_cx_kernel_16(out, in, pixels, swap_halfwords, rgb555, rgb444, true) \
+            : lcd_cx_kernel_16(out, in, pixels, swap_halfwords, rgb555, rgb444, false))
+
+static void lcd_cx_convert_16(uint16_t *out, const uint16_t *in, unsigned int pixels, const lcd_format *f) {
+    if (f->rgb555)
+        f->swap_halfwords ? LCD_CX_KERNEL_16(true, true, false) : LCD_CX_KERNEL_16(false, true, false);
+    else if (f->rgb444)
+        f->swap_halfwords ? LCD_CX_KERNEL_16(true, false, true) : LCD_CX_KERNEL_16(false, false, true);
+    else if (f->swap_halfwords)
+        LCD_CX_KERNEL_16(true, false, false);
+    else if (f->bgr)
+        lcd_cx_kernel_16(out, in, pixels, false, false, false, true);
+    else
+        memcpy(out, in, pixels * 2);
+}
+
+// 32bpp mode: Convert 888 to 565
+static void lcd_cx_convert_888(uint16_t *out, const uint32_t *in, unsigned int pixels, const lcd_format *f) {
+    const bool bgr = f->bgr;
+    unsigned int i = 0;
+#if defined(__SSE2__)
+    const __m128i mf800 = _mm_set1_epi32(0xF800), m07e0 = _mm_set1_epi32(0x07E0), m001f = _mm_set1_epi32(0x001F),
+            m07e0_16 = _mm_set1_epi16(0x07E0);
+    for (; i + 8 <= pixels; i += 8) {
+        __m128i w[2];
+        for (int j = 0; j < 2; j++) {
+            __m128i word = _mm_loadu_si128((const __m128i *)(in + i + j * 4));
+            w[j] = _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_srli_epi32(word, 8), mf800), _mm_and_si128(_mm_srli_epi32(word, 5), m07e0)),
+                                _mm_and_si128(_mm_srli_epi32(word, 3), m001f));
+            // Sign extended, so that the saturation of the pack doesn't change anything
+            w[j] = _mm_srai_epi32(_mm_slli_epi32(w[j], 16), 16);
         }
+        __m128i c = _mm_packs_epi32(w[0], w[1]);
+        if (bgr)
+            c = _mm_or_si128(_mm_or_si128(_mm_slli_epi16(c, 11), _mm_and_si128(c, m07e0_16)), _mm_srli_epi16(c, 11));
+        _mm_storeu_si128((__m128i *)(out + i), c);
     }
-    else if(mode < 4)
-    {
-        uint32_t *in32 = (uint32_t*) in;
-        for (int col = 0; col < 320; ++col)
-        {
-            uint16_t *out = buffer + col;
-            uint32_t words = (240 * bpp) / 32;
-            uint32_t mask = (1 << bpp) - 1;
-            uint32_t bi = (lcd.control & (1 << 9)) ? 0 : 24;
-            if (!(lcd.control & (1 << 10)))
-                bi ^= (8 - bpp);
-            do {
-                uint32_t word = *in32++;
-                int bitpos = 32;
-                do {
-                    uint16_t color = lcd.palette[word >> ((bitpos -= bpp) ^ bi) & mask];
-                    *out = color + (color & 0xFFE0) + (color >> 10 & 0x20);
-                    out += 320;
-                } while (bitpos != 0);
-            } while (--words != 0);
+#elif defined(__ARM_NEON)
+    const uint32x4_t mf800 = vdupq_n_u32(0xF800), m07e0 = vdupq_n_u32(0x07E0), m001f = vdupq_n_u32(0x001F);
+    const uint16x8_t m07e0_16 = vdupq_n_u16(0x07E0);
+    for (; i + 8 <= pixels; i += 8) {
+        uint16x4_t w[2];
+        for (int j = 0; j < 2; j++) {
+            uint32x4_t word = vld1q_u32(in + i + j * 4);
+            w[j] = vmovn_u32(vorrq_u32(vorrq_u32(vandq_u32(vshrq_n_u32(word, 8), mf800), vandq_u32(vshrq_n_u32(word, 5), m07e0)),
+                                       vandq_u32(vshrq_n_u32(word, 3), m001f)));
         }
+        uint16x8_t c = vcombine_u16(w[0], w[1]);
+        if (bgr)
+            c = vorrq_u16(vorrq_u16(vshlq_n_u16(c, 11), vandq_u16(c, m07e0_16)), vshrq_n_u16(c, 11));
+        vst1q_u16(out + i, c);
+    }
+#endif
+    for (; i < pixels; i++) {
+        uint32_t word = in[i];
+        uint16_t color = (word >> 8 & 0xF800) | (word >> 5 & 0x7E0) | (word >> 3 & 0x1F);
+        if (bgr)
+            color = color << 11 | (color & 0x07E0) | color >> 11;
+        out[i] = color;
     }
-    else // TODO: Support for other modes
-        return;
+}
+
+static void lcd_cx_convert_line(uint16_t *out, const uint8_t *in, unsigned int pixels, const lcd_format *f) {
+    if (f->bpp < 16)
+        lcd_cx_convert_palette(out, (const uint32_t *)in, pixels, f);
+    else if (f->mode == 5)
+        lcd_cx_convert_888(out, (const uint32_t *)in, pixels, f);
+    else
+        lcd_cx_convert_16(out, (const uint16_t *)in, pixels, f);
 }
 
 /* Draw the current screen into a 16bpp bitmap. */
@@ -134,89 +259,99 @@ void lcd_cx_draw_frame(uint16_t *buffer) {
     else
         bpp = 16;
 
+    const uint8_t *in = (const uint8_t *)phys_mem_ptr(lcd.framebuffer, (320 * 240) / 8 * bpp);
+    if (!in || !lcd.framebuffer) {
+        memset(buffer, 0, 320 * 240 * 2);
+        return;
+    }
+
     // HW-W features a new 240x320 LCD instead of the usual 320x240px one
-    if((features & FEATURE_HWW) == FEATURE_HWW)
-        lcd_cx_w_draw_frame(buffer);
-    else
-    {
-        uint32_t *in = (uint32_t *)phys_mem_ptr(lcd.framebuffer, (320 * 240) / 8 * bpp);
-        if (!in || !lcd.framebuffer) {
-            memset(buffer, 0, 320 * 240 * 2);
-            return;
-        }
-        int row;
-        for (row = 0; row < 240; ++row) {
-            uint16_t *out = buffer + (row * 320);
-            uint32_t words = (320 / 32) * bpp;
-            if (bpp < 16) {
-                uint32_t mask = (1 << bpp) - 1;
-                uint32_t bi = (lcd.control & (1 << 9)) ? 0 : 24;
-                if (!(lcd.control & (1 << 10)))
-                    bi ^= (8 - bpp);
-                do {
-                    uint32_t word = *in++;
-                    int bitpos = 32;
-                    do {
-                        uint16_t color = lcd.palette[word >> ((bitpos -= bpp) ^ bi) & mask];
-                        *out++ = color + (color & 0xFFE0) + (color >> 10 & 0x20);
-                    } while (bitpos != 0);
-                } while (--words != 0);
-            } else if (mode == 4) {
-                uint32_t i, bi = lcd.control >> 9 & 1;
-                for (i = 0; i < 320; i++) {
-                    uint16_t color = ((uint16_t *)in)[i ^ bi];
-                    uint8_t b = color & 0x1F,
-                            g = (color >> 5) & 0x1F,
-                            r = (color >> 10) & 0x1F;
-
-                    out[i] = (r << 11) | (g << 6) | b | (color >> 10 & 0x20);
-                }
-                in += 160;
-            } else if (mode == 5) {
-                // 32bpp mode: Convert 888 to 565
-                do {
-                    uint32_t word = *in++;
-                    *out++ = (word >> 8 & 0xF800) | (word >> 5 & 0x7E0) | (word >> 3 & 0x1F);
-                } while (--words != 0);
-            } else {
-                if (!(lcd.control & (1 << 9))) {
-                    memcpy(out, in, 640);
-                    in += 160;
-                } else {
-                    uint32_t *outw = (uint32_t *)out;
-                    do {
-                        uint32_t word = *in++;
-                        *outw++ = word << 16 | word >> 16;
-                    } while (--words != 0);
-                }
-            }
+    bool hww = (features & FEATURE_HWW) == FEATURE_HWW;
+    if (hww && (mode == 5 || mode == 7)) // TODO: Support for other modes
+        return;
+
+    lcd_format format;
+    lcd_cx_format(&format, mode, bpp, hww);
+
+    if (!hww) {
+        for (int row = 0; row < 240; ++row, in += 320 / 8 * bpp)
+            lcd_cx_convert_line(buffer + row * 320, in, 320, &format);
+    } else {
+        // Its framebuffer is column by column, only whole words of each
+        uint16_t column[240];
+        unsigned int pixels = (240 * bpp) / 32 * 32 / bpp;
+        for (int col = 0; col < 320; ++col, in += pixels * bpp / 8) {
+            lcd_cx_convert_line(column, in, pixels, &format);
+            uint16_t *out = buffer + col;
+            for (unsigned int row = 0; row < pixels; ++row, out += 320)
+                *out = column[row];
         }
     }
+}
+
+/* Cheap hash of everything the frame drawn by lcd_cx_draw_frame depends on,
+   a hash of the framebuffer is a lot less work than drawing it. */
+static uint64_t lcd_frame_hash(void) {
+    uint64_t hash = (uint64_t)lcd.framebuffer << 32 ^ lcd.control << 8 ^ (hdq1w.lcd_contrast == 0);
+    const uint64_t *palette = (const uint64_t *)lcd.palette;
+    for (unsigned int i = 0; i < sizeof(lcd.palette) / 8; i++)
+        hash = (hash ^ palette[i]) * 0x9E3779B97F4A7C15ULL;
+
+    uint32_t mode = lcd.control >> 1 & 7;
+    uint32_t size = (320 * 240) / 8 * (mode <= 5 ? 1 << mode : 16);
+    const uint64_t *in = (const uint64_t *)phys_mem_ptr(lcd.framebuffer, size);
+    if (in) {
+        for (const uint64_t *end = in + size / 8; in < end; in++)
+            hash = (hash ^ *in) * 0x9E3779B97F4A7C15ULL;
+    }
 
-    if(emulate_cx)
-    {
-        if (mode == 7)
-        {
-            // Convert RGB444 to RGB565
-            uint16_t *buffer_end = buffer + 320*240;
-            while(buffer < buffer_end)
-            {
-                uint16_t color = *buffer;
-                *buffer++ = (color & 0xF00) << 4 | (color & 0x0F0) << 3 | (color & 0x00F) << 1;
-            }
-        }
+    return hash ^ hash >> 29;
+}
+
+uint64_t lcd_frames;
+uint64_t lcd_drawn_hash;
+
+uint64_t lcd_pixels_hash(const uint16_t *frame) {
+    uint64_t hash = 0;
+    const uint64_t *in = (const uint64_t *)frame;
+    for (const uint64_t *end = in + 320 * 240 / 4; in < end; in++)
+        hash = (hash ^ *in) * 0x9E3779B97F4A7C15ULL;
+
+    return hash ^ hash >> 29;
+}
 
-        if (!(lcd.control & (1 << 8)))
-        {
-            // Convert BGR565 to RGB565
-            uint16_t *buffer_end = buffer + 320*240;
-            while(buffer < buffer_end)
-            {
-                uint16_t color = *buffer;
-                *buffer++ = (color & 0x001F) << 11 | (color & 0x07E0) | (color & 0xF800) >> 11;
+// Draws the frame for the GUI and lets it know, returns it if drawn
+static const uint16_t *lcd_publish_frame(void) {
+    const uint16_t *drawn = NULL;
+    lcd_frames++;
+    if (lcd_draw_frames || capture_active() || shmem_active()) {
+        uint16_t *frame = frames[frame_drawn];
+        lcd_cx_draw_frame(frame);
+        if (!emulate_cx) {
+            // 4 bit grayscale, 0 is white
+            for (unsigned int i = 0; i < 320 * 240; ++i) {
+                uint16_t gray = 15 - (frame[i] & 0xF);
+                frame[i] = (gray << 1 | gray >> 3) * 0x0801 | (gray << 2 | gray >> 2) << 5;
             }
         }
+
+        lcd_drawn_hash = lcd_pixels_hash(frame);
+        shmem_publish_frame(frame);
+
+        // Only drawn into again once the GUI is done with it
+        drawn = frame;
+        frame_drawn = __atomic_exchange_n(&frame_latest, frame_drawn | FRAME_NEW, __ATOMIC_ACQ_REL) & 3;
     }
+
+    gui_lcd_changed();
+    return drawn;
+}
+
+const uint16_t *lcd_frame_acquire(void) {
+    if (__atomic_load_n(&frame_latest, __ATOMIC_ACQUIRE) & FRAME_NEW)
+        frame_shown = __atomic_exchange_n(&frame_latest, frame_shown, __ATOMIC_ACQ_REL) & 3;
+
+    return frames[frame_shown];
 }
 
 static void lcd_event(int index) {
@@ -231,12 +366,26 @@ static void lcd_event(int index) {
             + (lcd.timing[1] >> 16 &  0xFF)      // Front porch
             + (lcd.timing[1] >> 10 &  0x3F) + 1  // Sync pulse
             + (lcd.timing[1]       & 0x3FF) + 1; // Active
+    uint64_t tick = sched.items[index].tick;
     event_repeat(index, pcd * htime * vtime);
     // for now, assuming vcomp occurs at same time UPBASE is loaded
     lcd.framebuffer = lcd.upbase;
     lcd.int_status |= 0xC;
     int_set(INT_LCD, lcd.int_status & lcd.int_mask);
 
+    // Only frames which look different get to the GUI, a new capture needs one to start with
+    uint64_t hash = lcd_frame_hash();
+    bool capture = capture_active();
+    const uint16_t *frame = NULL;
+    if (hash != last_frame_hash || (capture && !capturing)) {
+        last_frame_hash = hash;
+        frame = lcd_publish_frame();
+    }
+
+    capturing = capture;
+    if (capture)
+        capture_frame(frame, tick, sched.clock_rates[sched.items[index].clock], pcd * htime * vtime);
+
     gif_new_frame();
 }
 
@@ -244,8 +393,9 @@ void lcd_reset() {
     // Palette is unchanged on a reset
     memset(&lcd, 0, (char *)&lcd.palette - (char *)&lcd);
     sched.items[SCHED_LCD].clock = emulate_cx ? CLOCK_12M : CLOCK_27M;
-    sched.items[SCHED_LCD].second = -1;
+    sched.items[SCHED_LCD].disabled = true;
     sched.items[SCHED_LCD].proc = lcd_event;
+    lcd_publish_frame();
 }
 
 uint32_t lcd_read_word(uint32_t addr) {
@@ -300,6 +450,9 @@ write_control:
                         event_clear(SCHED_LCD);
                 }
                 lcd.control = value;
+                // Without frames, the GUI has to know that right away
+                if (!(value & 1))
+                    lcd_publish_frame();
                 return;
             case 0x028:
                 lcd.int_status &= ~value;
@@ -323,5 +476,7 @@ bool lcd_suspend(emu_snapshot *snapshot)
 bool lcd_resume(const emu_snapshot *snapshot)
 {
     lcd = snapshot->mem.lcd;
+    // The memory might not be there yet, so this waits for the next frame
+    last_frame_hash = 0;
     return true;
 }
@@ -3,6 +3,7 @@
 #ifndef _H_LCD
 #define _H_LCD
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -23,6 +24,21 @@ typedef struct lcd_state {
 void lcd_draw_frame(uint8_t *buffer);
 void lcd_cx_draw_frame(uint16_t *buffer);
 
+/* If set, each frame which looks different gets drawn in RGB565 by the
+   emulation, also on models without color, right before gui_lcd_changed. */
+extern bool lcd_draw_frames;
+/* Returns the latest of them, without copying or waiting. It stays the same
+   until the next call, so only one thread may use this. */
+const uint16_t *lcd_frame_acquire(void);
+// Frames which looked different so far, for the statistics
+extern uint64_t lcd_frames;
+/* Hash of the 320 * 240 RGB565 pixels of a frame: from 0, for each 8 bytes
+   as a word w in host byte order hash = (hash ^ w) * 0x9E3779B97F4A7C15,
+   then hash ^ hash >> 29. Simple enough to compute from a screenshot. */
+uint64_t lcd_pixels_hash(const uint16_t *frame);
+// Of the latest frame which got drawn, 0 if there is none
+extern uint64_t lcd_drawn_hash;
+
 void lcd_reset(void);
 typedef struct emu_snapshot emu_snapshot;
 bool lcd_suspend(emu_snapshot *snapshot);
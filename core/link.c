@@ -321,7 +321,13 @@ bad_format:
     packet_callback();
 }
 
-/* Advance to next bit in packet being read/written */
+/* Advance to next bit in packet being read/written. Called once per bit,
+ * when the calculator released the acknowledgement, as it bit-bangs the
+ * protocol: the TI-84 OS, running in the Nspire OS' Z80 emulator, pulls a
+ * line, polls for the acknowledgement and releases it again. Everything
+ * else deals with whole packets already (see send_packet and
+ * packet_callback). Completing whole bytes at once would need to recognize
+ * the guest's link routine, so that isn't done. */
 static void next_bit() {
     packet_bit = (packet_bit + 1) & 7;
     if (packet_bit == 0) {
@@ -370,6 +376,8 @@ void ti84_io_link_reset() {
     link_input = 3;
     link_output = 3;
 }
+/* Each poll of the calculator gets answered right away, with the bit
+ * next_bit got to, so transfers go as fast as the guest polls. */
 uint32_t ti84_io_link_read(uint32_t addr) {
     //printf("read %08x (in=%d out=%d)\n", addr, link_input, link_output);
     switch (addr & 0xFFFF) {
@@ -26,6 +26,14 @@ void literalpool_add(uintptr_t value)
 	                                          .value = value };
 }
 
+/* Forgets the references from code at or after inst, which got thrown away.
+   Otherwise literalpool_fill would patch what's emitted there later. */
+void literalpool_rollback(void *inst)
+{
+	while(literals_count > 0 && literals[literals_count - 1].inst >= inst)
+		--literals_count;
+}
+
 /* Function implemented by the architecture.
    It needs to iterate through all elements in literals until literals_count,
    emit the literal into a suitable location and fixup all instructions that
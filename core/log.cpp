@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+#include <thread>
+
+#include "emu.h"
+#include "log.h"
+#include "os/os.h"
+
+int log_enabled[MAX_LOG];
+
+/* Only the emulation thread logs, so the buffer has a single producer and
+   the writer as the single consumer. */
+static const size_t log_buffer_size = 1 << 20; // A power of two
+static char log_buffer[log_buffer_size];
+static std::atomic<size_t> log_head{0}, log_tail{0}; // Bytes written and read
+static std::atomic<bool> log_stopping{false};
+static std::atomic<uint32_t> log_dropped{0};
+static std::thread log_writer;
+static FILE *log_file;
+// Of the producer, whether the next one starts a line
+static bool log_line_start = true;
+
+static void log_write_buffered()
+{
+    for(;;)
+    {
+        // Everything logged before stopping is in the buffer then
+        bool stopping = log_stopping;
+        size_t tail = log_tail.load(std::memory_order_relaxed),
+               head = log_head.load(std::memory_order_acquire);
+
+        if(head == tail)
+        {
+            if(stopping)
+                break;
+
+            fflush(log_file);
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            continue;
+        }
+
+        // Up to the end of the buffer, the rest in the next round
+        size_t start = tail & (log_buffer_size - 1),
+               size = std::min(head - tail, log_buffer_size - start);
+        fwrite(log_buffer + start, 1, size, log_file);
+        log_tail.store(tail + size, std::memory_order_release);
+
+        if(uint32_t dropped = log_dropped.exchange(0))
+            fprintf(log_file, "(%u lines of the log dropped)\n", dropped);
+    }
+
+    fflush(log_file);
+}
+
+static void log_push(const char *data, size_t size)
+{
+    size_t head = log_head.load(std::memory_order_relaxed),
+           tail = log_tail.load(std::memory_order_acquire);
+
+    if(log_buffer_size - (head - tail) < size)
+    {
+        log_dropped++;
+        return;
+    }
+
+    size_t start = head & (log_buffer_size - 1),
+           first = std::min(size, log_buffer_size - start);
+    memcpy(log_buffer + start, data, first);
+    memcpy(log_buffer, data + first, size - first);
+    log_head.store(head + size, std::memory_order_release);
+}
+
+void log_write(int type, const char *fmt, ...)
+{
+    if(!log_file)
+        return;
+
+    char line[512];
+    int len = 0;
+    if(log_line_start)
+        len = snprintf(line, sizeof(line), "%12" PRIu64 " %c ", sched_cputick(), LOG_TYPE_TBL[type]);
+
+    va_list va;
+    va_start(va, fmt);
+    int printed = vsnprintf(line + len, sizeof(line) - len, fmt, va);
+    va_end(va);
+
+    if(printed < 0)
+        return;
+
+    // Cut off, but still ending the line
+    len += printed;
+    if(len >= (int) sizeof(line))
+    {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    if(len == 0)
+        return;
+
+    log_line_start = line[len - 1] == '\n';
+
+    if(log_writer.joinable())
+        log_push(line, len);
+    else
+        fwrite(line, 1, len, log_file);
+}
+
+bool log_start(const char *types, const char *filename)
+{
+    log_stop();
+
+    int enable[MAX_LOG] = {};
+    for(const char *c = types; *c; ++c)
+    {
+        const char *type = strchr(LOG_TYPE_TBL, *c);
+        if(!type)
+            return false;
+
+        enable[type - LOG_TYPE_TBL] = 1;
+    }
+
+    log_file = strcmp(filename, "-") == 0 ? stderr : fopen_utf8(filename, "w");
+    if(!log_file)
+        return false;
+
+    log_head = log_tail = 0;
+    log_dropped = 0;
+    log_stopping = false;
+    log_line_start = true;
+
+    try
+    {
+        log_writer = std::thread(log_write_buffered);
+    }
+    catch(const std::system_error &)
+    {
+        // Without threads, log_write writes the lines itself
+    }
+
+    memcpy(log_enabled, enable, sizeof(log_enabled));
+    return true;
+}
+
+void log_stop()
+{
+    memset(log_enabled, 0, sizeof(log_enabled));
+    if(!log_file)
+        return;
+
+    if(log_writer.joinable())
+    {
+        log_stopping = true;
+        log_writer.join();
+    }
+
+    if(log_file != stderr)
+        fclose(log_file);
+    else
+        fflush(log_file);
+
+    log_file = nullptr;
+}
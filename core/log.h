@@ -0,0 +1,39 @@
+/* Declarations for log.cpp */
+
+#ifndef _H_LOG
+#define _H_LOG
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum { LOG_CPU, LOG_IO, LOG_FLASH, LOG_INTS, LOG_ICOUNT, LOG_USB, LOG_GDB, MAX_LOG };
+#define LOG_TYPE_TBL "CIFQ#UG"
+extern int log_enabled[MAX_LOG];
+
+// Bitmask of the types which get compiled in at all, e.g. -DLOG_COMPILED=0 for none
+#ifndef LOG_COMPILED
+    #define LOG_COMPILED (~0u)
+#endif
+
+#define log_active(type) (((LOG_COMPILED) >> (type) & 1) && log_enabled[type])
+// The arguments only get evaluated if type is enabled
+#define logprintf(type, ...) do { if(log_active(type)) log_write(type, __VA_ARGS__); } while(0)
+
+/* Each line gets the CPU cycle (see sched_cputick) and the type from
+   LOG_TYPE_TBL in front. The lines get formatted into a ring buffer which a
+   background thread writes out, so that logging doesn't slow the emulation
+   down by much. If it doesn't keep up, lines get dropped and counted. */
+void log_write(int type, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+// Enables the types in types (characters of LOG_TYPE_TBL) to filename, "-" is stderr
+bool log_start(const char *types, const char *filename);
+// Writes what's left and disables all types
+void log_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
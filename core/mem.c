@@ -17,6 +17,8 @@
 #include "usb.h"
 #include "casplus.h"
 #include "mem.h"
+#include "mmu.h"
+#include "shmem.h"
 #include "debug.h"
 #include "translate.h"
 
@@ -35,9 +37,6 @@ void bad_write_byte(uint32_t addr, uint8_t value)  { warn("Bad write_byte: %08x
 void bad_write_half(uint32_t addr, uint16_t value) { warn("Bad write_half: %08x %04x", addr, value); }
 void bad_write_word(uint32_t addr, uint32_t value) { warn("Bad write_word: %08x %08x", addr, value); }
 
-uint8_t *mem_and_flags = NULL;
-struct mem_area_desc mem_areas[4];
-
 void *phys_mem_ptr(uint32_t addr, uint32_t size) {
     unsigned int i;
     for (i = 0; i < sizeof(mem_areas)/sizeof(*mem_areas); i++) {
@@ -58,48 +57,151 @@ uint32_t phys_mem_addr(void *ptr) {
     return -1; // should never happen
 }
 
-void read_action(void *ptr) {
-    uint32_t addr = phys_mem_addr(ptr);
-    if (!gdb_connected)
-        emuprintf("Hit read breakpoint at %08x. Entering debugger.\n", addr);
-    debugger(DBG_READ_BREAKPOINT, addr);
+uint8_t mem_watched_pages[MEM_MAXSIZE >> 10];
+static struct mem_watchpoint watchpoints[MEM_WATCHPOINTS_MAX];
+static unsigned int watchpoint_count;
+
+static inline bool watchpoint_overlaps(const struct mem_watchpoint *w, const uint8_t *start, const uint8_t *end) {
+    return w->ptr < end && start < w->ptr + w->size;
 }
 
-void write_action(void *ptr) {
-    uint32_t addr = phys_mem_addr(ptr);
-    volatile uint32_t *flags = &RAM_FLAGS((size_t)ptr & ~3);
-    if (*flags & RF_WRITE_BREAKPOINT) {
+// Enters the debugger if the access of size bytes at ptr hits a watchpoint of that type
+static void watchpoint_check(void *ptr, uint32_t size, uint32_t type) {
+    for (unsigned int i = 0; i < watchpoint_count; i++) {
+        if (!(watchpoints[i].type & type) || !watchpoint_overlaps(&watchpoints[i], ptr, (uint8_t *)ptr + size))
+            continue;
+
+        uint32_t addr = phys_mem_addr(ptr);
+        bool writing = type == RF_WRITE_BREAKPOINT;
         if (!gdb_connected)
-            emuprintf("Hit write breakpoint at %08x. Entering debugger.\n", addr);
-        debugger(DBG_WRITE_BREAKPOINT, addr);
+            emuprintf("Hit %s breakpoint at %08x. Entering debugger.\n", writing ? "write" : "read", addr);
+        debugger(writing ? DBG_WRITE_BREAKPOINT : DBG_READ_BREAKPOINT, addr);
+        return;
+    }
+}
+
+// Rebuilds the flags and page bits between start and end from the list
+static void watchpoints_update(uint8_t *start, uint8_t *end) {
+    uint8_t *first_word = (uint8_t *)((uintptr_t)start & ~3), *end_word = (uint8_t *)(((uintptr_t)end + 3) & ~3);
+    for (uint8_t *word = first_word; word < end_word; word += 4)
+        RAM_FLAGS(word) &= ~(RF_READ_BREAKPOINT | RF_WRITE_BREAKPOINT);
+
+    for (unsigned int i = 0; i < watchpoint_count; i++) {
+        struct mem_watchpoint *w = &watchpoints[i];
+        if (!watchpoint_overlaps(w, first_word, end_word))
+            continue;
+
+        uint8_t *from = w->ptr > first_word ? (uint8_t *)((uintptr_t)w->ptr & ~3) : first_word;
+        uint8_t *to = w->ptr + w->size < end_word ? w->ptr + w->size : end_word;
+        for (uint8_t *word = from; word < to; word += 4)
+            RAM_FLAGS(word) |= w->type;
+    }
+
+    for (uint32_t page = (start - mem_and_flags) >> 10; page <= (uint32_t)(end - 1 - mem_and_flags) >> 10; page++) {
+        uint8_t *page_start = mem_and_flags + (page << 10);
+        uint8_t type = 0;
+        for (unsigned int i = 0; i < watchpoint_count; i++)
+            if (watchpoint_overlaps(&watchpoints[i], page_start, page_start + 0x400))
+                type |= watchpoints[i].type;
+
+        if (mem_watched_pages[page] != type) {
+            mem_watched_pages[page] = type;
+            addr_cache_flush_ptr(page_start);
+        }
+    }
+}
+
+static void watchpoints_clear() {
+    watchpoint_count = 0;
+    memset(mem_watched_pages, 0, sizeof(mem_watched_pages));
+}
+
+bool memory_set_watchpoint(void *ptr, uint32_t size, uint32_t type, bool set) {
+    uint8_t *start = ptr, *end = start + size;
+    if (!size || !phys_mem_ptr(phys_mem_addr(ptr), size))
+        return false;
+
+    if (set) {
+        unsigned int i;
+        for (i = 0; i < watchpoint_count && (watchpoints[i].ptr != start || watchpoints[i].size != size); i++);
+        if (i == watchpoint_count) {
+            if (watchpoint_count == MEM_WATCHPOINTS_MAX)
+                return false;
+            watchpoints[watchpoint_count++] = (struct mem_watchpoint) { start, size, 0 };
+        }
+        watchpoints[i].type |= type;
+    } else {
+        // Removed ranges may reach further
+        uint8_t *from = start, *to = end;
+        for (unsigned int i = 0; i < watchpoint_count; i++) {
+            struct mem_watchpoint *w = &watchpoints[i];
+            if (!(w->type & type) || !watchpoint_overlaps(w, start, end))
+                continue;
+
+            if (w->ptr < from)
+                from = w->ptr;
+            if (w->ptr + w->size > to)
+                to = w->ptr + w->size;
+            w->type &= ~type;
+            if (!w->type)
+                watchpoints[i--] = watchpoints[--watchpoint_count];
+        }
+        start = from;
+        end = to;
     }
+
+    watchpoints_update(start, end);
+    return true;
+}
+
+const struct mem_watchpoint *memory_watchpoints(unsigned int *count) {
+    *count = watchpoint_count;
+    return watchpoints;
+}
+
+// The helpers in asmcode don't know the size of the access, so the whole word counts
+void read_action(void *ptr) {
+    watchpoint_check((void *)((uintptr_t)ptr & ~3), 4, RF_READ_BREAKPOINT);
+}
+
+static void code_write_action(void *ptr) {
 #ifndef NO_TRANSLATION
+    uint32_t addr = phys_mem_addr(ptr);
+    volatile uint32_t *flags = &RAM_FLAGS((size_t)ptr & ~3);
     if (*flags & RF_CODE_TRANSLATED) {
         logprintf(LOG_CPU, "Wrote to translated code at %08x. Deleting translations.\n", addr);
         invalidate_translation(*flags >> RFS_TRANSLATION_INDEX);
     } else {
         *flags &= ~RF_CODE_NO_TRANSLATE;
     }
+#else
+    (void) ptr;
 #endif
 }
 
+void write_action(void *ptr) {
+    if (RAM_FLAGS((size_t)ptr & ~3) & RF_WRITE_BREAKPOINT)
+        watchpoint_check((void *)((uintptr_t)ptr & ~3), 4, RF_WRITE_BREAKPOINT);
+    code_write_action(ptr);
+}
+
 /* 00000000, 10000000, A4000000: ROM and RAM */
 uint8_t memory_read_byte(uint32_t addr) {
     uint8_t *ptr = phys_mem_ptr(addr, 1);
     if (!ptr) return bad_read_byte(addr);
-    if (RAM_FLAGS((size_t)ptr & ~3) & DO_READ_ACTION) read_action(ptr);
+    if (RAM_FLAGS((size_t)ptr & ~3) & DO_READ_ACTION) watchpoint_check(ptr, 1, RF_READ_BREAKPOINT);
     return *ptr;
 }
 uint16_t memory_read_half(uint32_t addr) {
     uint16_t *ptr = phys_mem_ptr(addr, 2);
     if (!ptr) return bad_read_half(addr);
-    if (RAM_FLAGS((size_t)ptr & ~3) & DO_READ_ACTION) read_action(ptr);
+    if (RAM_FLAGS((size_t)ptr & ~3) & DO_READ_ACTION) watchpoint_check(ptr, 2, RF_READ_BREAKPOINT);
     return *ptr;
 }
 uint32_t memory_read_word(uint32_t addr) {
     uint32_t *ptr = phys_mem_ptr(addr, 4);
     if (!ptr) return bad_read_word(addr);
-    if (RAM_FLAGS(ptr) & DO_READ_ACTION) read_action(ptr);
+    if (RAM_FLAGS(ptr) & DO_READ_ACTION) watchpoint_check(ptr, 4, RF_READ_BREAKPOINT);
     return *ptr;
 }
 void memory_write_byte(uint32_t addr, uint8_t value) {
@@ -107,7 +209,8 @@ void memory_write_byte(uint32_t addr, uint8_t value) {
     if (!ptr) { bad_write_byte(addr, value); return; }
     uint32_t flags = RAM_FLAGS((size_t)ptr & ~3);
     if (flags & RF_READ_ONLY) { bad_write_byte(addr, value); return; }
-    if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if (flags & RF_WRITE_BREAKPOINT) watchpoint_check(ptr, 1, RF_WRITE_BREAKPOINT);
+    if (flags & (DO_WRITE_ACTION & ~RF_WRITE_BREAKPOINT)) code_write_action(ptr);
     *ptr = value;
 }
 void memory_write_half(uint32_t addr, uint16_t value) {
@@ -115,7 +218,8 @@ void memory_write_half(uint32_t addr, uint16_t value) {
     if (!ptr) { bad_write_half(addr, value); return; }
     uint32_t flags = RAM_FLAGS((size_t)ptr & ~3);
     if (flags & RF_READ_ONLY) { bad_write_half(addr, value); return; }
-    if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if (flags & RF_WRITE_BREAKPOINT) watchpoint_check(ptr, 2, RF_WRITE_BREAKPOINT);
+    if (flags & (DO_WRITE_ACTION & ~RF_WRITE_BREAKPOINT)) code_write_action(ptr);
     *ptr = value;
 }
 void memory_write_word(uint32_t addr, uint32_t value) {
@@ -123,7 +227,8 @@ void memory_write_word(uint32_t addr, uint32_t value) {
     if (!ptr) { bad_write_word(addr, value); return; }
     uint32_t flags = RAM_FLAGS(ptr);
     if (flags & RF_READ_ONLY) { bad_write_word(addr, value); return; }
-    if (flags & DO_WRITE_ACTION) write_action(ptr);
+    if (flags & RF_WRITE_BREAKPOINT) watchpoint_check(ptr, 4, RF_WRITE_BREAKPOINT);
+    if (flags & (DO_WRITE_ACTION & ~RF_WRITE_BREAKPOINT)) code_write_action(ptr);
     *ptr = value;
 }
 
@@ -164,23 +269,73 @@ void apb_write_word(uint32_t addr, uint32_t value) {
     apb_map[addr >> 16 & 31].write(addr, value);
 }
 
+/* The maps above have a granularity of 64MB and the APB needs another
+ * lookup, so mmio_* go through a flat table built from them instead: every
+ * 64kB page has the index of its set of handlers, word accesses to the APB
+ * call the peripheral's handlers directly. */
+struct mmio_handlers {
+    uint8_t (*read_byte)(uint32_t addr);
+    uint16_t (*read_half)(uint32_t addr);
+    uint32_t (*read_word)(uint32_t addr);
+    void (*write_byte)(uint32_t addr, uint8_t value);
+    void (*write_half)(uint32_t addr, uint16_t value);
+    void (*write_word)(uint32_t addr, uint32_t value);
+};
+#define MMIO_HANDLERS_MAX 64
+static struct mmio_handlers mmio_handlers[MMIO_HANDLERS_MAX];
+static unsigned int mmio_handler_count;
+static uint8_t mmio_page_handlers[0x10000];
+
+static void mmio_update_dispatch() {
+    mmio_handler_count = 0;
+    for (uint32_t page = 0; page < 0x10000; page++) {
+        struct mmio_handlers h = {
+            read_byte_map[page >> 10], read_half_map[page >> 10], read_word_map[page >> 10],
+            write_byte_map[page >> 10], write_half_map[page >> 10], write_word_map[page >> 10]
+        };
+        if (h.read_word == apb_read_word && (page & 0x3FF) < 0x12)
+            h.read_word = apb_map[page & 0x3FF].read;
+        if (h.write_word == apb_write_word && (page & 0x3FF) < 0x12)
+            h.write_word = apb_map[page & 0x3FF].write;
+
+        // Most pages have the same handlers as the one before
+        unsigned int i = page ? mmio_page_handlers[page - 1] : 0;
+        if (i >= mmio_handler_count || memcmp(&mmio_handlers[i], &h, sizeof(h)))
+            for (i = 0; i < mmio_handler_count && memcmp(&mmio_handlers[i], &h, sizeof(h)); i++);
+        if (i == mmio_handler_count) {
+            if (mmio_handler_count == MMIO_HANDLERS_MAX)
+                abort();
+            mmio_handlers[mmio_handler_count++] = h;
+        }
+        mmio_page_handlers[page] = i;
+    }
+}
+
+uint64_t mmio_accesses;
+
 uint32_t FASTCALL mmio_read_byte(uint32_t addr) {
-    return read_byte_map[addr >> 26](addr);
+    mmio_accesses++;
+    return mmio_handlers[mmio_page_handlers[addr >> 16]].read_byte(addr);
 }
 uint32_t FASTCALL mmio_read_half(uint32_t addr) {
-    return read_half_map[addr >> 26](addr);
+    mmio_accesses++;
+    return mmio_handlers[mmio_page_handlers[addr >> 16]].read_half(addr);
 }
 uint32_t FASTCALL mmio_read_word(uint32_t addr) {
-    return read_word_map[addr >> 26](addr);
+    mmio_accesses++;
+    return mmio_handlers[mmio_page_handlers[addr >> 16]].read_word(addr);
 }
 void FASTCALL mmio_write_byte(uint32_t addr, uint32_t value) {
-    write_byte_map[addr >> 26](addr, value);
+    mmio_accesses++;
+    mmio_handlers[mmio_page_handlers[addr >> 16]].write_byte(addr, value);
 }
 void FASTCALL mmio_write_half(uint32_t addr, uint32_t value) {
-    write_half_map[addr >> 26](addr, value);
+    mmio_accesses++;
+    mmio_handlers[mmio_page_handlers[addr >> 16]].write_half(addr, value);
 }
 void FASTCALL mmio_write_word(uint32_t addr, uint32_t value) {
-    write_word_map[addr >> 26](addr, value);
+    mmio_accesses++;
+    mmio_handlers[mmio_page_handlers[addr >> 16]].write_word(addr, value);
 }
 
 void (*reset_procs[20])(void);
@@ -231,9 +386,10 @@ bool memory_initialize(uint32_t sdram_size)
             total_mem += mem_areas[i].size;
         }
     }
+    // Most flags stay 0, so only the pages which get some set need memory
     if (total_mem > MEM_MAXSIZE ||
             !os_commit(mem_and_flags, total_mem) ||
-            !os_commit(mem_and_flags + MEM_MAXSIZE, total_mem))
+            !(os_commit_lazy(mem_and_flags + MEM_MAXSIZE, total_mem) || os_commit(mem_and_flags + MEM_MAXSIZE, total_mem)))
     {
         emuprintf("Couldn't allocate memory\n");
         memory_deinitialize();
@@ -250,6 +406,11 @@ bool memory_initialize(uint32_t sdram_size)
         mem_areas[3].ptr = mem_areas[0].ptr;
     }
 
+    if (!shmem_map(mem_and_flags, total_mem)) {
+        memory_deinitialize();
+        return false;
+    }
+
     for (int i = 0; i < 64; i++) {
         // will fallback to bad_* on non-memory addresses
         read_byte_map[i] = memory_read_byte;
@@ -274,6 +435,7 @@ bool memory_initialize(uint32_t sdram_size)
         write_word_map[0xFF >> 2] = omap_write_word;
 
         add_reset_proc(casplus_reset);
+        mmio_update_dispatch();
         return true;
     }
 
@@ -399,6 +561,7 @@ bool memory_initialize(uint32_t sdram_size)
         add_reset_proc(int_reset);
     }
 
+    mmio_update_dispatch();
     return true;
 }
 
@@ -415,6 +578,8 @@ void memory_deinitialize()
         // translation_table uses absolute addresses
         flush_translations();
         memset(mem_areas, 0, sizeof(mem_areas));
+        watchpoints_clear();
+        shmem_unmap();
         os_free(mem_and_flags, MEM_MAXSIZE * 2);
         mem_and_flags = NULL;
     }
@@ -422,12 +587,111 @@ void memory_deinitialize()
     reset_proc_count = 0;
 }
 
-bool memory_suspend(emu_snapshot *snapshot)
+/* Pages are compared by digest instead of tracking writes to them, which
+   would need the page protection used by the translator already.
+   Everything up to the page with the end of the last mem_area is kept. */
+static struct {
+    uint64_t id; // 0 if there's no full snapshot to refer to
+    char path[512];
+    uint64_t digests[MEM_SNAPSHOT_PAGES];
+} snapshot_base;
+
+// What memory_suspend_done needs, see memory_suspend_state
+static struct {
+    uint64_t id;
+    bool full;
+    uint64_t digests[MEM_SNAPSHOT_PAGES];
+} suspend_state;
+
+static uint64_t suspend_page_digests[MEM_SNAPSHOT_PAGES];
+static uint32_t suspend_pages[MEM_SNAPSHOT_PAGES];
+
+static uint32_t snapshot_page_count()
+{
+    uint32_t end = 0;
+    for(unsigned int i = 0; i < sizeof(mem_areas)/sizeof(*mem_areas); i++)
+        if(mem_areas[i].size && mem_areas[i].ptr + mem_areas[i].size - mem_and_flags > end)
+            end = mem_areas[i].ptr + mem_areas[i].size - mem_and_flags;
+
+    return (end + MEM_SNAPSHOT_PAGE_SIZE - 1) / MEM_SNAPSHOT_PAGE_SIZE;
+}
+
+static inline uint64_t digest_round(uint64_t acc, uint64_t value)
+{
+    acc += value * 0xC2B2AE3D27D4EB4FULL;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * 0x9E3779B185EBCA87ULL;
+}
+
+// Four independent lanes, so that it's not stalled by the multiplications
+static uint64_t digest(const void *data, size_t size)
+{
+    const uint64_t *words = (const uint64_t *) data;
+    uint64_t acc[4] = { 1, 2, 3, 4 };
+    for(size_t i = 0; i < size / 8; i += 4)
+        for(int lane = 0; lane < 4; lane++)
+            acc[lane] = digest_round(acc[lane], words[i + lane]);
+
+    uint64_t h = size;
+    for(int lane = 0; lane < 4; lane++)
+        h = digest_round(h ^ acc[lane], lane);
+
+    h ^= h >> 33;
+    h *= 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 29);
+}
+
+static uint64_t digest_page(uint32_t page)
+{
+    return digest(mem_and_flags + page * MEM_SNAPSHOT_PAGE_SIZE, MEM_SNAPSHOT_PAGE_SIZE);
+}
+
+static bool page_is_zero(uint32_t page)
+{
+    const uint64_t *words = (const uint64_t *) (mem_and_flags + page * MEM_SNAPSHOT_PAGE_SIZE);
+    for(size_t i = 0; i < MEM_SNAPSHOT_PAGE_SIZE / 8; i++)
+        if(words[i])
+            return false;
+
+    return true;
+}
+
+static uint64_t memory_id(const uint64_t *digests, uint32_t count)
+{
+    uint64_t id = digest(digests, count * sizeof(*digests));
+    return id ? id : 1;
+}
+
+/* Fills digests and picks the pages to store, those which differ from
+   base_digests if base_id isn't 0 or else all which aren't zero */
+static bool suspend_memory(emu_snapshot *snapshot, uint64_t *digests, uint64_t *id,
+                           uint64_t base_id, const uint64_t *base_digests, const char *base_path)
 {
     assert(mem_and_flags);
 
+    uint32_t count = snapshot_page_count();
+    for(uint32_t page = 0; page < count; page++)
+        digests[page] = digest_page(page);
+    *id = memory_id(digests, count);
+
     snapshot->mem.sdram_size = mem_areas[1].size;
-    memcpy(snapshot->mem.mem_and_flags, mem_and_flags, MEM_MAXSIZE);
+    snapshot->mem.mem_id = *id;
+    snapshot->mem.base_mem_id = base_id;
+    memset(snapshot->mem.base_path, 0, sizeof(snapshot->mem.base_path));
+    if(base_id && strlen(base_path) < sizeof(snapshot->mem.base_path))
+        memcpy(snapshot->mem.base_path, base_path, strlen(base_path));
+
+    uint32_t page_count = 0;
+    for(uint32_t page = 0; page < count; page++)
+    {
+        bool store = base_id ? digests[page] != base_digests[page] : !page_is_zero(page);
+        if(store)
+        {
+            suspend_page_digests[page_count] = digests[page];
+            suspend_pages[page_count++] = page;
+        }
+    }
+    snapshot->mem.page_count = page_count;
 
     return gpio_suspend(snapshot)
             && unknown_cx_suspend(snapshot)
@@ -448,16 +712,154 @@ bool memory_suspend(emu_snapshot *snapshot)
             && timer_cx_suspend(snapshot);
 }
 
-bool memory_resume(const emu_snapshot *snapshot)
+bool memory_suspend(emu_snapshot *snapshot, const char *path)
 {
-    if(!memory_initialize(snapshot->mem.sdram_size))
+    /* Overwriting the base would break the snapshots referring to it,
+       so it's replaced by a new full snapshot in that case. */
+    suspend_state.full = !incremental_snapshots || !snapshot_base.id
+                   || strcmp(snapshot_base.path, path) == 0;
+
+    return suspend_memory(snapshot, suspend_state.digests, &suspend_state.id,
+                          suspend_state.full ? 0 : snapshot_base.id, snapshot_base.digests, snapshot_base.path);
+}
+
+bool memory_checkpoint(emu_snapshot *snapshot, struct mem_checkpoint_base *checkpoint, const struct mem_checkpoint_base *base)
+{
+    // The digests of an incremental one are not needed afterwards
+    static struct mem_checkpoint_base scratch;
+    if(!checkpoint)
+        checkpoint = &scratch;
+
+    return suspend_memory(snapshot, checkpoint->digests, &checkpoint->id,
+                          base ? base->id : 0, base ? base->digests : NULL, "");
+}
+
+const uint32_t *memory_suspend_pages(const uint64_t **digests)
+{
+    *digests = suspend_page_digests;
+    return suspend_pages;
+}
+
+// Zero padded, as it's copied into snapshots as a whole
+static bool set_base_path(const char *path)
+{
+    size_t length = strlen(path);
+    if(length >= sizeof(snapshot_base.path))
         return false;
 
-    memory_reset();
+    memset(snapshot_base.path, 0, sizeof(snapshot_base.path));
+    memcpy(snapshot_base.path, path, length);
+    return true;
+}
+
+void memory_suspend_done(const char *path, bool success)
+{
+    if(!success || !suspend_state.full)
+        return;
 
-    memcpy(mem_and_flags, snapshot->mem.mem_and_flags, MEM_MAXSIZE);
-    memset(mem_and_flags + MEM_MAXSIZE, 0, MEM_MAXSIZE); // Set all flags to 0
+    // Later incremental snapshots refer to this one
+    snapshot_base.id = set_base_path(path) ? suspend_state.id : 0;
+    memcpy(snapshot_base.digests, suspend_state.digests, sizeof(snapshot_base.digests));
+}
+
+void *memory_suspend_state(size_t *size)
+{
+    *size = sizeof(suspend_state);
+    return &suspend_state;
+}
+
+// The numbers aren't necessarily aligned
+static uint32_t page_number(const uint8_t *pages, uint32_t i)
+{
+    uint32_t page;
+    memcpy(&page, pages + i * sizeof(page), sizeof(page));
+    return page;
+}
+
+// Copies or maps the pages stored at the end of the snapshot data into memory
+static bool resume_pages(const struct snapshot_image *image)
+{
+    const size_t page_record = sizeof(uint32_t) + sizeof(uint64_t) + MEM_SNAPSHOT_PAGE_SIZE;
+    uint32_t page_count = image->snapshot->mem.page_count, count = snapshot_page_count();
+    if(page_count > count || image->size < page_count * page_record)
+        return false;
+
+    size_t pages_start = image->size - page_count * page_record,
+           data_start = pages_start + page_count * (sizeof(uint32_t) + sizeof(uint64_t));
+    if(image->mapping.start < data_start && image->mapping.start < image->size)
+        return false;
 
+    const uint8_t *pages = (const uint8_t *) image->data + pages_start;
+    FILE *file = NULL; // Only if mapping doesn't work
+    bool success = true;
+    for(uint32_t i = 0; success && i < page_count;)
+    {
+        uint32_t page = page_number(pages, i);
+        if(page >= count)
+        {
+            success = false;
+            break;
+        }
+
+        size_t offset = data_start + i * MEM_SNAPSHOT_PAGE_SIZE;
+        uint8_t *ptr = mem_and_flags + page * MEM_SNAPSHOT_PAGE_SIZE;
+        if(offset < image->mapping.start)
+        {
+            memcpy(ptr, (const uint8_t *) image->data + offset, MEM_SNAPSHOT_PAGE_SIZE);
+            i++;
+            continue;
+        }
+
+        // Consecutive pages are mapped at once
+        uint32_t run = 1;
+        while(i + run < page_count && page_number(pages, i + run) == page + run)
+            run++;
+
+        // This also works if the snapshot gets overwritten, see snapshot_file_write
+        uint64_t file_offset = image->mapping.file_offset + (offset - image->mapping.start);
+        if(shmem_active() || !os_map_cow_at(image->path, file_offset, ptr, run * MEM_SNAPSHOT_PAGE_SIZE))
+        {
+            if(!file)
+                file = fopen_utf8(image->path, "rb");
+            success = file && fseek(file, file_offset, SEEK_SET) == 0
+                    && fread(ptr, run * MEM_SNAPSHOT_PAGE_SIZE, 1, file) == 1;
+        }
+        i += run;
+    }
+
+    if(file)
+        fclose(file);
+    return success;
+}
+
+// Takes the digests of the pages from the full snapshot, instead of reading all of the memory
+static bool resume_base(const struct snapshot_image *image, const char *path)
+{
+    static const uint8_t zero_page[MEM_SNAPSHOT_PAGE_SIZE];
+    uint64_t zero_digest = digest(zero_page, sizeof(zero_page));
+    uint32_t count = snapshot_page_count(), page_count = image->snapshot->mem.page_count;
+    for(uint32_t page = 0; page < count; page++)
+        snapshot_base.digests[page] = zero_digest;
+
+    const uint8_t *pages = (const uint8_t *) image->data + image->size
+            - page_count * (sizeof(uint32_t) + sizeof(uint64_t) + MEM_SNAPSHOT_PAGE_SIZE);
+    const uint8_t *digests = pages + page_count * sizeof(uint32_t);
+    for(uint32_t i = 0; i < page_count; i++)
+    {
+        uint32_t page = page_number(pages, i); // Checked by resume_pages
+        memcpy(&snapshot_base.digests[page], digests + i * sizeof(uint64_t), sizeof(uint64_t));
+    }
+
+    uint64_t id = image->snapshot->mem.mem_id;
+    if(memory_id(snapshot_base.digests, count) != id)
+        return false;
+
+    snapshot_base.id = set_base_path(path) ? id : 0;
+    return true;
+}
+
+static bool resume_devices(const emu_snapshot *snapshot)
+{
     return gpio_resume(snapshot)
             && unknown_cx_resume(snapshot)
             && watchdog_resume(snapshot)
@@ -476,3 +878,54 @@ bool memory_resume(const emu_snapshot *snapshot)
             && serial_cx_resume(snapshot)
             && timer_cx_resume(snapshot);
 }
+
+bool memory_resume(const struct snapshot_image *image, const struct snapshot_image *base)
+{
+    const emu_snapshot *snapshot = image->snapshot;
+    if(!memory_initialize(snapshot->mem.sdram_size))
+        return false;
+
+    memory_reset();
+
+    // Freshly zeroed pages don't take up memory if most of it gets mapped, shared memory stays
+    snapshot_base.id = 0;
+    uint32_t count = snapshot_page_count();
+    bool mapped = !shmem_active() && (image->mapping.start < image->size || (base && base->mapping.start < base->size));
+    if(!mapped || !os_commit_lazy(mem_and_flags, count * MEM_SNAPSHOT_PAGE_SIZE))
+        memset(mem_and_flags, 0, count * MEM_SNAPSHOT_PAGE_SIZE);
+
+    if(snapshot->mem.base_mem_id)
+    {
+        if(!base || base->snapshot->mem.base_mem_id || base->snapshot->mem.mem_id != snapshot->mem.base_mem_id
+           || base->snapshot->mem.sdram_size != snapshot->mem.sdram_size
+           || !resume_pages(base) || !resume_base(base, snapshot->mem.base_path)
+           || !resume_pages(image))
+            return false;
+    }
+    else if(!resume_pages(image) || !resume_base(image, image->path))
+        return false;
+
+    // Set all flags to 0, which drops the watchpoints
+    watchpoints_clear();
+    if (!os_commit_lazy(mem_and_flags + MEM_MAXSIZE, MEM_MAXSIZE))
+        memset(mem_and_flags + MEM_MAXSIZE, 0, MEM_MAXSIZE);
+
+    return resume_devices(snapshot);
+}
+
+bool memory_rewind(const struct snapshot_image *image, const struct snapshot_image *base)
+{
+    const emu_snapshot *snapshot = image->snapshot;
+    if(!mem_and_flags || snapshot->mem.sdram_size != mem_areas[1].size
+       || (snapshot->mem.base_mem_id && (!base || base->snapshot->mem.base_mem_id
+                                         || base->snapshot->mem.mem_id != snapshot->mem.base_mem_id)))
+        return false;
+
+    memory_reset();
+
+    // Unlike memory_resume, the flags with the breakpoints stay
+    memset(mem_and_flags, 0, snapshot_page_count() * MEM_SNAPSHOT_PAGE_SIZE);
+    return (!snapshot->mem.base_mem_id || resume_pages(base))
+            && resume_pages(image)
+            && resume_devices(snapshot);
+}
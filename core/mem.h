@@ -6,6 +6,7 @@
 #include <stdint.h>
 
 #include "cpu.h"
+#include "instance.h"
 #include "des.h"
 #include "misc.h"
 #include "interrupt.h"
@@ -13,6 +14,7 @@
 #include "lcd.h"
 #include "sha256.h"
 #include "usb.h"
+#include "snapshot_file.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,13 +22,7 @@ extern "C" {
 
 #define MEM_MAXSIZE (65*1024*1024) // also defined as RAM_FLAGS in asmcode.S
 
-// Must be allocated below 2GB (see comments for mmu.c)
-extern uint8_t *mem_and_flags;
-struct mem_area_desc {
-    uint32_t base, size;
-    uint8_t *ptr;
-};
-extern struct mem_area_desc mem_areas[4];
+// mem_and_flags and mem_areas are part of the emu_instance, see instance.h
 void *phys_mem_ptr(uint32_t addr, uint32_t size);
 uint32_t phys_mem_addr(void *ptr);
 
@@ -47,11 +43,33 @@ uint32_t phys_mem_addr(void *ptr);
 #define RF_CODE_NO_TRANSLATE 64
 #define RF_READ_ONLY         128
 #define RF_ARMLOADER_CB      256
-#define RFS_TRANSLATION_INDEX 9
+#define RF_CODE_THUMB        512 // Together with RF_CODE_TRANSLATED: It's a Thumb translation
+#define RFS_TRANSLATION_INDEX 10
 
 #define DO_READ_ACTION (RF_READ_BREAKPOINT)
 #define DO_WRITE_ACTION (RF_WRITE_BREAKPOINT | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)
 
+/* Read and write breakpoints (watchpoints) cover a range of bytes. The words
+ * they touch get RF_READ_BREAKPOINT or RF_WRITE_BREAKPOINT and the 1kB pages
+ * containing one have the same bits in mem_watched_pages. addr_cache only
+ * gets physical entries for those pages and the watched type of access, so
+ * that these accesses go through memory_read_* and memory_write_*, which
+ * check the exact range, while all other pages stay on the fast path. */
+#define MEM_WATCHPOINTS_MAX 256
+struct mem_watchpoint {
+    uint8_t *ptr;
+    uint32_t size;
+    uint32_t type; // RF_READ_BREAKPOINT and/or RF_WRITE_BREAKPOINT
+};
+extern uint8_t mem_watched_pages[MEM_MAXSIZE >> 10];
+#define RAM_WATCHED(memptr) (mem_watched_pages[((uint8_t *)(memptr) - mem_and_flags) >> 10])
+
+/* Sets type on the size bytes at ptr, which have to be in one memory area,
+ * or clears it on all watchpoints overlapping them. Returns false if there
+ * is no room or the range isn't in memory. */
+bool memory_set_watchpoint(void *ptr, uint32_t size, uint32_t type, bool set);
+const struct mem_watchpoint *memory_watchpoints(unsigned int *count);
+
 uint8_t bad_read_byte(uint32_t addr);
 uint16_t bad_read_half(uint32_t addr);
 uint32_t bad_read_word(uint32_t addr);
@@ -62,6 +80,8 @@ void bad_write_word(uint32_t addr, uint32_t value);
 void write_action(void *ptr) __asm__("write_action");
 void read_action(void *ptr) __asm__("read_action");
 
+// Calls of the mmio_* functions, for the statistics
+extern uint64_t mmio_accesses;
 uint32_t FASTCALL mmio_read_byte(uint32_t addr) __asm__("mmio_read_byte");
 uint32_t FASTCALL mmio_read_half(uint32_t addr) __asm__("mmio_read_half");
 uint32_t FASTCALL mmio_read_word(uint32_t addr) __asm__("mmio_read_word");
@@ -69,10 +89,22 @@ void FASTCALL mmio_write_byte(uint32_t addr, uint32_t value) __asm__("mmio_write
 void FASTCALL mmio_write_half(uint32_t addr, uint32_t value) __asm__("mmio_write_half");
 void FASTCALL mmio_write_word(uint32_t addr, uint32_t value) __asm__("mmio_write_word");
 
+#define MEM_SNAPSHOT_PAGE_SIZE 0x1000
+#define MEM_SNAPSHOT_PAGES (MEM_MAXSIZE / MEM_SNAPSHOT_PAGE_SIZE)
+
+/* The memory itself is stored in the last section of the snapshot as
+   page_count uint32_t page numbers, their uint64_t digests and then the
+   content of those pages, which can be mapped from the file. Only the pages
+   of the SDRAM are stored: a full snapshot has all of them which aren't zero,
+   an incremental one only those which differ from the full snapshot at base_path.
+   No flags are saved, the breakpoints have sections of their own. */
 typedef struct mem_snapshot
 {
-    size_t sdram_size;
-    uint8_t mem_and_flags[MEM_MAXSIZE]; // TODO: No flags saved. Only RF_EXEC_BREAKPOINT and maybe RF_READ_ONLY are interesting.
+    uint32_t sdram_size;
+    uint32_t page_count;
+    uint64_t mem_id; // Digest of all pages, identifies the memory content
+    uint64_t base_mem_id; // mem_id of the base, 0 for a full snapshot
+    char base_path[512];
     gpio_state gpio;
     unknown_cx_state unknown_cx;
     watchdog_state watchdog;
@@ -96,8 +128,39 @@ typedef struct mem_snapshot
 bool memory_initialize(uint32_t sdram_size);
 void memory_reset();
 typedef struct emu_snapshot emu_snapshot;
-bool memory_suspend(emu_snapshot *snapshot);
-bool memory_resume(const emu_snapshot *snapshot);
+/* Picks the pages to store, path is the file the snapshot is written to.
+   memory_suspend_pages returns their numbers and digests and
+   memory_suspend_done has to be called once the snapshot got written. */
+bool memory_suspend(emu_snapshot *snapshot, const char *path);
+const uint32_t *memory_suspend_pages(const uint64_t **digests);
+void memory_suspend_done(const char *path, bool success);
+/* What memory_suspend leaves for memory_suspend_done, to copy it over from
+   a process which wrote the snapshot */
+void *memory_suspend_state(size_t *size);
+
+// A snapshot file in memory, the pages may have been left in the file
+struct snapshot_image {
+    const char *path;
+    const void *data; // Uncompressed, size bytes
+    size_t size;
+    struct snapshot_mapping mapping;
+    const emu_snapshot *snapshot; // The sections of data
+};
+// An incremental snapshot needs its base as well
+bool memory_resume(const struct snapshot_image *image, const struct snapshot_image *base);
+
+// The memory content a checkpoint refers to, see rewind.h
+struct mem_checkpoint_base {
+    uint64_t id;
+    uint64_t digests[MEM_SNAPSHOT_PAGES];
+};
+/* Like memory_suspend, for snapshots which only get kept in memory. With
+   base it's an incremental one against that, checkpoint gets what a later
+   one needs to refer to this and can be NULL. */
+bool memory_checkpoint(emu_snapshot *snapshot, struct mem_checkpoint_base *checkpoint, const struct mem_checkpoint_base *base);
+/* Like memory_resume, without changing the memory size or flags. base has
+   to be the checkpoint the image refers to. */
+bool memory_rewind(const struct snapshot_image *image, const struct snapshot_image *base);
 void memory_deinitialize();
 
 #ifdef __cplusplus
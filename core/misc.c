@@ -194,9 +194,148 @@ bool timer_suspend(emu_snapshot *snapshot)
     return true;
 }
 
+/* The timers are clocked by the 32 kHz clock, the first pair by 703 ticks of
+ * it at once. Instead of stepping them, their registers get brought up to
+ * date on access and the event is only due when the first timer of a pair
+ * reaches a completion value with an interrupt which is unmasked and not
+ * pending yet. */
+static const uint32_t timer_rate[3] = { 703, 1, 1 };
+
+// Steps from one value to another, in the direction the timer counts
+static inline uint32_t timer_distance(const struct timer *t, uint16_t from, uint16_t to) {
+    return (uint16_t)((t->control & 8) ? to - from : from - to);
+}
+
+static inline uint16_t timer_move(const struct timer *t, uint16_t from, uint64_t steps) {
+    return (t->control & 8) ? from + steps : from - steps;
+}
+
+static uint16_t timer_value_after(const struct timerpair *tp, const struct timer *t, uint64_t steps) {
+    int compl = t->control & 7;
+    if (compl == 0) {
+        // Stops at 0
+        return steps >= timer_distance(t, t->value, 0) ? 0 : timer_move(t, t->value, steps);
+    }
+    if (compl == 7)
+        return timer_move(t, t->value, steps);
+
+    // The step after the completion value goes back to the start value
+    uint16_t target = tp->completion_value[compl - 1];
+    uint32_t first = timer_distance(t, t->value, target);
+    if (steps <= first)
+        return timer_move(t, t->value, steps);
+    return timer_move(t, t->start_value, (steps - first - 1) % (timer_distance(t, t->start_value, target) + 1));
+}
+
+// The first step after which the timer has the value, 0 if it never gets it
+static uint32_t timer_steps_to(const struct timerpair *tp, const struct timer *t, uint16_t value) {
+    int compl = t->control & 7;
+    uint32_t steps = timer_distance(t, t->value, value);
+    if (compl == 0) {
+        uint32_t to_zero = timer_distance(t, t->value, 0);
+        if (value == 0)
+            return to_zero ? to_zero : 1;
+        return steps && steps < to_zero ? steps : 0;
+    }
+    if (compl == 7)
+        return steps ? steps : 0x10000;
+
+    uint16_t target = tp->completion_value[compl - 1];
+    uint32_t first = timer_distance(t, t->value, target);
+    if (steps && steps <= first)
+        return steps;
+    steps = timer_distance(t, t->start_value, value);
+    return steps <= timer_distance(t, t->start_value, target) ? first + 1 + steps : 0;
+}
+
+static void timer_int_check(struct timerpair *tp) {
+    int_set(INT_TIMER0 + (tp - timer.pairs), tp->int_status & tp->int_mask);
+}
+
+// Brings all timers to the given tick of the 32 kHz clock
+static void timer_update(uint64_t tick) {
+    if (tick <= timer.tick)
+        return;
+
+    uint64_t elapsed = tick - timer.tick;
+    timer.tick = tick;
+    for (int i = 0; i < 3; i++) {
+        struct timerpair *tp = &timer.pairs[i];
+        for (int j = 0; j < 2; j++) {
+            struct timer *t = &tp->timers[j];
+            if (t->control & 0x10)
+                continue;
+
+            uint64_t ticks = t->ticks + elapsed * timer_rate[i];
+            uint64_t steps = ticks / (t->divider + 1u);
+            t->ticks = ticks % (t->divider + 1u);
+            if (steps == 0)
+                continue;
+
+            if (j == 0) {
+                uint8_t int_status = tp->int_status;
+                for (int compl = 0; compl < 6; compl++) {
+                    uint32_t reached = timer_steps_to(tp, t, tp->completion_value[compl]);
+                    if (reached && reached <= steps)
+                        tp->int_status |= 1 << compl;
+                }
+                if (tp->int_status != int_status)
+                    timer_int_check(tp);
+            }
+            t->value = timer_value_after(tp, t, steps);
+        }
+    }
+}
+
+// The tick when an interrupt gets pending next, 0 if none will
+static uint64_t timer_next_tick() {
+    uint64_t next = 0;
+    for (int i = 0; i < 3; i++) {
+        struct timerpair *tp = &timer.pairs[i];
+        struct timer *t = &tp->timers[0];
+        if (t->control & 0x10)
+            continue;
+
+        for (int compl = 0; compl < 6; compl++) {
+            if (!(tp->int_mask & ~tp->int_status & 1 << compl))
+                continue;
+
+            uint32_t steps = timer_steps_to(tp, t, tp->completion_value[compl]);
+            if (steps == 0)
+                continue;
+
+            uint64_t ticks = (uint64_t)steps * (t->divider + 1u);
+            ticks = ticks > t->ticks ? ticks - t->ticks : 1;
+            uint64_t tick = timer.tick + (ticks + timer_rate[i] - 1) / timer_rate[i];
+            if (next == 0 || tick < next)
+                next = tick;
+        }
+    }
+    return next;
+}
+
+static void timer_sync() {
+    timer_update(sched_clock_ticks(CLOCK_32K));
+}
+
+// After the timers got changed, timer_sync has to be called before
+static void timer_reschedule() {
+    uint64_t next = timer_next_tick();
+    if (next)
+        event_set(SCHED_TIMERS, next - timer.tick < 0x40000000 ? next - timer.tick : 0x40000000);
+    else
+        event_clear(SCHED_TIMERS);
+}
+
 uint32_t timer_read(uint32_t addr) {
     struct timerpair *tp = ADDR_TO_TP(addr);
-    cycle_count_delta = 0; // Avoid slowdown by fast-forwarding through polling loops
+    timer_sync();
+
+    // Avoid slowdown by fast-forwarding through polling loops, up to the next tick
+    uint64_t next_cputick = sched_clock_cputick(CLOCK_32K, timer.tick + 1);
+    if (next_cputick > sched_cputick())
+        cycle_count_delta = next_cputick < sched.next_cputick ? (int)(next_cputick - sched.next_cputick) : 0;
+
     switch (addr & 0x003F) {
         case 0x00: return tp->timers[0].value;
         case 0x04: return tp->timers[0].divider;
@@ -211,61 +350,32 @@ uint32_t timer_read(uint32_t addr) {
 }
 void timer_write(uint32_t addr, uint32_t value) {
     struct timerpair *tp = ADDR_TO_TP(addr);
+    timer_sync();
     switch (addr & 0x003F) {
-        case 0x00: tp->timers[0].start_value = tp->timers[0].value = value; return;
-        case 0x04: tp->timers[0].divider = value; return;
-        case 0x08: tp->timers[0].control = value & 0x1F; return;
+        case 0x00: tp->timers[0].start_value = tp->timers[0].value = value; break;
+        case 0x04: tp->timers[0].divider = value; break;
+        case 0x08: tp->timers[0].control = value & 0x1F; break;
         case 0x0C: tp->timers[1].start_value = tp->timers[1].value = value; return;
         case 0x10: tp->timers[1].divider = value; return;
         case 0x14: tp->timers[1].control = value & 0x1F; return;
         case 0x18: case 0x1C: case 0x20: case 0x24: case 0x28: case 0x2C:
-            tp->completion_value[((addr & 0x3F) - 0x18) >> 2] = value; return;
+            tp->completion_value[((addr & 0x3F) - 0x18) >> 2] = value; break;
         case 0x30: return;
+        default:
+            bad_write_word(addr, value);
+            return;
     }
-    bad_write_word(addr, value);
-}
-static void timer_int_check(struct timerpair *tp) {
-    int_set(INT_TIMER0 + (tp - timer.pairs), tp->int_status & tp->int_mask);
-}
-void timer_advance(struct timerpair *tp, int ticks) {
-    struct timer *t;
-    for (t = &tp->timers[0]; t != &tp->timers[2]; t++) {
-        int newticks;
-        if (t->control & 0x10)
-            continue;
-        for (newticks = t->ticks + ticks; newticks > t->divider; newticks -= (t->divider + 1)) {
-            int compl = t->control & 7;
-            t->ticks = 0;
-
-            if (compl == 0 && t->value == 0)
-                /* nothing */;
-            else if (compl != 0 && compl != 7 && t->value == tp->completion_value[compl - 1])
-                t->value = t->start_value;
-            else
-                t->value += (t->control & 8) ? +1 : -1;
-
-            if (t == &tp->timers[0]) {
-                for (compl = 0; compl < 6; compl++) {
-                    if (t->value == tp->completion_value[compl]) {
-                        tp->int_status |= 1 << compl;
-                        timer_int_check(tp);
-                    }
-                }
-            }
-        }
-        t->ticks = newticks;
-    }
+    timer_reschedule();
 }
 static void timer_event(int index) {
-    // TODO: should use seperate schedule item for each timer,
-    //       only fired on significant events
-    event_repeat(index, 1);
-    timer_advance(&timer.pairs[0], 703);
-    timer_advance(&timer.pairs[1], 1);
-    timer_advance(&timer.pairs[2], 1);
+    timer_update(sched.items[index].tick);
+    uint64_t next = timer_next_tick();
+    if (next)
+        event_repeat(index, next - sched.items[index].tick < 0x40000000 ? next - sched.items[index].tick : 0x40000000);
 }
 void timer_reset() {
     memset(timer.pairs, 0, sizeof timer.pairs);
+    timer.tick = 0;
     int i;
     for (i = 0; i < 3; i++) {
         timer.pairs[i].timers[0].control = 0x10;
@@ -273,6 +383,7 @@ void timer_reset() {
     }
     sched.items[SCHED_TIMERS].clock = CLOCK_32K;
     sched.items[SCHED_TIMERS].proc = timer_event;
+    sched.items[SCHED_TIMERS].disabled = true;
 }
 
 /* 90030000 */
@@ -365,7 +476,7 @@ void watchdog_reset() {
     watchdog.load = 0xFFFFFFFF;
     watchdog.value = 0xFFFFFFFF;
     sched.items[SCHED_WATCHDOG].clock = CLOCK_APB;
-    sched.items[SCHED_WATCHDOG].second = -1;
+    sched.items[SCHED_WATCHDOG].disabled = true;
     sched.items[SCHED_WATCHDOG].proc = watchdog_event;
 }
 uint32_t watchdog_read(uint32_t addr) {
@@ -485,6 +596,7 @@ uint32_t misc_read(uint32_t addr) {
         case 0x0C: return 0;
         case 0x10: case 0x18: case 0x20:
             if (emulate_cx) break;
+            timer_sync();
             return tp->int_status;
         case 0x14: case 0x1C: case 0x24:
             if (emulate_cx) break;
@@ -512,13 +624,17 @@ void misc_write(uint32_t addr, uint32_t value) {
         case 0x08: cpu_events |= EVENT_RESET; return;
         case 0x10: case 0x18: case 0x20:
             if (emulate_cx) break;
+            timer_sync();
             tp->int_status &= ~value;
             timer_int_check(tp);
+            timer_reschedule();
             return;
         case 0x14: case 0x1C: case 0x24:
             if (emulate_cx) break;
+            timer_sync();
             tp->int_mask = value & 0x3F;
             timer_int_check(tp);
+            timer_reschedule();
             return;
         case 0xF04: return;
     }
@@ -630,6 +746,7 @@ void timer_cx_int_check(int which) {
 uint32_t timer_cx_read(uint32_t addr) {
     int which = (addr >> 16) % 5;
     struct cx_timer *t = &timer_cx.timer[which][addr >> 5 & 1];
+    cycle_count_delta = 0; // Avoid slowdown by fast-forwarding through polling loops
     switch (addr & 0xFFFF) {
         case 0x0000: case 0x0020: return t->load;
         case 0x0004: case 0x0024: return t->value;
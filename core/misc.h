@@ -61,6 +61,7 @@ struct timerpair {
 
 typedef struct timer_state {
     struct timerpair pairs[3];
+    uint64_t tick; // Of the 32 kHz clock, which pairs is up to date for
 } timer_state;
 
 bool timer_suspend(emu_snapshot *snapshot);
@@ -100,6 +101,9 @@ void serial_cx_reset(void);
 uint32_t serial_cx_read(uint32_t addr);
 void serial_cx_write(uint32_t addr, uint32_t value);
 void serial_byte_in(uint8_t byte);
+// Hands the buffered output to gui_serial_write, also done on newlines and from the throttle event
+void serial_flush(void);
+extern bool serial_buffered; // If false, each byte goes out right away
 
 typedef struct unknown_cx_state {
     uint32_t fade; /* No idea. */
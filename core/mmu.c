@@ -181,86 +181,227 @@ void mmu_check_priv(uint32_t addr, bool writing)
 
 ac_entry *addr_cache = NULL;
 
-// Keep a list of valid entries so we can invalidate everything quickly
-#define AC_VALID_MAX 256
-static uint32_t ac_valid_index;
+/* Keep a list of valid entries so we can invalidate everything quickly.
+ * Flushing only costs as much as entries got filled since the last flush,
+ * and only when the list runs full all of them need to be dropped. */
+#define AC_VALID_MAX 0x10000
+static uint32_t ac_valid_count;
 static uint32_t ac_valid_list[AC_VALID_MAX];
 
 static void addr_cache_invalidate(int i) {
     AC_SET_ENTRY_INVALID(addr_cache[i], i >> 1 << 10)
 }
 
+static bool addr_cache_is_invalid(uint32_t i) {
+    uintptr_t entry = (uintptr_t)addr_cache[i];
+    #if defined(AC_FLAGS)
+        return entry & AC_INVALID;
+    #else
+        return (entry & AC_INVALID) && ((entry + (i >> 1 << 10)) & AC_NOT_PTR);
+    #endif
+}
+
 /* Since only a small fraction of the virtual address space, and therefore
  * only a small fraction of the pages making up addr_cache, will be in use
  * at a time, we can keep only a few pages committed and thereby reduce
- * the memory used by a lot. */
-#define AC_COMMIT_MAX 128
+ * the memory used by a lot. If the working set doesn't fit, pages which
+ * got decommitted fault in again soon, so then the budget grows, up to
+ * all of addr_cache. */
 #define AC_PAGE_SIZE 4096
-uint8_t ac_commit_map[AC_NUM_ENTRIES * sizeof(ac_entry) / AC_PAGE_SIZE];
-ac_entry *ac_commit_list[AC_COMMIT_MAX];
-uint32_t ac_commit_index;
+#define AC_PAGE_ENTRIES (AC_PAGE_SIZE / sizeof(ac_entry))
+#define AC_COMMIT_MIN 128
+#define AC_COMMIT_LIMIT (AC_NUM_ENTRIES / AC_PAGE_ENTRIES)
+enum { AC_PAGE_UNUSED, AC_PAGE_COMMITTED, AC_PAGE_DECOMMITTED };
+uint8_t ac_commit_map[AC_COMMIT_LIMIT];
+ac_entry *ac_commit_list[AC_COMMIT_LIMIT];
+uint32_t ac_commit_index, ac_commit_budget = AC_COMMIT_MIN;
+// Of the last ac_commit_budget faults at most, how many were of decommitted pages
+static uint32_t ac_window_faults, ac_window_refaults;
+uint64_t addr_cache_pagefaults;
+
+/* Entries in decommitted pages are gone already, writing them would only
+ * fault the page in again. Where nothing gets decommitted, all are kept. */
+static bool addr_cache_kept(uint32_t offset) {
+    return ac_commit_map[offset / AC_PAGE_ENTRIES] != AC_PAGE_DECOMMITTED;
+}
 
 bool addr_cache_pagefault(void *addr) {
     ac_entry *page = (ac_entry *)((uintptr_t)addr & -AC_PAGE_SIZE);
     uint32_t offset = page - addr_cache;
     if (offset >= AC_NUM_ENTRIES)
         return false;
+    addr_cache_pagefaults++;
+
+    if (ac_commit_map[offset / AC_PAGE_ENTRIES] == AC_PAGE_DECOMMITTED)
+        ac_window_refaults++;
+    if (++ac_window_faults >= ac_commit_budget) {
+        // Thrashing, so take more memory. The new slots get used first.
+        if (ac_window_refaults * 2 >= ac_window_faults && ac_commit_budget < AC_COMMIT_LIMIT) {
+            ac_commit_index = ac_commit_budget;
+            ac_commit_budget = ac_commit_budget * 2 < AC_COMMIT_LIMIT ? ac_commit_budget * 2 : AC_COMMIT_LIMIT;
+        }
+        ac_window_faults = ac_window_refaults = 0;
+    }
+
     ac_entry *oldpage = ac_commit_list[ac_commit_index];
     if (oldpage) {
         //printf("Freeing %p, ", oldpage);
         os_sparse_decommit(oldpage, AC_PAGE_SIZE);
-        ac_commit_map[offset / (AC_PAGE_SIZE / sizeof(ac_entry))] = 0;
+        ac_commit_map[(oldpage - addr_cache) / AC_PAGE_ENTRIES] = AC_PAGE_DECOMMITTED;
     }
     //printf("Committing %p\n", page);
     if (!os_sparse_commit(page, AC_PAGE_SIZE))
         return false;
-    ac_commit_map[offset / (AC_PAGE_SIZE / sizeof(ac_entry))] = 1;
+    ac_commit_map[offset / AC_PAGE_ENTRIES] = AC_PAGE_COMMITTED;
 
     uint32_t i;
-    for (i = 0; i < (AC_PAGE_SIZE / sizeof(ac_entry)); i++)
+    for (i = 0; i < AC_PAGE_ENTRIES; i++)
         addr_cache_invalidate(offset + i);
 
     ac_commit_list[ac_commit_index] = page;
-    ac_commit_index = (ac_commit_index + 1) % AC_COMMIT_MAX;
+    ac_commit_index = (ac_commit_index + 1) % ac_commit_budget;
     return true;
 }
 
+static void addr_cache_invalidate_all() {
+    uint32_t i;
+    for (i = 0; i < ac_valid_count; i++) {
+        uint32_t offset = ac_valid_list[i];
+        if (addr_cache_kept(offset))
+            addr_cache_invalidate(offset);
+    }
+    ac_valid_count = 0;
+}
+
+/* Results of successful page table walks for addr_cache_miss, so that
+ * refilling entries is cheap even if the working set doesn't fit into
+ * addr_cache. Two ways per set, indexed by the 1kB page. Tags are the page
+ * with the access type and privilege in the low bits, 0 is never used. */
+#define MMU_TLB_SETS 64
+#define MMU_TLB_VALID 4
+static struct mmu_tlb_entry {
+    uint32_t tag, phys;
+} mmu_tlb[MMU_TLB_SETS][2];
+
+static void mmu_tlb_flush() {
+    memset(mmu_tlb, 0, sizeof(mmu_tlb));
+}
+
+static uint32_t mmu_translate_cached(uint32_t virt, bool writing, fault_proc *fault) {
+    if (!(arm.control & 1))
+        return virt;
+
+    uint32_t tag = (virt & ~0x3FF) | MMU_TLB_VALID | writing << 1 | USER_MODE();
+    struct mmu_tlb_entry *set = mmu_tlb[virt >> 10 & (MMU_TLB_SETS - 1)];
+    if (set[0].tag == tag)
+        return set[0].phys | (virt & 0x3FF);
+    if (set[1].tag == tag)
+        return set[1].phys | (virt & 0x3FF);
+
+    uint8_t status = 0;
+    uint32_t phys = mmu_translate(virt, writing, fault, &status);
+    if (status == 0 && phys != 0xFFFFFFFF) {
+        set[1] = set[0];
+        set[0].tag = tag;
+        set[0].phys = phys & ~0x3FF;
+    }
+    return phys;
+}
+
+uint64_t addr_cache_misses;
+
 void *addr_cache_miss(uint32_t virt, bool writing, fault_proc *fault) {
     ac_entry entry;
-    uintptr_t phys = mmu_translate(virt, writing, fault, NULL);
+    addr_cache_misses++;
+    uintptr_t phys = mmu_translate_cached(virt, writing, fault);
     uint8_t *ptr = phys_mem_ptr(phys, 1);
-    if (ptr && !(writing && (RAM_FLAGS((size_t)ptr & ~3) & RF_READ_ONLY))) {
+    // Watched pages only get physical entries, see mem_watched_pages
+    if (ptr && !(writing && (RAM_FLAGS((size_t)ptr & ~3) & RF_READ_ONLY))
+            && !(RAM_WATCHED(ptr) & (writing ? RF_WRITE_BREAKPOINT : RF_READ_BREAKPOINT))) {
         AC_SET_ENTRY_PTR(entry, virt, ptr)
                 //printf("addr_cache_miss VA=%08x ptr=%p entry=%p\n", virt, ptr, entry);
     } else {
         AC_SET_ENTRY_PHYS(entry, virt, phys)
                 //printf("addr_cache_miss VA=%08x PA=%08x entry=%p\n", virt, phys, entry);
     }
-    uint32_t oldoffset = ac_valid_list[ac_valid_index];
     uint32_t offset = (virt >> 10) * 2 + writing;
-    //if (ac_commit_map[oldoffset / (AC_PAGE_SIZE / sizeof(ac_entry))])
-    addr_cache_invalidate(oldoffset);
+    // Entries which are already valid (e.g. physical ones) are listed already
+    if (addr_cache_is_invalid(offset)) {
+        if (ac_valid_count == AC_VALID_MAX)
+            addr_cache_invalidate_all();
+        ac_valid_list[ac_valid_count++] = offset;
+    }
     addr_cache[offset] = entry;
-    ac_valid_list[ac_valid_index] = offset;
-    ac_valid_index = (ac_valid_index + 1) % AC_VALID_MAX;
     return ptr;
 }
 
+static uint32_t *guest_translation_table() {
+    uint32_t *table = phys_mem_ptr(arm.translation_table_base, 0x4000);
+    if (!table)
+        error("Bad translation table base register: %x", arm.translation_table_base);
+    return table;
+}
+
+uint64_t addr_cache_flushes;
+
 void addr_cache_flush() {
-    uint32_t i;
+    addr_cache_flushes++;
+    if (arm.control & 1)
+        memcpy(mmu_translation_table, guest_translation_table(), 0x4000);
+    mmu_tlb_flush();
+    addr_cache_invalidate_all();
 
-    if (arm.control & 1) {
-        void *table = phys_mem_ptr(arm.translation_table_base, 0x4000);
-        if (!table)
-            error("Bad translation table base register: %x", arm.translation_table_base);
-        memcpy(mmu_translation_table, table, 0x4000);
+    flush_remapped_translations(0, 0xFFFFFFFF);
+}
+
+void addr_cache_flush_entry(uint32_t addr) {
+    uint32_t section = addr >> 20, i, kept = 0;
+
+    if (arm.control & 1)
+        mmu_translation_table[section] = guest_translation_table()[section];
+    mmu_tlb_flush();
+
+    /* Only the first level is cached, so drop the whole section. Entries
+     * in other sections stay listed. */
+    for (i = 0; i < ac_valid_count; i++) {
+        uint32_t offset = ac_valid_list[i];
+        if (!addr_cache_kept(offset))
+            continue;
+        if (offset >> 11 == section)
+            addr_cache_invalidate(offset);
+        else
+            ac_valid_list[kept++] = offset;
     }
+    ac_valid_count = kept;
 
-    for (i = 0; i < AC_VALID_MAX; i++) {
+    flush_remapped_translations(section << 20, section << 20 | 0xFFFFF);
+}
+
+void addr_cache_flush_ptr(void *ptr) {
+    uintptr_t page = (uintptr_t)ptr & ~0x3FF;
+    uint32_t i, kept = 0;
+    for (i = 0; i < ac_valid_count; i++) {
         uint32_t offset = ac_valid_list[i];
-        //	if (ac_commit_map[offset / (AC_PAGE_SIZE / sizeof(ac_entry))])
-        addr_cache_invalidate(offset);
+        if (!addr_cache_kept(offset))
+            continue;
+        uintptr_t target = (uintptr_t)addr_cache[offset] + (offset >> 1 << 10);
+        #if defined(AC_FLAGS)
+            bool is_ptr = !((uintptr_t)addr_cache[offset] & AC_FLAGS);
+        #else
+            bool is_ptr = !(target & AC_NOT_PTR);
+        #endif
+        if (is_ptr && target == page)
+            addr_cache_invalidate(offset);
+        else
+            ac_valid_list[kept++] = offset;
     }
+    ac_valid_count = kept;
+}
+
+void addr_cache_flush_permissions() {
+    // The privilege is part of the tag, but the domains aren't
+    mmu_tlb_flush();
+    addr_cache_invalidate_all();
 
-    flush_translations();
+    flush_translation_shortcuts();
 }
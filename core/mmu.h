@@ -61,7 +61,20 @@ extern ac_entry *addr_cache __asm__("addr_cache");
 
 bool addr_cache_pagefault(void *addr);
 void *addr_cache_miss(uint32_t addr, bool writing, fault_proc *fault) __asm__("addr_cache_miss");
+// Calls of addr_cache_miss, for the statistics
+extern uint64_t addr_cache_misses;
+// Calls of addr_cache_flush, for the statistics
+extern uint64_t addr_cache_flushes;
+// Faults on uncommitted pages of a sparse addr_cache, for the statistics
+extern uint64_t addr_cache_pagefaults;
+// Rereads the translation table and drops all entries
 void addr_cache_flush();
+// Like an MCR p15 TLB invalidate of the entry for addr
+void addr_cache_flush_entry(uint32_t addr);
+// Only the access permissions changed, the translation table stays the same
+void addr_cache_flush_permissions();
+// Drops the pointer entries into the 1kB page of memory at ptr, wherever it's mapped
+void addr_cache_flush_ptr(void *ptr);
 void mmu_dump_tables(void);
 
 #ifdef __cplusplus
@@ -1,8 +1,13 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <emscripten.h>
 
@@ -31,6 +36,11 @@ void *os_commit(void *addr, size_t size)
     return addr;
 }
 
+void *os_commit_lazy(void *addr, size_t size)
+{
+    return memset(addr, 0, size);
+}
+
 void *os_sparse_commit(void *page, size_t size)
 {
     (void) size;
@@ -49,6 +59,14 @@ void *os_alloc_executable(size_t size)
     return NULL;
 }
 
+bool os_set_writable(void *addr, size_t size, bool writable)
+{
+    (void) addr;
+    (void) size;
+    (void) writable;
+    return false;
+}
+
 void *os_map_cow(const char *filename, size_t size)
 {
     assert(strcmp(filename, "flash.img") == 0);
@@ -68,6 +86,79 @@ void os_unmap_cow(void *addr, size_t size)
     free(addr);
 }
 
+void *os_map_cow_at(const char *filename, uint64_t offset, void *addr, size_t size)
+{
+    (void) filename;
+    (void) offset;
+    (void) addr;
+    (void) size;
+    return NULL;
+}
+
+void *os_map_shared(const char *name, size_t header_size, void *addr, size_t size)
+{
+    (void) name;
+    (void) header_size;
+    (void) addr;
+    (void) size;
+    return NULL;
+}
+
+void os_unmap_shared(const char *name, void *header, size_t header_size)
+{
+    (void) name;
+    (void) header;
+    (void) header_size;
+}
+
+bool os_write_at(FILE *file, const void *data, size_t size, uint64_t offset)
+{
+    // No threads here, so moving the position doesn't hurt
+    return fseek(file, offset, SEEK_SET) == 0
+            && fwrite(data, size, 1, file) == 1
+            && fflush(file) == 0;
+}
+
+bool os_truncate(FILE *file, uint64_t size)
+{
+    return fflush(file) == 0 && ftruncate(fileno(file), size) == 0;
+}
+
+bool os_list_dir(const char *path, os_dir_cb callback, void *user_data)
+{
+    DIR *dir = opendir(path);
+    if(!dir)
+        return false;
+
+    struct dirent *entry;
+    while((entry = readdir(dir)))
+    {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        // d_type isn't known on all file systems
+        char entry_path[PATH_MAX];
+        struct stat st;
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+        if(stat(entry_path, &st) == 0)
+            callback(entry->d_name, S_ISDIR(st.st_mode), user_data);
+    }
+
+    closedir(dir);
+    return true;
+}
+
+bool os_make_dir(const char *path)
+{
+    struct stat st;
+    return mkdir(path, 0777) == 0 || (errno == EEXIST && stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+double os_thread_cpu_time()
+{
+    return -1;
+}
+
 void addr_cache_init(os_exception_frame_t *frame)
 {
     (void) frame;
@@ -1,10 +1,17 @@
 #define _GNU_SOURCE
 #define _XOPEN_SOURCE
 
+#include <sys/file.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #ifdef __APPLE__
     #include <mach/clock.h>
@@ -18,6 +25,7 @@
 #include "os.h"
 #include "../debug.h"
 #include "../mmu.h"
+#include "../translate.h"
 
 
 #ifdef IS_IOS_BUILD
@@ -49,13 +57,34 @@ FILE *fopen_utf8(const char *filename, const char *mode)
     return fopen(filename, mode);
 }
 
+// Explicit huge pages need to be set up by the admin, otherwise ask for transparent ones
+static void *map_anonymous(void *addr, size_t size, int prot, int flags)
+{
+#ifdef MAP_HUGETLB
+    if(use_huge_pages && size % (2 * 1024 * 1024) == 0)
+    {
+        void *ptr = mmap(addr, size, prot, flags | MAP_HUGETLB, -1, 0);
+        if(ptr != MAP_FAILED)
+            return ptr;
+    }
+#endif
+
+    void *ptr = mmap(addr, size, prot, flags, -1, 0);
+#ifdef MADV_HUGEPAGE
+    if(use_huge_pages && ptr != MAP_FAILED)
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+
 void *os_reserve(size_t size)
 {
 #ifdef __i386__
     // Has to have bit 31 zero
-    void *ptr = mmap((void*)0x70000000, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON|MAP_32BIT, -1, 0);
+    void *ptr = map_anonymous((void*)0x70000000, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_32BIT);
 #else
-    void *ptr = mmap((void*)0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+    // Private, so that a forked process keeps a copy, see emu_suspend_background
+    void *ptr = map_anonymous((void*)0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON);
 #endif
 
     if(ptr == MAP_FAILED)
@@ -77,6 +106,13 @@ void *os_commit(void *addr, size_t size)
     return addr;
 }
 
+void *os_commit_lazy(void *addr, size_t size)
+{
+    // Private anonymous pages map the zero page until the first write
+    void *ptr = mmap(addr, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_FIXED, -1, 0);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
 void *os_sparse_commit(void *page, size_t size)
 {
     (void) size;
@@ -93,9 +129,9 @@ void *os_alloc_executable(size_t size)
 {
 #if defined(__i386__) || defined(__x86_64__)
     // Has to be in 32-bit space for the JIT
-    void *ptr = mmap((void*)0x30000000, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANON|MAP_32BIT, -1, 0);
+    void *ptr = map_anonymous((void*)0x30000000, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANON|MAP_32BIT);
 #else
-    void *ptr = mmap((void*)0x0, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANON, -1, 0);
+    void *ptr = map_anonymous((void*)0x0, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANON);
 #endif
 
     if(ptr == MAP_FAILED)
@@ -105,13 +141,23 @@ void *os_alloc_executable(size_t size)
     return ptr;
 }
 
+bool os_set_writable(void *addr, size_t size, bool writable)
+{
+    return mprotect(addr, size, writable ? PROT_READ|PROT_WRITE : PROT_READ) == 0;
+}
+
+#ifndef MAP_NORESERVE
+    #define MAP_NORESERVE 0
+#endif
+
 void *os_map_cow(const char *filename, size_t size)
 {
     int fd = open(filename, O_RDONLY);
     if(fd == -1)
         return NULL;
 
-    void *ret = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    // Only modified pages need memory of their own, so don't reserve it all
+    void *ret = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
 
     close(fd);
     return ret == MAP_FAILED ? NULL : ret;
@@ -122,6 +168,174 @@ void os_unmap_cow(void *addr, size_t size)
     munmap(addr, size);
 }
 
+void *os_map_cow_at(const char *filename, uint64_t offset, void *addr, size_t size)
+{
+    uintptr_t ps = sysconf(_SC_PAGE_SIZE);
+    if(((uintptr_t) addr | offset | size) & (ps - 1))
+        return NULL;
+
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1)
+        return NULL;
+
+    void *ret = mmap(addr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+
+    close(fd);
+    return ret == MAP_FAILED ? NULL : ret;
+}
+
+#ifndef __ANDROID__
+// Of the object os_map_shared created, locked as long as it's in use
+static int shared_fd = -1;
+
+/* Whether the object at path got left behind by a process which is gone.
+   Its owner keeps it locked, an object without a size is still being set up. */
+static bool shared_object_stale(const char *path)
+{
+    int fd = shm_open(path, O_RDWR, 0600);
+    if(fd == -1)
+        return errno == ENOENT; // Got removed meanwhile
+
+    struct stat st;
+    bool stale = flock(fd, LOCK_EX | LOCK_NB) == 0 && fstat(fd, &st) == 0 && st.st_size > 0;
+    close(fd);
+    return stale;
+}
+#endif
+
+void *os_map_shared(const char *name, size_t header_size, void *addr, size_t size)
+{
+#ifdef __ANDROID__
+    (void) name;
+    (void) header_size;
+    (void) addr;
+    (void) size;
+    return NULL;
+#else
+    char path[NAME_MAX];
+    if((size_t) snprintf(path, sizeof(path), "/%s", name) >= sizeof(path))
+        return NULL;
+
+    int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd == -1 && errno == EEXIST)
+    {
+        // Another emulation might use it, only replace it if not
+        if(!shared_object_stale(path))
+        {
+            errno = EEXIST;
+            return NULL;
+        }
+
+        shm_unlink(path);
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if(fd == -1)
+        return NULL;
+
+    // Not supported everywhere, stale objects just stay in the way then
+    flock(fd, LOCK_EX | LOCK_NB);
+
+    void *header = MAP_FAILED;
+    if(ftruncate(fd, header_size + size) == 0)
+        header = mmap(NULL, header_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(header != MAP_FAILED
+       && mmap(addr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, header_size) == MAP_FAILED)
+    {
+        munmap(header, header_size);
+        header = MAP_FAILED;
+    }
+
+    if(header == MAP_FAILED)
+    {
+        shm_unlink(path);
+        close(fd);
+        return NULL;
+    }
+
+    shared_fd = fd;
+    return header;
+#endif
+}
+
+void os_unmap_shared(const char *name, void *header, size_t header_size)
+{
+    munmap(header, header_size);
+#ifndef __ANDROID__
+    char path[NAME_MAX];
+    snprintf(path, sizeof(path), "/%s", name);
+    shm_unlink(path);
+    close(shared_fd);
+    shared_fd = -1;
+#else
+    (void) name;
+#endif
+}
+
+bool os_write_at(FILE *file, const void *data, size_t size, uint64_t offset)
+{
+    int fd = fileno(file);
+    const uint8_t *ptr = (const uint8_t *) data;
+    while(size)
+    {
+        ssize_t written = pwrite(fd, ptr, size, offset);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return false;
+
+        ptr += written;
+        offset += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+bool os_truncate(FILE *file, uint64_t size)
+{
+    return ftruncate(fileno(file), size) == 0;
+}
+
+bool os_list_dir(const char *path, os_dir_cb callback, void *user_data)
+{
+    DIR *dir = opendir(path);
+    if(!dir)
+        return false;
+
+    struct dirent *entry;
+    while((entry = readdir(dir)))
+    {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        // d_type isn't known on all file systems
+        char entry_path[PATH_MAX];
+        struct stat st;
+        snprintf(entry_path, sizeof(entry_path), "%s/%s", path, entry->d_name);
+        if(stat(entry_path, &st) == 0)
+            callback(entry->d_name, S_ISDIR(st.st_mode), user_data);
+    }
+
+    closedir(dir);
+    return true;
+}
+
+bool os_make_dir(const char *path)
+{
+    struct stat st;
+    return mkdir(path, 0777) == 0 || (errno == EEXIST && stat(path, &st) == 0 && S_ISDIR(st.st_mode));
+}
+
+double os_thread_cpu_time()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+    return -1;
+}
+
 __attribute__((unused)) static void make_writable(void *addr)
 {
     uintptr_t ps = sysconf(_SC_PAGE_SIZE);
@@ -130,6 +344,47 @@ __attribute__((unused)) static void make_writable(void *addr)
         emuprintf("mprotect failed.\n");
 }
 
+static struct sigaction prev_segv_action, prev_bus_action;
+
+/* addr_cache is reserved without access and filled with invalid entries a
+ * chunk at a time on the first access, so that startup doesn't have to touch
+ * all of it and only the parts that get used take memory. */
+#define AC_FILL_CHUNK (64 * 1024)
+
+static bool addr_cache_fill(void *addr)
+{
+    uintptr_t offset = (uintptr_t) addr - (uintptr_t) addr_cache;
+    if(!addr_cache || offset >= AC_NUM_ENTRIES * sizeof(ac_entry))
+        return false;
+
+    offset &= ~(uintptr_t)(AC_FILL_CHUNK - 1);
+    ac_entry *chunk = (ac_entry *)((uint8_t *) addr_cache + offset);
+    if(mprotect(chunk, AC_FILL_CHUNK, PROT_READ|PROT_WRITE) != 0)
+        return false;
+
+    #if !defined(AC_FLAGS)
+        uint32_t first = offset / sizeof(ac_entry);
+        for(uint32_t i = first; i < first + AC_FILL_CHUNK / sizeof(ac_entry); ++i)
+        {
+            AC_SET_ENTRY_INVALID(addr_cache[i], (i >> 1) << 10)
+        }
+    #else
+        memset(chunk, 0xFF, AC_FILL_CHUNK);
+    #endif
+
+    return true;
+}
+
+static void write_fault_handler(int sig, siginfo_t *info, void *context)
+{
+    (void) context;
+    if(addr_cache_fill(info->si_addr) || translate_write_fault(info->si_addr))
+        return; // Try again
+
+    // Not ours, fault again with what was there before
+    sigaction(sig, sig == SIGSEGV ? &prev_segv_action : &prev_bus_action, NULL);
+}
+
 void addr_cache_init(os_exception_frame_t *frame)
 {
     (void) frame;
@@ -138,7 +393,17 @@ void addr_cache_init(os_exception_frame_t *frame)
     if(addr_cache)
         return;
 
-    addr_cache = mmap((void*)0, AC_NUM_ENTRIES * sizeof(ac_entry), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    // For write protected translated code, see translate_write_fault
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = write_fault_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &prev_segv_action);
+    sigaction(SIGBUS, &action, &prev_bus_action);
+
+    // Filled on demand by addr_cache_fill
+    addr_cache = mmap((void*)0, AC_NUM_ENTRIES * sizeof(ac_entry), PROT_NONE, MAP_PRIVATE|MAP_ANON|MAP_NORESERVE, -1, 0);
     if(addr_cache == MAP_FAILED)
     {
         addr_cache = NULL;
@@ -148,16 +413,6 @@ void addr_cache_init(os_exception_frame_t *frame)
 
     setbuf(stdout, NULL);
 
-    #if !defined(AC_FLAGS)
-        unsigned int i;
-        for(unsigned int i = 0; i < AC_NUM_ENTRIES; ++i)
-        {
-            AC_SET_ENTRY_INVALID(addr_cache[i], (i >> 1) << 10)
-        }
-    #else
-        memset(addr_cache, 0xFF, AC_NUM_ENTRIES * sizeof(ac_entry));
-    #endif
-
     #if defined(__i386__) && !defined(NO_TRANSLATION)
         // Relocate the assembly code that wants addr_cache at a fixed address
         extern uint32_t *ac_reloc_start[] __asm__("ac_reloc_start"), *ac_reloc_end[] __asm__("ac_reloc_end");
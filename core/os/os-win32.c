@@ -6,10 +6,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <io.h>
 #include <share.h>
 
 #include "../emu.h"
 #include "../mmu.h"
+#include "../translate.h"
 
 static HANDLE flash_mapping;
 static int flash_fd;
@@ -23,9 +25,46 @@ FILE *fopen_utf8(const char *filename, const char *mode)
     return _wfopen(filename_w, mode_w);
 }
 
+// Large pages need SeLockMemoryPrivilege, which has to be granted to the user first
+static SIZE_T large_page_size()
+{
+    static bool checked;
+    static SIZE_T size;
+    if(checked)
+        return size;
+
+    checked = true;
+    HANDLE token;
+    if(!GetLargePageMinimum() || !OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return size;
+
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    if(LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+        && AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+        && GetLastError() == ERROR_SUCCESS)
+        size = GetLargePageMinimum();
+
+    CloseHandle(token);
+    return size;
+}
+
+static void *alloc_committed(size_t size, DWORD protect)
+{
+    if(use_huge_pages && large_page_size() && size % large_page_size() == 0)
+    {
+        void *ptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, protect);
+        if(ptr)
+            return ptr;
+    }
+
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, protect);
+}
+
 void *os_reserve(size_t size)
 {
-    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    return alloc_committed(size, PAGE_READWRITE);
 }
 
 void os_free(void *ptr, size_t size)
@@ -36,6 +75,23 @@ void os_free(void *ptr, size_t size)
 
 void *os_commit(void *addr, size_t size)
 {
+    void *ptr = VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE);
+
+    // Large pages are committed already and can't be committed again
+    MEMORY_BASIC_INFORMATION info;
+    if(!ptr && VirtualQuery(addr, &info, sizeof(info))
+        && info.State == MEM_COMMIT && info.RegionSize >= size)
+        return addr;
+
+    return ptr;
+}
+
+void *os_commit_lazy(void *addr, size_t size)
+{
+    // Pages are only backed by memory once touched, but reading counts as well
+    if(!VirtualFree(addr, size, MEM_DECOMMIT))
+        return NULL;
+
     return VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE);
 }
 
@@ -52,7 +108,13 @@ void os_sparse_decommit(void *page, size_t size)
 
 void *os_alloc_executable(size_t size)
 {
-    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE);
+    return alloc_committed(size, PAGE_EXECUTE_READWRITE);
+}
+
+bool os_set_writable(void *addr, size_t size, bool writable)
+{
+    DWORD prot;
+    return VirtualProtect(addr, size, writable ? PAGE_READWRITE : PAGE_READONLY, &prot);
 }
 
 void *os_map_cow(const char *filename, size_t size)
@@ -94,10 +156,115 @@ void os_unmap_cow(void *addr, size_t size)
     _close(flash_fd);
 }
 
+void *os_map_cow_at(const char *filename, uint64_t offset, void *addr, size_t size)
+{
+    // Views can't be placed inside of an existing allocation
+    (void) filename;
+    (void) offset;
+    (void) addr;
+    (void) size;
+    return NULL;
+}
+
+void *os_map_shared(const char *name, size_t header_size, void *addr, size_t size)
+{
+    // Views can't be placed inside of an existing allocation
+    (void) name;
+    (void) header_size;
+    (void) addr;
+    (void) size;
+    return NULL;
+}
+
+void os_unmap_shared(const char *name, void *header, size_t header_size)
+{
+    (void) name;
+    (void) header;
+    (void) header_size;
+}
+
+bool os_write_at(FILE *file, const void *data, size_t size, uint64_t offset)
+{
+    HANDLE handle = (HANDLE)_get_osfhandle(_fileno(file));
+    const uint8_t *ptr = (const uint8_t *) data;
+    while(size)
+    {
+        OVERLAPPED overlapped = {0};
+        overlapped.Offset = (DWORD) offset;
+        overlapped.OffsetHigh = (DWORD) (offset >> 32);
+
+        DWORD written, chunk = size > 0x40000000 ? 0x40000000 : (DWORD) size;
+        if(!WriteFile(handle, ptr, chunk, &written, &overlapped) || !written)
+            return false;
+
+        ptr += written;
+        offset += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+bool os_truncate(FILE *file, uint64_t size)
+{
+    return _chsize_s(_fileno(file), size) == 0;
+}
+
+bool os_list_dir(const char *path, os_dir_cb callback, void *user_data)
+{
+    wchar_t pattern_w[MAX_PATH];
+    int length = MultiByteToWideChar(CP_UTF8, 0, path, -1, pattern_w, MAX_PATH - 2);
+    if(length == 0)
+        return false;
+    wcscpy(pattern_w + length - 1, L"\\*");
+
+    WIN32_FIND_DATAW entry;
+    HANDLE find = FindFirstFileW(pattern_w, &entry);
+    if(find == INVALID_HANDLE_VALUE)
+        return false;
+
+    do
+    {
+        if(wcscmp(entry.cFileName, L".") == 0 || wcscmp(entry.cFileName, L"..") == 0)
+            continue;
+
+        char name[MAX_PATH * 3];
+        if(WideCharToMultiByte(CP_UTF8, 0, entry.cFileName, -1, name, sizeof(name), NULL, NULL))
+            callback(name, entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY, user_data);
+    } while(FindNextFileW(find, &entry));
+
+    FindClose(find);
+    return true;
+}
+
+bool os_make_dir(const char *path)
+{
+    wchar_t path_w[MAX_PATH];
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, path_w, MAX_PATH);
+    if(CreateDirectoryW(path_w, NULL))
+        return true;
+
+    DWORD attributes = GetFileAttributesW(path_w);
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+}
+
+double os_thread_cpu_time()
+{
+    FILETIME creation, exit, kernel, user;
+    if(!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return -1;
+
+    // In units of 100 ns
+    uint64_t total = ((uint64_t) kernel.dwHighDateTime << 32 | kernel.dwLowDateTime)
+                     + ((uint64_t) user.dwHighDateTime << 32 | user.dwLowDateTime);
+    return total / 1e7;
+}
+
 static int addr_cache_exception(PEXCEPTION_RECORD er, void *x, void *y, void *z) {
     (void) x; (void) y; (void) z;
     if (er->ExceptionCode == EXCEPTION_ACCESS_VIOLATION) {
-        if (addr_cache_pagefault((void *)er->ExceptionInformation[1]))
+        if (addr_cache_pagefault((void *)er->ExceptionInformation[1])
+            || translate_write_fault((void *)er->ExceptionInformation[1]))
             return 0; // Continue execution
     }
     return 1; // Continue search
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdio.h>
 
 #ifdef __cplusplus
@@ -19,12 +20,46 @@ FILE *fopen_utf8(const char *filename, const char *mode);
 void *os_reserve(size_t size);
 void os_free(void *ptr, size_t size);
 void *os_commit(void *addr, size_t size);
+/* Like os_commit, but the pages are zeroed and only take up memory once
+   they get written to. Returns NULL if that's not possible. */
+void *os_commit_lazy(void *addr, size_t size);
 void *os_sparse_commit(void *page, size_t size);
 void os_sparse_decommit(void *page, size_t size);
 void *os_alloc_executable(size_t size);
+/* Changes whether the pages from addr to addr + size can be written to,
+   they stay readable. Returns false on failure. */
+bool os_set_writable(void *addr, size_t size, bool writable);
 
 void *os_map_cow(const char *filename, size_t size);
 void os_unmap_cow(void *addr, size_t size);
+/* Replaces the pages at addr with a private copy on write mapping of the file
+   at offset, all page aligned. Returns NULL on failure, the pages keep
+   their content then. Freed along with the memory around it. */
+void *os_map_cow_at(const char *filename, uint64_t offset, void *addr, size_t size);
+/* Creates the shared memory object name, which other processes can open, of
+   header_size + size bytes, all page aligned. Returns a mapping of its first
+   header_size bytes and replaces the pages at addr with the rest, all zeroed.
+   Returns NULL on failure, with errno EEXIST if another process uses the
+   name. Objects left behind by processes which are gone get replaced. */
+void *os_map_shared(const char *name, size_t header_size, void *addr, size_t size);
+/* Unmaps the header and removes the object, the rest gets freed along with
+   the memory around it. */
+void os_unmap_shared(const char *name, void *header, size_t header_size);
+/* Writes size bytes to the file at offset without moving its position, so that
+   it can be done from another thread. Bypasses the buffer of the FILE. */
+bool os_write_at(FILE *file, const void *data, size_t size, uint64_t offset);
+// Cuts the file off after size bytes, also bypassing the buffer
+bool os_truncate(FILE *file, uint64_t size);
+
+/* Calls callback for each entry of the directory but . and .., with the name
+   in UTF-8. Returns false if it can't be read. */
+typedef void (*os_dir_cb)(const char *name, bool is_dir, void *user_data);
+bool os_list_dir(const char *path, os_dir_cb callback, void *user_data);
+// Also succeeds if it exists already
+bool os_make_dir(const char *path);
+
+// CPU time used by the calling thread so far in seconds, negative if unknown
+double os_thread_cpu_time(void);
 
 typedef struct { void *prev, *function; } os_exception_frame_t;
 void addr_cache_init(os_exception_frame_t *frame);
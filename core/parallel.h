@@ -0,0 +1,38 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+// Calls work(i) for all i < count, spread over as many threads as there are cores
+template <typename F> static void parallel_for(size_t count, F work)
+{
+    std::atomic<size_t> next{0};
+    auto worker = [&] {
+        for(size_t i; (i = next++) < count;)
+            work(i);
+    };
+
+    std::vector<std::thread> threads;
+#ifndef __EMSCRIPTEN__
+    size_t thread_count = std::min<size_t>(std::thread::hardware_concurrency(), count);
+    try
+    {
+        for(size_t i = 1; i < thread_count; ++i)
+            threads.emplace_back(worker);
+    }
+    catch(const std::system_error &)
+    {
+        // Fewer threads do the job as well
+    }
+#endif
+
+    worker();
+    for(auto &thread : threads)
+        thread.join();
+}
+
+#endif
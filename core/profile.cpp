@@ -0,0 +1,85 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include "cpu.h"
+#include "debug.h"
+#include "profile.h"
+#include "schedule.h"
+#include "os/os.h"
+
+// Deep enough for the OS, without walking corrupted chains for long
+static const unsigned int max_depth = 64;
+
+// The addresses of a stack, innermost first, as the bytes of the key
+static std::unordered_map<std::string, uint64_t> samples;
+static uint64_t sample_count;
+static bool active;
+
+static void profile_sample()
+{
+    uint32_t stack[max_depth + 2];
+    unsigned int depth = 0;
+    stack[depth++] = arm.reg[15];
+
+    uint32_t returns[max_depth];
+    unsigned int count = backtrace_returns(arm.reg[11], returns, max_depth);
+    // Without a frame of its own, the function returns to LR
+    if(!count || returns[0] != arm.reg[14])
+        stack[depth++] = arm.reg[14];
+    for(unsigned int i = 0; i < count; ++i)
+        stack[depth++] = returns[i];
+
+    ++samples[std::string(reinterpret_cast<const char *>(stack), depth * sizeof(*stack))];
+    ++sample_count;
+}
+
+void profile_start(uint32_t interval)
+{
+    samples.clear();
+    sample_count = 0;
+    active = interval != 0;
+    sched_set_sampler(interval, profile_sample);
+}
+
+void profile_stop()
+{
+    active = false;
+    sched_set_sampler(0, nullptr);
+}
+
+bool profile_active()
+{
+    return active;
+}
+
+uint64_t profile_sample_count()
+{
+    return sample_count;
+}
+
+bool profile_write(const char *filename)
+{
+    FILE *file = fopen_utf8(filename, "w");
+    if(!file)
+        return false;
+
+    bool success = true;
+    for(auto &sample : samples)
+    {
+        const char *stack = sample.first.data();
+        for(size_t i = sample.first.size() / sizeof(uint32_t); i-- > 0;)
+        {
+            uint32_t addr;
+            memcpy(&addr, stack + i * sizeof(addr), sizeof(addr));
+            fprintf(file, i ? "%08x;" : "%08x", addr);
+        }
+
+        if(fprintf(file, " %" PRIu64 "\n", sample.second) < 0)
+            success = false;
+    }
+
+    return fclose(file) == 0 && success;
+}
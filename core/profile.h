@@ -0,0 +1,31 @@
+/* Declarations for profile.cpp */
+
+#ifndef _H_PROFILE
+#define _H_PROFILE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The profiler looks at the guest every interval CPU cycles, from the
+   scheduler, so that it doesn't matter whether the code runs translated.
+   A sample is PC, LR and the return addresses of the frame pointer chain,
+   counted per distinct stack. */
+
+// Drops the previous samples, an interval of 0 stops sampling
+void profile_start(uint32_t interval);
+void profile_stop();
+bool profile_active();
+uint64_t profile_sample_count();
+/* Writes one line per stack in the folded format of flamegraph.pl,
+   "outermost;...;pc count", returns false on failure */
+bool profile_write(const char *filename);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+
+#include "rewind.h"
+#include "emu.h"
+#include "mmu.h"
+#include "translate.h"
+
+double rewind_interval = 0;
+unsigned int rewind_capacity = 120;
+
+struct checkpoint
+{
+    ~checkpoint() { free(data); }
+
+    void *data = nullptr; // From snapshot_buffer_write
+    size_t size = 0;
+    uint64_t intervals; // When it got taken, counted by rewind_interval_event
+    uint32_t page_count;
+    std::shared_ptr<checkpoint> base; // The full one an incremental one refers to
+    std::unique_ptr<mem_checkpoint_base> mem; // Only for full ones
+};
+
+static std::deque<std::shared_ptr<checkpoint>> checkpoints; // Oldest first
+static std::shared_ptr<checkpoint> keyframe; // What new incremental ones refer to
+static unsigned int since_keyframe;
+static uint64_t intervals;
+static std::atomic<int> requested{-1};
+
+static std::shared_ptr<checkpoint> take_checkpoint(const std::shared_ptr<checkpoint> &base)
+{
+    auto cp = std::make_shared<checkpoint>();
+    cp->intervals = intervals;
+    cp->base = base;
+    if(!base)
+        cp->mem.reset(new mem_checkpoint_base);
+
+    size_t size;
+    auto snapshot = emu_snapshot_begin(&size);
+    if(!snapshot)
+        return nullptr;
+
+    if(memory_checkpoint(snapshot, cp->mem.get(), base ? base->mem.get() : nullptr))
+    {
+        std::vector<uint8_t> sections;
+        auto segments = emu_snapshot_segments(snapshot, size, false, false, sections);
+        cp->page_count = snapshot->mem.page_count;
+        cp->data = snapshot_buffer_write(segments.data(), segments.size(), &cp->size);
+    }
+
+    free(snapshot);
+    return cp->data ? cp : nullptr;
+}
+
+void rewind_interval_event()
+{
+    intervals++;
+    if(rewind_interval <= 0 || !rewind_capacity)
+    {
+        if(!checkpoints.empty())
+            rewind_clear();
+        return;
+    }
+
+    uint64_t step = std::max<uint64_t>(1, std::lround(rewind_interval * 100));
+    if(!checkpoints.empty() && intervals - checkpoints.back()->intervals < step)
+        return;
+
+    /* A new full one once the incremental ones got half as large or the
+       last full one is about to fall out of the ring */
+    bool full = !keyframe || since_keyframe + 1 >= rewind_capacity
+            || (!checkpoints.empty() && checkpoints.back()->page_count * 2 > keyframe->page_count);
+    auto cp = take_checkpoint(full ? nullptr : keyframe);
+    if(!cp)
+        return;
+
+    if(full)
+    {
+        keyframe = cp;
+        since_keyframe = 0;
+    }
+    else
+        since_keyframe++;
+
+    checkpoints.push_back(cp);
+    while(checkpoints.size() > rewind_capacity)
+        checkpoints.pop_front();
+}
+
+unsigned int rewind_count()
+{
+    return checkpoints.size();
+}
+
+double rewind_age(unsigned int index)
+{
+    if(index >= checkpoints.size())
+        return 0;
+
+    return (intervals - checkpoints[checkpoints.size() - 1 - index]->intervals) / 100.0;
+}
+
+void rewind_to(unsigned int index)
+{
+    requested = index;
+    cpu_events |= EVENT_REWIND;
+}
+
+// Inflates the snapshot, the image has to be freed with emu_snapshot_image_free
+static bool load_checkpoint(const checkpoint &cp, snapshot_image *image)
+{
+    image->path = nullptr;
+    image->snapshot = nullptr;
+    image->data = snapshot_buffer_read(cp.data, cp.size, &image->size);
+    image->mapping.start = image->size;
+    image->mapping.file_offset = 0;
+    return image->data && emu_snapshot_decode(image);
+}
+
+bool rewind_apply()
+{
+    int index = requested.exchange(-1);
+    if(index < 0 || unsigned(index) >= checkpoints.size())
+        return false;
+
+    auto cp = checkpoints[checkpoints.size() - 1 - index];
+    snapshot_image image = {}, base = {};
+    if(!load_checkpoint(*cp, &image) || (cp->base && !load_checkpoint(*cp->base, &base)))
+    {
+        emu_snapshot_image_free(&image);
+        emu_snapshot_image_free(&base);
+        gui_debug_printf("Could not read the checkpoint to rewind to.\n");
+        return false;
+    }
+
+    // Stepping in the debugger goes on where it got rewound to
+    uint32_t debug_step = cpu_events & EVENT_DEBUG_STEP;
+
+    // Unprotects the pages with translated code as well
+    flush_translations();
+
+    auto snapshot = image.snapshot;
+    bool success = flash_rewind(snapshot)
+            && cpu_resume(snapshot)
+            && memory_rewind(&image, cp->base ? &base : nullptr)
+            && sched_resume(snapshot);
+    emu_snapshot_image_free(&base);
+    emu_snapshot_image_free(&image);
+
+    cpu_events |= debug_step;
+    addr_cache_flush();
+
+    if(!success)
+    {
+        // Partially rewound, better start over
+        gui_debug_printf("Rewinding failed, resetting the emulation.\n");
+        rewind_clear();
+        cpu_events |= EVENT_RESET;
+        return false;
+    }
+
+    // The rewound to one stays, to go back there again
+    checkpoints.resize(checkpoints.size() - index);
+    intervals = cp->intervals;
+    keyframe = cp->base ? cp->base : cp;
+    since_keyframe = 0;
+    for(auto it = checkpoints.rbegin(); it != checkpoints.rend() && *it != keyframe; ++it)
+        since_keyframe++;
+    return true;
+}
+
+void rewind_clear()
+{
+    checkpoints.clear();
+    keyframe.reset();
+    since_keyframe = 0;
+    requested = -1;
+}
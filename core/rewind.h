@@ -0,0 +1,37 @@
+/* Declarations for rewind.cpp */
+
+#ifndef _H_REWIND
+#define _H_REWIND
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* While rewind_interval isn't 0, a checkpoint of the whole emulation is
+   taken every rewind_interval seconds of emulated time and kept compressed
+   in memory, up to the last rewind_capacity of them. Most only have the
+   memory pages which differ from the last full one, so that they are cheap
+   to take. Going back to one doesn't touch the disk. */
+extern double rewind_interval;
+extern unsigned int rewind_capacity;
+
+// Called by the throttle event, 100 times per emulated second
+void rewind_interval_event();
+// The number of checkpoints, 0 is the latest one
+unsigned int rewind_count();
+// The emulated seconds since checkpoint index got taken
+double rewind_age(unsigned int index);
+/* Goes back to checkpoint index once the emulation gets there, dropping the
+   ones after it. Unlike the others, this can be called from any thread. */
+void rewind_to(unsigned int index);
+// Does what rewind_to asked for, only called by emu_loop
+bool rewind_apply();
+void rewind_clear();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
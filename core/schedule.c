@@ -5,118 +5,240 @@
 #include "emu.h"
 #include "schedule.h"
 
-sched_state sched;
+// Not part of sched_state, as it's not emulated and doesn't go into snapshots
+static uint32_t sampler_interval;
+static uint64_t sampler_cputick;
+static void (*sampler_proc)(void);
+static uint64_t host_event_cputick[SCHED_HOST_NUM_EVENTS];
+static void (*host_event_proc[SCHED_HOST_NUM_EVENTS])(void);
 
-static inline uint32_t muldiv(uint32_t a, uint32_t b, uint32_t c) {
-#if defined(__i386__) || defined(__x86_64__)
-    __asm__ ("mull %1; divl %2" : "+a" (a) : "m" (b), "m" (c) : "edx");
-    return a;
-#else
-    uint64_t d = a;
-    d *= b;
-    return d / c;
-#endif
+/* Time is kept as the number of CPU cycles since the reset. Items are due at
+   a tick count of their own clock, which gets converted to CPU cycles with
+   the rates since the last change in sched_set_clocks. */
+
+// a * b / c without overflowing in between
+static inline uint64_t muldiv(uint64_t a, uint32_t b, uint32_t c) {
+    return a / c * b + a % c * b / c;
+}
+
+static uint64_t clock_ticks(enum clock_id clock, uint64_t cputick) {
+    return sched.base_ticks[clock] + muldiv(cputick - sched.base_cputick, sched.clock_rates[clock], sched.clock_rates[CLOCK_CPU]);
+}
+
+static uint64_t clock_cputick(enum clock_id clock, uint64_t tick) {
+    if (tick <= sched.base_ticks[clock])
+        return sched.base_cputick;
+
+    return sched.base_cputick + muldiv(tick - sched.base_ticks[clock], sched.clock_rates[CLOCK_CPU], sched.clock_rates[clock]);
+}
+
+// Ties go to the lower index, like the order of the items
+static inline bool queue_before(int a, int b) {
+    return sched.items[a].cputick < sched.items[b].cputick
+            || (sched.items[a].cputick == sched.items[b].cputick && a < b);
+}
+
+static inline void queue_place(int pos, int index) {
+    sched.queue[pos] = index;
+    sched.queue_pos[index] = pos;
+}
+
+static void queue_up(int pos) {
+    int index = sched.queue[pos];
+    while (pos > 0 && queue_before(index, sched.queue[(pos - 1) / 2])) {
+        queue_place(pos, sched.queue[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+    queue_place(pos, index);
+}
+
+static void queue_down(int pos) {
+    int index = sched.queue[pos];
+    for (;;) {
+        int child = pos * 2 + 1;
+        if (child >= sched.queue_size)
+            break;
+        if (child + 1 < sched.queue_size && queue_before(sched.queue[child + 1], sched.queue[child]))
+            child++;
+        if (!queue_before(sched.queue[child], index))
+            break;
+        queue_place(pos, sched.queue[child]);
+        pos = child;
+    }
+    queue_place(pos, index);
+}
+
+static void queue_insert(int index) {
+    sched.items[index].disabled = false;
+    queue_place(sched.queue_size++, index);
+    queue_up(sched.queue_size - 1);
+}
+
+static void queue_remove(int index) {
+    if (sched.items[index].disabled)
+        return;
+
+    sched.items[index].disabled = true;
+    int pos = sched.queue_pos[index], last = sched.queue[--sched.queue_size];
+    if (last == index)
+        return;
+
+    queue_place(pos, last);
+    queue_up(pos);
+    queue_down(sched.queue_pos[last]);
+}
+
+static void queue_rebuild(void) {
+    sched.queue_size = 0;
+    for (int i = 0; i < SCHED_NUM_ITEMS; i++) {
+        // Not all items are used on every model
+        if (!sched.items[i].proc)
+            sched.items[i].disabled = true;
+        if (!sched.items[i].disabled)
+            queue_place(sched.queue_size++, i);
+    }
+    for (int pos = sched.queue_size / 2 - 1; pos >= 0; pos--)
+        queue_down(pos);
+}
+
+static void set_next_event(uint64_t cputick) {
+    // Without anything due soon, come back after a second anyway so that cycle_count_delta doesn't overflow
+    sched.next_cputick = cputick + sched.clock_rates[CLOCK_CPU];
+    if (sched.queue_size && sched.items[sched.queue[0]].cputick < sched.next_cputick)
+        sched.next_cputick = sched.items[sched.queue[0]].cputick;
+    if (sampler_proc) {
+        // The time may have gone back, after a reset or resuming
+        if (sampler_cputick > cputick + sampler_interval)
+            sampler_cputick = cputick + sampler_interval;
+        if (sampler_cputick < sched.next_cputick)
+            sched.next_cputick = sampler_cputick;
+    }
+    for (int i = 0; i < SCHED_HOST_NUM_EVENTS; i++)
+        if (host_event_proc[i] && host_event_cputick[i] < sched.next_cputick)
+            sched.next_cputick = host_event_cputick[i] > cputick ? host_event_cputick[i] : cputick;
+    cycle_count_delta = cputick - sched.next_cputick;
 }
 
 void sched_reset(void) {
     const uint32_t def_rates[] = { 0, 0, 0, 27000000, 12000000, 32768 };
     memcpy(sched.clock_rates, def_rates, sizeof(def_rates));
     memset(sched.items, 0, sizeof sched.items);
+    sched.base_cputick = sched.next_cputick = 0;
+    cycle_count_delta = 0;
+    memset(sched.base_ticks, 0, sizeof sched.base_ticks);
+    sched.queue_size = 0; // Built by sched_update_next_event
 }
 
 void event_repeat(int index, uint32_t ticks) {
     struct sched_item *item = &sched.items[index];
 
-    uint32_t prev = item->tick;
-    item->second = ticks / sched.clock_rates[item->clock];
-    item->tick = ticks % sched.clock_rates[item->clock];
-    if (prev >= sched.clock_rates[item->clock] - item->tick) {
-        item->second++;
-        item->tick -= sched.clock_rates[item->clock];
-    }
-    item->tick += prev;
+    item->tick += ticks;
+    item->cputick = clock_cputick(item->clock, item->tick);
 
-    item->cputick = muldiv(item->tick, sched.clock_rates[CLOCK_CPU], sched.clock_rates[item->clock]);
+    queue_remove(index);
+    queue_insert(index);
 }
 
-void sched_update_next_event(uint32_t cputick) {
-    sched.next_cputick = sched.clock_rates[CLOCK_CPU];
-    sched.next_index = -1;
-    for (int i = 0; i < SCHED_NUM_ITEMS; i++) {
-        struct sched_item *item = &sched.items[i];
-        if (item->proc != NULL && item->second == 0 && item->cputick < sched.next_cputick) {
-            sched.next_cputick = item->cputick;
-            sched.next_index = i;
-        }
-    }
-    //printf("Next event: (%8d,%d)\n", next_cputick, next_index);
-    cycle_count_delta = cputick - sched.next_cputick;
+void sched_update_next_event(uint64_t cputick) {
+    queue_rebuild();
+    set_next_event(cputick);
 }
 
-uint32_t sched_process_pending_events() {
-    uint32_t cputick = sched.next_cputick + cycle_count_delta;
-    while (cputick >= sched.next_cputick) {
-        if (sched.next_index < 0) {
-            //printf("[%8d] New second\n", cputick);
-            int i;
-            for (i = 0; i < SCHED_NUM_ITEMS; i++) {
-                if (sched.items[i].second >= 0)
-                    sched.items[i].second--;
-            }
-            cputick -= sched.clock_rates[CLOCK_CPU];
-        } else {
-            //printf("[%8d/%8d] Event %d\n", cputick, next_cputick, next_index);
-            sched.items[sched.next_index].second = -1;
-            sched.items[sched.next_index].proc(sched.next_index);
-        }
-        sched_update_next_event(cputick);
+uint64_t sched_process_pending_events() {
+    uint64_t cputick = sched.next_cputick + cycle_count_delta;
+    while (sched.queue_size && sched.items[sched.queue[0]].cputick <= cputick) {
+        int index = sched.queue[0];
+        queue_remove(index);
+        sched.items[index].proc(index);
     }
+    if (sampler_proc && sampler_cputick <= cputick) {
+        sampler_cputick = cputick + sampler_interval;
+        sampler_proc();
+    }
+    set_next_event(cputick);
     return cputick;
 }
 
+void sched_process_host_events() {
+    uint64_t cputick = sched.next_cputick + cycle_count_delta;
+    bool due = false;
+    for (int i = 0; i < SCHED_HOST_NUM_EVENTS; i++) {
+        if (!host_event_proc[i] || host_event_cputick[i] > cputick)
+            continue;
+
+        // It may set the next one
+        void (*proc)(void) = host_event_proc[i];
+        host_event_proc[i] = NULL;
+        proc();
+        due = true;
+    }
+    if (due)
+        set_next_event(cputick);
+}
+
+void sched_set_sampler(uint32_t interval, void (*proc)(void)) {
+    uint64_t cputick = sched_process_pending_events();
+
+    sampler_interval = interval;
+    sampler_proc = interval ? proc : NULL;
+    sampler_cputick = cputick + interval;
+
+    set_next_event(cputick);
+}
+
+void sched_set_host_event(int index, uint64_t cputick, void (*proc)(void)) {
+    uint64_t now = sched_process_pending_events();
+
+    host_event_cputick[index] = cputick;
+    host_event_proc[index] = proc;
+
+    set_next_event(now);
+}
+
 void event_clear(int index) {
-    uint32_t cputick = sched_process_pending_events();
+    uint64_t cputick = sched_process_pending_events();
 
-    sched.items[index].second = -1;
+    queue_remove(index);
 
-    sched_update_next_event(cputick);
+    set_next_event(cputick);
 }
 void event_set(int index, int ticks) {
-    uint32_t cputick = sched_process_pending_events();
+    uint64_t cputick = sched_process_pending_events();
 
     struct sched_item *item = &sched.items[index];
-    item->tick = muldiv(cputick, sched.clock_rates[item->clock], sched.clock_rates[CLOCK_CPU]);
+    item->tick = clock_ticks(item->clock, cputick);
     event_repeat(index, ticks);
 
-    sched_update_next_event(cputick);
+    set_next_event(cputick);
 }
 
 uint32_t event_ticks_remaining(int index) {
-    uint32_t cputick = sched_process_pending_events();
+    uint64_t cputick = sched_process_pending_events();
 
     struct sched_item *item = &sched.items[index];
-    return item->second * sched.clock_rates[item->clock]
-            + item->tick - muldiv(cputick, sched.clock_rates[item->clock], sched.clock_rates[CLOCK_CPU]);
+    return item->tick - clock_ticks(item->clock, cputick);
+}
+
+uint64_t sched_clock_ticks(enum clock_id clock) {
+    return clock_ticks(clock, sched_cputick());
+}
+
+uint64_t sched_clock_cputick(enum clock_id clock, uint64_t tick) {
+    return clock_cputick(clock, tick);
 }
 
 void sched_set_clocks(int count, uint32_t *new_rates) {
-    uint32_t cputick = sched_process_pending_events();
+    uint64_t cputick = sched_process_pending_events();
 
-    uint32_t remaining[SCHED_NUM_ITEMS];
-    int i;
-    for (i = 0; i < SCHED_NUM_ITEMS; i++) {
-        struct sched_item *item = &sched.items[i];
-        if (item->second >= 0)
-            remaining[i] = event_ticks_remaining(i);
-    }
-    cputick = muldiv(cputick, new_rates[CLOCK_CPU], sched.clock_rates[CLOCK_CPU]);
+    // The clocks keep their tick counts, only the items' times in CPU cycles change
+    for (int i = 0; i < 6; i++)
+        sched.base_ticks[i] = clock_ticks(i, cputick);
+    sched.base_cputick = cputick;
     memcpy(sched.clock_rates, new_rates, sizeof(uint32_t) * count);
-    for (i = 0; i < SCHED_NUM_ITEMS; i++) {
+
+    for (int i = 0; i < SCHED_NUM_ITEMS; i++) {
         struct sched_item *item = &sched.items[i];
-        if (item->second >= 0) {
-            item->tick = muldiv(cputick, sched.clock_rates[item->clock], sched.clock_rates[CLOCK_CPU]);
-            event_repeat(i, remaining[i]);
-        }
+        item->cputick = clock_cputick(item->clock, item->tick);
     }
 
     sched_update_next_event(cputick);
@@ -130,16 +252,17 @@ bool sched_resume(const emu_snapshot *snapshot)
     // for the proper proc values.
     for(int i = 0; i < SCHED_NUM_ITEMS; ++i)
     {
-        struct sched_item j = snapshot->sched.items[i];
+        struct sched_item j = snapshot->schedule.items[i];
         j.proc = sched.items[i].proc;
         if(!j.proc)
             return false;
 
         sched.items[i] = j;
     }
-    memcpy(sched.clock_rates, snapshot->sched.clock_rates, sizeof(sched.clock_rates));
-    sched.next_cputick = snapshot->sched.next_cputick;
-    sched.next_index = snapshot->sched.next_index;
+    memcpy(sched.clock_rates, snapshot->schedule.clock_rates, sizeof(sched.clock_rates));
+    sched.base_cputick = snapshot->schedule.base_cputick;
+    memcpy(sched.base_ticks, snapshot->schedule.base_ticks, sizeof(sched.base_ticks));
+    sched.next_cputick = snapshot->schedule.next_cputick;
     sched_update_next_event(sched.next_cputick);
 
     return true;
@@ -147,6 +270,6 @@ bool sched_resume(const emu_snapshot *snapshot)
 
 bool sched_suspend(emu_snapshot *snapshot)
 {
-    snapshot->sched = sched;
+    snapshot->schedule = sched;
     return true;
 }
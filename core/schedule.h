@@ -3,6 +3,9 @@
 #ifndef _H_SCHEDULE
 #define _H_SCHEDULE
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,38 +21,72 @@ enum sched_item_index {
         SCHED_NUM_ITEMS
 };
 
+// Events of the host, which aren't part of the emulation
+enum sched_host_index {
+        SCHED_HOST_INPUT_SCRIPT,
+        SCHED_HOST_STOP, // Of the frontend, to stop the emulation at some point
+        SCHED_HOST_NUM_EVENTS
+};
+
 #define SCHED_CASPLUS_TIMER1 SCHED_KEYPAD
 #define SCHED_CASPLUS_TIMER2 SCHED_LCD
 #define SCHED_CASPLUS_TIMER3 SCHED_TIMERS
 
 struct sched_item {
         enum clock_id clock;
-        int second; // -1 = disabled
-        uint32_t tick;
-        uint32_t cputick;
+        bool disabled; // Reset functions may set this directly
+        uint64_t tick; // When it's due, in ticks of clock
+        uint64_t cputick; // The same in CPU cycles
         void (*proc)(int index);
 };
 
 typedef struct sched_state {
     struct sched_item items[SCHED_NUM_ITEMS];
     uint32_t clock_rates[6];
-    uint32_t next_cputick;
-    int next_index; // -1 if no more events this second
+    // Clock i was at base_ticks[i] at base_cputick, only sched_set_clocks moves these
+    uint64_t base_cputick, base_ticks[6];
+    uint64_t next_cputick; // cycle_count_delta counts up to this
+    // Indices of the enabled items, as a binary heap ordered by cputick
+    uint8_t queue[SCHED_NUM_ITEMS], queue_pos[SCHED_NUM_ITEMS];
+    int queue_size;
 } sched_state;
 
-extern sched_state sched;
+#ifdef __cplusplus
+}
+#endif
+
+// sched is part of the emu_instance
+#include "instance.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 void sched_reset(void);
 typedef struct emu_snapshot emu_snapshot;
 bool sched_resume(const emu_snapshot *snapshot);
 bool sched_suspend(emu_snapshot *snapshot);
 void event_repeat(int index, uint32_t ticks);
-void sched_update_next_event(uint32_t cputick);
-uint32_t sched_process_pending_events();
+// Rebuilds the queue after items got changed directly, cputick is the current time
+void sched_update_next_event(uint64_t cputick);
+uint64_t sched_process_pending_events();
 void event_clear(int index);
 void event_set(int index, int ticks);
 uint32_t event_ticks_remaining(int index);
+// The current tick count of clock, and the CPU cycle when it reaches tick
+uint64_t sched_clock_ticks(enum clock_id clock);
+uint64_t sched_clock_cputick(enum clock_id clock, uint64_t tick);
 void sched_set_clocks(int count, uint32_t *new_rates);
+/* Calls proc every interval CPU cycles, from wherever events get processed,
+   until interval is 0. For the profiler, it doesn't affect the emulation. */
+void sched_set_sampler(uint32_t interval, void (*proc)(void));
+/* Calls proc once when the CPU cycle count reaches cputick, unless the event
+   of that index gets replaced before. proc NULL cancels it. Like the sampler,
+   it's for the host and not in snapshots. They're only called by emu_loop
+   between instructions, through sched_process_host_events, so they may do
+   anything. */
+void sched_set_host_event(int index, uint64_t cputick, void (*proc)(void));
+void sched_process_host_events();
 
 #ifdef __cplusplus
 }
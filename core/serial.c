@@ -51,6 +51,18 @@ void xmodem_send(const char *filename) {
     xmodem_next_packet();
 }
 
+/* Not part of the emulated state. A frontend may need a signal or a system
+ * call for each write, so the output goes out by the line. */
+static char serial_out[256];
+static size_t serial_out_size;
+bool serial_buffered = true;
+
+void serial_flush(void) {
+    if (serial_out_size)
+        gui_serial_write(serial_out, serial_out_size);
+    serial_out_size = 0;
+}
+
 void serial_byte_out(uint8_t byte) {
     if (xmodem_file) {
         if (byte == 6) {
@@ -62,8 +74,11 @@ void serial_byte_out(uint8_t byte) {
             xmodem_file = NULL;
         }
     }
-    else
-        gui_putchar(byte);
+    else {
+        serial_out[serial_out_size++] = byte;
+        if (!serial_buffered || byte == '\n' || serial_out_size == sizeof(serial_out))
+            serial_flush();
+    }
 }
 
 static serial_state serial;
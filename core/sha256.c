@@ -2,49 +2,66 @@
 #include "emu.h"
 #include "mem.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA256_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO) || (defined(__linux__) && !defined(__clang__)))
+#define SHA256_ARM64
+#include <arm_neon.h>
+#if !defined(__ARM_FEATURE_SHA2) && !defined(__ARM_FEATURE_CRYPTO)
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+#endif
+
 static sha256_state sha256;
 
 #define ROR(x, y) ((x) >> (y) | (x) << (32 - (y)))
 
+static const uint32_t initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
 static inline void initialize() {
-    static const uint32_t initial_state[8] = {
-        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
-        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
-    };
     memcpy(sha256.hash_state, initial_state, 32);
 }
 
-static void process_block() {
-    static const uint32_t k[64] = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
 
+/* The compression function in C, for hosts without SHA instructions */
+static void process_block_generic(uint32_t hash_state[8], const uint32_t hash_block[16]) {
     uint32_t a, b, c, d, e, f, g, h;
     uint32_t w[64];
     int i;
 
-    memcpy(w, sha256.hash_block, 64);
+    memcpy(w, hash_block, 64);
     for (i = 16; i < 64; i++) {
         uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
         uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
         w[i] = w[i-16] + s0 + w[i-7] + s1;
     }
 
-    a = sha256.hash_state[0];
-    b = sha256.hash_state[1];
-    c = sha256.hash_state[2];
-    d = sha256.hash_state[3];
-    e = sha256.hash_state[4];
-    f = sha256.hash_state[5];
-    g = sha256.hash_state[6];
-    h = sha256.hash_state[7];
+    a = hash_state[0];
+    b = hash_state[1];
+    c = hash_state[2];
+    d = hash_state[3];
+    e = hash_state[4];
+    f = hash_state[5];
+    g = hash_state[6];
+    h = hash_state[7];
 
     for (i = 0; i < 64; i++) {
         uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
@@ -64,14 +81,140 @@ static void process_block() {
         a = t1 + t2;
     }
 
-    sha256.hash_state[0] += a;
-    sha256.hash_state[1] += b;
-    sha256.hash_state[2] += c;
-    sha256.hash_state[3] += d;
-    sha256.hash_state[4] += e;
-    sha256.hash_state[5] += f;
-    sha256.hash_state[6] += g;
-    sha256.hash_state[7] += h;
+    hash_state[0] += a;
+    hash_state[1] += b;
+    hash_state[2] += c;
+    hash_state[3] += d;
+    hash_state[4] += e;
+    hash_state[5] += f;
+    hash_state[6] += g;
+    hash_state[7] += h;
+}
+
+#ifdef SHA256_X86
+/* With the SHA extensions. They work on ABEF and CDGH, the message words are
+ * already in host order */
+__attribute__((target("sha,sse4.1")))
+static void process_block_sha_ni(uint32_t hash_state[8], const uint32_t hash_block[16]) {
+    __m128i temp = _mm_loadu_si128((const __m128i *) &hash_state[0]);
+    __m128i state1 = _mm_loadu_si128((const __m128i *) &hash_state[4]);
+    temp = _mm_shuffle_epi32(temp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    __m128i state0 = _mm_alignr_epi8(temp, state1, 8);
+    state1 = _mm_blend_epi16(state1, temp, 0xF0);
+    __m128i abef = state0, cdgh = state1;
+
+    __m128i w[4];
+    int i;
+    for (i = 0; i < 4; i++)
+        w[i] = _mm_loadu_si128((const __m128i *) &hash_block[i * 4]);
+
+    for (i = 0; i < 16; i++) {
+        __m128i wk = _mm_add_epi32(w[i & 3], _mm_loadu_si128((const __m128i *) &k[i * 4]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+        if (i < 12) {
+            __m128i next = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+            next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+            w[i & 3] = _mm_sha256msg2_epu32(next, w[(i + 3) & 3]);
+        }
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+    temp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i *) &hash_state[0], _mm_blend_epi16(temp, state1, 0xF0));
+    _mm_storeu_si128((__m128i *) &hash_state[4], _mm_alignr_epi8(state1, temp, 8));
+}
+
+static bool have_sha_instructions() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1))
+        return false;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & bit_SHA);
+}
+#endif
+
+#ifdef SHA256_ARM64
+/* With the ARMv8 crypto extension */
+#if !defined(__ARM_FEATURE_SHA2) && !defined(__ARM_FEATURE_CRYPTO)
+__attribute__((target("+crypto")))
+#endif
+static void process_block_armv8(uint32_t hash_state[8], const uint32_t hash_block[16]) {
+    uint32x4_t abcd = vld1q_u32(&hash_state[0]), efgh = vld1q_u32(&hash_state[4]);
+    uint32x4_t abcd_start = abcd, efgh_start = efgh;
+
+    uint32x4_t w[4];
+    int i;
+    for (i = 0; i < 4; i++)
+        w[i] = vld1q_u32(&hash_block[i * 4]);
+
+    for (i = 0; i < 16; i++) {
+        uint32x4_t wk = vaddq_u32(w[i & 3], vld1q_u32(&k[i * 4]));
+        uint32x4_t abcd_prev = abcd;
+        abcd = vsha256hq_u32(abcd, efgh, wk);
+        efgh = vsha256h2q_u32(efgh, abcd_prev, wk);
+        if (i < 12)
+            w[i & 3] = vsha256su1q_u32(vsha256su0q_u32(w[i & 3], w[(i + 1) & 3]), w[(i + 2) & 3], w[(i + 3) & 3]);
+    }
+
+    vst1q_u32(&hash_state[0], vaddq_u32(abcd, abcd_start));
+    vst1q_u32(&hash_state[4], vaddq_u32(efgh, efgh_start));
+}
+
+static bool have_sha_instructions() {
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+    return true;
+#else
+    return getauxval(AT_HWCAP) & HWCAP_SHA2;
+#endif
+}
+#endif
+
+/* The compression function, also used by sha256_digest. The first call
+ * picks the implementation for the host. */
+static void process_block_detect(uint32_t hash_state[8], const uint32_t hash_block[16]);
+static void (*process_block)(uint32_t hash_state[8], const uint32_t hash_block[16]) = process_block_detect;
+
+static void process_block_detect(uint32_t hash_state[8], const uint32_t hash_block[16]) {
+    process_block = process_block_generic;
+#if defined(SHA256_X86)
+    if (have_sha_instructions())
+        process_block = process_block_sha_ni;
+#elif defined(SHA256_ARM64)
+    if (have_sha_instructions())
+        process_block = process_block_armv8;
+#endif
+    process_block(hash_state, hash_block);
+}
+
+static void process_bytes(uint32_t hash_state[8], const uint8_t bytes[64]) {
+    uint32_t block[16];
+    for (int i = 0; i < 16; i++)
+        block[i] = (uint32_t)bytes[i*4] << 24 | bytes[i*4+1] << 16 | bytes[i*4+2] << 8 | bytes[i*4+3];
+    process_block(hash_state, block);
+}
+
+void sha256_digest(const void *data, size_t size, uint32_t digest[8]) {
+    const uint8_t *bytes = data;
+    memcpy(digest, initial_state, 32);
+
+    size_t full = size & ~(size_t)63;
+    for (size_t pos = 0; pos < full; pos += 64)
+        process_bytes(digest, bytes + pos);
+
+    // The rest is followed by a 1 bit, zeroes and the length in bits
+    uint8_t tail[128] = { 0 };
+    size_t rest = size - full, tail_size = rest < 56 ? 64 : 128;
+    memcpy(tail, bytes + full, rest);
+    tail[rest] = 0x80;
+    for (int i = 0; i < 8; i++)
+        tail[tail_size - 1 - i] = (uint64_t)size * 8 >> (8 * i);
+
+    process_bytes(digest, tail);
+    if (tail_size == 128)
+        process_bytes(digest, tail + 64);
 }
 
 void sha256_reset(void) {
@@ -99,7 +242,7 @@ void sha256_write_word(uint32_t addr, uint32_t value) {
                 if ((value & 0xE) == 0xA) // 0A or 0B: first block
                     initialize();
                 if ((value & 0xA) == 0xA) // 0E or 0F: subsequent blocks
-                    process_block();
+                    process_block(sha256.hash_state, sha256.hash_block);
             }
             return;
         case 0x08: return;
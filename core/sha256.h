@@ -3,6 +3,9 @@
 #ifndef _H_SHA256
 #define _H_SHA256
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -11,6 +14,9 @@ typedef struct sha256_state {
     uint32_t hash_state[8], hash_block[16];
 } sha256_state;
 
+// Software implementation, independent of the emulated hardware
+void sha256_digest(const void *data, size_t size, uint32_t digest[8]);
+
 void sha256_reset(void);
 typedef struct emu_snapshot emu_snapshot;
 bool sha256_suspend(emu_snapshot *snapshot);
@@ -0,0 +1,83 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "emu.h"
+#include "mem.h"
+#include "shmem.h"
+#include "os/os.h"
+
+// The memory starts at a multiple of this, which covers the host page sizes
+#define SHMEM_ALIGN 0x10000
+#define SHMEM_HEADER_SIZE ((sizeof(struct shmem_header) + SHMEM_ALIGN - 1) & ~(size_t)(SHMEM_ALIGN - 1))
+
+static struct shmem_header *header;
+static char name[256]; // Of the object, shared_state_name might change meanwhile
+
+bool shmem_map(uint8_t *mem, size_t size)
+{
+    shmem_unmap();
+    if(!shared_state_name)
+        return true;
+
+    size = (size + SHMEM_ALIGN - 1) & ~(size_t)(SHMEM_ALIGN - 1);
+    errno = 0;
+    if((size_t) snprintf(name, sizeof(name), "%s", shared_state_name) >= sizeof(name)
+       || !(header = os_map_shared(name, SHMEM_HEADER_SIZE, mem, size)))
+    {
+        if(errno == EEXIST)
+            emuprintf("Could not share the memory as %s, another emulation uses that name\n", shared_state_name);
+        else
+            emuprintf("Could not share the memory as %s\n", shared_state_name);
+        return false;
+    }
+
+    memset(header, 0, SHMEM_HEADER_SIZE);
+    header->magic = SHMEM_MAGIC;
+    header->mem_offset = SHMEM_HEADER_SIZE;
+    header->mem_size = size;
+    header->product = product;
+    header->features = features;
+    for(unsigned int i = 0; i < sizeof(mem_areas) / sizeof(*mem_areas); i++)
+    {
+        if(!mem_areas[i].size)
+            continue;
+
+        header->areas[i].base = mem_areas[i].base;
+        header->areas[i].size = mem_areas[i].size;
+        header->areas[i].offset = SHMEM_HEADER_SIZE + (mem_areas[i].ptr - mem);
+    }
+
+    // Last, so that a reader sees all of the above with it
+    __atomic_store_n(&header->version, SHMEM_VERSION, __ATOMIC_RELEASE);
+    return true;
+}
+
+void shmem_unmap(void)
+{
+    if(!header)
+        return;
+
+    // Readers which have it open already see that it's gone
+    __atomic_store_n(&header->version, 0, __ATOMIC_RELEASE);
+    os_unmap_shared(name, header, SHMEM_HEADER_SIZE);
+    header = NULL;
+}
+
+bool shmem_active(void)
+{
+    return header != NULL;
+}
+
+void shmem_publish_frame(const uint16_t *frame)
+{
+    if(!header)
+        return;
+
+    uint64_t sequence = header->frame_sequence;
+    __atomic_store_n(&header->frame_sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->frame, frame, sizeof(header->frame));
+    header->frame_cputick = sched_cputick();
+    __atomic_store_n(&header->frame_sequence, sequence + 2, __ATOMIC_RELEASE);
+}
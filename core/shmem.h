@@ -0,0 +1,56 @@
+/* Declarations for shmem.c */
+
+#ifndef _H_SHMEM
+#define _H_SHMEM
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* If shared_state_name is set, the guest memory and the LCD are in a shared
+   memory object of that name (/dev/shm/<name> on Linux), so that other
+   processes can look at them while the emulation runs, without stopping it
+   or copying anything. The object starts with this header, in host byte
+   order. The memory of the areas follows at mem_offset, it's the memory
+   the emulation uses itself. It's only valid as long as version isn't 0,
+   which it becomes when the emulation stops. */
+#define SHMEM_MAGIC 0x4D485346 // "FSHM"
+#define SHMEM_VERSION 1
+
+struct shmem_header {
+    uint32_t magic, version;
+    uint32_t mem_offset, mem_size; // Of the guest memory in the object
+    uint32_t product, features;
+    struct {
+        uint32_t base, size; // Physical addresses, like mem_areas
+        uint32_t offset; // Of the memory in the object, 0 if unused
+        uint32_t reserved;
+    } areas[4];
+    /* Incremented before and after the frame gets written, so it's odd
+       meanwhile. A reader copies the frame and only uses the copy if
+       frame_sequence was even and the same before and after. */
+    uint64_t frame_sequence;
+    uint64_t frame_cputick; // When it got shown, see sched_cputick
+    uint16_t frame[320 * 240]; // RGB565, like lcd_frame_acquire
+};
+
+/* Shares the size bytes of guest memory at mem, called by memory_initialize
+   once the areas are set up. Returns true if there's nothing to share. */
+bool shmem_map(uint8_t *mem, size_t size);
+// Removes the object, mem gets freed along with the memory around it
+void shmem_unmap(void);
+/* Whether the memory is shared. It must not be replaced by other mappings
+   then and a forked process doesn't get a copy of it. */
+bool shmem_active(void);
+// Called by lcd_publish_frame for each frame which got drawn
+void shmem_publish_frame(const uint16_t *frame);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
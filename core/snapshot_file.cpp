@@ -0,0 +1,341 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "parallel.h"
+#include "snapshot_file.h"
+#include "os/os.h"
+
+static bool compress_chunk(const struct snapshot_segment *segments, size_t count, std::vector<uint8_t> &out, bool &stored)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if(deflateInit(&stream, Z_BEST_SPEED) != Z_OK)
+        return false;
+
+    size_t size = 0;
+    for(size_t i = 0; i < count; ++i)
+        size += segments[i].size;
+    out.resize(deflateBound(&stream, size));
+    stream.next_out = out.data();
+    stream.avail_out = out.size();
+
+    int ret = Z_OK;
+    for(size_t i = 0; ret == Z_OK && i < count; ++i)
+    {
+        stream.next_in = (Bytef *) segments[i].data;
+        stream.avail_in = segments[i].size;
+        ret = deflate(&stream, i + 1 == count ? Z_FINISH : Z_NO_FLUSH);
+    }
+    if(!count)
+        ret = deflate(&stream, Z_FINISH);
+
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    if(ret != Z_STREAM_END)
+        return false;
+
+    stored = out.size() >= size;
+    if(stored)
+    {
+        out.clear();
+        for(size_t i = 0; i < count; ++i)
+            out.insert(out.end(), (const uint8_t *) segments[i].data, (const uint8_t *) segments[i].data + segments[i].size);
+    }
+    return true;
+}
+
+// The chunks of a snapshot and the table for them, as they get written
+struct container
+{
+    struct snapshot_file_header header;
+    std::vector<struct snapshot_file_chunk> table;
+    // The parts of the segments each chunk consists of
+    std::vector<std::vector<struct snapshot_segment>> chunk_segments;
+    std::vector<uint8_t> mappable; // Not vector<bool>, written concurrently later
+    std::vector<std::vector<uint8_t>> compressed; // Empty for mappable chunks
+    uint64_t size; // Of the whole file
+};
+
+// With allow_mappable false, the segments are all taken as not mappable
+static bool build_container(const struct snapshot_segment *segments, size_t count, bool allow_mappable, container &c)
+{
+    auto &chunk_segments = c.chunk_segments;
+    auto &mappable = c.mappable;
+    size_t chunk_used = SNAPSHOT_CHUNK_SIZE;
+    uint64_t size = 0;
+    for(size_t i = 0; i < count; ++i)
+    {
+        auto data = static_cast<const uint8_t *>(segments[i].data);
+        size_t remaining = segments[i].size;
+        bool segment_mappable = allow_mappable && segments[i].mappable;
+        size += remaining;
+        if(remaining && !mappable.empty() && mappable.back() != segment_mappable)
+            chunk_used = SNAPSHOT_CHUNK_SIZE;
+        while(remaining)
+        {
+            if(chunk_used == SNAPSHOT_CHUNK_SIZE)
+            {
+                chunk_segments.emplace_back();
+                mappable.push_back(segment_mappable);
+                chunk_used = 0;
+            }
+
+            size_t part = std::min<size_t>(remaining, SNAPSHOT_CHUNK_SIZE - chunk_used);
+            chunk_segments.back().push_back({data, part, segment_mappable});
+            data += part;
+            remaining -= part;
+            chunk_used += part;
+        }
+    }
+
+    c.compressed.resize(chunk_segments.size());
+    std::vector<uint8_t> stored(chunk_segments.size());
+    std::atomic<bool> success{true};
+    parallel_for(chunk_segments.size(), [&](size_t i) {
+        if(mappable[i])
+            return; // Written straight from the segments
+
+        bool chunk_stored = false;
+        if(!compress_chunk(chunk_segments[i].data(), chunk_segments[i].size(), c.compressed[i], chunk_stored))
+            success = false;
+        else
+            stored[i] = chunk_stored;
+    });
+    if(!success)
+        return false;
+
+    c.header.magic = SNAPSHOT_FILE_MAGIC;
+    c.header.chunk_count = c.compressed.size();
+    c.header.size = size;
+
+    auto &table = c.table;
+    table.resize(c.compressed.size());
+    uint64_t offset = sizeof(c.header) + table.size() * sizeof(table[0]), data_offset = 0;
+    for(size_t i = 0; i < table.size(); ++i)
+    {
+        table[i].data_offset = data_offset;
+        for(auto &segment : chunk_segments[i])
+            data_offset += segment.size;
+
+        if(mappable[i])
+        {
+            offset = (offset + SNAPSHOT_FILE_ALIGN - 1) & ~uint64_t(SNAPSHOT_FILE_ALIGN - 1);
+            table[i].compressed_size = data_offset - table[i].data_offset;
+            table[i].flags = SNAPSHOT_CHUNK_STORED | SNAPSHOT_CHUNK_MAPPABLE;
+        }
+        else
+        {
+            table[i].compressed_size = c.compressed[i].size();
+            table[i].flags = stored[i] ? SNAPSHOT_CHUNK_STORED : 0;
+        }
+        table[i].offset = offset;
+        offset += table[i].compressed_size;
+    }
+
+    c.size = offset;
+    return true;
+}
+
+bool snapshot_file_write(const char *path, const struct snapshot_segment *segments, size_t count)
+{
+    container c;
+    if(!build_container(segments, count, true, c))
+        return false;
+
+#ifdef _WIN32
+    const std::string file_path = path;
+#else
+    // A resumed snapshot might still be mapped, so don't overwrite it in place
+    const std::string file_path = std::string(path) + ".tmp";
+#endif
+    FILE *file = fopen_utf8(file_path.c_str(), "wb");
+    if(!file)
+        return false;
+
+    const auto &table = c.table;
+    static const uint8_t padding[SNAPSHOT_FILE_ALIGN] = {};
+    uint64_t written_size = sizeof(c.header) + table.size() * sizeof(table[0]);
+    bool written = fwrite(&c.header, sizeof(c.header), 1, file) == 1
+            && fwrite(table.data(), sizeof(table[0]), table.size(), file) == table.size();
+    for(size_t i = 0; written && i < table.size(); ++i)
+    {
+        if(table[i].offset != written_size)
+            written = fwrite(padding, table[i].offset - written_size, 1, file) == 1;
+
+        if(!c.mappable[i])
+            written = written && fwrite(c.compressed[i].data(), c.compressed[i].size(), 1, file) == 1;
+        for(size_t j = 0; written && c.mappable[i] && j < c.chunk_segments[i].size(); ++j)
+            written = fwrite(c.chunk_segments[i][j].data, c.chunk_segments[i][j].size, 1, file) == 1;
+
+        written_size = table[i].offset + table[i].compressed_size;
+    }
+
+    written = fclose(file) == 0 && written;
+#ifndef _WIN32
+    if(written)
+        written = rename(file_path.c_str(), path) == 0;
+    else
+        remove(file_path.c_str());
+#endif
+    return written;
+}
+
+void *snapshot_buffer_write(const struct snapshot_segment *segments, size_t count, size_t *size)
+{
+    container c;
+    if(!build_container(segments, count, false, c) || c.size > SIZE_MAX)
+        return nullptr;
+
+    auto buffer = static_cast<uint8_t *>(malloc(c.size));
+    if(!buffer)
+        return nullptr;
+
+    memcpy(buffer, &c.header, sizeof(c.header));
+    memcpy(buffer + sizeof(c.header), c.table.data(), c.table.size() * sizeof(c.table[0]));
+    for(size_t i = 0; i < c.table.size(); ++i)
+        memcpy(buffer + c.table[i].offset, c.compressed[i].data(), c.compressed[i].size());
+
+    *size = c.size;
+    return buffer;
+}
+
+static bool check_header(const struct snapshot_file_header &header)
+{
+    return header.magic == SNAPSHOT_FILE_MAGIC
+            && header.size <= SIZE_MAX
+            && header.chunk_count <= header.size
+            && header.chunk_count <= header.size / SNAPSHOT_CHUNK_SIZE * 2 + 2;
+}
+
+/* Checks that the chunks follow each other as snapshot_file_write puts them
+   and fills chunk_sizes with their uncompressed sizes. Returns the offset
+   after the last chunk or 0 if the table is invalid. */
+static uint64_t check_table(const struct snapshot_file_header &header, const std::vector<struct snapshot_file_chunk> &table,
+                            std::vector<uint64_t> &chunk_sizes)
+{
+    uint64_t offset = sizeof(header) + table.size() * sizeof(table[0]);
+    chunk_sizes.resize(table.size());
+    for(size_t i = 0; i < table.size(); ++i)
+    {
+        uint64_t end = i + 1 < table.size() ? table[i + 1].data_offset : header.size;
+        chunk_sizes[i] = end - table[i].data_offset;
+        if(table[i].flags & SNAPSHOT_CHUNK_MAPPABLE)
+            offset = (offset + SNAPSHOT_FILE_ALIGN - 1) & ~uint64_t(SNAPSHOT_FILE_ALIGN - 1);
+        if(table[i].offset != offset
+                || table[i].data_offset >= end || chunk_sizes[i] > SNAPSHOT_CHUNK_SIZE
+                || (!i && table[i].data_offset != 0)
+                || ((table[i].flags & SNAPSHOT_CHUNK_STORED) && table[i].compressed_size != chunk_sizes[i]))
+            return 0;
+        offset += table[i].compressed_size;
+    }
+
+    return offset;
+}
+
+/* Inflates the first count chunks into a malloc'd buffer of header.size bytes,
+   the chunks are in compressed which starts at offset start of the file */
+static void *inflate_chunks(const struct snapshot_file_header &header, const std::vector<struct snapshot_file_chunk> &table,
+                            const std::vector<uint64_t> &chunk_sizes, size_t count, const uint8_t *compressed, uint64_t start)
+{
+    auto data = static_cast<uint8_t *>(malloc(header.size ? header.size : 1));
+    if(!data)
+        return nullptr;
+
+    std::atomic<bool> inflated{true};
+    parallel_for(count, [&](size_t i) {
+        uLongf chunk_size = chunk_sizes[i];
+        uLongf expected = chunk_size;
+        const uint8_t *in = compressed + (table[i].offset - start);
+        if(table[i].flags & SNAPSHOT_CHUNK_STORED)
+            memcpy(data + table[i].data_offset, in, expected);
+        else if(uncompress(data + table[i].data_offset, &chunk_size, in, table[i].compressed_size) != Z_OK
+                || chunk_size != expected)
+            inflated = false;
+    });
+
+    if(!inflated)
+    {
+        free(data);
+        return nullptr;
+    }
+
+    return data;
+}
+
+void *snapshot_file_read(const char *path, size_t *size, struct snapshot_mapping *mapping)
+{
+    FILE *file = fopen_utf8(path, "rb");
+    if(!file)
+        return nullptr;
+
+    struct snapshot_file_header header;
+    if(fread(&header, sizeof(header), 1, file) != 1 || !check_header(header))
+    {
+        fclose(file);
+        return nullptr;
+    }
+
+    std::vector<struct snapshot_file_chunk> table(header.chunk_count);
+    std::vector<uint64_t> chunk_sizes;
+    const uint64_t start = sizeof(header) + table.size() * sizeof(table[0]);
+    uint64_t offset = 0;
+    bool success = fread(table.data(), sizeof(table[0]), table.size(), file) == table.size()
+            && (offset = check_table(header, table, chunk_sizes)) != 0;
+
+    // The mappable chunks at the end are contiguous in the file, the others are read
+    size_t read_count = table.size();
+    while(mapping && read_count && (table[read_count - 1].flags & SNAPSHOT_CHUNK_MAPPABLE))
+        --read_count;
+    if(mapping)
+    {
+        mapping->start = read_count < table.size() ? table[read_count].data_offset : header.size;
+        mapping->file_offset = read_count < table.size() ? table[read_count].offset : offset;
+    }
+
+    // Everything else is read at once, it's small compared to the rest
+    std::vector<uint8_t> compressed;
+    if(success)
+    {
+        uint64_t end = read_count < table.size() ? table[read_count].offset : offset;
+        compressed.resize(end - start);
+        success = fread(compressed.data(), 1, compressed.size(), file) == compressed.size();
+    }
+    fclose(file);
+
+    void *data = success ? inflate_chunks(header, table, chunk_sizes, read_count, compressed.data(), start) : nullptr;
+    if(data)
+        *size = header.size;
+    return data;
+}
+
+void *snapshot_buffer_read(const void *buffer, size_t buffer_size, size_t *size)
+{
+    auto bytes = static_cast<const uint8_t *>(buffer);
+    struct snapshot_file_header header;
+    if(buffer_size < sizeof(header))
+        return nullptr;
+
+    memcpy(&header, bytes, sizeof(header));
+    if(!check_header(header) || (buffer_size - sizeof(header)) / sizeof(struct snapshot_file_chunk) < header.chunk_count)
+        return nullptr;
+
+    std::vector<struct snapshot_file_chunk> table(header.chunk_count);
+    memcpy(table.data(), bytes + sizeof(header), table.size() * sizeof(table[0]));
+    std::vector<uint64_t> chunk_sizes;
+    uint64_t end = check_table(header, table, chunk_sizes);
+    if(!end || end > buffer_size)
+        return nullptr;
+
+    const uint64_t start = sizeof(header) + table.size() * sizeof(table[0]);
+    void *data = inflate_chunks(header, table, chunk_sizes, table.size(), bytes + start, start);
+    if(data)
+        *size = header.size;
+    return data;
+}
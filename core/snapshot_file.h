@@ -0,0 +1,69 @@
+/* Declarations for snapshot_file.cpp */
+
+#ifndef _H_SNAPSHOT_FILE
+#define _H_SNAPSHOT_FILE
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A snapshot file is split into chunks of up to SNAPSHOT_CHUNK_SIZE bytes which
+   are deflated independently, so that writing and reading them can be done
+   by all cores at once. The file starts with a snapshot_file_header and the
+   snapshot_file_chunk table, the compressed chunks follow in order.
+   Mappable chunks are stored uncompressed at offsets aligned to
+   SNAPSHOT_FILE_ALIGN, so that their data can be mapped from the file. */
+#define SNAPSHOT_FILE_MAGIC 0x4E534246 // "FBSN"
+#define SNAPSHOT_CHUNK_SIZE 0x100000
+#define SNAPSHOT_FILE_ALIGN 0x10000
+
+struct snapshot_file_header {
+    uint32_t magic;
+    uint32_t chunk_count;
+    uint64_t size; // Of the uncompressed data
+};
+
+struct snapshot_file_chunk {
+    uint64_t offset; // In the file
+    uint64_t data_offset; // In the uncompressed data, the chunk ends where the next one starts
+    uint32_t compressed_size;
+    uint32_t flags;
+};
+// Chunks which don't get smaller are stored as they are
+#define SNAPSHOT_CHUNK_STORED 1
+#define SNAPSHOT_CHUNK_MAPPABLE 2
+
+// Parts of the data which get written one after another
+struct snapshot_segment {
+    const void *data;
+    size_t size;
+    bool mappable; // Starts a new chunk, as does the next segment if it isn't mappable
+};
+
+// The part at the end of the data which got left in the file
+struct snapshot_mapping {
+    size_t start; // Offset in the data, the size of it if nothing is left
+    uint64_t file_offset;
+};
+
+bool snapshot_file_write(const char *path, const struct snapshot_segment *segments, size_t count);
+/* Returns the uncompressed data in a malloc'd buffer or NULL. If mapping is
+   given, the mappable chunks at the end are not read, the buffer has room
+   for them but the content is undefined. */
+void *snapshot_file_read(const char *path, size_t *size, struct snapshot_mapping *mapping);
+
+/* The same in a malloc'd buffer instead of a file, nothing is mappable.
+   Returns the buffer or NULL and its size in size. */
+void *snapshot_buffer_write(const struct snapshot_segment *segments, size_t count, size_t *size);
+// Returns the uncompressed data of such a buffer like snapshot_file_read
+void *snapshot_buffer_read(const void *buffer, size_t buffer_size, size_t *size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
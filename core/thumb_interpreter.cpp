@@ -1,9 +1,13 @@
+#include <chrono>
+
 #include "asmcode.h"
 #include "cpu.h"
 #include "debug.h"
 #include "emu.h"
 #include "mem.h"
 #include "mmu.h"
+#include "trace.h"
+#include "translate.h"
 
 static uint32_t shift(int type, uint32_t res, uint32_t count, int setcc) {
     //TODO: Verify!
@@ -90,24 +94,66 @@ void cpu_thumb_loop() {
             goto enter_debugger;
         }
 
+#ifndef NO_TRANSLATION
+        // A Thumb translation may start at either halfword of the word
+        if ((flags & (RF_CODE_TRANSLATED | RF_CODE_THUMB)) == (RF_CODE_TRANSLATED | RF_CODE_THUMB) && !translation_replaying) {
+            unsigned int index = flags >> RFS_TRANSLATION_INDEX;
+            if ((uint32_t*) insnp >= translation_table[index].start_ptr
+                && (uint32_t*) insnp < translation_table[index].end_ptr) {
+                translation_touch(index);
+                uint64_t cputick = sched_cputick();
+                translation_run();
+                translate_stats.jit_instructions += sched_cputick() - cputick;
+                if (!(arm.cpsr_low28 & 0x20))
+                    return; // The translation switched to ARM mode
+                continue;
+            }
+        }
+#endif
+
         if (flags & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT)) {
-            if (flags & RF_EXEC_BREAKPOINT)
-                printf("Hit breakpoint at %08X. Entering debugger.\n", arm.reg[15]);
+            if ((flags & RF_EXEC_DEBUG_NEXT) || debug_exec_breakpoint(insnp)) {
+                if (flags & RF_EXEC_BREAKPOINT)
+                    printf("Hit breakpoint at %08X. Entering debugger.\n", arm.reg[15]);
 enter_debugger:
-            debugger(DBG_EXEC_BREAKPOINT, 0);
+                debugger(DBG_EXEC_BREAKPOINT, 0);
+            }
+            else if (exiting)
+                continue; // The breakpoint stops the emulation before the instruction
         }
+#ifndef NO_TRANSLATION
+        else if (do_translate && !(flags & (RF_CODE_NO_TRANSLATE | RF_CODE_TRANSLATED))
+                 && translation_hot(insnp) && !translation_queued(arm.reg[15] & ~1, insnp, true)) {
+            auto start = std::chrono::steady_clock::now();
+            bool translated = translate_thumb(arm.reg[15] & ~1, insnp);
+            translate_stats.translate_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            if (translated) {
+                ++translate_stats.translations;
+                continue;
+            }
+            ++translate_stats.fallbacks;
+        }
+#endif
+
+        if (unlikely(trace_enabled))
+            trace_record(insnp, true);
 
         arm.reg[15] += 2;
         cycle_count_delta++;
+        translate_stats.interpreted_instructions++;
 
-#define CASE_x2(base) case base: case base+1
-#define CASE_x4(base) CASE_x2(base): CASE_x2(base+2)
-#define CASE_x8(base) CASE_x4(base): CASE_x4(base+4)
+/* Dispatch on the top 10 bits, so that the format 4 ALU operations get
+   their own cases as well. The case macros take the top byte. */
+#define CASE_x1(base) case (base) << 2 ... ((base) << 2) + 3
+#define CASE_x2(base) case (base) << 2 ... ((base) << 2) + 7
+#define CASE_x4(base) case (base) << 2 ... ((base) << 2) + 15
+#define CASE_x8(base) case (base) << 2 ... ((base) << 2) + 31
 #define REG0 arm.reg[insn & 7]
 #define REG3 arm.reg[insn >> 3 & 7]
 #define REG6 arm.reg[insn >> 6 & 7]
 #define REG8 arm.reg[insn >> 8 & 7]
-        switch (insn >> 8) {
+#define ALU(op, expr) case 0x100 | (op): set_nz_flags(expr); break;
+        switch (insn >> 6) {
             CASE_x8(0x00): /* LSL Rd, Rm, #imm */
                 CASE_x8(0x08): /* LSR Rd, Rm, #imm */
               CASE_x8(0x10): /* ASR Rd, Rm, #imm */
@@ -121,48 +167,38 @@ enter_debugger:
             CASE_x8(0x28): /* CMP Rn, #imm */ set_nz_flags(add(REG8, ~(insn & 0xFF), 1, true)); break;
             CASE_x8(0x30): /* ADD Rd, #imm */ set_nz_flags(REG8 = add(REG8, insn & 0xFF, 0, true)); break;
             CASE_x8(0x38): /* SUB Rd, #imm */ set_nz_flags(REG8 = add(REG8, ~(insn & 0xFF), 1, true)); break;
-            CASE_x4(0x40): {
-                uint32_t *dst = &REG0;
-                uint32_t res;
-                uint32_t src = REG3;
-                switch (insn >> 6 & 15) {
-                    default:
-                    case 0x0: /* AND */ res = *dst &= src; break;
-                    case 0x1: /* EOR */ res = *dst ^= src; break;
-                    case 0x2: /* LSL */ res = *dst = shift(0, *dst, src & 0xFF, true); break;
-                    case 0x3: /* LSR */ res = *dst = shift(1, *dst, src & 0xFF, true); break;
-                    case 0x4: /* ASR */ res = *dst = shift(2, *dst, src & 0xFF, true); break;
-                    case 0x5: /* ADC */ res = *dst = add(*dst, src, arm.cpsr_c, true); break;
-                    case 0x6: /* SBC */ res = *dst = add(*dst, ~src, arm.cpsr_c, true); break;
-                    case 0x7: /* ROR */ res = *dst = shift(3, *dst, src & 0xFF, true); break;
-                    case 0x8: /* TST */ res = *dst & src; break;
-                    case 0x9: /* NEG */ res = *dst = add(0, ~src, 1, true); break;
-                    case 0xA: /* CMP */ res = add(*dst, ~src, 1, true); break;
-                    case 0xB: /* CMN */ res = add(*dst, src, 0, true); break;
-                    case 0xC: /* ORR */ res = *dst |= src; break;
-                    case 0xD: /* MUL */ res = *dst *= src; break;
-                    case 0xE: /* BIC */ res = *dst &= ~src; break;
-                    case 0xF: /* MVN */ res = *dst = ~src; break;
-                }
-                set_nz_flags(res);
-                break;
-            }
-            case 0x44: { /* ADD Rd, Rm (high registers allowed) */
+            ALU(0x0, /* AND */ REG0 &= REG3)
+            ALU(0x1, /* EOR */ REG0 ^= REG3)
+            ALU(0x2, /* LSL */ REG0 = shift(0, REG0, REG3 & 0xFF, true))
+            ALU(0x3, /* LSR */ REG0 = shift(1, REG0, REG3 & 0xFF, true))
+            ALU(0x4, /* ASR */ REG0 = shift(2, REG0, REG3 & 0xFF, true))
+            ALU(0x5, /* ADC */ REG0 = add(REG0, REG3, arm.cpsr_c, true))
+            ALU(0x6, /* SBC */ REG0 = add(REG0, ~REG3, arm.cpsr_c, true))
+            ALU(0x7, /* ROR */ REG0 = shift(3, REG0, REG3 & 0xFF, true))
+            ALU(0x8, /* TST */ REG0 & REG3)
+            ALU(0x9, /* NEG */ REG0 = add(0, ~REG3, 1, true))
+            ALU(0xA, /* CMP */ add(REG0, ~REG3, 1, true))
+            ALU(0xB, /* CMN */ add(REG0, REG3, 0, true))
+            ALU(0xC, /* ORR */ REG0 |= REG3)
+            ALU(0xD, /* MUL */ REG0 *= REG3)
+            ALU(0xE, /* BIC */ REG0 &= ~REG3)
+            ALU(0xF, /* MVN */ REG0 = ~REG3)
+            CASE_x1(0x44): { /* ADD Rd, Rm (high registers allowed) */
                 uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
                 set_reg_pc0(left, get_reg_pc_thumb(left) + get_reg_pc_thumb(right));
                 break;
             }
-            case 0x45: { /* CMP Rn, Rm (high registers allowed) */
+            CASE_x1(0x45): { /* CMP Rn, Rm (high registers allowed) */
                 uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
                 set_nz_flags(add(get_reg(left), ~get_reg_pc_thumb(right), 1, true));
                 break;
             }
-            case 0x46: { /* MOV Rd, Rm (high registers allowed) */
+            CASE_x1(0x46): { /* MOV Rd, Rm (high registers allowed) */
                 uint32_t left = (insn >> 4 & 8) | (insn & 7), right = insn >> 3 & 15;
                 set_reg_pc0(left, get_reg_pc_thumb(right));
                 break;
             }
-            case 0x47: { /* BX/BLX Rm (high register allowed) */
+            CASE_x1(0x47): { /* BX/BLX Rm (high register allowed) */
                 uint32_t target = get_reg_pc_thumb(insn >> 3 & 15);
                 if (insn & 0x80)
                     arm.reg[14] = arm.reg[15] + 1;
@@ -192,7 +228,7 @@ enter_debugger:
                 CASE_x8(0x98): /* LDR Rd, [SP, #imm] */ REG8 = read_word(arm.reg[13] + ((insn & 0xFF) << 2)); break;
                 CASE_x8(0xA0): /* ADD Rd, PC, #imm */ REG8 = ((arm.reg[15] + 2) & -4) + ((insn & 0xFF) << 2); break;
                 CASE_x8(0xA8): /* ADD Rd, SP, #imm */ REG8 = arm.reg[13] + ((insn & 0xFF) << 2); break;
-            case 0xB0: /* ADD/SUB SP, #imm */
+            CASE_x1(0xB0): /* ADD/SUB SP, #imm */
                 arm.reg[13] += ((insn & 0x80) ? -(insn & 0x7F) : (insn & 0x7F)) << 2;
                 break;
 
@@ -229,7 +265,7 @@ enter_debugger:
                     arm.reg[13] = addr;
                     break;
                 }
-            case 0xBE:
+            CASE_x1(0xBE):
                 printf("Software breakpoint at %08x (%02x)\n", arm.reg[15], insn & 0xFF);
                 debugger(DBG_EXEC_BREAKPOINT, 0);
                 break;
@@ -263,22 +299,22 @@ enter_debugger:
                     break;
                 }
 #define BRANCH_IF(cond) if (cond) arm.reg[15] += 2 + ((int8_t)insn << 1); break;
-            case 0xD0: /* BEQ */ BRANCH_IF(arm.cpsr_z)
-                    case 0xD1: /* BNE */ BRANCH_IF(!arm.cpsr_z)
-              case 0xD2: /* BCS */ BRANCH_IF(arm.cpsr_c)
-              case 0xD3: /* BCC */ BRANCH_IF(!arm.cpsr_c)
-              case 0xD4: /* BMI */ BRANCH_IF(arm.cpsr_n)
-              case 0xD5: /* BPL */ BRANCH_IF(!arm.cpsr_n)
-              case 0xD6: /* BVS */ BRANCH_IF(arm.cpsr_v)
-              case 0xD7: /* BVC */ BRANCH_IF(!arm.cpsr_v)
-              case 0xD8: /* BHI */ BRANCH_IF(arm.cpsr_c > arm.cpsr_z)
-              case 0xD9: /* BLS */ BRANCH_IF(arm.cpsr_c <= arm.cpsr_z)
-              case 0xDA: /* BGE */ BRANCH_IF(arm.cpsr_n == arm.cpsr_v)
-              case 0xDB: /* BLT */ BRANCH_IF(arm.cpsr_n != arm.cpsr_v)
-              case 0xDC: /* BGT */ BRANCH_IF(!arm.cpsr_z && arm.cpsr_n == arm.cpsr_v)
-              case 0xDD: /* BLE */ BRANCH_IF(arm.cpsr_z || arm.cpsr_n != arm.cpsr_v)
+            CASE_x1(0xD0): /* BEQ */ BRANCH_IF(arm.cpsr_z)
+                    CASE_x1(0xD1): /* BNE */ BRANCH_IF(!arm.cpsr_z)
+              CASE_x1(0xD2): /* BCS */ BRANCH_IF(arm.cpsr_c)
+              CASE_x1(0xD3): /* BCC */ BRANCH_IF(!arm.cpsr_c)
+              CASE_x1(0xD4): /* BMI */ BRANCH_IF(arm.cpsr_n)
+              CASE_x1(0xD5): /* BPL */ BRANCH_IF(!arm.cpsr_n)
+              CASE_x1(0xD6): /* BVS */ BRANCH_IF(arm.cpsr_v)
+              CASE_x1(0xD7): /* BVC */ BRANCH_IF(!arm.cpsr_v)
+              CASE_x1(0xD8): /* BHI */ BRANCH_IF(arm.cpsr_c > arm.cpsr_z)
+              CASE_x1(0xD9): /* BLS */ BRANCH_IF(arm.cpsr_c <= arm.cpsr_z)
+              CASE_x1(0xDA): /* BGE */ BRANCH_IF(arm.cpsr_n == arm.cpsr_v)
+              CASE_x1(0xDB): /* BLT */ BRANCH_IF(arm.cpsr_n != arm.cpsr_v)
+              CASE_x1(0xDC): /* BGT */ BRANCH_IF(!arm.cpsr_z && arm.cpsr_n == arm.cpsr_v)
+              CASE_x1(0xDD): /* BLE */ BRANCH_IF(arm.cpsr_z || arm.cpsr_n != arm.cpsr_v)
 
-              case 0xDF: /* SWI */
+              CASE_x1(0xDF): /* SWI */
                   cpu_exception(EX_SWI);
                 return; /* Exits THUMB mode */
 
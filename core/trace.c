@@ -0,0 +1,36 @@
+#include "emu.h"
+#include "mem.h"
+#include "trace.h"
+#include "translate.h"
+
+bool trace_enabled;
+uintptr_t trace_ring[TRACE_ENTRIES];
+uint32_t trace_pos;
+
+void trace_enable(bool enable)
+{
+    if (enable == trace_enabled)
+        return;
+
+    flush_translations();
+    trace_enabled = enable;
+}
+
+void trace_dump(unsigned int count)
+{
+    if (count > TRACE_ENTRIES)
+        count = TRACE_ENTRIES;
+
+    gui_debug_printf("Last %u instructions and translations entered (physical address):\n", count);
+    for (uint32_t i = trace_pos - count; i != trace_pos; i++) {
+        uintptr_t entry = trace_ring[i & (TRACE_ENTRIES - 1)];
+        if (!entry)
+            continue; // Not written yet
+
+        void *ptr = (void *)(entry & ~(uintptr_t)1);
+        if (entry & 1)
+            gui_debug_printf("%08x: %04x (Thumb)\n", phys_mem_addr(ptr), *(uint16_t *)ptr);
+        else
+            gui_debug_printf("%08x: %08x\n", phys_mem_addr(ptr), *(uint32_t *)ptr);
+    }
+}
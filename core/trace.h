@@ -0,0 +1,38 @@
+/* Declarations for trace.c */
+
+#ifndef _H_TRACE
+#define _H_TRACE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* While tracing, the interpreters record every instruction they run and the
+   x86_64 translations every time they get entered, in a ring of the last
+   TRACE_ENTRIES. An entry is the host pointer of the instruction, with bit 0
+   set for Thumb, so that recording is a single store. */
+#define TRACE_ENTRIES 0x10000
+
+extern bool trace_enabled;
+extern uintptr_t trace_ring[TRACE_ENTRIES];
+extern uint32_t trace_pos; // The next entry to overwrite
+
+static inline void trace_record(const void *insnp, bool thumb)
+{
+    trace_ring[trace_pos] = (uintptr_t)insnp | thumb;
+    trace_pos = (trace_pos + 1) & (TRACE_ENTRIES - 1);
+}
+
+// Flushes the translations if it changes, as they only record while enabled
+void trace_enable(bool enable);
+// Prints the last count entries, the oldest first
+void trace_dump(unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -21,10 +21,146 @@ extern struct translation translation_table[] __asm__("translation_table");
 
 bool translate_init();
 void translate_deinit();
+/* Keeps translations in the file at path across runs, returns false if that
+   is not possible or not supported by the translator */
+bool translate_store_open(const char *path);
+void translate_store_close();
+/* For snapshots: writes the PCs the translations start at, with bit 0 set
+   for Thumb, oldest first, into pcs up to max of them. Returns how many there
+   are, 0 if the translator doesn't keep track of the PCs. */
+unsigned int translate_list(uint32_t *pcs, unsigned int max);
 void translate(uint32_t start_pc, uint32_t *insnp);
+// Returns false if nothing could be translated
+bool translate_thumb(uint32_t start_pc, uint16_t *insnp);
 void flush_translations();
+/* The mapping of the virtual addresses from start to last (inclusive) may
+   have changed: drops the translations of code there which isn't mapped to
+   the same physical address anymore, and whatever depends on the old
+   mapping otherwise */
+void flush_remapped_translations(uint32_t start, uint32_t last);
+/* The access permissions changed, but not the mapping: drops what would
+   skip the permission checks done by addr_cache */
+void flush_translation_shortcuts();
 void invalidate_translation(int index);
+/* Drops only the translation with the instruction at ptr in it, if there is
+   one, for the debugger setting a breakpoint there or writing to it. Unlike
+   invalidate_translation, which expects more writes to follow, the others in
+   the page stay. */
+void invalidate_translation_at(void *ptr);
+/* With protect_translated_code, translators may leave out the RAM_FLAGS
+   checks of stores and write protect the host pages with translated code
+   instead. Returns true if addr is in such a page, which got writable again
+   and has no translations in it anymore. Called by the fault handler. */
+bool translate_write_fault(void *addr);
 void translate_fix_pc();
+// Hint for the translation cache that the translation got entered
+void translation_touch(unsigned int index);
+
+/* Encoding classes of untranslatable instructions, for the breakdown of
+   translate_stats.no_translate. Only the x86_64 translator sorts them. */
+enum translate_unimpl {
+    UNIMPL_THUMB, // Thumb instructions without an ARM equivalent here
+    UNIMPL_COND, // Condition NV, or too much code to skip
+    UNIMPL_MULTIPLY,
+    UNIMPL_HALFWORD, // Halfword and doubleword transfers, SWP
+    UNIMPL_MISC, // BX, MRS, MSR and CLZ
+    UNIMPL_DATA_PROC,
+    UNIMPL_LOAD_STORE, // Byte and word transfers
+    UNIMPL_LDM_STM,
+    UNIMPL_OTHER, // Coprocessor, SWI and undefined
+    UNIMPL_CLASSES
+};
+
+// What the translator has been doing, shown by the "jit" debugger command
+struct translate_stats {
+    uint64_t translations; // Blocks translated, or loaded from the store
+    uint64_t dropped; // Translations invalidated, evicted or flushed
+    uint64_t code_bytes; // Translated code currently in the buffer
+    uint64_t fallbacks; // Attempts to translate which didn't produce anything
+    uint64_t no_translate; // Instructions marked RF_CODE_NO_TRANSLATE
+    uint64_t unimpl[UNIMPL_CLASSES]; // The same by encoding class
+    uint64_t fix_pc; // translate_fix_pc calls while in a translation
+    uint64_t translate_ns; // Host time spent in translate and translate_thumb
+    uint64_t background; // Of the translations and fallbacks, the ones done by the compiler thread
+    uint64_t discarded; // Background translations which got outdated before they were installed
+    uint64_t jit_instructions, interpreted_instructions;
+    uint64_t validated, mismatches; // Blocks compared with the interpreter, see translation_run
+    uint64_t validate_skipped; // Blocks which the interpreter couldn't replay
+};
+extern struct translate_stats translate_stats;
+
+/* Tiered execution: code gets interpreted until the instruction ran
+   translate_threshold times, so that code which runs only once (like most of
+   the boot) doesn't get translated. 0 translates right away.
+   The counters are in a small table indexed by the address, collisions only
+   make code get translated a bit earlier. */
+#define TRANSLATE_THRESHOLD_MAX 0xFFFF
+extern unsigned int translate_threshold;
+extern uint16_t translate_counters[0x10000];
+
+static inline bool translation_hot(const void *insnp)
+{
+    if (!translate_threshold)
+        return true;
+
+    uint16_t *counter = &translate_counters[(uintptr_t)insnp >> 1 & 0xFFFF];
+    if (*counter >= translate_threshold)
+        return true;
+
+    ++*counter;
+    return false;
+}
+
+/* Background translation: with translate_background, the CPU loops hand hot
+   blocks to translate_queue, which copies the code and its RAM_FLAGS for a
+   compiler thread, and go on interpreting them. translate_install, called
+   between the timeslices, puts the finished translations into place like
+   ones from the translation store, unless the code, its RAM_FLAGS or its
+   mapping changed in the meantime or the translations got flushed.
+   Only the x86_64 translator has it. */
+#if !defined(NO_TRANSLATION) && defined(__x86_64__)
+    #define TRANSLATE_BACKGROUND
+#endif
+extern bool translate_background;
+/* Returns false if the block has to be translated right away instead, like
+   when tracing. If the queue is full, the block gets tried again the next
+   time it runs. */
+bool translate_queue(uint32_t start_pc, void *start_insnp, bool thumb);
+void translate_install();
+
+// Whether the block at insnp got queued for the compiler thread instead of translating it
+static inline bool translation_queued(uint32_t pc, void *insnp, bool thumb)
+{
+#ifdef TRANSLATE_BACKGROUND
+    return translate_background && translate_queue(pc, insnp, thumb);
+#else
+    (void) pc; (void) insnp; (void) thumb;
+    return false;
+#endif
+}
+
+/* Lockstep validation of the translators: with translate_validate_interval
+   N, every Nth entry into a translation replays the block in the interpreter
+   first, undoes its stores and then runs the translation for the block only.
+   The registers, the flags and the stored bytes have to match the state of
+   the interpreter at the instruction the translation exited at, or the
+   differences go to the debug output with the instructions, followed by a
+   warning. The translation's results are kept either way.
+   The replay gets skipped for blocks which access MMIO, store to translated
+   code or raise an exception, as the interpreter would do that a second
+   time then. The replay relies on asmcode.c, which isn't used with
+   asmcode_x86.S, and on setjmp. */
+#if !defined(NO_TRANSLATION) && !defined(NO_SETJMP) && !defined(__i386__)
+    #define TRANSLATE_VALIDATE
+#endif
+extern unsigned int translate_validate_interval;
+// Enters the translation at arm.reg[15], which has to exist
+void translation_run();
+// For asmcode.c: set while the interpreter replays a block
+extern bool translation_replaying;
+void translation_replay_store(uint32_t addr, void *ptr, uint32_t value, unsigned int size);
+// Stops the replay before an access which is not safe to do twice
+__attribute__((noreturn)) void translation_replay_bail();
 
 #ifdef __cplusplus
 }
@@ -4,7 +4,9 @@
  * x0: First parameter and return value of helper functions in asmcode_aarch64.S
  * x1: Second parameter to helper functions in asmcode_aarch64.S
  * w2-w16: arm.reg[0] - arm.reg[14]
- * x17: Used as a scratch register for keeping a copy of the virtual cpsr_nzcv
+ * x17: Copy of the virtual cpsr_nzcv while in asmcode_aarch64.S. The guest flags
+ *      stay in the host NZCV across blocks and memory accesses, they only get
+ *      converted when leaving the translation or calling into C code.
  * (x18: Platform specific, can't use this)
  * x19: Pointer to the arm_state struct
  * x21-x24: Used as temporary registers by various subroutines
@@ -71,8 +73,13 @@ uint32_t *translate_buffer = nullptr,
          *translate_current = nullptr;
 
 #include "literalpool.h"
+#include "translation_cache.h"
+#include "translation_perfmap.h"
 
 #define MAX_TRANSLATIONS 0x40000
+// Worst case space a single block may need, in instructions and jump table entries
+#define BLOCK_CODE_MAX 0x4000
+#define BLOCK_JTBL_MAX (0x400 / 4 + 1)
 struct translation translation_table[MAX_TRANSLATIONS];
 uint32_t *jump_table[MAX_TRANSLATIONS*2],
          **jump_table_current = jump_table;
@@ -123,6 +130,24 @@ static void emit_mov_reg(const PReg wd, const PReg wm)
 	emit(0x2a0003e0 | (wm << 16) | wd);
 }
 
+/* Sets N and Z with tst (an ANDS to wzr or xzr), but keeps C and V. ARM's logical
+   operations without shifter carry and multiplies leave those alone. Destroys x23 and x24. */
+static void emit_set_nz(const uint32_t tst)
+{
+	emit(0xd53b4217); // mrs x23, nzcv
+	emit(tst);
+	emit(0xd53b4218); // mrs x24, nzcv
+	emit(0x531e7f18); // lsr w24, w24, #30
+	emit(0x33020717); // bfi w23, w24, #30, #2
+	emit(0xd51b4217); // msr nzcv, x23
+}
+
+// tst wn, wn
+static uint32_t tst_reg(const PReg wn)
+{
+	return 0x6a00001f | (wn << 16) | (wn << 5);
+}
+
 void literalpool_fill()
 {
 	for(unsigned int i = 0; i < literals_count; ++i)
@@ -195,6 +220,7 @@ bool translate_init()
 	translate_current = translate_buffer = reinterpret_cast<uint32_t*>(os_alloc_executable(INSN_BUFFER_SIZE));
 	jump_table_current = jump_table;
 	next_translation_index = 0;
+	tcache_init(MAX_TRANSLATIONS, INSN_BUFFER_SIZE/sizeof(*translate_buffer), MAX_TRANSLATIONS*2);
 
 	return translate_buffer != nullptr;
 }
@@ -208,13 +234,33 @@ void translate_deinit()
 	translate_current = translate_buffer = nullptr;
 }
 
+bool translate_store_open(const char *)
+{
+	return false;
+}
+
+void translate_store_close()
+{
+}
+
+unsigned int translate_list(uint32_t *, unsigned int)
+{
+	return 0;
+}
+
+void translation_touch(unsigned int index)
+{
+	tcache.regions[index / tcache.slots].referenced = true;
+}
+
 void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 {
-	if(next_translation_index >= MAX_TRANSLATIONS)
-	{
-		warn("Out of translation slots!");
-		return;
-	}
+	tcache_reserve(BLOCK_CODE_MAX, BLOCK_JTBL_MAX);
+	next_translation_index = tcache_next_index();
+	translate_current = translate_buffer + tcache_code_offset();
+	jump_table_current = jump_table + tcache_jtbl_offset();
+	// Leave space for the literal pool
+	uint32_t *translate_end = translate_buffer + tcache_code_end() - MAX_LITERALS * 2;
 
 	uint32_t **jump_table_start = jump_table_current;
 	uint32_t pc = pc_start, *insn_ptr = insn_ptr_start;
@@ -238,7 +284,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	{
 		// Translate further?
 		if(stop_here
-		   || size_t((translate_current + 16) - translate_buffer) > (INSN_BUFFER_SIZE/sizeof(*translate_buffer))
+		   || translate_current + 16 > translate_end
 		   || RAM_FLAGS(insn_ptr) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)
 		   || (pc ^ pc_start) & ~0x3ff)
 			goto exit_translation;
@@ -275,9 +321,6 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 				   || i.mult.rn == PC || i.mult.rd == PC)
 					goto unimpl; // PC as register not implemented
 
-				if(i.mult.s)
-					goto unimpl; // setcc not implemented (not easily possible as no aarch64 instruction only changes n and z)
-
 				if ((i.raw & 0xFC000F0) == 0x0000090)
 				{
 					uint32_t instruction = 0x1B000000; // madd w0, w0, w0, w0
@@ -289,10 +332,37 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 						instruction |= WZR << 10;
 
 					emit(instruction);
+					if(i.mult.s)
+						emit_set_nz(tst_reg(mapreg(i.mult.rd)));
+					goto instruction_translated;
+				}
+
+				if ((i.raw & 0xF8000F0) == 0x0800090)
+				{
+					// UMULL, UMLAL, SMULL, SMLAL
+					if(i.mult.rdhi == i.mult.rdlo)
+						goto unimpl;
+
+					uint32_t instruction = (i.raw & 0x0400000) ? 0x9B200015 : 0x9BA00015; // smaddl/umaddl x21, w0, w0, x0
+					instruction |= (mapreg(i.mult.rs) << 16) | (mapreg(i.mult.rm) << 5);
+					if(i.mult.a)
+					{
+						emit(0x2a0003f6 | (mapreg(i.mult.rdlo) << 16)); // mov w22, wLo
+						emit(0xb3607c16 | (mapreg(i.mult.rdhi) << 5)); // bfi x22, xHi, #32, #32
+						instruction |= 22 << 10;
+					}
+					else
+						instruction |= WZR << 10;
+
+					emit(instruction);
+					emit(0x2a1503e0 | mapreg(i.mult.rdlo)); // mov wLo, w21
+					emit(0xd360fea0 | mapreg(i.mult.rdhi)); // lsr xHi, x21, #32
+					if(i.mult.s)
+						emit_set_nz(0xea1502bf); // tst x21, x21
 					goto instruction_translated;
 				}
 
-				goto unimpl; // UMULL, UMLAL, SMULL, SMLAL not implemented
+				goto unimpl;
 			}
 
 			if(i.mem_proc2.s || !i.mem_proc2.h)
@@ -374,17 +444,19 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 			if(!i.data_proc.imm && i.data_proc.reg_shift) // reg shift
 				goto unimpl;
 
-			if(i.data_proc.s
-			   && !(i.data_proc.op == OP_ADD || i.data_proc.op == OP_SUB || i.data_proc.op == OP_CMP || i.data_proc.op == OP_CMN
-				#ifndef SUPPORT_LINUX
-					|| i.data_proc.op == OP_TST
-				#endif
-			   ))
+			/* The arithmetic ops set the flags just like on ARM. The logical ones only
+			   set N and Z (see emit_set_nz), so the S-bit can only be translated if the
+			   barrel shifter doesn't produce a carry. */
+			bool arith_flags = i.data_proc.op == OP_ADD || i.data_proc.op == OP_SUB || i.data_proc.op == OP_CMP || i.data_proc.op == OP_CMN
+			                   || i.data_proc.op == OP_ADC || i.data_proc.op == OP_SBC;
+			if(i.data_proc.s && !arith_flags)
 			{
-				/* We can't translate the S-bit that easily,
-				   as the barrel shifter output does not influence
-				   the carry flag anymore. */
-				goto unimpl;
+				bool logical = i.data_proc.op == OP_AND || i.data_proc.op == OP_EOR || i.data_proc.op == OP_TST || i.data_proc.op == OP_TEQ
+				               || i.data_proc.op == OP_ORR || i.data_proc.op == OP_MOV || i.data_proc.op == OP_BIC || i.data_proc.op == OP_MVN;
+				bool shifter_carry = i.data_proc.imm ? i.data_proc.rotate_imm != 0
+				                                     : (i.data_proc.shift != SH_LSL || i.data_proc.shift_imm != 0);
+				if(!logical || shifter_carry)
+					goto unimpl;
 			}
 
 			if(i.data_proc.op == OP_RSB)
@@ -402,7 +474,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 					goto unimpl;
 			}
 
-			if(i.data_proc.op == OP_RSC || i.data_proc.op == OP_TEQ)
+			if(i.data_proc.op == OP_RSC)
 				goto unimpl;
 
 			if(i.data_proc.shift == SH_ROR && !i.data_proc.imm && (i.data_proc.op == OP_SUB || i.data_proc.op == OP_ADD || i.data_proc.shift_imm == 0))
@@ -435,12 +507,8 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 				0x1A000000, // ADC (no shift!)
 				0x5A000000, // SBC (no shift!)
 				0, // RSC not possible
-				#ifdef SUPPORT_LINUX
-					0, // TST not possible, carry and overflow flags not identical
-				#else
-					0x6A00001F, // TST
-				#endif
-				0, // TEQ not possible
+				0x0A000019, // TST (AND into w25)
+				0x4A000019, // TEQ (EOR into w25)
 				0x6B00001F, // CMP
 				0x2B00001F, // CMN
 				0x2A000000, // ORR
@@ -451,9 +519,12 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 
 			uint32_t instruction = opmap[i.data_proc.op];
 
-			if(i.data_proc.s)
+			if(i.data_proc.s && arith_flags)
 				instruction |= 1 << 29;
 
+			// The result of TST and TEQ (w25) or rd, for setting N and Z afterwards
+			const PReg result = (i.data_proc.op == OP_TST || i.data_proc.op == OP_TEQ) ? W25 : mapreg(i.data_proc.rd);
+
 			if(i.data_proc.op < OP_TST || i.data_proc.op > OP_CMP)
 				instruction |= mapreg(i.data_proc.rd);
 
@@ -487,6 +558,8 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 				if(i.data_proc.op == OP_MOV)
 				{
 					emit_mov_imm(mapreg(i.data_proc.rd), immed);
+					if(i.data_proc.s)
+						emit_set_nz(tst_reg(result));
 					goto instruction_translated;
 				}
 
@@ -511,6 +584,8 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 			}
 
 			emit(instruction);
+			if(i.data_proc.s && !arith_flags)
+				emit_set_nz(tst_reg(result));
 		}
 		else if((i.raw & 0xFF000F0) == 0x7F000F0)
 			goto unimpl; // undefined
@@ -708,7 +783,8 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 			uintptr_t entry = reinterpret_cast<uintptr_t>(addr_cache[(addr >> 10) << 1]);
 			uint32_t *ptr = reinterpret_cast<uint32_t*>(entry + addr);
 
-			if(entry & AC_FLAGS || !(RAM_FLAGS(ptr) & RF_CODE_TRANSLATED))
+			if(entry & AC_FLAGS || !(RAM_FLAGS(ptr) & RF_CODE_TRANSLATED)
+			   || !tcache_same_region(RAM_FLAGS(ptr) >> RFS_TRANSLATION_INDEX))
 			{
 				emit_mov_imm(W0, addr);
 				emit_jmp(reinterpret_cast<void*>(translation_next));
@@ -748,7 +824,9 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	unimpl:
 	// Throw away partial translation
 	translate_current = *jump_table_current;
+	literalpool_rollback(translate_current);
 	RAM_FLAGS(insn_ptr) |= RF_CODE_NO_TRANSLATE;
+	translate_stats.no_translate++;
 
 	exit_translation:
 
@@ -773,7 +851,8 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	this_translation->end_ptr = insn_ptr;
 	this_translation->unused = reinterpret_cast<uintptr_t>(translate_current);
 
-	next_translation_index += 1;
+	tcache_commit(translate_current - translate_buffer, jump_table_current - jump_table);
+	tperf_add(jump_table_start[0], (translate_current - jump_table_start[0]) * 4, pc_start, false);
 
 	// Flush the instruction cache
 	#ifdef IS_IOS_BUILD
@@ -783,7 +862,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 	#endif
 }
 
-static void _invalidate_translation(int index)
+static __attribute__((unused)) void _invalidate_translation(int index)
 {
 	/* Disabled for now. write_action not called in asmcode_aarch64.S so this can't happen
 	   and translation_pc_ptr is inaccurate due to translation_jmp anyway.
@@ -793,20 +872,36 @@ static void _invalidate_translation(int index)
 		error("Cannot modify currently executing code block.");
 	*/
 
-	uint32_t *start = translation_table[index].start_ptr;
-	uint32_t *end   = translation_table[index].end_ptr;
-	for (; start < end; start++)
-		RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
+	tcache_invalidate(index);
+}
+
+// Thumb code is not translated by this backend
+bool translate_thumb(uint32_t, uint16_t *)
+{
+	return false;
 }
 
 void flush_translations()
 {
-	for(unsigned int index = 0; index < next_translation_index; index++)
-		_invalidate_translation(index);
+	tcache_flush();
+}
 
-	next_translation_index = 0;
-	translate_current = translate_buffer;
-	jump_table_current = jump_table;
+// translation_jmp uses absolute pointers in the JIT, which depend on the mapping
+void flush_remapped_translations(uint32_t, uint32_t)
+{
+	flush_translations();
+}
+
+void flush_translation_shortcuts()
+{
+	flush_translations();
+}
+
+// Stores always check RAM_FLAGS here
+bool translate_write_fault(void *addr)
+{
+	(void) addr;
+	return false;
 }
 
 void invalidate_translation(int index)
@@ -821,11 +916,20 @@ void invalidate_translation(int index)
 	#endif
 }
 
+void invalidate_translation_at(void *ptr)
+{
+	uint32_t flags = RAM_FLAGS((uintptr_t)ptr & ~3);
+	if (flags & RF_CODE_TRANSLATED)
+		invalidate_translation(flags >> RFS_TRANSLATION_INDEX);
+}
+
 void translate_fix_pc()
 {
 	if (!translation_sp)
 		return;
 
+	translate_stats.fix_pc++;
+
 	uint32_t *insnp = reinterpret_cast<uint32_t*>(try_ptr(arm.reg[15]));
 	uint32_t flags = 0;
 	if(!insnp || !((flags = RAM_FLAGS(insnp)) & RF_CODE_TRANSLATED))
@@ -840,8 +944,7 @@ void translate_fix_pc()
 	unsigned int jump_index = insnp - translation_table[index].start_ptr;
 	unsigned int translation_insts = translation_table[index].end_ptr - translation_table[index].start_ptr;
 
-	for(unsigned int i = jump_index; ret_pc > translation_table[index].jump_table[i] && i < translation_insts; ++i)
-		arm.reg[15] += 4;
+	arm.reg[15] += (tcache_insn_after(translation_table[index].jump_table, jump_index, translation_insts, ret_pc) - jump_index) * 4;
 
 	cycle_count_delta -= translation_table[index].end_ptr - insnp;
 	translation_sp = nullptr;
@@ -16,6 +16,7 @@
 
 #ifdef IS_IOS_BUILD
 #include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 // Uncomment the following line to support relative jumps if possible,
@@ -29,6 +30,8 @@
 #include "mem.h"
 #include "mmu.h"
 #include "translate.h"
+#include "translation_cache.h"
+#include "translation_perfmap.h"
 #include "os/os.h"
 
 #ifdef __thumb__
@@ -46,6 +49,9 @@ extern void **translation_sp __asm__("translation_sp");
 }
 
 #define MAX_TRANSLATIONS 0x40000
+// Worst case space a single block may need, in instructions and jump table entries
+#define BLOCK_CODE_MAX 0x4000
+#define BLOCK_JTBL_MAX (0x400 / 4 + 1)
 struct translation translation_table[MAX_TRANSLATIONS];
 uint32_t *jump_table[MAX_TRANSLATIONS*2],
          **jump_table_current = jump_table;
@@ -66,6 +72,46 @@ static inline void emit_al(uint32_t instruction)
     emit(instruction | (CC_AL << 28));
 }
 
+#include "literalpool.h"
+
+/* LDR can only reach 4KB, so the pool is emitted in the middle of the block
+   when the oldest reference gets this far away (in instructions). A single
+   instruction may take 0x200 more, see translate. */
+#define LITERALPOOL_DISTANCE_MAX 0x100
+
+void literalpool_fill()
+{
+    for(unsigned int i = 0; i < literals_count; ++i)
+    {
+        auto &&literal = literals[i];
+        if(!literal.inst)
+            continue;
+
+        // Emit the literal
+        uint32_t *literal_loc = translate_current;
+        emit(static_cast<uint32_t>(literal.value));
+
+        // Fixup all literal references for the same value
+        for(unsigned int j = i; j < literals_count; ++j)
+        {
+            auto &&literal_ref = literals[j];
+            if(!literal_ref.inst || literal_ref.value != literal.value)
+                continue;
+
+            // In bytes, relative to the PC, which reads as address + 8
+            ptrdiff_t diff = (literal_loc - reinterpret_cast<uint32_t*>(literal_ref.inst) - 2) * 4;
+            if(diff < -0xFFF || diff > 0xFFF)
+                error("Literal unreachable");
+
+            // Set the offset and the U-bit if it's positive
+            *reinterpret_cast<uint32_t*>(literal_ref.inst) |= diff >= 0 ? (1 << 23) | diff : -diff;
+            literal_ref.inst = nullptr;
+        }
+    }
+
+    literals_count = 0;
+}
+
 // Loads arm.reg[rs] into rd.
 static void emit_ldr_armreg(const unsigned int rd, const unsigned int r_virt)
 {
@@ -111,10 +157,8 @@ static void emit_mov(int rd, uint32_t imm)
             emit_al(0x3a00000 | (rd << 12) | imm); // mov rd, #imm
         else
         {
-            // Insert immediate into code and jump over it
-            emit_al(0x59f0000 | (rd << 12)); // ldr rd, [pc]
-            emit_al(0xa000000); // b pc
-            emit(imm);
+            literalpool_add(imm);
+            emit_al(0x51f0000 | (rd << 12)); // ldr rd, [pc, #<offset>]
         }
     #endif
 }
@@ -368,8 +412,8 @@ static void emit_jmp(void *target, bool save = true)
         return emit_al(branch);
 
     // Doesn't fit into branch, use memory
-    emit_al(0x51ff004); // ldr pc, [pc, #-4]
-    emit(reinterpret_cast<uintptr_t>(target));
+    literalpool_add(reinterpret_cast<uintptr_t>(target));
+    emit_al(0x51ff000); // ldr pc, [pc, #<offset>]
 }
 
 // Registers r0-r3 and r12 are not preserved!
@@ -385,10 +429,9 @@ static void emit_call(void *target, bool save = true)
     if(branch)
         return emit_al(branch | (1 << 24)); // Set the L-bit
 
-    // This is cheaper than doing it like emit_mov above.
-    emit_al(0x28fe004); // add lr, pc, #4
-    emit_al(0x51ff004); // ldr pc, [pc, #-4]
-    emit(reinterpret_cast<uintptr_t>(target));
+    emit_al(0x28fe000); // add lr, pc, #0
+    literalpool_add(reinterpret_cast<uintptr_t>(target));
+    emit_al(0x51ff000); // ldr pc, [pc, #<offset>]
 }
 
 bool translate_init()
@@ -408,6 +451,7 @@ bool translate_init()
     translate_end = translate_current + INSN_BUFFER_SIZE/sizeof(*translate_buffer);
     jump_table_current = jump_table;
     next_translation_index = 0;
+    tcache_init(MAX_TRANSLATIONS, INSN_BUFFER_SIZE/sizeof(*translate_buffer), MAX_TRANSLATIONS*2);
 
     if(!translate_buffer)
         return false;
@@ -457,6 +501,32 @@ void translate_deinit()
     translate_end = translate_current = translate_buffer = nullptr;
 }
 
+bool translate_store_open(const char *)
+{
+    return false;
+}
+
+void translate_store_close()
+{
+}
+
+unsigned int translate_list(uint32_t *, unsigned int)
+{
+    return 0;
+}
+
+#ifdef IS_IOS_BUILD
+// Changes the protection of the pages containing the code between start and end
+static void protect_code(uint32_t *start, uint32_t *end, int prot)
+{
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t first = reinterpret_cast<uintptr_t>(start) & ~(page_size - 1),
+              last = (reinterpret_cast<uintptr_t>(end) + page_size - 1) & ~(page_size - 1);
+    if(mprotect(reinterpret_cast<void*>(first), last - first, prot) != 0)
+        error("Could not change protection of translated code");
+}
+#endif
+
 static __attribute__((unused)) void dump_translation(int index)
 {
     auto &translation = translation_table[index];
@@ -480,17 +550,26 @@ static __attribute__((unused)) void dump_translation(int index)
     }
 }
 
+void translation_touch(unsigned int index)
+{
+    tcache.regions[index / tcache.slots].referenced = true;
+}
+
 void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 {
-    if(next_translation_index >= MAX_TRANSLATIONS)
-    {
-        warn("Out of translation slots!");
-        return;
-    }
+    tcache_reserve(BLOCK_CODE_MAX, BLOCK_JTBL_MAX);
+    next_translation_index = tcache_next_index();
+    translate_current = translate_buffer + tcache_code_offset();
+    // Leave space for the literal pool. Not more than BLOCK_CODE_MAX is
+    // written, which keeps the number of pages to make writable small.
+    uint32_t *block_end = std::min(translate_buffer + tcache_code_end(), translate_current + BLOCK_CODE_MAX);
+    translate_end = block_end - MAX_LITERALS;
+    jump_table_current = jump_table + tcache_jtbl_offset();
 
     #ifdef IS_IOS_BUILD
-        // Mark translate_buffer as RW_
-        mprotect(translate_buffer, INSN_BUFFER_SIZE, PROT_READ | PROT_WRITE);
+        // Mark the pages of this block as RW_
+        uint32_t *block_start = translate_current;
+        protect_code(block_start, block_end, PROT_READ | PROT_WRITE);
     #endif
 
     uint32_t **jump_table_start = jump_table_current;
@@ -522,7 +601,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
     {
         // Translate further?
         if(stop_here
-            || translate_current + 0x200 > translate_end
+            || translate_current + 0x200 + literals_count > translate_end // The pool may come first
             || RAM_FLAGS(insn_ptr) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)
             || (pc ^ pc_start) & ~0x3ff)
             goto exit_translation;
@@ -547,6 +626,15 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
             flush_flags();
         }
 
+        if(literals_count && translate_current - reinterpret_cast<uint32_t*>(literals[0].inst) >= LITERALPOOL_DISTANCE_MAX)
+        {
+            // Emit the pool here and jump over it
+            uint32_t *branch = translate_current;
+            emit_al(0xa000000); // b <after pool>
+            literalpool_fill();
+            *branch |= (translate_current - branch - 2) & 0xFFFFFF;
+        }
+
         // Rollback translate_current to this val if instruction not supported
         *jump_table_current = translate_buffer_inst_start = translate_current;
 
@@ -1003,7 +1091,8 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
                 emit_mov(R0, addr);
                 emit_jmp(reinterpret_cast<void*>(translation_next));
             }
-            else if (!(RAM_FLAGS(ptr) & RF_CODE_TRANSLATED))
+            else if (!(RAM_FLAGS(ptr) & RF_CODE_TRANSLATED)
+                     || !tcache_same_region(RAM_FLAGS(ptr) >> RFS_TRANSLATION_INDEX))
             {
                 emit_mov(R0, addr);
                 emit_str_armreg(R0, PC);
@@ -1051,7 +1140,9 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
     unimpl:
     // There may be a partial translation in memory, scrap it.
     translate_current = translate_buffer_inst_start;
+    literalpool_rollback(translate_current);
     RAM_FLAGS(insn_ptr) |= RF_CODE_NO_TRANSLATE;
+    translate_stats.no_translate++;
 
     exit_translation:
 
@@ -1064,10 +1155,12 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
         emit_jmp(reinterpret_cast<void*>(translation_next), false);
     }
 
+    literalpool_fill();
+
     #ifdef IS_IOS_BUILD
-        // Mark translate_buffer as R_X
-        // Even if no translation was done, pages got marked RW_
-        mprotect(translate_buffer, INSN_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+        // Mark the pages as R_X again
+        // Even if no translation was done, they got marked RW_
+        protect_code(block_start, block_end, PROT_READ | PROT_EXEC);
     #endif
     
     // Did we do any translation at all?
@@ -1083,8 +1176,8 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 
     //dump_translation(next_translation_index);
 
-    // This effectively flushes this_translation, as it won't get used next time
-    next_translation_index += 1;
+    tcache_commit(translate_current - translate_buffer, jump_table_current - jump_table);
+    tperf_add(jump_table_start[0], (translate_current - jump_table_start[0]) * 4, pc_start, false);
 
     // Flush the instruction cache
 #ifdef IS_IOS_BUILD
@@ -1094,7 +1187,7 @@ void translate(uint32_t pc_start, uint32_t *insn_ptr_start)
 #endif
 }
 
-static void _invalidate_translation(int index)
+static __attribute__((unused)) void _invalidate_translation(int index)
 {
     /* Disabled for now. write_action not called in asmcode_arm.S so this can't happen
        and translation_pc_ptr is inaccurate due to translation_jmp anyway.
@@ -1104,20 +1197,36 @@ static void _invalidate_translation(int index)
         error("Cannot modify currently executing code block.");
     */
 
-    uint32_t *start = translation_table[index].start_ptr;
-    uint32_t *end   = translation_table[index].end_ptr;
-    for (; start < end; start++)
-        RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
+    tcache_invalidate(index);
+}
+
+// Thumb code is not translated by this backend
+bool translate_thumb(uint32_t, uint16_t *)
+{
+    return false;
 }
 
 void flush_translations()
 {
-    for(unsigned int index = 0; index < next_translation_index; index++)
-        _invalidate_translation(index);
+    tcache_flush();
+}
 
-    next_translation_index = 0;
-    translate_current = translate_buffer;
-    jump_table_current = jump_table;
+// translation_jmp uses absolute pointers in the JIT, which depend on the mapping
+void flush_remapped_translations(uint32_t, uint32_t)
+{
+    flush_translations();
+}
+
+void flush_translation_shortcuts()
+{
+    flush_translations();
+}
+
+// Stores always check RAM_FLAGS here
+bool translate_write_fault(void *addr)
+{
+    (void) addr;
+    return false;
 }
 
 void invalidate_translation(int index)
@@ -1131,11 +1240,20 @@ void invalidate_translation(int index)
     #endif
 }
 
+void invalidate_translation_at(void *ptr)
+{
+    uint32_t flags = RAM_FLAGS((uintptr_t)ptr & ~3);
+    if (flags & RF_CODE_TRANSLATED)
+        invalidate_translation(flags >> RFS_TRANSLATION_INDEX);
+}
+
 void translate_fix_pc()
 {
     if (!translation_sp)
         return;
 
+    translate_stats.fix_pc++;
+
     // This is normally done when leaving the translation,
     // but since we are here, this didn't happen (longjmp)
     set_cpsr_flags(arm.cpsr_flags);
@@ -1154,8 +1272,7 @@ void translate_fix_pc()
     unsigned int jump_index = insnp - translation_table[index].start_ptr;
     unsigned int translation_insts = translation_table[index].end_ptr - translation_table[index].start_ptr;
 
-    for(unsigned int i = jump_index; ret_pc > translation_table[index].jump_table[i] && i < translation_insts; ++i)
-        arm.reg[15] += 4;
+    arm.reg[15] += (tcache_insn_after(translation_table[index].jump_table, jump_index, translation_insts, ret_pc) - jump_index) * 4;
 
     cycle_count_delta -= translation_table[index].end_ptr - insnp;
     translation_sp = nullptr;
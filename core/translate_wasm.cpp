@@ -0,0 +1,1426 @@
+/* How the WebAssembly translation works:
+ * There's no way to write to code in the browser, so every block of ARM code
+ * becomes a small WebAssembly module of its own, which the browser compiles
+ * and instantiates. Its function gets added to the function table, from where
+ * translation_enter calls it like any other function pointer.
+ *
+ * The modules import the memory and the function table of firebird, so they
+ * work on arm, cycle_count_delta, RAM_FLAGS and addr_cache directly. Memory
+ * accesses look addr_cache up inline and only call read_word and the others
+ * (through the table) for MMIO, misses and pages which need a write_action.
+ *
+ * The function gets the index of the instruction to start at. The code of
+ * each instruction follows the end of a block, a br_table at the start jumps
+ * out of the right one, which is what the jump tables of the native
+ * translators are used for. The whole thing is in a loop, so that branches
+ * back into the block don't need to return as long as no event is pending.
+ *
+ * The local "done" is the index of the first instruction not added to
+ * cycle_count_delta yet. It gets updated before calling anything that might
+ * look at the cycles and when leaving the block. arm.reg[15] is set to the
+ * address of the instruction + 4 before calling helpers, like in the
+ * interpreter, so there's nothing to do for translate_fix_pc.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include <emscripten.h>
+
+#include "asmcode.h"
+#include "cpu.h"
+#include "cpudefs.h"
+#include "emu.h"
+#include "mem.h"
+#include "mmu.h"
+#include "translate.h"
+#include "translation_cache.h"
+
+#ifndef __EMSCRIPTEN__
+#error "The WebAssembly translator is for the browser build only."
+#endif
+
+#define MAX_TRANSLATIONS 0x8000
+struct translation translation_table[MAX_TRANSLATIONS];
+
+// Sizes of code are counted in bytes of the modules
+#define CODE_BUFFER_SIZE 0x2000000
+// Worst case space a single block may need
+#define BLOCK_CODE_MAX 0x10000
+/* Worst case space a single instruction may need (LDM/STM of all registers),
+   twice that is left for the last one and the rest of the module */
+#define INSN_CODE_MAX 0x1000
+
+/* Compiles and instantiates a module, returns the index of its function in the
+   table or 0. The function replaces the one at index, unless that's 0. */
+EM_JS(int, wasm_module_load, (const uint8_t *code, size_t size, int index), {
+    try {
+        var module = new WebAssembly.Module(HEAPU8.subarray(code, code + size));
+        var instance = new WebAssembly.Instance(module, {'env': {'memory': wasmMemory, 'table': wasmTable}});
+        if (!index) {
+            index = wasmTable.length;
+            wasmTable.grow(1);
+        }
+        wasmTable.set(index, instance.exports['run']);
+        return index;
+    } catch (e) {
+        return 0;
+    }
+});
+
+enum WasmOp : uint8_t {
+    W_BLOCK = 0x02, W_LOOP = 0x03, W_IF = 0x04, W_ELSE = 0x05, W_END = 0x0B,
+    W_BR = 0x0C, W_BR_TABLE = 0x0E, W_RETURN = 0x0F, W_CALL_INDIRECT = 0x11,
+    W_SELECT = 0x1B,
+    W_LOCAL_GET = 0x20, W_LOCAL_SET = 0x21, W_LOCAL_TEE = 0x22,
+    W_I32_LOAD = 0x28, W_I32_LOAD8_U = 0x2D, W_I32_LOAD16_U = 0x2F,
+    W_I32_STORE = 0x36, W_I32_STORE8 = 0x3A, W_I32_STORE16 = 0x3B,
+    W_I32_CONST = 0x41, W_I64_CONST = 0x42,
+    W_I32_EQZ = 0x45, W_I32_EQ = 0x46, W_I32_NE = 0x47, W_I32_LT_S = 0x48, W_I32_LT_U = 0x49,
+    W_I64_EQZ = 0x50,
+    W_I32_CLZ = 0x67, W_I32_ADD = 0x6A, W_I32_SUB = 0x6B, W_I32_MUL = 0x6C,
+    W_I32_AND = 0x71, W_I32_OR = 0x72, W_I32_XOR = 0x73,
+    W_I32_SHL = 0x74, W_I32_SHR_S = 0x75, W_I32_SHR_U = 0x76, W_I32_ROTR = 0x78,
+    W_I64_ADD = 0x7C, W_I64_MUL = 0x7E, W_I64_OR = 0x84, W_I64_SHL = 0x86, W_I64_SHR_U = 0x88,
+    W_I32_WRAP_I64 = 0xA7, W_I64_EXTEND_I32_S = 0xAC, W_I64_EXTEND_I32_U = 0xAD
+};
+
+// Block types
+#define BT_VOID 0x40
+#define BT_I32 0x7F
+
+// Function types in the module
+enum { TYPE_RUN, TYPE_READ, TYPE_WRITE };
+
+// Locals of the function, L_ENTRY is the parameter
+enum Local : uint8_t {
+    L_ENTRY = 0, L_DONE, L_X, L_Y, L_R, L_C, L_A, L_V, L_E, L_W
+};
+#define I32_LOCALS 8 // L_DONE to L_E
+#define I64_LOCALS 1 // L_W
+
+// Body of the function being built, the module gets put together around it
+static std::vector<uint8_t> code;
+static std::vector<uint8_t> module;
+
+// Branches to the loop, patched with the final depth once the block size is known
+struct LoopBranch {
+    size_t offset;
+    unsigned int index, nesting;
+};
+static std::vector<LoopBranch> loop_branches;
+
+// The instruction being translated
+static uint32_t pc_start, pc;
+static uint32_t *insn_ptr;
+static unsigned int insn_index;
+// Open blocks in the code of the current instruction
+static unsigned int nesting;
+
+static void emit(uint8_t byte)
+{
+    code.push_back(byte);
+}
+
+static void emit_uleb(std::vector<uint8_t> &out, uint32_t value)
+{
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        out.push_back(value ? byte | 0x80 : byte);
+    } while(value);
+}
+
+static void emit_uleb(uint32_t value)
+{
+    emit_uleb(code, value);
+}
+
+static void emit_sleb(int32_t value)
+{
+    bool more;
+    do
+    {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        more = !((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)));
+        emit(more ? byte | 0x80 : byte);
+    } while(more);
+}
+
+static void emit_const(uint32_t value)
+{
+    emit(W_I32_CONST);
+    emit_sleb(value);
+}
+
+static void emit_op(WasmOp op)
+{
+    emit(op);
+}
+
+static void emit_get(Local local)
+{
+    emit(W_LOCAL_GET);
+    emit(local);
+}
+
+static void emit_set(Local local)
+{
+    emit(W_LOCAL_SET);
+    emit(local);
+}
+
+static void emit_if(uint8_t type = BT_VOID)
+{
+    emit(W_IF);
+    emit(type);
+    nesting++;
+}
+
+static void emit_else()
+{
+    emit(W_ELSE);
+}
+
+static void emit_end()
+{
+    emit(W_END);
+    nesting--;
+}
+
+static uint32_t addr(const volatile void *ptr)
+{
+    return reinterpret_cast<uintptr_t>(ptr);
+}
+
+// Loads from ptr, or from the address on the stack + ptr
+static void emit_load_at(WasmOp op, uint32_t offset)
+{
+    emit(op);
+    emit_uleb(op == W_I32_LOAD ? 2 : op == W_I32_LOAD16_U ? 1 : 0);
+    emit_uleb(offset);
+}
+
+static void emit_load(WasmOp op, const volatile void *ptr)
+{
+    emit_const(0);
+    emit_load_at(op, addr(ptr));
+}
+
+// The address (or 0) and the value must be on the stack
+static void emit_store_at(WasmOp op, uint32_t offset)
+{
+    emit(op);
+    emit_uleb(op == W_I32_STORE ? 2 : op == W_I32_STORE16 ? 1 : 0);
+    emit_uleb(offset);
+}
+
+static void emit_store_local(WasmOp op, const void *ptr, Local local)
+{
+    emit_const(0);
+    emit_get(local);
+    emit_store_at(op, addr(ptr));
+}
+
+static void emit_store_const(WasmOp op, const void *ptr, uint32_t value)
+{
+    emit_const(0);
+    emit_const(value);
+    emit_store_at(op, addr(ptr));
+}
+
+// Register i like reg_pc does it
+static void emit_reg(unsigned int i)
+{
+    if(i == 15)
+        emit_const(pc + 8);
+    else
+        emit_load(W_I32_LOAD, &arm.reg[i]);
+}
+
+static void emit_set_reg(unsigned int i, Local local)
+{
+    emit_store_local(W_I32_STORE, &arm.reg[i], local);
+}
+
+// Pushes the flag at ptr (one of arm.cpsr_n and so on)
+static void emit_flag(const uint8_t *ptr)
+{
+    emit_load(W_I32_LOAD8_U, ptr);
+}
+
+// cycle_count_delta += insn_index + 1 - done; done = insn_index + 1
+static void emit_count_cycles()
+{
+    emit_const(0);
+    emit_load(W_I32_LOAD, &cycle_count_delta);
+    emit_const(insn_index + 1);
+    emit_op(W_I32_ADD);
+    emit_get(L_DONE);
+    emit_op(W_I32_SUB);
+    emit_store_at(W_I32_STORE, addr(&cycle_count_delta));
+    emit_const(insn_index + 1);
+    emit_set(L_DONE);
+}
+
+// Before calling a helper, which might look at the PC and the cycles
+static void emit_call_prologue()
+{
+    emit_store_const(W_I32_STORE, &arm.reg[15], pc + 4);
+    emit_count_cycles();
+}
+
+// Returns to translation_enter, arm.reg[15] has to be set already
+static void emit_exit()
+{
+    emit_count_cycles();
+    emit(W_RETURN);
+}
+
+static void emit_exit_to(uint32_t target)
+{
+    emit_store_const(W_I32_STORE, &arm.reg[15], target);
+    emit_exit();
+}
+
+// Continues at instruction index of the block, if nothing needs the emulator's attention
+static void emit_loop_to(unsigned int index)
+{
+    emit_store_const(W_I32_STORE, &arm.reg[15], pc_start + index * 4);
+    emit_count_cycles();
+
+    emit_load(W_I32_LOAD, &cycle_count_delta);
+    emit_const(0);
+    emit_op(W_I32_LT_S);
+    emit_load(W_I32_LOAD, &cpu_events);
+    emit_op(W_I32_EQZ);
+    emit_op(W_I32_AND);
+    emit_load(W_I32_LOAD8_U, &exiting);
+    emit_op(W_I32_EQZ);
+    emit_op(W_I32_AND);
+    emit_if();
+        emit_const(index);
+        emit_set(L_ENTRY);
+        emit_const(index);
+        emit_set(L_DONE);
+        emit(W_BR);
+        loop_branches.push_back({code.size(), insn_index, nesting});
+        // Padded, to be patched
+        for(int i = 0; i < 4; i++)
+            emit(0x80);
+        emit(0x00);
+    emit_end();
+    emit(W_RETURN);
+}
+
+/* A write to the page of the block might have invalidated it, with code
+   after this instruction changed. Leaves the block if so. */
+static void emit_code_check()
+{
+    emit_load(W_I32_LOAD, &RAM_FLAGS(insn_ptr));
+    emit_const(RF_CODE_TRANSLATED);
+    emit_op(W_I32_AND);
+    emit_op(W_I32_EQZ);
+    emit_if();
+        emit_exit_to(pc + 4);
+    emit_end();
+}
+
+static void emit_call(void *helper, unsigned int type_index)
+{
+    emit_const(addr(helper));
+    emit(W_CALL_INDIRECT);
+    emit_uleb(type_index);
+    emit(0x00); // Table
+}
+
+// Pushes the entry of addr_cache for the address in L_A and keeps it in L_E
+static void emit_addr_cache_entry(bool write)
+{
+    static_assert(sizeof(ac_entry) == 4, "ac_entry is expected to be 32 bits wide");
+    emit_get(L_A);
+    emit_const(10);
+    emit_op(W_I32_SHR_U);
+    emit_const(3);
+    emit_op(W_I32_SHL);
+    emit_load_at(W_I32_LOAD, addr(addr_cache + write));
+    emit(W_LOCAL_TEE);
+    emit(L_E);
+}
+
+// Pushes the value of size bytes at the address in L_A, like read_word and the others
+static void emit_read(unsigned int size)
+{
+    if(size == 2)
+    {
+        emit_get(L_A);
+        emit_const(~1u);
+        emit_op(W_I32_AND);
+        emit_set(L_A);
+    }
+
+    emit_addr_cache_entry(false);
+    emit_const(AC_FLAGS);
+    emit_op(W_I32_AND);
+    emit_if(BT_I32);
+        emit_call_prologue();
+        emit_get(L_A);
+        emit_call(reinterpret_cast<void*>(size == 4 ? read_word : size == 2 ? read_half : read_byte), TYPE_READ);
+    emit_else();
+        emit_get(L_E);
+        emit_get(L_A);
+        emit_op(W_I32_ADD);
+        emit_load_at(size == 4 ? W_I32_LOAD : size == 2 ? W_I32_LOAD16_U : W_I32_LOAD8_U, 0);
+    emit_end();
+}
+
+// Writes the value in L_V to the address in L_A, like write_word and the others
+static void emit_write(unsigned int size)
+{
+    if(size == 2)
+    {
+        emit_get(L_A);
+        emit_const(~1u);
+        emit_op(W_I32_AND);
+        emit_set(L_A);
+    }
+
+    // The helper is needed for MMIO and misses, and if the RAM_FLAGS want a write_action
+    emit_addr_cache_entry(true);
+    emit_const(AC_FLAGS);
+    emit_op(W_I32_AND);
+    emit_if(BT_I32);
+        emit_const(1);
+    emit_else();
+        emit_get(L_E);
+        emit_get(L_A);
+        emit_op(W_I32_ADD);
+        emit_const(~3u);
+        emit_op(W_I32_AND);
+        emit_load_at(W_I32_LOAD, MEM_MAXSIZE);
+        emit_const(DO_WRITE_ACTION);
+        emit_op(W_I32_AND);
+    emit_end();
+    emit_if();
+        emit_call_prologue();
+        emit_get(L_A);
+        emit_get(L_V);
+        emit_call(reinterpret_cast<void*>(size == 4 ? write_word : size == 2 ? write_half : write_byte), TYPE_WRITE);
+    emit_else();
+        emit_get(L_E);
+        emit_get(L_A);
+        emit_op(W_I32_ADD);
+        emit_get(L_V);
+        emit_store_at(size == 4 ? W_I32_STORE : size == 2 ? W_I32_STORE16 : W_I32_STORE8, 0);
+    emit_end();
+}
+
+// Pushes whether condition cond (not AL or NV) passes
+static void emit_condition(unsigned int cond)
+{
+    switch(cond & ~1)
+    {
+    case CC_EQ: emit_flag(&arm.cpsr_z); break;
+    case CC_CS: emit_flag(&arm.cpsr_c); break;
+    case CC_MI: emit_flag(&arm.cpsr_n); break;
+    case CC_VS: emit_flag(&arm.cpsr_v); break;
+    case CC_HI:
+        emit_flag(&arm.cpsr_c);
+        emit_flag(&arm.cpsr_z);
+        emit_op(W_I32_EQZ);
+        emit_op(W_I32_AND);
+        break;
+    case CC_GE:
+        emit_flag(&arm.cpsr_n);
+        emit_flag(&arm.cpsr_v);
+        emit_op(W_I32_EQ);
+        break;
+    case CC_GT:
+        emit_flag(&arm.cpsr_n);
+        emit_flag(&arm.cpsr_v);
+        emit_op(W_I32_EQ);
+        emit_flag(&arm.cpsr_z);
+        emit_op(W_I32_EQZ);
+        emit_op(W_I32_AND);
+        break;
+    }
+
+    if(cond & 1)
+        emit_op(W_I32_EQZ);
+}
+
+// local = (local >> amount) & 1
+static void emit_bit(Local out, Local in, unsigned int bit)
+{
+    emit_get(in);
+    emit_const(bit);
+    emit_op(W_I32_SHR_U);
+    emit_const(1);
+    emit_op(W_I32_AND);
+    emit_set(out);
+}
+
+/* Shifts the value in L_Y like shift() in the interpreter does for an
+   immediate amount. With carry, the carry out goes into L_C. */
+static void emit_shift_imm(unsigned int type, unsigned int amount, bool carry)
+{
+    if(type == SH_LSL && amount == 0)
+        return;
+
+    if(type == SH_ROR && amount == 0)
+    {
+        // RRX
+        if(carry)
+            emit_bit(L_C, L_Y, 0);
+        emit_get(L_Y);
+        emit_const(1);
+        emit_op(W_I32_SHR_U);
+        emit_flag(&arm.cpsr_c);
+        emit_const(31);
+        emit_op(W_I32_SHL);
+        emit_op(W_I32_OR);
+        emit_set(L_Y);
+        return;
+    }
+
+    // LSR #32 and ASR #32 are encoded as #0
+    if(amount == 0)
+        amount = 32;
+
+    if(carry)
+        emit_bit(L_C, L_Y, type == SH_LSL ? 32 - amount : amount - 1);
+
+    if(type == SH_LSR && amount == 32)
+    {
+        emit_const(0);
+        emit_set(L_Y);
+        return;
+    }
+
+    emit_get(L_Y);
+    emit_const(amount == 32 ? 31 : amount);
+    emit_op(type == SH_LSL ? W_I32_SHL : type == SH_LSR ? W_I32_SHR_U : type == SH_ASR ? W_I32_SHR_S : W_I32_ROTR);
+    emit_set(L_Y);
+}
+
+// Same for an amount in the low byte of register rs, without the carry out
+static void emit_shift_reg(unsigned int type, unsigned int rs)
+{
+    emit_reg(rs);
+    emit_const(0xFF);
+    emit_op(W_I32_AND);
+    emit_set(L_R);
+
+    emit_get(L_Y);
+    if(type == SH_LSL || type == SH_LSR)
+    {
+        // Amounts of 32 and more shift everything out, not modulo 32
+        emit_get(L_R);
+        emit_op(type == SH_LSL ? W_I32_SHL : W_I32_SHR_U);
+        emit_const(0);
+        emit_get(L_R);
+        emit_const(32);
+        emit_op(W_I32_LT_U);
+        emit(W_SELECT);
+    }
+    else if(type == SH_ASR)
+    {
+        emit_get(L_R);
+        emit_const(31);
+        emit_get(L_R);
+        emit_const(32);
+        emit_op(W_I32_LT_U);
+        emit(W_SELECT);
+        emit_op(W_I32_SHR_S);
+    }
+    else
+    {
+        emit_get(L_R);
+        emit_op(W_I32_ROTR);
+    }
+    emit_set(L_Y);
+}
+
+static void emit_set_nz(Local local)
+{
+    emit_const(0);
+    emit_get(local);
+    emit_const(31);
+    emit_op(W_I32_SHR_U);
+    emit_store_at(W_I32_STORE8, addr(&arm.cpsr_n));
+
+    emit_const(0);
+    emit_get(local);
+    emit_op(W_I32_EQZ);
+    emit_store_at(W_I32_STORE8, addr(&arm.cpsr_z));
+}
+
+enum TranslateResult {
+    TR_UNIMPL, // Nothing emitted that's needed
+    TR_NEXT, // Continues with the next instruction
+    TR_STOP // Doesn't get to the next instruction
+};
+
+static TranslateResult translate_data_processing(Instruction i)
+{
+    unsigned int op = i.data_proc.op;
+    bool setcc = i.data_proc.s,
+         logical = op <= OP_EOR || op == OP_TST || op == OP_TEQ || op >= OP_ORR,
+         writes = op < OP_TST || op > OP_CMN;
+
+    // With the S bit, that's a return from an exception
+    if(i.data_proc.rd == 15 && setcc)
+        return TR_UNIMPL;
+
+    // Operand 2 into L_Y, the carry out of the shifter into L_C if used
+    bool shifter_carry = false;
+    if(i.data_proc.imm)
+    {
+        unsigned int count = i.data_proc.rotate_imm << 1;
+        uint32_t imm = i.data_proc.immed_8;
+        if(count)
+            imm = imm >> count | imm << (32 - count);
+
+        emit_const(imm);
+        emit_set(L_Y);
+        if(count && setcc && logical)
+        {
+            emit_const(imm >> 31);
+            emit_set(L_C);
+            shifter_carry = true;
+        }
+    }
+    else if(i.data_proc.reg_shift)
+    {
+        if(i.data_proc.rs == 15 || (setcc && logical))
+            return TR_UNIMPL;
+
+        emit_reg(i.data_proc.rm);
+        emit_set(L_Y);
+        emit_shift_reg(i.data_proc.shift, i.data_proc.rs);
+    }
+    else
+    {
+        shifter_carry = setcc && logical && !(i.data_proc.shift == SH_LSL && i.data_proc.shift_imm == 0);
+        emit_reg(i.data_proc.rm);
+        emit_set(L_Y);
+        emit_shift_imm(i.data_proc.shift, i.data_proc.shift_imm, shifter_carry);
+    }
+
+    if(op != OP_MOV && op != OP_MVN)
+    {
+        emit_reg(i.data_proc.rn);
+        emit_set(L_X);
+    }
+
+    if(logical)
+    {
+        if(op == OP_MOV || op == OP_MVN)
+            emit_get(L_Y);
+        else
+        {
+            emit_get(L_X);
+            emit_get(L_Y);
+            if(op == OP_BIC)
+            {
+                emit_const(~0u);
+                emit_op(W_I32_XOR);
+            }
+            emit_op(op == OP_EOR || op == OP_TEQ ? W_I32_XOR : op == OP_ORR ? W_I32_OR : W_I32_AND);
+        }
+        if(op == OP_MVN)
+        {
+            emit_const(~0u);
+            emit_op(W_I32_XOR);
+        }
+        emit_set(L_R);
+
+        if(setcc)
+        {
+            emit_set_nz(L_R);
+            if(shifter_carry)
+                emit_store_local(W_I32_STORE8, &arm.cpsr_c, L_C);
+        }
+    }
+    else
+    {
+        // Everything is an addition of x, y and a carry in, like add() in the interpreter
+        bool invert_x = op == OP_RSB || op == OP_RSC,
+             invert_y = op == OP_SUB || op == OP_SBC || op == OP_CMP;
+        for(Local local : {L_X, L_Y})
+        {
+            if(local == L_X ? invert_x : invert_y)
+            {
+                emit_get(local);
+                emit_const(~0u);
+                emit_op(W_I32_XOR);
+                emit_set(local);
+            }
+        }
+
+        if(op == OP_ADC || op == OP_SBC || op == OP_RSC)
+            emit_flag(&arm.cpsr_c);
+        else
+            emit_const(op == OP_SUB || op == OP_RSB || op == OP_CMP);
+        emit_set(L_C);
+
+        if(!setcc)
+        {
+            emit_get(L_X);
+            emit_get(L_Y);
+            emit_op(W_I32_ADD);
+            emit_get(L_C);
+            emit_op(W_I32_ADD);
+            emit_set(L_R);
+        }
+        else
+        {
+            for(Local local : {L_X, L_Y, L_C})
+            {
+                emit_get(local);
+                emit_op(W_I64_EXTEND_I32_U);
+            }
+            emit_op(W_I64_ADD);
+            emit_op(W_I64_ADD);
+            emit(W_LOCAL_TEE);
+            emit(L_W);
+            emit_op(W_I32_WRAP_I64);
+            emit_set(L_R);
+
+            emit_set_nz(L_R);
+
+            emit_const(0);
+            emit_get(L_W);
+            emit(W_I64_CONST);
+            emit_sleb(32);
+            emit_op(W_I64_SHR_U);
+            emit_op(W_I32_WRAP_I64);
+            emit_store_at(W_I32_STORE8, addr(&arm.cpsr_c));
+
+            // Overflow if the sign of the result differs from both operands
+            emit_const(0);
+            emit_get(L_X);
+            emit_get(L_R);
+            emit_op(W_I32_XOR);
+            emit_get(L_Y);
+            emit_get(L_R);
+            emit_op(W_I32_XOR);
+            emit_op(W_I32_AND);
+            emit_const(31);
+            emit_op(W_I32_SHR_U);
+            emit_store_at(W_I32_STORE8, addr(&arm.cpsr_v));
+        }
+    }
+
+    if(!writes)
+        return TR_NEXT;
+
+    emit_set_reg(i.data_proc.rd, L_R);
+    if(i.data_proc.rd != 15)
+        return TR_NEXT;
+
+    emit_exit();
+    return TR_STOP;
+}
+
+// MUL, MLA and the 64-bit multiplications
+static TranslateResult translate_multiply(uint32_t insn)
+{
+    unsigned int rm = insn & 15, rs = insn >> 8 & 15, rn = insn >> 12 & 15, rd = insn >> 16 & 15;
+    bool accumulate = insn & 0x0200000, setcc = insn & 0x0100000;
+    if(rm == 15 || rs == 15 || rn == 15 || rd == 15)
+        return TR_UNIMPL;
+
+    if((insn & 0xFC000F0) == 0x0000090)
+    {
+        emit_reg(rm);
+        emit_reg(rs);
+        emit_op(W_I32_MUL);
+        if(accumulate)
+        {
+            emit_reg(rn);
+            emit_op(W_I32_ADD);
+        }
+        emit_set(L_R);
+        emit_set_reg(rd, L_R);
+        if(setcc)
+            emit_set_nz(L_R);
+        return TR_NEXT;
+    }
+
+    // UMULL, UMLAL, SMULL, SMLAL: rn is RdLo and rd RdHi here
+    if(rn == rd)
+        return TR_UNIMPL;
+
+    WasmOp extend = (insn & 0x0400000) ? W_I64_EXTEND_I32_S : W_I64_EXTEND_I32_U;
+    emit_reg(rm);
+    emit_op(extend);
+    emit_reg(rs);
+    emit_op(extend);
+    emit_op(W_I64_MUL);
+    if(accumulate)
+    {
+        emit_reg(rd);
+        emit_op(W_I64_EXTEND_I32_U);
+        emit(W_I64_CONST);
+        emit_sleb(32);
+        emit_op(W_I64_SHL);
+        emit_reg(rn);
+        emit_op(W_I64_EXTEND_I32_U);
+        emit_op(W_I64_OR);
+        emit_op(W_I64_ADD);
+    }
+    emit(W_LOCAL_TEE);
+    emit(L_W);
+    emit_op(W_I32_WRAP_I64);
+    emit_set(L_R);
+    emit_set_reg(rn, L_R);
+
+    emit_get(L_W);
+    emit(W_I64_CONST);
+    emit_sleb(32);
+    emit_op(W_I64_SHR_U);
+    emit_op(W_I32_WRAP_I64);
+    emit_set(L_R);
+    emit_set_reg(rd, L_R);
+
+    if(setcc)
+    {
+        emit_const(0);
+        emit_get(L_R);
+        emit_const(31);
+        emit_op(W_I32_SHR_U);
+        emit_store_at(W_I32_STORE8, addr(&arm.cpsr_n));
+
+        emit_const(0);
+        emit_get(L_W);
+        emit_op(W_I64_EQZ);
+        emit_store_at(W_I32_STORE8, addr(&arm.cpsr_z));
+    }
+    return TR_NEXT;
+}
+
+// LDRH, STRH, LDRSB and LDRSH
+static TranslateResult translate_load_store_extra(uint32_t insn)
+{
+    int type = insn >> 5 & 3;
+    unsigned int rn = insn >> 16 & 15, rd = insn >> 12 & 15;
+    bool load = insn & (1 << 20), pre = insn & (1 << 24), up = insn & (1 << 23),
+         writeback = !pre || (insn & (1 << 21));
+
+    // LDRD, STRD and user mode accesses aren't done here
+    if((!load && type != 1) || (!pre && (insn & (1 << 21))))
+        return TR_UNIMPL;
+    if(rd == 15 || (writeback && (rn == 15 || (load && rn == rd))))
+        return TR_UNIMPL;
+
+    // The offset into L_Y
+    if(insn & (1 << 22))
+        emit_const((insn & 0x0F) | (insn >> 4 & 0xF0));
+    else
+    {
+        if((insn & 15) == 15)
+            return TR_UNIMPL;
+        emit_reg(insn & 15);
+    }
+    emit_set(L_Y);
+
+    emit_reg(rn);
+    emit_set(L_X);
+    emit_get(L_X);
+    if(pre)
+    {
+        emit_get(L_Y);
+        emit_op(up ? W_I32_ADD : W_I32_SUB);
+        emit(W_LOCAL_TEE);
+        emit(L_X);
+    }
+    emit_set(L_A);
+
+    if(load)
+    {
+        emit_read(type == 2 ? 1 : 2);
+        if(type != 1)
+        {
+            // Sign extension
+            unsigned int bits = type == 2 ? 24 : 16;
+            emit_const(bits);
+            emit_op(W_I32_SHL);
+            emit_const(bits);
+            emit_op(W_I32_SHR_S);
+        }
+        emit_set(L_R);
+        emit_set_reg(rd, L_R);
+    }
+    else
+    {
+        emit_reg(rd);
+        emit_set(L_V);
+        emit_write(2);
+    }
+
+    if(writeback)
+    {
+        if(!pre)
+        {
+            emit_get(L_X);
+            emit_get(L_Y);
+            emit_op(up ? W_I32_ADD : W_I32_SUB);
+            emit_set(L_X);
+        }
+        emit_set_reg(rn, L_X);
+    }
+
+    if(!load)
+        emit_code_check();
+    return TR_NEXT;
+}
+
+// LDR, STR, LDRB and STRB
+static TranslateResult translate_load_store(Instruction i)
+{
+    unsigned int rn = i.mem_proc.rn, rd = i.mem_proc.rd;
+    bool writeback = !i.mem_proc.p || i.mem_proc.w;
+
+    // Post-indexed with W is a user mode access
+    if((!i.mem_proc.p && i.mem_proc.w) || (writeback && rn == 15))
+        return TR_UNIMPL;
+
+    // The offset into L_Y
+    if(!i.mem_proc.not_imm)
+    {
+        emit_const(i.mem_proc.immed);
+        emit_set(L_Y);
+    }
+    else
+    {
+        emit_reg(i.mem_proc.rm);
+        emit_set(L_Y);
+        emit_shift_imm(i.mem_proc.shift, i.mem_proc.shift_imm, false);
+    }
+
+    emit_reg(rn);
+    emit_set(L_X);
+    emit_get(L_X);
+    if(i.mem_proc.p)
+    {
+        emit_get(L_Y);
+        emit_op(i.mem_proc.u ? W_I32_ADD : W_I32_SUB);
+        emit(W_LOCAL_TEE);
+        emit(L_X);
+    }
+    emit_set(L_A);
+
+    if(i.mem_proc.l)
+    {
+        emit_read(i.mem_proc.b ? 1 : 4);
+        emit_set(L_R);
+        if(rd == 15)
+        {
+            // Like set_reg_bx
+            emit_const(0);
+            emit_load(W_I32_LOAD, &arm.cpsr_low28);
+            emit_get(L_R);
+            emit_const(1);
+            emit_op(W_I32_AND);
+            emit_const(5);
+            emit_op(W_I32_SHL);
+            emit_op(W_I32_OR);
+            emit_store_at(W_I32_STORE, addr(&arm.cpsr_low28));
+            emit_get(L_R);
+            emit_const(~1u);
+            emit_op(W_I32_AND);
+            emit_set(L_R);
+        }
+        emit_set_reg(rd, L_R);
+    }
+    else
+    {
+        // Like reg_pc_mem
+        if(rd == 15)
+            emit_const(pc + 12);
+        else
+            emit_reg(rd);
+        emit_set(L_V);
+        emit_write(i.mem_proc.b ? 1 : 4);
+    }
+
+    if(writeback)
+    {
+        if(!i.mem_proc.p)
+        {
+            emit_get(L_X);
+            emit_get(L_Y);
+            emit_op(i.mem_proc.u ? W_I32_ADD : W_I32_SUB);
+            emit_set(L_X);
+        }
+        emit_set_reg(rn, L_X);
+    }
+
+    if(!i.mem_proc.l)
+    {
+        emit_code_check();
+        return TR_NEXT;
+    }
+
+    if(rd != 15)
+        return TR_NEXT;
+
+    emit_exit();
+    return TR_STOP;
+}
+
+// LDM and STM, without the user mode registers
+static TranslateResult translate_load_store_multiple(Instruction i)
+{
+    unsigned int rn = i.mem_multi.rn, reglist = i.mem_multi.reglist;
+    bool load = i.mem_multi.l, writeback = i.mem_multi.w;
+    if(i.mem_multi.s || rn == 15 || !reglist || (load && writeback && (reglist >> rn & 1)))
+        return TR_UNIMPL;
+
+    unsigned int count = __builtin_popcount(reglist);
+
+    // Address of the first register into L_Y, the new base into L_R
+    emit_reg(rn);
+    emit_set(L_X);
+    if(i.mem_multi.u)
+    {
+        emit_get(L_X);
+        if(writeback)
+        {
+            emit_const(count * 4);
+            emit_op(W_I32_ADD);
+        }
+        emit_set(L_R);
+        emit_get(L_X);
+        emit_const(i.mem_multi.p ? 4 : 0);
+        emit_op(W_I32_ADD);
+        emit_set(L_Y);
+    }
+    else
+    {
+        emit_get(L_X);
+        emit_const(count * 4);
+        emit_op(W_I32_SUB);
+        emit_set(L_Y);
+        emit_get(writeback ? L_Y : L_X);
+        emit_set(L_R);
+        if(!i.mem_multi.p)
+        {
+            emit_get(L_Y);
+            emit_const(4);
+            emit_op(W_I32_ADD);
+            emit_set(L_Y);
+        }
+    }
+
+    unsigned int offset = 0;
+    for(unsigned int reg = 0; reg < 16; reg++)
+    {
+        if(!(reglist >> reg & 1))
+            continue;
+
+        emit_get(L_Y);
+        emit_const(offset);
+        emit_op(W_I32_ADD);
+        emit_set(L_A);
+        offset += 4;
+
+        if(load)
+        {
+            emit_read(4);
+            if(reg == rn)
+                emit_set(L_R); // Replaces the new base
+            else if(reg != 15)
+            {
+                emit_set(L_V);
+                emit_set_reg(reg, L_V);
+            }
+            else
+                emit_set(L_X);
+        }
+        else
+        {
+            if(reg == 15)
+                emit_const(pc + 12);
+            else
+                emit_reg(reg);
+            emit_set(L_V);
+            emit_write(4);
+        }
+    }
+
+    if(writeback || (load && (reglist >> rn & 1)))
+        emit_set_reg(rn, L_R);
+
+    if(!load)
+    {
+        emit_code_check();
+        return TR_NEXT;
+    }
+
+    if(!(reglist & 0x8000))
+        return TR_NEXT;
+
+    // Like set_reg_bx, the value loaded into the PC is in L_X
+    emit_const(0);
+    emit_load(W_I32_LOAD, &arm.cpsr_low28);
+    emit_get(L_X);
+    emit_const(1);
+    emit_op(W_I32_AND);
+    emit_const(5);
+    emit_op(W_I32_SHL);
+    emit_op(W_I32_OR);
+    emit_store_at(W_I32_STORE, addr(&arm.cpsr_low28));
+    emit_get(L_X);
+    emit_const(~1u);
+    emit_op(W_I32_AND);
+    emit_set(L_X);
+    emit_set_reg(15, L_X);
+    emit_exit();
+    return TR_STOP;
+}
+
+// B and BL
+static TranslateResult translate_branch(Instruction i)
+{
+    uint32_t target = pc + 8 + ((int32_t) i.raw << 8 >> 6);
+    if(i.branch.l)
+        emit_store_const(W_I32_STORE, &arm.reg[14], pc + 4);
+
+    // Back into this block?
+    if(target >= pc_start && target <= pc)
+        emit_loop_to((target - pc_start) / 4);
+    else
+        emit_exit_to(target);
+
+    return TR_STOP;
+}
+
+// BX, BLX (register) and CLZ
+static TranslateResult translate_miscellaneous(uint32_t insn)
+{
+    unsigned int rm = insn & 15;
+    if(rm == 15)
+        return TR_UNIMPL;
+
+    if((insn & 0xFFF0FF0) == 0x16F0F10)
+    {
+        unsigned int rd = insn >> 12 & 15;
+        if(rd == 15)
+            return TR_UNIMPL;
+
+        emit_reg(rm);
+        emit_op(W_I32_CLZ);
+        emit_set(L_R);
+        emit_set_reg(rd, L_R);
+        return TR_NEXT;
+    }
+
+    if((insn & 0xFFFFFD0) != 0x12FFF10)
+        return TR_UNIMPL;
+
+    emit_reg(rm);
+    emit_set(L_R);
+    if(insn & 0x20)
+        emit_store_const(W_I32_STORE, &arm.reg[14], pc + 4);
+
+    // Bit 0 selects Thumb mode
+    emit_const(0);
+    emit_load(W_I32_LOAD, &arm.cpsr_low28);
+    emit_get(L_R);
+    emit_const(1);
+    emit_op(W_I32_AND);
+    emit_const(5);
+    emit_op(W_I32_SHL);
+    emit_op(W_I32_OR);
+    emit_store_at(W_I32_STORE, addr(&arm.cpsr_low28));
+    emit_get(L_R);
+    emit_const(~1u);
+    emit_op(W_I32_AND);
+    emit_set(L_R);
+    emit_set_reg(15, L_R);
+    emit_exit();
+    return TR_STOP;
+}
+
+// Decodes like arm_decode in the interpreter
+static TranslateResult translate_instruction(Instruction i)
+{
+    uint32_t insn = i.raw;
+    if((insn & 0xE000090) == 0x0000090)
+    {
+        if((insn >> 5 & 3) == 0)
+        {
+            if((insn & 0xFC000F0) == 0x0000090 || (insn & 0xF8000F0) == 0x0800090)
+                return translate_multiply(insn);
+            return TR_UNIMPL; // SWP
+        }
+        return translate_load_store_extra(insn);
+    }
+    else if((insn & 0xD900000) == 0x1000000)
+        return translate_miscellaneous(insn);
+    else if((insn & 0xC000000) == 0x0000000)
+        return translate_data_processing(i);
+    else if((insn & 0xFF000F0) == 0x7F000F0)
+        return TR_UNIMPL;
+    else if((insn & 0xC000000) == 0x4000000)
+        return translate_load_store(i);
+    else if((insn & 0xE000000) == 0x8000000)
+        return translate_load_store_multiple(i);
+    else if((insn & 0xE000000) == 0xA000000)
+        return translate_branch(i);
+
+    return TR_UNIMPL;
+}
+
+static void emit_section(uint8_t id, const std::vector<uint8_t> &content)
+{
+    module.push_back(id);
+    emit_uleb(module, content.size());
+    module.insert(module.end(), content.begin(), content.end());
+}
+
+static void emit_name(std::vector<uint8_t> &out, const char *name)
+{
+    emit_uleb(out, strlen(name));
+    out.insert(out.end(), name, name + strlen(name));
+}
+
+// Builds the module around the code of count instructions
+static void build_module(unsigned int count)
+{
+    for(const LoopBranch &branch : loop_branches)
+    {
+        uint32_t depth = count - 1 - branch.index + branch.nesting;
+        for(int i = 0; i < 4; i++)
+            code[branch.offset + i] = (depth >> (i * 7) & 0x7F) | 0x80;
+        code[branch.offset + 4] = depth >> 28;
+    }
+
+    static const uint8_t header[] = {
+        0x00, 0x61, 0x73, 0x6D, // "\0asm"
+        0x01, 0x00, 0x00, 0x00 // Version
+    };
+    module.assign(header, header + sizeof(header));
+
+    static const uint8_t types[] = {
+        3, // Count
+        0x60, 1, 0x7F, 0, // TYPE_RUN: (i32) -> ()
+        0x60, 1, 0x7F, 1, 0x7F, // TYPE_READ: (i32) -> i32
+        0x60, 2, 0x7F, 0x7F, 0 // TYPE_WRITE: (i32, i32) -> ()
+    };
+    emit_section(1, std::vector<uint8_t>(types, types + sizeof(types)));
+
+    std::vector<uint8_t> imports = {2};
+    emit_name(imports, "env");
+    emit_name(imports, "memory");
+    imports.insert(imports.end(), {0x02, 0x00, 0x00}); // Memory without maximum, at least 0 pages
+    emit_name(imports, "env");
+    emit_name(imports, "table");
+    imports.insert(imports.end(), {0x01, 0x70, 0x00, 0x00}); // Table of funcref, at least 0 entries
+    emit_section(2, imports);
+
+    emit_section(3, {1, TYPE_RUN});
+
+    std::vector<uint8_t> exports = {1};
+    emit_name(exports, "run");
+    exports.insert(exports.end(), {0x00, 0x00}); // Function 0
+    emit_section(7, exports);
+
+    // Locals, none of the instructions before the entry count, the loop and the blocks for entering
+    std::vector<uint8_t> body = {2, I32_LOCALS, 0x7F, I64_LOCALS, 0x7E, W_LOCAL_GET, L_ENTRY, W_LOCAL_SET, L_DONE, W_LOOP, BT_VOID};
+    for(unsigned int i = 0; i < count; i++)
+        body.insert(body.end(), {W_BLOCK, BT_VOID});
+    body.insert(body.end(), {W_LOCAL_GET, L_ENTRY, W_BR_TABLE});
+    emit_uleb(body, count);
+    for(unsigned int i = 0; i < count; i++)
+        emit_uleb(body, i);
+    emit_uleb(body, count - 1);
+    body.push_back(W_END);
+    body.insert(body.end(), code.begin(), code.end());
+    body.insert(body.end(), {W_END, W_END}); // The loop and the function
+
+    std::vector<uint8_t> functions = {1};
+    emit_uleb(functions, body.size());
+    functions.insert(functions.end(), body.begin(), body.end());
+    emit_section(10, functions);
+}
+
+bool translate_init()
+{
+    tcache_init(MAX_TRANSLATIONS, CODE_BUFFER_SIZE, MAX_TRANSLATIONS);
+    return true;
+}
+
+void translate_deinit()
+{
+    // The entries of the table stay for the translations after translate_init
+    tcache_flush();
+}
+
+bool translate_store_open(const char *)
+{
+    return false;
+}
+
+void translate_store_close()
+{
+}
+
+unsigned int translate_list(uint32_t *, unsigned int)
+{
+    return 0;
+}
+
+void translation_touch(unsigned int index)
+{
+    tcache.regions[index / tcache.slots].referenced = true;
+}
+
+void translate(uint32_t start_pc, uint32_t *insn_ptr_start)
+{
+    tcache_reserve(BLOCK_CODE_MAX, 1);
+    unsigned int index = tcache_next_index();
+    translation *this_translation = &translation_table[index];
+
+    pc_start = pc = start_pc;
+    insn_ptr = insn_ptr_start;
+    insn_index = 0;
+    code.clear();
+    loop_branches.clear();
+
+    while(1)
+    {
+        // Translate further?
+        if(code.size() > BLOCK_CODE_MAX - 2 * INSN_CODE_MAX
+           || RAM_FLAGS(insn_ptr) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)
+           || (pc ^ pc_start) & ~0x3ff)
+            break;
+
+        size_t insn_start = code.size(), branches = loop_branches.size();
+        if(insn_index)
+            emit(W_END); // Of the block for entering here
+
+        Instruction i;
+        i.raw = *insn_ptr;
+        nesting = 0;
+
+        TranslateResult result;
+        if(i.cond == CC_NV)
+            result = (i.raw & 0xFD70F000) == 0xF550F000 ? TR_NEXT : TR_UNIMPL; // PLD does nothing here
+        else if(i.cond == CC_AL)
+            result = translate_instruction(i);
+        else
+        {
+            emit_condition(i.cond);
+            emit_if();
+            result = translate_instruction(i);
+            emit_end();
+            if(result == TR_STOP)
+                result = TR_NEXT;
+        }
+
+        if(result == TR_UNIMPL)
+        {
+            // Throw away the partial translation
+            code.resize(insn_start);
+            loop_branches.resize(branches);
+            RAM_FLAGS(insn_ptr) |= RF_CODE_NO_TRANSLATE;
+            translate_stats.no_translate++;
+            break;
+        }
+
+        RAM_FLAGS(insn_ptr) |= (RF_CODE_TRANSLATED | index << RFS_TRANSLATION_INDEX);
+        ++insn_index;
+        ++insn_ptr;
+        pc += 4;
+
+        if(result == TR_STOP)
+            break;
+    }
+
+    unsigned int count = insn_index;
+    if(count == 0)
+        return;
+
+    this_translation->jump_table = nullptr;
+    this_translation->start_ptr = insn_ptr_start;
+    this_translation->end_ptr = insn_ptr;
+
+    // Continues after the last instruction
+    insn_index = count - 1;
+    nesting = 0;
+    emit_exit_to(pc);
+
+    build_module(count);
+    // The slot in the table of a translation evicted before gets reused
+    int function = wasm_module_load(module.data(), module.size(), this_translation->unused);
+    if(!function)
+    {
+        // The browser didn't take it, don't try again
+        tcache_clear_flags(index, insn_ptr_start, insn_ptr);
+        RAM_FLAGS(insn_ptr_start) |= RF_CODE_NO_TRANSLATE;
+        translate_stats.no_translate++;
+        return;
+    }
+
+    this_translation->unused = function;
+    tcache_commit(tcache_code_offset() + module.size(), tcache_jtbl_offset() + 1);
+}
+
+void translation_enter()
+{
+    uint32_t *insnp = static_cast<uint32_t*>(read_instruction(arm.reg[15]));
+    const translation &t = translation_table[RAM_FLAGS(insnp) >> RFS_TRANSLATION_INDEX];
+    reinterpret_cast<void (*)(uint32_t)>(t.unused)(insnp - t.start_ptr);
+}
+
+// Thumb code is not translated by this backend
+bool translate_thumb(uint32_t, uint16_t *)
+{
+    return false;
+}
+
+void flush_translations()
+{
+    tcache_flush();
+}
+
+// The PCs in the translations are the virtual addresses they got translated at
+void flush_remapped_translations(uint32_t, uint32_t)
+{
+    flush_translations();
+}
+
+// Memory accesses go through addr_cache, which has the permissions
+void flush_translation_shortcuts()
+{
+}
+
+// Stores always check RAM_FLAGS here
+bool translate_write_fault(void *addr)
+{
+    (void) addr;
+    return false;
+}
+
+void invalidate_translation(int index)
+{
+    tcache_invalidate(index);
+}
+
+void invalidate_translation_at(void *ptr)
+{
+    uint32_t flags = RAM_FLAGS((uintptr_t)ptr & ~3);
+    if (flags & RF_CODE_TRANSLATED)
+        invalidate_translation(flags >> RFS_TRANSLATION_INDEX);
+}
+
+// arm.reg[15] is always up to date when calling helpers
+void translate_fix_pc()
+{
+}
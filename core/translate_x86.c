@@ -7,6 +7,7 @@
 #include "cpu.h"
 #include "asmcode.h"
 #include "translate.h"
+#include "translation_cache.h"
 #include "debug.h"
 
 extern void translation_enter() __asm__("translation_enter");
@@ -19,11 +20,14 @@ void *in_translation_pc_ptr __asm__("in_translation_pc_ptr");
 #define MAX_TRANSLATIONS 262144
 struct translation translation_table[MAX_TRANSLATIONS];
 
+#define JTBL_BUFFER_SIZE 500000
+// Worst case space a single block may need
+#define BLOCK_CODE_MAX 0x10000
+#define BLOCK_JTBL_MAX (0x400 / 4)
+
 static int next_index = 0;
 uint8_t *insn_buffer = NULL;
-uint8_t *insn_bufptr = NULL;
-static uint8_t *jtbl_buffer[500000];
-static uint8_t **jtbl_bufptr = jtbl_buffer;
+static uint8_t *jtbl_buffer[JTBL_BUFFER_SIZE];
 static uint8_t *out;
 static uint8_t **outj;
 
@@ -238,7 +242,7 @@ bool translate_init()
     if(!insn_buffer)
     {
         insn_buffer = os_alloc_executable(INSN_BUFFER_SIZE);
-        insn_bufptr = insn_buffer;
+        tcache_init(MAX_TRANSLATIONS, INSN_BUFFER_SIZE, JTBL_BUFFER_SIZE);
     }
 
     return !!insn_buffer;
@@ -253,25 +257,45 @@ void translate_deinit()
     insn_buffer = NULL;
 }
 
+bool translate_store_open(const char *path)
+{
+    (void) path;
+    return false;
+}
+
+void translate_store_close()
+{
+}
+
+unsigned int translate_list(uint32_t *pcs, unsigned int max)
+{
+    (void) pcs; (void) max;
+    return 0;
+}
+
+void translation_touch(unsigned int index) {
+    tcache.regions[index / tcache.slots].referenced = true;
+}
+
 void translate(uint32_t start_pc, uint32_t *start_insnp) {
-    out = insn_bufptr;
-    outj = jtbl_bufptr;
+    tcache_reserve(BLOCK_CODE_MAX, BLOCK_JTBL_MAX);
+    next_index = tcache_next_index();
+    out = &insn_buffer[tcache_code_offset()];
+    outj = &jtbl_buffer[tcache_jtbl_offset()];
+    uint8_t *code_end = &insn_buffer[tcache_code_end()];
+    uint8_t **jtbl_start = outj;
     uint32_t pc = start_pc;
     uint32_t *insnp = start_insnp;
 
-    if (next_index >= MAX_TRANSLATIONS)
-        error("too many translations");
-
     uint8_t *insn_start;
     int stop_here = 0;
     while (1) {
-        if (out >= &insn_buffer[INSN_BUFFER_SIZE - 1000])
-            error("Out of instruction space");
-        if (outj >= &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
-            error("Out of jump table space");
-
         insn_start = out;
 
+        // Can only happen with huge blocks, the end is reserved by tcache_reserve
+        if (out >= code_end - 1000)
+            goto branch_conditional;
+
         if ((pc ^ start_pc) & ~0x3FF) {
             //printf("stopping translation - end of page\n");
             goto branch_conditional;
@@ -939,6 +963,7 @@ data_proc_done:
 unimpl:
     out = insn_start;
     RAM_FLAGS(insnp) |= RF_CODE_NO_TRANSLATE;
+    translate_stats.no_translate++;
 branch_conditional:
     emit_mov_x86reg_immediate(EAX, pc);
     emit_jump((uint32_t)translation_next);
@@ -947,43 +972,83 @@ branch_unconditional:
     if (pc == start_pc)
         return;
 
-    int index = next_index++;
-    translation_table[index].jump_table = (void**) ((uint32_t)jtbl_bufptr - (uint32_t)start_insnp);
+    int index = next_index;
+    translation_table[index].jump_table = (void**) ((uint32_t)jtbl_start - (uint32_t)start_insnp);
     translation_table[index].start_ptr  = start_insnp;
     translation_table[index].end_ptr    = insnp;
 
-    insn_bufptr = out;
-    jtbl_bufptr = outj;
+    tcache_commit(out - insn_buffer, outj - jtbl_buffer);
 
     return;
 }
 
+// Thumb code is not translated by this backend
+bool translate_thumb(uint32_t start_pc, uint16_t *start_insnp) {
+    (void) start_pc;
+    (void) start_insnp;
+    return false;
+}
+
 void flush_translations() {
-    int index;
-    for (index = 0; index < next_index; index++) {
-        uint32_t *start = translation_table[index].start_ptr;
-        uint32_t *end   = translation_table[index].end_ptr;
-        for (; start < end; start++)
-            RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
-    }
-    next_index = 0;
-    insn_bufptr = insn_buffer;
-    jtbl_bufptr = jtbl_buffer;
+    tcache_flush();
+}
+
+// Translations do not remember their virtual address, so they all have to go
+void flush_remapped_translations(uint32_t start, uint32_t last) {
+    (void) start;
+    (void) last;
+    flush_translations();
+}
+
+void flush_translation_shortcuts() {
+    flush_translations();
+}
+
+// Stores always check RAM_FLAGS here
+bool translate_write_fault(void *addr) {
+    (void) addr;
+    return false;
 }
 
 void invalidate_translation(int index) {
+    unsigned int current = ~0u;
     if (in_translation_esp) {
         uint32_t flags = RAM_FLAGS(in_translation_pc_ptr);
         if ((flags & RF_CODE_TRANSLATED) && (int)(flags >> RFS_TRANSLATION_INDEX) == index)
             error("Cannot modify currently executing code block.");
+        if (flags & RF_CODE_TRANSLATED)
+            current = flags >> RFS_TRANSLATION_INDEX;
     }
-    flush_translations();
+
+    /* Code gets usually modified in bulk, so drop everything in the page
+       at once instead of taking a write_action for each translation.
+       The currently running translation stays, translate_fix_pc needs it. */
+    tcache_invalidate_page(translation_table[index].start_ptr, current, tcache_invalidate);
+}
+
+void invalidate_translation_at(void *ptr) {
+    uint32_t flags = RAM_FLAGS((uintptr_t)ptr & ~3);
+    if (!(flags & RF_CODE_TRANSLATED))
+        return;
+
+    // translate_fix_pc needs the running one
+    unsigned int index = flags >> RFS_TRANSLATION_INDEX;
+    if (in_translation_esp) {
+        uint32_t running = RAM_FLAGS(in_translation_pc_ptr);
+        if ((running & RF_CODE_TRANSLATED) && (running >> RFS_TRANSLATION_INDEX) == index) {
+            flush_translations();
+            return;
+        }
+    }
+
+    tcache_invalidate(index);
 }
 
 void translate_fix_pc() {
     if (!in_translation_esp)
         return;
 
+    translate_stats.fix_pc++;
     uint32_t *insnp = in_translation_pc_ptr;
     void *ret_eip = in_translation_esp[-1];
     uint32_t flags = RAM_FLAGS(insnp);
@@ -992,11 +1057,8 @@ void translate_fix_pc() {
     int index = flags >> RFS_TRANSLATION_INDEX;
     uint32_t start = (uint32_t)translation_table[index].start_ptr;
     uint32_t end = (uint32_t)translation_table[index].end_ptr;
-    for (; start < end; start += 4) {
-        void *code = *(void **)((uintptr_t)(translation_table[index].jump_table) + start);
-        if (code >= ret_eip)
-            break;
-    }
+    void **jtbl = (void **)((uintptr_t)(translation_table[index].jump_table) + start);
+    start += tcache_insn_after(jtbl, 0, (end - start) >> 2, ret_eip) << 2;
     arm.reg[15] += (uint32_t)start - (uint32_t)insnp;
     cycle_count_delta -= ((uint32_t)end - (uint32_t)insnp) >> 2;
     in_translation_esp = NULL;
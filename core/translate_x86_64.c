@@ -1,16 +1,26 @@
+#define _GNU_SOURCE // For translation_perfmap.h
+
 #include <assert.h>
+#include <pthread.h>
 
 #include "emu.h"
 #include "mem.h"
 #include "cpu.h"
+#include "mmu.h"
 #include "asmcode.h"
+#include "trace.h"
 #include "translate.h"
+#include "translation_cache.h"
+#include "translation_perfmap.h"
+#include "translation_ir.h"
+#include "translation_store.h"
 #include "debug.h"
 #include "os/os.h"
 
 extern void translation_enter() __asm__("translation_enter");
 extern void translation_next() __asm__("translation_next");
 extern void translation_next_bx() __asm__("translation_next_bx");
+extern void translation_next_thumb() __asm__("translation_next_thumb");
 extern uintptr_t arm_shift_proc[2][4] __asm__("arm_shift_proc");
 void **in_translation_rsp __asm__("in_translation_rsp");
 void *in_translation_pc_ptr __asm__("in_translation_pc_ptr");
@@ -18,13 +28,85 @@ void *in_translation_pc_ptr __asm__("in_translation_pc_ptr");
 #define MAX_TRANSLATIONS 262144
 struct translation translation_table[MAX_TRANSLATIONS];
 
+#define JTBL_BUFFER_SIZE 500000
+// Worst case space a single block may need
+#define BLOCK_CODE_MAX 0x10000
+// Blocks may span two 1KB pages, see block_continues
+#define BLOCK_BYTES_MAX 0x800
+#define BLOCK_JTBL_MAX (BLOCK_BYTES_MAX / 2) // Thumb
+
 static int next_index = 0;
 uint8_t *insn_buffer = NULL;
-uint8_t *insn_bufptr = NULL;
-static uint8_t *jtbl_buffer[500000];
-static uint8_t **jtbl_bufptr = jtbl_buffer;
+static uint8_t *jtbl_buffer[JTBL_BUFFER_SIZE];
 static uint8_t *out;
 static uint8_t **outj;
+// Whether the block being translated is Thumb code
+static bool translating_thumb;
+// protect_translated_code for the block being translated
+static bool block_protected;
+// The background job the compiler thread translates, NULL on the emulation thread
+static struct bg_job *bg_current;
+
+/* Displacements in the block being translated which point out of it, as
+   code offset | size of the immediate following << 16. Needed to move it
+   elsewhere, see "Translation store". */
+static uint8_t *block_code;
+static uint32_t block_relocs[BLOCK_CODE_MAX / 4];
+static unsigned int block_reloc_count;
+// Marks an entry of block_relocs as 64 bit pointer to guest code instead
+#define RELOC_INSN_PTR 0x80000000
+
+/* Translated calls push the return address and the pointer to the
+   instruction there, so that translation_next_bx can skip looking it up
+   if it's the target. The pointers depend on the address mapping, so it's
+   cleared whenever that or the access permissions change. */
+#define RETURN_STACK_SIZE 16 // Also in asmcode_x86_64.S
+struct return_prediction {
+    uint32_t pc;
+    void *ptr; // NULL if empty
+};
+struct return_prediction return_stack[RETURN_STACK_SIZE] __asm__("return_stack");
+uint32_t return_stack_top __asm__("return_stack_top"); // Byte offset of the top entry
+
+/* Results of the jump table lookups done by translation_next and
+   translation_next_thumb, indexed by bits 2-9 of the PC. A hit enters the
+   translation right away, which mostly helps computed jumps (jump tables,
+   mov pc, rX) landing on the same few targets again and again. Entries
+   point into translations, so they're cleared whenever any get dropped. */
+#define BRANCH_CACHE_SIZE 256 // Also in asmcode_x86_64.S
+struct branch_target {
+    uint32_t pc; // Bit 0 set for Thumb
+    uint32_t cycles; // To add to cycle_count_delta, like translation_next does
+    void *insn_ptr, *entry, *code;
+};
+struct branch_target branch_cache[BRANCH_CACHE_SIZE] __asm__("branch_cache");
+
+static void branch_cache_clear() {
+    // A PC belonging to another entry never matches
+    for (unsigned int i = 0; i < BRANCH_CACHE_SIZE; i++)
+        branch_cache[i].pc = (i + 1) % BRANCH_CACHE_SIZE * 4;
+}
+
+// tcache_reserve evicts a region if the current one is full
+static void reserve(size_t code, size_t jtbl) {
+    unsigned int region = tcache.current;
+    tcache_reserve(code, jtbl);
+    if (tcache.current != region)
+        branch_cache_clear();
+}
+
+/* Direct links between translations, at most two per translation (the
+   branch and the fall through). Link n belongs to translation n / 2 and
+   is in the list of links to its target translation. */
+struct chain_link {
+    uint32_t site; // Offset of the patchable jump in insn_buffer
+    int next; // Next link to the same target, -1 for none
+};
+static struct chain_link chain_links[MAX_TRANSLATIONS * 2];
+static int chain_head[MAX_TRANSLATIONS];
+
+// Virtual address each translation was made for, start_ptr is the physical one
+static uint32_t translation_pc[MAX_TRANSLATIONS];
 
 #define REG_ARG1 EDI
 #define REG_ARG2 ESI
@@ -43,11 +125,16 @@ static inline void emit_byte(uint8_t b)    { *out++ = b; }
 static inline void emit_word(uint16_t w)   { *(uint16_t *)out = w; out += 2; }
 static inline void emit_dword(uint32_t dw) { *(uint32_t *)out = dw; out += 4; }
 
+static inline void emit_reloc(int imm_size) {
+    block_relocs[block_reloc_count++] = (out - block_code) | imm_size << 16;
+}
+
 /*This is a hack:
  * -regs not saved
  * -stack not aligned */
 static inline void emit_call_nosave(uintptr_t target) {
     emit_byte(0xE8);
+    emit_reloc(0);
     int64_t diff = target - ((uintptr_t) out + 4);
     if(diff > INT32_MAX || diff < INT32_MIN)
         assert(false); //Distance doesn't fit into immediate
@@ -75,6 +162,7 @@ static inline void emit_call(uintptr_t target) {
 
 static inline void emit_jump(uintptr_t target) {
     emit_byte(0xE9);
+    emit_reloc(0);
     int64_t diff = target - ((uintptr_t) out + 4);
     if(diff > INT32_MAX || diff < INT32_MIN)
         assert(false);
@@ -105,6 +193,43 @@ static void emit_modrm_armreg(int r, int armreg) {
     emit_modrm_base_offset(r, EBX, (uint8_t *)&arm.reg[armreg] - (uint8_t *)&arm);
 }
 
+/* Register mapping.
+   The ARM registers used most by a block are kept in host registers while it
+   runs. The mapping is the same for the whole block, so it doesn't matter at
+   which instruction the block gets entered: translation_next and chained
+   exits go through the entry code of the translation, which loads all mapped
+   registers and then jumps to the address in %rcx.
+   Modified registers are written back before calling helpers, which may
+   look at arm.reg or not return at all (data aborts), and at block exits. */
+#define REGMAP_HOST_REGS 4
+// R12D-R15D, callee saved so the helpers keep them intact
+static const int8_t regmap_host[REGMAP_HOST_REGS] = { 12, 13, 14, 15 };
+// Host register an ARM register is mapped to, -1 if not mapped
+static int8_t regmap_v2h[15];
+// Mapped ARM registers which may have been modified since the last write back
+static uint16_t regmap_dirty;
+
+static inline void regmap_mark_dirty(int armreg) {
+    if (regmap_v2h[armreg] >= 0)
+        regmap_dirty |= 1 << armreg;
+}
+
+/* Emits an instruction with armreg as r/m operand, which is either the host
+   register it is mapped to or arm.reg. Two-byte opcodes are given as 0x0Fxx. */
+static void emit_armreg_op(int opcode, int r, int armreg) {
+    if (armreg < 0 || armreg > 14) error("translation f***up");
+    int host = regmap_v2h[armreg];
+    if (host >= 0)
+        emit_byte(0x41); // REX.B
+    if (opcode > 0xFF)
+        emit_byte(opcode >> 8);
+    emit_byte(opcode);
+    if (host >= 0)
+        emit_byte(0xC0 | r << 3 | (host & 7));
+    else
+        emit_modrm_armreg(r, armreg);
+}
+
 // ----------------------------------------------------------------------
 
 static void emit_mov_x86reg_immediate(int x86reg, int imm) {
@@ -128,21 +253,21 @@ static void emit_alu_x86reg_immediate(int aluop, int x86reg, int imm) {
 }
 
 static void emit_mov_armreg_immediate(int armreg, int imm) {
-    emit_byte(0xC7);
-    emit_modrm_armreg(0, armreg);
+    emit_armreg_op(0xC7, 0, armreg);
     emit_dword(imm);
+    regmap_mark_dirty(armreg);
 }
 
 static void emit_alu_armreg_immediate(int aluop, int armreg, int imm) {
     if (imm >= -0x80 && imm < 0x80) {
-        emit_byte(0x83);
-        emit_modrm_armreg(aluop, armreg);
+        emit_armreg_op(0x83, aluop, armreg);
         emit_byte(imm);
     } else {
-        emit_byte(0x81);
-        emit_modrm_armreg(aluop, armreg);
+        emit_armreg_op(0x81, aluop, armreg);
         emit_dword(imm);
     }
+    if (aluop != CMP)
+        regmap_mark_dirty(armreg);
 }
 
 static inline void emit_mov_x86reg_x86reg(int dest, int src) {
@@ -156,23 +281,22 @@ static inline void emit_alu_x86reg_x86reg(int aluop, int dest, int src) {
 }
 
 static inline void emit_mov_x86reg_armreg(int x86reg, int armreg) {
-    emit_byte(0x8B);
-    emit_modrm_armreg(x86reg, armreg);
+    emit_armreg_op(0x8B, x86reg, armreg);
 }
 
 static inline void emit_alu_x86reg_armreg(int aluop, int x86reg, int armreg) {
-    emit_byte(0x03 | aluop << 3);
-    emit_modrm_armreg(x86reg, armreg);
+    emit_armreg_op(0x03 | aluop << 3, x86reg, armreg);
 }
 
 static inline void emit_mov_armreg_x86reg(int armreg, int x86reg) {
-    emit_byte(0x89);
-    emit_modrm_armreg(x86reg, armreg);
+    emit_armreg_op(0x89, x86reg, armreg);
+    regmap_mark_dirty(armreg);
 }
 
 static inline void emit_alu_armreg_x86reg(int aluop, int armreg, int x86reg) {
-    emit_byte(0x01 | aluop << 3);
-    emit_modrm_armreg(x86reg, armreg);
+    emit_armreg_op(0x01 | aluop << 3, x86reg, armreg);
+    if (aluop != CMP)
+        regmap_mark_dirty(armreg);
 }
 
 static inline void emit_unary_x86reg(int unop, int x86reg) {
@@ -181,19 +305,18 @@ static inline void emit_unary_x86reg(int unop, int x86reg) {
 }
 
 static inline void emit_unary_armreg(int unop, int armreg) {
-    emit_byte(0xF7);
-    emit_modrm_armreg(unop, armreg);
+    emit_armreg_op(0xF7, unop, armreg);
+    if (unop == NOT || unop == NEG)
+        regmap_mark_dirty(armreg);
 }
 
 static inline void emit_test_armreg_immediate(int armreg, int imm) {
-    emit_byte(0xF7);
-    emit_modrm_armreg(0, armreg);
+    emit_armreg_op(0xF7, 0, armreg);
     emit_dword(imm);
 }
 
 static inline void emit_test_armreg_x86reg(int armreg, int x86reg) {
-    emit_byte(0x85);
-    emit_modrm_armreg(x86reg, armreg);
+    emit_armreg_op(0x85, x86reg, armreg);
 }
 
 static inline void emit_test_x86reg_x86reg(int reg1, int reg2) {
@@ -220,18 +343,17 @@ static void emit_shift_x86reg(int shiftop, int x86reg, int count) {
 
 static void emit_shift_armreg(int shiftop, int armreg, int count) {
     if (count == SHIFT_BY_CL) {
-        emit_byte(0xD3);
-        emit_modrm_armreg(shiftop, armreg);
+        emit_armreg_op(0xD3, shiftop, armreg);
     } else if (count == 0) {
         /* no-op */
+        return;
     } else if (count == 1) {
-        emit_byte(0xD1);
-        emit_modrm_armreg(shiftop, armreg);
+        emit_armreg_op(0xD1, shiftop, armreg);
     } else {
-        emit_byte(0xC1);
-        emit_modrm_armreg(shiftop, armreg);
+        emit_armreg_op(0xC1, shiftop, armreg);
         emit_byte(count);
     }
+    regmap_mark_dirty(armreg);
 }
 
 static inline void emit_mov_x86reg8_immediate(int x86reg, int immediate) {
@@ -251,7 +373,17 @@ static inline void emit_alu_x86reg8_flag(int aluop, int x86reg, void *flagptr) {
     emit_byte(0x02 | aluop << 3);
     emit_modrm_base_offset(x86reg, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
 }
+
+// Flags the current instruction doesn't need to store, see flags_liveness
+static uint8_t flags_dead;
+
+static inline bool flag_dead(void *flagptr) {
+    return flags_dead >> ((uint8_t *)flagptr - &arm.cpsr_n) & 1;
+}
+
 static inline void emit_mov_flag_immediate(void *flagptr, int imm) {
+    if (flag_dead(flagptr))
+        return;
     emit_byte(0xC6);
     emit_modrm_base_offset(0, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
     emit_byte(imm);
@@ -259,24 +391,293 @@ static inline void emit_mov_flag_immediate(void *flagptr, int imm) {
 enum { SETO = 0x90, SETNO, SETB,  SETAE, SETZ, SETNZ, SETBE, SETA,
        SETS,        SETNS, SETPE, SETPO, SETL, SETGE, SETLE, SETG };
 static inline void emit_setcc_flag(int setcc, void *flagptr) {
+    if (flag_dead(flagptr))
+        return;
     emit_byte(0x0F);
     emit_byte(setcc);
     emit_modrm_base_offset(0, EBX, (uint8_t *)flagptr - (uint8_t *)&arm);
 }
 
+static inline void emit_rip_relative(void *target, int imm_size) {
+    emit_reloc(imm_size);
+    int64_t diff = (uintptr_t)target - ((uintptr_t) out + 4 + imm_size);
+    if(diff > INT32_MAX || diff < INT32_MIN)
+        assert(false);
+
+    emit_dword(diff);
+}
+
+// For a call returning to ret_pc (with bit 0 set for Thumb), clobbers ECX, EDX, R8 and the flags
+static void emit_return_push(uint32_t ret_pc, void *ret_ptr) {
+    // ret_ptr is only known to be right in the same page, see block_continues
+    if (!(ret_pc & 0x3FE))
+        return;
+
+    emit_byte(0x8B); emit_byte(0x0D); // mov return_stack_top(%rip), %ecx
+    emit_rip_relative(&return_stack_top, 0);
+    emit_byte(0x83); emit_byte(0xC1); emit_byte(sizeof(struct return_prediction)); // add $16, %ecx
+    emit_byte(0x81); emit_byte(0xE1); // and $mask, %ecx
+    emit_dword((RETURN_STACK_SIZE - 1) * sizeof(struct return_prediction));
+    emit_byte(0x89); emit_byte(0x0D); // mov %ecx, return_stack_top(%rip)
+    emit_rip_relative(&return_stack_top, 0);
+    emit_byte(0x48); emit_byte(0x8D); emit_byte(0x15); // lea return_stack(%rip), %rdx
+    emit_rip_relative(return_stack, 0);
+    emit_byte(0xC7); emit_byte(0x04); emit_byte(0x0A); // movl $ret_pc, (%rdx,%rcx)
+    emit_dword(ret_pc);
+    emit_byte(0x49); emit_byte(0xB8); // movabs $ret_ptr, %r8
+    block_relocs[block_reloc_count++] = (out - block_code) | RELOC_INSN_PTR;
+    emit_dword((uintptr_t)ret_ptr); emit_dword((uintptr_t)ret_ptr >> 32);
+    emit_byte(0x4C); emit_byte(0x89); emit_byte(0x44); emit_byte(0x0A); // mov %r8, 8(%rdx,%rcx)
+    emit_byte(offsetof(struct return_prediction, ptr));
+}
+
+// Stores modified mapped registers to arm.reg, doesn't touch flags or EAX
+static void emit_regmap_writeback() {
+    for (int reg = 0; reg < 15; reg++) {
+        if (!(regmap_dirty >> reg & 1))
+            continue;
+        emit_byte(0x44); // REX.R
+        emit_byte(0x89);
+        emit_modrm_armreg(regmap_v2h[reg] & 7, reg);
+    }
+}
+
+/* Records the entered instruction in the trace ring, in front of the entry
+   code while tracing. Clobbers EAX, EDX, R8 and the flags. */
+static void emit_trace_entry() {
+    emit_byte(0x48); emit_byte(0x8B); emit_byte(0x05); // mov in_translation_pc_ptr(%rip), %rax
+    emit_rip_relative(&in_translation_pc_ptr, 0);
+    if (translating_thumb) {
+        emit_byte(0x48); emit_byte(0x83); emit_byte(0xC8); emit_byte(1); // or $1, %rax
+    }
+    emit_byte(0x8B); emit_byte(0x15); // mov trace_pos(%rip), %edx
+    emit_rip_relative(&trace_pos, 0);
+    emit_byte(0x4C); emit_byte(0x8D); emit_byte(0x05); // lea trace_ring(%rip), %r8
+    emit_rip_relative(trace_ring, 0);
+    emit_byte(0x49); emit_byte(0x89); emit_byte(0x04); emit_byte(0xD0); // mov %rax, (%r8,%rdx,8)
+    emit_byte(0xFF); emit_byte(0xC2); // inc %edx
+    emit_byte(0x81); emit_byte(0xE2); // and $mask, %edx
+    emit_dword(TRACE_ENTRIES - 1);
+    emit_byte(0x89); emit_byte(0x15); // mov %edx, trace_pos(%rip)
+    emit_rip_relative(&trace_pos, 0);
+}
+
+// Entry code of a translation, see "Register mapping"
+static void emit_regmap_entry() {
+    for (int reg = 0; reg < 15; reg++) {
+        if (regmap_v2h[reg] < 0)
+            continue;
+        emit_byte(0x44); // REX.R
+        emit_byte(0x8B);
+        emit_modrm_armreg(regmap_v2h[reg] & 7, reg);
+    }
+    emit_word(0xE1FF); // jmp *%rcx
+}
+
+// Leaves the translation, target is one of the translation_next variants
+static void emit_exit_jump(uintptr_t target) {
+    emit_regmap_writeback();
+    emit_jump(target);
+}
+
+enum mem_access { READ_BYTE, READ_HALF, READ_WORD, WRITE_BYTE, WRITE_HALF, WRITE_WORD };
+
+/* Accesses memory at the address in REG_ARG1 (EDI), storing REG_ARG2 (ESI)
+   or loading zero extended into EAX. Pointer entries of addr_cache are
+   handled inline like in the *_asm helpers, which only get called for the
+   rest: invalid entries, MMIO and writes needing a write_action.
+   Clobbers EAX, R8 and the flags. */
+static void emit_memory_access(enum mem_access access) {
+    static const uintptr_t helpers[] = {
+        (uintptr_t)read_byte_asm, (uintptr_t)read_half_asm, (uintptr_t)read_word_asm,
+        (uintptr_t)write_byte_asm, (uintptr_t)write_half_asm, (uintptr_t)write_word_asm
+    };
+    bool is_write = access >= WRITE_BYTE;
+    enum mem_access size = access % 3; // The READ_ value of the same size
+
+    if (size == READ_HALF)
+        emit_alu_x86reg_immediate(AND, REG_ARG1, ~1);
+
+    // %rax = addr_cache[(addr >> 10) << 1 | is_write]
+    emit_mov_x86reg_x86reg(EAX, REG_ARG1);
+    emit_shift_x86reg(SHR, EAX, 10);
+    emit_alu_x86reg_x86reg(ADD, EAX, EAX);
+    emit_byte(0x4C); emit_byte(0x8B); emit_byte(0x05); // mov addr_cache(%rip), %r8
+    emit_rip_relative(&addr_cache, 0);
+    emit_byte(0x49); emit_byte(0x8B); emit_byte(0x44); emit_byte(0xC0); // mov disp8(%r8,%rax,8), %rax
+    emit_byte(is_write ? sizeof(ac_entry) : 0);
+
+    emit_byte(0xA8); emit_byte(AC_FLAGS); // test $AC_FLAGS, %al
+    emit_byte(JNZ); emit_byte(0);
+    uint8_t *not_ptr = out, *needs_action = NULL;
+
+    if (is_write && !block_protected) {
+        // Flags are per word, DO_WRITE_ACTION fits into the lowest byte
+        emit_byte(0x4C); emit_byte(0x8D); emit_byte(0x04); emit_byte(0x38); // lea (%rax,%rdi), %r8
+        emit_byte(0x49); emit_byte(0x83); emit_byte(0xE0); emit_byte(0xFC); // and $-4, %r8
+        emit_byte(0x41); emit_byte(0xF6); emit_byte(0x80); // testb $DO_WRITE_ACTION, RAM_FLAGS(%r8)
+        emit_dword(MEM_MAXSIZE);
+        emit_byte(DO_WRITE_ACTION);
+        emit_byte(JNZ); emit_byte(0);
+        needs_action = out;
+    }
+    if (is_write) {
+        if (size == READ_BYTE) {
+            emit_byte(0x40); emit_byte(0x88); // mov %sil, (%rax,%rdi)
+        } else {
+            if (size == READ_HALF)
+                emit_byte(0x66);
+            emit_byte(0x89); // mov %esi / %si, (%rax,%rdi)
+        }
+    } else {
+        if (size == READ_WORD) {
+            emit_byte(0x8B); // mov (%rax,%rdi), %eax
+        } else {
+            emit_byte(0x0F); emit_byte(size == READ_BYTE ? 0xB6 : 0xB7); // movzb / movzw (%rax,%rdi), %eax
+        }
+    }
+    emit_byte(is_write ? 0x34 : 0x04);
+    emit_byte(0x38);
+
+    emit_byte(0xEB); emit_byte(5); // jmp over the call
+    not_ptr[-1] = out - not_ptr;
+    if (needs_action)
+        needs_action[-1] = out - needs_action;
+    emit_call_nosave(helpers[access]);
+}
+
+/* A chained exit jumps directly into the translation of a static branch
+   target and does the same bookkeeping as translation_next:
+
+       mov   $pc, %eax
+   site:
+       jmp   slow / fast        // Offset 0 while not linked, 5 once linked
+   slow:
+       jmp   translation_next
+   fast:
+       mov   %eax, ARM_PC(%rbx)
+       cmpl  $0, cycle_count_delta(%rip)
+       jns   slow
+       cmpl  $0, cpu_events(%rip)
+       jnz   slow
+       movabs $target_ptr, %rcx
+       mov   %rcx, in_translation_pc_ptr(%rip)
+       addl  $cycles, cycle_count_delta(%rip)
+       lea   target(%rip), %rcx
+       jmp   entry              // Or target, if entry has nothing to load
+
+   Everything depending on the target is filled in by chain_link only. */
+struct chain_exit {
+    uint8_t *site, *end;
+    uint32_t pc;
+    uint32_t *target_ptr;
+};
+
+// Returns the instruction at pc if there is an ARM translation to link to
+static uint32_t *chain_target(uint32_t pc) {
+    uintptr_t entry = (uintptr_t)addr_cache[(pc >> 10) << 1];
+    uint32_t *ptr = (uint32_t *)(entry + pc);
+    if ((entry & AC_FLAGS) || (RAM_FLAGS(ptr) & (RF_CODE_TRANSLATED | RF_CODE_THUMB)) != RF_CODE_TRANSLATED
+        || !tcache_same_region(RAM_FLAGS(ptr) >> RFS_TRANSLATION_INDEX))
+        return NULL;
+
+    return ptr;
+}
+
+static bool emit_chained_exit(uint32_t pc, struct chain_exit *exit) {
+    emit_regmap_writeback();
+    emit_mov_x86reg_immediate(EAX, pc);
+
+    // Thumb translations are not chained (yet)
+    if (translating_thumb) {
+        emit_jump((uintptr_t)translation_next_thumb);
+        return false;
+    }
+
+    // Linking is up to translate_install for the compiler thread
+    uint32_t *ptr = bg_current ? NULL : chain_target(pc);
+    if (!ptr && !bg_current) {
+        emit_jump((uintptr_t)translation_next);
+        return false;
+    }
+
+    exit->site = out;
+    exit->pc = pc;
+    exit->target_ptr = ptr;
+    emit_byte(0xE9);
+    emit_dword(0);
+    uint8_t *slow = out;
+    emit_jump((uintptr_t)translation_next);
+
+    emit_byte(0x89);
+    emit_modrm_base_offset(EAX, EBX, (uint8_t *)&arm.reg[15] - (uint8_t *)&arm);
+    emit_byte(0x83); emit_byte(0x3D);
+    emit_rip_relative(&cycle_count_delta, 1);
+    emit_byte(0);
+    emit_byte(JNS); emit_byte(slow - (out + 1));
+    emit_byte(0x83); emit_byte(0x3D);
+    emit_rip_relative(&cpu_events, 1);
+    emit_byte(0);
+    emit_byte(JNZ); emit_byte(slow - (out + 1));
+    emit_byte(0x48); emit_byte(0xB9);
+    emit_dword(0); emit_dword(0); // Target pointer, filled in by chain_link
+    emit_byte(0x48); emit_byte(0x89); emit_byte(0x0D);
+    emit_rip_relative(&in_translation_pc_ptr, 0);
+    emit_byte(0x81); emit_byte(0x05);
+    emit_rip_relative(&cycle_count_delta, 4);
+    emit_dword(0); // Cycles, filled in by chain_link
+    emit_byte(0x48); emit_byte(0x8D); emit_byte(0x0D);
+    emit_dword(0); // Target, filled in by chain_link
+    emit_byte(0xE9);
+    emit_dword(0); // Entry, filled in by chain_link
+    exit->end = out;
+    return true;
+}
+
+// Links the chained exit to its target, which has to be translated already
+static void chain_link(int link, struct chain_exit *exit) {
+    int index = RAM_FLAGS(exit->target_ptr) >> RFS_TRANSLATION_INDEX;
+    struct translation *target = &translation_table[index];
+    uint8_t *target_code = target->jump_table[exit->target_ptr - target->start_ptr];
+    uint8_t *entry = (uint8_t *)target->unused;
+
+    *(uint32_t **)(exit->end - 37) = exit->target_ptr;
+    *(uint32_t *)(exit->end - 16) = target->end_ptr - exit->target_ptr;
+    *(int32_t *)(exit->end - 9) = target_code - (exit->end - 5);
+    // Entry code without registers to load is just "jmp *%rcx"
+    *(int32_t *)(exit->end - 4) = (entry[0] == 0xFF ? target_code : entry) - exit->end;
+    *(int32_t *)(exit->site + 1) = 5;
+
+    chain_links[link].site = exit->site - insn_buffer;
+    chain_links[link].next = chain_head[index];
+    chain_head[index] = link;
+}
+
+// Makes all chained exits into the translation go through translation_next again
+static void chain_unlink_all(int index) {
+    for (int link = chain_head[index]; link >= 0; link = chain_links[link].next)
+        *(int32_t *)(insn_buffer + chain_links[link].site + 1) = 0;
+
+    chain_head[index] = -1;
+}
+
 bool translate_init()
 {
     if(!insn_buffer)
     {
         insn_buffer = os_alloc_executable(INSN_BUFFER_SIZE);
-        insn_bufptr = insn_buffer;
+        tcache_init(MAX_TRANSLATIONS, INSN_BUFFER_SIZE, JTBL_BUFFER_SIZE);
+        branch_cache_clear();
     }
 
     return !!insn_buffer;
 }
 
+static void bg_stop();
+
 void translate_deinit()
 {
+    bg_stop();
     if(!insn_buffer)
         return;
 
@@ -284,39 +685,514 @@ void translate_deinit()
     insn_buffer = NULL;
 }
 
-void translate(uint32_t start_pc, uint32_t *start_insnp) {
-    out = insn_bufptr;
-    outj = jtbl_bufptr;
+/* Translation store: if translate_store_open got called, translations are
+   saved to a file and next time loaded from it instead of translating the
+   block again.
+   Code in insn_buffer only refers to the emulator through the displacements
+   in block_relocs and to other translations through chained exits, which
+   are not linked yet when it's saved. So the displacements get stored
+   relative to &arm and the exits are linked again when loading. Pointers
+   into guest code (RELOC_INSN_PTR) are stored relative to the block. */
+struct stored_translation {
+    uint32_t code_size;
+    uint16_t insns; // Jump table entries
+    uint16_t relocs;
+    uint8_t exits;
+    uint8_t no_translate; // The instruction after the end got RF_CODE_NO_TRANSLATE
+    uint16_t pad;
+    /* Followed by
+       uint32_t relocs[relocs]; // Like block_relocs
+       struct stored_exit exits[exits];
+       uint16_t jump_table[insns]; // Code offsets
+       uint8_t code[code_size]; */
+};
+
+struct stored_exit {
+    uint32_t pc;
+    uint16_t site, end; // Code offsets
+};
+
+static uint8_t store_buffer[sizeof(struct stored_translation) + sizeof(block_relocs)
+                            + 2 * sizeof(struct stored_exit) + BLOCK_JTBL_MAX * sizeof(uint16_t) + BLOCK_CODE_MAX];
+
+bool translate_store_open(const char *path) {
+    // Stored code can only be used by an emulator with the same layout
+    const uintptr_t symbols[] = {
+        (uintptr_t)translation_next, (uintptr_t)translation_next_bx, (uintptr_t)translation_next_thumb,
+        (uintptr_t)read_byte_asm, (uintptr_t)read_half_asm, (uintptr_t)read_word_asm,
+        (uintptr_t)write_byte_asm, (uintptr_t)write_half_asm, (uintptr_t)write_word_asm,
+        (uintptr_t)get_cpsr, (uintptr_t)set_cpsr, (uintptr_t)get_spsr, (uintptr_t)set_spsr,
+        (uintptr_t)arm_shift_proc, (uintptr_t)&addr_cache, (uintptr_t)&cycle_count_delta,
+        (uintptr_t)&cpu_events, (uintptr_t)&in_translation_pc_ptr,
+        (uintptr_t)return_stack, (uintptr_t)&return_stack_top,
+        (uintptr_t)translate, (uintptr_t)translate_fix_pc
+    };
+    intptr_t layout[sizeof(symbols) / sizeof(*symbols) + 2];
+    for (unsigned int i = 0; i < sizeof(symbols) / sizeof(*symbols); i++)
+        layout[i] = symbols[i] - (uintptr_t)&arm;
+    layout[sizeof(symbols) / sizeof(*symbols)] = sizeof(arm);
+    // Stores don't have the checks then
+    layout[sizeof(symbols) / sizeof(*symbols) + 1] = protect_translated_code;
+
+    uint32_t fingerprint[8];
+    sha256_digest(layout, sizeof(layout), fingerprint);
+    return tstore_open(path, fingerprint);
+}
+
+void translate_store_close() {
+    tstore_close();
+}
+
+/* Packs the translation t, which got emitted up to out, into buf in the
+   format of the store. Returns the size, 0 if it can't be moved elsewhere. */
+static size_t pack_translation(uint8_t *buf, const struct translation *t, struct chain_exit *exits, int num_exits, bool no_translate) {
+    uint8_t *code = (uint8_t *)t->unused;
+    struct stored_translation *st = (struct stored_translation *)buf;
+    st->code_size = out - code;
+    st->insns = ((uint8_t *)t->end_ptr - (uint8_t *)t->start_ptr) / (translating_thumb ? 2 : 4);
+    st->relocs = block_reloc_count;
+    st->exits = num_exits;
+    st->no_translate = no_translate;
+    st->pad = 0;
+
+    uint32_t *relocs = (uint32_t *)(st + 1);
+    struct stored_exit *stored_exits = (struct stored_exit *)(relocs + st->relocs);
+    uint16_t *jump_table = (uint16_t *)(stored_exits + num_exits);
+    uint8_t *stored_code = (uint8_t *)(jump_table + st->insns);
+
+    memcpy(stored_code, code, st->code_size);
+    for (unsigned int i = 0; i < block_reloc_count; i++) {
+        uint32_t offset = block_relocs[i] & 0xFFFF;
+        relocs[i] = block_relocs[i];
+        if (block_relocs[i] & RELOC_INSN_PTR) {
+            // Relative to the start of the block, which is in the same page
+            *(uint64_t *)(stored_code + offset) = *(uint64_t *)(code + offset) - (uintptr_t)t->start_ptr;
+            continue;
+        }
+
+        uintptr_t next = (uintptr_t)code + offset + 4 + (block_relocs[i] >> 16);
+        int64_t target = next + *(int32_t *)(code + offset) - (uintptr_t)&arm;
+        if (target > INT32_MAX || target < INT32_MIN)
+            return 0;
+
+        *(int32_t *)(stored_code + offset) = target;
+    }
+    for (int i = 0; i < num_exits; i++) {
+        stored_exits[i].pc = exits[i].pc;
+        stored_exits[i].site = exits[i].site - code;
+        stored_exits[i].end = exits[i].end - code;
+    }
+    for (unsigned int i = 0; i < st->insns; i++)
+        jump_table[i] = (uint8_t *)t->jump_table[i] - code;
+
+    return stored_code + st->code_size - buf;
+}
+
+static void store_translation(const struct tstore_key *key, int index, struct chain_exit *exits, int num_exits, bool no_translate) {
+    struct translation *t = &translation_table[index];
+    // The key only covers the page the block starts in
+    if ((key->start_pc & 0x3FF) + ((uint8_t *)t->end_ptr - (uint8_t *)t->start_ptr) > 0x400)
+        return;
+
+    size_t size = pack_translation(store_buffer, t, exits, num_exits, no_translate);
+    if (size)
+        tstore_add(key, store_buffer, size);
+}
+
+/* Puts the translation packed by pack_translation at st into place for the
+   block at start_insnp, which may be max_bytes long. Returns the index, or -1
+   if it doesn't fit or translate_block would have stopped earlier. */
+static int unpack_translation(uint32_t start_pc, uint32_t *start_insnp, bool thumb,
+                              const struct stored_translation *st, size_t size, unsigned int max_bytes) {
+    const uint32_t *relocs = (const uint32_t *)(st + 1);
+    const struct stored_exit *stored_exits = (const struct stored_exit *)(relocs + st->relocs);
+    const uint16_t *jump_table = (const uint16_t *)(stored_exits + st->exits);
+    const uint8_t *stored_code = (const uint8_t *)(jump_table + st->insns);
+    int insn_size = thumb ? 2 : 4;
+    if (size < sizeof(*st) || st->insns == 0 || st->exits > 2 || st->code_size > BLOCK_CODE_MAX
+        || st->insns * insn_size > max_bytes
+        || stored_code + st->code_size != (const uint8_t *)st + size)
+        return -1;
+
+    // Same checks as in translate_block, which would stop translating there
+    uint32_t *end_insnp = (uint32_t *)((uint8_t *)start_insnp + st->insns * insn_size);
+    for (uint32_t *ptr = (uint32_t *)((uintptr_t)start_insnp & ~3); ptr < end_insnp; ptr++)
+        if (RAM_FLAGS(ptr) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_NO_TRANSLATE | RF_CODE_TRANSLATED))
+            return -1;
+
+    reserve(st->code_size, st->insns);
+    int index = tcache_next_index();
+    uint8_t *code = &insn_buffer[tcache_code_offset()];
+    uint8_t **jtbl = &jtbl_buffer[tcache_jtbl_offset()];
+
+    memcpy(code, stored_code, st->code_size);
+    for (unsigned int i = 0; i < st->relocs; i++) {
+        uint32_t offset = relocs[i] & 0xFFFF;
+        if (relocs[i] & RELOC_INSN_PTR) {
+            uint64_t rel = *(uint64_t *)(code + offset);
+            if (offset + 8 > st->code_size || rel >= max_bytes)
+                return -1;
+
+            *(uint64_t *)(code + offset) = (uintptr_t)start_insnp + rel;
+            continue;
+        }
+
+        uintptr_t next = (uintptr_t)code + offset + 4 + (relocs[i] >> 16);
+        int64_t diff = (uintptr_t)&arm + *(int32_t *)(code + offset) - next;
+        if (offset + 4 > st->code_size || diff > INT32_MAX || diff < INT32_MIN)
+            return -1;
+
+        *(int32_t *)(code + offset) = diff;
+    }
+    for (unsigned int i = 0; i < st->insns; i++)
+        jtbl[i] = code + jump_table[i];
+
+    for (uint8_t *ptr = (uint8_t *)start_insnp; ptr < (uint8_t *)end_insnp; ptr += insn_size)
+        RAM_FLAGS((uintptr_t)ptr & ~3) |= (RF_CODE_TRANSLATED | (thumb ? RF_CODE_THUMB : 0) | index << RFS_TRANSLATION_INDEX);
+    if (st->no_translate)
+        RAM_FLAGS(end_insnp) |= RF_CODE_NO_TRANSLATE;
+
+    translation_table[index].unused     = (uintptr_t) code;
+    translation_table[index].jump_table = (void**) jtbl;
+    translation_table[index].start_ptr  = start_insnp;
+    translation_table[index].end_ptr    = end_insnp;
+    translation_pc[index] = start_pc;
+
+    tcache_commit(code + st->code_size - insn_buffer, jtbl + st->insns - jtbl_buffer);
+    tperf_add(code, st->code_size, start_pc, thumb);
+
+    chain_head[index] = -1;
+    for (int i = 0; i < st->exits; i++) {
+        struct chain_exit exit = { code + stored_exits[i].site, code + stored_exits[i].end,
+                                   stored_exits[i].pc, chain_target(stored_exits[i].pc) };
+        if (exit.target_ptr)
+            chain_link(index * 2 + i, &exit);
+    }
+
+    return index;
+}
+
+// Returns false if there's no stored translation which can be used instead of translating
+static bool load_translation(const struct tstore_key *key, uint32_t *start_insnp) {
+    const struct tstore_record *record = tstore_find(key);
+    if (!record)
+        return false;
+
+    int index = unpack_translation(key->start_pc, start_insnp, translating_thumb, (const struct stored_translation *)(record + 1),
+                                   record->size, 0x400 - (key->start_pc & 0x3FF));
+    if (index < 0)
+        return false;
+
+    next_index = index;
+    return true;
+}
+
+/* Background translation, see translate_queue in translate.h. The jobs go
+   around a ring: translate_queue fills in the first part on the emulation
+   thread, the compiler thread translates the copy of the code into bg_code
+   and packs the result like pack_translation does for the store, and
+   translate_install puts it into place. */
+#define BG_JOBS 8
+struct bg_job {
+    uint32_t start_pc;
+    uint32_t *start_insnp;
+    bool thumb;
+    bool protect; // protect_translated_code
+    unsigned int generation; // bg_generation
+    unsigned int bytes; // How far the block may go, see block_continues
+    // Copy of the words from start_insnp & ~3 on and their RAM_FLAGS
+    uint32_t code[BLOCK_BYTES_MAX / 4 + 1];
+    uint32_t flags[BLOCK_BYTES_MAX / 4 + 1];
+
+    // Filled in by the compiler thread
+    size_t size; // Of the packed translation, 0 if nothing got translated
+    bool no_translate; // An instruction got RF_CODE_NO_TRANSLATE, the first or the one after the block
+    enum translate_unimpl unimpl_class;
+    uint8_t packed[sizeof(store_buffer)];
+};
+static struct bg_job bg_jobs[BG_JOBS];
+// Counters of the jobs ever queued, translated and installed (or discarded)
+static unsigned int bg_queued, bg_done, bg_installed;
+// Incremented by flush_translations, jobs queued before are outdated
+static unsigned int bg_generation;
+static bool bg_running, bg_quit;
+static pthread_t bg_thread;
+static pthread_mutex_t bg_mutex = PTHREAD_MUTEX_INITIALIZER; // For the counters and bg_quit
+static pthread_cond_t bg_wake = PTHREAD_COND_INITIALIZER;
+/* Held while translating, by both threads: the state of the emitter and of
+   the block being translated is static */
+static pthread_mutex_t translator_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t bg_code[BLOCK_CODE_MAX];
+static uint8_t *bg_jtbl[BLOCK_JTBL_MAX];
+
+// What translate_block and scan_block see of the code: a job's copy or the memory itself
+static inline uint32_t block_flags(uint32_t *flagsp) {
+    if (!bg_current)
+        return RAM_FLAGS(flagsp);
+    return bg_current->flags[flagsp - (uint32_t *)((uintptr_t)bg_current->start_insnp & ~3)];
+}
+
+static inline uint32_t block_word(uint32_t *insnp) {
+    if (!bg_current)
+        return *insnp;
+    return bg_current->code[insnp - bg_current->start_insnp];
+}
+
+static inline uint16_t block_half(uint32_t *insnp) {
+    if (!bg_current)
+        return *(uint16_t *)insnp;
+    uint8_t *first = (uint8_t *)((uintptr_t)bg_current->start_insnp & ~3);
+    return *(uint16_t *)((uint8_t *)bg_current->code + ((uint8_t *)insnp - first));
+}
+
+// Instructions of the block being translated as found by scan_block
+static struct tir_insn scan_ir[BLOCK_JTBL_MAX];
+static unsigned int scan_count;
+
+/* Whether the block starting at start_pc may go on with the instruction at
+   pc, as far as its address goes. It may continue into the following 1KB
+   page if the MMU maps that right behind the previous one, so that insnp
+   is still the right pointer. If the mapping of either page changes later,
+   flush_remapped_translations drops the translation. */
+static bool block_continues(uint32_t start_pc, uint32_t pc, const void *insnp) {
+    uint32_t offset = pc - (start_pc & ~0x3FF);
+    if (offset >= BLOCK_BYTES_MAX)
+        return false;
+    // translate_queue looked at the mapping already
+    if (bg_current)
+        return pc - start_pc < bg_current->bytes;
+    // Only check once at the start of the page
+    if (offset < 0x400 || (pc & 0x3FF))
+        return true;
+
+    return phys_mem_ptr(mmu_translate(pc, false, NULL, NULL), 0x400) == insnp;
+}
+
+/* Decodes the instructions of the block starting at insnp, up to the first
+   one which ends it, and runs the passes on them. translate_block may stop
+   earlier, but not later. */
+static void scan_block(uint32_t pc, uint32_t *insnp) {
+    uint32_t start_pc = pc;
+    int insn_size = translating_thumb ? 2 : 4;
+
+    for (scan_count = 0; block_continues(start_pc, pc, insnp); pc += insn_size, insnp = (uint32_t *)((uint8_t *)insnp + insn_size)) {
+        if (block_flags((uint32_t *)((uintptr_t)insnp & ~3)) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE))
+            break;
+
+        struct tir_insn *ir = &scan_ir[scan_count++];
+        if (translating_thumb)
+            tir_decode_thumb(block_half(insnp), pc, ir);
+        else
+            tir_decode(block_word(insnp), pc, false, ir);
+        if (tir_ends_block(ir))
+            break;
+    }
+    tir_fold_constants(scan_ir, scan_count);
+}
+
+/* Chooses the registers to map for the block found by scan_block. A register
+   needs to be used at least twice to be worth loading on entry. */
+static void regmap_choose() {
+    unsigned int uses[16] = {0};
+    for (unsigned int i = 0; i < scan_count; i++)
+        tir_reg_uses(&scan_ir[i], uses);
+
+    memset(regmap_v2h, -1, sizeof(regmap_v2h));
+    regmap_dirty = 0;
+    for (unsigned int i = 0; i < REGMAP_HOST_REGS; i++) {
+        int best = -1;
+        for (int reg = 0; reg < 15; reg++) {
+            if (regmap_v2h[reg] < 0 && uses[reg] >= 2 && (best < 0 || uses[reg] > uses[best]))
+                best = reg;
+        }
+        if (best < 0)
+            break;
+        regmap_v2h[best] = regmap_host[i];
+    }
+}
+
+// How many of the scanned instructions flags_liveness looked at
+static unsigned int scan_live_count;
+
+// Finds flag stores whose values get overwritten, see tir_flags_liveness
+static void flags_liveness(unsigned int count) {
+    scan_live_count = count;
+    tir_flags_liveness(scan_ir, count);
+}
+
+/* Makes flags_liveness consider the first count instructions only, for a
+   block which got shorter than scanned. Returns whether this revives a
+   flag store in there, which means the block has to be translated again. */
+static bool flags_liveness_truncate(unsigned int count) {
+    if (count >= scan_live_count)
+        return false;
+
+    uint8_t dead[BLOCK_JTBL_MAX];
+    for (unsigned int i = 0; i < count; i++)
+        dead[i] = scan_ir[i].flags_dead;
+    flags_liveness(count);
+    for (unsigned int i = 0; i < count; i++) {
+        if (dead[i] != scan_ir[i].flags_dead)
+            return true;
+    }
+    return false;
+}
+
+/* Returns the jump to take if the condition holds, testing the flags in
+   EFLAGS, or 0 if not all required flags are in there. carry_set is the
+   jump for ARM's C set, as ARM's subtractions have it inverted. */
+static int host_condition(int cond, uint8_t host_flags, int carry_set) {
+    uint8_t needed;
+    int jcc;
+    switch (cond >> 1) {
+        case 0: needed = FLAG_Z;                   jcc = JZ;        break; /* EQ, NE */
+        case 1: needed = FLAG_C;                   jcc = carry_set; break; /* CS, CC */
+        case 2: needed = FLAG_N;                   jcc = JS;        break; /* MI, PL */
+        case 3: needed = FLAG_V;                   jcc = JO;        break; /* VS, VC */
+        case 4: /* HI, LS */
+            if (carry_set != JAE)
+                return 0;
+            needed = FLAG_C | FLAG_Z;              jcc = JA;        break;
+        case 5: needed = FLAG_N | FLAG_V;          jcc = JGE;       break; /* GE, LT */
+        case 6: needed = FLAG_N | FLAG_Z | FLAG_V; jcc = JG;        break; /* GT, LE */
+        default: return 0;
+    }
+    if ((host_flags & needed) != needed)
+        return 0;
+    return jcc ^ (cond & 1);
+}
+
+// Whether the instruction calls a helper, which needs arm.reg to be up to date
+static bool insn_calls_helper(const struct tir_insn *ir) {
+    return ir->op == TIR_LDST || ir->op == TIR_LDM_STM || ir->op == TIR_MRS || ir->op == TIR_MSR;
+}
+
+// Gives up on the instruction, counting it in translate_stats.unimpl
+#define UNIMPL(class) do { unimpl_class = class; goto unimpl; } while (0)
+
+static bool translate_block(uint32_t start_pc, uint32_t *start_insnp) {
+    struct tstore_key key;
+    // Stored translations don't record
+    bool use_tstore = !bg_current && tstore_is_open() && !trace_enabled;
+    if (use_tstore) {
+        tstore_make_key(&key, start_pc, start_insnp, translating_thumb);
+        if (load_translation(&key, start_insnp))
+            return true;
+    }
+
+    // The compiler thread doesn't touch the translation cache, translate_install does
+    if (!bg_current) {
+        reserve(BLOCK_CODE_MAX, BLOCK_JTBL_MAX);
+        next_index = tcache_next_index();
+        block_protected = protect_translated_code;
+    } else {
+        next_index = -1;
+        block_protected = bg_current->protect;
+    }
+    scan_block(start_pc, start_insnp);
+    flags_liveness(scan_count);
+    bool no_translate = false;
+
+retry:
+    out = bg_current ? bg_code : &insn_buffer[tcache_code_offset()];
+    block_code = out;
+    block_reloc_count = 0;
+    outj = bg_current ? bg_jtbl : &jtbl_buffer[tcache_jtbl_offset()];
+    uint8_t *code_end = bg_current ? bg_code + BLOCK_CODE_MAX : &insn_buffer[tcache_code_end()];
+    uint8_t **jtbl_start = outj;
     uint32_t pc = start_pc;
     uint32_t *insnp = start_insnp;
 
-    if (next_index >= MAX_TRANSLATIONS)
-        error("too many translations");
-
-    uint8_t *insn_start;
+    regmap_choose();
+    uint8_t *entry = out;
+    // translate_queue leaves blocks to trace to the emulation thread
+    if (!bg_current && trace_enabled)
+        emit_trace_entry();
+    emit_regmap_entry();
+
+    uint8_t *insn_start, *insn_entry;
+    uint16_t insn_dirty;
+    // Flags the previous instruction left in EFLAGS, see host_condition
+    uint8_t host_flags = 0, prev_host_flags;
+    int host_carry = JB;
     int stop_here = 0;
+    struct chain_exit exits[2];
+    int num_exits = 0, insn_exits;
+    unsigned int insn_relocs;
+    int insn_size = translating_thumb ? 2 : 4;
+    enum translate_unimpl unimpl_class = UNIMPL_OTHER;
     while (1) {
-        if (out >= &insn_buffer[INSN_BUFFER_SIZE - 1000])
-            error("Out of instruction space");
-        if (outj >= &jtbl_buffer[sizeof jtbl_buffer / sizeof *jtbl_buffer])
-            error("Out of jump table space");
-
-        insn_start = out;
+        insn_start = insn_entry = out;
+        insn_exits = num_exits;
+        insn_relocs = block_reloc_count;
+        insn_dirty = regmap_dirty;
+        uint32_t *flagsp = (uint32_t *)((uintptr_t)insnp & ~3);
+        unsigned int insn_index = (pc - start_pc) / insn_size;
+        flags_dead = insn_index < scan_live_count ? scan_ir[insn_index].flags_dead : 0;
+        prev_host_flags = host_flags;
+        host_flags = 0;
+
+        // Can only happen with huge blocks, the end is reserved by tcache_reserve
+        if (out >= code_end - 1000)
+            goto branch_conditional;
 
-        if ((pc ^ start_pc) & ~0x3FF) {
+        if (!block_continues(start_pc, pc, insnp)) {
             //printf("stopping translation - end of page\n");
             goto branch_conditional;
         }
-        if (RAM_FLAGS(insnp) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_TRANSLATED | RF_CODE_NO_TRANSLATE)) {
+        if (block_flags(flagsp) & (RF_EXEC_BREAKPOINT | RF_EXEC_DEBUG_NEXT | RF_EXEC_HACK | RF_CODE_NO_TRANSLATE)) {
             //printf("stopping translation - at breakpoint %x (%x)\n", pc);
             goto branch_conditional;
         }
-        uint32_t insn = *insnp;
+        // The first half of the word may belong to this Thumb translation already
+        if ((block_flags(flagsp) & RF_CODE_TRANSLATED)
+            && (!translating_thumb || block_flags(flagsp) >> RFS_TRANSLATION_INDEX != (uint32_t)next_index))
+            goto branch_conditional;
+
+        // The scan found where the block ends at the latest
+        if (insn_index >= scan_count)
+            goto branch_conditional;
+        const struct tir_insn *ir = &scan_ir[insn_index];
+        int cond = ir->cond;
+        uint8_t *cond_jmp_offset = NULL, *host_skip_offset = NULL;
+        // Whether skipping the instruction takes a rel32 jump
+        bool long_skip = false;
+        if (ir->op == TIR_NONE)
+            UNIMPL(ir->unimpl);
+
+        /* Write back before the condition check, so that it's done on both paths.
+           MSR may switch to other banked registers, they must not be overwritten
+           by a write back later on. */
+        bool calls_helper = insn_calls_helper(ir);
+        if (calls_helper) {
+            emit_regmap_writeback();
+            regmap_dirty = 0;
+        }
+
+        /* Coming from the previous instruction, the flags may still be in EFLAGS.
+           Entering through the jump table skips this part, which is why the
+           write back above must not be jumped over. */
+        uint8_t *host_cond_offset = NULL;
+        int host_jcc = (cond < 0x0E && !calls_helper) ? host_condition(cond, prev_host_flags, host_carry) : 0;
+        // Load/store multiple of more than a few registers doesn't fit into rel8
+        long_skip = ir->op == TIR_LDM_STM;
+        if (host_jcc) {
+            emit_byte(host_jcc);
+            emit_byte(0);
+            host_cond_offset = out;
+            if (long_skip) {
+                emit_byte(0xE9); // JMP rel32
+                emit_dword(0);
+            } else {
+                emit_byte(0xEB); // JMP rel8
+                emit_byte(0);
+            }
+            host_skip_offset = out;
+            insn_entry = out;
+        }
 
-        /* Condition code */
-        int cond = insn >> 28;
         int jcc = JZ;
-        uint8_t *cond_jmp_offset = NULL;
         switch (cond >> 1) {
             case 0: /* EQ (Z), NE (!Z) */
                 emit_cmp_flag_immediate(&arm.cpsr_z, 0);
@@ -347,620 +1223,545 @@ void translate(uint32_t start_pc, uint32_t *start_insnp) {
                 jcc = JNZ;
                 break;
             case 7: /* AL */
-                if (cond & 1) goto unimpl;
+                if (cond & 1) UNIMPL(UNIMPL_COND);
                 goto no_condition;
         }
         /* If condition not met, jump around code.
          * (If ARM condition code is inverted, invert x86 code too) */
-        emit_byte(jcc ^ (cond & 1));
-        emit_byte(0);
+        if (long_skip) {
+            emit_byte(0x0F);
+            emit_byte((jcc ^ (cond & 1)) + 0x10); // Jcc rel32
+            emit_dword(0);
+        } else {
+            emit_byte(jcc ^ (cond & 1));
+            emit_byte(0);
+        }
         cond_jmp_offset = out;
+        if (host_cond_offset)
+            host_cond_offset[-1] = out - host_cond_offset;
 no_condition:
 
-        if ((insn & 0xE000090) == 0x0000090) {
-            if ((insn & 0xFC000F0) == 0x0000090) {
+        switch (ir->op) {
+            case TIR_MOV_IMM:
+                emit_mov_armreg_immediate(ir->rd, ir->imm);
+                break;
+            case TIR_MUL:
                 /* MUL, MLA - 32x32->32 multiplications */
-                int left_reg  = insn & 15;
-                int right_reg = insn >> 8 & 15;
-                int acc_reg   = insn >> 12 & 15;
-                int dest_reg  = insn >> 16 & 15;
-                if (left_reg == 15 || right_reg == 15 || acc_reg == 15 || dest_reg == 15)
-                    goto unimpl;
-
-                emit_mov_x86reg_armreg(EAX, left_reg);
-                emit_unary_armreg(MUL, right_reg);
-                if (insn & 0x0200000)
-                    emit_alu_x86reg_armreg(ADD, EAX, acc_reg);
-                emit_mov_armreg_x86reg(dest_reg, EAX);
-
-                if (insn & 0x0100000) {
-                    if (!(insn & 0x0200000))
+                emit_mov_x86reg_armreg(EAX, ir->rm);
+                emit_unary_armreg(MUL, ir->rs);
+                if (ir->opts & TIR_ACCUMULATE)
+                    emit_alu_x86reg_armreg(ADD, EAX, ir->rn);
+                emit_mov_armreg_x86reg(ir->rd, EAX);
+
+                if (ir->opts & TIR_SETCC) {
+                    if (!(ir->opts & TIR_ACCUMULATE))
                         emit_test_x86reg_x86reg(EAX, EAX);
                     emit_setcc_flag(SETS, &arm.cpsr_n);
                     emit_setcc_flag(SETZ, &arm.cpsr_z);
+                    if (cond == 0x0E)
+                        host_flags = FLAG_N | FLAG_Z;
                 }
-            } else if ((insn & 0xF8000F0) == 0x0800090) {
+                break;
+            case TIR_MULL:
                 /* UMULL, UMLAL, SMULL, SMLAL: 32x32 to 64 multiplications */
-                uint32_t left_reg  = insn & 15;
-                uint32_t right_reg = insn >> 8  & 15;
-                uint32_t reg_lo    = insn >> 12 & 15;
-                uint32_t reg_hi    = insn >> 16 & 15;
-
-                if (left_reg == 15 || right_reg == 15 || reg_lo == 15 || reg_hi == 15)
-                    goto unimpl;
-                if (reg_lo == reg_hi)
-                    goto unimpl;
-                if (insn & 0x0100000) // set flags
-                    goto unimpl;
-
-                emit_mov_x86reg_armreg(EAX, left_reg);
-                emit_unary_armreg((insn & 0x0400000) ? IMUL : MUL, right_reg);
-                if (insn & 0x0200000) {
-                    /* Accumulate */
-                    emit_alu_armreg_x86reg(ADD, reg_lo, EAX);
-                    emit_alu_armreg_x86reg(ADC, reg_hi, EDX);
-                } else {
-                    emit_mov_armreg_x86reg(reg_lo, EAX);
-                    emit_mov_armreg_x86reg(reg_hi, EDX);
-                }
-            } else {
-                enum { INVALID, H, SB, SH } type;
-                int is_load = insn & (1 << 20);
-                type = insn >> 5 & 3;
-                if (type == INVALID || (!is_load && type != H))
-                    // multiply, SWP, or doubleword access
-                    goto unimpl;
-
-                int post_index = !(insn & (1 << 24));
-                int offset_op = (insn & (1 << 23)) ? ADD : SUB;
-                int pre_index = insn & (1 << 21);
-                int base_reg = insn >> 16 & 15;
-                int data_reg = insn >> 12 & 15;
-
-                if (base_reg == 15 || data_reg == 15)
-                    goto unimpl;
-
-                if (pre_index || post_index) {
-                    if (pre_index && post_index) goto unimpl;
-                    if (base_reg == 15) goto unimpl;
-                    if (is_load && base_reg == data_reg) goto unimpl;
+                emit_mov_x86reg_armreg(EAX, ir->rm);
+                emit_unary_armreg((ir->opts & TIR_SIGNED) ? IMUL : MUL, ir->rs);
+                if (ir->opts & TIR_ACCUMULATE) {
+                    emit_alu_x86reg_armreg(ADD, EAX, ir->rd);
+                    emit_alu_x86reg_armreg(ADC, EDX, ir->rn);
                 }
+                emit_mov_armreg_x86reg(ir->rd, EAX);
+                emit_mov_armreg_x86reg(ir->rn, EDX);
 
-                if (insn & (1 << 22)) {
-                    // Offset is immediate
-                    int offset = (insn & 0x0F) | (insn >> 4 & 0xF0);
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
-                    if (!post_index && offset != 0)
-                        emit_alu_x86reg_immediate(offset_op, REG_ARG1, offset);
-                } else {
-                    // Offset is register
-                    int offset_reg = insn & 0x0F;
-                    if (offset_reg == 15)
-                        goto unimpl;
-                    if (post_index || pre_index)
-                        goto unimpl;
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
-                    emit_alu_x86reg_armreg(offset_op, REG_ARG1, offset_reg);
+                if (ir->opts & TIR_SETCC) {
+                    // N and Z of the 64 bit result, only Z stays in EFLAGS
+                    emit_test_x86reg_x86reg(EDX, EDX);
+                    emit_setcc_flag(SETS, &arm.cpsr_n);
+                    emit_alu_x86reg_x86reg(OR, EAX, EDX);
+                    emit_setcc_flag(SETZ, &arm.cpsr_z);
+                    if (cond == 0x0E)
+                        host_flags = FLAG_Z;
                 }
-
-                if (is_load) {
-                    if (type == SB) {
-                        emit_call_nosave((uintptr_t)read_byte_asm);
-                        // movsx eax,al
-                        emit_word(0xBE0F);
-                        emit_byte(0xC0);
-                    } else {
-                        emit_call_nosave((uintptr_t)read_half_asm);
-                        if (type == SH) {
-                            // cwde
-                            emit_byte(0x98);
-                        }
-                    }
-                    emit_mov_armreg_x86reg(data_reg, EAX);
-                } else {
-                    emit_mov_x86reg_armreg(REG_ARG2, data_reg);
-                    emit_call_nosave((uintptr_t)write_half_asm);
+                break;
+            case TIR_BX:
+                /* BX/BLX, and the second half of Thumb's BL */
+                emit_mov_x86reg_armreg(EAX, ir->rm);
+                if (ir->imm)
+                    emit_alu_x86reg_immediate(ADD, EAX, ir->imm);
+                if (ir->opts & TIR_LINK) {
+                    emit_mov_armreg_immediate(14, ir->link_pc);
+                    emit_return_push(ir->link_pc, (uint8_t *)insnp + insn_size);
                 }
-
-                if (post_index || pre_index)
-                    emit_alu_armreg_immediate(offset_op, base_reg, ((insn & 0x0F) | (insn >> 4 & 0xF0)));
-            }
-        } else if ((insn & 0xD900000) == 0x1000000) {
-            if ((insn & 0xFFFFFD0) == 0x12FFF10) {
-                /* BX/BLX */
-                int target_reg = insn & 15;
-                if (target_reg == 15)
-                    break;
-                emit_mov_x86reg_armreg(EAX, target_reg);
-                if (insn & 0x20)
-                    emit_mov_armreg_immediate(14, pc + 4);
-                emit_jump((uintptr_t)translation_next_bx);
+                if (ir->opts & TIR_TO_THUMB)
+                    emit_alu_x86reg_immediate(OR, EAX, 1);
+                else if (ir->opts & TIR_TO_ARM)
+                    emit_alu_x86reg_immediate(AND, EAX, ~3);
+                emit_exit_jump((uintptr_t)translation_next_bx);
                 stop_here = 1;
-            } else if ((insn & 0xFBF0FFF) == 0x10F0000) {
+                break;
+            case TIR_JUMP:
+                /* Computed jumps: MOV PC, Rm and jump tables with ADD PC, PC, Rm, LSL #n */
+                emit_mov_x86reg_armreg(EAX, ir->op2.reg);
+                if (ir->op2.kind == TIR_SHIFT_IMM)
+                    emit_shift_x86reg(SHL, EAX, ir->op2.amount);
+                if (ir->imm)
+                    emit_alu_x86reg_immediate(ADD, EAX, ir->imm);
+                emit_exit_jump((uintptr_t)translation_next);
+                stop_here = 1;
+                break;
+            case TIR_MRS:
                 /* MRS - move reg <- status */
-                int target_reg = insn >> 12 & 15;
-                if (target_reg == 15)
-                    break;
-                emit_call((insn & 0x0400000) ? (uintptr_t)get_spsr : (uintptr_t)get_cpsr);
-                emit_mov_armreg_x86reg(target_reg, EAX);
-            } else if ((insn & 0xFB0FFF0) == 0x120F000 ||
-                       (insn & 0xFB0F000) == 0x320F000) {
+                emit_call((ir->opts & TIR_SPSR) ? (uintptr_t)get_spsr : (uintptr_t)get_cpsr);
+                emit_mov_armreg_x86reg(ir->rd, EAX);
+                break;
+            case TIR_MSR:
                 /* MSR - move status <- reg/imm */
-                uint32_t mask = 0;
-                if (insn & 0x2000000) {
-                    uint32_t imm = insn & 0xFF;
-                    int rotate = insn >> 7 & 30;
-                    imm = imm >> rotate | imm << (32 - rotate);
-                    emit_mov_x86reg_immediate(REG_ARG1, imm);
-                } else {
-                    int reg = insn & 15;
-                    if (reg == 15)
-                        break;
-                    emit_mov_x86reg_armreg(REG_ARG1, reg);
-                }
-                if (insn & 0x0080000) mask |= 0xFF000000;
-                if (insn & 0x0040000) mask |= 0x00FF0000;
-                if (insn & 0x0020000) mask |= 0x0000FF00;
-                if (insn & 0x0010000) mask |= 0x000000FF;
-                emit_mov_x86reg_immediate(REG_ARG2, mask);
-                emit_call((insn & 0x0400000) ? (uintptr_t)set_spsr : (uintptr_t)set_cpsr);
+                if (ir->op2.kind == TIR_IMM)
+                    emit_mov_x86reg_immediate(REG_ARG1, ir->op2.imm);
+                else
+                    emit_mov_x86reg_armreg(REG_ARG1, ir->op2.reg);
+                emit_mov_x86reg_immediate(REG_ARG2, ir->imm);
+                emit_call((ir->opts & TIR_SPSR) ? (uintptr_t)set_spsr : (uintptr_t)set_cpsr);
                 // If cpsr_c changed, leave translation to check for interrupts
-                if ((insn & 0x0410000) == 0x0010000) {
+                if (!(ir->opts & TIR_SPSR) && (ir->imm & 0xFF)) {
                     emit_mov_x86reg_immediate(EAX, pc + 4);
-                    emit_jump((uintptr_t)translation_next);
+                    emit_exit_jump((uintptr_t)translation_next);
                 }
-            } else if ((insn & 0xFFF0FF0) == 0x16F0F10) {
+                break;
+            case TIR_CLZ:
                 /* CLZ: Count leading zeros */
-                int src_reg = insn & 15;
-                int dst_reg = insn >> 12 & 15;
-                if (src_reg == 15 || dst_reg == 15)
-                    break;
-                emit_word(0xBD0F); // BSR
-                emit_modrm_armreg(EAX, src_reg);
+                emit_armreg_op(0x0FBD, EAX, ir->rm); // BSR
                 emit_word(5 << 8 | JNZ);
                 emit_mov_x86reg_immediate(EAX, 63);
                 emit_alu_x86reg_immediate(XOR, EAX, 31);
-                emit_mov_armreg_x86reg(dst_reg, EAX);
-            } else {
+                emit_mov_armreg_x86reg(ir->rd, EAX);
                 break;
-            }
-        } else if ((insn & 0xC000000) == 0) {
-            /* Data processing instructions */
-            int right_reg = insn & 15;
-            int dest_reg = insn >> 12 & 15;
-            int left_reg = insn >> 16 & 15;
-            int setcc = insn >> 20 & 1;
-            int op = insn >> 21 & 15;
-
-            if (dest_reg == 15 || left_reg == 15)
-                break; // not dealing with this for now
-
-            int set_overflow = -1;
-            int set_carry = -1;
-            int right_is_imm = insn >> 25 & 1;
-            int right_is_reg = 0;
-            uint32_t imm = 0; // value not used, just suppressing uninitialized variable warning
-            if (right_is_imm) {
-                // Right operand is immediate
-                imm = insn & 0xFF;
-                int rotate = insn >> 7 & 30;
-                if (rotate != 0)
-                {
-                    imm = (imm >> rotate) | (imm << (32 - rotate));
-                    set_carry = imm >> 31;
-                }
-            } else if (right_reg == 15) {
-                if (insn & 0xFF0) // Shifted PC?! Not likely.
-                    goto unimpl;
-                imm = pc + 8;
-                right_is_imm = 1;
-            } else {
-                int shift_type = insn >> 5 & 3;
+            case TIR_ALU: {
+                /* Data processing instructions */
+                int right_reg = ir->op2.reg;
+                int dest_reg = ir->rd;
+                int left_reg = ir->rn;
+                int setcc = !!(ir->opts & TIR_SETCC);
+                int op = ir->alu;
+
+                if (left_reg == 15)
+                    UNIMPL(UNIMPL_DATA_PROC); // not dealing with this for now
+
+                int set_overflow = -1;
+                int set_carry = -1;
+                int right_is_imm = 0;
+                int right_is_reg = 0;
+                uint32_t imm = 0; // value not used, just suppressing uninitialized variable warning
                 static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
-                int x86_shift_type = shift_table[shift_type];
-
-                int count = insn >> 7 & 31;
+                int x86_shift_type = shift_table[ir->op2.shift];
+                int count = ir->op2.amount;
                 int shift_need_carry = setcc & ((0xF303 >> op) & 1);
-                if (insn & (1 << 4)) {
-                    if (insn & (1 << 7))
-                        goto unimpl;
-                    /* Register shifted by register.
-                     * ARM's shifts are very different from x86's, unfortunately.
-                     * In x86, only 5 bits of the shift count are used.
-                     * In ARM, 8 bits are used. To implement ARM shifts on x86,
-                     * one must check for the 32-255 cases explicitly.
-                     * This is done in asmcode.S */
-
-                    int shift_reg = count >> 1;
-                    if (shift_reg == 15)
-                        goto unimpl;
-
-                    emit_mov_x86reg_armreg(ECX, shift_reg);
-                    if (shift_type == 3 && !shift_need_carry) {
-                        /* Ignoring flags, ARM's ROR is the same as x86's :) */
-                        count = SHIFT_BY_CL;
-                        goto simple_shift;
-                    }
-
-                    emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_call_nosave(arm_shift_proc[shift_need_carry][shift_type]);
-
-                    shift_need_carry = 0; /* Already set by the function */
-                } else if (count == 0) {
-                    if (shift_type == 0) {
+                switch (ir->op2.kind) {
+                    case TIR_IMM:
+                        imm = ir->op2.imm;
+                        right_is_imm = 1;
+                        set_carry = ir->op2.carry;
+                        shift_need_carry = 0;
+                        break;
+                    case TIR_REG:
                         /* Right operand is just an ARM register */
+                        if (right_reg == 15)
+                            UNIMPL(UNIMPL_DATA_PROC);
                         right_is_reg = 1;
                         shift_need_carry = 0;
-                    } else if (shift_type == 1) {
-                        /* LSR #32 */
-                        if (shift_need_carry) {
-                            emit_mov_x86reg_armreg(EAX, right_reg);
-                            emit_shift_x86reg(SHL, EAX, 1);
+                        break;
+                    case TIR_SHIFT_REG:
+                        /* Register shifted by register.
+                         * ARM's shifts are very different from x86's, unfortunately.
+                         * In x86, only 5 bits of the shift count are used.
+                         * In ARM, 8 bits are used. To implement ARM shifts on x86,
+                         * one must check for the 32-255 cases explicitly.
+                         * This is done in asmcode.S */
+                        emit_mov_x86reg_armreg(ECX, ir->op2.amount);
+                        if (ir->op2.shift == TIR_ROR && !shift_need_carry) {
+                            /* Ignoring flags, ARM's ROR is the same as x86's :) */
+                            count = SHIFT_BY_CL;
+                            goto simple_shift;
                         }
-                        imm = 0;
-                        right_is_imm = 1;
-                    } else if (shift_type == 2) {
-                        /* ASR #32 */
+
                         emit_mov_x86reg_armreg(EAX, right_reg);
-                        emit_shift_x86reg(SAR, EAX, 31);
-                        if (shift_need_carry)
-                            emit_shift_x86reg(SAR, EAX, 1);
-                    } else if (shift_type == 3) {
-                        /* RRX */
+                        emit_call_nosave(arm_shift_proc[shift_need_carry][ir->op2.shift]);
+
+                        shift_need_carry = 0; /* Already set by the function */
+                        break;
+                    case TIR_RRX:
                         emit_mov_x86reg8_immediate(AL, 0);
                         emit_alu_x86reg8_flag(CMP, AL, &arm.cpsr_c);
                         x86_shift_type = RCR;
                         count = 1;
                         goto simple_shift;
-                    }
-                } else {
+                    case TIR_SHIFT_IMM:
+                        if (count == 32 && ir->op2.shift == TIR_LSR) {
+                            /* LSR #32 */
+                            if (shift_need_carry) {
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                                emit_shift_x86reg(SHL, EAX, 1);
+                            }
+                            imm = 0;
+                            right_is_imm = 1;
+                            break;
+                        } else if (count == 32) {
+                            /* ASR #32 */
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                            emit_shift_x86reg(SAR, EAX, 31);
+                            if (shift_need_carry)
+                                emit_shift_x86reg(SAR, EAX, 1);
+                            break;
+                        }
 simple_shift:
-                    if (dest_reg == right_reg && op == 13) {
-                        /* MOV of a shifted register to itself. Do shift in-place */
-                        emit_shift_armreg(x86_shift_type, dest_reg, count);
-                        right_is_reg = 1;
-                    } else {
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                        emit_shift_x86reg(x86_shift_type, EAX, count);
-                    }
+                        if (dest_reg == right_reg && op == 13) {
+                            /* MOV of a shifted register to itself. Do shift in-place */
+                            emit_shift_armreg(x86_shift_type, dest_reg, count);
+                            right_is_reg = 1;
+                        } else {
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                            emit_shift_x86reg(x86_shift_type, EAX, count);
+                        }
+                        break;
                 }
                 if (shift_need_carry)
                     emit_setcc_flag(SETB, &arm.cpsr_c);
-            }
 
-            if (op == 13 || op == 15) {
-                if (right_is_imm) {
-                    if (op == 15)
-                        imm = ~imm;
-                    emit_mov_armreg_immediate(dest_reg, imm);
-                    if (setcc)
-                        goto unimpl;
-                } else if (right_is_reg && dest_reg == right_reg) {
-                    /* MOV/MVN of a register to itself */
-                    if (op == 15) {
-                        if (setcc)
-                            emit_alu_armreg_immediate(XOR, dest_reg, -1);
-                        else
-                            emit_unary_armreg(NOT, dest_reg);
+                if (op == 13 || op == 15) {
+                    if (right_is_imm) {
+                        if (op == 15)
+                            imm = ~imm;
+                        emit_mov_armreg_immediate(dest_reg, imm);
+                        if (setcc) {
+                            emit_mov_flag_immediate(&arm.cpsr_n, imm >> 31);
+                            emit_mov_flag_immediate(&arm.cpsr_z, imm == 0);
+                            if (set_carry >= 0)
+                                emit_mov_flag_immediate(&arm.cpsr_c, set_carry);
+                            setcc = 0;
+                        }
+                    } else if (right_is_reg && dest_reg == right_reg) {
+                        /* MOV/MVN of a register to itself */
+                        if (op == 15) {
+                            if (setcc)
+                                emit_alu_armreg_immediate(XOR, dest_reg, -1);
+                            else
+                                emit_unary_armreg(NOT, dest_reg);
+                        } else {
+                            if (setcc)
+                                emit_alu_armreg_immediate(CMP, dest_reg, 0);
+                        }
                     } else {
+                        if (right_is_reg)
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                        if (op == 15)
+                            emit_unary_x86reg(NOT, EAX);
+                        emit_mov_armreg_x86reg(dest_reg, EAX);
                         if (setcc)
-                            emit_alu_armreg_immediate(CMP, dest_reg, 0);
+                            emit_test_x86reg_x86reg(EAX, EAX);
                     }
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    if (op == 15)
-                        emit_unary_x86reg(NOT, EAX);
-                    emit_mov_armreg_x86reg(dest_reg, EAX);
-                    if (setcc)
-                        emit_test_x86reg_x86reg(EAX, EAX);
-                }
-            } else if (op == 8) { // TST
-                if (right_is_imm) {
-                    emit_test_armreg_immediate(left_reg, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_test_armreg_x86reg(left_reg, EAX);
-                }
-            } else if (op == 10) { // CMP
-                if (right_is_imm) {
-                    emit_alu_armreg_immediate(CMP, left_reg, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_alu_armreg_x86reg(CMP, left_reg, EAX);
-                }
-                set_overflow = SETO;
-                set_carry = SETAE;
-            } else if (op == 9 || op == 11) { // TEQ, CMN
-                int aluop;
-                if (op == 9) { aluop = XOR; }
-                else         { aluop = ADD; set_overflow = SETO; set_carry = SETB; }
-
-                if (right_is_imm) {
-                    emit_mov_x86reg_armreg(EAX, left_reg);
-                    emit_alu_x86reg_immediate(aluop, EAX, imm);
-                } else {
-                    if (right_is_reg)
-                        emit_mov_x86reg_armreg(EAX, right_reg);
-                    emit_alu_x86reg_armreg(aluop, EAX, left_reg);
-                }
-            } else {
-                int aluop;
-                enum { LR = 1, RL = 2 } direction;
-
-                if      (op == 0)  { aluop = AND; direction = LR | RL; }
-                else if (op == 1)  { aluop = XOR; direction = LR | RL; }
-                else if (op == 2)  { aluop = SUB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 3)  { aluop = SUB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 4)  { aluop = ADD; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
-                else if (op == 5)  { aluop = ADC; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
-                else if (op == 6)  { aluop = SBB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 7)  { aluop = SBB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
-                else if (op == 12) { aluop = OR;  direction = LR | RL; }
-                else {
-                    // Convert BIC to AND
+                } else if (op == 8) { // TST
                     if (right_is_imm) {
-                        imm = ~imm;
+                        emit_test_armreg_immediate(left_reg, imm);
                     } else {
-                        if (right_is_reg) {
+                        if (right_is_reg)
                             emit_mov_x86reg_armreg(EAX, right_reg);
-                            right_is_reg = 0;
-                        }
-                        emit_unary_x86reg(NOT, EAX);
+                        emit_test_armreg_x86reg(left_reg, EAX);
                     }
-                    aluop = AND; direction = LR | RL;
-                }
-
-                if (aluop == ADC) {
-                    emit_mov_x86reg8_immediate(CL, 0);
-                    emit_alu_x86reg8_flag(CMP, CL, &arm.cpsr_c);
-                } else if (aluop == SBB) {
-                    emit_cmp_flag_immediate(&arm.cpsr_c, 1);
-                }
+                } else if (op == 10) { // CMP
+                    if (right_is_imm) {
+                        emit_alu_armreg_immediate(CMP, left_reg, imm);
+                    } else {
+                        if (right_is_reg)
+                            emit_mov_x86reg_armreg(EAX, right_reg);
+                        emit_alu_armreg_x86reg(CMP, left_reg, EAX);
+                    }
+                    set_overflow = SETO;
+                    set_carry = SETAE;
+                } else if (op == 9 || op == 11) { // TEQ, CMN
+                    int aluop;
+                    if (op == 9) { aluop = XOR; }
+                    else         { aluop = ADD; set_overflow = SETO; set_carry = SETB; }
 
-                int reg_out = EAX;
-                if (dest_reg == left_reg && (direction & LR)) {
                     if (right_is_imm) {
-                        emit_alu_armreg_immediate(aluop, dest_reg, imm);
+                        emit_mov_x86reg_armreg(EAX, left_reg);
+                        emit_alu_x86reg_immediate(aluop, EAX, imm);
                     } else {
                         if (right_is_reg)
                             emit_mov_x86reg_armreg(EAX, right_reg);
-                        emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
+                        emit_alu_x86reg_armreg(aluop, EAX, left_reg);
                     }
-                } else if (right_is_reg && dest_reg == right_reg && (direction & RL)) {
-                    emit_mov_x86reg_armreg(EAX, left_reg);
-                    emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
                 } else {
-                    if (right_is_imm) {
-                        if (direction & LR) {
-                            emit_mov_x86reg_armreg(EAX, left_reg);
-                            emit_alu_x86reg_immediate(aluop, EAX, imm);
+                    int aluop;
+                    enum { LR = 1, RL = 2 } direction;
+
+                    if      (op == 0)  { aluop = AND; direction = LR | RL; }
+                    else if (op == 1)  { aluop = XOR; direction = LR | RL; }
+                    else if (op == 2)  { aluop = SUB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 3)  { aluop = SUB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 4)  { aluop = ADD; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
+                    else if (op == 5)  { aluop = ADC; direction = LR | RL; set_overflow = SETO; set_carry = SETB; }
+                    else if (op == 6)  { aluop = SBB; direction = LR;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 7)  { aluop = SBB; direction = RL;      set_overflow = SETO; set_carry = SETAE; }
+                    else if (op == 12) { aluop = OR;  direction = LR | RL; }
+                    else {
+                        // Convert BIC to AND
+                        if (right_is_imm) {
+                            imm = ~imm;
                         } else {
-                            if (aluop == SUB && imm == 0) {
-                                if (dest_reg == left_reg) {
-                                    /* RSB reg, reg, 0 is like x86's NEG */
-                                    emit_unary_armreg(NEG, left_reg);
-                                    goto data_proc_done;
-                                }
-                                emit_alu_x86reg_x86reg(XOR, EAX, EAX);
-                            } else {
-                                emit_mov_x86reg_immediate(EAX, imm);
+                            if (right_is_reg) {
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                                right_is_reg = 0;
                             }
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            emit_unary_x86reg(NOT, EAX);
                         }
-                    } else if (right_is_reg) {
-                        if (direction & LR) {
-                            emit_mov_x86reg_armreg(EAX, left_reg);
-                            emit_alu_x86reg_armreg(aluop, EAX, right_reg);
+                        aluop = AND; direction = LR | RL;
+                    }
+
+                    if (aluop == ADC) {
+                        emit_mov_x86reg8_immediate(CL, 0);
+                        emit_alu_x86reg8_flag(CMP, CL, &arm.cpsr_c);
+                    } else if (aluop == SBB) {
+                        emit_cmp_flag_immediate(&arm.cpsr_c, 1);
+                    }
+
+                    int reg_out = EAX;
+                    if (dest_reg == left_reg && (direction & LR)) {
+                        if (right_is_imm) {
+                            emit_alu_armreg_immediate(aluop, dest_reg, imm);
                         } else {
-                            emit_mov_x86reg_armreg(EAX, right_reg);
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            if (right_is_reg)
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                            emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
                         }
+                    } else if (right_is_reg && dest_reg == right_reg && (direction & RL)) {
+                        emit_mov_x86reg_armreg(EAX, left_reg);
+                        emit_alu_armreg_x86reg(aluop, dest_reg, EAX);
                     } else {
-                        if (direction & RL) {
-                            emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                        if (right_is_imm) {
+                            if (direction & LR) {
+                                emit_mov_x86reg_armreg(EAX, left_reg);
+                                emit_alu_x86reg_immediate(aluop, EAX, imm);
+                            } else {
+                                if (aluop == SUB && imm == 0) {
+                                    if (dest_reg == left_reg) {
+                                        /* RSB reg, reg, 0 is like x86's NEG */
+                                        emit_unary_armreg(NEG, left_reg);
+                                        goto data_proc_done;
+                                    }
+                                    emit_alu_x86reg_x86reg(XOR, EAX, EAX);
+                                } else {
+                                    emit_mov_x86reg_immediate(EAX, imm);
+                                }
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            }
+                        } else if (right_is_reg) {
+                            if (direction & LR) {
+                                emit_mov_x86reg_armreg(EAX, left_reg);
+                                emit_alu_x86reg_armreg(aluop, EAX, right_reg);
+                            } else {
+                                emit_mov_x86reg_armreg(EAX, right_reg);
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            }
                         } else {
-                            emit_mov_x86reg_armreg(REG_ARG2, left_reg);
-                            emit_alu_x86reg_x86reg(aluop, REG_ARG2, EAX);
-                            reg_out = REG_ARG2;
+                            if (direction & RL) {
+                                emit_alu_x86reg_armreg(aluop, EAX, left_reg);
+                            } else {
+                                emit_mov_x86reg_armreg(REG_ARG2, left_reg);
+                                emit_alu_x86reg_x86reg(aluop, REG_ARG2, EAX);
+                                reg_out = REG_ARG2;
+                            }
                         }
+                        emit_mov_armreg_x86reg(dest_reg, reg_out);
                     }
-                    emit_mov_armreg_x86reg(dest_reg, reg_out);
                 }
-            }
 data_proc_done:
-            if (setcc) {
-                emit_setcc_flag(SETS, &arm.cpsr_n);
-                emit_setcc_flag(SETZ, &arm.cpsr_z);
-                if (set_carry >= 0) {
-                    if (set_carry < 2)
-                        emit_mov_flag_immediate(&arm.cpsr_c, set_carry);
-                    else
-                        emit_setcc_flag(set_carry, &arm.cpsr_c);
+                if (setcc) {
+                    emit_setcc_flag(SETS, &arm.cpsr_n);
+                    emit_setcc_flag(SETZ, &arm.cpsr_z);
+                    if (set_carry >= 0) {
+                        if (set_carry < 2)
+                            emit_mov_flag_immediate(&arm.cpsr_c, set_carry);
+                        else
+                            emit_setcc_flag(set_carry, &arm.cpsr_c);
+                    }
+                    if (set_overflow >= 0)
+                        emit_setcc_flag(set_overflow, &arm.cpsr_v);
+
+                    if (cond == 0x0E) {
+                        host_flags = FLAG_N | FLAG_Z | (set_carry >= 2 ? FLAG_C : 0) | (set_overflow >= 0 ? FLAG_V : 0);
+                        host_carry = set_carry == SETAE ? JAE : JB;
+                    }
                 }
-                if (set_overflow >= 0)
-                    emit_setcc_flag(set_overflow, &arm.cpsr_v);
-            }
-        } else if ((insn & 0xC000000) == 0x4000000) {
-            /* Byte/word memory access */
-            int post_index = !(insn & (1 << 24));
-            int offset_op = (insn & (1 << 23)) ? ADD : SUB;
-            int is_byteop = insn & (1 << 22);
-            int pre_index = insn & (1 << 21);
-            int is_load   = insn & (1 << 20);
-            int base_reg = insn >> 16 & 15;
-            int data_reg = insn >> 12 & 15;
-
-            if (pre_index || post_index) {
-                // Pre-indexed addressing is broken (maybe data abort issues?)
-                if (pre_index) break;
-                if (pre_index && post_index) break;
-                if (base_reg == 15) break;
-                if (is_load && base_reg == data_reg) break;
+                break;
             }
-
-            if (insn & (1 << 25)) {
-                // Offset is register
-
-                int offset_reg = insn & 15;
-                int shift_type = insn >> 5 & 3;
-                static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
-                int count;
-
-                if (insn & (1 << 4))
-                    // reg shifted by reg
-                    break;
-
-                // reg shifted by immediate
-                count = insn >> 7 & 31;
-                if (count == 0 && shift_type != 0)
-                    break; // special shift
-
-                if (base_reg == 15)
-                    emit_mov_x86reg_immediate(REG_ARG1, pc + 8);
+            case TIR_LDST: {
+                /* Memory access */
+                int offset_op = (ir->opts & TIR_SUBTRACT) ? SUB : ADD;
+                bool post_index = ir->opts & TIR_POST;
+                bool writeback = ir->opts & TIR_WRITEBACK;
+                const struct tir_operand *offset = &ir->op2;
+
+                if (offset->kind == TIR_RRX || (offset->kind == TIR_SHIFT_IMM && offset->amount == 32))
+                    UNIMPL(UNIMPL_LOAD_STORE); // special shift
+
+                if (ir->rn == TIR_NO_REG)
+                    emit_mov_x86reg_immediate(REG_ARG1, ir->imm);
+                else if (ir->rn == 15)
+                    emit_mov_x86reg_immediate(REG_ARG1, ir->pc_read);
                 else
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
+                    emit_mov_x86reg_armreg(REG_ARG1, ir->rn);
 
-                if (count == 0 && !pre_index && !post_index) {
-                    emit_alu_x86reg_armreg(offset_op, REG_ARG1, offset_reg);
+                if (offset->kind == TIR_IMM) {
+                    if (offset->imm != 0 && !post_index)
+                        emit_alu_x86reg_immediate(offset_op, REG_ARG1, offset->imm);
+                } else if (offset->kind == TIR_REG && !writeback) {
+                    emit_alu_x86reg_armreg(offset_op, REG_ARG1, offset->reg);
                 } else {
-                    emit_mov_x86reg_armreg(ECX, offset_reg);
-                    emit_shift_x86reg(shift_table[shift_type], ECX, count);
+                    // The load may overwrite the offset register, keep it for the write back
+                    static const uint8_t shift_table[] = { SHL, SHR, SAR, ROR };
+                    emit_mov_x86reg_armreg(ECX, offset->reg);
+                    if (offset->kind == TIR_SHIFT_IMM)
+                        emit_shift_x86reg(shift_table[offset->shift], ECX, offset->amount);
                     if (!post_index)
                         emit_alu_x86reg_x86reg(offset_op, REG_ARG1, ECX);
                 }
-            } else {
-                // Offset is immediate
-                int offset = insn & 0xFFF;
-                if (base_reg == 15) {
-                    if (offset_op == SUB)
-                        offset = -offset;
-                    emit_mov_x86reg_immediate(REG_ARG1, pc + 8 + offset);
+
+                if (ir->opts & TIR_LOAD) {
+                    if (ir->size == 1 && (ir->opts & TIR_SIGNED)) {
+                        emit_memory_access(READ_BYTE);
+                        // movsx eax,al
+                        emit_word(0xBE0F);
+                        emit_byte(0xC0);
+                    } else if (ir->size == 2) {
+                        emit_memory_access(READ_HALF);
+                        if (ir->opts & TIR_SIGNED) {
+                            // cwde
+                            emit_byte(0x98);
+                        }
+                    } else {
+                        emit_memory_access(ir->size == 1 ? READ_BYTE : READ_WORD);
+                    }
+                    if (ir->rd != 15)
+                        emit_mov_armreg_x86reg(ir->rd, EAX);
                 } else {
-                    emit_mov_x86reg_armreg(REG_ARG1, base_reg);
-                    if (offset != 0 && !post_index)
-                        emit_alu_x86reg_immediate(offset_op, REG_ARG1, offset);
+                    if (ir->rd == 15)
+                        emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
+                    else
+                        emit_mov_x86reg_armreg(REG_ARG2, ir->rd);
+                    emit_memory_access(ir->size == 1 ? WRITE_BYTE : ir->size == 2 ? WRITE_HALF : WRITE_WORD);
                 }
-            }
 
-            if (is_load) {
-                /* LDR/LDRB instruction */
-                emit_call_nosave(is_byteop ? (uintptr_t)read_byte_asm : (uintptr_t)read_word_asm);
-                if (data_reg != 15)
-                    emit_mov_armreg_x86reg(data_reg, EAX);
-            } else {
-                /* STR/STRB instruction */
-                if (data_reg == 15)
-                    emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
-                else
-                    emit_mov_x86reg_armreg(REG_ARG2, data_reg);
-                emit_call_nosave(is_byteop ? (uintptr_t)write_byte_asm : (uintptr_t)write_word_asm);
-            }
+                if (writeback) {
+                    if (offset->kind == TIR_IMM)
+                        emit_alu_armreg_immediate(offset_op, ir->rn, offset->imm);
+                    else
+                        emit_alu_armreg_x86reg(offset_op, ir->rn, ECX);
+                }
 
-            if (pre_index || post_index) { // Writeback
-                if (insn & (1 << 25)) // Register offset
-                    emit_alu_armreg_x86reg(offset_op, base_reg, ECX);
-                else // Immediate offset
-                    emit_alu_armreg_immediate(offset_op, base_reg, insn & 0xFFF);
+                if ((ir->opts & TIR_LOAD) && ir->rd == 15) {
+                    emit_exit_jump((uintptr_t)translation_next_bx);
+                    stop_here = 1;
+                }
+                break;
             }
+            case TIR_LDM_STM: {
+                /* Load/store multiple */
+                bool load = ir->opts & TIR_LOAD;
+                int addr_reg = ir->rn;
+                int reg, offset, wb_offset, count;
+                bool loaded_addr_reg = false;
+
+                for (reg = count = 0; reg < 16; reg++)
+                    count += (ir->regs >> reg & 1);
+
+                if (ir->opts & TIR_INCREMENT) {
+                    wb_offset = count * 4;
+                    offset = 0;
+                    if (ir->opts & TIR_BEFORE) // Preincrement
+                        offset += 4;
+                } else {
+                    wb_offset = count * -4;
+                    offset = wb_offset;
+                    if (!(ir->opts & TIR_BEFORE)) // Postdecrement
+                        offset += 4;
+                }
 
-            if (is_load && data_reg == 15) {
-                emit_jump((uintptr_t)translation_next_bx);
-                stop_here = 1;
-            }
-        } else if ((insn & 0xE000000) == 0x8000000) {
-            /* Load/store multiple */
-            int writeback = insn & (1 << 21);
-            int load      = insn & (1 << 20);
-            int reg, offset, wb_offset, count;
-            bool loaded_addr_reg = false;
-
-            if (insn & (1 << 22)) // restore CPSR, or use umode regs
-                goto unimpl;
-
-            int addr_reg = insn >> 16 & 15;
-            if (addr_reg == 15)
-                goto unimpl;
-
-            if (writeback && load && insn & (1 << addr_reg))
-                goto unimpl;
-
-            for (reg = count = 0; reg < 16; reg++)
-                count += (insn >> reg & 1);
-
-            if (insn & (1 << 23)) { /* Increasing */
-                wb_offset = count * 4;
-                offset = 0;
-                if (insn & (1 << 24)) // Preincrement
-                    offset += 4;
-            } else { /* Decreasing */
-                wb_offset = count * -4;
-                offset = wb_offset;
-                if (!(insn & (1 << 24))) // Postdecrement
+                emit_mov_x86reg_armreg(EDX, addr_reg);
+                for (reg = 0; reg < 16; reg++) {
+                    if (!(ir->regs >> reg & 1))
+                        continue;
+                    emit_byte(0x8D); // LEA
+                    emit_modrm_base_offset(REG_ARG1, EDX, offset);
+                    if (load) {
+                        emit_call_nosave((uintptr_t)read_word_asm);
+                        if (reg == addr_reg && (ir->regs & ~0u << reg & 0xFFFF)) {
+                            // Loading the address register, but there are still more
+                            // registers to go. In case they cause a data abort, don't
+                            // write to register yet; save it to ECX
+                            emit_mov_x86reg_x86reg(ECX, EAX);
+                            loaded_addr_reg = true;
+                        } else if (reg != 15)
+                            emit_mov_armreg_x86reg(reg, EAX);
+                    } else {
+                        if (reg == 15)
+                            emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
+                        else
+                            emit_mov_x86reg_armreg(REG_ARG2, reg);
+                        emit_call_nosave((uintptr_t)write_word_asm);
+                    }
                     offset += 4;
-            }
-
-            emit_mov_x86reg_armreg(EDX, addr_reg);
-            for (reg = 0; reg < 16; reg++) {
-                if (!(insn >> reg & 1))
-                    continue;
-                emit_byte(0x8D); // LEA
-                emit_modrm_base_offset(REG_ARG1, EDX, offset);
-                if (load) {
-                    emit_call_nosave((uintptr_t)read_word_asm);
-                    if (reg == addr_reg && (insn & ~0u << reg & 0xFFFF)) {
-                        // Loading the address register, but there are still more
-                        // registers to go. In case they cause a data abort, don't
-                        // write to register yet; save it to ECX
-                        emit_mov_x86reg_x86reg(ECX, EAX);
-                        loaded_addr_reg = true;
-                    } else if (reg != 15)
-                        emit_mov_armreg_x86reg(reg, EAX);
-                } else {
-                    if (reg == 15)
-                        emit_mov_x86reg_immediate(REG_ARG2, pc + 12);
-                    else
-                        emit_mov_x86reg_armreg(REG_ARG2, reg);
-                    emit_call_nosave((uintptr_t)write_word_asm);
                 }
-                offset += 4;
-            }
 
-            if (writeback)
-                emit_alu_armreg_immediate(ADD, addr_reg, wb_offset);
+                if (ir->opts & TIR_WRITEBACK)
+                    emit_alu_armreg_immediate(ADD, addr_reg, wb_offset);
 
-            if (loaded_addr_reg)
-                emit_mov_armreg_x86reg(addr_reg, ECX);
+                if (loaded_addr_reg)
+                    emit_mov_armreg_x86reg(addr_reg, ECX);
 
-            if (insn & (1 << 15) && load) {
-                // LDM with PC
-                emit_jump((uintptr_t)translation_next_bx);
-                stop_here = 1;
+                if ((ir->regs & (1 << 15)) && load) {
+                    // LDM with PC
+                    emit_exit_jump((uintptr_t)translation_next_bx);
+                    stop_here = 1;
+                }
+                break;
             }
-        } else if ((insn & 0xE000000) == 0xA000000) {
-            /* Branch, branch-and-link */
-            if (insn & (1 << 24))
-                emit_mov_armreg_immediate(14, pc + 4);
-            emit_mov_x86reg_immediate(EAX, pc + 8 + ((int32_t)(insn << 8) >> 6));
-            emit_jump((uintptr_t)translation_next);
-            stop_here = 1;
-        } else {
-            break;
+            case TIR_B:
+                /* Branch, branch-and-link */
+                if (ir->opts & TIR_LINK) {
+                    emit_mov_armreg_immediate(14, ir->link_pc);
+                    emit_return_push(ir->link_pc, (uint8_t *)insnp + insn_size);
+                }
+                if (emit_chained_exit(ir->imm, &exits[num_exits]))
+                    num_exits++;
+                stop_here = 1;
+                break;
+            default:
+                UNIMPL(UNIMPL_OTHER);
         }
 
         /* Fill in the conditional jump offset */
         if (cond_jmp_offset) {
-            if (out - cond_jmp_offset > 0x7F)
-                goto unimpl; /* yes, this could happen (with large LDM/STM) */
-            cond_jmp_offset[-1] = out - cond_jmp_offset;
+            if (long_skip)
+                ((int32_t *)cond_jmp_offset)[-1] = out - cond_jmp_offset;
+            else if (out - cond_jmp_offset > 0x7F)
+                UNIMPL(UNIMPL_COND);
+            else
+                cond_jmp_offset[-1] = out - cond_jmp_offset;
+        }
+        if (host_skip_offset) {
+            if (long_skip)
+                ((int32_t *)host_skip_offset)[-1] = out - host_skip_offset;
+            else if (out - host_skip_offset > 0x7F)
+                UNIMPL(UNIMPL_COND);
+            else
+                host_skip_offset[-1] = out - host_skip_offset;
         }
 
-        RAM_FLAGS(insnp) |= (RF_CODE_TRANSLATED | next_index << RFS_TRANSLATION_INDEX);
-        pc += 4;
-        insnp++;
-        *outj++ = insn_start;
+        if (!bg_current)
+            RAM_FLAGS(flagsp) |= (RF_CODE_TRANSLATED | (translating_thumb ? RF_CODE_THUMB : 0) | next_index << RFS_TRANSLATION_INDEX);
+        pc += insn_size;
+        insnp = (uint32_t *)((uint8_t *)insnp + insn_size);
+        *outj++ = insn_entry;
 
         if (stop_here) {
             if (cond == 0x0E)
@@ -971,71 +1772,480 @@ data_proc_done:
     }
 unimpl:
     out = insn_start;
-    RAM_FLAGS(insnp) |= RF_CODE_NO_TRANSLATE;
+    num_exits = insn_exits;
+    block_reloc_count = insn_relocs;
+    regmap_dirty = insn_dirty;
+    // For Thumb, the other half of the word might be translatable
+    if (!translating_thumb || pc == start_pc) {
+        if (bg_current) {
+            bg_current->unimpl_class = unimpl_class;
+        } else {
+            RAM_FLAGS((uintptr_t)insnp & ~3) |= RF_CODE_NO_TRANSLATE;
+            translate_stats.no_translate++;
+            translate_stats.unimpl[unimpl_class]++;
+        }
+        no_translate = true;
+    }
 branch_conditional:
-    emit_mov_x86reg_immediate(EAX, pc);
-    emit_jump((uintptr_t)translation_next);
+    // The block is shorter than scanned, the exit may need flags which didn't get stored
+    if (flags_liveness_truncate((pc - start_pc) / insn_size)) {
+        if (!bg_current)
+            tcache_clear_flags(next_index, start_insnp, insnp);
+        goto retry;
+    }
+    if (emit_chained_exit(pc, &exits[num_exits]))
+        num_exits++;
 branch_unconditional:
+    if (bg_current)
+        bg_current->no_translate = no_translate;
 
     if (pc == start_pc)
-        return;
+        return false;
 
-    int index = next_index++;
+    if (bg_current) {
+        struct translation t = { (uintptr_t) entry, (void**) jtbl_start, start_insnp, insnp };
+        bg_current->size = pack_translation(bg_current->packed, &t, exits, num_exits, no_translate);
+        return true;
+    }
+
+    int index = next_index;
 
     //jump_table[0] is pointer to code on pc=start_ptr
     //jump_table[1] is pointer to code on pc=start_ptr+4
-    translation_table[index].jump_table = (void**) jtbl_bufptr;
+    translation_table[index].unused     = (uintptr_t) entry;
+    translation_table[index].jump_table = (void**) jtbl_start;
     translation_table[index].start_ptr  = start_insnp;
     translation_table[index].end_ptr    = insnp;
+    translation_pc[index] = start_pc;
+
+    tcache_commit(out - insn_buffer, outj - jtbl_buffer);
+    tperf_add(entry, out - entry, start_pc, translating_thumb);
+
+    // Before linking, which patches the code
+    if (use_tstore)
+        store_translation(&key, index, exits, num_exits, no_translate);
+
+    // Only now the table entry is complete, which is needed for links to itself
+    chain_head[index] = -1;
+    for (int i = 0; i < num_exits; i++)
+        chain_link(index * 2 + i, &exits[i]);
+
+    return true;
+}
+
+static void drop_translation(unsigned int index) {
+    // Chained exits into it need to go through translation_next again
+    chain_unlink_all(index);
+    tcache_invalidate(index);
+}
+
+/* With protect_translated_code, stores of translations don't check RAM_FLAGS
+   for a write_action. The host pages with translated code are write protected
+   instead and the first store into one drops all translations in it, which
+   makes the page writable again. */
+#define CODE_PAGE_SIZE 0x1000
+static bool code_page_protected[MEM_MAXSIZE / CODE_PAGE_SIZE];
+static unsigned int code_pages_protected;
+/* Flags of the translation which was running when translate_write_fault
+   dropped it. It goes on until it exits, translate_fix_pc may still need it. */
+static uint32_t dropped_running_flags;
+
+static void stop_protecting_code() {
+    protect_translated_code = false;
+    // Everything translated so far skips the checks, also what's in the store
+    flush_translations();
+    tstore_close();
+}
+
+static void protect_translation(unsigned int index) {
+    if (!protect_translated_code)
+        return;
+
+    // Blocks may continue into the next page
+    size_t first = ((uint8_t *)translation_table[index].start_ptr - mem_and_flags) / CODE_PAGE_SIZE;
+    size_t last = ((uint8_t *)translation_table[index].end_ptr - 1 - mem_and_flags) / CODE_PAGE_SIZE;
+    for (size_t page = first; page <= last; page++) {
+        if (code_page_protected[page])
+            continue;
+
+        if (!os_set_writable(mem_and_flags + page * CODE_PAGE_SIZE, CODE_PAGE_SIZE, false)) {
+            warn("Failed to write protect translated code, checking stores again");
+            stop_protecting_code();
+            return;
+        }
+        code_page_protected[page] = true;
+        code_pages_protected++;
+    }
+}
+
+bool translate_write_fault(void *addr) {
+    uint8_t *ptr = (uint8_t *)addr;
+    if (!mem_and_flags || ptr < mem_and_flags || ptr >= mem_and_flags + MEM_MAXSIZE)
+        return false;
+
+    size_t page = (ptr - mem_and_flags) / CODE_PAGE_SIZE;
+    uint32_t *page_ptr = (uint32_t *)(mem_and_flags + page * CODE_PAGE_SIZE);
+    if (!code_page_protected[page] || !os_set_writable(page_ptr, CODE_PAGE_SIZE, true))
+        return false;
+
+    code_page_protected[page] = false;
+    code_pages_protected--;
+
+    if (in_translation_rsp) {
+        uint32_t flags = RAM_FLAGS((uintptr_t)in_translation_pc_ptr & ~3);
+        if (flags & RF_CODE_TRANSLATED)
+            dropped_running_flags = flags;
+    }
+    for (uint32_t *p = page_ptr; p < page_ptr + CODE_PAGE_SIZE / 4; p += 0x100)
+        tcache_invalidate_page(p, ~0u, drop_translation);
+    branch_cache_clear();
+    return true;
+}
+
+void translation_touch(unsigned int index) {
+    tcache.regions[index / tcache.slots].referenced = true;
+}
+
+void translate(uint32_t start_pc, uint32_t *start_insnp) {
+    if (bg_running)
+        pthread_mutex_lock(&translator_mutex);
+
+    translating_thumb = false;
+    dropped_running_flags = 0;
+    if (translate_block(start_pc, start_insnp))
+        protect_translation(next_index);
+
+    if (bg_running)
+        pthread_mutex_unlock(&translator_mutex);
+}
+
+bool translate_thumb(uint32_t start_pc, uint16_t *start_insnp) {
+    if (bg_running)
+        pthread_mutex_lock(&translator_mutex);
+
+    translating_thumb = true;
+    dropped_running_flags = 0;
+    bool translated = translate_block(start_pc, (uint32_t *)start_insnp);
+    if (translated)
+        protect_translation(next_index);
+
+    if (bg_running)
+        pthread_mutex_unlock(&translator_mutex);
+    return translated;
+}
+
+static void *bg_compile(void *unused) {
+    (void) unused;
+    pthread_mutex_lock(&bg_mutex);
+    while (!bg_quit) {
+        if (bg_done == bg_queued) {
+            pthread_cond_wait(&bg_wake, &bg_mutex);
+            continue;
+        }
+
+        struct bg_job *job = &bg_jobs[bg_done % BG_JOBS];
+        pthread_mutex_unlock(&bg_mutex);
+
+        pthread_mutex_lock(&translator_mutex);
+        bg_current = job;
+        translating_thumb = job->thumb;
+        job->size = 0;
+        job->no_translate = false;
+        translate_block(job->start_pc, job->start_insnp);
+        bg_current = NULL;
+        pthread_mutex_unlock(&translator_mutex);
+
+        pthread_mutex_lock(&bg_mutex);
+        __atomic_store_n(&bg_done, bg_done + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&bg_mutex);
+    return NULL;
+}
+
+static void bg_stop() {
+    if (!bg_running)
+        return;
+
+    pthread_mutex_lock(&bg_mutex);
+    bg_quit = true;
+    pthread_cond_signal(&bg_wake);
+    pthread_mutex_unlock(&bg_mutex);
+    pthread_join(bg_thread, NULL);
 
-    insn_bufptr = out;
-    jtbl_bufptr = outj;
+    // What's left is outdated after translate_deinit anyway
+    bg_running = bg_quit = false;
+    bg_queued = bg_done = bg_installed = 0;
+}
+
+#ifndef __MINGW32__
+/* The child of a fork only has the thread which called it, it starts its own
+   compiler thread. The jobs in flight are lost. */
+static void bg_fork_prepare() {
+    pthread_mutex_lock(&translator_mutex);
+    pthread_mutex_lock(&bg_mutex);
+}
+
+static void bg_fork_parent() {
+    pthread_mutex_unlock(&bg_mutex);
+    pthread_mutex_unlock(&translator_mutex);
+}
+
+static void bg_fork_child() {
+    bg_fork_parent();
+    bg_running = false;
+    bg_queued = bg_done = bg_installed = 0;
+}
+#endif
+
+bool translate_queue(uint32_t start_pc, void *start_insnp, bool thumb) {
+    // Translations which record or get stored are made right away
+    if (trace_enabled || tstore_is_open())
+        return false;
+
+    if (!bg_running) {
+#ifndef __MINGW32__
+        static bool fork_handlers;
+        if (!fork_handlers)
+            fork_handlers = pthread_atfork(bg_fork_prepare, bg_fork_parent, bg_fork_child) == 0;
+#endif
+        if (pthread_create(&bg_thread, NULL, bg_compile, NULL) != 0) {
+            warn("Failed to start the compiler thread, translating on the emulation thread");
+            translate_background = false;
+            return false;
+        }
+        bg_running = true;
+    }
+
+    /* The interpreter goes on with the instructions of the blocks in flight,
+       which would get queued as well otherwise. Until a block is translated,
+       it may go on as far as it can. */
+    unsigned int done = __atomic_load_n(&bg_done, __ATOMIC_ACQUIRE);
+    for (unsigned int i = bg_installed; i != bg_queued; i++) {
+        const struct bg_job *job = &bg_jobs[i % BG_JOBS];
+        uint8_t *start = (uint8_t *)job->start_insnp, *end = start + job->bytes;
+        if (i - bg_installed < done - bg_installed)
+            end = start + (job->size ? ((const struct stored_translation *)job->packed)->insns * (job->thumb ? 2 : 4) : 0);
+        if (start_insnp == job->start_insnp || ((uint8_t *)start_insnp > start && (uint8_t *)start_insnp < end))
+            return true;
+    }
+    // It gets queued again when it runs next time
+    if (bg_queued - bg_installed == BG_JOBS)
+        return true;
+
+    struct bg_job *job = &bg_jobs[bg_queued % BG_JOBS];
+    job->start_pc = start_pc;
+    job->start_insnp = start_insnp;
+    job->thumb = thumb;
+    job->protect = protect_translated_code;
+    job->generation = bg_generation;
+
+    // Like block_continues does it
+    unsigned int bytes = 0x400 - (start_pc & 0x3FF);
+    if (phys_mem_ptr(mmu_translate(start_pc + bytes, false, NULL, NULL), 0x400) == (uint8_t *)start_insnp + bytes)
+        bytes += 0x400;
+    job->bytes = bytes;
+
+    uint32_t *first = (uint32_t *)((uintptr_t)start_insnp & ~3);
+    unsigned int words = ((uint8_t *)start_insnp + bytes - (uint8_t *)first + 3) / 4;
+    memcpy(job->code, first, words * 4);
+    for (unsigned int i = 0; i < words; i++)
+        job->flags[i] = RAM_FLAGS(first + i);
+
+    pthread_mutex_lock(&bg_mutex);
+    bg_queued++;
+    pthread_cond_signal(&bg_wake);
+    pthread_mutex_unlock(&bg_mutex);
+    return true;
+}
+
+// Whether the code of the job is still there, with the same mapping, and its translation still fits
+static bool bg_valid(const struct bg_job *job, unsigned int size) {
+    if (job->generation != bg_generation || job->protect != protect_translated_code || trace_enabled)
+        return false;
+
+    for (uint32_t addr = job->start_pc; addr - job->start_pc < size; addr = (addr & ~0x3FF) + 0x400) {
+        uint32_t phys = mmu_translate(addr, false, NULL, NULL);
+        if (phys == 0xFFFFFFFF || phys_mem_ptr(phys, 1) != (uint8_t *)job->start_insnp + (addr - job->start_pc))
+            return false;
+    }
+
+    uint32_t *first = (uint32_t *)((uintptr_t)job->start_insnp & ~3);
+    unsigned int words = ((uint8_t *)job->start_insnp + size - (uint8_t *)first + 3) / 4;
+    return memcmp(job->code, first, words * 4) == 0;
+}
+
+static void bg_install(const struct bg_job *job) {
+    const struct stored_translation *st = (const struct stored_translation *)job->packed;
+    unsigned int insn_size = job->thumb ? 2 : 4;
+    unsigned int insns = job->size ? st->insns : 0;
+    // The instruction which got RF_CODE_NO_TRANSLATE has to be the same as well
+    if (!bg_valid(job, (insns + job->no_translate) * insn_size)) {
+        translate_stats.discarded++;
+        return;
+    }
+
+    if (job->size) {
+        int index = unpack_translation(job->start_pc, job->start_insnp, job->thumb, st, job->size, job->bytes);
+        if (index < 0) {
+            translate_stats.discarded++;
+            return;
+        }
+        protect_translation(index);
+        translate_stats.translations++;
+    } else {
+        uint32_t *flagsp = (uint32_t *)((uintptr_t)job->start_insnp & ~3);
+        if (job->no_translate && !(RAM_FLAGS(flagsp) & RF_CODE_TRANSLATED))
+            RAM_FLAGS(flagsp) |= RF_CODE_NO_TRANSLATE;
+        translate_stats.fallbacks++;
+    }
+
+    translate_stats.background++;
+    if (job->no_translate) {
+        translate_stats.no_translate++;
+        translate_stats.unimpl[job->unimpl_class]++;
+    }
+}
+
+void translate_install() {
+    unsigned int done = __atomic_load_n(&bg_done, __ATOMIC_ACQUIRE);
+    for (; bg_installed != done; bg_installed++)
+        bg_install(&bg_jobs[bg_installed % BG_JOBS]);
 }
 
 void flush_translations() {
-    int index;
-    for (index = 0; index < next_index; index++) {
-        uint32_t *start = translation_table[index].start_ptr;
-        uint32_t *end   = translation_table[index].end_ptr;
-        for (; start < end; start++)
-            RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | (~0u << RFS_TRANSLATION_INDEX));
+    bg_generation++;
+    tcache_flush();
+    flush_translation_shortcuts();
+
+    // Nothing to protect anymore
+    for (size_t page = 0; code_pages_protected && page < MEM_MAXSIZE / CODE_PAGE_SIZE; page++) {
+        if (code_page_protected[page] && os_set_writable(mem_and_flags + page * CODE_PAGE_SIZE, CODE_PAGE_SIZE, true)) {
+            code_page_protected[page] = false;
+            code_pages_protected--;
+        }
+    }
+}
+
+/* Translations stay usable as long as their address maps to the same code.
+   Chained exits between the remaining ones stay as well: they follow direct
+   branches only, which don't go into code with other permissions. The
+   predictions are also taken for returns and computed jumps though. */
+void flush_remapped_translations(uint32_t start, uint32_t last) {
+    uint32_t page = 1; // Never matches a page address
+    uint8_t *page_ptr = NULL;
+    for (unsigned int region = 0; region < TCACHE_REGIONS; region++) {
+        unsigned int first = region * tcache.slots;
+        for (unsigned int index = first; index < first + tcache.regions[region].count; index++) {
+            uint32_t pc = translation_pc[index],
+                     size = (uint8_t *)translation_table[index].end_ptr - (uint8_t *)translation_table[index].start_ptr;
+            if (size == 0 || pc > last || pc + (size - 1) < start)
+                continue;
+
+            // Blocks may go on into the next 1KB page, each has to be mapped like before
+            for (uint32_t addr = pc; addr - pc < size; addr = (addr & ~0x3FF) + 0x400) {
+                if ((addr & ~0x3FF) != page) {
+                    page = addr & ~0x3FF;
+                    uint32_t phys = mmu_translate(page, false, NULL, NULL);
+                    page_ptr = phys == 0xFFFFFFFF ? NULL : phys_mem_ptr(phys, 0x400);
+                }
+                if (!page_ptr || page_ptr + (addr & 0x3FF) != (uint8_t *)translation_table[index].start_ptr + (addr - pc)) {
+                    drop_translation(index);
+                    break;
+                }
+            }
+        }
+    }
+
+    flush_translation_shortcuts();
+}
+
+unsigned int translate_list(uint32_t *pcs, unsigned int max) {
+    unsigned int count = 0;
+    for (unsigned int i = 1; i <= TCACHE_REGIONS; i++) {
+        unsigned int region = (tcache.current + i) % TCACHE_REGIONS, first = region * tcache.slots;
+        for (unsigned int index = first; index < first + tcache.regions[region].count; index++) {
+            // Invalidated ones keep their slot until the region gets evicted
+            uint32_t flags = RAM_FLAGS((uintptr_t)translation_table[index].start_ptr & ~3);
+            if (!(flags & RF_CODE_TRANSLATED) || (flags >> RFS_TRANSLATION_INDEX) != index)
+                continue;
+
+            if (count < max)
+                pcs[count] = translation_pc[index] | ((flags & RF_CODE_THUMB) ? 1 : 0);
+            count++;
+        }
     }
-    next_index = 0;
-    insn_bufptr = insn_buffer;
-    jtbl_bufptr = jtbl_buffer;
+    return count;
+}
+
+void flush_translation_shortcuts() {
+    memset(return_stack, 0, sizeof(return_stack));
+    branch_cache_clear();
 }
 
 void invalidate_translation(int index) {
+    unsigned int current = ~0u;
     if (in_translation_rsp) {
-        uint32_t flags = RAM_FLAGS(in_translation_pc_ptr);
+        uint32_t flags = RAM_FLAGS((uintptr_t)in_translation_pc_ptr & ~3);
         if ((flags & RF_CODE_TRANSLATED) && (int)(flags >> RFS_TRANSLATION_INDEX) == index)
             error("Cannot modify currently executing code block.");
+        if (flags & RF_CODE_TRANSLATED)
+            current = flags >> RFS_TRANSLATION_INDEX;
     }
-    flush_translations();
+
+    /* Code gets usually modified in bulk, so drop everything in the pages
+       of the translation at once instead of taking a write_action for each.
+       The currently running translation stays, translate_fix_pc needs it. */
+    uintptr_t page = (uintptr_t)translation_table[index].start_ptr & ~0x3FF;
+    uintptr_t end = (uintptr_t)translation_table[index].end_ptr;
+    for (; page < end; page += 0x400)
+        tcache_invalidate_page((uint32_t *)page, current, drop_translation);
+    branch_cache_clear();
+}
+
+void invalidate_translation_at(void *ptr) {
+    uint32_t flags = RAM_FLAGS((uintptr_t)ptr & ~3);
+    if (!(flags & RF_CODE_TRANSLATED))
+        return;
+
+    // If it's the running one, it goes on until it exits like with translate_write_fault
+    unsigned int index = flags >> RFS_TRANSLATION_INDEX;
+    if (in_translation_rsp) {
+        uint32_t running = RAM_FLAGS((uintptr_t)in_translation_pc_ptr & ~3);
+        if ((running & RF_CODE_TRANSLATED) && (running >> RFS_TRANSLATION_INDEX) == index)
+            dropped_running_flags = running;
+    }
+
+    drop_translation(index);
+    branch_cache_clear();
 }
 
 void translate_fix_pc() {
     if (!in_translation_rsp)
         return;
 
+    translate_stats.fix_pc++;
     uint32_t *insnp = in_translation_pc_ptr;
     void *ret_eip = in_translation_rsp[-1];
-    uint32_t flags = RAM_FLAGS(insnp);
-    if (!(flags & RF_CODE_TRANSLATED))
-        error("Couldn't get PC for fault");
+    uint32_t flags = RAM_FLAGS((uintptr_t)insnp & ~3);
+    if (!(flags & RF_CODE_TRANSLATED)) {
+        flags = dropped_running_flags;
+        uint32_t index = flags >> RFS_TRANSLATION_INDEX;
+        if (!flags || insnp < translation_table[index].start_ptr || insnp >= translation_table[index].end_ptr)
+            error("Couldn't get PC for fault");
+    }
     int index = flags >> RFS_TRANSLATION_INDEX;
+    unsigned int insn_size = (flags & RF_CODE_THUMB) ? 2 : 4;
 
     assert(insnp >= translation_table[index].start_ptr);
     assert(insnp < translation_table[index].end_ptr);
     // We may have jumped into the middle of a translation
     arm.reg[15] -= (uint8_t*) insnp - (uint8_t*) translation_table[index].start_ptr;
 
-    unsigned int translation_insts = translation_table[index].end_ptr - translation_table[index].start_ptr;
-    for(unsigned int i = 0; ret_eip > translation_table[index].jump_table[i] && i < translation_insts; ++i)
-        arm.reg[15] += 4;
+    unsigned int translation_insts = ((uint8_t*) translation_table[index].end_ptr - (uint8_t*) translation_table[index].start_ptr) / insn_size;
+    arm.reg[15] += tcache_insn_after(translation_table[index].jump_table, 0, translation_insts, ret_eip) * insn_size;
 
-    cycle_count_delta -= ((uintptr_t)translation_table[index].end_ptr - (uintptr_t)insnp) >> 2;
+    cycle_count_delta -= ((uintptr_t)translation_table[index].end_ptr - (uintptr_t)insnp) / insn_size;
     in_translation_rsp = NULL;
 
-    assert(!(arm.cpsr_low28 & 0x20));
+    assert(!(arm.cpsr_low28 & 0x20) == (insn_size == 4));
 }
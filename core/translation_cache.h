@@ -0,0 +1,187 @@
+#ifndef TRANSLATION_CACHE_H
+#define TRANSLATION_CACHE_H
+
+/* Code shared by the translators: bookkeeping for translation_table and the
+   code and jump table buffers belonging to it.
+
+   All three are split into TCACHE_REGIONS regions of equal size and new
+   translations are appended to the current region only. If it can't hold
+   another block, the next region (in FIFO order) gets evicted and reused.
+   Regions which got entered since the last time they were considered get
+   a second chance, so that hot code does not get thrown away all the time.
+
+   As evicted code is overwritten, code must not jump directly into a
+   translation of another region, use tcache_same_region to check that.
+
+   Sizes and offsets of code are counted in units of the code buffer's
+   element type, sizes and offsets of jump tables in entries. */
+
+#include <string.h>
+
+#include "mem.h"
+#include "translate.h"
+
+#define TCACHE_REGIONS 16
+
+struct tcache_region {
+    unsigned int count; // Number of translation slots in use
+    size_t code_used, jtbl_used;
+    bool referenced;
+};
+
+static struct {
+    unsigned int slots; // Per region
+    size_t code_size, jtbl_size; // Per region
+    unsigned int current, hand;
+    struct tcache_region regions[TCACHE_REGIONS];
+} tcache;
+
+static inline void tcache_init(unsigned int max_translations, size_t code_size, size_t jtbl_size)
+{
+    tcache.slots = max_translations / TCACHE_REGIONS;
+    tcache.code_size = code_size / TCACHE_REGIONS;
+    tcache.jtbl_size = jtbl_size / TCACHE_REGIONS;
+    tcache.current = tcache.hand = 0;
+    memset(tcache.regions, 0, sizeof(tcache.regions));
+}
+
+static inline unsigned int tcache_next_index()
+{
+    return tcache.current * tcache.slots + tcache.regions[tcache.current].count;
+}
+
+static inline size_t tcache_code_offset()
+{
+    return tcache.current * tcache.code_size + tcache.regions[tcache.current].code_used;
+}
+
+// Offset of the end of code space usable by the current translation
+static inline size_t tcache_code_end()
+{
+    return (tcache.current + 1) * tcache.code_size;
+}
+
+static inline size_t tcache_jtbl_offset()
+{
+    return tcache.current * tcache.jtbl_size + tcache.regions[tcache.current].jtbl_used;
+}
+
+static inline bool tcache_same_region(unsigned int index)
+{
+    return index / tcache.slots == tcache.current;
+}
+
+/* Removes the RAM_FLAGS of translation index from the code between start and end.
+   Returns false if there were none left. */
+static inline bool tcache_clear_flags(unsigned int index, uint32_t *start, uint32_t *end)
+{
+    bool cleared = false;
+    // Thumb translations may start in the middle of a word
+    start = (uint32_t *)((uintptr_t)start & ~3);
+    for (; start < end; start++)
+    {
+        // The instruction might belong to a newer translation already
+        uint32_t flags = RAM_FLAGS(start);
+        if ((flags & RF_CODE_TRANSLATED) && (flags >> RFS_TRANSLATION_INDEX) == index)
+        {
+            RAM_FLAGS(start) &= ~(RF_CODE_TRANSLATED | RF_CODE_THUMB | (~0u << RFS_TRANSLATION_INDEX));
+            cleared = true;
+        }
+    }
+    return cleared;
+}
+
+static inline void tcache_invalidate(unsigned int index)
+{
+    // Evicting a region also gets here for translations invalidated before
+    if (tcache_clear_flags(index, translation_table[index].start_ptr, translation_table[index].end_ptr))
+        translate_stats.dropped++;
+}
+
+/* RAM_FLAGS of the 1KB page ptr is in tell which translations cover part of
+   it. Calls drop for each of them except keep. */
+static inline void tcache_invalidate_page(uint32_t *ptr, unsigned int keep, void (*drop)(unsigned int index))
+{
+    uint32_t *page = (uint32_t *)((uintptr_t)ptr & ~0x3FF);
+    for (ptr = page; ptr < page + 0x100; ptr++)
+    {
+        uint32_t flags = RAM_FLAGS(ptr);
+        if ((flags & RF_CODE_TRANSLATED) && (flags >> RFS_TRANSLATION_INDEX) != keep)
+            drop(flags >> RFS_TRANSLATION_INDEX);
+    }
+}
+
+static inline void tcache_evict(unsigned int region)
+{
+    unsigned int first = region * tcache.slots;
+    for (unsigned int index = first; index < first + tcache.regions[region].count; index++)
+        tcache_invalidate(index);
+
+    translate_stats.code_bytes -= tcache.regions[region].code_used;
+    tcache.regions[region].count = 0;
+    tcache.regions[region].code_used = tcache.regions[region].jtbl_used = 0;
+    tcache.regions[region].referenced = false;
+}
+
+/* Makes sure that the current region has room for a translation using up to
+   code and jtbl units. Must not be called while inside translated code. */
+static inline void tcache_reserve(size_t code, size_t jtbl)
+{
+    struct tcache_region *cur = &tcache.regions[tcache.current];
+    if (cur->count < tcache.slots
+        && cur->code_used + code <= tcache.code_size
+        && cur->jtbl_used + jtbl <= tcache.jtbl_size)
+        return;
+
+    // Find the next region without recent use, this terminates after two rounds
+    for (;;)
+    {
+        tcache.hand = (tcache.hand + 1) % TCACHE_REGIONS;
+        if (tcache.hand == tcache.current)
+            continue;
+        if (!tcache.regions[tcache.hand].referenced)
+            break;
+
+        tcache.regions[tcache.hand].referenced = false;
+    }
+
+    tcache_evict(tcache.hand);
+    tcache.current = tcache.hand;
+}
+
+// Accounts for a new translation in the current region, taking its space up to the given offsets
+static inline void tcache_commit(size_t code_end, size_t jtbl_end)
+{
+    struct tcache_region *cur = &tcache.regions[tcache.current];
+    cur->count++;
+    translate_stats.code_bytes += code_end - tcache.current * tcache.code_size - cur->code_used;
+    cur->code_used = code_end - tcache.current * tcache.code_size;
+    cur->jtbl_used = jtbl_end - tcache.current * tcache.jtbl_size;
+}
+
+static inline void tcache_flush()
+{
+    for (unsigned int region = 0; region < TCACHE_REGIONS; region++)
+        tcache_evict(region);
+
+    tcache.current = tcache.hand = 0;
+}
+
+/* For translate_fix_pc: returns the first of the instructions from first to
+   end of a translation whose code in jump_table doesn't start before ret.
+   That's the one after the instruction which a call returning to ret is in.
+   The code of the instructions is in order, so this is a binary search. */
+static inline unsigned int tcache_insn_after(void *const *jump_table, unsigned int first, unsigned int end, const void *ret)
+{
+    while (first < end)
+    {
+        unsigned int mid = first + (end - first) / 2;
+        if (jump_table[mid] < ret)
+            first = mid + 1;
+        else
+            end = mid;
+    }
+    return first;
+}
+
+#endif //TRANSLATION_CACHE_H
@@ -0,0 +1,636 @@
+#ifndef TRANSLATION_IR_H
+#define TRANSLATION_IR_H
+
+/* Code shared by the translators: a decoded form of the instructions of a
+   block to emit code from, and the passes working on it before that.
+
+   tir_decode and tir_decode_thumb lower an instruction into a struct
+   tir_insn, Thumb instructions become the same operations as their ARM
+   equivalents. What can't be expressed becomes TIR_NONE. Decoding doesn't
+   change the meaning of anything, reads of the PC stay register 15 until
+   tir_fold_constants turns them into constants.
+   The passes only rely on what the instructions do, not on how they get
+   translated. Which operations and operands a translator supports is up to
+   it, it has to end the block before the first one it doesn't. The results
+   of tir_flags_liveness then have to be brought up to date for the shorter
+   block, which may need more flags stored. */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "translate.h"
+
+/* ARM flags as bit masks, in the order of arm.cpsr_n, _z, _c and _v */
+#define FLAG_N 1
+#define FLAG_Z 2
+#define FLAG_C 4
+#define FLAG_V 8
+#define FLAGS_ALL 15
+
+enum tir_op {
+    TIR_NONE, // Not translatable, unimpl says why
+    TIR_MOV_IMM, // rd = imm
+    TIR_ALU, // Data processing: rd = rn <alu> op2, no rd for TST, TEQ, CMP and CMN, no rn for MOV and MVN
+    TIR_MUL, // rd = rm * rs, + rn with TIR_ACCUMULATE
+    TIR_MULL, // rn:rd = rm * rs, + rn:rd with TIR_ACCUMULATE
+    TIR_CLZ, // rd = leading zeros of rm
+    TIR_MRS, // rd = CPSR or SPSR
+    TIR_MSR, // CPSR or SPSR = op2, only the bytes set in the mask imm
+    TIR_LDST, // Load rd from or store rd to rn +/- op2, or to imm + op2 with no rn
+    TIR_LDM_STM, // regs from or to the addresses starting at rn
+    TIR_B, // Branch to imm
+    TIR_BX, // Branch to rm + imm, to Thumb state if bit 0 of that is set
+    TIR_JUMP, // Branch to op2 + imm in ARM state
+};
+
+// Kinds of struct tir_operand
+enum tir_operand_kind {
+    TIR_IMM, // imm
+    TIR_REG, // reg
+    TIR_SHIFT_IMM, // reg shifted by amount, from 1 to 32 (LSL and ROR: up to 31)
+    TIR_SHIFT_REG, // reg shifted by the low byte of register amount
+    TIR_RRX, // reg rotated right through the carry by one
+};
+
+// Shift types, as encoded by ARM
+enum tir_shift { TIR_LSL, TIR_LSR, TIR_ASR, TIR_ROR };
+
+struct tir_operand {
+    uint8_t kind;
+    uint8_t reg;
+    uint8_t shift;
+    uint8_t amount;
+    int8_t carry; // TIR_IMM of data processing: the shifter's carry out, -1 if C stays
+    uint32_t imm;
+};
+
+// Bits of struct tir_insn's opts
+#define TIR_SETCC      0x0001 // TIR_ALU, TIR_MUL, TIR_MULL: update the flags
+#define TIR_LINK       0x0002 // TIR_B, TIR_BX: set LR to link_pc first
+#define TIR_TO_THUMB   0x0004 // TIR_BX: to Thumb state whatever bit 0 is
+#define TIR_TO_ARM     0x0008 // TIR_BX: to ARM state, bits 0 and 1 of the target cleared
+#define TIR_LOAD       0x0010 // TIR_LDST, TIR_LDM_STM
+#define TIR_SIGNED     0x0020 // TIR_LDST: sign extend, TIR_MULL: signed multiplication
+#define TIR_SUBTRACT   0x0040 // TIR_LDST: subtract the offset
+#define TIR_POST       0x0080 // TIR_LDST: access rn itself, then write back
+#define TIR_WRITEBACK  0x0100 // TIR_LDST, TIR_LDM_STM: write the new address to rn
+#define TIR_INCREMENT  0x0200 // TIR_LDM_STM: upwards from rn
+#define TIR_BEFORE     0x0400 // TIR_LDM_STM: step before each access
+#define TIR_ACCUMULATE 0x0800 // TIR_MUL, TIR_MULL
+#define TIR_SPSR       0x1000 // TIR_MRS, TIR_MSR
+
+// In place of a register
+#define TIR_NO_REG 0xFF
+
+/* Stores of the PC, by TIR_LDST or TIR_LDM_STM, store pc + 12 */
+struct tir_insn {
+    uint8_t op;
+    uint8_t cond; // ARM condition, 14 for always
+    uint8_t alu; // TIR_ALU: the ARM data processing opcode
+    uint8_t size; // TIR_LDST: 1, 2 or 4 bytes
+    uint8_t rd, rn, rm, rs;
+    uint16_t opts;
+    uint16_t regs; // TIR_LDM_STM
+    struct tir_operand op2;
+    uint32_t imm;
+    uint32_t pc; // Address of the instruction
+    uint32_t pc_read; // What the PC reads as in it
+    uint32_t link_pc; // Return address for TIR_LINK, with bit 0 set in Thumb state
+    uint8_t unimpl; // TIR_NONE: an enum translate_unimpl
+    uint8_t flags_dead; // See tir_flags_liveness
+};
+
+static inline void tir_none(struct tir_insn *ir, enum translate_unimpl unimpl) {
+    ir->op = TIR_NONE;
+    ir->unimpl = unimpl;
+}
+
+// The second operand of data processing and of MSR with an immediate
+static inline void tir_rotated_imm(uint32_t insn, struct tir_operand *operand) {
+    uint32_t imm = insn & 0xFF;
+    int rotate = insn >> 7 & 30;
+    operand->kind = TIR_IMM;
+    operand->carry = -1;
+    if (rotate) {
+        imm = imm >> rotate | imm << (32 - rotate);
+        operand->carry = imm >> 31;
+    }
+    operand->imm = imm;
+}
+
+// A register shifted by an immediate, with the special cases of shifting by 0 sorted out
+static inline void tir_shifted_reg(uint32_t insn, struct tir_operand *operand) {
+    operand->reg = insn & 15;
+    operand->shift = insn >> 5 & 3;
+    operand->amount = insn >> 7 & 31;
+    operand->kind = TIR_SHIFT_IMM;
+    if (operand->amount == 0) {
+        if (operand->shift == TIR_LSL)
+            operand->kind = TIR_REG;
+        else if (operand->shift == TIR_ROR)
+            operand->kind = TIR_RRX;
+        else
+            operand->amount = 32;
+    }
+}
+
+static inline void tir_init(struct tir_insn *ir, int cond, uint32_t pc, bool thumb) {
+    memset(ir, 0, sizeof(*ir));
+    ir->cond = cond;
+    ir->rd = ir->rn = ir->rm = ir->rs = TIR_NO_REG;
+    ir->op2.reg = ir->op2.amount = TIR_NO_REG;
+    ir->pc = pc;
+    ir->pc_read = pc + (thumb ? 4 : 8);
+    ir->link_pc = thumb ? (pc + 2) | 1 : pc + 4;
+}
+
+// For tir_decode: fills in everything but cond, pc and so on. Returns the class if it's TIR_NONE, otherwise -1.
+static inline int tir_lower(uint32_t insn, bool thumb, struct tir_insn *ir) {
+    int rd = insn >> 12 & 15, rn = insn >> 16 & 15, rm = insn & 15, rs = insn >> 8 & 15;
+    if (insn >> 28 == 0xF)
+        return UNIMPL_COND;
+
+    if ((insn & 0xE000090) == 0x0000090) {
+        if ((insn & 0xFC000F0) == 0x0000090) {
+            /* MUL, MLA */
+            ir->op = TIR_MUL;
+            ir->rd = rn;
+            ir->rm = rm;
+            ir->rs = rs;
+            if (insn & (1 << 20))
+                ir->opts |= TIR_SETCC;
+            if (insn & 0x0200000) {
+                ir->opts |= TIR_ACCUMULATE;
+                ir->rn = rd;
+            }
+            if (rn == 15 || rm == 15 || rs == 15 || ir->rn == 15)
+                return UNIMPL_MULTIPLY;
+        } else if ((insn & 0xF8000F0) == 0x0800090) {
+            /* UMULL, UMLAL, SMULL, SMLAL */
+            ir->op = TIR_MULL;
+            ir->rd = rd;
+            ir->rn = rn;
+            ir->rm = rm;
+            ir->rs = rs;
+            if (insn & (1 << 20))
+                ir->opts |= TIR_SETCC;
+            if (insn & 0x0200000)
+                ir->opts |= TIR_ACCUMULATE;
+            if (insn & 0x0400000)
+                ir->opts |= TIR_SIGNED;
+            if (rd == 15 || rn == 15 || rm == 15 || rs == 15 || rd == rn)
+                return UNIMPL_MULTIPLY;
+        } else {
+            /* Halfword and signed byte transfers */
+            enum { INVALID, H, SB, SH };
+            int type = insn >> 5 & 3;
+            bool load = insn & (1 << 20);
+            if (type == INVALID || (!load && type != H))
+                return UNIMPL_HALFWORD; // SWP, doubleword transfers
+            ir->op = TIR_LDST;
+            ir->size = type == SB ? 1 : 2;
+            ir->rd = rd;
+            ir->rn = rn;
+            if (load)
+                ir->opts |= TIR_LOAD;
+            if (type != H)
+                ir->opts |= TIR_SIGNED;
+            if (!(insn & (1 << 23)))
+                ir->opts |= TIR_SUBTRACT;
+            if (!(insn & (1 << 24)))
+                ir->opts |= TIR_POST | TIR_WRITEBACK;
+            else if (insn & (1 << 21))
+                ir->opts |= TIR_WRITEBACK;
+            if (insn & (1 << 22)) {
+                ir->op2.kind = TIR_IMM;
+                ir->op2.imm = (insn & 0x0F) | (insn >> 4 & 0xF0);
+            } else {
+                ir->op2.kind = TIR_REG;
+                ir->op2.reg = rm;
+            }
+
+            if (rd == 15 || (!(insn & (1 << 22)) && rm == 15))
+                return UNIMPL_HALFWORD;
+            if (!(insn & (1 << 24)) && (insn & (1 << 21)))
+                return UNIMPL_HALFWORD;
+            if ((ir->opts & TIR_WRITEBACK) && (rn == 15 || (load && rn == rd)))
+                return UNIMPL_HALFWORD;
+        }
+    } else if ((insn & 0xD900000) == 0x1000000) {
+        if ((insn & 0xFFFFFD0) == 0x12FFF10) {
+            /* BX, BLX */
+            ir->op = TIR_BX;
+            ir->rm = rm;
+            if (insn & 0x20)
+                ir->opts |= TIR_LINK;
+            if (rm == 15)
+                return UNIMPL_MISC;
+        } else if ((insn & 0xFBF0FFF) == 0x10F0000) {
+            /* MRS */
+            ir->op = TIR_MRS;
+            ir->rd = rd;
+            if (insn & 0x0400000)
+                ir->opts |= TIR_SPSR;
+            if (rd == 15)
+                return UNIMPL_MISC;
+        } else if ((insn & 0xFB0FFF0) == 0x120F000 || (insn & 0xFB0F000) == 0x320F000) {
+            /* MSR */
+            ir->op = TIR_MSR;
+            if (insn & 0x2000000) {
+                tir_rotated_imm(insn, &ir->op2);
+            } else {
+                ir->op2.kind = TIR_REG;
+                ir->op2.reg = rm;
+                if (rm == 15)
+                    return UNIMPL_MISC;
+            }
+            if (insn & 0x0400000)
+                ir->opts |= TIR_SPSR;
+            if (insn & 0x0080000) ir->imm |= 0xFF000000;
+            if (insn & 0x0040000) ir->imm |= 0x00FF0000;
+            if (insn & 0x0020000) ir->imm |= 0x0000FF00;
+            if (insn & 0x0010000) ir->imm |= 0x000000FF;
+        } else if ((insn & 0xFFF0FF0) == 0x16F0F10) {
+            /* CLZ */
+            ir->op = TIR_CLZ;
+            ir->rd = rd;
+            ir->rm = rm;
+            if (rd == 15 || rm == 15)
+                return UNIMPL_MISC;
+        } else {
+            return UNIMPL_MISC;
+        }
+    } else if ((insn & 0xC000000) == 0) {
+        /* Data processing */
+        int op = insn >> 21 & 15;
+        ir->op = TIR_ALU;
+        ir->alu = op;
+        if (insn & (1 << 20))
+            ir->opts |= TIR_SETCC;
+        if (op < 8 || op >= 12)
+            ir->rd = rd;
+        if (op != 13 && op != 15)
+            ir->rn = rn;
+
+        if (insn & 0x2000000) {
+            tir_rotated_imm(insn, &ir->op2);
+        } else if (insn & 0x10) {
+            ir->op2.kind = TIR_SHIFT_REG;
+            ir->op2.reg = rm;
+            ir->op2.shift = insn >> 5 & 3;
+            ir->op2.amount = rs;
+            if (rm == 15 || rs == 15)
+                return UNIMPL_DATA_PROC;
+        } else {
+            tir_shifted_reg(insn, &ir->op2);
+            if (rm == 15 && ir->op2.kind != TIR_REG)
+                return UNIMPL_DATA_PROC; // Shifted PC?! Not likely.
+        }
+
+        if (rd == 15) {
+            // TSTP and the like, exception returns and Thumb's jumps with exchange
+            if ((op >= 8 && op < 12) || (ir->opts & TIR_SETCC) || thumb)
+                return UNIMPL_DATA_PROC;
+            /* Computed jumps: MOV PC, Rm and jump tables with ADD PC, PC, Rm, LSL #n */
+            bool shifted_left = ir->op2.kind == TIR_REG || (ir->op2.kind == TIR_SHIFT_IMM && ir->op2.shift == TIR_LSL);
+            if (ir->op2.reg == 15 || !shifted_left)
+                return UNIMPL_DATA_PROC;
+            if (op == 13 && ir->op2.kind == TIR_REG) {
+                ir->op = TIR_JUMP;
+            } else if (op == 4 && rn == 15) {
+                ir->op = TIR_JUMP;
+                ir->imm = ir->pc_read;
+            } else {
+                return UNIMPL_DATA_PROC;
+            }
+            ir->rd = ir->rn = TIR_NO_REG;
+        }
+    } else if ((insn & 0xC000000) == 0x4000000) {
+        /* Byte and word transfers */
+        bool load = insn & (1 << 20);
+        ir->op = TIR_LDST;
+        ir->size = (insn & (1 << 22)) ? 1 : 4;
+        ir->rd = rd;
+        ir->rn = rn;
+        if (load)
+            ir->opts |= TIR_LOAD;
+        if (!(insn & (1 << 23)))
+            ir->opts |= TIR_SUBTRACT;
+        if (!(insn & (1 << 24)))
+            ir->opts |= TIR_POST | TIR_WRITEBACK;
+        else if (insn & (1 << 21))
+            ir->opts |= TIR_WRITEBACK;
+        if (insn & (1 << 25)) {
+            if (insn & (1 << 4))
+                return UNIMPL_LOAD_STORE; // Undefined
+            tir_shifted_reg(insn, &ir->op2);
+            if (rm == 15)
+                return UNIMPL_LOAD_STORE;
+        } else {
+            ir->op2.kind = TIR_IMM;
+            ir->op2.imm = insn & 0xFFF;
+        }
+
+        if (!(insn & (1 << 24)) && (insn & (1 << 21)))
+            return UNIMPL_LOAD_STORE; // LDRT, STRT etc.
+        if ((ir->opts & TIR_WRITEBACK) && (rn == 15 || (load && rn == rd)))
+            return UNIMPL_LOAD_STORE;
+    } else if ((insn & 0xE000000) == 0x8000000) {
+        /* Load/store multiple */
+        ir->op = TIR_LDM_STM;
+        ir->rn = rn;
+        ir->regs = insn & 0xFFFF;
+        if (insn & (1 << 20))
+            ir->opts |= TIR_LOAD;
+        if (insn & (1 << 21))
+            ir->opts |= TIR_WRITEBACK;
+        if (insn & (1 << 23))
+            ir->opts |= TIR_INCREMENT;
+        if (insn & (1 << 24))
+            ir->opts |= TIR_BEFORE;
+
+        if (insn & (1 << 22))
+            return UNIMPL_LDM_STM; // Restore CPSR, or use user mode registers
+        if (rn == 15 || ((ir->opts & TIR_WRITEBACK) && (ir->opts & TIR_LOAD) && (ir->regs >> rn & 1)))
+            return UNIMPL_LDM_STM;
+    } else if ((insn & 0xE000000) == 0xA000000) {
+        /* Branch, branch-and-link */
+        ir->op = TIR_B;
+        ir->imm = ir->pc_read + ((int32_t)(insn << 8) >> 6);
+        if (insn & (1 << 24))
+            ir->opts |= TIR_LINK;
+    } else {
+        return UNIMPL_OTHER;
+    }
+    return -1;
+}
+
+/* Decodes the ARM instruction insn at pc. With thumb, it stands for a Thumb
+   instruction there, see tir_decode_thumb. */
+static inline void tir_decode(uint32_t insn, uint32_t pc, bool thumb, struct tir_insn *ir) {
+    tir_init(ir, insn >> 28, pc, thumb);
+    int unimpl = tir_lower(insn, thumb, ir);
+    if (unimpl >= 0)
+        tir_none(ir, (enum translate_unimpl)unimpl);
+}
+
+/* Most Thumb instructions have an ARM equivalent, so they are decoded by
+   converting them first. Returns 0 if there is none, branches and the
+   instructions which need the PC are left to tir_decode_thumb.
+   The PC reads as pc + 4 in Thumb state, which tir_decode knows about. */
+static inline uint32_t tir_thumb_to_arm(uint16_t insn, uint32_t pc) {
+    int rd = insn & 7, rn = insn >> 3 & 7, rm = insn >> 6 & 7, rd8 = insn >> 8 & 7;
+    uint32_t imm5 = insn >> 6 & 31, imm8 = insn & 0xFF;
+
+    switch (insn >> 11) {
+        case 0x00: case 0x01: case 0x02: /* LSL, LSR, ASR Rd, Rm, #imm */
+            return 0xE1B00000 | rd << 12 | imm5 << 7 | (insn >> 11) << 5 | rn;
+        case 0x03:
+            switch (insn >> 9 & 3) {
+                case 0: /* ADD Rd, Rn, Rm */ return 0xE0900000 | rn << 16 | rd << 12 | rm;
+                case 1: /* SUB Rd, Rn, Rm */ return 0xE0500000 | rn << 16 | rd << 12 | rm;
+                case 2: /* ADD Rd, Rn, #imm */ return 0xE2900000 | rn << 16 | rd << 12 | rm;
+                case 3: /* SUB Rd, Rn, #imm */ return 0xE2500000 | rn << 16 | rd << 12 | rm;
+            }
+            break;
+        case 0x04: /* MOV Rd, #imm */ return 0xE3B00000 | rd8 << 12 | imm8;
+        case 0x05: /* CMP Rn, #imm */ return 0xE3500000 | rd8 << 16 | imm8;
+        case 0x06: /* ADD Rd, #imm */ return 0xE2900000 | rd8 << 16 | rd8 << 12 | imm8;
+        case 0x07: /* SUB Rd, #imm */ return 0xE2500000 | rd8 << 16 | rd8 << 12 | imm8;
+        case 0x08:
+            if (!(insn & 0x400)) {
+                /* Data processing, both operands in Rd and Rm (bits 3-5) */
+                static const uint32_t alu[16] = {
+                    0xE0100000, 0xE0300000, 0xE1B00010, 0xE1B00030, /* AND, EOR, LSL, LSR */
+                    0xE1B00050, 0xE0B00000, 0xE0D00000, 0xE1B00070, /* ASR, ADC, SBC, ROR */
+                    0xE1100000, 0xE2700000, 0xE1500000, 0xE1700000, /* TST, NEG, CMP, CMN */
+                    0xE1900000, 0xE0100090, 0xE1D00000, 0xE1F00000, /* ORR, MUL, BIC, MVN */
+                };
+                int op = insn >> 6 & 15;
+                uint32_t base = alu[op];
+                if (op == 2 || op == 3 || op == 4 || op == 7) // Rd = Rd shifted by Rm
+                    return base | rd << 12 | rn << 8 | rd;
+                if (op == 8 || op == 10 || op == 11) // Flags only
+                    return base | rd << 16 | rn;
+                if (op == 9) // RSBS Rd, Rm, #0
+                    return base | rn << 16 | rd << 12;
+                if (op == 13) // MULS Rd, Rm, Rd
+                    return base | rd << 16 | rd << 8 | rn;
+                if (op == 15)
+                    return base | rd << 12 | rn;
+                return base | rd << 16 | rd << 12 | rn;
+            } else {
+                /* High register operations, BX is handled by tir_decode_thumb */
+                int hrd = rd | (insn >> 4 & 8), hrm = insn >> 3 & 15;
+                switch (insn >> 8 & 3) {
+                    case 0: /* ADD */ return 0xE0800000 | hrd << 16 | hrd << 12 | hrm;
+                    case 1: /* CMP */ return 0xE1500000 | hrd << 16 | hrm;
+                    case 2: /* MOV */ return 0xE1A00000 | hrd << 12 | hrm;
+                }
+            }
+            break;
+        case 0x09: { /* LDR Rd, [PC, #imm] */
+            int32_t offset = imm8 * 4 - (pc & 2);
+            if (offset < 0)
+                return 0xE5100000 | 15 << 16 | rd8 << 12 | -offset;
+            return 0xE5900000 | 15 << 16 | rd8 << 12 | offset;
+        }
+        case 0x0A: case 0x0B: {
+            /* Load/store with register offset */
+            static const uint32_t ldst[8] = {
+                0xE7800000, 0xE18000B0, 0xE7C00000, 0xE19000D0, /* STR, STRH, STRB, LDRSB */
+                0xE7900000, 0xE19000B0, 0xE7D00000, 0xE19000F0, /* LDR, LDRH, LDRB, LDRSH */
+            };
+            return ldst[insn >> 9 & 7] | rn << 16 | rd << 12 | rm;
+        }
+        case 0x0C: /* STR Rd, [Rn, #imm] */ return 0xE5800000 | rn << 16 | rd << 12 | imm5 << 2;
+        case 0x0D: /* LDR Rd, [Rn, #imm] */ return 0xE5900000 | rn << 16 | rd << 12 | imm5 << 2;
+        case 0x0E: /* STRB Rd, [Rn, #imm] */ return 0xE5C00000 | rn << 16 | rd << 12 | imm5;
+        case 0x0F: /* LDRB Rd, [Rn, #imm] */ return 0xE5D00000 | rn << 16 | rd << 12 | imm5;
+        case 0x10: case 0x11: { /* STRH, LDRH Rd, [Rn, #imm] */
+            uint32_t offset = imm5 << 1;
+            return ((insn & 0x800) ? 0xE1D000B0 : 0xE1C000B0) | rn << 16 | rd << 12 | (offset & 0xF0) << 4 | (offset & 0xF);
+        }
+        case 0x12: /* STR Rd, [SP, #imm] */ return 0xE58D0000 | rd8 << 12 | imm8 << 2;
+        case 0x13: /* LDR Rd, [SP, #imm] */ return 0xE59D0000 | rd8 << 12 | imm8 << 2;
+        case 0x15: /* ADD Rd, SP, #imm */ return 0xE28D0F00 | rd8 << 12 | imm8;
+        case 0x16: case 0x17:
+            if ((insn & 0xFF00) == 0xB000) /* ADD/SUB SP, #imm */
+                return ((insn & 0x80) ? 0xE24DDF00 : 0xE28DDF00) | (insn & 0x7F);
+            if ((insn & 0xFE00) == 0xB400) /* PUSH */
+                return 0xE92D0000 | imm8 | (insn & 0x100) << 6;
+            if ((insn & 0xFE00) == 0xBC00) /* POP */
+                return 0xE8BD0000 | imm8 | (insn & 0x100) << 7;
+            break;
+        case 0x18: /* STMIA Rn!, {...} */ return 0xE8A00000 | rd8 << 16 | imm8;
+        case 0x19: /* LDMIA Rn!, {...} */ return 0xE8B00000 | rd8 << 16 | imm8;
+    }
+    return 0;
+}
+
+// Decodes the Thumb instruction insn at pc
+static inline void tir_decode_thumb(uint16_t insn, uint32_t pc, struct tir_insn *ir) {
+    if ((insn & 0xFF00) == 0x4700 && !(insn & 7)) {
+        /* BX, BLX Rm */
+        tir_decode(0xE12FFF10 | (insn & 0x80) >> 2 | (insn >> 3 & 15), pc, true, ir);
+        return;
+    }
+    uint32_t arm_insn = tir_thumb_to_arm(insn, pc);
+    if (arm_insn) {
+        tir_decode(arm_insn, pc, true, ir);
+        return;
+    }
+
+    tir_init(ir, 0xE, pc, true);
+    if ((insn & 0xF800) == 0xF000) {
+        /* BL/BLX prefix */
+        ir->op = TIR_MOV_IMM;
+        ir->rd = 14;
+        ir->imm = ir->pc_read + ((int32_t)((uint32_t)insn << 21) >> 9);
+    } else if ((insn & 0xE800) == 0xE800) {
+        /* BL/BLX suffix */
+        ir->op = TIR_BX;
+        ir->rm = 14;
+        ir->imm = (insn & 0x7FF) << 1;
+        ir->opts = TIR_LINK | ((insn & 0x1000) ? TIR_TO_THUMB : TIR_TO_ARM);
+    } else if ((insn & 0xF800) == 0xA000) {
+        /* ADD Rd, PC, #imm */
+        ir->op = TIR_MOV_IMM;
+        ir->rd = insn >> 8 & 7;
+        ir->imm = (ir->pc_read & ~3) + ((insn & 0xFF) << 2);
+    } else if ((insn & 0xF000) == 0xD000 && (insn & 0x0E00) != 0x0E00) {
+        /* B<cond> */
+        ir->op = TIR_B;
+        ir->cond = insn >> 8 & 15;
+        ir->imm = ir->pc_read + ((int8_t)insn << 1);
+    } else if ((insn & 0xF800) == 0xE000) {
+        /* B */
+        ir->op = TIR_B;
+        ir->imm = ir->pc_read + ((int32_t)((uint32_t)insn << 21) >> 20);
+    } else {
+        tir_none(ir, UNIMPL_THUMB); // Undefined, SWI and the rest
+    }
+}
+
+// Whether the block ends after the instruction, if it gets to it
+static inline bool tir_ends_block(const struct tir_insn *ir) {
+    switch (ir->op) {
+        case TIR_NONE: case TIR_B: case TIR_BX: case TIR_JUMP:
+            return true;
+        case TIR_LDST:
+            return (ir->opts & TIR_LOAD) && ir->rd == 15;
+        case TIR_LDM_STM:
+            return (ir->opts & TIR_LOAD) && (ir->regs & 0x8000);
+        default:
+            return false;
+    }
+}
+
+/* Replaces reads of the PC by the value it reads as, where that's the
+   second operand of data processing or the base of a transfer. Additions to
+   the PC like ADR and moves of immediates become TIR_MOV_IMM. */
+static inline void tir_fold_constants(struct tir_insn *insns, unsigned int count) {
+    for (unsigned int i = 0; i < count; i++) {
+        struct tir_insn *ir = &insns[i];
+        if (ir->op == TIR_ALU) {
+            if (ir->op2.kind == TIR_REG && ir->op2.reg == 15) {
+                ir->op2.kind = TIR_IMM;
+                ir->op2.reg = TIR_NO_REG;
+                ir->op2.imm = ir->pc_read;
+                ir->op2.carry = -1;
+            }
+            if (ir->op2.kind != TIR_IMM || (ir->opts & TIR_SETCC))
+                continue;
+            if (ir->rn == 15 && (ir->alu == 2 || ir->alu == 4)) { // SUB, ADD
+                ir->op = TIR_MOV_IMM;
+                ir->imm = ir->alu == 4 ? ir->pc_read + ir->op2.imm : ir->pc_read - ir->op2.imm;
+            } else if (ir->alu == 13 || ir->alu == 15) { // MOV, MVN
+                ir->op = TIR_MOV_IMM;
+                ir->imm = ir->alu == 13 ? ir->op2.imm : ~ir->op2.imm;
+            }
+        } else if (ir->op == TIR_LDST && ir->rn == 15) {
+            // tir_decode doesn't allow a write back to the PC
+            ir->rn = TIR_NO_REG;
+            ir->imm = ir->pc_read;
+            if (ir->op2.kind == TIR_IMM) {
+                ir->imm += (ir->opts & TIR_SUBTRACT) ? -ir->op2.imm : ir->op2.imm;
+                ir->op2.imm = 0;
+            }
+        }
+    }
+}
+
+/* Flags an instruction reads and, if executed, writes. Anything which may
+   leave the block, also by calling a helper, reads all of them. Writes must
+   not be overstated, reads must not be understated. */
+static inline void tir_insn_flags(const struct tir_insn *ir, uint8_t *reads, uint8_t *writes) {
+    static const uint8_t cond_flags[16] = {
+        FLAG_Z, FLAG_Z, FLAG_C, FLAG_C, FLAG_N, FLAG_N, FLAG_V, FLAG_V,
+        FLAG_C | FLAG_Z, FLAG_C | FLAG_Z, FLAG_N | FLAG_V, FLAG_N | FLAG_V,
+        FLAG_N | FLAG_Z | FLAG_V, FLAG_N | FLAG_Z | FLAG_V, 0, FLAGS_ALL
+    };
+    bool setcc = ir->opts & TIR_SETCC;
+    *reads = cond_flags[ir->cond];
+    *writes = 0;
+
+    switch (ir->op) {
+        case TIR_MOV_IMM: case TIR_CLZ:
+            break;
+        case TIR_MUL: case TIR_MULL:
+            *writes = setcc ? FLAG_N | FLAG_Z : 0;
+            break;
+        case TIR_ALU: {
+            const struct tir_operand *op2 = &ir->op2;
+            if ((ir->alu >= 5 && ir->alu <= 7) || op2->kind == TIR_RRX) // ADC, SBC, RSC
+                *reads |= FLAG_C;
+            if (setcc && (0xF303 >> ir->alu) & 1) {
+                // Logical operations take the carry from the shifter, if it has one
+                bool shifter_carry = op2->kind == TIR_IMM ? op2->carry >= 0
+                                   : op2->kind == TIR_SHIFT_IMM || op2->kind == TIR_RRX;
+                *writes = FLAG_N | FLAG_Z | (shifter_carry ? FLAG_C : 0);
+            } else if (setcc) {
+                *writes = FLAGS_ALL;
+            }
+            break;
+        }
+        default:
+            *reads = FLAGS_ALL;
+            break;
+    }
+}
+
+/* Sets flags_dead of the instructions of the block insns[0..count) to the
+   flags they write which get overwritten before anything could look at
+   them, so that the translation doesn't need to store them. All flags are
+   live at the end of the block. */
+static inline void tir_flags_liveness(struct tir_insn *insns, unsigned int count) {
+    uint8_t live = FLAGS_ALL;
+    for (unsigned int i = count; i-- > 0; ) {
+        uint8_t reads, writes;
+        tir_insn_flags(&insns[i], &reads, &writes);
+        insns[i].flags_dead = writes & ~live;
+        if (insns[i].cond == 0xE)
+            live &= ~writes;
+        live |= reads;
+    }
+}
+
+// Counts the registers an instruction uses into uses, for choosing which to keep in host registers
+static inline void tir_reg_uses(const struct tir_insn *ir, unsigned int uses[16]) {
+    uint8_t regs[6] = { ir->rd, ir->rn, ir->rm, ir->rs, ir->op2.reg, TIR_NO_REG };
+    if (ir->op2.kind == TIR_SHIFT_REG)
+        regs[5] = ir->op2.amount;
+    for (int i = 0; i < 6; i++) {
+        if (regs[i] < 16)
+            uses[regs[i]]++;
+    }
+    if (ir->op == TIR_LDM_STM) {
+        for (int reg = 0; reg < 16; reg++)
+            uses[reg] += ir->regs >> reg & 1;
+    }
+    if (ir->opts & TIR_LINK)
+        uses[14]++;
+}
+
+#endif
@@ -0,0 +1,140 @@
+#ifndef TRANSLATION_PERFMAP_H
+#define TRANSLATION_PERFMAP_H
+
+/* Code shared by the translators: describes the translations to host
+   profilers if write_perf_map is set, so that they don't just see an
+   anonymous buffer. The symbols are named after the guest PC, like
+   arm_0x10012340 or thumb_0x10012340.
+
+   Each translation gets a line in /tmp/perf-<pid>.map, which "perf top"
+   and "perf report" read by themselves. That format can't tell code apart
+   which got evicted and replaced by another translation at the same address,
+   so each one also goes into /tmp/jit-<pid>.dump in the jitdump format,
+   with a timestamp. For that, use "perf record -k mono" and then
+   "perf inject --jit" before "perf report". */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __linux__
+
+#include <elf.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emu.h"
+
+#if defined(__x86_64__)
+    #define TPERF_ELF_MACH EM_X86_64
+#elif defined(__aarch64__)
+    #define TPERF_ELF_MACH EM_AARCH64
+#elif defined(__arm__)
+    #define TPERF_ELF_MACH EM_ARM
+#else
+    #define TPERF_ELF_MACH EM_386
+#endif
+
+#define TPERF_JITDUMP_MAGIC 0x4A695444 // "JiTD"
+#define TPERF_JIT_CODE_LOAD 0
+
+static struct {
+    int pid; // Which the files are for, forked processes get their own
+    FILE *map, *dump;
+    uint64_t code_index;
+} tperf;
+
+// Has to be the clock perf record -k mono uses
+static inline uint64_t tperf_timestamp()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void tperf_open()
+{
+    if (tperf.map)
+        fclose(tperf.map);
+    if (tperf.dump)
+        fclose(tperf.dump);
+    tperf.pid = getpid();
+    tperf.code_index = 0;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)tperf.pid);
+    tperf.map = fopen(path, "w");
+    if (tperf.map)
+        setvbuf(tperf.map, NULL, _IOLBF, 0);
+    else
+        emuprintf("Could not open %s\n", path);
+
+    snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)tperf.pid);
+    tperf.dump = fopen(path, "w+");
+    if (!tperf.dump)
+    {
+        emuprintf("Could not open %s\n", path);
+        return;
+    }
+
+    struct {
+        uint32_t magic, version, total_size, elf_mach, pad1, pid;
+        uint64_t timestamp, flags;
+    } header = { TPERF_JITDUMP_MAGIC, 1, sizeof(header), TPERF_ELF_MACH, 0, (uint32_t)tperf.pid, tperf_timestamp(), 0 };
+    fwrite(&header, sizeof(header), 1, tperf.dump);
+    fflush(tperf.dump);
+
+    // perf record finds the file through this mapping of it, which stays
+    if (mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(tperf.dump), 0) == MAP_FAILED)
+    {
+        fclose(tperf.dump);
+        tperf.dump = NULL;
+    }
+}
+
+// The host code from code to code + size is the translation of the block at pc
+static inline void tperf_add(const void *code, size_t size, uint32_t pc, bool thumb)
+{
+    if (!write_perf_map)
+        return;
+    if (tperf.pid != getpid())
+        tperf_open();
+
+    char name[32];
+    snprintf(name, sizeof(name), "%s_0x%08x", thumb ? "thumb" : "arm", pc);
+
+    if (tperf.map)
+        fprintf(tperf.map, "%lx %lx %s\n", (unsigned long)(uintptr_t)code, (unsigned long)size, name);
+
+    if (tperf.dump)
+    {
+        size_t name_size = strlen(name) + 1;
+        struct {
+            uint32_t id, total_size;
+            uint64_t timestamp;
+            uint32_t pid, tid;
+            uint64_t vma, code_addr, code_size, code_index;
+        } record = { TPERF_JIT_CODE_LOAD, (uint32_t)(sizeof(record) + name_size + size), tperf_timestamp(),
+                     (uint32_t)tperf.pid, (uint32_t)syscall(SYS_gettid),
+                     (uintptr_t)code, (uintptr_t)code, size, tperf.code_index++ };
+        fwrite(&record, sizeof(record), 1, tperf.dump);
+        fwrite(name, name_size, 1, tperf.dump);
+        fwrite(code, size, 1, tperf.dump);
+        fflush(tperf.dump);
+    }
+}
+
+#else
+
+static inline void tperf_add(const void *code, size_t size, uint32_t pc, bool thumb)
+{
+    (void) code; (void) size; (void) pc; (void) thumb;
+}
+
+#endif
+
+#endif //TRANSLATION_PERFMAP_H
@@ -0,0 +1,229 @@
+#ifndef TRANSLATION_STORE_H
+#define TRANSLATION_STORE_H
+
+/* Code shared by the translators: a file which keeps translations across
+   runs of the emulator, so that code which runs on every boot does not need
+   to be translated again each time.
+
+   Records are looked up by the SHA-256 of the 1KB page the translation
+   starts in, its start address and whether it's Thumb code. The layout of
+   the data is up to the translator, it has to make the code position
+   independent itself. The file starts with a fingerprint of the emulator
+   binary, files written by something else are discarded as a whole.
+
+   New records are appended and flushed right away, so that they survive
+   the emulator getting killed. A truncated or damaged tail is dropped when
+   loading the file again. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sha256.h"
+#include "os/os.h"
+
+#define TSTORE_MAGIC 0x53544246 // "FBTS"
+#define TSTORE_RECORD_MAX 0x100000
+
+struct tstore_key {
+    uint32_t page_digest[8];
+    uint32_t start_pc;
+    uint32_t thumb;
+};
+
+struct tstore_record {
+    struct tstore_key key;
+    uint32_t size; // Of the data following the record
+    uint32_t check; // First word of the SHA-256 of the record, with check 0, and data
+};
+
+struct tstore_header {
+    uint32_t magic;
+    uint32_t fingerprint[8];
+};
+
+static struct {
+    bool open;
+    FILE *file; // NULL if writing failed
+    struct tstore_record **table; // Open addressing, size is a power of two
+    size_t table_size, count;
+} tstore;
+
+static inline bool tstore_is_open()
+{
+    return tstore.open;
+}
+
+static inline void tstore_make_key(struct tstore_key *key, uint32_t start_pc, const void *start_insnp, bool thumb)
+{
+    const uint8_t *page = (const uint8_t *)start_insnp - (start_pc & 0x3FF);
+    sha256_digest(page, 0x400, key->page_digest);
+    key->start_pc = start_pc;
+    key->thumb = thumb;
+}
+
+static inline uint32_t tstore_check(struct tstore_record *record)
+{
+    uint32_t digest[8], check = record->check;
+    record->check = 0;
+    sha256_digest(record, sizeof(*record) + record->size, digest);
+    record->check = check;
+    return digest[0];
+}
+
+static inline size_t tstore_slot(const struct tstore_key *key)
+{
+    size_t slot = (key->page_digest[0] ^ key->start_pc * 0x9E3779B1u ^ key->thumb) & (tstore.table_size - 1);
+    while (tstore.table[slot] && memcmp(&tstore.table[slot]->key, key, sizeof(*key)))
+        slot = (slot + 1) & (tstore.table_size - 1);
+
+    return slot;
+}
+
+static inline void tstore_insert(struct tstore_record *record)
+{
+    if ((tstore.count + 1) * 2 > tstore.table_size)
+    {
+        struct tstore_record **old = tstore.table;
+        size_t old_size = tstore.table_size;
+        tstore.table_size = old_size ? old_size * 2 : 0x1000;
+        tstore.table = (struct tstore_record **) calloc(tstore.table_size, sizeof(*tstore.table));
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i])
+                tstore.table[tstore_slot(&old[i]->key)] = old[i];
+        free(old);
+    }
+
+    size_t slot = tstore_slot(&record->key);
+    if (tstore.table[slot])
+    {
+        free(record);
+        return;
+    }
+
+    tstore.table[slot] = record;
+    tstore.count++;
+}
+
+// Returns the record for key or NULL
+static inline const struct tstore_record *tstore_find(const struct tstore_key *key)
+{
+    if (!tstore.count)
+        return NULL;
+
+    return tstore.table[tstore_slot(key)];
+}
+
+static inline bool tstore_write(const struct tstore_record *record)
+{
+    return fwrite(record, sizeof(*record) + record->size, 1, tstore.file) == 1;
+}
+
+static inline void tstore_close()
+{
+    if (tstore.file)
+        fclose(tstore.file);
+    tstore.file = NULL;
+    tstore.open = false;
+
+    for (size_t i = 0; i < tstore.table_size; i++)
+        free(tstore.table[i]);
+    free(tstore.table);
+    tstore.table = NULL;
+    tstore.table_size = tstore.count = 0;
+}
+
+/* Loads all records of the file at path and keeps it open for appending.
+   If the file has a different fingerprint or a broken record, it gets
+   written again with the records which are still usable. */
+static inline bool tstore_open(const char *path, const uint32_t fingerprint[8])
+{
+    tstore_close();
+
+    bool rewrite = true;
+    FILE *file = fopen_utf8(path, "rb");
+    if (file)
+    {
+        struct tstore_header header;
+        if (fread(&header, sizeof(header), 1, file) == 1
+            && header.magic == TSTORE_MAGIC && !memcmp(header.fingerprint, fingerprint, sizeof(header.fingerprint)))
+        {
+            for (;;)
+            {
+                struct tstore_record head;
+                size_t got = fread(&head, 1, sizeof(head), file);
+                if (got != sizeof(head))
+                {
+                    // Only nothing at all is a clean end of the file
+                    rewrite = got != 0 || !feof(file);
+                    break;
+                }
+                if (head.size > TSTORE_RECORD_MAX)
+                    break;
+
+                struct tstore_record *record = (struct tstore_record *) malloc(sizeof(head) + head.size);
+                if (!record)
+                    break;
+                *record = head;
+                if (fread(record + 1, head.size, 1, file) != 1 || tstore_check(record) != head.check)
+                {
+                    free(record);
+                    break;
+                }
+                tstore_insert(record);
+            }
+        }
+        fclose(file);
+    }
+
+    if (!rewrite)
+    {
+        tstore.file = fopen_utf8(path, "ab");
+        tstore.open = tstore.file != NULL;
+        return tstore.open;
+    }
+
+    tstore.file = fopen_utf8(path, "wb");
+    if (!tstore.file)
+        return false;
+
+    struct tstore_header header;
+    header.magic = TSTORE_MAGIC;
+    memcpy(header.fingerprint, fingerprint, sizeof(header.fingerprint));
+    bool success = fwrite(&header, sizeof(header), 1, tstore.file) == 1;
+    for (size_t i = 0; success && i < tstore.table_size; i++)
+        if (tstore.table[i])
+            success = tstore_write(tstore.table[i]);
+
+    if (!success || fflush(tstore.file) != 0)
+    {
+        tstore_close();
+        return false;
+    }
+    tstore.open = true;
+    return true;
+}
+
+// Stores size bytes of data for key, in memory and in the file
+static inline void tstore_add(const struct tstore_key *key, const void *data, uint32_t size)
+{
+    struct tstore_record *record = (struct tstore_record *) malloc(sizeof(*record) + size);
+    if (!record)
+        return;
+
+    record->key = *key;
+    record->size = size;
+    memcpy(record + 1, data, size);
+    record->check = 0;
+    record->check = tstore_check(record);
+
+    if (tstore.file && (!tstore_write(record) || fflush(tstore.file) != 0))
+    {
+        // Don't bother anymore
+        fclose(tstore.file);
+        tstore.file = NULL;
+    }
+    tstore_insert(record);
+}
+
+#endif //TRANSLATION_STORE_H
@@ -10,6 +10,9 @@
 extern void usblink_receive(int ep, uint8_t *buf, uint32_t size);
 extern void usblink_complete_send(int ep);
 
+// TDs used for one transfer at most, in case the list is circular
+#define USB_TD_CHAIN_MAX 64
+
 usb_state usb;
 
 struct usb_qh { // Queue head
@@ -72,6 +75,37 @@ static void usb_prime(struct usb_qh *qh, uint32_t epbit) {
     usb.epsr |= epbit;
 }
 
+/* Copies size bytes between data and the buffer of the TD. The buffer may
+   span up to five 4kB pages, bufptr[0] has the offset into the first one.
+   Returns false if part of it isn't memory. */
+static bool usb_td_copy(const struct usb_td *td, uint8_t *data, uint32_t size, bool to_guest) {
+    uint32_t pos = td->bufptr[0] & 0xFFF;
+    while (size) {
+        unsigned int page = pos >> 12;
+        if (page >= 5)
+            return false;
+
+        uint32_t chunk = 0x1000 - (pos & 0xFFF);
+        if (chunk > size)
+            chunk = size;
+        uint8_t *buf = (uint8_t *)(intptr_t)phys_mem_ptr((td->bufptr[page] & ~0xFFF) + (pos & 0xFFF), chunk);
+        if (!buf)
+            return false;
+
+        if (to_guest)
+            memcpy(buf, data, chunk);
+        else
+            memcpy(data, buf, chunk);
+        data += chunk;
+        pos += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+/* Finishes the current TD with size bytes transferred. Like the real
+   controller, this goes on with the next TD in the list right away, the
+   endpoint only stops being primed at the end of it. */
 static void usb_complete(struct usb_qh *qh, uint32_t epbit, uint32_t size) {
     uint32_t tda = qh->current_td;
     if (tda & 0x1F)
@@ -82,12 +116,16 @@ static void usb_complete(struct usb_qh *qh, uint32_t epbit, uint32_t size) {
 
     td->flags -= size << 16;
     td->flags &= ~0xFF; // clear status bits
-    usb.epsr &= ~epbit;
     usb.epcomplete |= epbit;
     if (qh->overlay.flags & 0x8000) { // IOC (interrupt on complete)
         usb.usbsts |= 1;
         usb_int_check();
     }
+
+    if (qh->overlay.next_td & 1) // Terminate
+        usb.epsr &= ~epbit;
+    else
+        usb_prime(qh, epbit);
 }
 
 void usb_receive_setup_packet(int endpoint, const void *packet) {
@@ -103,6 +141,8 @@ void usb_receive_setup_packet(int endpoint, const void *packet) {
     }
 }
 
+/* The data fills the TDs of the endpoint one after another, the one it ends
+   in gets completed as with a short packet. */
 void usb_receive_packet(int endpoint, const void *packet, uint32_t size) {
     if (!(usb.epsr & (1 << endpoint))) {
         printf("USB: can't receive packet, endpoint not primed\n");
@@ -111,20 +151,25 @@ void usb_receive_packet(int endpoint, const void *packet, uint32_t size) {
     struct usb_qh *qh = (struct usb_qh *)(intptr_t)phys_mem_ptr(usb.eplistaddr + (endpoint * 0x80), 0x30);
     if (!qh)
         error("USB: bad QH");
-    uint32_t maxsize = qh->overlay.flags >> 16 & 0x7FFF;
-    //printf("USB: receiving %d, max %d\n", size, maxsize);
-    if (size > maxsize) {
-        printf("USB: too big\n");
-        return;
-    }
-    if (size) {
-        // assumes contiguous buffer
-        void *buf = (void *)(intptr_t)phys_mem_ptr(qh->overlay.bufptr[0], size);
-        if (!buf)
+
+    const uint8_t *data = (const uint8_t *)packet;
+    int tds = 0;
+    do {
+        if (!(usb.epsr & (1 << endpoint)) || tds++ == USB_TD_CHAIN_MAX) {
+            printf("USB: too big, %u bytes dropped\n", size);
+            return;
+        }
+
+        uint32_t maxsize = qh->overlay.flags >> 16 & 0x7FFF;
+        uint32_t chunk = size < maxsize ? size : maxsize;
+        //printf("USB: receiving %d, max %d\n", chunk, maxsize);
+        if (!usb_td_copy(&qh->overlay, (uint8_t *)data, chunk, true))
             error("USB: bad buffer");
-        memcpy(buf, packet, size);
-    }
-    usb_complete(qh, 1 << endpoint, size);
+
+        usb_complete(qh, 1 << endpoint, chunk);
+        data += chunk;
+        size -= chunk;
+    } while (size);
 }
 
 /* B0000000 (and B4000000?): USB */
@@ -240,11 +285,18 @@ void usb_write_word(uint32_t addr, uint32_t value) {
                         error("USB: bad QH");
                     usb_prime(qh, 0x10000 << ep);
 
-                    uint32_t size = qh->overlay.flags >> 16 & 0x7FFF;
-                    uint8_t *buf = (uint8_t*)(intptr_t)phys_mem_ptr(qh->overlay.bufptr[0], size);
-                    usblink_receive(ep, buf, size);
+                    // Each TD is a transfer of its own, as long as the list goes
+                    static uint8_t buf[5 * 0x1000];
+                    for (int tds = 0; tds < USB_TD_CHAIN_MAX && (usb.epsr & (0x10000 << ep)); tds++) {
+                        uint32_t size = qh->overlay.flags >> 16 & 0x7FFF;
+                        if (size > sizeof(buf) || !usb_td_copy(&qh->overlay, buf, size, false)) {
+                            printf("USB: bad buffer\n");
+                            usblink_receive(ep, buf, 0);
+                        } else
+                            usblink_receive(ep, buf, size);
 
-                    usb_complete(qh, 0x10000 << ep, size);
+                        usb_complete(qh, 0x10000 << ep, size);
+                    }
                 }
             }
             return;
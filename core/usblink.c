@@ -7,6 +7,7 @@
 #include "emu.h"
 #include "usb.h"
 #include "usblink.h"
+#include "usblink_io.h"
 #include "os/os.h"
 
 struct packet {
@@ -75,13 +76,13 @@ uint8_t usblink_header_checksum(struct packet *packet) {
 }
 
 static void dump_packet(char *type, void *data, uint32_t size) {
-    if (log_enabled[LOG_USB])
+    if (log_active(LOG_USB))
     {
         uint32_t i;
-        emuprintf("%s", type);
+        logprintf(LOG_USB, "%s", type);
         for (i = 0; i < size; i++)
-            emuprintf(" %02x %c", ((uint8_t *)data)[i], isprint(((uint8_t *)data)[i]) ? ((uint8_t *)data)[i] : '?');
-        emuprintf("\n");
+            logprintf(LOG_USB, " %02x %c", ((uint8_t *)data)[i], isprint(((uint8_t *)data)[i]) ? ((uint8_t *)data)[i] : '?');
+        logprintf(LOG_USB, "\n");
     }
 }
 
@@ -107,9 +108,34 @@ static usblink_dirlist_cb current_dirlist_callback;
 static usblink_progress_cb current_file_callback;
 static void *current_user_data = NULL;
 
-FILE *put_file = NULL;
 uint32_t put_file_size, put_file_size_orig;
 uint16_t put_file_port;
+
+/* NavNet acks each packet before the next one can be sent and has no larger
+   packets, so only the file I/O can be done ahead. That's up to usblink_io,
+   data which isn't read yet gets sent by usblink_timer once it is. */
+static bool put_file_waiting;
+// The largest File_Contents, as the calculator sends them
+#define CONTENTS_MAX 253
+
+// For usblink_transfer_rate
+static uint64_t transfer_start;
+static uint32_t transfer_bytes;
+
+static void transfer_begin(FILE *file, bool writing) {
+    usblink_io_open(file, writing);
+    put_file_waiting = false;
+    transfer_start = sched_cputick();
+    transfer_bytes = 0;
+}
+
+uint32_t usblink_transfer_rate() {
+    uint64_t cycles = sched_cputick() - transfer_start;
+    if (!cycles)
+        return 0;
+    return (uint64_t)transfer_bytes * sched.clock_rates[CLOCK_CPU] / cycles;
+}
+
 enum {
     SENDING_03         = 1,
     RECVING_04         = 2,
@@ -120,8 +146,48 @@ enum {
     EXPECT_FF_00       = 16, // Sent to us after first OS data packet
 } put_file_state;
 
-void put_file_next(struct packet *in) {
+static void put_file_send_data(void) {
     struct packet *out = &usblink_send_buffer;
+    if (prev_seqno == 1)
+        throttle_timer_off();
+    if (put_file_size > 0) {
+        /* Send data (05) */
+        uint32_t len = put_file_size;
+        if (len > CONTENTS_MAX)
+            len = CONTENTS_MAX;
+        if (!usblink_io_read(out->data + 1, len)) {
+            put_file_waiting = true;
+            return;
+        }
+        put_file_size -= len;
+        transfer_bytes += len;
+        out->src.service = SID_File;
+        out->dst.service = put_file_port;
+        out->data_size = 1 + len;
+        out->ack = 0;
+        out->seqno = next_seqno();
+        out->data[0] = File_Contents;
+        usblink_send_packet();
+
+        static int old_progress = 101;
+        //Not 100 as the completion is signaled seperately and mustn't happen more than once
+        int progress = ((uint64_t)(put_file_size_orig-put_file_size) * 99) / put_file_size_orig;
+        if(old_progress != progress)
+        {
+            old_progress = progress;
+            gui_status_printf("Sending file: %u bytes left, %u KiB/s", put_file_size, usblink_transfer_rate() / 1024);
+            if(current_file_callback)
+                current_file_callback(progress, current_user_data);
+        }
+        return;
+    }
+
+    gui_status_printf("Send complete");
+    throttle_timer_on();
+    put_file_state = DONE;
+}
+
+void put_file_next(struct packet *in) {
     int16_t status = 0;
     if(in && in->data_size >= 2)
     {
@@ -145,41 +211,7 @@ void put_file_next(struct packet *in) {
         case ACKING_04_or_FF_00:
             if (in) goto fail;
             put_file_state++;
-send_data:
-            if (prev_seqno == 1)
-            {
-                gui_status_printf("Sending file: %u bytes left", put_file_size);
-                throttle_timer_off();
-            }
-            if (put_file_size > 0) {
-                /* Send data (05) */
-                uint32_t len = put_file_size;
-                if (len > 253)
-                    len = 253;
-                put_file_size -= len;
-                out->src.service = SID_File;
-                out->dst.service = put_file_port;
-                out->data_size = 1 + len;
-                out->ack = 0;
-                out->seqno = next_seqno();
-                out->data[0] = File_Contents;
-                fread(out->data + 1, 1, len, put_file);
-                usblink_send_packet();
-
-                if(current_file_callback)
-                {
-                    static int old_progress = 101;
-                    //Not 100 as the completion is signaled seperately and mustn't happen more than once
-                    int progress = ((put_file_size_orig-put_file_size) * 99) / put_file_size_orig;
-                    if(old_progress != progress)
-                        current_file_callback(old_progress = progress, current_user_data);
-                }
-                break;
-            }
-
-            gui_status_printf("Send complete");
-            throttle_timer_on();
-            put_file_state = DONE;
+            put_file_send_data();
             break;
         case SENDING_05:
             if (!in || in->ack != 0x0A) goto fail;
@@ -187,7 +219,8 @@ send_data:
                 put_file_state++;
                 break;
             }
-            goto send_data;
+            put_file_send_data();
+            break;
         case RECVING_FF_00: /* Got FF 00: OS header is valid */
             if (!in || in->data_size != 2 || in->data[0] != 0xFF || in->data[1]) {
                 emuprintf("File send error: Didn't get FF 00\n");
@@ -209,8 +242,8 @@ fail:
             if(current_file_callback)
                 current_file_callback((in->data_size == 2 && in->data[0] == 0xFF && in->data[1] == 00) ? 100 : 0, current_user_data);
             put_file_state = 0;
-            fclose(put_file);
-            put_file = NULL;
+            put_file_waiting = false;
+            usblink_io_close();
             break;
     }
 }
@@ -251,20 +284,26 @@ void get_file_next(struct packet *in)
         put_file_size += in->data_size - 1;
 
         if(put_file_size > put_file_size_orig)
-            in->data_size -= put_file_size_orig - put_file_size;
-
-        if(current_file_callback)
         {
-            static int old_progress = 101;
-            // Not 100 as the completion is signaled seperately and mustn't happen more than once
-            int progress = (put_file_size * 99) / put_file_size_orig;
-            if(old_progress != progress)
-                current_file_callback(old_progress = progress, current_user_data);
+            in->data_size -= put_file_size - put_file_size_orig;
+            put_file_size = put_file_size_orig;
         }
 
-        fwrite(in->data + 1, 1, in->data_size - 1, put_file);
+        usblink_io_write(in->data + 1, in->data_size - 1);
+        transfer_bytes += in->data_size - 1;
 
-        if(in->data_size < 254 || put_file_size == put_file_size_orig)
+        static int old_progress = 101;
+        // Not 100 as the completion is signaled seperately and mustn't happen more than once
+        int progress = ((uint64_t)put_file_size * 99) / put_file_size_orig;
+        if(old_progress != progress)
+        {
+            old_progress = progress;
+            gui_status_printf("Receiving file: %u bytes left, %u KiB/s", put_file_size_orig - put_file_size, usblink_transfer_rate() / 1024);
+            if(current_file_callback)
+                current_file_callback(progress, current_user_data);
+        }
+
+        if(in->data_size < 1 + CONTENTS_MAX || put_file_size == put_file_size_orig)
         {
             // Send last packet
             struct packet *out = &usblink_send_buffer;
@@ -278,21 +317,29 @@ void get_file_next(struct packet *in)
             out->data_size = data - out->data;
             usblink_send_packet();
 
-            fclose(put_file);
-            put_file = NULL;
+            bool written = usblink_io_close();
 
             if(current_file_callback)
-                current_file_callback(put_file_size == put_file_size_orig ? 100 : -1, current_user_data);
+                current_file_callback(written && put_file_size == put_file_size_orig ? 100 : -1, current_user_data);
         }
     }
 }
 
+/* Starts the next queued action right when the link is idle after the last
+   one, instead of on the next usblink_timer. */
+static void usblink_idle() {
+    extern void usblink_queue_do();
+    if (!usblink_sending)
+        usblink_queue_do();
+}
+
 void usblink_sent_packet() {
     if (usblink_send_buffer.ack) {
         /* Received packet has been acked */
         uint16_t service = usblink_send_buffer.dst.service;
         if (service == BSWAP16(0x4060) || service == BSWAP16(0x4080))
             put_file_next(NULL);
+        usblink_idle();
     }
 }
 
@@ -446,6 +493,9 @@ void usblink_received_packet(uint8_t *data, uint32_t size) {
         out->seqno = in->seqno;
         memcpy(&out->data[0], &in->dst.service, sizeof(in->dst.service)); // *(uint16_t *)&out->data[0] = in->dst.service;
         usblink_send_packet();
+    } else {
+        // Our last packet got acked
+        usblink_idle();
     }
 }
 
@@ -476,9 +526,7 @@ bool usblink_put_file(const char *filepath, const char *folder, usblink_progress
         gui_perror(filepath);
         return 0;
     }
-    if (put_file)
-        fclose(put_file);
-    put_file = f;
+    transfer_begin(f, false);
     fseek(f, 0, SEEK_END);
     put_file_size_orig = put_file_size = ftell(f);
     fseek(f, 0, SEEK_SET);
@@ -536,9 +584,7 @@ bool usblink_send_os(const char *filepath, usblink_progress_cb callback, void *u
     FILE *f = fopen_utf8(filepath, "rb");
     if (!f)
         return false;
-    if (put_file)
-        fclose(put_file);
-    put_file = f;
+    transfer_begin(f, false);
     fseek(f, 0, SEEK_END);
     put_file_size_orig = put_file_size = ftell(f);
     fseek(f, 0, SEEK_SET);
@@ -601,11 +647,10 @@ bool usblink_get_file(const char *path, const char *dest, usblink_progress_cb ca
     current_file_callback = callback;
     current_user_data = user_data;
 
-    if (put_file)
-        fclose(put_file);
-    put_file = fopen_utf8(dest, "wb");
-    if(!put_file)
+    FILE *f = fopen_utf8(dest, "wb");
+    if(!f)
         return false;
+    transfer_begin(f, true);
 
     /* Send the first packet */
     struct packet *out = &usblink_send_buffer;
@@ -686,8 +731,8 @@ struct usb_setup {
 void usblink_reset() {
     if (put_file_state) {
         put_file_state = 0;
-        fclose(put_file);
-        put_file = NULL;
+        put_file_waiting = false;
+        usblink_io_close();
     }
     usblink_connected = false;
     gui_usblink_changed(usblink_connected);
@@ -706,6 +751,11 @@ void usblink_connect() {
 // no easy way to tell when it's ok to turn bus reset off,
 // (putting the device into the default state) so do it on a timer :/
 void usblink_timer() {
+    if (put_file_waiting) {
+        put_file_waiting = false;
+        put_file_send_data();
+    }
+
     switch (usblink_state) {
         case 1:
             usb_bus_reset_on();
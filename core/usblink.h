@@ -31,6 +31,9 @@ bool usblink_put_file(const char *filepath, const char *folder, usblink_progress
 void usblink_new_dir(const char *path, usblink_progress_cb callback, void *user_data);
 void usblink_move(const char *old_path, const char *new_path, usblink_progress_cb callback, void *user_data);
 bool usblink_send_os(const char *filepath, usblink_progress_cb callback, void *user_data);
+/* Bytes per emulated second of the current or last file transfer,
+   for progress callbacks to show. */
+uint32_t usblink_transfer_rate();
 
 void usblink_reset();
 void usblink_connect();
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "usblink_io.h"
+
+static const size_t ring_size = 1 << 20;
+
+static std::mutex io_mutex; // For everything but the file, which belongs to the worker while it runs
+static std::condition_variable io_cond; // Data got added to or taken from the ring
+static std::thread worker;
+static std::vector<uint8_t> ring;
+// The data starts at ring_start, ring_fill bytes of it
+static size_t ring_start, ring_fill;
+static FILE *io_file;
+static bool io_writing, io_stopping, io_end, io_failed;
+
+// The free space after the data, in one piece
+static size_t ring_free_piece(size_t *offset)
+{
+    *offset = (ring_start + ring_fill) % ring_size;
+    return std::min(ring_size - ring_fill, ring_size - *offset);
+}
+
+// Reads into the free space, with the lock held by lock
+static void io_read_piece(std::unique_lock<std::mutex> &lock)
+{
+    size_t offset, size = std::min<size_t>(ring_free_piece(&offset), 0x10000);
+
+    // Nobody else touches the free space
+    lock.unlock();
+    size_t done = fread(ring.data() + offset, 1, size, io_file);
+    lock.lock();
+
+    ring_fill += done;
+    if(done < size)
+    {
+        io_end = true;
+        io_failed = ferror(io_file);
+    }
+}
+
+// Writes the data from the start, as much as is in one piece
+static void io_write_piece(std::unique_lock<std::mutex> &lock)
+{
+    size_t size = std::min(ring_fill, ring_size - ring_start);
+
+    lock.unlock();
+    bool success = fwrite(ring.data() + ring_start, 1, size, io_file) == size;
+    lock.lock();
+
+    ring_start = (ring_start + size) % ring_size;
+    ring_fill -= size;
+    if(!success)
+        io_failed = true;
+}
+
+static void io_work()
+{
+    std::unique_lock<std::mutex> lock(io_mutex);
+    for(;;)
+    {
+        if(io_writing)
+        {
+            io_cond.wait(lock, [] { return ring_fill || io_stopping; });
+            if(!ring_fill)
+                return;
+
+            io_write_piece(lock);
+        }
+        else
+        {
+            io_cond.wait(lock, [] { return ring_fill < ring_size || io_stopping; });
+            if(io_stopping)
+                return;
+
+            io_read_piece(lock);
+            if(io_end)
+                return;
+        }
+
+        io_cond.notify_all();
+    }
+}
+
+void usblink_io_open(FILE *file, bool writing)
+{
+    usblink_io_close();
+
+    std::lock_guard<std::mutex> lock(io_mutex);
+    ring.resize(ring_size);
+    ring_start = ring_fill = 0;
+    io_file = file;
+    io_writing = writing;
+    io_stopping = io_end = io_failed = false;
+
+    try
+    {
+        worker = std::thread(io_work);
+    }
+    catch(const std::system_error &)
+    {
+        // Without threads, the file gets read and written right away
+    }
+}
+
+bool usblink_io_read(uint8_t *data, uint32_t len)
+{
+    std::unique_lock<std::mutex> lock(io_mutex);
+    if(!worker.joinable())
+    {
+        while(ring_fill < len && !io_end)
+            io_read_piece(lock);
+    }
+
+    if(ring_fill < len && !io_end)
+        return false;
+
+    uint32_t available = std::min<size_t>(len, ring_fill);
+    for(uint32_t done = 0; done < available;)
+    {
+        size_t size = std::min<size_t>(available - done, ring_size - ring_start);
+        memcpy(data + done, ring.data() + ring_start, size);
+        ring_start = (ring_start + size) % ring_size;
+        ring_fill -= size;
+        done += size;
+    }
+
+    // The file got shorter
+    memset(data + available, 0, len - available);
+
+    io_cond.notify_all();
+    return true;
+}
+
+void usblink_io_write(const uint8_t *data, uint32_t len)
+{
+    std::unique_lock<std::mutex> lock(io_mutex);
+    while(len)
+    {
+        if(ring_fill == ring_size)
+        {
+            if(worker.joinable())
+                io_cond.wait(lock, [] { return ring_fill < ring_size; });
+            else
+                io_write_piece(lock);
+        }
+
+        size_t offset, size = std::min<size_t>(ring_free_piece(&offset), len);
+        memcpy(ring.data() + offset, data, size);
+        ring_fill += size;
+        data += size;
+        len -= size;
+    }
+
+    io_cond.notify_all();
+}
+
+bool usblink_io_close()
+{
+    std::unique_lock<std::mutex> lock(io_mutex);
+    if(!io_file)
+        return true;
+
+    io_stopping = true;
+    io_cond.notify_all();
+
+    lock.unlock();
+    if(worker.joinable())
+        worker.join();
+    lock.lock();
+
+    // Without a worker, or if it stopped
+    while(io_writing && ring_fill && !io_failed)
+        io_write_piece(lock);
+
+    bool success = !io_failed;
+    if(fclose(io_file) != 0)
+        success = false;
+
+    io_file = nullptr;
+    ring.clear();
+    ring.shrink_to_fit();
+    return success;
+}
+
+bool usblink_io_is_open()
+{
+    std::lock_guard<std::mutex> lock(io_mutex);
+    return io_file != nullptr;
+}
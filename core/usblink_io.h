@@ -0,0 +1,34 @@
+/* Declarations for usblink_io.cpp */
+
+#ifndef _H_USBLINK_IO
+#define _H_USBLINK_IO
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The file of a usblink transfer gets read and written by a worker thread,
+   through a ring buffer, so that a slow file system doesn't hold up the
+   emulation in the middle of a transfer. Only one file at a time. */
+
+// Takes over the file, closing the previous one
+void usblink_io_open(FILE *file, bool writing);
+/* Copies the next len bytes of the file into data. Returns false without
+   taking any if the worker didn't read that far yet. After the end of the
+   file, the missing bytes are zeroes. */
+bool usblink_io_read(uint8_t *data, uint32_t len);
+// Only waits for the worker if it's behind by the whole buffer
+void usblink_io_write(const uint8_t *data, uint32_t len);
+// Writes what's left and closes the file, returns false if anything failed
+bool usblink_io_close();
+bool usblink_io_is_open();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,10 +1,25 @@
+#include <algorithm>
 #include <cassert>
 #include <atomic>
-#include <queue>
+#include <deque>
 #include <chrono>
+#include <memory>
 #include <thread>
+#include <vector>
 
+#include "emu.h"
 #include "usblink_queue.h"
+#include "os/os.h"
+
+// What the actions of a directory transfer report to, as a whole
+struct usblink_batch {
+    usblink_progress_cb progress_callback;
+    void *user_data;
+    unsigned int actions = 0; // Still in the queue
+    unsigned int files = 0, files_done = 0;
+    int last_progress = -1;
+    bool failed = false;
+};
 
 struct usblink_queue_action {
     enum {
@@ -15,7 +30,9 @@ struct usblink_queue_action {
         DEL_FILE,
         NEW_DIR,
         DEL_DIR,
-        GET_FILE
+        GET_FILE,
+        PUT_DIR, // Turns into NEW_DIR and PUT_FILE or PUT_DIR for each entry
+        GET_DIR // Turns into GET_FILE or GET_DIR for each entry, after a dirlist
     } action;
 
     //Members only used if the appropriate action is set
@@ -24,10 +41,146 @@ struct usblink_queue_action {
     usblink_progress_cb progress_callback = nullptr;
     usblink_dirlist_cb dirlist_callback = nullptr;
     void *user_data;
+    std::shared_ptr<usblink_batch> batch; // If part of a directory transfer
+    std::vector<std::pair<std::string, bool>> entries; // Of PUT_DIR or GET_DIR, name and whether it's a directory
 };
 
 static std::atomic_bool busy;
-static std::queue<usblink_queue_action> usblink_queue;
+static std::deque<usblink_queue_action> usblink_queue;
+
+static std::string basename(const std::string &path)
+{
+    size_t pos = path.find_last_of("/\\");
+    return pos == std::string::npos ? path : path.substr(pos + 1);
+}
+
+// Removes the finished front action of a batch and reports the progress of the batch
+static void batch_action_done(bool success)
+{
+    auto action = usblink_queue.front();
+    auto batch = action.batch;
+    usblink_queue.pop_front();
+
+    // The directory may exist already
+    if(!success && action.action != usblink_queue_action::NEW_DIR)
+        batch->failed = true;
+    if(action.action == usblink_queue_action::PUT_FILE || action.action == usblink_queue_action::GET_FILE)
+        batch->files_done++;
+
+    if(--batch->actions == 0)
+    {
+        if(batch->progress_callback)
+            batch->progress_callback(batch->failed ? -1 : 100, batch->user_data);
+    }
+}
+
+static void batch_progress(usblink_batch &batch, int file_progress)
+{
+    if(!batch.progress_callback || batch.files == 0)
+        return;
+
+    // Not 100 as the completion is signaled once the whole batch is done
+    int progress = std::min(99u, (batch.files_done * 100 + file_progress) / batch.files);
+    if(progress != batch.last_progress)
+        batch.progress_callback(batch.last_progress = progress, batch.user_data);
+}
+
+/* Replaces the front action by the ones for the entries of its directory,
+   with the same batch */
+static void batch_expand(std::vector<usblink_queue_action> &&actions)
+{
+    auto batch = usblink_queue.front().batch;
+    usblink_queue.pop_front();
+    batch->actions--;
+
+    for(auto it = actions.rbegin(); it != actions.rend(); ++it)
+    {
+        it->batch = batch;
+        it->user_data = batch->user_data;
+        if(it->action == usblink_queue_action::PUT_FILE || it->action == usblink_queue_action::GET_FILE)
+            batch->files++;
+        batch->actions++;
+        usblink_queue.push_front(std::move(*it));
+    }
+
+    if(batch->actions == 0 && batch->progress_callback)
+        batch->progress_callback(batch->failed ? -1 : 100, batch->user_data);
+}
+
+static void put_dir_entry(const char *name, bool is_dir, void *)
+{
+    usblink_queue.front().entries.emplace_back(name, is_dir);
+}
+
+// Lists the local directory and puts the actions to upload it in the queue
+static void put_dir_expand()
+{
+    usblink_queue_action &action = usblink_queue.front();
+    std::string remote_dir = action.path + "/" + basename(action.filepath);
+
+    if(!os_list_dir(action.filepath.c_str(), put_dir_entry, nullptr))
+    {
+        gui_perror(action.filepath.c_str());
+        action.batch->failed = true;
+        batch_expand({});
+        return;
+    }
+
+    std::vector<usblink_queue_action> actions(1);
+    actions[0].action = usblink_queue_action::NEW_DIR;
+    actions[0].path = remote_dir;
+
+    for(auto &entry : action.entries)
+    {
+        usblink_queue_action sub;
+        sub.action = entry.second ? usblink_queue_action::PUT_DIR : usblink_queue_action::PUT_FILE;
+        sub.filepath = action.filepath + "/" + entry.first;
+        sub.path = remote_dir;
+        actions.push_back(std::move(sub));
+    }
+
+    batch_expand(std::move(actions));
+}
+
+// Puts the actions to download the entries the dirlist of the front GET_DIR found in the queue
+static void get_dir_expand(bool is_error)
+{
+    usblink_queue_action &action = usblink_queue.front();
+    if(is_error)
+    {
+        action.batch->failed = true;
+        batch_expand({});
+        return;
+    }
+
+    std::vector<usblink_queue_action> actions;
+    for(auto &entry : action.entries)
+    {
+        usblink_queue_action sub;
+        sub.action = entry.second ? usblink_queue_action::GET_DIR : usblink_queue_action::GET_FILE;
+        sub.path = action.path + "/" + entry.first;
+        sub.filepath = action.filepath + "/" + entry.first;
+        actions.push_back(std::move(sub));
+    }
+
+    batch_expand(std::move(actions));
+}
+
+static void get_dir_entry(struct usblink_file *f, bool is_error, void *user_data)
+{
+    (void) user_data;
+    assert(!usblink_queue.empty());
+    assert(usblink_queue.front().action == usblink_queue_action::GET_DIR);
+
+    if(f)
+    {
+        usblink_queue.front().entries.emplace_back(f->filename, f->is_dir);
+        return;
+    }
+
+    get_dir_expand(is_error);
+    busy = false;
+}
 
 static void dirlist_callback(struct usblink_file *f, bool is_error, void *user_data)
 {
@@ -40,7 +193,7 @@ static void dirlist_callback(struct usblink_file *f, bool is_error, void *user_d
 
     if(!f)
     {
-        usblink_queue.pop();
+        usblink_queue.pop_front();
         busy = false;
     }
 }
@@ -49,6 +202,19 @@ static void progress_callback(int progress, void *user_data)
 {
     assert(!usblink_queue.empty());
     assert(usblink_queue.front().user_data == user_data);
+    if(usblink_queue.front().batch)
+    {
+        if(progress < 0 || progress == 100)
+        {
+            batch_action_done(progress == 100);
+            busy = false;
+        }
+        else if(usblink_queue.front().action == usblink_queue_action::PUT_FILE
+                || usblink_queue.front().action == usblink_queue_action::GET_FILE)
+            batch_progress(*usblink_queue.front().batch, progress);
+        return;
+    }
+
     if(usblink_queue.front().progress_callback != nullptr)
     {
         auto action = usblink_queue.front().action;
@@ -66,7 +232,7 @@ static void progress_callback(int progress, void *user_data)
 
     if(progress < 0 || progress == 100)
     {
-        usblink_queue.pop();
+        usblink_queue.pop_front();
         busy = false;
     }
 }
@@ -115,6 +281,25 @@ void usblink_queue_do()
             progress_callback(-1, action.user_data);
             busy = false;
         }
+        break;
+    case usblink_queue_action::PUT_DIR:
+        // Nothing to send yet, go on with the first entry right away
+        put_dir_expand();
+        busy = false;
+        usblink_queue_do();
+        break;
+    case usblink_queue_action::GET_DIR:
+        if(!os_make_dir(action.filepath.c_str()))
+        {
+            gui_perror(action.filepath.c_str());
+            get_dir_expand(true);
+            busy = false;
+            usblink_queue_do();
+            break;
+        }
+
+        usblink_dirlist(action.path.c_str(), get_dir_entry, action.user_data);
+        break;
     }
 }
 
@@ -124,12 +309,18 @@ void usblink_queue_reset()
     {
         // Treat as error
         usblink_queue_action action = usblink_queue.front();
+        if(action.batch)
+        {
+            batch_action_done(false);
+            continue;
+        }
+
         if(action.dirlist_callback)
             action.dirlist_callback(nullptr, true, action.user_data);
         else if(action.progress_callback)
             action.progress_callback(-1, action.user_data);
 
-        usblink_queue.pop();
+        usblink_queue.pop_front();
     }
 
     busy = false;
@@ -139,7 +330,7 @@ void usblink_queue_reset()
 
 void usblink_queue_add(usblink_queue_action &action)
 {
-    usblink_queue.push(action);
+    usblink_queue.push_back(action);
 
     if(!usblink_connected)
         usblink_connect();
@@ -229,3 +420,35 @@ unsigned int usblink_queue_size()
 {
     return usblink_queue.size();
 }
+
+// The batch of a directory transfer, which starts with this action
+static void usblink_queue_add_batch(usblink_queue_action &action, usblink_progress_cb callback, void *user_data)
+{
+    action.batch = std::make_shared<usblink_batch>();
+    action.batch->progress_callback = callback;
+    action.batch->user_data = user_data;
+    action.batch->actions = 1;
+    action.user_data = user_data;
+
+    usblink_queue_add(action);
+}
+
+void usblink_queue_put_dir(std::string dirpath, std::string folder, usblink_progress_cb callback, void *user_data)
+{
+    usblink_queue_action action;
+    action.action = usblink_queue_action::PUT_DIR;
+    action.filepath = dirpath;
+    action.path = folder;
+
+    usblink_queue_add_batch(action, callback, user_data);
+}
+
+void usblink_queue_download_dir(std::string path, std::string destpath, usblink_progress_cb callback, void *user_data)
+{
+    usblink_queue_action action;
+    action.action = usblink_queue_action::GET_DIR;
+    action.filepath = destpath;
+    action.path = path;
+
+    usblink_queue_add_batch(action, callback, user_data);
+}
@@ -17,6 +17,11 @@ void usblink_queue_put_file(std::string filepath, std::string folder, usblink_pr
 void usblink_queue_move(std::string old_path, std::string new_path, usblink_progress_cb callback, void *user_data);
 void usblink_queue_new_dir(std::string path, usblink_progress_cb callback, void *user_data);
 void usblink_queue_send_os(std::string filepath, usblink_progress_cb callback, void *user_data);
+/* Whole directories, recursively, as one action: dirpath gets uploaded into
+   folder and path downloaded as destpath. The callback gets the progress over
+   all files and 100 only once at the end, or -1 if any of them failed. */
+void usblink_queue_put_dir(std::string dirpath, std::string folder, usblink_progress_cb callback, void *user_data);
+void usblink_queue_download_dir(std::string path, std::string destpath, usblink_progress_cb callback, void *user_data);
 
 // Do one task from the queue
 extern "C" void usblink_queue_do();
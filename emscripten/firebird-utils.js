@@ -1,4 +1,42 @@
-var Module = { 'preRun': function() {
+// The page side: the emulation runs in a Web Worker (firebird.js with
+// firebird-worker.js), so the page never waits for it. The layout of the
+// shared buffers is the same as in firebird-worker.js.
+
+var FRAME_SIZE = 320 * 240 * 4;
+var FRAME_OFFSET = 16; // After the sequence number
+var INPUT_ENTRIES = 256; // A power of two
+var INPUT_HEADER = 4; // Written and read count
+var INPUT_ENTRY_SIZE = 5;
+
+var worker = new Worker('firebird.js');
+var files = {};
+
+// SharedArrayBuffer needs a cross-origin isolated page, otherwise it's messages
+var useShared = typeof SharedArrayBuffer !== 'undefined' && self.crossOriginIsolated !== false;
+var frameShared = null, frameSeq = null;
+var inputInts = null, inputFloats = null;
+var postedFrame = null;
+
+printOutput = function(text)
+{
+    var element = document.getElementById('output');
+    console.log(text);
+    if (element) {
+        element.value += text + "\n";
+        element.scrollTop = element.scrollHeight; // focus on bottom
+    }
+}
+
+worker.onmessage = function(event)
+{
+    var msg = event.data;
+    if (msg.type == 'print')
+        printOutput(msg.text);
+    else if (msg.type == 'ready')
+        document.getElementById('start').disabled = false;
+    else if (msg.type == 'frame')
+        postedFrame = new Uint8ClampedArray(msg.pixels);
+}
 
 initLCD = function()
 {
@@ -11,53 +49,98 @@ initLCD = function()
 
     var ctx = c.getContext('2d');
     var imageData = ctx.getImageData(0, 0, w, h);
-    var bufSize = w * h * 4;
-    var bufPtr = Module['_malloc'](bufSize);
-    var buf = new Uint8Array(Module['HEAPU8']['buffer'], bufPtr, bufSize);
+    var framePixels = frameShared ? new Uint8Array(frameShared, FRAME_OFFSET, FRAME_SIZE) : null;
+    var shownSeq = 0;
 
-    var wrappedPaint = Module['cwrap']('paintLCD', 'void', ['number']);
+    // At the display rate, if there's a new frame
     repaint = function() {
-        wrappedPaint(buf.byteOffset);
-        imageData.data.set(buf);
-        ctx.putImageData(imageData, 0, 0);
+        if (framePixels) {
+            var seq = Atomics.load(frameSeq, 0);
+            if (seq != shownSeq && !(seq & 1)) {
+                imageData.data.set(framePixels);
+                // Unless it got written in the meantime
+                if (Atomics.load(frameSeq, 0) == seq) {
+                    shownSeq = seq;
+                    ctx.putImageData(imageData, 0, 0);
+                }
+            }
+        } else if (postedFrame) {
+            imageData.data.set(postedFrame);
+            postedFrame = null;
+            ctx.putImageData(imageData, 0, 0);
+        }
         window.requestAnimationFrame(repaint);
     };
     repaint();
 }
 
-fileLoaded = function(event, filename)
-{
-    if (event.target.readyState == FileReader.DONE)
-        FS.writeFile(filename, new Uint8Array(event.target.result), {encoding: 'binary'});
-}
-
 fileLoad = function(event, filename)
 {
     var file = event.target.files[0];
 
     if(!file)
-        return FS.unlink(filename);
+        return delete files[filename];
 
     var reader = new FileReader();
     reader.onloadend = function(event)
         {
-            fileLoaded(event, filename);
+            if (event.target.readyState == FileReader.DONE)
+                files[filename] = event.target.result;
         };
 
-    if (file.webkitSlice)
-        var blob = file.webkitSlice(0, file.size);
-    else if (file.mozSlice)
-        var blob = file.mozSlice(0, file.size);
-    else
-        var blob = file.slice(0, file.size);
-
     reader.readAsArrayBuffer(file);
 }
 
 startEmulation = function()
 {
-    return Module.callMain();
+    if (!files['boot1.img'] || !files['flash.img'])
+        return printOutput('Select a boot1 and a flash image first.');
+
+    var msg = { type: 'start', boot1: files['boot1.img'], flash: files['flash.img'] };
+    if (useShared) {
+        frameShared = msg.frame = new SharedArrayBuffer(FRAME_OFFSET + FRAME_SIZE);
+        frameSeq = new Int32Array(frameShared, 0, 1);
+        msg.input = new SharedArrayBuffer((INPUT_HEADER + INPUT_ENTRIES * INPUT_ENTRY_SIZE) * 4);
+        inputInts = new Int32Array(msg.input);
+        inputFloats = new Float32Array(msg.input);
+    }
+
+    worker.postMessage(msg, [msg.boot1, msg.flash]);
+    files = {};
+    document.getElementById('start').disabled = true;
+    initLCD();
+}
+
+// kind 0 is a key (row, col, pressed), 1 the touchpad (x, y, contact, down)
+sendInput = function(kind, a, b, c, d)
+{
+    var written = inputInts ? Atomics.load(inputInts, 0) : 0;
+    if (!inputInts || ((written - Atomics.load(inputInts, 1)) | 0) >= INPUT_ENTRIES) {
+        worker.postMessage({ type: 'input', event: [kind, a, b, c, d] });
+        return;
+    }
+
+    var i = INPUT_HEADER + (written & (INPUT_ENTRIES - 1)) * INPUT_ENTRY_SIZE;
+    inputInts[i] = kind;
+    if (kind == 0) {
+        inputInts[i + 1] = a;
+        inputInts[i + 2] = b;
+    } else {
+        inputFloats[i + 1] = a;
+        inputFloats[i + 2] = b;
+    }
+    inputInts[i + 3] = c ? 1 : 0;
+    inputInts[i + 4] = d ? 1 : 0;
+    Atomics.store(inputInts, 0, (written + 1) | 0);
+}
+
+sendKey = function(row, col, pressed)
+{
+    sendInput(0, row, col, pressed, 0);
 }
 
-} // preRun function
-} // Module
\ No newline at end of file
+// x and y from 0 to 1
+sendTouchpad = function(x, y, contact, down)
+{
+    sendInput(1, x, y, contact, down);
+}
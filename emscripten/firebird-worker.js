@@ -0,0 +1,105 @@
+// Runs in the Web Worker with the emulation, prepended to firebird.js.
+// The layout of the shared buffers is the same as in firebird-utils.js.
+
+var FRAME_SIZE = 320 * 240 * 4;
+var FRAME_OFFSET = 16; // After the sequence number
+var INPUT_ENTRIES = 256; // A power of two
+var INPUT_HEADER = 4; // Written and read count
+var INPUT_ENTRY_SIZE = 5;
+
+var frameSeq = null, framePixels = null;
+var inputInts = null, inputFloats = null;
+// Without SharedArrayBuffer, or if the queue was full
+var pendingInput = [];
+
+var Module = {
+    'print': function(text) {
+        postMessage({'type': 'print', 'text': text});
+    },
+    'printErr': function(text) {
+        postMessage({'type': 'print', 'text': text});
+    },
+    'onRuntimeInitialized': function() {
+        postMessage({'type': 'ready'});
+    }
+};
+
+// From the slices, with ptr to a frame in RGBA
+presentFrame = function(ptr)
+{
+    var pixels = Module['HEAPU8'].subarray(ptr, ptr + FRAME_SIZE);
+    if(framePixels)
+    {
+        // Odd while the frame gets written, the page doesn't show it then
+        Atomics.add(frameSeq, 0, 1);
+        framePixels.set(pixels);
+        Atomics.add(frameSeq, 0, 1);
+    }
+    else
+    {
+        var copy = new Uint8Array(pixels);
+        postMessage({'type': 'frame', 'pixels': copy.buffer}, [copy.buffer]);
+    }
+}
+
+applyInput = function(kind, a, b, c, d)
+{
+    if(kind == 0)
+        Module['_keyEvent'](a, b, c);
+    else
+        Module['_touchpadEvent'](a, b, c, d);
+}
+
+// From the start of each slice
+takeInput = function()
+{
+    if(inputInts)
+        takeSharedInput();
+
+    // Sent while the queue was full, so after what's in it
+    while(pendingInput.length)
+    {
+        var event = pendingInput.shift();
+        applyInput(event[0], event[1], event[2], event[3], event[4]);
+    }
+}
+
+takeSharedInput = function()
+{
+    var read = Atomics.load(inputInts, 1), written = Atomics.load(inputInts, 0);
+    for(; read != written; read = (read + 1) | 0)
+    {
+        var i = INPUT_HEADER + (read & (INPUT_ENTRIES - 1)) * INPUT_ENTRY_SIZE;
+        if(inputInts[i] == 0)
+            applyInput(0, inputInts[i + 1], inputInts[i + 2], inputInts[i + 3], 0);
+        else
+            applyInput(1, inputFloats[i + 1], inputFloats[i + 2], inputInts[i + 3], inputInts[i + 4]);
+    }
+    Atomics.store(inputInts, 1, read);
+}
+
+onmessage = function(event)
+{
+    var msg = event.data;
+    if(msg['type'] == 'start')
+    {
+        FS.writeFile('boot1.img', new Uint8Array(msg['boot1']), {encoding: 'binary'});
+        FS.writeFile('flash.img', new Uint8Array(msg['flash']), {encoding: 'binary'});
+
+        if(msg['frame'])
+        {
+            frameSeq = new Int32Array(msg['frame'], 0, 1);
+            framePixels = new Uint8Array(msg['frame'], FRAME_OFFSET, FRAME_SIZE);
+        }
+        if(msg['input'])
+        {
+            inputInts = new Int32Array(msg['input']);
+            inputFloats = new Float32Array(msg['input']);
+        }
+
+        if(Module['callMain']() != 0)
+            postMessage({'type': 'print', 'text': 'Starting the emulation failed.'});
+    }
+    else if(msg['type'] == 'input')
+        pendingInput.push(msg['event']);
+}
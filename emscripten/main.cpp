@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <errno.h>
 
 #include <emscripten.h>
@@ -5,6 +6,14 @@
 #include "core/mmu.h"
 #include "core/debug.h"
 #include "core/emu.h"
+#include "core/keypad.h"
+#include "core/lcd.h"
+#include "core/schedule.h"
+
+/* This runs in a Web Worker (see firebird-worker.js), in slices of a number of
+   cycles which the browser gets control back after. The page shows the frames
+   and sends the input through SharedArrayBuffers, so neither side waits for
+   the other. */
 
 void gui_do_stuff(bool wait)
 {
@@ -54,94 +63,79 @@ void gui_debugger_request_input(debug_input_cb callback)
     callback(debug_in);
 }
 
-void gui_putchar(char c) { putc(c, stdout); }
+void gui_serial_write(const char *data, size_t size) { fwrite(data, 1, size, stdout); }
 int gui_getchar() { return -1; }
 void gui_set_busy(bool busy) {}
 void gui_show_speed(double d) {}
 void gui_usblink_changed(bool state) {}
 void throttle_timer_off() {}
 void throttle_timer_on() {}
-void throttle_timer_wait() {}
+void throttle_timer_wait(unsigned int usec) {}
+
+static bool frame_pending = true;
+
+void gui_lcd_changed()
+{
+    frame_pending = true;
+}
 
-extern "C" void EMSCRIPTEN_KEEPALIVE paintLCD(uint32_t *dest)
+extern "C" void EMSCRIPTEN_KEEPALIVE keyEvent(int row, int col, int state)
 {
-    static uint16_t LCDbuffer16[320*240];
+    keypad_set_key(row, col, state);
+}
 
-    uint16_t* in = LCDbuffer16;
+extern "C" void EMSCRIPTEN_KEEPALIVE touchpadEvent(float x, float y, int contact, int down)
+{
+    touchpad_set_state(x, y, contact, down);
+}
 
-    lcd_cx_draw_frame(LCDbuffer16);
+// As RGBA, for an ImageData
+static void present_frame()
+{
+    static uint32_t rgba[320 * 240];
 
-    for(int i = 320*240; i--;)
+    const uint16_t *in = lcd_frame_acquire();
+    for(uint32_t &out : rgba)
     {
-        *dest++ = ( ((*in & 0xf800) >> 8) | ((*in & 0x07e0) << 5) | ((*in & 0x1f) << 19))
-                    | 0xFF000000;
+        out = ((*in & 0xf800) >> 8) | ((*in & 0x07e0) << 5) | ((*in & 0x1f) << 19) | 0xFF000000;
         in++;
     }
+
+    EM_ASM({ presentFrame($0); }, rgba);
 }
 
-void step()
+// The slices get as many cycles as take about slice_ms to run
+static const double slice_ms = 8;
+static uint64_t slice_cycles = 1000000;
+static bool slice_started = false;
+
+static void slice_end()
 {
-    int i = 1000;
-    while(i--)
-    {
-        sched_process_pending_events();
-        while (!exiting && cycle_count_delta < 0)
-        {
-            if (cpu_events & (EVENT_FIQ | EVENT_IRQ)) {
-                // Align PC in case the interrupt occurred immediately after a jump
-                if (arm.cpsr_low28 & 0x20)
-                    arm.reg[15] &= ~1;
-                else
-                    arm.reg[15] &= ~3;
-
-                if (cpu_events & EVENT_WAITING)
-                    arm.reg[15] += 4; // Skip over wait instruction
-
-                arm.reg[15] += 4;
-                cpu_exception((cpu_events & EVENT_FIQ) ? EX_FIQ : EX_IRQ);
-            }
-            cpu_events &= ~EVENT_WAITING;
-
-            if (arm.cpsr_low28 & 0x20)
-                cpu_thumb_loop();
-            else
-                cpu_arm_loop();
-        }
-    }
+    exiting = true;
 }
 
-void emscripten_loop(bool reset)
+static void run_slice()
 {
-    if(reset)
-    {
-        memset(mem_areas[1].ptr, 0, mem_areas[1].size);
-
-        memset(&arm, 0, sizeof arm);
-        arm.control = 0x00050078;
-        arm.cpsr_low28 = MODE_SVC | 0xC0;
-        cpu_events &= EVENT_DEBUG_STEP;
+    EM_ASM(takeInput());
 
-        sched_reset();
-        sched.items[SCHED_THROTTLE].clock = CLOCK_27M;
-        sched.items[SCHED_THROTTLE].proc = do_stuff;
-
-        memory_reset();
+    double start = emscripten_get_now();
+    sched_set_host_event(SCHED_HOST_STOP, sched_cputick() + slice_cycles, slice_end);
+    if(!slice_started)
+    {
+        slice_started = true;
+        emu_loop(false);
     }
+    else
+        emu_continue_loop();
 
-    addr_cache_flush();
-
-    sched_update_next_event(0);
+    double elapsed = std::max(emscripten_get_now() - start, 0.1);
+    slice_cycles = std::min<uint64_t>(std::max<uint64_t>(slice_cycles * slice_ms / elapsed, 10000), 100000000);
 
-    exiting = false;
-
-// clang segfaults with that, for an iOS build :(
-#ifndef NO_SETJMP
-    // Workaround for LLVM bug #18974
-    while(__builtin_setjmp(restart_after_exception)){};
-#endif
-
-    emscripten_set_main_loop(step, 0, 1);
-    return;
+    if(frame_pending)
+    {
+        frame_pending = false;
+        present_frame();
+    }
 }
 
 int main()
@@ -149,13 +143,15 @@ int main()
     path_boot1 = "boot1.img";
     path_flash = "flash.img";
 
+    lcd_draw_frames = true;
     if(!emu_start(0, 0, NULL))
         return 1;
 
-    EM_ASM(initLCD());
-
     turbo_mode = true;
-    emscripten_loop(true);
+
+    // Slices run back to back, the page keeps a separate loop for showing frames
+    emscripten_set_main_loop(run_slice, 0, 0);
+    emscripten_set_main_loop_timing(EM_TIMING_SETIMMEDIATE, 0);
 
     return 0;
 }
@@ -5,12 +5,17 @@
 #include <cstdarg>
 #include <chrono>
 
+#include <QCryptographicHash>
 #include <QDir>
 #include <QEventLoop>
+#include <QFile>
+#include <QStandardPaths>
 #include <QTimer>
 
 #include "core/debug.h"
 #include "core/emu.h"
+#include "core/rewind.h"
+#include "core/schedule.h"
 #include "core/usblink_queue.h"
 #include "mainwindow.h"
 
@@ -31,11 +36,25 @@ void gui_debug_printf(const char *fmt, ...)
     va_end(ap);
 }
 
+// Collected until the emulation pauses, instead of a signal per call
+static QString debug_pending;
+
+static void debug_flush()
+{
+    if(debug_pending.isEmpty())
+        return;
+
+    emu_thread.debugStr(debug_pending);
+    debug_pending.clear();
+}
+
 void gui_debug_vprintf(const char *fmt, va_list ap)
 {
     QString str;
     str.vsprintf(fmt, ap);
-    emu_thread.debugStr(str);
+    debug_pending += str;
+    if(debug_pending.size() >= 4096)
+        debug_flush();
 }
 
 void gui_status_printf(const char *fmt, ...)
@@ -64,16 +83,14 @@ static debug_input_cb debug_callback;
 
 void gui_debugger_request_input(debug_input_cb callback)
 {
+    debug_flush();
     debug_callback = callback;
     emu_thread.debugInputRequested(callback != nullptr);
 }
 
-void gui_putchar(char c)
+void gui_serial_write(const char *data, size_t size)
 {
-    if(true)
-        emu_thread.serialChar(c);
-    else
-        putchar(c);
+    emu_thread.serialStr(QByteArray(data, size));
 }
 
 int gui_getchar()
@@ -96,6 +113,11 @@ void gui_usblink_changed(bool state)
     emit emu_thread.usblinkChanged(state);
 }
 
+void gui_lcd_changed()
+{
+    emit emu_thread.lcdChanged();
+}
+
 void throttle_timer_off()
 {
     emu_thread.setTurboMode(true);
@@ -106,9 +128,9 @@ void throttle_timer_on()
     emu_thread.setTurboMode(false);
 }
 
-void throttle_timer_wait()
+void throttle_timer_wait(unsigned int usec)
 {
-    emu_thread.throttleTimerWait();
+    emu_thread.throttleTimerWait(usec);
 }
 
 EmuThread::EmuThread(QObject *parent) :
@@ -124,6 +146,8 @@ EmuThread::EmuThread(QObject *parent) :
 //Called occasionally, only way to do something in the same thread the emulator runs in.
 void EmuThread::doStuff(bool wait)
 {
+    debug_flush();
+
     do
     {
         if(do_suspend)
@@ -133,6 +157,9 @@ void EmuThread::doStuff(bool wait)
             emit suspended(success);
         }
 
+        if(!boot_cache_pending.empty())
+            bootCacheCheck();
+
         if(enter_debugger)
         {
             setPaused(false);
@@ -141,12 +168,38 @@ void EmuThread::doStuff(bool wait)
                 debugger(DBG_USER, 0);
         }
 
+        if(rewind_count() != rewind_count_shown)
+        {
+            rewind_count_shown = rewind_count();
+            emit rewindCountChanged(rewind_count_shown);
+        }
+
+        // Let emu_loop rewind, it pauses again on the next call
+        if(cpu_events & EVENT_REWIND)
+            break;
+
         if(is_paused && wait)
-            msleep(100);
+        {
+            QMutexLocker locker(&state_mutex);
+            while(is_paused && !do_suspend && !enter_debugger && !exiting && !(cpu_events & EVENT_REWIND))
+                state_changed.wait(&state_mutex);
+        }
 
     } while(is_paused && wait);
 }
 
+void EmuThread::notify()
+{
+    {
+        QMutexLocker locker(&state_mutex);
+        state_changed.wakeAll();
+    }
+
+    // From doStuff itself it's not needed
+    if(!is_paused && isRunning() && QThread::currentThread() != this)
+        emu_request_gui();
+}
+
 void EmuThread::run()
 {
     setTerminationEnabled();
@@ -155,7 +208,37 @@ void EmuThread::run()
     path_flash = QDir::toNativeSeparators(flash).toStdString();
 
     bool do_reset = !do_resume;
-    bool success = emu_start(port_gdb, port_rdbg, do_resume ? snapshot_path.c_str() : nullptr);
+    std::string start_path = do_resume ? snapshot_path : std::string();
+
+    // Booting into diags or the debugger isn't what the cache is for
+    QString cache;
+    boot_cache_pending.clear();
+    if(!do_resume && !boot_cache.isEmpty() && boot_order != ORDER_DIAGS && !debug_on_start)
+        cache = bootCachePath();
+
+    if(!cache.isEmpty() && QFile::exists(cache))
+    {
+        start_path = QDir::toNativeSeparators(cache).toStdString();
+        do_reset = false;
+    }
+
+    bool success = emu_start(port_gdb, port_rdbg, start_path.empty() ? nullptr : start_path.c_str());
+
+    // An unusable cache gets taken again
+    if(!success && !do_resume && !start_path.empty())
+    {
+        QFile::remove(cache);
+        path_boot1 = QDir::toNativeSeparators(boot1).toStdString();
+        path_flash = QDir::toNativeSeparators(flash).toStdString();
+        do_reset = true;
+        success = emu_start(port_gdb, port_rdbg, nullptr);
+    }
+
+    if(success && do_reset && !cache.isEmpty())
+    {
+        boot_cache_pending = QDir::toNativeSeparators(cache).toStdString();
+        boot_idle_start = UINT64_MAX;
+    }
 
     if(do_resume)
         emit resumed(success);
@@ -167,16 +250,85 @@ void EmuThread::run()
     if(success)
         emu_loop(do_reset);
 
+    debug_flush();
     emit stopped();
 }
 
-void EmuThread::throttleTimerWait()
+QString EmuThread::bootCachePath()
+{
+    // The snapshot refers to the files by path and only has the modified flash blocks
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for(auto &&path : {boot1, flash})
+    {
+        hash.addData(path.toUtf8());
+        QFile file(path);
+        if(!file.open(QIODevice::ReadOnly) || !hash.addData(&file))
+            return {};
+    }
+
+    QString dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QStringLiteral("/boot");
+    if(!QDir().mkpath(dir))
+        return {};
+
+    return dir + QLatin1Char('/') + boot_cache + QLatin1Char('-')
+            + QString::fromLatin1(hash.result().toHex().left(16)) + QStringLiteral(".snapshot");
+}
+
+/* Called by doStuff, so at least once per throttle interval. The OS booted
+   once the CPU spent most of a few emulated seconds in a row waiting for
+   interrupts, at the home screen. */
+void EmuThread::bootCacheCheck()
+{
+    uint64_t now = sched_cputick();
+    if(now < boot_idle_start) // First call or after a reset
+    {
+        boot_idle_start = now;
+        boot_idle_cycles = idle_cycles;
+        boot_idle_seconds = 0;
+        return;
+    }
+
+    uint64_t elapsed = now - boot_idle_start;
+    if(elapsed < sched.clock_rates[CLOCK_CPU])
+        return;
+
+    bool idle = (idle_cycles - boot_idle_cycles) * 10 >= elapsed * 9;
+    boot_idle_seconds = idle ? boot_idle_seconds + 1 : 0;
+    boot_idle_start = now;
+    boot_idle_cycles = idle_cycles;
+
+    if(boot_idle_seconds < 3)
+        return;
+
+    /* Mapped on resume, so that only the pages used get read, and with the
+       translations of the boot, which get translated again right away */
+    bool map = map_snapshots, incremental = incremental_snapshots, translations = snapshot_translations;
+    map_snapshots = true;
+    incremental_snapshots = false;
+    snapshot_translations = true;
+    bool success = emu_suspend_copy(boot_cache_pending.c_str());
+    map_snapshots = map;
+    incremental_snapshots = incremental;
+    snapshot_translations = translations;
+
+    QFileInfo info(QString::fromStdString(boot_cache_pending));
+    if(!success)
+        QFile::remove(info.filePath());
+    else
+    {
+        // The ones for other contents of the files
+        QDir dir = info.dir();
+        for(auto &&name : dir.entryList({boot_cache + QStringLiteral("-*.snapshot")}, QDir::Files))
+            if(name != info.fileName())
+                dir.remove(name);
+    }
+
+    boot_cache_pending.clear();
+}
+
+void EmuThread::throttleTimerWait(unsigned int usec)
 {
-    unsigned int now = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
-    unsigned int throttle = throttle_delay * 1000;
-    unsigned int left = throttle - (now % throttle);
-    if(left > 0)
-        QThread::usleep(left);
+    QThread::usleep(usec);
 }
 
 void EmuThread::setTurboMode(bool enabled)
@@ -190,9 +342,19 @@ void EmuThread::toggleTurbo()
     setTurboMode(!turbo_mode);
 }
 
+void EmuThread::rewind(int index)
+{
+    if(index >= 0)
+    {
+        rewind_to(index);
+        notify();
+    }
+}
+
 void EmuThread::enterDebugger()
 {
     enter_debugger = true;
+    notify();
 }
 
 void EmuThread::debuggerInput(QString str)
@@ -204,6 +366,8 @@ void EmuThread::debuggerInput(QString str)
 void EmuThread::setPaused(bool paused)
 {
     this->is_paused = paused;
+    if(!paused)
+        notify();
     emit this->paused(paused);
 }
 
@@ -252,4 +416,5 @@ void EmuThread::suspend(QString path)
 {
     snapshot_path = QDir::toNativeSeparators(path).toStdString();
     do_suspend = true;
+    notify();
 }
@@ -1,7 +1,10 @@
 #ifndef EMUTHREAD_H
 #define EMUTHREAD_H
 
+#include <QByteArray>
+#include <QMutex>
 #include <QThread>
+#include <QWaitCondition>
 
 class EmuThread : public QThread
 {
@@ -10,9 +13,13 @@ public:
     explicit EmuThread(QObject *parent = 0);
 
     void doStuff(bool wait);
-    void throttleTimerWait();
+    void throttleTimerWait(unsigned int usec);
 
     QString boot1, flash;
+    /* If not empty, a normal start resumes from a snapshot named after it and
+       the contents of boot1 and flash. If there is none yet, one is taken as
+       soon as the OS idles after booting. */
+    QString boot_cache;
     unsigned int port_gdb = 0, port_rdbg = 0;
 
 signals:
@@ -24,7 +31,7 @@ signals:
     void paused(bool b);
 
     // I/O
-    void serialChar(char c);
+    void serialStr(QByteArray str); // From gui_serial_write
 
     // Status
     void isBusy(bool busy);
@@ -32,6 +39,8 @@ signals:
     void speedChanged(double value);
     void usblinkChanged(bool state);
     void turboModeChanged(bool state);
+    void rewindCountChanged(int count);
+    void lcdChanged(); // See gui_lcd_changed
 
     // Debugging
     void debugStr(QString str);
@@ -51,15 +60,29 @@ public slots:
     // Emulation settings
     void setTurboMode(bool state);
     void toggleTurbo();
+    // Goes back to checkpoint index, see rewind_to
+    void rewind(int index);
 
     // Debugging
     void enterDebugger();
     void debuggerInput(QString str);
 
 private:
-    bool enter_debugger = false;
+    // After setting a flag for doStuff: wakes it up if paused, otherwise lets the emulation call it soon
+    void notify();
+    // For boot_cache, in the emulation thread
+    QString bootCachePath();
+    void bootCacheCheck();
+
+    volatile bool enter_debugger = false;
     volatile bool is_paused = false, do_suspend = false, do_resume = false;
+    QMutex state_mutex; // Only for waiting in doStuff
+    QWaitCondition state_changed;
     std::string debug_input, snapshot_path;
+    unsigned int rewind_count_shown = 0;
+    std::string boot_cache_pending; // Where to take the boot snapshot, if still to do
+    uint64_t boot_idle_start, boot_idle_cycles; // Of the current emulated second
+    unsigned int boot_idle_seconds;
 };
 
 extern EmuThread emu_thread;
@@ -8,6 +8,8 @@ DEFINES += FB_VERSION=1.3-dev
 
 # JIT
 TRANSLATION_ENABLED = true
+# The WebAssembly translator didn't get built with emscripten yet
+emscripten: TRANSLATION_ENABLED = false
 # More accurate, but slower
 SUPPORT_LINUX = true
 ios|android: SUPPORT_LINUX = false
@@ -39,6 +41,8 @@ linux: !android {
 QMAKE_CFLAGS = -g -std=gnu11 -Wall -Wextra
 QMAKE_CXXFLAGS = -g -std=c++11 -Wall -Wextra -D QT_NO_CAST_FROM_ASCII
 LIBS += -lz
+# For shm_open with glibc before 2.34
+linux:!android: LIBS += -lrt
 
 # Override bad default options to enable better optimizations
 QMAKE_CFLAGS_RELEASE = -O3 -flto -DNDEBUG
@@ -134,6 +138,9 @@ equals(TRANSLATION_ENABLED, true) {
 }
 else: DEFINES += NO_TRANSLATION
 
+# The WebAssembly translator adds the functions of its modules to the table
+emscripten:equals(TRANSLATION_ENABLED, true): QMAKE_LFLAGS += -s ALLOW_TABLE_GROWTH=1
+
 # The x86_64 and ARM JIT use asmcode.c for mem access
 equals(QMAKE_TARGET.arch, "x86_64") || equals(QMAKE_TARGET.arch, "arm") || equals(QMAKE_TARGET.arch, "aarch64") {
     !contains(ASMCODE_IMPL, "core/asmcode.c") {
@@ -167,12 +174,16 @@ SOURCES += $$ASMCODE_IMPL \
     core/cpu.cpp \
     core/thumb_interpreter.cpp \
     core/usblink_queue.cpp \
+    core/usblink_io.cpp \
     core/armsnippets_loader.c \
+    core/capture.cpp \
+    core/log.cpp \
     core/casplus.c \
     core/des.c \
     core/disasm.c \
     core/gdbstub.c \
     core/gif.cpp \
+    core/input_script.cpp \
     core/interrupt.c \
     core/keypad.cpp \
     core/lcd.c \
@@ -180,13 +191,20 @@ SOURCES += $$ASMCODE_IMPL \
     core/mem.c \
     core/misc.c \
     core/mmu.c \
+    core/profile.cpp \
     core/schedule.c \
     core/serial.c \
     core/sha256.c \
+    core/shmem.c \
+    core/trace.c \
     core/usb.c \
     core/usblink.c \
     qtframebuffer.cpp \
     core/debug.cpp \
+    core/hostio.cpp \
+    core/snapshot_file.cpp \
+    core/gzip_file.cpp \
+    core/rewind.cpp \
     core/flash.cpp \
     core/emu.cpp \
     usblinktreewidget.cpp \
@@ -211,6 +229,8 @@ HEADERS += \
     core/armsnippets.h \
     core/asmcode.h \
     core/bitfield.h \
+    core/capture.h \
+    core/log.h \
     core/casplus.h \
     core/cpu.h \
     core/cpudefs.h \
@@ -221,6 +241,10 @@ HEADERS += \
     core/flash.h \
     core/gdbstub.h \
     core/gif.h \
+    core/gzip_file.h \
+    core/hostio.h \
+    core/input_script.h \
+    core/instance.h \
     core/interrupt.h \
     core/keypad.h \
     core/lcd.h \
@@ -228,11 +252,18 @@ HEADERS += \
     core/mem.h \
     core/misc.h \
     core/mmu.h \
+    core/parallel.h \
+    core/profile.h \
+    core/rewind.h \
     core/schedule.h \
+    core/trace.h \
     core/sha256.h \
+    core/shmem.h \
+    core/snapshot_file.h \
     core/translate.h \
     core/usb.h \
     core/usblink.h \
+    core/usblink_io.h \
     core/usblink_queue.h \
     qtframebuffer.h \
     usblinktreewidget.h \
@@ -277,8 +308,14 @@ armsnippets.commands = arm-none-eabi-gcc -fno-leading-underscore -c $$PWD/core/a
 # In case you change armsnippets.S, run "make armsnippets" and update armcode_bin.h
 QMAKE_EXTRA_TARGETS = armsnippets
 
+# "make firebird-bench" builds bench/firebird-bench, which times the interpreter and the JIT
+firebird-bench.commands = $(MAKE) -C $$PWD/bench
+QMAKE_EXTRA_TARGETS += firebird-bench
+
 OTHER_FILES += \
     TODO \
+    bench/main.cpp \
+    bench/Makefile \
     emscripten/main.cpp \
     emscripten/Makefile
 
@@ -4,6 +4,7 @@
 
 #include "core/emu.h"
 #include "core/flash.h"
+#include "core/gzip_file.h"
 #include "flashdialog.h"
 #include "ui_flashdialog.h"
 
@@ -160,8 +161,18 @@ void FlashDialog::saveAs()
         return;
     }
 
+    // Kept compressed if the name asks for it
+    if(path.endsWith(QStringLiteral(".gz")))
+    {
+        size_t compressed_size;
+        uint8_t *compressed = static_cast<uint8_t*>(gzip_buffer_write(nand_data, nand_size, &compressed_size));
+        free(nand_data);
+        nand_data = compressed;
+        nand_size = compressed_size;
+    }
+
     QFile flash_file(path);
-    if(!flash_file.open(QFile::WriteOnly) || !flash_file.write(reinterpret_cast<char*>(nand_data), nand_size))
+    if(!nand_data || !flash_file.open(QFile::WriteOnly) || !flash_file.write(reinterpret_cast<char*>(nand_data), nand_size))
     {
         QMessageBox::critical(this, tr("Flash saving failed"), tr("Saving the flash file failed!"));
 
@@ -1,12 +1,143 @@
+#include <algorithm>
+#include <chrono>
 #include <errno.h>
+#include <signal.h>
+#include <string>
+#include <thread>
+#include <vector>
 
+#ifndef _WIN32
+    #define FORK_INSTANCES
+    #include <poll.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+#ifdef __linux__
+    #include <sched.h>
+#endif
+
+#include "core/capture.h"
 #include "core/debug.h"
 #include "core/emu.h"
+#include "core/flash.h"
+#include "core/input_script.h"
+#include "core/log.h"
 #include "core/mem.h"
 #include "core/mmu.h"
+#include "core/profile.h"
+#include "core/rewind.h"
+#include "core/shmem.h"
+#include "core/trace.h"
+#include "core/translate.h"
+#include "core/usblink_queue.h"
+#include "core/os/os.h"
+
+static const char *autosave_file = nullptr;
+static std::chrono::steady_clock::duration autosave_interval;
+
+// Of --inject, entries of the directory which are still being sent
+static unsigned int inject_pending = 0;
+static bool inject_failed = false;
+
+// The conditions of --until-* and the limits of --max-*, which stop the emulation
+static bool cycles_reached = false, wall_reached = false, serial_reached = false;
+static std::chrono::steady_clock::time_point wall_deadline = std::chrono::steady_clock::time_point::max();
+static std::string until_serial, serial_tail;
+static char last_putchar = '\n';
+// Of --frame-hashes, --until-frame-hash and --expect-frame-hash, see lcd_pixels_hash
+static FILE *frame_hashes;
+static bool until_frame = false, frame_reached = false;
+static uint64_t until_frame_hash;
+
+static void stop_event()
+{
+	cycles_reached = exiting = true;
+}
+
+static void stop_after_cycles(uint64_t cycles)
+{
+	cycles_reached = false;
+	sched_set_host_event(SCHED_HOST_STOP, sched_cputick() + cycles, stop_event);
+}
+
+static void stop_after(double seconds)
+{
+	stop_after_cycles(static_cast<uint64_t>(seconds * sched.clock_rates[CLOCK_CPU]));
+}
+
+static void inject_progress(int progress, void *user_data)
+{
+	if(progress != 100 && progress != -1)
+		return;
+
+	if(progress == -1)
+	{
+		fprintf(stderr, "Could not inject %s.\n", static_cast<const char *>(user_data));
+		inject_failed = true;
+	}
+
+	free(user_data);
+	if(--inject_pending == 0)
+		exiting = true;
+}
+
+static void inject_entry(const char *name, bool is_dir, void *user_data)
+{
+	std::string path = std::string(static_cast<const char *>(user_data)) + "/" + name;
+	// Into the root of the documents, the path is for the message
+	if(is_dir)
+		usblink_queue_put_dir(path, "", inject_progress, strdup(path.c_str()));
+	else
+		usblink_queue_put_file(path, "", inject_progress, strdup(path.c_str()));
+
+	inject_pending++;
+}
+
+// The OS doesn't listen to the bus reset until it booted far enough
+static void inject_connect()
+{
+	static auto next_connect = std::chrono::steady_clock::now();
+
+	auto now = std::chrono::steady_clock::now();
+	if(!inject_pending || usblink_connected || now < next_connect)
+		return;
+
+	next_connect = now + std::chrono::seconds(5);
+	usblink_connect();
+}
 
 void gui_do_stuff(bool wait)
 {
+	if(std::chrono::steady_clock::now() >= wall_deadline)
+		wall_reached = exiting = true;
+
+	inject_connect();
+
+	if(!autosave_file)
+		return;
+
+	static auto next_autosave = std::chrono::steady_clock::now() + autosave_interval;
+	static bool autosave_running = false;
+	bool success;
+	if(autosave_running && emu_suspend_background_finished(false, &success))
+	{
+		autosave_running = false;
+		if(!success)
+			fprintf(stderr, "Autosave to %s failed.\n", autosave_file);
+	}
+
+	auto now = std::chrono::steady_clock::now();
+	if(!autosave_running && now >= next_autosave)
+	{
+		next_autosave = now + autosave_interval;
+		autosave_running = emu_suspend_background(autosave_file);
+		if(!autosave_running)
+			fprintf(stderr, "Autosave to %s failed.\n", autosave_file);
+	}
 }
 
 void do_stuff(int i)
@@ -53,18 +184,426 @@ void gui_debugger_request_input(debug_input_cb callback)
     callback(debug_in);
 }
 
-void gui_putchar(char c) { putc(c, stdout); }
+// With --until-serial unbuffered, so that it stops right after the text
+void gui_serial_write(const char *data, size_t size)
+{
+	fwrite(data, 1, size, stdout);
+	last_putchar = data[size - 1];
+	if(until_serial.empty())
+		return;
+
+	for(size_t i = 0; i < size; i++)
+	{
+		serial_tail += data[i];
+		if(serial_tail.size() > until_serial.size())
+			serial_tail.erase(0, 1);
+		if(serial_tail == until_serial)
+			serial_reached = exiting = true;
+	}
+}
 int gui_getchar() { return -1; }
 void gui_set_busy(bool busy) {}
 void gui_show_speed(double d) {}
 void gui_usblink_changed(bool state) {}
+// With any of the frame hash options each frame which looks different got drawn and hashed right before
+void gui_lcd_changed()
+{
+	if(frame_hashes)
+		fprintf(frame_hashes, "%llu %016llx\n", (unsigned long long) sched_cputick(), (unsigned long long) lcd_drawn_hash);
+	if(until_frame && lcd_drawn_hash == until_frame_hash)
+		frame_reached = exiting = true;
+}
 void throttle_timer_off() {}
 void throttle_timer_on() {}
-void throttle_timer_wait() {}
+void throttle_timer_wait(unsigned int usec)
+{
+	std::this_thread::sleep_for(std::chrono::microseconds(usec));
+}
+
+static void stop_emulation(int)
+{
+	exiting = true;
+}
+
+struct instance_result {
+	uint64_t cycles;
+	double seconds;
+	uint32_t clock_rate;
+};
+
+// Runs the emulation and fills result, warm if the caches are still valid
+static void instance_loop(instance_result *result, bool warm)
+{
+	auto start = std::chrono::steady_clock::now();
+	uint64_t start_cputick = sched_cputick();
+	if(warm)
+		emu_continue_loop();
+	else
+		emu_loop(false);
+
+	result->cycles = sched_cputick() - start_cputick;
+	result->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result->clock_rate = sched.clock_rates[CLOCK_CPU];
+}
+
+static double instance_speed(const instance_result &result)
+{
+	return result.seconds > 0 && result.clock_rate ? result.cycles / (result.seconds * result.clock_rate) : 0;
+}
+
+#ifdef FORK_INSTANCES
+/* --farm runs several instances, all forked after the images got loaded so
+   that they share those pages until they get written. The parent only
+   reports on them, one JSON object per line on stdout. */
+
+// Of an instance which exited, the members of its JSON object
+static std::string instance_report(pid_t pid, int status, const instance_result &result)
+{
+	int exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	char report[128];
+	snprintf(report, sizeof(report), "\"pid\":%d,\"status\":%d,\"cycles\":%llu,\"seconds\":%.3f,\"speed\":%.3f",
+	         pid, exit_status, (unsigned long long) result.cycles, result.seconds, instance_speed(result));
+	return report;
+}
+
+static std::vector<pid_t> farm_pids;
+static instance_result *farm_results;
+
+// Each instance stops cleanly on SIGTERM, so that it still gets reported
+static void stop_farm(int)
+{
+	for(pid_t pid : farm_pids)
+		if(pid > 0)
+			kill(pid, SIGTERM);
+}
+
+static void farm_pin(unsigned int instance)
+{
+#ifdef __linux__
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || !CPU_COUNT(&allowed))
+		return;
+
+	// The instance-th of the allowed cores, round robin
+	unsigned int index = instance % CPU_COUNT(&allowed);
+	for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+	{
+		if(!CPU_ISSET(cpu, &allowed) || index--)
+			continue;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		sched_setaffinity(0, sizeof(set), &set);
+		printf("{\"instance\":%u,\"event\":\"started\",\"pid\":%d,\"cpu\":%d}\n", instance, getpid(), cpu);
+		return;
+	}
+#endif
+	printf("{\"instance\":%u,\"event\":\"started\",\"pid\":%d}\n", instance, getpid());
+}
+
+/* Returns the index of the instance in the children. The parent waits for
+   all of them and returns -1, with its exit status in exit_code. */
+static int farm_run(unsigned int count, int *exit_code)
+{
+	*exit_code = 8;
+	void *results = mmap(nullptr, count * sizeof(instance_result), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+	if(results == MAP_FAILED)
+	{
+		perror("Could not start the farm");
+		return -1;
+	}
+
+	farm_results = static_cast<instance_result *>(results);
+	// The children don't get the thread which saves the flash
+	flash_save_wait();
+	fflush(stdout);
+
+	signal(SIGINT, stop_farm);
+	signal(SIGTERM, stop_farm);
+
+	farm_pids.assign(count, 0);
+	unsigned int running = 0;
+	for(unsigned int instance = 0; instance < count; ++instance)
+	{
+		pid_t pid = fork();
+		if(pid == 0)
+		{
+			farm_pids.clear();
+			signal(SIGINT, stop_emulation);
+			signal(SIGTERM, stop_emulation);
+			farm_pin(instance);
+			fflush(stdout);
+			// Only the parent writes the reports to stdout, the rest goes with the errors
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+			return instance;
+		}
+
+		if(pid == -1)
+		{
+			perror("Could not start an instance");
+			break;
+		}
+
+		farm_pids[instance] = pid;
+		running++;
+	}
+
+	bool success = running == count;
+	while(running)
+	{
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if(pid == -1)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		auto it = std::find(farm_pids.begin(), farm_pids.end(), pid);
+		if(it == farm_pids.end())
+			continue;
+
+		*it = 0;
+		running--;
+
+		unsigned int instance = it - farm_pids.begin();
+		printf("{\"instance\":%u,\"event\":\"exited\",%s}\n", instance, instance_report(pid, status, farm_results[instance]).c_str());
+		fflush(stdout);
+
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			success = false;
+	}
+
+	if(success)
+		*exit_code = 0;
+	return -1;
+}
+
+/* --fork-server boots or resumes once, runs until the translations are warm
+   and then forks a job from that state for each connection to its socket.
+   The client sends one line of "seconds <emulated seconds>", "script <input
+   script>" and "suspend <file>" options, the ones it wants, and gets back a
+   JSON object on a line once the job exited. */
+struct server_job {
+	pid_t pid;
+	int fd;
+	instance_result *result;
+};
+
+static volatile bool server_stopping = false;
+
+static void stop_server(int)
+{
+	server_stopping = true;
+}
+
+static void server_run_job(int fd, instance_result *result)
+{
+	signal(SIGINT, stop_emulation);
+	signal(SIGTERM, stop_emulation);
+	// The reports of the server are on stdout
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	char request[1024];
+	size_t len = 0;
+	ssize_t done;
+	while(len < sizeof(request) - 1 && (done = read(fd, request + len, sizeof(request) - 1 - len)) > 0)
+	{
+		len += done;
+		if(memchr(request, '\n', len))
+			break;
+	}
+	request[len] = 0;
+
+	const char *suspend = nullptr;
+	for(char *option = strtok(request, " \r\n"); option; option = strtok(nullptr, " \r\n"))
+	{
+		char *value = strtok(nullptr, " \r\n");
+		if(value && strcmp(option, "seconds") == 0)
+			stop_after(strtod(value, nullptr));
+		else if(value && strcmp(option, "suspend") == 0)
+			suspend = value;
+		else if(value && strcmp(option, "script") == 0)
+		{
+			if(!input_script_load(value))
+				_exit(9);
+			input_script_start();
+		}
+		else
+		{
+			fprintf(stderr, "Unknown job option '%s'.\n", option);
+			_exit(2);
+		}
+	}
+
+	instance_loop(result, true);
+
+	int ret = 0;
+	if(suspend && !emu_suspend(suspend))
+	{
+		fprintf(stderr, "Could not write the snapshot.\n");
+		ret = 5;
+	}
+
+	fflush(stdout);
+	_exit(ret);
+}
+
+static void server_report(const server_job &job, int status)
+{
+	std::string report = instance_report(job.pid, status, *job.result);
+	printf("{\"event\":\"exited\",%s}\n", report.c_str());
+	fflush(stdout);
+
+	// The client might be gone already, then nobody cares
+	std::string reply = "{" + report + "}\n";
+	ssize_t written = write(job.fd, reply.data(), reply.size());
+	(void) written;
+	close(job.fd);
+	munmap(job.result, sizeof(instance_result));
+}
+
+static int fork_server(const char *path, double warmup)
+{
+	signal(SIGINT, stop_server);
+	signal(SIGTERM, stop_server);
+#ifdef SIGPIPE
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	stop_after(warmup);
+	emu_loop(false);
+	if(server_stopping)
+		return 0;
+
+	// The jobs don't get the thread which saves the flash
+	flash_save_wait();
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "The socket path %s is too long.\n", path);
+		return 8;
+	}
+	strcpy(addr.sun_path, path);
+
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(path);
+	if(listen_fd == -1 || bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+	   || listen(listen_fd, 16) != 0)
+	{
+		perror("Could not listen on the socket");
+		return 8;
+	}
+
+	printf("{\"event\":\"ready\",\"pid\":%d,\"cycles\":%llu}\n", getpid(), (unsigned long long) sched_cputick());
+	fflush(stdout);
+
+	std::vector<server_job> jobs;
+	std::vector<pollfd> fds;
+	while(!server_stopping)
+	{
+		fds.assign(1, pollfd{listen_fd, POLLIN, 0});
+		// Only for hangups, the connection is read by the job
+		for(const server_job &job : jobs)
+			fds.push_back(pollfd{job.fd, 0, 0});
+
+		if(poll(fds.data(), fds.size(), 100) > 0)
+		{
+			for(size_t i = 1; i < fds.size(); ++i)
+				if(fds[i].revents & (POLLHUP | POLLERR))
+					kill(jobs[i - 1].pid, SIGTERM);
+
+			if(fds[0].revents & POLLIN)
+			{
+				int fd = accept(listen_fd, nullptr, nullptr);
+				void *result = fd == -1 ? MAP_FAILED
+				               : mmap(nullptr, sizeof(instance_result), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANON, -1, 0);
+				pid_t pid = result == MAP_FAILED ? -1 : fork();
+				if(pid == 0)
+				{
+					close(listen_fd);
+					for(const server_job &job : jobs)
+						close(job.fd);
+					server_run_job(fd, static_cast<instance_result *>(result));
+				}
+
+				if(pid == -1)
+				{
+					perror("Could not start a job");
+					if(result != MAP_FAILED)
+						munmap(result, sizeof(instance_result));
+					if(fd != -1)
+						close(fd);
+				}
+				else
+				{
+					jobs.push_back({pid, fd, static_cast<instance_result *>(result)});
+					printf("{\"event\":\"started\",\"pid\":%d}\n", pid);
+					fflush(stdout);
+				}
+			}
+		}
+
+		int status;
+		pid_t pid;
+		while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		{
+			auto it = std::find_if(jobs.begin(), jobs.end(), [pid](const server_job &job) { return job.pid == pid; });
+			if(it == jobs.end())
+				continue;
+
+			server_report(*it, status);
+			jobs.erase(it);
+		}
+	}
+
+	// The jobs stop cleanly and still get reported
+	for(const server_job &job : jobs)
+		kill(job.pid, SIGTERM);
+
+	for(const server_job &job : jobs)
+	{
+		int status;
+		while(waitpid(job.pid, &status, 0) == -1 && errno == EINTR);
+		server_report(job, status);
+	}
+
+	close(listen_fd);
+	unlink(path);
+	return 0;
+}
+#endif
+
+// With %i replaced by the instance of --farm
+static std::string instance_path(const char *path, int instance)
+{
+	std::string ret = path;
+	size_t pos = ret.find("%i");
+	if(pos != std::string::npos)
+		ret.replace(pos, 2, std::to_string(instance < 0 ? 0 : instance));
+	return ret;
+}
 
 int main(int argc, char *argv[])
 {
-	const char *boot1 = nullptr, *flash = nullptr, *snapshot = nullptr, *rampayload = nullptr;
+	const char *boot1 = nullptr, *flash = nullptr, *snapshot = nullptr, *suspend = nullptr, *rampayload = nullptr;
+	const char *capture = nullptr, *inject = nullptr, *profile = nullptr, *input_script = nullptr;
+	const char *log_types = nullptr, *log = nullptr, *frame_hashes_path = nullptr;
+	uint32_t profile_interval = 0;
+	capture_format capture_fmt = CAPTURE_RAW;
+	bool jit_stats = false, throttle = false;
+	unsigned int farm_size = 0;
+	const char *server_socket = nullptr;
+	double server_warmup = 0;
+	const char *until_pc = nullptr;
+	bool expect_frame = false;
+	uint64_t expect_frame_hash = 0;
+	uint64_t max_cycles = 0;
+	double max_wall = 0;
 
 	for(int argi = 1; argi < argc; ++argi)
 	{
@@ -74,6 +613,48 @@ int main(int argc, char *argv[])
 			flash = argv[++argi];
 		else if(strcmp(argv[argi], "--snapshot") == 0)
 			snapshot = argv[++argi];
+		else if(strcmp(argv[argi], "--suspend-on-exit") == 0 && argi + 1 < argc)
+			suspend = argv[++argi];
+		else if(strcmp(argv[argi], "--incremental-snapshots") == 0)
+			incremental_snapshots = true;
+		else if(strcmp(argv[argi], "--map-snapshots") == 0)
+			map_snapshots = true;
+		else if(strcmp(argv[argi], "--snapshot-translations") == 0)
+			snapshot_translations = true;
+		else if(strcmp(argv[argi], "--share-state") == 0 && argi + 1 < argc)
+			shared_state_name = argv[++argi];
+		else if(strcmp(argv[argi], "--autosave") == 0 && argi + 2 < argc)
+		{
+			autosave_interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			            std::chrono::duration<double>(strtod(argv[++argi], nullptr)));
+			autosave_file = argv[++argi];
+		}
+		else if(strcmp(argv[argi], "--rewind") == 0 && argi + 2 < argc)
+		{
+			rewind_interval = strtod(argv[++argi], nullptr);
+			rewind_capacity = strtoul(argv[++argi], nullptr, 0);
+		}
+		else if(strcmp(argv[argi], "--capture") == 0 && argi + 2 < argc)
+		{
+			// Either raw RGB565 or y4m
+			capture_fmt = strcmp(argv[++argi], "y4m") == 0 ? CAPTURE_Y4M : CAPTURE_RAW;
+			capture = argv[++argi];
+		}
+		else if(strcmp(argv[argi], "--log") == 0 && argi + 2 < argc)
+		{
+			// Types as in LOG_TYPE_TBL, e.g. "UG" for USB and GDB
+			log_types = argv[++argi];
+			log = argv[++argi];
+		}
+		else if(strcmp(argv[argi], "--profile") == 0 && argi + 2 < argc)
+		{
+			profile_interval = strtoul(argv[++argi], nullptr, 0);
+			profile = argv[++argi];
+		}
+		else if(strcmp(argv[argi], "--input-script") == 0 && argi + 1 < argc)
+			input_script = argv[++argi];
+		else if(strcmp(argv[argi], "--inject") == 0 && argi + 1 < argc)
+			inject = argv[++argi];
 		else if(strcmp(argv[argi], "--rampayload") == 0)
 			rampayload = argv[++argi];
 		else if(strcmp(argv[argi], "--debug-on-start") == 0)
@@ -82,6 +663,59 @@ int main(int argc, char *argv[])
 			debug_on_warn = true;
 		else if(strcmp(argv[argi], "--diags") == 0)
 			boot_order = ORDER_DIAGS;
+		else if(strcmp(argv[argi], "--store-translations") == 0)
+			do_store_translations = true;
+		else if(strcmp(argv[argi], "--perf-map") == 0)
+			write_perf_map = true;
+		else if(strcmp(argv[argi], "--huge-pages") == 0)
+			use_huge_pages = true;
+		else if(strcmp(argv[argi], "--protect-code") == 0)
+			protect_translated_code = true;
+		else if(strcmp(argv[argi], "--speed") == 0 && argi + 1 < argc)
+		{
+			throttle_speed = strtod(argv[++argi], nullptr);
+			throttle = throttle_speed > 0;
+		}
+		else if(strcmp(argv[argi], "--farm") == 0 && argi + 1 < argc)
+			farm_size = strtoul(argv[++argi], nullptr, 0);
+		else if(strcmp(argv[argi], "--fork-server") == 0 && argi + 2 < argc)
+		{
+			server_socket = argv[++argi];
+			server_warmup = strtod(argv[++argi], nullptr);
+		}
+		else if(strcmp(argv[argi], "--until-pc") == 0 && argi + 1 < argc)
+			until_pc = argv[++argi];
+		else if(strcmp(argv[argi], "--until-serial") == 0 && argi + 1 < argc)
+			until_serial = argv[++argi];
+		else if(strcmp(argv[argi], "--until-frame-hash") == 0 && argi + 1 < argc)
+		{
+			until_frame = true;
+			until_frame_hash = strtoull(argv[++argi], nullptr, 16);
+		}
+		else if(strcmp(argv[argi], "--expect-frame-hash") == 0 && argi + 1 < argc)
+		{
+			expect_frame = true;
+			expect_frame_hash = strtoull(argv[++argi], nullptr, 16);
+		}
+		else if(strcmp(argv[argi], "--frame-hashes") == 0 && argi + 1 < argc)
+			frame_hashes_path = argv[++argi];
+		else if(strcmp(argv[argi], "--max-cycles") == 0 && argi + 1 < argc)
+			max_cycles = strtoull(argv[++argi], nullptr, 0);
+		else if(strcmp(argv[argi], "--max-wall") == 0 && argi + 1 < argc)
+			max_wall = strtod(argv[++argi], nullptr);
+		else if(strcmp(argv[argi], "--jit-stats") == 0)
+			jit_stats = true;
+		else if(strcmp(argv[argi], "--trace") == 0)
+			trace_enabled = true; // Nothing got translated yet
+		else if(strcmp(argv[argi], "--translate-threshold") == 0 && argi + 1 < argc)
+		{
+			unsigned long threshold = strtoul(argv[++argi], nullptr, 0);
+			translate_threshold = threshold < TRANSLATE_THRESHOLD_MAX ? threshold : TRANSLATE_THRESHOLD_MAX;
+		}
+		else if(strcmp(argv[argi], "--jit-validate") == 0 && argi + 1 < argc)
+			translate_validate_interval = strtoul(argv[++argi], nullptr, 0);
+		else if(strcmp(argv[argi], "--jit-background") == 0)
+			translate_background = true;
 		else
 		{
 			fprintf(stderr, "Unknown argument '%s'.\n", argv[argi]);
@@ -95,12 +729,69 @@ int main(int argc, char *argv[])
 		return 2;
 	}
 
+#ifndef FORK_INSTANCES
+	if(farm_size || server_socket)
+	{
+		fprintf(stderr, "--farm and --fork-server are not supported on this platform.\n");
+		return 2;
+	}
+#endif
+
+	// They'd all write to the same file or memory
+	if((farm_size || server_socket) && (inject || do_store_translations || shared_state_name))
+	{
+		fprintf(stderr, "--farm and --fork-server can't be used with --inject, --store-translations or --share-state.\n");
+		return 2;
+	}
+
+	if(server_socket && (farm_size || capture || log || profile || suspend || autosave_file || input_script
+	                     || until_pc || !until_serial.empty() || until_frame || expect_frame || frame_hashes_path
+	                     || max_cycles || max_wall > 0))
+	{
+		fprintf(stderr, "--fork-server only takes the options of the state to start the jobs from.\n");
+		return 2;
+	}
+
 	path_boot1 = boot1;
 	path_flash = flash;
 
 	if(!emu_start(0, 0, snapshot))
 		return 1;
 
+	// Nothing else cleans up at the returns below, the object would stay around
+	if(shared_state_name)
+		atexit(shmem_unmap);
+
+	int instance = -1;
+#ifdef FORK_INSTANCES
+	if(farm_size)
+	{
+		int exit_code;
+		instance = farm_run(farm_size, &exit_code);
+		if(instance < 0)
+			return exit_code;
+	}
+#endif
+
+	// Each instance gets its own outputs and RAM payload
+	std::string rampayload_path, capture_path, log_path, profile_path, suspend_path, autosave_path, input_script_path, frame_hashes_file;
+	if(input_script)
+		input_script = (input_script_path = instance_path(input_script, instance)).c_str();
+	if(rampayload)
+		rampayload = (rampayload_path = instance_path(rampayload, instance)).c_str();
+	if(capture)
+		capture = (capture_path = instance_path(capture, instance)).c_str();
+	if(log && strcmp(log, "-") != 0)
+		log = (log_path = instance_path(log, instance)).c_str();
+	if(profile)
+		profile = (profile_path = instance_path(profile, instance)).c_str();
+	if(frame_hashes_path && strcmp(frame_hashes_path, "-") != 0)
+		frame_hashes_path = (frame_hashes_file = instance_path(frame_hashes_path, instance)).c_str();
+	if(suspend)
+		suspend = (suspend_path = instance_path(suspend, instance)).c_str();
+	if(autosave_file)
+		autosave_file = (autosave_path = instance_path(autosave_file, instance)).c_str();
+
 	if(rampayload)
 	{
 		FILE *f = fopen(rampayload, "rb");
@@ -122,8 +813,186 @@ int main(int argc, char *argv[])
 		arm.reg[15] = mem_areas[1].base;
 	}
 
-	turbo_mode = true;
-	emu_loop(false);
+#ifdef FORK_INSTANCES
+	if(server_socket)
+	{
+		turbo_mode = !throttle;
+		return fork_server(server_socket, server_warmup);
+	}
+#endif
 
-	return 0;
+	if(capture)
+	{
+		if(!capture_start(capture, capture_fmt))
+		{
+			perror("Could not start capturing");
+			return 6;
+		}
+
+#ifdef SIGPIPE
+		// If the reader of the pipe goes away, only the capture stops
+		signal(SIGPIPE, SIG_IGN);
+#endif
+	}
+
+	if(log && !log_start(log_types, log))
+	{
+		fprintf(stderr, "Could not log %s to %s.\n", log_types, log);
+		return 2;
+	}
+
+	// Like for the log, "-" is stderr
+	if(frame_hashes_path)
+	{
+		frame_hashes = strcmp(frame_hashes_path, "-") == 0 ? stderr : fopen(frame_hashes_path, "w");
+		if(!frame_hashes)
+		{
+			perror(frame_hashes_path);
+			return 2;
+		}
+	}
+
+	// The frames are only hashed once drawn
+	if(frame_hashes || until_frame || expect_frame)
+		lcd_draw_frames = true;
+
+	if(inject)
+	{
+		/* The file system of the flash is only known to the OS, so it boots
+		   and gets the files over usblink. Once that's done, the flash gets
+		   saved and the emulation stops. */
+		if(!os_list_dir(inject, inject_entry, const_cast<char *>(inject)))
+		{
+			perror(inject);
+			return 7;
+		}
+
+		// Nothing to do
+		if(!inject_pending)
+			return 0;
+	}
+
+	if(input_script)
+	{
+		if(!input_script_load(input_script))
+			return 9;
+		input_script_start();
+	}
+
+	uint32_t until_pc_addr = until_pc ? strtoul(until_pc, nullptr, 0) : 0;
+	if(until_pc && !debug_set_stop_pc(until_pc_addr))
+	{
+		fprintf(stderr, "Address %s is not in memory.\n", until_pc);
+		return 2;
+	}
+
+	if(!until_serial.empty())
+		serial_buffered = false;
+	if(max_cycles)
+		stop_after_cycles(max_cycles);
+	if(max_wall > 0)
+		wall_deadline = std::chrono::steady_clock::now()
+		                + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(max_wall));
+
+	if(profile)
+		profile_start(profile_interval);
+
+	bool run_stats = until_pc || !until_serial.empty() || until_frame || max_cycles || max_wall > 0;
+	if(jit_stats || suspend || capture || log || profile || run_stats)
+	{
+		// Stop the emulation instead of getting killed, to print the statistics, suspend or finish the capture and log
+		signal(SIGINT, stop_emulation);
+		signal(SIGTERM, stop_emulation);
+	}
+
+	// Without --speed run as fast as possible
+	turbo_mode = !throttle;
+	instance_result result, *result_ptr = &result;
+#ifdef FORK_INSTANCES
+	if(instance >= 0)
+		result_ptr = &farm_results[instance];
+#endif
+	instance_loop(result_ptr, false);
+
+	int ret = 0;
+	if(run_stats)
+	{
+		const char *reason;
+		if(serial_reached)
+			reason = "serial";
+		else if(frame_reached)
+			reason = "frame";
+		else if(cycles_reached)
+			reason = "cycles";
+		else if(wall_reached)
+			reason = "wall";
+		else if(until_pc && (arm.reg[15] & ~3) == (until_pc_addr & ~3))
+			reason = "pc";
+		else
+			reason = "exit";
+
+		// Running out of the budget before the condition is a failure
+		if(until_pc || !until_serial.empty() || until_frame)
+			ret = !strcmp(reason, "pc") || !strcmp(reason, "serial") || !strcmp(reason, "frame") ? 0
+			      : cycles_reached ? 10 : wall_reached ? 11 : 12;
+
+		if(last_putchar != '\n')
+			putchar('\n');
+		printf("{\"reason\":\"%s\",\"cycles\":%llu,\"seconds\":%.3f,\"speed\":%.3f,\"pc\":\"%08x\"",
+		       reason, (unsigned long long) result_ptr->cycles, result_ptr->seconds, instance_speed(*result_ptr), arm.reg[15]);
+		if(lcd_draw_frames)
+			printf(",\"frame_hash\":\"%016llx\"", (unsigned long long) lcd_drawn_hash);
+		printf("}\n");
+		fflush(stdout);
+	}
+
+	// A different screen at the end is a failure as well
+	if(expect_frame && lcd_drawn_hash != expect_frame_hash)
+	{
+		fprintf(stderr, "The last frame has the hash %016llx instead of %016llx.\n",
+		        (unsigned long long) lcd_drawn_hash, (unsigned long long) expect_frame_hash);
+		if(!ret)
+			ret = 13;
+	}
+
+	if(frame_hashes && frame_hashes != stderr)
+		fclose(frame_hashes);
+	frame_hashes = nullptr;
+
+	if(jit_stats)
+		debug_print_jit_stats();
+
+	log_stop();
+
+	if(capture && !capture_stop())
+		fprintf(stderr, "Capturing to %s failed.\n", capture);
+
+	if(profile && !profile_write(profile))
+		fprintf(stderr, "Could not write the profile to %s.\n", profile);
+
+	// Let the last autosave finish
+	emu_suspend_background_finished(true, nullptr);
+
+	if(inject)
+	{
+		if(inject_pending || inject_failed)
+		{
+			fprintf(stderr, "Injecting %s failed.\n", inject);
+			return 7;
+		}
+
+		if(!flash_save_changes() || !flash_save_wait())
+		{
+			fprintf(stderr, "Could not save the flash image.\n");
+			return 7;
+		}
+	}
+
+	if(suspend && !emu_suspend(suspend))
+	{
+		fprintf(stderr, "Could not write the snapshot.\n");
+		return 5;
+	}
+
+	return ret;
 }
@@ -5,7 +5,7 @@
 
 QDataStream &operator<<(QDataStream &out, const Kit &kit)
 {
-    unsigned int version = 1;
+    unsigned int version = 2;
 
     out << version
         << kit.id
@@ -13,7 +13,8 @@ QDataStream &operator<<(QDataStream &out, const Kit &kit)
         << kit.boot1
         << kit.flash
         << kit.snapshot
-        << kit.type;
+        << kit.type
+        << kit.boot_cache;
 
     return out;
 }
@@ -23,7 +24,7 @@ QDataStream &operator>>(QDataStream &in, Kit &kit)
     unsigned int version;
     in >> version;
 
-    if(version == 1)
+    if(version == 1 || version == 2)
     {
         in >> kit.id
            >> kit.name
@@ -31,6 +32,10 @@ QDataStream &operator>>(QDataStream &in, Kit &kit)
            >> kit.flash
            >> kit.snapshot
            >> kit.type;
+
+        kit.boot_cache = false;
+        if(version >= 2)
+            in >> kit.boot_cache;
     }
     else
         qWarning() << "Unknown Kit serialization version " << version;
@@ -40,7 +45,7 @@ QDataStream &operator>>(QDataStream &in, Kit &kit)
 
 QDataStream &operator<<(QDataStream &out, const KitModel &kits)
 {
-    unsigned int version = 1;
+    unsigned int version = 2;
 
     out << version << kits.kits << kits.nextID;
     return out;
@@ -73,6 +78,7 @@ QHash<int, QByteArray> KitModel::roleNames() const
     roles[FlashRole] = "flash";
     roles[Boot1Role] = "boot1";
     roles[SnapshotRole] = "snapshot";
+    roles[BootCacheRole] = "bootCache";
     return roles;
 }
 
@@ -100,6 +106,8 @@ QVariant KitModel::getDataRow(const int row, int role) const
         return kits[row].boot1;
     case SnapshotRole:
         return kits[row].snapshot;
+    case BootCacheRole:
+        return kits[row].boot_cache;
     default:
         return QVariant();
     }
@@ -131,6 +139,9 @@ bool KitModel::setDataRow(const int row, const QVariant &value, int role)
     case SnapshotRole:
         kits[row].snapshot = value.toString();
         break;
+    case BootCacheRole:
+        kits[row].boot_cache = value.toBool();
+        break;
     default:
         return false;
     }
@@ -185,7 +196,7 @@ void KitModel::addKit(QString name, QString boot1, QString flash, QString snapsh
 {
     int row = kits.size();
     beginInsertRows({}, row, row);
-    kits.append({nextID++, name, typeForFlash(flash), boot1, flash, snapshot_path});
+    kits.append({nextID++, name, typeForFlash(flash), boot1, flash, snapshot_path, false});
     endInsertRows();
 
     emit anythingChanged();
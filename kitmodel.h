@@ -7,6 +7,7 @@ struct Kit
 {
     unsigned int id;
     QString name, type, boot1, flash, snapshot;
+    bool boot_cache; // Keep a snapshot of the booted OS to start from, see EmuThread::boot_cache
 };
 
 class KitModel : public QAbstractListModel
@@ -19,7 +20,8 @@ public:
         TypeRole,
         FlashRole,
         Boot1Role,
-        SnapshotRole
+        SnapshotRole,
+        BootCacheRole
     };
     Q_ENUMS(Role)
 
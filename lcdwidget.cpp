@@ -1,4 +1,5 @@
 #include "lcdwidget.h"
+#include "emuthread.h"
 #include "core/keypad.h"
 #include "qtkeypadbridge.h"
 #include "qmlbridge.h"
@@ -7,9 +8,9 @@
 LCDWidget::LCDWidget(QWidget *parent, Qt::WindowFlags f)
     : QWidget(parent, f)
 {
-    connect(&refresh_timer, SIGNAL(timeout()), this, SLOT(update()));
-
-    refresh_timer.setInterval(1000 / 30); // 30 fps
+    // Only repainted if there's something new to show
+    connect(&emu_thread, SIGNAL(lcdChanged()), this, SLOT(update()), Qt::QueuedConnection);
+    connect(&emu_thread, SIGNAL(debuggerEntered(bool)), this, SLOT(update()), Qt::QueuedConnection);
 }
 
 void LCDWidget::mousePressEvent(QMouseEvent *event)
@@ -34,20 +35,6 @@ void LCDWidget::mouseMoveEvent(QMouseEvent *event)
     the_qml_bridge->touchpadStateChanged((qreal)event->x() / width(), (qreal)event->y() / height(), keypad.touchpad_contact, keypad.touchpad_down);
 }
 
-void LCDWidget::showEvent(QShowEvent *e)
-{
-    QWidget::showEvent(e);
-
-    refresh_timer.start();
-}
-
-void LCDWidget::hideEvent(QHideEvent *e)
-{
-    QWidget::hideEvent(e);
-
-    refresh_timer.stop();
-}
-
 void LCDWidget::closeEvent(QCloseEvent *e)
 {
     QWidget::closeEvent(e);
@@ -3,7 +3,6 @@
 
 #include <QGraphicsView>
 #include <QKeyEvent>
-#include <QTimer>
 
 class LCDWidget : public QWidget
 {
@@ -16,8 +15,6 @@ public slots:
     void mousePressEvent(QMouseEvent *event) override;
     void mouseReleaseEvent(QMouseEvent *event) override;
     void mouseMoveEvent(QMouseEvent *event) override;
-    void showEvent(QShowEvent *e) override;
-    void hideEvent(QHideEvent *e) override;
     void closeEvent(QCloseEvent *e) override;
 
 protected:
@@ -25,9 +22,6 @@ protected:
 
 signals:
     void closed();
-
-private:
-    QTimer refresh_timer;
 };
 
 #endif // LCDWIDGET_H
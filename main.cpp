@@ -1,4 +1,5 @@
 #include <QApplication>
+#include <QCommandLineParser>
 #include <QTranslator>
 
 #include "mainwindow.h"
@@ -6,6 +7,7 @@
 
 #include "qtframebuffer.h"
 #include "qmlbridge.h"
+#include "core/lcd.h"
 
 int main(int argc, char **argv)
 {
@@ -30,13 +32,23 @@ int main(int argc, char **argv)
     QCoreApplication::setOrganizationName(QStringLiteral("ndless"));
     QCoreApplication::setApplicationName(QStringLiteral("firebird"));
 
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption kit_option(QStringLiteral("kit"), QCoreApplication::translate("main", "Start the kit with the ID <id>."), QStringLiteral("id"));
+    parser.addOption(kit_option);
+    parser.process(app);
+
     // Register QMLBridge for Keypad<->Emu communication
     qmlRegisterSingletonType<QMLBridge>("Firebird.Emu", 1, 0, "Emu", qmlBridgeFactory);
     // Register QtFramebuffer for QML display
     qmlRegisterType<QMLFramebuffer>("Firebird.Emu", 1, 0, "EmuScreen");
+    // Both UIs show the frames drawn by the emulation
+    lcd_draw_frames = true;
 
     #ifndef MOBILE_UI
-        MainWindow mw;
+        bool kit_valid;
+        int kit_id = parser.value(kit_option).toInt(&kit_valid);
+        MainWindow mw(nullptr, kit_valid ? kit_id : -1);
         main_window = &mw;
     #else
         QQmlApplicationEngine engine;
@@ -7,15 +7,19 @@
 #include <QGraphicsItem>
 #include <QDropEvent>
 #include <QMimeData>
+#include <QProcess>
 #include <QDockWidget>
 #include <QShortcut>
+#include <QToolTip>
 #include <QQmlComponent>
 
 #include "core/debug.h"
 #include "core/emu.h"
 #include "core/flash.h"
 #include "core/gif.h"
+#include "core/input_script.h"
 #include "core/misc.h"
+#include "core/rewind.h"
 #include "core/usblink_queue.h"
 
 #include "dockwidget.h"
@@ -29,7 +33,7 @@ MainWindow *main_window;
 // Change this if you change the UI
 static const constexpr int WindowStateVersion = 0;
 
-MainWindow::MainWindow(QWidget *parent) :
+MainWindow::MainWindow(QWidget *parent, int kit_id) :
     QMainWindow(parent),
     ui(new Ui::MainWindow)
 {
@@ -58,7 +62,7 @@ MainWindow::MainWindow(QWidget *parent) :
         throw std::runtime_error("Can't continue without QMLBridge");
 
     //Emu -> GUI (QueuedConnection as they're different threads)
-    connect(&emu_thread, SIGNAL(serialChar(char)), this, SLOT(serialChar(char)), Qt::QueuedConnection);
+    connect(&emu_thread, SIGNAL(serialStr(QByteArray)), this, SLOT(serialStr(QByteArray)), Qt::QueuedConnection);
     connect(&emu_thread, SIGNAL(debugStr(QString)), this, SLOT(debugStr(QString))); //Not queued connection as it may cause a hang
     connect(&emu_thread, SIGNAL(isBusy(bool)), this, SLOT(isBusy(bool)), Qt::QueuedConnection);
     connect(&emu_thread, SIGNAL(statusMsg(QString)), this, SLOT(showStatusMsg(QString)), Qt::QueuedConnection);
@@ -78,6 +82,8 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->actionPause, SIGNAL(toggled(bool)), &emu_thread, SLOT(setPaused(bool)));
     connect(ui->actionPause, SIGNAL(toggled(bool)), ui->buttonPause, SLOT(setChecked(bool)));
     connect(ui->buttonSpeed, SIGNAL(clicked(bool)), &emu_thread, SLOT(setTurboMode(bool)));
+    connect(ui->sliderRewind, SIGNAL(sliderMoved(int)), this, SLOT(rewindSliderMoved(int)));
+    connect(ui->sliderRewind, SIGNAL(sliderReleased()), this, SLOT(rewindSliderReleased()));
 
     QShortcut *shortcut = new QShortcut(QKeySequence(Qt::Key_F11), this);
     shortcut->setAutoRepeat(false);
@@ -87,6 +93,7 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->buttonScreenshot, SIGNAL(clicked()), this, SLOT(screenshot()));
     connect(ui->actionScreenshot, SIGNAL(triggered()), this, SLOT(screenshot()));
     connect(ui->actionRecord_GIF, SIGNAL(triggered()), this, SLOT(recordGIF()));
+    connect(ui->actionRecord_input, SIGNAL(triggered()), this, SLOT(recordInput()));
     connect(ui->actionConnect, SIGNAL(triggered()), this, SLOT(connectUSB()));
     connect(ui->buttonUSB, SIGNAL(clicked(bool)), this, SLOT(connectUSB()));
     connect(ui->actionLCD_Window, SIGNAL(triggered(bool)), this, SLOT(setExtLCD(bool)));
@@ -156,7 +163,7 @@ MainWindow::MainWindow(QWidget *parent) :
     ui->lcdView->setFocus();
 
     // Select default Kit
-    bool defaultKitFound = the_qml_bridge->useDefaultKit();
+    bool defaultKitFound = kit_id >= 0 ? the_qml_bridge->setCurrentKit(kit_id) : the_qml_bridge->useDefaultKit();
 
     if(the_qml_bridge->getKitModel()->allKitsEmpty())
     {
@@ -178,7 +185,7 @@ MainWindow::MainWindow(QWidget *parent) :
         show();
     }
 
-    if(!the_qml_bridge->getAutostart())
+    if(!the_qml_bridge->getAutostart() && kit_id < 0)
     {
         showStatusMsg(tr("Start the emulation via Emulation->Start."));
         return;
@@ -250,6 +257,12 @@ void MainWindow::dragEnterEvent(QDragEnterEvent *e)
     e->accept();
 }
 
+void MainWindow::serialStr(QByteArray str)
+{
+    for(char c : str)
+        serialChar(c);
+}
+
 void MainWindow::serialChar(const char c)
 {
     ui->serialConsole->moveCursor(QTextCursor::End);
@@ -361,6 +374,7 @@ void MainWindow::setActive(bool b)
     {
         connect(&emu_thread, SIGNAL(speedChanged(double)), this, SLOT(showSpeed(double)), Qt::QueuedConnection);
         connect(&emu_thread, SIGNAL(turboModeChanged(bool)), ui->buttonSpeed, SLOT(setChecked(bool)), Qt::QueuedConnection);
+        connect(&emu_thread, SIGNAL(rewindCountChanged(int)), this, SLOT(rewindCountChanged(int)), Qt::QueuedConnection);
         connect(&emu_thread, SIGNAL(usblinkChanged(bool)), this, SLOT(usblinkChanged(bool)), Qt::QueuedConnection);
         connect(&emu_thread, SIGNAL(started(bool)), this, SLOT(started(bool)), Qt::QueuedConnection);
         connect(&emu_thread, SIGNAL(paused(bool)), ui->actionPause, SLOT(setChecked(bool)), Qt::QueuedConnection);
@@ -372,11 +386,13 @@ void MainWindow::setActive(bool b)
         updateUIActionState(emu_thread.isRunning());
         ui->buttonSpeed->setChecked(turbo_mode);
         usblinkChanged(usblink_connected);
+        rewindCountChanged(rewind_count());
     }
     else
     {
         disconnect(&emu_thread, SIGNAL(speedChanged(double)), this, SLOT(showSpeed(double)));
         disconnect(&emu_thread, SIGNAL(turboModeChanged(bool)), ui->buttonSpeed, SLOT(setChecked(bool)));
+        disconnect(&emu_thread, SIGNAL(rewindCountChanged(int)), this, SLOT(rewindCountChanged(int)));
         disconnect(&emu_thread, SIGNAL(usblinkChanged(bool)), this, SLOT(usblinkChanged(bool)));
         disconnect(&emu_thread, SIGNAL(started(bool)), this, SLOT(started(bool)));
         disconnect(&emu_thread, SIGNAL(paused(bool)), ui->actionPause, SLOT(setChecked(bool)));
@@ -417,6 +433,7 @@ void MainWindow::updateUIActionState(bool emulation_running)
 
     ui->actionScreenshot->setEnabled(emulation_running);
     ui->actionRecord_GIF->setEnabled(emulation_running);
+    ui->actionRecord_input->setEnabled(emulation_running);
     ui->actionConnect->setEnabled(emulation_running);
     ui->actionDebugger->setEnabled(emulation_running);
     ui->actionXModem->setEnabled(emulation_running);
@@ -426,6 +443,7 @@ void MainWindow::updateUIActionState(bool emulation_running)
     ui->actionSave->setEnabled(emulation_running);
 
     ui->buttonSpeed->setEnabled(emulation_running);
+    ui->sliderRewind->setEnabled(emulation_running && ui->sliderRewind->minimum() < 0);
 }
 
 void MainWindow::raiseDebugger()
@@ -488,11 +506,64 @@ void MainWindow::convertTabsToDocks()
 void MainWindow::showSpeed(double value)
 {
     ui->buttonSpeed->setText(tr("Speed: %1 %").arg(value * 100, 1, 'f', 0));
+
+    // emu_metrics got updated right before
+    const struct emu_metrics m = emu_metrics;
+    QString cpu = m.host_cpu_percent < 0 ? tr("unknown") : tr("%1 %").arg(m.host_cpu_percent, 0, 'f', 0);
+    QString text = tr("Speed: %1 %\n"
+                      "Guest MIPS: %2\n"
+                      "Translated code: %3 %\n"
+                      "Translations/s: %4\n"
+                      "Address cache flushes/s: %5\n"
+                      "Address cache misses/s: %6\n"
+                      "MMIO accesses/s: %7\n"
+                      "Host CPU of the emulation thread: %8\n"
+                      "Frames/s: %9")
+                   .arg(m.speed * 100, 0, 'f', 0)
+                   .arg(m.mips, 0, 'f', 1)
+                   .arg(m.jit_percent, 0, 'f', 1)
+                   .arg(m.translations, 0, 'f', 0)
+                   .arg(m.flushes, 0, 'f', 0)
+                   .arg(m.addr_cache_misses, 0, 'f', 0)
+                   .arg(m.mmio_accesses, 0, 'f', 0)
+                   .arg(cpu)
+                   .arg(m.fps, 0, 'f', 1);
+#ifdef Q_OS_WIN
+    // Only there addr_cache is sparse
+    text += tr("\nAddress cache page faults/s: %1").arg(m.addr_cache_pagefaults, 0, 'f', 0);
+#endif
+    ui->labelPerformance->setText(text);
+}
+
+void MainWindow::rewindCountChanged(int count)
+{
+    ui->sliderRewind->setMinimum(-count);
+    ui->sliderRewind->setEnabled(count > 0 && emu_thread.isRunning());
+    if(!ui->sliderRewind->isSliderDown())
+        ui->sliderRewind->setValue(0);
+}
+
+void MainWindow::rewindSliderMoved(int value)
+{
+    QString text = value < 0 ? tr("Rewind %1 s").arg(-value * rewind_interval, 0, 'f', 1) : tr("Rewind");
+    ui->sliderRewind->setToolTip(text);
+    QToolTip::showText(QCursor::pos(), text, ui->sliderRewind);
+}
+
+void MainWindow::rewindSliderReleased()
+{
+    int value = ui->sliderRewind->value();
+    if(value < 0)
+        emu_thread.rewind(-value - 1);
+
+    ui->sliderRewind->setValue(0);
+    ui->sliderRewind->setToolTip(tr("Rewind"));
 }
 
 void MainWindow::screenshot()
 {
-    QImage image = renderFramebuffer();
+    // The frame is only borrowed from the emulation
+    QImage image = renderFramebuffer().copy();
 
     QString filename = QFileDialog::getSaveFileName(this, tr("Save Screenshot"), QString(), tr("PNG images (*.png)"));
     if(filename.isEmpty())
@@ -535,6 +606,23 @@ void MainWindow::recordGIF()
     ui->actionRecord_GIF->setChecked(!path.isEmpty());
 }
 
+void MainWindow::recordInput()
+{
+    if(input_record_active())
+    {
+        if(!input_record_stop())
+            QMessageBox::warning(this, tr("Failed recording input"), tr("A failure occured during recording"));
+    }
+    else
+    {
+        QString filename = QFileDialog::getSaveFileName(this, tr("Record Input"), QString(), tr("Input scripts (*.txt)"));
+        if(!filename.isEmpty() && !input_record_start(filename.toStdString().c_str()))
+            QMessageBox::critical(this, tr("Failed recording input"), tr("Could not open %1.").arg(filename));
+    }
+
+    ui->actionRecord_input->setChecked(input_record_active());
+}
+
 void MainWindow::connectUSB()
 {
     if(usblink_connected)
@@ -635,6 +723,7 @@ void MainWindow::isBusy(bool busy)
 void MainWindow::started(bool success)
 {
     updateUIActionState(success);
+    updateEmuPriority();
 
     if(success)
         showStatusMsg(tr("Emulation started"));
@@ -645,6 +734,7 @@ void MainWindow::started(bool success)
 void MainWindow::resumed(bool success)
 {
     updateUIActionState(success);
+    updateEmuPriority();
 
     if(success)
         showStatusMsg(tr("Emulation resumed from snapshot"));
@@ -693,6 +783,21 @@ void MainWindow::closeEvent(QCloseEvent *e)
     qApp->exit(0);
 }
 
+void MainWindow::changeEvent(QEvent *event)
+{
+    if(event->type() == QEvent::ActivationChange)
+        updateEmuPriority();
+
+    QMainWindow::changeEvent(event);
+}
+
+void MainWindow::updateEmuPriority()
+{
+    // Other instances, e.g. from startKitInNewWindow, run in the background
+    if(emu_thread.isRunning())
+        emu_thread.setPriority(isActiveWindow() ? QThread::NormalPriority : QThread::LowPriority);
+}
+
 void MainWindow::showStatusMsg(QString str)
 {
     status_label.setText(str);
@@ -729,6 +834,7 @@ void MainWindow::refillKitMenus()
 {
     ui->menuRestart_with_Kit->clear();
     ui->menuBoot_Diags_with_Kit->clear();
+    ui->menuStart_Kit_in_New_Window->clear();
 
     auto &&kit_model = the_qml_bridge->getKitModel();
     for(auto &&kit : kit_model->getKits())
@@ -740,6 +846,10 @@ void MainWindow::refillKitMenus()
         action = ui->menuBoot_Diags_with_Kit->addAction(kit.name);
         action->setData(kit.id);
         connect(action, SIGNAL(triggered()), this, SLOT(startKitDiags()));
+
+        action = ui->menuStart_Kit_in_New_Window->addAction(kit.name);
+        action->setData(kit.id);
+        connect(action, SIGNAL(triggered()), this, SLOT(startKitInNewWindow()));
     }
 }
 
@@ -817,6 +927,22 @@ void MainWindow::startKitDiags()
     restart();
 }
 
+void MainWindow::startKitInNewWindow()
+{
+    auto action = qobject_cast<QAction*>(sender());
+    if(!action)
+    {
+        qWarning() << "Received signal from invalid sender";
+        return;
+    }
+
+    /* The emulation core only exists once per process, so each kit gets its own.
+       Not much of the memory reserved by it is actually used. */
+    auto kit_id = action->data().toInt();
+    if(!QProcess::startDetached(QCoreApplication::applicationFilePath(), {QStringLiteral("--kit"), QString::number(kit_id)}))
+        QMessageBox::warning(this, tr("Could not start the kit"), tr("Starting another instance of Firebird failed."));
+}
+
 void MainWindow::xmodemSend()
 {
     QString filename = QFileDialog::getOpenFileName(this, tr("Select file to send"));
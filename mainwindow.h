@@ -41,9 +41,13 @@ class MainWindow : public QMainWindow
     Q_OBJECT
 
 public:
-    explicit MainWindow(QWidget *parent = 0);
+    // kit_id: the kit to start right away instead of the default one, see --kit
+    explicit MainWindow(QWidget *parent = 0, int kit_id = -1);
     ~MainWindow();
 
+protected:
+    void changeEvent(QEvent *event) override;
+
 public slots:
     //Miscellaneous
     void closeEvent(QCloseEvent *) override;
@@ -61,10 +65,12 @@ public slots:
     void openConfiguration();
     void startKit();
     void startKitDiags();
+    void startKitInNewWindow();
 
     //Menu "Tools"
     void screenshot();
     void recordGIF();
+    void recordInput();
     void connectUSB();
     void usblinkChanged(bool state);
     void setExtLCD(bool state);
@@ -95,7 +101,7 @@ public slots:
     void stopped();
 
     //Serial
-    void serialChar(const char c);
+    void serialStr(QByteArray str);
 
     //Debugging
     void debugInputRequested(bool b);
@@ -109,6 +115,9 @@ public slots:
 
     //Tool bar (above screen)
     void showSpeed(double value);
+    void rewindCountChanged(int count);
+    void rewindSliderMoved(int value);
+    void rewindSliderReleased();
 
 signals:
     void debuggerCommand(QString input);
@@ -120,6 +129,9 @@ public:
 
 private:
     void setActive(bool b);
+    void serialChar(const char c);
+    // Lets the emulation in the focused window get the host CPU first
+    void updateEmuPriority();
 
     void suspendToPath(QString path);
     bool resumeFromPath(QString path);
@@ -87,6 +87,69 @@ ColumnLayout {
         }
     }
 
+    FBLabel {
+        text: qsTr("Rewind")
+        font.pixelSize: TextMetrics.title2Size
+        Layout.topMargin: 10
+        Layout.bottomMargin: 5
+    }
+
+    FBLabel {
+        Layout.maximumWidth: parent.width
+        wrapMode: Text.WordWrap
+        text: qsTr("Keep checkpoints of the emulation in memory to go back to, with the slider above the screen or the \"rw\" debugger command. An interval of 0 disables this.")
+        font.pixelSize: TextMetrics.normalSize
+    }
+
+    RowLayout {
+        width: parent.width
+        Layout.fillWidth: true
+
+        FBLabel {
+            text: qsTr("Every")
+            font.pixelSize: TextMetrics.normalSize
+        }
+
+        SpinBox {
+            Layout.maximumWidth: TextMetrics.normalSize * 8
+
+            decimals: 1
+            stepSize: 0.5
+            minimumValue: 0
+            maximumValue: 60
+            suffix: qsTr(" s")
+
+            value: Emu.rewindInterval
+            onValueChanged: {
+                Emu.rewindInterval = value;
+                value = Qt.binding(function() { return Emu.rewindInterval; });
+            }
+        }
+
+        FBLabel {
+            text: qsTr("keep up to")
+            font.pixelSize: TextMetrics.normalSize
+        }
+
+        SpinBox {
+            Layout.maximumWidth: TextMetrics.normalSize * 8
+
+            minimumValue: 1
+            maximumValue: 1000
+
+            value: Emu.rewindCapacity
+            onValueChanged: {
+                Emu.rewindCapacity = value;
+                value = Qt.binding(function() { return Emu.rewindCapacity; });
+            }
+        }
+
+        FBLabel {
+            text: qsTr("checkpoints")
+            font.pixelSize: TextMetrics.normalSize
+        }
+    }
+
     FBLabel {
         text: qsTr("UI Preferences")
         font.pixelSize: TextMetrics.title2Size
@@ -121,6 +121,19 @@ ColumnLayout {
                     filePath = Qt.binding(function() { return kitList.currentItem.myData.snapshot; });
                 }
             }
+
+            LabeledCheckBox {
+                id: bootCacheCheck
+                Layout.columnSpan: parent.columns
+                Layout.fillWidth: true
+                text: qsTr("Start from a snapshot taken once the OS booted (redone if Boot1 or Flash change)")
+                checked: kitList.currentItem.myData.bootCache;
+                onCheckedChanged: {
+                    if(checked !== kitList.currentItem.myData.bootCache)
+                        kitModel.setDataRow(kitList.currentIndex, checked, KitModel.BootCacheRole);
+                    checked = Qt.binding(function() { return kitList.currentItem.myData.bootCache; });
+                }
+            }
         }
     }
 }
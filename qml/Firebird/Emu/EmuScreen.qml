@@ -1,5 +1,9 @@
 import QtQuick 2.0
 
 Rectangle {
+    property bool lcdOff: false
+    property bool colorLCD: true
+    property bool inDebugger: false
+
     color: "white"
 }
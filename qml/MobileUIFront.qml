@@ -50,11 +50,28 @@ Item {
 
             focus: true
 
-            Timer {
-                interval: 35
-                running: true
-                repeat: true
-                onTriggered: screen.update()
+            Rectangle {
+                anchors.fill: parent
+                visible: screen.lcdOff
+                color: screen.colorLCD ? "black" : "white"
+
+                Text {
+                    anchors.centerIn: parent
+                    color: screen.colorLCD ? "white" : "black"
+                    text: qsTr("LCD turned off")
+                }
+            }
+
+            Rectangle {
+                anchors.fill: parent
+                visible: screen.inDebugger
+                color: Qt.rgba(30 / 255, 30 / 255, 30 / 255, 150 / 255)
+
+                Text {
+                    anchors.centerIn: parent
+                    color: "white"
+                    text: qsTr("In debugger")
+                }
             }
         }
 
@@ -11,6 +11,8 @@
 
 #include "core/emu.h"
 #include "core/keypad.h"
+#include "core/rewind.h"
+#include "core/translate.h"
 #include "core/usblink_queue.h"
 
 QMLBridge *the_qml_bridge = nullptr;
@@ -60,6 +62,8 @@ QMLBridge::QMLBridge(QObject *parent) : QObject(parent)
     // Same for debug_on_*
     debug_on_start = getDebugOnStart();
     debug_on_warn = getDebugOnWarn();
+    rewind_interval = getRewindInterval();
+    rewind_capacity = getRewindCapacity();
 
     connect(&kit_model, SIGNAL(anythingChanged()), this, SLOT(saveKits()), Qt::QueuedConnection);
 
@@ -211,6 +215,36 @@ void QMLBridge::setSuspendOnClose(bool e)
     emit suspendOnCloseChanged();
 }
 
+double QMLBridge::getRewindInterval()
+{
+    return settings.value(QStringLiteral("rewindInterval"), isMobile() ? 0.0 : 0.5).toDouble();
+}
+
+void QMLBridge::setRewindInterval(double seconds)
+{
+    if(getRewindInterval() == seconds)
+        return;
+
+    rewind_interval = seconds;
+    settings.setValue(QStringLiteral("rewindInterval"), seconds);
+    emit rewindIntervalChanged();
+}
+
+unsigned int QMLBridge::getRewindCapacity()
+{
+    return settings.value(QStringLiteral("rewindCapacity"), 120).toUInt();
+}
+
+void QMLBridge::setRewindCapacity(unsigned int count)
+{
+    if(getRewindCapacity() == count)
+        return;
+
+    rewind_capacity = count;
+    settings.setValue(QStringLiteral("rewindCapacity"), count);
+    emit rewindCapacityChanged();
+}
+
 QString QMLBridge::getUSBDir()
 {
     return settings.value(QStringLiteral("usbdirNew"), QStringLiteral("/ndless")).toString();
@@ -494,6 +528,7 @@ bool QMLBridge::setCurrentKit(unsigned int id)
     emu_thread.boot1 = kit.boot1;
     emu_thread.flash = kit.flash;
     fallback_snapshot_path = kit.snapshot;
+    emu_thread.boot_cache = kit.boot_cache ? QStringLiteral("kit%1").arg(kit.id) : QString();
 
     emit currentKitChanged(kit);
 
@@ -588,6 +623,39 @@ double QMLBridge::getSpeed()
     return speed;
 }
 
+QVariantMap QMLBridge::getJITStats()
+{
+    // Read while the emulation is running, the values might be slightly off
+    const struct translate_stats s = translate_stats;
+    return {
+        {QStringLiteral("translations"), double(s.translations)},
+        {QStringLiteral("dropped"), double(s.dropped)},
+        {QStringLiteral("codeBytes"), double(s.code_bytes)},
+        {QStringLiteral("fallbacks"), double(s.fallbacks)},
+        {QStringLiteral("noTranslate"), double(s.no_translate)},
+        {QStringLiteral("fixPC"), double(s.fix_pc)},
+        {QStringLiteral("jitInstructions"), double(s.jit_instructions)},
+        {QStringLiteral("interpretedInstructions"), double(s.interpreted_instructions)},
+    };
+}
+
+QVariantMap QMLBridge::getPerfStats()
+{
+    const struct emu_metrics m = emu_metrics;
+    return {
+        {QStringLiteral("speed"), m.speed},
+        {QStringLiteral("mips"), m.mips},
+        {QStringLiteral("jitPercent"), m.jit_percent},
+        {QStringLiteral("translations"), m.translations},
+        {QStringLiteral("flushes"), m.flushes},
+        {QStringLiteral("addrCacheMisses"), m.addr_cache_misses},
+        {QStringLiteral("addrCachePageFaults"), m.addr_cache_pagefaults},
+        {QStringLiteral("mmioAccesses"), m.mmio_accesses},
+        {QStringLiteral("hostCPUPercent"), m.host_cpu_percent},
+        {QStringLiteral("fps"), m.fps},
+    };
+}
+
 bool QMLBridge::getTurboMode()
 {
     return turbo_mode;
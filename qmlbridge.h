@@ -24,12 +24,17 @@ public:
     Q_PROPERTY(unsigned int defaultKit READ getDefaultKit WRITE setDefaultKit NOTIFY defaultKitChanged)
     Q_PROPERTY(bool leftHanded READ getLeftHanded WRITE setLeftHanded NOTIFY leftHandedChanged)
     Q_PROPERTY(bool suspendOnClose READ getSuspendOnClose WRITE setSuspendOnClose NOTIFY suspendOnCloseChanged)
+    Q_PROPERTY(double rewindInterval READ getRewindInterval WRITE setRewindInterval NOTIFY rewindIntervalChanged)
+    Q_PROPERTY(unsigned int rewindCapacity READ getRewindCapacity WRITE setRewindCapacity NOTIFY rewindCapacityChanged)
     Q_PROPERTY(QString usbdir READ getUSBDir WRITE setUSBDir NOTIFY usbDirChanged)
     Q_PROPERTY(QString version READ getVersion CONSTANT)
     Q_PROPERTY(bool isRunning READ getIsRunning NOTIFY isRunningChanged)
     Q_PROPERTY(KitModel* kits READ getKitModel CONSTANT)
 
     Q_PROPERTY(double speed READ getSpeed NOTIFY speedChanged)
+    // Updated together with the speed
+    Q_PROPERTY(QVariantMap jitStats READ getJITStats NOTIFY speedChanged)
+    Q_PROPERTY(QVariantMap perfStats READ getPerfStats NOTIFY speedChanged)
     Q_PROPERTY(bool turboMode READ getTurboMode WRITE setTurboMode NOTIFY turboModeChanged)
 
     Q_PROPERTY(int mobileX READ getMobileX WRITE setMobileX NOTIFY neverEmitted)
@@ -57,12 +62,19 @@ public:
     void setLeftHanded(bool e);
     bool getSuspendOnClose();
     void setSuspendOnClose(bool e);
+    double getRewindInterval();
+    void setRewindInterval(double seconds);
+    unsigned int getRewindCapacity();
+    void setRewindCapacity(unsigned int count);
     QString getUSBDir();
     void setUSBDir(QString dir);
     bool getIsRunning();
     QString getVersion();
 
     double getSpeed();
+    QVariantMap getJITStats();
+    // Rates of the last half second, see emu_metrics
+    QVariantMap getPerfStats();
     bool getTurboMode();
     void setTurboMode(bool e);
 
@@ -140,6 +152,8 @@ signals:
     void defaultKitChanged();
     void leftHandedChanged();
     void suspendOnCloseChanged();
+    void rewindIntervalChanged();
+    void rewindCapacityChanged();
     void usbDirChanged();
     void isRunningChanged();
     void speedChanged();
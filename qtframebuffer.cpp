@@ -1,43 +1,27 @@
 #include "qtframebuffer.h"
 
-#include <array>
 #include <cassert>
 
 #include <QImage>
 #include <QPainter>
 #include <QGuiApplication>
 #include <QScreen>
+#include <QQuickWindow>
+#include <QSGSimpleTextureNode>
 
 #include "core/debug.h"
 #include "core/emu.h"
 #include "core/lcd.h"
 #include "core/misc.h"
 
+#include "emuthread.h"
 #include "qtkeypadbridge.h"
 
 QImage renderFramebuffer()
 {
-    static std::array<uint16_t, 320 * 240> framebuffer;
-
-    lcd_cx_draw_frame(framebuffer.data());
-    QImage::Format format = QImage::Format_RGB16;
-
-    if(!emulate_cx)
-    {
-        format = QImage::Format_RGB444;
-        uint16_t *px = framebuffer.data();
-        for(unsigned int i = 0; i < 320*240; ++i)
-        {
-            uint8_t pix = *px & 0xF;
-            uint16_t n = pix << 8 | pix << 4 | pix;
-            *px = ~n;
-            ++px;
-        }
-    }
-
-    QImage image(reinterpret_cast<const uchar*>(framebuffer.data()), 320, 240, 320 * 2, format);
-
-    return image;
+    // Refers to the latest frame of the emulation, no copy
+    const uint16_t *frame = lcd_frame_acquire();
+    return QImage(reinterpret_cast<const uchar*>(frame), 320, 240, 320 * 2, QImage::Format_RGB16);
 }
 
 void paintFramebuffer(QPainter *p)
@@ -61,9 +45,11 @@ void paintFramebuffer(QPainter *p)
     }
     else
     {
-        QImage image = renderFramebuffer().scaled(p->window().size(), Qt::KeepAspectRatio, Qt::SmoothTransformation);
-        image.setDevicePixelRatio(devicePixelRatio);
-        p->drawImage((p->window().width() - image.width()) / 2, (p->window().height() - image.height()) / 2, image);
+        // Scaled while drawing, instead of into another image first
+        QSize size = QSize(320, 240).scaled(p->window().size(), Qt::KeepAspectRatio);
+        QRect target(QPoint((p->window().width() - size.width()) / 2, (p->window().height() - size.height()) / 2), size / devicePixelRatio);
+        p->setRenderHint(QPainter::SmoothPixmapTransform);
+        p->drawImage(target, renderFramebuffer());
     }
 
     if(in_debugger)
@@ -76,12 +62,67 @@ void paintFramebuffer(QPainter *p)
 }
 
 QMLFramebuffer::QMLFramebuffer(QQuickItem *parent)
- : QQuickPaintedItem(parent)
+ : QQuickItem(parent)
 {
+    setFlag(ItemHasContents);
+    lcd_off = hdq1w.lcd_contrast == 0;
+    color_lcd = emulate_cx;
+    in_debugger_state = in_debugger;
     installEventFilter(&qt_keypad_bridge);
+
+    // Only updated if there's something new to show
+    connect(&emu_thread, SIGNAL(lcdChanged()), this, SLOT(frameChanged()), Qt::QueuedConnection);
+    connect(&emu_thread, SIGNAL(debuggerEntered(bool)), this, SLOT(debuggerEntered(bool)), Qt::QueuedConnection);
+    connect(this, SIGNAL(widthChanged()), this, SLOT(update()));
+    connect(this, SIGNAL(heightChanged()), this, SLOT(update()));
+    connect(this, SIGNAL(smoothChanged(bool)), this, SLOT(update()));
+}
+
+void QMLFramebuffer::frameChanged()
+{
+    bool off = hdq1w.lcd_contrast == 0;
+    if(off != lcd_off || emulate_cx != color_lcd)
+    {
+        lcd_off = off;
+        color_lcd = emulate_cx;
+        emit lcdOffChanged();
+    }
+
+    frame_dirty = true;
+    update();
+}
+
+void QMLFramebuffer::debuggerEntered(bool entered)
+{
+    if(entered == in_debugger_state)
+        return;
+
+    in_debugger_state = entered;
+    emit inDebuggerChanged();
 }
 
-void QMLFramebuffer::paint(QPainter *p)
+QSGNode *QMLFramebuffer::updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *)
 {
-    paintFramebuffer(p);
+    // Called on the render thread while the GUI thread is blocked
+    auto *node = static_cast<QSGSimpleTextureNode*>(oldNode);
+    if(!node)
+    {
+        node = new QSGSimpleTextureNode();
+        node->setOwnsTexture(true);
+        frame_dirty = true;
+    }
+
+    if(frame_dirty)
+    {
+        /* The image refers to the frame without a copy. It gets uploaded while
+           rendering, before the next frame is acquired here. */
+        node->setTexture(window()->createTextureFromImage(renderFramebuffer(), QQuickWindow::TextureIsOpaque));
+        frame_dirty = false;
+    }
+
+    node->setFiltering(smooth() ? QSGTexture::Linear : QSGTexture::Nearest);
+
+    QSizeF size = QSizeF(320, 240).scaled(QSizeF(width(), height()), Qt::KeepAspectRatio);
+    node->setRect(QRectF(QPointF((width() - size.width()) / 2, (height() - size.height()) / 2), size));
+    return node;
 }
@@ -1,15 +1,44 @@
 #ifndef QMLFRAMEBUFFER_H
 #define QMLFRAMEBUFFER_H
 
-#include <QQuickPaintedItem>
+#include <QQuickItem>
 
-class QMLFramebuffer : public QQuickPaintedItem
+/* Shows the LCD as a texture in the scene graph, so that the GPU scales it.
+   The "LCD turned off" and "In debugger" overlays are up to the QML side,
+   using the properties. */
+class QMLFramebuffer : public QQuickItem
 {
+    Q_OBJECT
+
+    Q_PROPERTY(bool lcdOff READ lcdOff NOTIFY lcdOffChanged)
+    Q_PROPERTY(bool colorLCD READ colorLCD NOTIFY lcdOffChanged)
+    Q_PROPERTY(bool inDebugger READ inDebugger NOTIFY inDebuggerChanged)
+
 public:
     explicit QMLFramebuffer(QQuickItem *parent = 0);
-    virtual void paint(QPainter *p) override;
+
+    bool lcdOff() const { return lcd_off; }
+    bool colorLCD() const { return color_lcd; }
+    bool inDebugger() const { return in_debugger_state; }
+
+signals:
+    void lcdOffChanged();
+    void inDebuggerChanged();
+
+protected:
+    QSGNode *updatePaintNode(QSGNode *oldNode, UpdatePaintNodeData *) override;
+
+private slots:
+    void frameChanged();
+    void debuggerEntered(bool entered);
+
+private:
+    bool lcd_off = false, color_lcd = false, in_debugger_state = false;
+    // Set by frameChanged, so that only new frames get uploaded
+    bool frame_dirty = true;
 };
 
+// The latest frame, only valid until the next call
 QImage renderFramebuffer();
 void paintFramebuffer(QPainter *p);
 
@@ -102,9 +102,10 @@ void USBLinkTreeWidget::customContextMenuRequested(QPoint pos)
             action_delete->setDisabled(true);
         }
     }
-    else
+
+    if(context_menu_item != nullptr)
     {
-        // Is not a directory
+        // Directories get downloaded with everything in them
         QAction *action_download = new QAction(tr("Download"), menu);
         connect(action_download, SIGNAL(triggered()), this, SLOT(downloadEntry()));
         menu->addAction(action_download);
@@ -148,30 +149,43 @@ void USBLinkTreeWidget::dragEnterEvent(QDragEnterEvent *e)
 {
     // Somehow caching this QList is necessary. Without this, the values vanished in the middle of the if() condition...
     QList<QUrl> urls = e->mimeData()->urls();
-    if(urls.size() != 1)
+    if(urls.isEmpty())
         return e->ignore();
 
     static const QStringList valid_suffixes = { QStringLiteral("tns"), QStringLiteral("tno"),
                                           QStringLiteral("tnc"), QStringLiteral("tco"),
                                           QStringLiteral("tcc") };
 
-    QFileInfo file(urls[0].fileName());
-    if(valid_suffixes.contains(file.suffix().toLower()))
-        QTreeWidget::dragEnterEvent(e);
-    else
-        e->ignore();
+    // Folders get uploaded with everything in them
+    for(auto &url : urls)
+    {
+        QFileInfo file(url.toLocalFile());
+        if(!file.isDir() && !valid_suffixes.contains(file.suffix().toLower()))
+            return e->ignore();
+    }
+
+    QTreeWidget::dragEnterEvent(e);
 }
 
 bool USBLinkTreeWidget::dropMimeData(QTreeWidgetItem *parent, int index, const QMimeData *data, Qt::DropAction action)
 {
-    if(data->urls().size() != 1)
+    if(data->urls().isEmpty())
         return false;
 
     (void) index;
     (void) action;
 
-    std::string file = QDir::toNativeSeparators(data->urls()[0].toLocalFile()).toStdString();
-    usblink_queue_put_file(file, usblink_path_item(parent).toStdString(), usblink_upload_callback, this);
+    std::string folder = usblink_path_item(parent).toStdString();
+    for(auto &url : data->urls())
+    {
+        QString path = url.toLocalFile();
+        std::string native_path = QDir::toNativeSeparators(path).toStdString();
+        if(QFileInfo(path).isDir())
+            usblink_queue_put_dir(native_path, folder, usblink_upload_callback, this);
+        else
+            usblink_queue_put_file(native_path, folder, usblink_upload_callback, this);
+    }
+
     return true;
 }
 
@@ -282,9 +296,19 @@ void USBLinkTreeWidget::dataChangedHandler(QTreeWidgetItem *item, int column)
 
 void USBLinkTreeWidget::downloadEntry()
 {
-    if(!context_menu_item
-            || context_menu_item->data(0, Qt::UserRole).toBool()) // Is a directory
+    if(!context_menu_item)
+        return;
+
+    if(context_menu_item->data(0, Qt::UserRole).toBool()) // Is a directory
+    {
+        QString parent = QFileDialog::getExistingDirectory(this, tr("Chose save location"));
+        if(!parent.isEmpty())
+        {
+            QString dest = QDir(parent).filePath(context_menu_item->data(2, Qt::UserRole).toString());
+            usblink_queue_download_dir(usblink_path_item(context_menu_item).toStdString(), QDir::toNativeSeparators(dest).toStdString(), usblink_download_callback, this);
+        }
         return;
+    }
 
     QString dest = QFileDialog::getSaveFileName(this, tr("Chose save location"), QString(), tr("TNS file (*.tns)"));
     if(!dest.isEmpty())